@@ -60,6 +60,12 @@ static int s_num_vhost_backends = 0, s_num_default_backends = 0;
 static int s_sig_num = 0;
 static int s_backend_keepalive = 0;
 static FILE *s_log_file = NULL;
+static double s_client_rate = 0; /* Per client download rate, bytes/s */
+static double s_total_rate = 0;  /* Download rate to all clients, bytes/s */
+#ifdef NS_ENABLE_UNIX_SOCKETS
+static const char *s_restart_ctl = NULL; /* Hot restart control socket */
+#endif
+static int s_draining = 0; /* Listeners handed off, waiting for clients */
 #ifdef NS_ENABLE_SSL
 const char *s_ssl_cert = NULL;
 #endif
@@ -287,9 +293,13 @@ static int connect_backend(struct conn_data *conn, struct http_message *hm) {
               bec);
 #endif
   } else {
+    struct ns_connect_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    /* Repeated connections to a backend send the request with the SYN */
+    opts.flags = NSF_TCP_FASTOPEN;
     bec = malloc(sizeof(*conn->be_conn));
     memset(bec, 0, sizeof(*bec));
-    bec->nc = ns_connect(nc->mgr, be->host_port, ev_handler);
+    bec->nc = ns_connect_opt(nc->mgr, be->host_port, ev_handler, opts);
 #ifdef DEBUG
     write_log("conn=%p new conn to %p (%s) bec=%p\n", conn, be, be->host_port,
               bec);
@@ -410,6 +420,9 @@ static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
         conn->client.body_len = -1;
         conn->backend.body_len = -1;
         conn->last_activity = now;
+        if (s_client_rate > 0) {
+          ns_set_bandwidth(nc, NS_BANDWIDTH_SEND, s_client_rate, 0);
+        }
       }
       return;
     } else {
@@ -425,7 +438,7 @@ static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
       assert(conn != NULL);
       assert(conn->be_conn == NULL);
       struct http_message *hm = (struct http_message *) ev_data;
-      conn->client.flags.keep_alive = is_keep_alive(hm);
+      conn->client.flags.keep_alive = !s_draining && is_keep_alive(hm);
 
       if (!connect_backend(conn, hm)) {
         respond_with_error(conn, s_error_500);
@@ -517,9 +530,47 @@ static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
   }
 }
 
+static int is_client(struct ns_connection *nc) {
+  return nc->listener != NULL && nc->handler == ev_handler;
+}
+
+static int num_clients(struct ns_mgr *mgr) {
+  struct ns_connection *nc;
+  int n = 0;
+  for (nc = ns_next(mgr, NULL); nc != NULL; nc = ns_next(mgr, nc)) {
+    n += is_client(nc);
+  }
+  return n;
+}
+
+#ifdef NS_ENABLE_UNIX_SOCKETS
+static void restart_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct ns_connection *c;
+  struct conn_data *conn;
+
+  if (ev != NS_HANDOFF) return;
+  write_log("Handed %d listeners over to a new process, draining %d clients\n",
+            *(int *) ev_data, num_clients(nc->mgr));
+  s_draining = 1;
+
+  /* Idle keep-alive clients would never leave by themselves */
+  for (c = ns_next(nc->mgr, NULL); c != NULL; c = ns_next(nc->mgr, c)) {
+    conn = (struct conn_data *) c->user_data;
+    if (is_client(c) && (conn == NULL || conn->be_conn == NULL) &&
+        c->recv_mbuf.len == 0 && c->send_mbuf.len == 0) {
+      c->flags |= NSF_SEND_AND_CLOSE;
+    }
+  }
+}
+#endif
+
 static void print_usage_and_exit(const char *prog_name) {
   fprintf(stderr,
-          "Usage: %s [-D debug_dump_file] [-p http_port] [-l log] [-k]"
+          "Usage: %s [-D debug_dump_file] [-p http_port] [-l log] [-k] "
+          "[-L client_bytes_per_sec] [-T total_bytes_per_sec] "
+#ifdef NS_ENABLE_UNIX_SOCKETS
+          "[-R restart_ctl_socket] "
+#endif
 #if NS_ENABLE_SSL
           "[-s ssl_cert] "
 #endif
@@ -554,6 +605,14 @@ int main(int argc, char *argv[]) {
         }
       }
       i++;
+    } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+      s_client_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+      s_total_rate = atof(argv[++i]);
+#ifdef NS_ENABLE_UNIX_SOCKETS
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      s_restart_ctl = argv[++i];
+#endif
     } else if (strcmp(argv[i], "-p") == 0) {
       s_http_port = argv[i + 1];
       i++;
@@ -576,6 +635,10 @@ int main(int argc, char *argv[]) {
       be->uri_prefix = argv[i + 1];
       be->host_port = argv[i + 2];
       be->redirect = redirect;
+      if (redirect && strncmp(be->host_port, "unix", 4) == 0) {
+        fprintf(stderr, "Cannot redirect to %s\n", be->host_port);
+        exit(EXIT_FAILURE);
+      }
       be->uri_prefix_replacement = be->uri_prefix;
       if ((r = strchr(be->uri_prefix, '=')) != NULL) {
         *r = '\0';
@@ -598,6 +661,18 @@ int main(int argc, char *argv[]) {
     }
   }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  /* Take the listening socket over from the running instance, if any */
+  if (s_restart_ctl != NULL) {
+    int n = ns_hot_restart_takeover(&mgr, s_restart_ctl);
+    if (n < 0) {
+      fprintf(stderr, "Cannot take over from %s\n", s_restart_ctl);
+    } else if (n > 0) {
+      printf("Took over %d listeners from %s\n", n, s_restart_ctl);
+    }
+  }
+#endif
+
   /* Open listening socket */
   if ((nc = ns_bind(&mgr, s_http_port, ev_handler)) == NULL) {
     fprintf(stderr, "ns_bind(%s) failed\n", s_http_port);
@@ -614,24 +689,39 @@ int main(int argc, char *argv[]) {
   }
 #endif
   ns_set_protocol_http_websocket(nc);
+  if (s_total_rate > 0) {
+    ns_set_bandwidth(nc, NS_BANDWIDTH_SEND, s_total_rate, 0);
+  }
 
   if (s_num_vhost_backends + s_num_default_backends == 0) {
     print_usage_and_exit(argv[0]);
   }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (s_restart_ctl != NULL &&
+      ns_hot_restart_listen(&mgr, s_restart_ctl, restart_handler) == NULL) {
+    fprintf(stderr, "ns_hot_restart_listen(%s) failed\n", s_restart_ctl);
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
   /* Run event loop until signal is received */
   printf("Starting LB on port %s\n", s_http_port);
-  while (s_sig_num == 0) {
+  while (s_sig_num == 0 && !(s_draining && num_clients(&mgr) == 0)) {
     ns_mgr_poll(&mgr, 1000);
   }
 
   /* Cleanup */
   ns_mgr_free(&mgr);
 
-  printf("Exiting on signal %d\n", s_sig_num);
+  if (s_sig_num == 0) {
+    printf("Exiting after handing over to a new process\n");
+  } else {
+    printf("Exiting on signal %d\n", s_sig_num);
+  }
 
   return EXIT_SUCCESS;
 }
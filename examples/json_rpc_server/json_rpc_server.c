@@ -4,44 +4,48 @@
  *
  * To test this server, do
  *   $ curl -d '{"id":1,method:"sum",params:[22,33]}' 127.0.0.1:8000
+ *
+ * Batch requests are supported too:
+ *   $ curl -d '[{"id":1,method:"sum",params:[1]},{"id":2,method:"sum"}]' ...
  */
 
 #include "fossa.h"
 
 static const char *s_http_port = "8000";
 
-static int rpc_sum(char *buf, int len, struct ns_rpc_request *req) {
+static int rpc_sum(struct mbuf *out, struct ns_rpc_request *req,
+                   void *user_data) {
   double sum = 0;
   int i;
 
-  if (req->params[0].type != JSON_TYPE_ARRAY) {
-    return ns_rpc_create_std_error(buf, len, req,
-                                   JSON_RPC_INVALID_PARAMS_ERROR);
+  (void) user_data;
+  if (req->params == NULL || req->params[0].type != JSON_TYPE_ARRAY) {
+    return ns_rpc_append_std_error(out, req, JSON_RPC_INVALID_PARAMS_ERROR);
   }
 
   for (i = 0; i < req->params[0].num_desc; i++) {
     if (req->params[i + 1].type != JSON_TYPE_NUMBER) {
-      return ns_rpc_create_std_error(buf, len, req,
-                                     JSON_RPC_INVALID_PARAMS_ERROR);
+      return ns_rpc_append_std_error(out, req, JSON_RPC_INVALID_PARAMS_ERROR);
     }
     sum += strtod(req->params[i + 1].ptr, NULL);
   }
-  return ns_rpc_create_reply(buf, len, req, "f", sum);
+  return ns_rpc_append_reply(out, req, "f", sum);
 }
 
 static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
   struct http_message *hm = (struct http_message *) ev_data;
-  static const char *methods[] = { "sum", NULL };
-  static ns_rpc_handler_t handlers[] = { rpc_sum, NULL };
-  char buf[100];
+  struct ns_rpc_methods *methods = (struct ns_rpc_methods *) nc->mgr->user_data;
+  struct mbuf reply;
 
   switch (ev) {
     case NS_HTTP_REQUEST:
-      ns_rpc_dispatch(hm->body.p, hm->body.len, buf, sizeof(buf),
-                      methods, handlers);
+      mbuf_init(&reply, 0);
+      ns_rpc_dispatch_mbuf(methods, hm->body.p, hm->body.len, &reply);
       ns_printf(nc, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n"
-                "Content-Type: application/json\r\n\r\n%s",
-                (int) strlen(buf), buf);
+                "Content-Type: application/json\r\n\r\n",
+                (int) reply.len);
+      ns_send(nc, reply.buf, reply.len);
+      mbuf_free(&reply);
       nc->flags |= NSF_SEND_AND_CLOSE;
       break;
     default:
@@ -52,8 +56,12 @@ static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
 int main(void) {
   struct ns_mgr mgr;
   struct ns_connection *nc;
+  struct ns_rpc_methods methods;
+
+  ns_rpc_methods_init(&methods);
+  ns_rpc_add_method(&methods, "sum", rpc_sum, NULL);
 
-  ns_mgr_init(&mgr, NULL);
+  ns_mgr_init(&mgr, &methods);
   nc = ns_bind(&mgr, s_http_port, ev_handler);
   ns_set_protocol_http_websocket(nc);
 
@@ -62,6 +70,7 @@ int main(void) {
     ns_mgr_poll(&mgr, 1000);
   }
   ns_mgr_free(&mgr);
+  ns_rpc_methods_free(&methods);
 
   return 0;
 }
@@ -76,6 +76,31 @@ NS_INTERNAL void ns_forward(struct ns_connection *, struct ns_connection *);
 NS_INTERNAL void ns_add_conn(struct ns_mgr *mgr, struct ns_connection *c);
 NS_INTERNAL void ns_remove_conn(struct ns_connection *c);
 
+#if defined(NS_ENABLE_THREADS) && !defined(NS_DISABLE_SOCKETPAIR) && \
+    !defined(_WIN32)
+#define NS_WORKERS
+
+/* Work for a pool of worker threads, see ns_workers_add() */
+struct ns_job {
+  struct ns_job *next;
+  struct ns_connection *nc;      /* NULL if the connection went away */
+  void (*run)(struct ns_job *);  /* Called in a worker thread */
+  void (*done)(struct ns_job *); /* Called in the event loop, frees the job */
+};
+
+/*
+ * Queue a job. `done` is called when it has run, or with `nc` NULL when the
+ * manager is freed. Return 0 on success, -1 if the pool is NULL.
+ */
+NS_INTERNAL int ns_workers_add(struct ns_workers *, struct ns_job *);
+#endif
+
+#if !defined(NS_DISABLE_DNS) && defined(NS_ENABLE_DNS_SERVER)
+/* Overwrite the DNS header at offset `pos` with the one from `msg`. */
+NS_INTERNAL void ns_dns_update_header(struct mbuf *, size_t,
+                                      struct ns_dns_message *);
+#endif
+
 #ifndef NS_DISABLE_FILESYSTEM
 NS_INTERNAL int find_index_file(char *, size_t, const char *, ns_stat_t *);
 #endif
@@ -1619,10 +1644,103 @@ int json_emit(char *buf, int buf_len, const char *fmt, ...) {
 #include <sys/epoll.h>
 #endif
 
+#if defined(NS_ENABLE_SEND_FILE) && defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#if !defined(_WIN32) && !defined(NS_ESP8266) && !defined(NO_LIBC) && \
+    !defined(NO_BSD_SOCKETS)
+#include <netinet/tcp.h>
+#endif
+
+#if defined(NS_ENABLE_SPLICE) && !defined(SPLICE_F_MOVE)
+/* glibc hides them without _GNU_SOURCE */
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+ssize_t splice(int, void *, int, void *, size_t, unsigned int);
+#endif
+#if defined(NS_ENABLE_SPLICE) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+#ifdef NS_ENABLE_UDP_GSO
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+#ifdef NS_ENABLE_ZEROCOPY
+#ifndef SO_ZEROCOPY
+#include <asm/socket.h> /* glibc hides it without _DEFAULT_SOURCE */
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#define NS_EE_ORIGIN_ZEROCOPY 5       /* SO_EE_ORIGIN_ZEROCOPY */
+#define NS_EE_CODE_ZEROCOPY_COPIED 1 /* SO_EE_CODE_ZEROCOPY_COPIED */
+#endif
+
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(__linux__) && \
+    !defined(SO_PEERCRED)
+#include <asm/socket.h> /* glibc hides it without _DEFAULT_SOURCE */
+#endif
+
+#if defined(NS_ENABLE_SSL) && defined(OPENSSL_VERSION_NUMBER) && \
+    OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define NS_SSL_OPENSSL_1_1 /* Not krypton or an older OpenSSL */
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+static void ns_ssl_client_cache_free(struct ns_ssl_client_cache *);
+#endif
+
+#ifdef NS_WORKERS
+#include <pthread.h>
+static void ns_workers_free(struct ns_workers *);
+#endif
+#if defined(NS_SSL_OPENSSL_1_1) && defined(NS_WORKERS)
+#define NS_SSL_WORKERS
+static void ns_workers_quiesce(struct ns_workers *);
+#endif
+
 #define NS_CTL_MSG_MESSAGE_SIZE 8192
 #define NS_READ_BUFFER_SIZE 1024
+#define NS_SSL_MAX_RECORD_SIZE 16384 /* Max TLS record payload */
+#ifndef NS_SSL_SMALL_RECORD_SIZE
+#define NS_SSL_SMALL_RECORD_SIZE 1400 /* A record per TCP segment */
+#endif
+#ifndef NS_SSL_SMALL_RECORDS_LIMIT
+#define NS_SSL_SMALL_RECORDS_LIMIT (1024 * 1024) /* Then switch to bulk */
+#endif
+#ifndef NS_SSL_IDLE_RESET
+#define NS_SSL_IDLE_RESET 1.0 /* Seconds idle before small records again */
+#endif
+#ifndef NS_TCP_FASTOPEN_QUEUE
+#define NS_TCP_FASTOPEN_QUEUE 256 /* Pending Fast Open connections */
+#endif
+#ifndef NS_RECV_BUDGET
+#define NS_RECV_BUDGET 65536
+#endif
 #define NS_UDP_RECEIVE_BUFFER_SIZE 1500
+#define NS_UDP_GRO_BUFFER_SIZE 65536   /* Largest coalesced datagram */
+#define NS_UDP_GSO_MAX_SEGMENT 1400    /* Datagrams that fit a frame */
+#define NS_UDP_GSO_MAX_SEGMENTS 64     /* Kernel limit before Linux 5.5 */
+#define NS_UDP_GSO_MAX_SIZE 65000      /* Bytes per UDP_SEGMENT send */
+#ifndef NS_HANDOFF_TIMEOUT
+#define NS_HANDOFF_TIMEOUT 5 /* Seconds */
+#endif
+#define NS_HANDOFF_MAX_SOCKETS 64
 #define NS_VPRINTF_BUFFER_SIZE 100
+#ifndef NS_SSL_CLIENT_SESSIONS
+#define NS_SSL_CLIENT_SESSIONS 64 /* Per client context */
+#endif
 #define NS_MAX_HOST_LEN 200
 
 #define NS_COPY_COMMON_CONNECTION_OPTIONS(dst, src) \
@@ -1631,12 +1749,12 @@ int json_emit(char *buf, int buf_len, const char *fmt, ...) {
 /* Which flags can be pre-set by the user at connection creation time. */
 #define _NS_ALLOWED_CONNECT_FLAGS_MASK                              \
   (NSF_USER_1 | NSF_USER_2 | NSF_USER_3 | NSF_USER_4 | NSF_USER_5 | \
-   NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG)
+   NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG | NSF_TCP_FASTOPEN)
 /* Which flags should be modifiable by user's callbacks. */
 #define _NS_CALLBACK_MODIFIABLE_FLAGS_MASK                                     \
   (NSF_USER_1 | NSF_USER_2 | NSF_USER_3 | NSF_USER_4 | NSF_USER_5 |            \
    NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG | NSF_SEND_AND_CLOSE | NSF_DONT_SEND | \
-   NSF_CLOSE_IMMEDIATELY | NSF_IS_WEBSOCKET)
+   NSF_CLOSE_IMMEDIATELY | NSF_IS_WEBSOCKET | NSF_RATE_LIMITED)
 
 #ifndef intptr_t
 #define intptr_t long
@@ -1647,10 +1765,105 @@ struct ctl_msg {
   char message[NS_CTL_MSG_MESSAGE_SIZE];
 };
 
+#define NS_RATE_LIMIT_KEY_SIZE 32
+#define NS_RATE_LIMIT_DEFAULT_CLIENTS 1024
+
+struct ns_rate_limit_bucket {
+  double tokens;                    /* Tokens left at `last` */
+  double last;                      /* Time of the last refill */
+  uint32_t hash;                    /* Hash of the whole key */
+  int next;                         /* Next bucket in the hash chain, or -1 */
+  int lru_prev, lru_next;           /* LRU list linkage, or -1 */
+  size_t key_len;                   /* Length of the whole key */
+  char key[NS_RATE_LIMIT_KEY_SIZE]; /* Key prefix */
+};
+
+struct ns_byte_bucket {
+  double rate;   /* Bytes per second, 0 for no limit */
+  double burst;  /* Bucket size, bytes */
+  double tokens; /* Bytes allowed at `last`, negative if in debt */
+  double last;   /* Time of the last refill */
+};
+
+struct ns_bandwidth {
+  struct ns_byte_bucket dirs[2]; /* NS_BANDWIDTH_SEND, NS_BANDWIDTH_RECV */
+  struct ns_bandwidth *shared;   /* Limits of the listener, if any */
+  int refs;                      /* Connections using these limits */
+};
+
+/* Don't transfer less than that unless the bucket is smaller */
+#define NS_BANDWIDTH_QUANTUM 1024
+
+struct ns_send_file {
+  int fd;
+  int64_t offset; /* Next byte to send */
+  int64_t len;    /* Bytes left to send */
+  int no_sendfile; /* sendfile() failed, read the file instead */
+};
+
+#define NS_SEND_FILE_BUFFER_SIZE 16384
+
+/* Pipe of a spliced connection, holds data received by the peer */
+struct ns_splice {
+  struct ns_connection *peer; /* NULL once the peer is closed */
+  int fds[2];                 /* Read and write ends of the pipe */
+  size_t len;                 /* Bytes in the pipe */
+  size_t size;                /* Pipe capacity */
+  int full;                   /* Don't read the peer before the pipe drains */
+};
+
+#ifndef NS_SPLICE_PIPE_SIZE
+#define NS_SPLICE_PIPE_SIZE 262144
+#endif
+
+/* Output buffer taken over by a zero-copy send, see ns_set_zerocopy() */
+struct ns_zc_buf {
+  char *buf;
+  size_t len;               /* Bytes in the buffer */
+  size_t sent;              /* Bytes sent */
+  uint32_t first_id;        /* Kernel's id of the first zero-copy send */
+  uint32_t num_ids;         /* Number of zero-copy sends */
+  uint32_t pending;         /* Sends not completed yet */
+  struct ns_zc_buf *next;   /* Older buffer */
+};
+
+/* UDP offloads of a socket, see ns_send() */
+struct ns_udp_offload {
+  int gso, gro;            /* Supported by the kernel */
+  union socket_address sa; /* Destination of the queued datagrams */
+  size_t seg_size;         /* Size of the first queued datagram */
+  int num_segs;            /* Number of queued datagrams */
+  struct mbuf queue;       /* Queued datagrams */
+  char *gro_buf;           /* NS_UDP_GRO_BUFFER_SIZE bytes if gro */
+};
+
+struct ns_zerocopy {
+  size_t threshold;       /* Smallest output buffer to send this way */
+  int copied;             /* The kernel copied, use regular sends */
+  uint32_t next_id;       /* Kernel's id of the next zero-copy send */
+  size_t unsent;          /* Bytes not sent yet from `bufs` */
+  struct ns_zc_buf *bufs; /* Newest first */
+};
+
+struct ns_rate_limit {
+  struct ns_rate_limit_opts opts;
+  struct ns_rate_limit_stats stats;
+  struct ns_rate_limit_bucket *buckets; /* opts.max_clients buckets */
+  int *chains;            /* Hash table: first bucket of each chain, or -1 */
+  uint32_t mask;          /* Number of chains - 1 */
+  int lru_head, lru_tail; /* Most and least recently used buckets */
+  int refs;
+};
+
 static void ns_ev_mgr_init(struct ns_mgr *mgr);
 static void ns_ev_mgr_free(struct ns_mgr *mgr);
 static void ns_ev_mgr_add_conn(struct ns_connection *nc);
 static void ns_ev_mgr_remove_conn(struct ns_connection *nc);
+static void ns_bandwidth_free(struct ns_bandwidth *bw);
+static void ns_send_file_free(struct ns_connection *nc);
+static void ns_splice_free(struct ns_connection *nc);
+static void ns_zerocopy_free(struct ns_connection *nc);
+static int ns_zerocopy_pending(const struct ns_connection *nc);
 
 NS_INTERNAL void ns_add_conn(struct ns_mgr *mgr, struct ns_connection *c) {
   c->mgr = mgr;
@@ -1701,9 +1914,139 @@ NS_INTERNAL void ns_call(struct ns_connection *nc, int ev, void *ev_data) {
   DBG(("call done, flags %d", (int) nc->flags));
 }
 
+/* Size of the part of `sa` that bind(), connect() and sendto() look at */
+static socklen_t ns_sa_len(const union socket_address *sa) {
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* Abstract names start with a 0 byte and aren't 0-terminated */
+    const char *path = sa->un.sun_path;
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) +
+                       (path[0] == '\0' ? 1 + strlen(path + 1)
+                                        : strlen(path) + 1));
+  }
+#endif
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) return sizeof(sa->sin6);
+#endif
+  return sizeof(sa->sin);
+}
+
+#ifdef NS_ENABLE_UDP_GSO
+/* Send the queued datagrams as one, the kernel splits them */
+static int ns_udp_send_gso(struct ns_connection *nc) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+  uint16_t seg_size = (uint16_t) uo->seg_size;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = uo->queue.buf;
+  iov.iov_len = uo->queue.len;
+  msg.msg_name = &uo->sa.sa;
+  msg.msg_namelen = ns_sa_len(&uo->sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = IPPROTO_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(seg_size));
+  memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+
+  return (int) sendmsg(nc->sock, &msg, 0);
+}
+
+static void ns_udp_flush(struct ns_connection *nc) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+  size_t off, len;
+  int n = -1;
+
+  if (uo == NULL || uo->num_segs == 0) return;
+  if (uo->num_segs > 1) {
+    n = ns_udp_send_gso(nc);
+    DBG(("%p %d datagrams, %d bytes -> %d (GSO %d)", nc, uo->num_segs,
+         (int) uo->queue.len, nc->sock, n));
+    if (n < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+      n = 0; /* Dropped, as they would be one by one */
+    } else if (n < 0 && errno != EINVAL) {
+      uo->gso = 0; /* E.g. no checksum offload on the route */
+    }
+  }
+  if (n < 0) {
+    /* One by one, e.g. datagrams don't fit the MTU, or a single one */
+    for (off = 0; off < uo->queue.len; off += len) {
+      len = uo->queue.len - off < uo->seg_size ? uo->queue.len - off
+                                               : uo->seg_size;
+      (void) sendto(nc->sock, uo->queue.buf + off, len, 0, &uo->sa.sa,
+                    ns_sa_len(&uo->sa));
+    }
+  }
+  uo->num_segs = 0;
+  uo->queue.len = 0;
+}
+
+/*
+ * Queue a datagram, to send it with other ones to the same peer. All but the
+ * last one must have the same size. Return 0 if it must be sent right away.
+ */
+static int ns_udp_queue(struct ns_connection *nc, const void *buf,
+                        size_t len) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+
+  if (uo == NULL || !uo->gso) return 0;
+  if (uo->num_segs > 0 &&
+      (len > uo->seg_size || uo->queue.len != uo->num_segs * uo->seg_size ||
+       uo->queue.len + len > NS_UDP_GSO_MAX_SIZE ||
+       uo->num_segs >= NS_UDP_GSO_MAX_SEGMENTS ||
+       memcmp(&uo->sa, &nc->sa, ns_sa_len(&nc->sa)) != 0)) {
+    ns_udp_flush(nc);
+  }
+  if (len == 0 || len > NS_UDP_GSO_MAX_SEGMENT) {
+    ns_udp_flush(nc);
+    return 0;
+  }
+  if (uo->num_segs == 0) {
+    uo->sa = nc->sa;
+    uo->seg_size = len;
+  }
+  if (mbuf_append(&uo->queue, buf, len) != len) {
+    ns_udp_flush(nc);
+    return 0;
+  }
+  uo->num_segs++;
+
+  return 1;
+}
+
+static void ns_udp_offload_free(struct ns_connection *nc) {
+  if (nc->udp_offload != NULL) {
+    mbuf_free(&nc->udp_offload->queue);
+    NS_FREE(nc->udp_offload->gro_buf);
+    NS_FREE(nc->udp_offload);
+    nc->udp_offload = NULL;
+  }
+}
+#else
+static void ns_udp_flush(struct ns_connection *nc) {
+  (void) nc;
+}
+#endif
+
 static size_t ns_out(struct ns_connection *nc, const void *buf, size_t len) {
   if (nc->flags & NSF_UDP) {
-    int n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, sizeof(nc->sa.sin));
+    int n;
+#ifdef NS_ENABLE_UDP_GSO
+    if (ns_udp_queue(nc, buf, len)) return len;
+#endif
+    n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, ns_sa_len(&nc->sa));
     DBG(("%p %d %d %d %s:%hu", nc, nc->sock, n, errno,
          inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
     return n < 0 ? 0 : n;
@@ -1713,7 +2056,23 @@ static size_t ns_out(struct ns_connection *nc, const void *buf, size_t len) {
 }
 
 static void ns_destroy_conn(struct ns_connection *conn) {
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL && (conn->flags & NSF_SSL_HANDSHAKE_DONE)) {
+    /* Best effort close_notify. OpenSSL forgets sessions closed without */
+    SSL_shutdown(conn->ssl);
+  }
+#endif
   if (conn->sock != INVALID_SOCKET) {
+    ns_udp_flush(conn);
+#ifdef NS_ENABLE_ZEROCOPY
+    if (ns_zerocopy_pending(conn)) {
+      /* The buffers go away, the kernel must drop what it has to send */
+      struct linger l;
+      l.l_onoff = 1;
+      l.l_linger = 0;
+      setsockopt(conn->sock, SOL_SOCKET, SO_LINGER, (char *) &l, sizeof(l));
+    }
+#endif
     closesocket(conn->sock);
     /*
      * avoid users accidentally double close a socket
@@ -1726,6 +2085,16 @@ static void ns_destroy_conn(struct ns_connection *conn) {
   }
   mbuf_free(&conn->recv_mbuf);
   mbuf_free(&conn->send_mbuf);
+  ns_ip_acl_free(conn->ip_acl);
+  ns_rate_limit_free(conn->rate_limit[NS_RATE_LIMIT_CONNECTIONS]);
+  ns_rate_limit_free(conn->rate_limit[NS_RATE_LIMIT_MESSAGES]);
+  ns_bandwidth_free(conn->bandwidth);
+  ns_send_file_free(conn);
+  ns_splice_free(conn);
+  ns_zerocopy_free(conn);
+#ifdef NS_ENABLE_UDP_GSO
+  ns_udp_offload_free(conn);
+#endif
 #ifdef NS_ENABLE_SSL
   if (conn->ssl != NULL) {
     SSL_free(conn->ssl);
@@ -1789,6 +2158,10 @@ void ns_mgr_free(struct ns_mgr *s) {
   if (s == NULL) return;
   /* Do one last poll, see https://github.com/cesanta/mongoose/issues/286 */
   ns_mgr_poll(s, 0);
+#ifdef NS_SSL_WORKERS
+  ns_workers_free(s->ssl_workers);
+  s->ssl_workers = NULL;
+#endif
 
   if (s->ctl[0] != INVALID_SOCKET) closesocket(s->ctl[0]);
   if (s->ctl[1] != INVALID_SOCKET) closesocket(s->ctl[1]);
@@ -1798,7 +2171,16 @@ void ns_mgr_free(struct ns_mgr *s) {
     tmp_conn = conn->next;
     ns_close_conn(conn);
   }
+#ifdef NS_WORKERS
+  /* Closed connections have let go of their file jobs */
+  ns_workers_free(s->file_workers);
+  s->file_workers = NULL;
+#endif
 
+#ifdef NS_SSL_OPENSSL_1_1
+  ns_ssl_client_cache_free(s->ssl_clients);
+  s->ssl_clients = NULL;
+#endif
   ns_ev_mgr_free(s);
 }
 
@@ -1806,6 +2188,11 @@ int ns_vprintf(struct ns_connection *nc, const char *fmt, va_list ap) {
   char mem[NS_VPRINTF_BUFFER_SIZE], *buf = mem;
   int len;
 
+  if (!(nc->flags & NSF_UDP)) {
+    /* Format straight into the send buffer, without a temporary copy */
+    return ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap);
+  }
+
   if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
     ns_out(nc, buf, len);
   }
@@ -1936,11 +2323,114 @@ NS_INTERNAL struct ns_connection *ns_create_connection(
      * doesn't compile with pedantic ansi flags.
      */
     conn->recv_mbuf_limit = ~0;
+    conn->recv_budget = NS_RECV_BUDGET;
   }
 
   return conn;
 }
 
+static int ns_set_tcp_opt(sock_t sock, int opt, int value) {
+  int rc = setsockopt(sock, IPPROTO_TCP, opt, (char *) &value, sizeof(value));
+  return rc == 0 ? 0 : -1;
+}
+
+static int ns_is_inet(const union socket_address *sa) {
+  return sa->sa.sa_family == AF_INET
+#ifdef NS_ENABLE_IPV6
+         || sa->sa.sa_family == AF_INET6
+#endif
+      ;
+}
+
+/* Defaults for new TCP connections: see ns_set_nodelay() */
+static void ns_set_tcp_defaults(sock_t sock, const union socket_address *sa) {
+#ifdef TCP_NODELAY
+  if (ns_is_inet(sa)) (void) ns_set_tcp_opt(sock, TCP_NODELAY, 1);
+#else
+  (void) sock;
+  (void) sa;
+#endif
+}
+
+int ns_set_nodelay(struct ns_connection *nc, int on) {
+#ifdef TCP_NODELAY
+  if (!(nc->flags & (NSF_UDP | NSF_LISTENING))) {
+    return ns_set_tcp_opt(nc->sock, TCP_NODELAY, on);
+  }
+#endif
+  (void) nc;
+  (void) on;
+  return -1;
+}
+
+int ns_set_cork(struct ns_connection *nc, int on) {
+  if (!(nc->flags & (NSF_UDP | NSF_LISTENING))) {
+#if defined(TCP_CORK)
+    return ns_set_tcp_opt(nc->sock, TCP_CORK, on);
+#elif defined(TCP_NOPUSH)
+    return ns_set_tcp_opt(nc->sock, TCP_NOPUSH, on);
+#endif
+  }
+  (void) nc;
+  (void) on;
+  return -1;
+}
+
+#ifdef NS_ENABLE_UDP_GSO
+/* Enable UDP offloads the kernel has, for UDP connections and listeners */
+static void ns_udp_offload_init(struct ns_connection *nc) {
+  struct ns_udp_offload *uo;
+  int on = 1, seg_size = 0;
+  socklen_t len = sizeof(seg_size);
+
+  if (!ns_is_inet(&nc->sa) ||
+      (uo = (struct ns_udp_offload *) NS_CALLOC(1, sizeof(*uo))) == NULL) {
+    return;
+  }
+  uo->gso = getsockopt(nc->sock, IPPROTO_UDP, UDP_SEGMENT, (char *) &seg_size,
+                       &len) == 0;
+  uo->gro = setsockopt(nc->sock, IPPROTO_UDP, UDP_GRO, (char *) &on,
+                       sizeof(on)) == 0;
+  if (uo->gro && (uo->gro_buf = (char *) NS_MALLOC(NS_UDP_GRO_BUFFER_SIZE)) ==
+                     NULL) {
+    /* Coalesced datagrams wouldn't fit in the regular buffer */
+    on = 0;
+    setsockopt(nc->sock, IPPROTO_UDP, UDP_GRO, (char *) &on, sizeof(on));
+    uo->gro = 0;
+  }
+  DBG(("%p UDP gso=%d gro=%d", nc, uo->gso, uo->gro));
+  if (uo->gso || uo->gro) {
+    nc->udp_offload = uo;
+  } else {
+    NS_FREE(uo);
+  }
+}
+#endif
+
+int ns_set_zerocopy(struct ns_connection *nc, size_t threshold) {
+#if defined(NS_ENABLE_ZEROCOPY) && defined(SO_ZEROCOPY)
+  int on = 1;
+
+  if (nc->ssl != NULL || nc->ssl_ctx != NULL || (nc->flags & NSF_UDP)) {
+    return -1;
+  }
+  if (threshold > 0 && nc->zerocopy == NULL) {
+    if (setsockopt(nc->sock, SOL_SOCKET, SO_ZEROCOPY, (char *) &on,
+                   sizeof(on)) != 0 ||
+        (nc->zerocopy = (struct ns_zerocopy *) NS_CALLOC(
+             1, sizeof(*nc->zerocopy))) == NULL) {
+      return -1;
+    }
+  }
+  if (nc->zerocopy != NULL) nc->zerocopy->threshold = threshold;
+  return 0;
+#else
+  (void) nc;
+  (void) threshold;
+  return -1;
+#endif
+}
+
 /* Associate a socket to a connection and and add to the manager. */
 NS_INTERNAL void ns_set_sock(struct ns_connection *nc, sock_t sock) {
 #ifndef NS_CC3200
@@ -1987,6 +2477,23 @@ NS_INTERNAL int ns_parse_address(const char *str, union socket_address *sa,
 
   *proto = SOCK_STREAM;
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (strncmp(str, "unix://", 7) == 0 || strncmp(str, "unixgram://", 11) == 0) {
+    /* Path, e.g. unix:///var/run/app.sock, or abstract name, unix://@app */
+    if (str[4] == 'g') *proto = SOCK_DGRAM;
+    str += *proto == SOCK_DGRAM ? 11 : 7;
+    len = (int) strlen(str);
+    if (len == 0 || (len == 1 && str[0] == '@') ||
+        (size_t) len >= sizeof(sa->un.sun_path)) {
+      return -1;
+    }
+    sa->un.sun_family = AF_UNIX;
+    memcpy(sa->un.sun_path, str, len);
+    if (str[0] == '@') sa->un.sun_path[0] = '\0';
+    return len;
+  }
+#endif
+
   if (strncmp(str, "udp://", 6) == 0) {
     str += 6;
     *proto = SOCK_DGRAM;
@@ -2025,15 +2532,40 @@ NS_INTERNAL int ns_parse_address(const char *str, union socket_address *sa,
   return port < 0xffffUL && str[len] == '\0' ? len : -1;
 }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+/*
+ * Remove a socket file left behind by a process that's gone, otherwise
+ * bind() fails with EADDRINUSE. A socket that somebody listens on is kept.
+ */
+static void ns_unlink_stale_socket(union socket_address *sa, int proto) {
+  const char *path = sa->un.sun_path;
+  struct stat st;
+  sock_t sock;
+
+  if (path[0] == '\0' || stat(path, &st) != 0 || !S_ISSOCK(st.st_mode) ||
+      (sock = socket(AF_UNIX, proto, 0)) == INVALID_SOCKET) {
+    return;
+  }
+  if (connect(sock, &sa->sa, ns_sa_len(sa)) != 0 && errno == ECONNREFUSED) {
+    DBG(("removing stale socket %s", path));
+    unlink(path);
+  }
+  closesocket(sock);
+}
+#endif
+
 /* 'sa' must be an initialized address to bind to */
 static sock_t ns_open_listening_socket(union socket_address *sa, int proto) {
-  socklen_t sa_len =
-      (sa->sa.sa_family == AF_INET) ? sizeof(sa->sin) : sizeof(sa->sin6);
+  socklen_t sa_len = ns_sa_len(sa);
   sock_t sock = INVALID_SOCKET;
 #ifndef NS_CC3200
   int on = 1;
 #endif
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) ns_unlink_stale_socket(sa, proto);
+#endif
+
   if ((sock = socket(sa->sa.sa_family, proto, 0)) != INVALID_SOCKET &&
 #ifndef NS_CC3200 /* CC3200 doesn't support either */
 #if defined(_WIN32) && defined(SO_EXCLUSIVEADDRUSE)
@@ -2071,6 +2603,69 @@ static sock_t ns_open_listening_socket(union socket_address *sa, int proto) {
   return sock;
 }
 
+/* Whether `sock` is a socket of type `proto` bound to `sa` */
+static int ns_is_bound_to(sock_t sock, const union socket_address *sa,
+                          int proto) {
+  union socket_address bound;
+  socklen_t len = sizeof(bound), type_len = sizeof(int);
+  int type = 0;
+
+  memset(&bound, 0, sizeof(bound));
+  if (getsockname(sock, &bound.sa, &len) != 0 ||
+      getsockopt(sock, SOL_SOCKET, SO_TYPE, (char *) &type, &type_len) != 0 ||
+      type != proto || bound.sa.sa_family != sa->sa.sa_family) {
+    return 0;
+  }
+  switch (sa->sa.sa_family) {
+    case AF_INET:
+      return bound.sin.sin_port == sa->sin.sin_port &&
+             bound.sin.sin_addr.s_addr == sa->sin.sin_addr.s_addr;
+#ifdef NS_ENABLE_IPV6
+    case AF_INET6:
+      return bound.sin6.sin6_port == sa->sin6.sin6_port &&
+             memcmp(&bound.sin6.sin6_addr, &sa->sin6.sin6_addr,
+                    sizeof(sa->sin6.sin6_addr)) == 0;
+#endif
+#ifdef NS_ENABLE_UNIX_SOCKETS
+    case AF_UNIX:
+      return memcmp(bound.un.sun_path, sa->un.sun_path,
+                    sizeof(sa->un.sun_path)) == 0;
+#endif
+  }
+  return 0;
+}
+
+/* Claim a socket taken over by ns_hot_restart_takeover(), if one matches */
+static sock_t ns_take_inherited(struct ns_mgr *mgr, union socket_address *sa,
+                                int proto) {
+  sock_t sock;
+  int i;
+
+  for (i = 0; i < mgr->num_inherited; i++) {
+    if (ns_is_bound_to(mgr->inherited[i], sa, proto)) {
+      sock = mgr->inherited[i];
+      mgr->inherited[i] = mgr->inherited[--mgr->num_inherited];
+      DBG(("%p reusing sock %d", mgr, sock));
+      return sock;
+    }
+  }
+  return INVALID_SOCKET;
+}
+
+/* Close taken over sockets that nobody claimed */
+static void ns_close_inherited(struct ns_mgr *mgr) {
+  int i;
+
+  if (mgr->inherited == NULL) return;
+  for (i = 0; i < mgr->num_inherited; i++) {
+    DBG(("%p closing unclaimed sock %d", mgr, mgr->inherited[i]));
+    closesocket(mgr->inherited[i]);
+  }
+  NS_FREE(mgr->inherited);
+  mgr->inherited = NULL;
+  mgr->num_inherited = 0;
+}
+
 #ifdef NS_ENABLE_SSL
 /*
  * Certificate generation script is at
@@ -2188,4013 +2783,7697 @@ static int ns_use_cert(SSL_CTX *ctx, const char *pem_file) {
   }
 }
 
-/*
- * Turn the connection into SSL mode.
- * `cert` is the certificate file in PEM format. For listening connections,
- * certificate file must contain private key and server certificate,
- * concatenated. It may also contain DH params - these will be used for more
- * secure key exchange. `ca_cert` is a certificate authority (CA) PEM file, and
- * it is optional (can be set to NULL). If `ca_cert` is non-NULL, then
- * the connection is so-called two-way-SSL: other peer's certificate is
- * checked against the `ca_cert`.
- *
- * Handy OpenSSL command to generate test self-signed certificate:
- *
- *    openssl req -x509 -newkey rsa:2048 -keyout key.pem -out cert.pem -days 999
- *
- * Return NULL on success, or error message on failure.
- */
-const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
-                       const char *ca_cert) {
+/* Create an SSL context and load certificates into it */
+static const char *ns_ssl_ctx_new(SSL_CTX **ctx, int server_side,
+                                  const char *cert, const char *ca_cert) {
   const char *result = NULL;
 
-  if ((nc->flags & NSF_LISTENING) &&
-      (nc->ssl_ctx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
-    result = "SSL_CTX_new() failed";
-  } else if (!(nc->flags & NSF_LISTENING) &&
-             (nc->ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
-    result = "SSL_CTX_new() failed";
-  } else if (ns_use_cert(nc->ssl_ctx, cert) != 0) {
+  if ((*ctx = SSL_CTX_new(server_side ? SSLv23_server_method()
+                                      : SSLv23_client_method())) == NULL) {
+    return "SSL_CTX_new() failed";
+  } else if (ns_use_cert(*ctx, cert) != 0) {
     result = "Invalid ssl cert";
-  } else if (ns_use_ca_cert(nc->ssl_ctx, ca_cert) != 0) {
+  } else if (ns_use_ca_cert(*ctx, ca_cert) != 0) {
     result = "Invalid CA cert";
-  } else if (!(nc->flags & NSF_LISTENING) &&
-             (nc->ssl = SSL_new(nc->ssl_ctx)) == NULL) {
-    result = "SSL_new() failed";
-  } else if (!(nc->flags & NSF_LISTENING) && nc->sock != INVALID_SOCKET) {
-    /*
-     * Socket is open here only if we are connecting to IP address
-     * and does not open if we are connecting using async DNS resolver
-     */
-    SSL_set_fd(nc->ssl, nc->sock);
   }
 
 /* TODO(rojer): remove when krypton exposes this function, even a dummy one */
 #ifdef OPENSSL_VERSION_NUMBER
-  SSL_CTX_set_cipher_list(nc->ssl_ctx, ns_s_cipher_list);
+  SSL_CTX_set_cipher_list(*ctx, ns_s_cipher_list);
+  if (server_side) {
+    /* Without it, sessions of verified clients can't be resumed */
+    SSL_CTX_set_session_id_context(*ctx, (const unsigned char *) "fossa", 5);
+  }
+#endif
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  /* OpenSSL hands the keys to the kernel after the handshake if it can */
+  SSL_CTX_set_options(*ctx, SSL_OP_ENABLE_KTLS);
 #endif
   return result;
 }
 
-static int ns_ssl_err(struct ns_connection *conn, int res) {
-  int ssl_err = SSL_get_error(conn->ssl, res);
-  if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
-  if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
-  return ssl_err;
-}
-#endif /* NS_ENABLE_SSL */
+#ifdef NS_SSL_OPENSSL_1_1
+/* A session to resume with a server, most recently stored first */
+struct ns_ssl_client_session {
+  struct ns_ssl_client_session *next;
+  char addr[128]; /* Server address, see ns_sock_addr_to_str() */
+  SSL_SESSION *session;
+};
 
-static struct ns_connection *accept_conn(struct ns_connection *ls) {
-  struct ns_connection *c = NULL;
-  union socket_address sa;
-  socklen_t len = sizeof(sa);
-  sock_t sock = INVALID_SOCKET;
+/* A client context shared by connections with the same certificates */
+struct ns_ssl_client_ctx {
+  struct ns_ssl_client_ctx *next;
+  struct ns_ssl_client_cache *cache;
+  char *cert, *ca_cert; /* Empty strings for none */
+  SSL_CTX *ctx;
+  struct ns_ssl_client_session *sessions;
+};
 
-  /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
-  if ((sock = accept(ls->sock, &sa.sa, &len)) == INVALID_SOCKET) {
-  } else if ((c = ns_add_sock(ls->mgr, sock, ls->handler)) == NULL) {
-    closesocket(sock);
-#ifdef NS_ENABLE_SSL
-  } else if (ls->ssl_ctx != NULL && ((c->ssl = SSL_new(ls->ssl_ctx)) == NULL ||
-                                     SSL_set_fd(c->ssl, sock) != 1)) {
-    DBG(("SSL error"));
-    ns_close_conn(c);
-    c = NULL;
-#endif
-  } else {
-    c->listener = ls;
-    c->proto_data = ls->proto_data;
-    c->proto_handler = ls->proto_handler;
-    c->user_data = ls->user_data;
-    c->recv_mbuf_limit = ls->recv_mbuf_limit;
-    if (c->ssl == NULL) { /* SSL connections need to perform handshake. */
-      ns_call(c, NS_ACCEPT, &sa);
+struct ns_ssl_client_cache {
+  struct ns_ssl_client_ctx *contexts;
+  struct ns_ssl_client_stats stats;
+};
+
+static void ns_ssl_client_cache_free(struct ns_ssl_client_cache *cache) {
+  struct ns_ssl_client_ctx *cc;
+  struct ns_ssl_client_session *cs;
+
+  if (cache == NULL) return;
+  while ((cc = cache->contexts) != NULL) {
+    cache->contexts = cc->next;
+    while ((cs = cc->sessions) != NULL) {
+      cc->sessions = cs->next;
+      SSL_SESSION_free(cs->session);
+      NS_FREE(cs);
     }
-    DBG(("%p %d %p %p", c, c->sock, c->ssl_ctx, c->ssl));
+    /* Connections still using the context hold their own reference */
+    SSL_CTX_free(cc->ctx);
+    NS_FREE(cc->cert);
+    NS_FREE(cc->ca_cert);
+    NS_FREE(cc);
   }
+  NS_FREE(cache);
+}
 
-  return c;
+/* Key of the sessions with a server: its address and SNI name, if any */
+static void ns_ssl_client_addr(struct ns_connection *nc, char *buf,
+                               size_t len) {
+  const char *name = SSL_get_servername(nc->ssl, TLSEXT_NAMETYPE_host_name);
+  size_t n;
+
+  ns_sock_addr_to_str(&nc->sa, buf, len,
+                      NS_SOCK_STRINGIFY_IP | NS_SOCK_STRINGIFY_PORT);
+  n = strlen(buf);
+  if (name != NULL) snprintf(buf + n, len - n, "/%s", name);
 }
 
-static int ns_is_error(int n) {
-#ifdef NS_CC3200
-  DBG(("n = %d, errno = %d", n, errno));
-  if (n < 0) errno = n;
-#endif
-  return n == 0 || (n < 0 && errno != EINTR && errno != EINPROGRESS &&
-                    errno != EAGAIN && errno != EWOULDBLOCK
-#ifdef NS_CC3200
-                    && errno != SL_EALREADY
-#endif
-#ifdef _WIN32
-                    && WSAGetLastError() != WSAEINTR &&
-                    WSAGetLastError() != WSAEWOULDBLOCK
-#endif
-                    );
-}
-
-static size_t recv_avail_size(struct ns_connection *conn, size_t max) {
-  size_t avail;
-  if (conn->recv_mbuf_limit < conn->recv_mbuf.len) return 0;
-  avail = conn->recv_mbuf_limit - conn->recv_mbuf.len;
-  return avail > max ? max : avail;
-}
-
-#ifdef NS_ENABLE_SSL
-static void ns_ssl_begin(struct ns_connection *nc) {
-  int server_side = nc->listener != NULL;
-  int res = server_side ? SSL_accept(nc->ssl) : SSL_connect(nc->ssl);
+/*
+ * Called by OpenSSL when the server hands out a session: at the end of
+ * a TLS 1.2 handshake, or in a TLS 1.3 ticket at any time after it.
+ */
+static int ns_ssl_client_new_session(SSL *ssl, SSL_SESSION *session) {
+  struct ns_connection *nc = (struct ns_connection *) SSL_get_app_data(ssl);
+  struct ns_ssl_client_ctx *cc =
+      (struct ns_ssl_client_ctx *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  struct ns_ssl_client_session *cs, **p;
+  char addr[sizeof(cs->addr)];
+  int n = 0;
 
-  if (res == 1) {
-    nc->flags |= NSF_SSL_HANDSHAKE_DONE;
-    nc->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
+  if (nc == NULL || cc == NULL) return 0;
+  ns_ssl_client_addr(nc, addr, sizeof(addr));
 
-    if (server_side) {
-      union socket_address sa;
-      socklen_t sa_len = sizeof(sa);
-      /* In case port was set to 0, get the real port number */
-      (void) getsockname(nc->sock, &sa.sa, &sa_len);
-      ns_call(nc, NS_ACCEPT, &sa);
+  /* Replace the previous session with this server, evict the oldest ones */
+  for (p = &cc->sessions; (cs = *p) != NULL;) {
+    if (strcmp(cs->addr, addr) == 0 || ++n >= NS_SSL_CLIENT_SESSIONS) {
+      *p = cs->next;
+      SSL_SESSION_free(cs->session);
+      NS_FREE(cs);
+      cc->cache->stats.num_sessions--;
+    } else {
+      p = &cs->next;
     }
-  } else {
-    int ssl_err = ns_ssl_err(nc, res);
-    if (ssl_err != SSL_ERROR_WANT_READ && ssl_err != SSL_ERROR_WANT_WRITE) {
-      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+
+  if ((cs = (struct ns_ssl_client_session *) NS_CALLOC(1, sizeof(*cs))) ==
+      NULL) {
+    return 0;
+  }
+  strcpy(cs->addr, addr);
+  cs->session = session;
+  cs->next = cc->sessions;
+  cc->sessions = cs;
+  cc->cache->stats.num_sessions++;
+  return 1; /* We own the session now */
+}
+
+/* Offer the session stored for the server, if any, before connecting */
+static void ns_ssl_client_resume(struct ns_connection *nc) {
+  struct ns_ssl_client_ctx *cc =
+      (struct ns_ssl_client_ctx *) SSL_CTX_get_app_data(nc->ssl_ctx);
+  struct ns_ssl_client_session *cs;
+  char addr[sizeof(cs->addr)];
+
+  if (cc == NULL || cc->sessions == NULL) return;
+  ns_ssl_client_addr(nc, addr, sizeof(addr));
+  for (cs = cc->sessions; cs != NULL; cs = cs->next) {
+    if (strcmp(cs->addr, addr) == 0) {
+      if (SSL_SESSION_is_resumable(cs->session)) {
+        SSL_set_session(nc->ssl, cs->session);
+      }
+      break;
     }
   }
 }
-#endif /* NS_ENABLE_SSL */
-
-static void ns_read_from_socket(struct ns_connection *conn) {
-  char buf[NS_READ_BUFFER_SIZE];
-  int n = 0, to_recv;
-
-  if (conn->flags & NSF_CONNECTING) {
-    int ok = 1, ret;
-#ifndef NS_CC3200
-    socklen_t len = sizeof(ok);
-#endif
 
-    (void) ret;
-#ifdef NS_CC3200
-    /* On CC3200 we use blocking connect. If we got as far as this,
-     * this means connect() was successful.
-     * TODO(rojer): Figure out why it fails where blocking succeeds.
-     */
-    ns_set_non_blocking_mode(conn->sock);
-    ret = ok = 0;
-#else
-    ret = getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char *) &ok, &len);
-#endif
-#ifdef NS_ENABLE_SSL
-    if (ret == 0 && ok == 0 && conn->ssl != NULL) {
-      ns_ssl_begin(conn);
-    }
-#endif
-    DBG(("%p connect ok=%d", conn, ok));
-    if (ok != 0) {
-      conn->flags |= NSF_CLOSE_IMMEDIATELY;
-    } else {
-      conn->flags &= ~NSF_CONNECTING;
+/*
+ * Get the manager's client context for the given certificates, creating
+ * it on first use. The connection gets its own reference.
+ */
+static const char *ns_ssl_client_ctx(struct ns_connection *nc,
+                                     const char *cert, const char *ca_cert) {
+  struct ns_ssl_client_cache *cache = nc->mgr->ssl_clients;
+  struct ns_ssl_client_ctx *cc;
+  const char *result;
+
+  if (cert == NULL) cert = "";
+  if (ca_cert == NULL) ca_cert = "";
+  if (cache == NULL &&
+      (cache = nc->mgr->ssl_clients = (struct ns_ssl_client_cache *) NS_CALLOC(
+           1, sizeof(*cache))) == NULL) {
+    return "Out of memory";
+  }
+
+  for (cc = cache->contexts; cc != NULL; cc = cc->next) {
+    if (strcmp(cc->cert, cert) == 0 && strcmp(cc->ca_cert, ca_cert) == 0) {
+      SSL_CTX_up_ref(cc->ctx);
+      nc->ssl_ctx = cc->ctx;
+      return NULL;
     }
-    ns_call(conn, NS_CONNECT, &ok);
-    return;
   }
 
-#ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
-    if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
-      /* SSL library may have more bytes ready to read then we ask to read.
-       * Therefore, read in a loop until we read everything. Without the loop,
-       * we skip to the next select() cycle which can just timeout. */
-      while ((n = SSL_read(conn->ssl, buf, sizeof(buf))) > 0) {
-        DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
-        mbuf_append(&conn->recv_mbuf, buf, n);
-        ns_call(conn, NS_RECV, &n);
-      }
-      ns_ssl_err(conn, n);
-    } else {
-      ns_ssl_begin(conn);
-      return;
-    }
-  } else
-#endif
-  {
-    to_recv = recv_avail_size(conn, sizeof(buf));
-    while ((n = (int) NS_RECV_FUNC(conn->sock, buf, to_recv, 0)) > 0) {
-      DBG(("%p %d bytes (PLAIN) <- %d", conn, n, conn->sock));
-      mbuf_append(&conn->recv_mbuf, buf, n);
-      ns_call(conn, NS_RECV, &n);
-#ifdef NS_ESP8266
-      /*
-       * TODO(alashkin): ESP/RTOS recv implementation tend to block
-       * even in non-blocking mode, so, break the loop
-       * if received size less than buffer size
-       * and wait for next select()
-       * Some of RTOS specific call missed?
-       */
-      if (to_recv > n) {
-        break;
-      }
-      to_recv = recv_avail_size(conn, sizeof(buf));
-#endif
+  if ((result = ns_ssl_ctx_new(&nc->ssl_ctx, 0, cert, ca_cert)) != NULL) {
+    return result;
+  } else if ((cc = (struct ns_ssl_client_ctx *) NS_CALLOC(1, sizeof(*cc))) ==
+                 NULL ||
+             (cc->cert = strdup(cert)) == NULL ||
+             (cc->ca_cert = strdup(ca_cert)) == NULL) {
+    if (cc != NULL) {
+      NS_FREE(cc->cert);
+      NS_FREE(cc);
     }
-    DBG(("recv returns %d", n));
+    return NULL; /* Works, just isn't shared */
   }
 
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  SSL_CTX_set_session_cache_mode(
+      nc->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(nc->ssl_ctx, ns_ssl_client_new_session);
+  SSL_CTX_set_app_data(nc->ssl_ctx, cc);
+  SSL_CTX_up_ref(nc->ssl_ctx);
+  cc->ctx = nc->ssl_ctx;
+  cc->cache = cache;
+  cc->next = cache->contexts;
+  cache->contexts = cc;
+  cache->stats.num_contexts++;
+  return NULL;
+}
+
+void ns_ssl_get_client_stats(struct ns_mgr *mgr,
+                             struct ns_ssl_client_stats *stats) {
+  if (mgr->ssl_clients != NULL) {
+    *stats = mgr->ssl_clients->stats;
+  } else {
+    memset(stats, 0, sizeof(*stats));
   }
 }
 
-static void ns_write_to_socket(struct ns_connection *conn) {
-  struct mbuf *io = &conn->send_mbuf;
-  int n = 0;
+/* Certificate served to clients asking for a name with SNI */
+struct ns_ssl_sni_cert {
+  struct ns_ssl_sni_cert *next;
+  char *name; /* Host name, or "*." followed by a domain */
+  SSL_CTX *ctx;
+  unsigned char *ocsp; /* Stapled OCSP response, DER */
+  size_t ocsp_len;
+};
 
-  assert(io->len > 0);
+/*
+ * Listener settings. They live as long as the listener's SSL_CTX, which
+ * accepted connections keep alive after the listener is closed.
+ */
+struct ns_ssl_server {
+  unsigned char *ticket_keys; /* NS_SSL_TICKET_KEY_SIZE bytes each */
+  int num_ticket_keys;
+  struct ns_ssl_sni_cert *certs;
+  unsigned char *ocsp; /* For the listener's own certificate */
+  size_t ocsp_len;
+};
 
-#ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
-    if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
-      n = SSL_write(conn->ssl, io->buf, io->len);
-      if (n <= 0) {
-        int ssl_err = ns_ssl_err(conn, n);
-        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
-          return; /* Call us again */
-        } else {
-          conn->flags |= NSF_CLOSE_IMMEDIATELY;
-        }
-      } else {
-        /* Successful SSL operation, clear off SSL wait flags */
-        conn->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
-      }
-    } else {
-      ns_ssl_begin(conn);
-      return;
-    }
-  } else
-#endif
-  {
-    n = (int) NS_SEND_FUNC(conn->sock, io->buf, io->len, 0);
-  }
+static int s_ns_ssl_server_index = -1;
 
-  DBG(("%p %d bytes -> %d", conn, n, conn->sock));
+static void ns_ssl_server_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                               int idx, long argl, void *argp) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) ptr;
+  struct ns_ssl_sni_cert *sc;
 
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
-  } else if (n > 0) {
-#ifndef NS_DISABLE_FILESYSTEM
-    /* LCOV_EXCL_START */
-    if (conn->mgr->hexdump_file != NULL) {
-      ns_hexdump_connection(conn, conn->mgr->hexdump_file, n, NS_SEND);
-    }
-/* LCOV_EXCL_STOP */
-#endif
-    mbuf_remove(io, n);
+  (void) parent;
+  (void) ad;
+  (void) idx;
+  (void) argl;
+  (void) argp;
+  if (srv == NULL) return;
+  while ((sc = srv->certs) != NULL) {
+    srv->certs = sc->next;
+    SSL_CTX_free(sc->ctx);
+    NS_FREE(sc->name);
+    NS_FREE(sc->ocsp);
+    NS_FREE(sc);
   }
-  ns_call(conn, NS_SEND, &n);
+  if (srv->ticket_keys != NULL) {
+    OPENSSL_cleanse(srv->ticket_keys,
+                    srv->num_ticket_keys * NS_SSL_TICKET_KEY_SIZE);
+    NS_FREE(srv->ticket_keys);
+  }
+  NS_FREE(srv->ocsp);
+  NS_FREE(srv);
 }
 
-int ns_send(struct ns_connection *conn, const void *buf, int len) {
-  return (int) ns_out(conn, buf, len);
-}
+/* Get the settings of an SSL listener, creating them if needed */
+static struct ns_ssl_server *ns_ssl_server_get(struct ns_connection *nc) {
+  struct ns_ssl_server *srv;
 
-static void ns_handle_udp(struct ns_connection *ls) {
-  struct ns_connection nc;
-  char buf[NS_UDP_RECEIVE_BUFFER_SIZE];
-  int n;
-  socklen_t s_len = sizeof(nc.sa);
+  if (!(nc->flags & NSF_LISTENING) || nc->ssl_ctx == NULL) return NULL;
+  if (s_ns_ssl_server_index < 0) {
+    s_ns_ssl_server_index =
+        SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ns_ssl_server_free);
+  }
+  srv = (struct ns_ssl_server *) SSL_CTX_get_app_data(nc->ssl_ctx);
+  if (srv == NULL && (srv = (struct ns_ssl_server *) NS_CALLOC(
+                          1, sizeof(*srv))) != NULL) {
+    /* App data is for callbacks, the indexed copy frees it with the ctx */
+    SSL_CTX_set_app_data(nc->ssl_ctx, srv);
+    SSL_CTX_set_ex_data(nc->ssl_ctx, s_ns_ssl_server_index, srv);
+  }
+  return srv;
+}
 
-  memset(&nc, 0, sizeof(nc));
-  n = recvfrom(ls->sock, buf, sizeof(buf), 0, &nc.sa.sa, &s_len);
-  if (n <= 0) {
-    DBG(("%p recvfrom: %s", ls, strerror(errno)));
-  } else {
-    union socket_address sa = nc.sa;
-    /* Copy all attributes, preserving sender address */
-    nc = *ls;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define NS_TICKET_HMAC_CTX EVP_MAC_CTX
+#else
+#define NS_TICKET_HMAC_CTX HMAC_CTX
+#endif
 
-    /* Then override some */
-    nc.sa = sa;
-    nc.recv_mbuf.buf = buf;
-    nc.recv_mbuf.len = nc.recv_mbuf.size = n;
-    nc.listener = ls;
-    nc.flags = NSF_UDP;
+static int ns_ssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *ectx, NS_TICKET_HMAC_CTX *hctx,
+                            int enc) {
+  struct ns_ssl_server *srv =
+      (struct ns_ssl_server *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  const unsigned char *key = NULL;
+  int i;
 
-    /* Call NS_RECV handler */
-    DBG(("%p %d bytes received", ls, n));
-    ns_call(&nc, NS_RECV, &n);
+  if (srv == NULL || srv->num_ticket_keys == 0) return -1;
+  if (enc) {
+    key = srv->ticket_keys;
+    if (RAND_bytes(iv, 16) != 1) return -1;
+    memcpy(name, key, 16);
+  } else {
+    for (i = 0; i < srv->num_ticket_keys && key == NULL; i++) {
+      if (memcmp(name, srv->ticket_keys + i * NS_SSL_TICKET_KEY_SIZE, 16) ==
+          0) {
+        key = srv->ticket_keys + i * NS_SSL_TICKET_KEY_SIZE;
+      }
+    }
+    if (key == NULL) return 0; /* Retired key: full handshake */
+  }
 
-    /*
-     * See https://github.com/cesanta/fossa/issues/207
-     * ns_call migth set flags. They need to be synced back to ls.
-     */
-    ls->flags = nc.flags;
+  /* Key layout: 16 bytes name, 32 bytes HMAC-SHA256 key, 32 bytes AES key */
+  if (EVP_CipherInit_ex(ectx, EVP_aes_256_cbc(), NULL, key + 48, iv, enc) !=
+      1) {
+    return -1;
   }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  {
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *) "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_init(hctx, key + 16, 32, params) != 1) return -1;
+  }
+#else
+  if (HMAC_Init_ex(hctx, key + 16, 32, EVP_sha256(), NULL) != 1) return -1;
+#endif
+  /*
+   * Always issue a new ticket on resumption: tickets of older keys must be
+   * replaced, and TLS 1.3 clients can't resume twice with the same one.
+   */
+  return enc ? 1 : 2;
 }
 
-#define _NSF_FD_CAN_READ 1
-#define _NSF_FD_CAN_WRITE 1 << 1
-#define _NSF_FD_ERROR 1 << 2
+const char *ns_ssl_set_ticket_keys(struct ns_connection *nc, const void *keys,
+                                   size_t len) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  unsigned char *copy = NULL;
 
-static void ns_mgr_handle_connection(struct ns_connection *nc, int fd_flags,
-                                     time_t now) {
-  DBG(("%p fd=%d fd_flags=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock,
-       fd_flags, nc->flags, (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
-  if (fd_flags != 0) nc->last_io_time = now;
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
 
-  if (nc->flags & NSF_CONNECTING) {
-    if (fd_flags != 0) {
-      ns_read_from_socket(nc);
-    }
-    return;
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if (len % NS_SSL_TICKET_KEY_SIZE != 0) {
+    return "Invalid ticket keys";
+  } else if (len > 0 && (copy = (unsigned char *) NS_MALLOC(len)) == NULL) {
+    return "Out of memory";
   }
 
-  if (nc->flags & NSF_LISTENING) {
-    /*
-     * We're not looping here, and accepting just one connection at
-     * a time. The reason is that eCos does not respect non-blocking
-     * flag on a listening socket and hangs in a loop.
-     */
-    if (fd_flags & _NSF_FD_CAN_READ) accept_conn(nc);
-    return;
+  if (len > 0) memcpy(copy, keys, len);
+  if (srv->ticket_keys != NULL) {
+    OPENSSL_cleanse(srv->ticket_keys,
+                    srv->num_ticket_keys * NS_SSL_TICKET_KEY_SIZE);
+    NS_FREE(srv->ticket_keys);
   }
+  srv->ticket_keys = copy;
+  srv->num_ticket_keys = (int) (len / NS_SSL_TICKET_KEY_SIZE);
 
-  if (fd_flags & _NSF_FD_CAN_READ) {
-    if (nc->flags & NSF_UDP) {
-      ns_handle_udp(nc);
-    } else {
-      ns_read_from_socket(nc);
-    }
-    if (nc->flags & NSF_CLOSE_IMMEDIATELY) return;
+  if (len == 0) {
+    SSL_CTX_set_options(nc->ssl_ctx, SSL_OP_NO_TICKET);
+  } else {
+    SSL_CTX_clear_options(nc->ssl_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(nc->ssl_ctx, ns_ssl_ticket_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(nc->ssl_ctx, ns_ssl_ticket_cb);
+#endif
   }
+  return NULL;
+}
 
-  if ((fd_flags & _NSF_FD_CAN_WRITE) && !(nc->flags & NSF_DONT_SEND) &&
-      !(nc->flags & NSF_UDP)) { /* Writes to UDP sockets are not buffered. */
-    ns_write_to_socket(nc);
+const char *ns_ssl_set_session_cache(struct ns_connection *nc,
+                                     int max_sessions, int timeout) {
+  if (!(nc->flags & NSF_LISTENING) || nc->ssl_ctx == NULL) {
+    return "Not an SSL listener";
   }
-
-  if (!(fd_flags & (_NSF_FD_CAN_READ | _NSF_FD_CAN_WRITE))) {
-    ns_call(nc, NS_POLL, &now);
+#ifdef NS_SSL_WORKERS
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
+  if (max_sessions > 0) {
+    SSL_CTX_set_session_cache_mode(nc->ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(nc->ssl_ctx, max_sessions);
+  } else {
+    SSL_CTX_set_session_cache_mode(nc->ssl_ctx, SSL_SESS_CACHE_OFF);
   }
-
-  DBG(("%p after fd=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock, nc->flags,
-       (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
+  if (timeout > 0) SSL_CTX_set_timeout(nc->ssl_ctx, timeout);
+  return NULL;
 }
 
-static void ns_mgr_handle_ctl_sock(struct ns_mgr *mgr) {
-  struct ctl_msg ctl_msg;
-  int len =
-      (int) NS_RECV_FUNC(mgr->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
-  NS_SEND_FUNC(mgr->ctl[1], ctl_msg.message, 1, 0);
-  if (len >= (int) sizeof(ctl_msg.callback) && ctl_msg.callback != NULL) {
-    struct ns_connection *nc;
-    for (nc = ns_next(mgr, NULL); nc != NULL; nc = ns_next(mgr, nc)) {
-      ctl_msg.callback(nc, NS_POLL, ctl_msg.message);
+/* Find the certificate for a name, preferring exact matches to wildcards */
+static struct ns_ssl_sni_cert *ns_ssl_find_sni_cert(struct ns_ssl_server *srv,
+                                                    const char *name,
+                                                    int exact) {
+  struct ns_ssl_sni_cert *sc, *wildcard = NULL;
+  const char *domain = strchr(name, '.');
+
+  for (sc = srv->certs; sc != NULL; sc = sc->next) {
+    if (ns_casecmp(sc->name, name) == 0) {
+      return sc;
+    } else if (!exact && wildcard == NULL && sc->name[0] == '*' &&
+               domain != NULL && ns_casecmp(sc->name + 1, domain) == 0) {
+      wildcard = sc;
     }
   }
+  return wildcard;
 }
 
-#if NS_MGR_EV_MGR == 1 /* epoll() */
+static int ns_ssl_sni_cb(SSL *ssl, int *alert, void *arg) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) arg;
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  struct ns_ssl_sni_cert *sc;
 
-#ifndef NS_EPOLL_MAX_EVENTS
-#define NS_EPOLL_MAX_EVENTS 100
-#endif
-
-#define _NS_EPF_EV_EPOLLIN (1 << 0)
-#define _NS_EPF_EV_EPOLLOUT (1 << 1)
-#define _NS_EPF_NO_POLL (1 << 2)
-
-static uint32_t ns_epf_to_evflags(unsigned int epf) {
-  uint32_t result = 0;
-  if (epf & _NS_EPF_EV_EPOLLIN) result |= EPOLLIN;
-  if (epf & _NS_EPF_EV_EPOLLOUT) result |= EPOLLOUT;
-  return result;
-}
-
-static void ns_ev_mgr_epoll_set_flags(const struct ns_connection *nc,
-                                      struct epoll_event *ev) {
-  /* NOTE: EPOLLERR and EPOLLHUP are always enabled. */
-  ev->events = 0;
-  if (nc->recv_mbuf.len < nc->recv_mbuf_limit) {
-    ev->events |= EPOLLIN;
-  }
-  if ((nc->flags & NSF_CONNECTING) ||
-      (nc->send_mbuf.len > 0 && !(nc->flags & NSF_DONT_SEND))) {
-    ev->events |= EPOLLOUT;
+  (void) alert;
+  /* Other names get the listener's certificate */
+  if (name != NULL && (sc = ns_ssl_find_sni_cert(srv, name, 0)) != NULL) {
+    SSL_set_SSL_CTX(ssl, sc->ctx);
   }
+  return SSL_TLSEXT_ERR_OK;
 }
 
-static void ns_ev_mgr_epoll_ctl(struct ns_connection *nc, int op) {
-  int epoll_fd = (intptr_t) nc->mgr->mgr_data;
-  struct epoll_event ev;
-  assert(op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD || EPOLL_CTL_DEL);
-  if (op != EPOLL_CTL_DEL) {
-    ns_ev_mgr_epoll_set_flags(nc, &ev);
-    if (op == EPOLL_CTL_MOD) {
-      uint32_t old_ev_flags = ns_epf_to_evflags((intptr_t) nc->mgr_data);
-      if (ev.events == old_ev_flags) return;
-    }
-    ev.data.ptr = nc;
-  }
-  if (epoll_ctl(epoll_fd, op, nc->sock, &ev) != 0) {
-    perror("epoll_ctl");
-    abort();
-  }
-}
+static int ns_ssl_status_cb(SSL *ssl, void *arg) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) arg;
+  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+  struct ns_ssl_sni_cert *sc;
+  const unsigned char *der = srv->ocsp;
+  size_t len = srv->ocsp_len;
+  unsigned char *resp;
 
-static void ns_ev_mgr_init(struct ns_mgr *mgr) {
-  int epoll_fd;
-  DBG(("%p using epoll()", mgr));
-  epoll_fd = epoll_create(NS_EPOLL_MAX_EVENTS /* unused but required */);
-  if (epoll_fd < 0) {
-    perror("epoll_ctl");
-    abort();
-  }
-  mgr->mgr_data = (void *) ((intptr_t) epoll_fd);
-  if (mgr->ctl[1] != INVALID_SOCKET) {
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.ptr = NULL;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mgr->ctl[1], &ev) != 0) {
-      perror("epoll_ctl");
-      abort();
+  for (sc = srv->certs; sc != NULL; sc = sc->next) {
+    if (sc->ctx == ctx) {
+      der = sc->ocsp;
+      len = sc->ocsp_len;
     }
   }
+  if (len == 0 || (resp = (unsigned char *) OPENSSL_malloc(len)) == NULL) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  memcpy(resp, der, len);
+  SSL_set_tlsext_status_ocsp_resp(ssl, resp, (long) len);
+  return SSL_TLSEXT_ERR_OK;
 }
 
-static void ns_ev_mgr_free(struct ns_mgr *mgr) {
-  int epoll_fd = (intptr_t) mgr->mgr_data;
-  close(epoll_fd);
-}
+const char *ns_ssl_add_sni_cert(struct ns_connection *nc,
+                                const char *server_name, const char *cert) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  struct ns_ssl_sni_cert *sc;
+  X509_STORE *store;
+  const char *result;
 
-static void ns_ev_mgr_add_conn(struct ns_connection *nc) {
-  ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_ADD);
-}
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
 
-static void ns_ev_mgr_remove_conn(struct ns_connection *nc) {
-  ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_DEL);
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if ((sc = (struct ns_ssl_sni_cert *) NS_CALLOC(1, sizeof(*sc))) ==
+                 NULL ||
+             (sc->name = strdup(server_name)) == NULL) {
+    NS_FREE(sc);
+    return "Out of memory";
+  } else if ((result = ns_ssl_ctx_new(&sc->ctx, 1, cert, NULL)) != NULL) {
+    SSL_CTX_free(sc->ctx);
+    NS_FREE(sc->name);
+    NS_FREE(sc);
+    return result;
+  }
+
+  /* Switching to this context must not change client certificate checks */
+  store = SSL_CTX_get_cert_store(nc->ssl_ctx);
+  X509_STORE_up_ref(store);
+  SSL_CTX_set_cert_store(sc->ctx, store);
+  SSL_CTX_set_verify(sc->ctx, SSL_CTX_get_verify_mode(nc->ssl_ctx), NULL);
+
+  SSL_CTX_set_app_data(sc->ctx, srv);
+  SSL_CTX_set_tlsext_status_cb(sc->ctx, ns_ssl_status_cb);
+  SSL_CTX_set_tlsext_status_arg(sc->ctx, srv);
+  sc->next = srv->certs;
+  srv->certs = sc;
+
+  SSL_CTX_set_tlsext_servername_callback(nc->ssl_ctx, ns_ssl_sni_cb);
+  SSL_CTX_set_tlsext_servername_arg(nc->ssl_ctx, srv);
+  return NULL;
 }
 
-time_t ns_mgr_poll(struct ns_mgr *mgr, int timeout_ms) {
-  int epoll_fd = (intptr_t) mgr->mgr_data;
-  struct epoll_event events[NS_EPOLL_MAX_EVENTS];
-  struct ns_connection *nc, *next;
-  int num_ev, fd_flags;
-  time_t now;
+const char *ns_ssl_set_ocsp_response(struct ns_connection *nc,
+                                     const char *server_name, const void *der,
+                                     size_t len) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  struct ns_ssl_sni_cert *sc = NULL;
+  unsigned char *copy = NULL, **dst;
+  size_t *dst_len;
 
-  num_ev = epoll_wait(epoll_fd, events, NS_EPOLL_MAX_EVENTS, timeout_ms);
-  now = time(NULL);
-  DBG(("epoll_wait @ %ld num_ev=%d", (long) now, num_ev));
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
 
-  while (num_ev-- > 0) {
-    intptr_t epf;
-    struct epoll_event *ev = events + num_ev;
-    nc = (struct ns_connection *) ev->data.ptr;
-    if (nc == NULL) {
-      ns_mgr_handle_ctl_sock(mgr);
-      continue;
-    }
-    fd_flags = ((ev->events & (EPOLLIN | EPOLLHUP)) ? _NSF_FD_CAN_READ : 0) |
-               ((ev->events & (EPOLLOUT)) ? _NSF_FD_CAN_WRITE : 0) |
-               ((ev->events & (EPOLLERR)) ? _NSF_FD_ERROR : 0);
-    ns_mgr_handle_connection(nc, fd_flags, now);
-    epf = (intptr_t) nc->mgr_data;
-    epf ^= _NS_EPF_NO_POLL;
-    nc->mgr_data = (void *) epf;
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if (server_name != NULL &&
+             (sc = ns_ssl_find_sni_cert(srv, server_name, 1)) == NULL) {
+    return "Unknown server name";
+  } else if (len > 0 && (copy = (unsigned char *) NS_MALLOC(len)) == NULL) {
+    return "Out of memory";
   }
 
-  for (nc = mgr->active_connections; nc != NULL; nc = next) {
-    next = nc->next;
-    if (!(((intptr_t) nc->mgr_data) & _NS_EPF_NO_POLL)) {
-      ns_mgr_handle_connection(nc, 0, now);
-    } else {
-      intptr_t epf = (intptr_t) nc->mgr_data;
-      epf ^= _NS_EPF_NO_POLL;
-      nc->mgr_data = (void *) epf;
-    }
-    if ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & NSF_SEND_AND_CLOSE))) {
-      ns_close_conn(nc);
-    } else {
-      ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
-    }
-  }
+  if (len > 0) memcpy(copy, der, len);
+  dst = sc != NULL ? &sc->ocsp : &srv->ocsp;
+  dst_len = sc != NULL ? &sc->ocsp_len : &srv->ocsp_len;
+  NS_FREE(*dst);
+  *dst = copy;
+  *dst_len = len;
 
-  return now;
+  SSL_CTX_set_tlsext_status_cb(nc->ssl_ctx, ns_ssl_status_cb);
+  SSL_CTX_set_tlsext_status_arg(nc->ssl_ctx, srv);
+  return NULL;
 }
-
-#else /* select() */
-
-static void ns_ev_mgr_init(struct ns_mgr *mgr) {
+#else
+void ns_ssl_get_client_stats(struct ns_mgr *mgr,
+                             struct ns_ssl_client_stats *stats) {
   (void) mgr;
-  DBG(("%p using select()", mgr));
+  memset(stats, 0, sizeof(*stats));
 }
 
-static void ns_ev_mgr_free(struct ns_mgr *mgr) {
-  (void) mgr;
+const char *ns_ssl_set_ticket_keys(struct ns_connection *nc, const void *keys,
+                                   size_t len) {
+  (void) nc;
+  (void) keys;
+  (void) len;
+  return "Not supported";
 }
 
-static void ns_ev_mgr_add_conn(struct ns_connection *nc) {
+const char *ns_ssl_set_session_cache(struct ns_connection *nc,
+                                     int max_sessions, int timeout) {
   (void) nc;
+  (void) max_sessions;
+  (void) timeout;
+  return "Not supported";
 }
 
-static void ns_ev_mgr_remove_conn(struct ns_connection *nc) {
+const char *ns_ssl_add_sni_cert(struct ns_connection *nc,
+                                const char *server_name, const char *cert) {
   (void) nc;
+  (void) server_name;
+  (void) cert;
+  return "Not supported";
 }
 
-static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
-  if (sock != INVALID_SOCKET) {
-    FD_SET(sock, set);
-    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
-      *max_fd = sock;
-    }
+const char *ns_ssl_set_ocsp_response(struct ns_connection *nc,
+                                     const char *server_name, const void *der,
+                                     size_t len) {
+  (void) nc;
+  (void) server_name;
+  (void) der;
+  (void) len;
+  return "Not supported";
+}
+#endif /* NS_SSL_OPENSSL_1_1 */
+
+/*
+ * Turn the connection into SSL mode.
+ * `cert` is the certificate file in PEM format. For listening connections,
+ * certificate file must contain private key and server certificate,
+ * concatenated. It may also contain DH params - these will be used for more
+ * secure key exchange. `ca_cert` is a certificate authority (CA) PEM file, and
+ * it is optional (can be set to NULL). If `ca_cert` is non-NULL, then
+ * the connection is so-called two-way-SSL: other peer's certificate is
+ * checked against the `ca_cert`.
+ *
+ * Handy OpenSSL command to generate test self-signed certificate:
+ *
+ *    openssl req -x509 -newkey rsa:2048 -keyout key.pem -out cert.pem -days 999
+ *
+ * Return NULL on success, or error message on failure.
+ */
+const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
+                       const char *ca_cert) {
+  const char *result = NULL;
+
+  if (nc->flags & NSF_LISTENING) {
+    result = ns_ssl_ctx_new(&nc->ssl_ctx, 1, cert, ca_cert);
+#ifdef NS_SSL_OPENSSL_1_1
+  } else if ((result = ns_ssl_client_ctx(nc, cert, ca_cert)) != NULL) {
+#else
+  } else if ((result = ns_ssl_ctx_new(&nc->ssl_ctx, 0, cert, ca_cert)) !=
+             NULL) {
+#endif
+  } else if ((nc->ssl = SSL_new(nc->ssl_ctx)) == NULL) {
+    result = "SSL_new() failed";
+  } else {
+    SSL_set_app_data(nc->ssl, nc);
+    /*
+     * Socket is open here only if we are connecting to IP address
+     * and does not open if we are connecting using async DNS resolver
+     */
+    if (nc->sock != INVALID_SOCKET) SSL_set_fd(nc->ssl, nc->sock);
   }
+  return result;
 }
 
-time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
-  time_t now;
-  struct ns_connection *nc, *tmp;
-  struct timeval tv;
-  fd_set read_set, write_set, err_set;
-  sock_t max_fd = INVALID_SOCKET;
-  int num_selected;
+int ns_ssl_ktls(struct ns_connection *nc) {
+  int res = 0;
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  if (nc->ssl != NULL && (nc->flags & NSF_SSL_HANDSHAKE_DONE)) {
+    if (BIO_get_ktls_send(SSL_get_wbio(nc->ssl))) res |= NS_KTLS_SEND;
+    if (BIO_get_ktls_recv(SSL_get_rbio(nc->ssl))) res |= NS_KTLS_RECV;
+  }
+#else
+  (void) nc;
+#endif
+  return res;
+}
 
-  FD_ZERO(&read_set);
-  FD_ZERO(&write_set);
-  FD_ZERO(&err_set);
-  ns_add_to_set(mgr->ctl[1], &read_set, &max_fd);
+static int ns_ssl_err(struct ns_connection *conn, int res) {
+  int ssl_err = SSL_get_error(conn->ssl, res);
+  if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
+  if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
+  return ssl_err;
+}
+#endif /* NS_ENABLE_SSL */
 
-  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
-    tmp = nc->next;
+static void ns_bandwidth_free(struct ns_bandwidth *bw) {
+  if (bw != NULL && --bw->refs == 0) {
+    ns_bandwidth_free(bw->shared);
+    NS_FREE(bw);
+  }
+}
 
-    if (!(nc->flags & NSF_WANT_WRITE) &&
-        nc->recv_mbuf.len < nc->recv_mbuf_limit) {
-      ns_add_to_set(nc->sock, &read_set, &max_fd);
-    }
+/* Get the bandwidth limits of a connection, creating them if needed */
+static struct ns_bandwidth *ns_bandwidth_get(struct ns_connection *nc) {
+  if (nc->bandwidth == NULL &&
+      (nc->bandwidth = (struct ns_bandwidth *) NS_CALLOC(
+           1, sizeof(*nc->bandwidth))) != NULL) {
+    nc->bandwidth->refs = 1;
+  }
+  return nc->bandwidth;
+}
 
-    if (((nc->flags & NSF_CONNECTING) && !(nc->flags & NSF_WANT_READ)) ||
-        (nc->send_mbuf.len > 0 && !(nc->flags & NSF_CONNECTING) &&
-         !(nc->flags & NSF_DONT_SEND))) {
-      ns_add_to_set(nc->sock, &write_set, &max_fd);
-      ns_add_to_set(nc->sock, &err_set, &max_fd);
-    }
+/*
+ * Refill a byte bucket and return how many of `max` bytes can be
+ * transferred now. If none, set `*resume` to when enough will be.
+ */
+static size_t ns_byte_bucket_avail(struct ns_byte_bucket *b, double now,
+                                   size_t max, double *resume) {
+  double quantum, t;
+
+  if (b->rate <= 0) return max;
+  if (now > b->last) {
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+  }
+  quantum = b->burst < NS_BANDWIDTH_QUANTUM ? b->burst : NS_BANDWIDTH_QUANTUM;
+  if (b->tokens >= quantum) {
+    return b->tokens < max ? (size_t) b->tokens : max;
   }
+  t = now + (quantum - b->tokens) / b->rate;
+  if (t > *resume) *resume = t;
 
-  tv.tv_sec = milli / 1000;
-  tv.tv_usec = (milli % 1000) * 1000;
+  return 0;
+}
 
-  num_selected = select((int) max_fd + 1, &read_set, &write_set, &err_set, &tv);
-  now = time(NULL);
-  DBG(("select @ %ld num_ev=%d", (long) now, num_selected));
+/* Return how many of `max` bytes `nc` may transfer in direction `dir` */
+static size_t ns_bandwidth_avail(struct ns_connection *nc, int dir,
+                                 size_t max, double *resume) {
+  struct ns_bandwidth *bw = nc->bandwidth;
+  double now;
 
-  if (num_selected > 0 && mgr->ctl[1] != INVALID_SOCKET &&
-      FD_ISSET(mgr->ctl[1], &read_set)) {
-    ns_mgr_handle_ctl_sock(mgr);
+  if (bw == NULL) return max;
+  now = ns_time();
+  max = ns_byte_bucket_avail(&bw->dirs[dir], now, max, resume);
+  if (bw->shared != NULL && max > 0) {
+    max = ns_byte_bucket_avail(&bw->shared->dirs[dir], now, max, resume);
   }
+  return max;
+}
 
-  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
-    int fd_flags = 0;
-    if (num_selected > 0) {
-      fd_flags = (FD_ISSET(nc->sock, &read_set) ? _NSF_FD_CAN_READ : 0) |
-                 (FD_ISSET(nc->sock, &write_set) ? _NSF_FD_CAN_WRITE : 0) |
-                 (FD_ISSET(nc->sock, &err_set) ? _NSF_FD_ERROR : 0);
-    }
-#ifdef NS_CC3200
-    // CC3200 does not report UDP sockets as writeable.
-    if (nc->flags & NSF_UDP &&
-        (nc->send_mbuf.len > 0 || nc->flags & NSF_CONNECTING)) {
-      fd_flags |= _NSF_FD_CAN_WRITE;
-    }
-#endif
-    tmp = nc->next;
-    ns_mgr_handle_connection(nc, fd_flags, now);
+static void ns_bandwidth_charge(struct ns_connection *nc, int dir, size_t n) {
+  struct ns_bandwidth *bw = nc->bandwidth;
+
+  if (bw != NULL) {
+    bw->dirs[dir].tokens -= n;
+    if (bw->shared != NULL) bw->shared->dirs[dir].tokens -= n;
   }
+}
 
-  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
-    tmp = nc->next;
-    if ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & NSF_SEND_AND_CLOSE))) {
-      ns_close_conn(nc);
-    }
+int ns_set_bandwidth(struct ns_connection *nc, int dir, double rate,
+                     double burst) {
+  struct ns_byte_bucket *b;
+  double now = ns_time(), resume = 0;
+
+  if ((dir != NS_BANDWIDTH_SEND && dir != NS_BANDWIDTH_RECV) || rate < 0 ||
+      ns_bandwidth_get(nc) == NULL) {
+    return -1;
+  }
+  b = &nc->bandwidth->dirs[dir];
+  if (burst <= 0) burst = rate / 10;
+  if (burst < 1) burst = 1;
+  if (b->rate > 0) {
+    /* Adjusting: refill at the old rate, keep any debt */
+    ns_byte_bucket_avail(b, now, 0, &resume);
+    if (b->tokens > burst) b->tokens = burst;
+  } else {
+    b->tokens = burst;
   }
+  b->rate = rate;
+  b->burst = burst;
+  b->last = now;
 
-  return now;
+  return 0;
 }
 
-#endif
-
-/*
- * Schedules an async connect for a resolved address and proto.
- * Called from two places: `ns_connect_opt()` and from async resolver.
- * When called from the async resolver, it must trigger `NS_CONNECT` event
- * with a failure flag to indicate connection failure.
- */
-NS_INTERNAL struct ns_connection *ns_finish_connect(struct ns_connection *nc,
-                                                    int proto,
-                                                    union socket_address *sa,
-                                                    struct ns_add_sock_opts o) {
+static struct ns_connection *accept_conn(struct ns_connection *ls) {
+  struct ns_connection *c = NULL;
+  struct ns_rate_limit *rl = ls->rate_limit[NS_RATE_LIMIT_CONNECTIONS];
+  union socket_address sa;
+  socklen_t len = sizeof(sa);
   sock_t sock = INVALID_SOCKET;
-  int rc;
+  double now = 0, wait = 0;
 
-  DBG(("%p %s://%s:%hu", nc, proto == SOCK_DGRAM ? "udp" : "tcp",
-       inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
+  /* Unix domain peers are usually unnamed: accept() fills in the family only */
+  memset(&sa, 0, sizeof(sa));
 
-  if ((sock = socket(AF_INET, proto, 0)) == INVALID_SOCKET) {
-    int failure = errno;
-    NS_SET_PTRPTR(o.error_string, "cannot create socket");
-    if (nc->flags & NSF_CONNECTING) {
-      ns_call(nc, NS_CONNECT, &failure);
+  /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
+  if ((sock = accept(ls->sock, &sa.sa, &len)) == INVALID_SOCKET) {
+  } else if (!ns_ip_acl_check(ls->ip_acl, &sa)) {
+    /* Denied before anything is allocated for the connection */
+    DBG(("%p %d denied by ACL", ls, sock));
+    closesocket(sock);
+  } else if (rl != NULL &&
+             (wait = ns_rate_limit_take_addr(rl, &sa, now = ns_time())) > 0 &&
+             rl->opts.action != NS_RATE_LIMIT_DELAY) {
+    DBG(("%p %d rate limited", ls, sock));
+    closesocket(sock);
+  } else if ((c = ns_add_sock(ls->mgr, sock, ls->handler)) == NULL) {
+    closesocket(sock);
+#ifdef NS_ENABLE_SSL
+  } else if (ls->ssl_ctx != NULL && ((c->ssl = SSL_new(ls->ssl_ctx)) == NULL ||
+                                     SSL_set_fd(c->ssl, sock) != 1)) {
+    DBG(("SSL error"));
+    ns_close_conn(c);
+    c = NULL;
+#endif
+  } else {
+    c->listener = ls;
+    c->proto_data = ls->proto_data;
+    c->proto_handler = ls->proto_handler;
+    c->user_data = ls->user_data;
+    c->recv_mbuf_limit = ls->recv_mbuf_limit;
+    c->recv_budget = ls->recv_budget;
+    c->sa = sa;
+    ns_set_tcp_defaults(sock, &sa);
+    if (ls->zerocopy != NULL && ls->zerocopy->threshold > 0) {
+      ns_set_zerocopy(c, ls->zerocopy->threshold);
+    }
+    ns_set_rate_limit(c, NS_RATE_LIMIT_MESSAGES,
+                      ls->rate_limit[NS_RATE_LIMIT_MESSAGES]);
+    if (ls->bandwidth != NULL && ns_bandwidth_get(c) != NULL) {
+      c->bandwidth->shared = ls->bandwidth;
+      ls->bandwidth->refs++;
+    }
+    if (wait > 0) c->recv_resume_time = now + wait;
+    if (c->ssl == NULL) { /* SSL connections need to perform handshake. */
+      ns_call(c, NS_ACCEPT, &sa);
     }
-    ns_destroy_conn(nc);
-    return NULL;
+    DBG(("%p %d %p %p", c, c->sock, c->ssl_ctx, c->ssl));
   }
 
-#ifndef NS_CC3200
-  ns_set_non_blocking_mode(sock);
+  return c;
+}
+
+static int ns_is_error(int n) {
+#ifdef NS_CC3200
+  DBG(("n = %d, errno = %d", n, errno));
+  if (n < 0) errno = n;
+#endif
+  return n == 0 || (n < 0 && errno != EINTR && errno != EINPROGRESS &&
+                    errno != EAGAIN && errno != EWOULDBLOCK
+#ifdef NS_CC3200
+                    && errno != SL_EALREADY
+#endif
+#ifdef _WIN32
+                    && WSAGetLastError() != WSAEINTR &&
+                    WSAGetLastError() != WSAEWOULDBLOCK
 #endif
-  rc = (proto == SOCK_DGRAM) ? 0 : connect(sock, &sa->sa, sizeof(sa->sin));
+                    );
+}
 
-  if (rc != 0 && ns_is_error(rc)) {
-    NS_SET_PTRPTR(o.error_string, "cannot connect to socket");
-    if (nc->flags & NSF_CONNECTING) {
-      ns_call(nc, NS_CONNECT, &rc);
-    }
-    ns_destroy_conn(nc);
-    close(sock);
-    return NULL;
-  }
+static size_t recv_avail_size(struct ns_connection *conn, size_t max) {
+  size_t avail;
+  /* Paused by a handler, e.g. the rate limit */
+  if (conn->recv_resume_time != 0) return 0;
+  if (conn->recv_mbuf_limit < conn->recv_mbuf.len) return 0;
+  avail = conn->recv_mbuf_limit - conn->recv_mbuf.len;
+  return avail > max ? max : avail;
+}
 
-  /* Fire NS_CONNECT on next poll. */
-  nc->flags |= NSF_CONNECTING;
+#ifdef NS_WORKERS
+struct ns_workers {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* Jobs to do, or stop */
+  pthread_cond_t idle; /* num_busy dropped to 0 */
+  struct ns_job *todo, **todo_tail;
+  struct ns_job *done;
+  int num_busy; /* Jobs queued or running */
+  int stop;
+  int num_threads;
+  pthread_t *threads;
+  sock_t wake[2]; /* A byte to wake[0] tells the loop that jobs are done */
+};
 
-  /* No ns_destroy_conn() call after this! */
-  ns_set_sock(nc, sock);
+static void *ns_worker(void *param) {
+  struct ns_workers *w = (struct ns_workers *) param;
+  struct ns_job *job;
 
-#ifdef NS_ENABLE_SSL
-  /*
-   * If we are using async resolver, socket isn't open
-   * before this place, so
-   * for SSL connections we have to add socket to SSL fd set
-   */
-  if (nc->ssl != NULL && !(nc->flags & NSF_LISTENING)) {
-    SSL_set_fd(nc->ssl, nc->sock);
-  }
-#endif
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->todo == NULL && !w->stop) pthread_cond_wait(&w->work, &w->lock);
+    if ((job = w->todo) == NULL) break;
+    if ((w->todo = job->next) == NULL) w->todo_tail = &w->todo;
+    pthread_mutex_unlock(&w->lock);
 
-  return nc;
+    job->run(job);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->done == NULL) (void) NS_SEND_FUNC(w->wake[0], "", 1, 0);
+    job->next = w->done;
+    w->done = job;
+    if (--w->num_busy == 0) pthread_cond_broadcast(&w->idle);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
 }
 
-#ifndef NS_DISABLE_RESOLVER
-/*
- * Callback for the async resolver on ns_connect_opt() call.
- * Main task of this function is to trigger NS_CONNECT event with
- *    either failure (and dealloc the connection)
- *    or success (and proceed with connect()
- */
-static void resolve_cb(struct ns_dns_message *msg, void *data) {
-  struct ns_connection *nc = (struct ns_connection *) data;
-  int i;
-  int failure = -1;
+/* Finish the jobs that are done */
+static void ns_workers_handler(struct ns_connection *nc, int ev, void *p) {
+  struct ns_workers *w = (struct ns_workers *) nc->user_data;
+  struct ns_job *job, *done;
 
-  if (msg != NULL) {
-    /*
-     * Take the first DNS A answer and run...
-     */
-    for (i = 0; i < msg->num_answers; i++) {
-      if (msg->answers[i].rtype == NS_DNS_A_RECORD) {
-        static struct ns_add_sock_opts opts;
-        /*
-         * Async resolver guarantees that there is at least one answer.
-         * TODO(lsm): handle IPv6 answers too
-         */
-        ns_dns_parse_record_data(msg, &msg->answers[i], &nc->sa.sin.sin_addr,
-                                 4);
-        /* Make ns_finish_connect() trigger NS_CONNECT on failure */
-        nc->flags |= NSF_CONNECTING;
-        ns_finish_connect(nc, nc->flags & NSF_UDP ? SOCK_DGRAM : SOCK_STREAM,
-                          &nc->sa, opts);
-        return;
-      }
-    }
+  (void) p;
+  if (ev != NS_RECV) return;
+  mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+
+  pthread_mutex_lock(&w->lock);
+  done = w->done;
+  w->done = NULL;
+  pthread_mutex_unlock(&w->lock);
+
+  while ((job = done) != NULL) {
+    done = job->next;
+    job->done(job);
   }
+}
 
-  /*
-   * If we get there was no NS_DNS_A_RECORD in the answer
-   */
-  ns_call(nc, NS_CONNECT, &failure);
-  ns_destroy_conn(nc);
+NS_INTERNAL int ns_workers_add(struct ns_workers *w, struct ns_job *job) {
+  if (w == NULL) return -1;
+  job->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  *w->todo_tail = job;
+  w->todo_tail = &job->next;
+  w->num_busy++;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  return 0;
 }
-#endif
 
-struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
-                                 ns_event_handler_t callback) {
-  static struct ns_connect_opts opts;
-  return ns_connect_opt(mgr, address, callback, opts);
+#ifdef NS_SSL_WORKERS
+/* Wait for the workers to finish their jobs */
+static void ns_workers_quiesce(struct ns_workers *w) {
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  while (w->num_busy > 0) pthread_cond_wait(&w->idle, &w->lock);
+  pthread_mutex_unlock(&w->lock);
 }
+#endif
 
-struct ns_connection *ns_connect_opt(struct ns_mgr *mgr, const char *address,
-                                     ns_event_handler_t callback,
-                                     struct ns_connect_opts opts) {
-  struct ns_connection *nc = NULL;
-  int proto, rc;
-  struct ns_add_sock_opts add_sock_opts;
-  char host[NS_MAX_HOST_LEN];
+static void ns_workers_free(struct ns_workers *w) {
+  struct ns_job *job;
+  int i;
 
-  NS_COPY_COMMON_CONNECTION_OPTIONS(&add_sock_opts, &opts);
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->num_threads; i++) pthread_join(w->threads[i], NULL);
+
+  while ((job = w->done) != NULL) {
+    w->done = job->next;
+    job->nc = NULL;
+    job->done(job);
+  }
+  /* wake[1] belongs to a connection, closed with the others */
+  closesocket(w->wake[0]);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->idle);
+  NS_FREE(w->threads);
+  NS_FREE(w);
+}
+
+static struct ns_workers *ns_workers_new(struct ns_mgr *mgr, int num_threads) {
+  struct ns_workers *w;
+  struct ns_connection *nc;
 
-  if ((nc = ns_create_connection(mgr, callback, add_sock_opts)) == NULL) {
+  if (num_threads <= 0 ||
+      (w = (struct ns_workers *) NS_CALLOC(1, sizeof(*w))) == NULL) {
     return NULL;
-  } else if ((rc = ns_parse_address(address, &nc->sa, &proto, host,
-                                    sizeof(host))) < 0) {
-    /* Address is malformed */
-    NS_SET_PTRPTR(opts.error_string, "cannot parse address");
-    ns_destroy_conn(nc);
+  } else if ((w->threads = (pthread_t *) NS_CALLOC(
+                  num_threads, sizeof(*w->threads))) == NULL ||
+             !ns_socketpair(w->wake, SOCK_STREAM)) {
+    NS_FREE(w->threads);
+    NS_FREE(w);
+    return NULL;
+  } else if ((nc = ns_add_sock(mgr, w->wake[1], ns_workers_handler)) ==
+             NULL) {
+    closesocket(w->wake[0]);
+    closesocket(w->wake[1]);
+    NS_FREE(w->threads);
+    NS_FREE(w);
     return NULL;
   }
-  nc->flags |= opts.flags & _NS_ALLOWED_CONNECT_FLAGS_MASK;
-  nc->flags |= (proto == SOCK_DGRAM) ? NSF_UDP : 0;
-  nc->user_data = opts.user_data;
-
-  if (rc == 0) {
-#ifndef NS_DISABLE_RESOLVER
-    /*
-     * DNS resolution is required for host.
-     * ns_parse_address() fills port in nc->sa, which we pass to resolve_cb()
-     */
-    if (ns_resolve_async(nc->mgr, host, NS_DNS_A_RECORD, resolve_cb, nc) != 0) {
-      NS_SET_PTRPTR(opts.error_string, "cannot schedule DNS lookup");
-      ns_destroy_conn(nc);
-      return NULL;
-    }
 
-    return nc;
-#else
-    NS_SET_PTRPTR(opts.error_string, "Resolver is disabled");
-    ns_destroy_conn(nc);
+  nc->user_data = w;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->idle, NULL);
+  w->todo_tail = &w->todo;
+  while (w->num_threads < num_threads &&
+         pthread_create(&w->threads[w->num_threads], NULL, ns_worker, w) ==
+             0) {
+    w->num_threads++;
+  }
+  if (w->num_threads == 0) {
+    ns_workers_free(w);
     return NULL;
-#endif
-  } else {
-    /* Address is parsed and resolved to IP. proceed with connect() */
-    return ns_finish_connect(nc, proto, &nc->sa, add_sock_opts);
   }
+  return w;
 }
 
-struct ns_connection *ns_bind(struct ns_mgr *srv, const char *address,
-                              ns_event_handler_t event_handler) {
-  static struct ns_bind_opts opts;
-  return ns_bind_opt(srv, address, event_handler, opts);
+int ns_offload_file_io(struct ns_mgr *mgr, int num_threads) {
+  if (mgr->file_workers != NULL) return -1;
+  mgr->file_workers = ns_workers_new(mgr, num_threads);
+  return mgr->file_workers == NULL ? -1 : 0;
+}
+#else
+int ns_offload_file_io(struct ns_mgr *mgr, int num_threads) {
+  (void) mgr;
+  (void) num_threads;
+  return -1;
 }
+#endif /* NS_WORKERS */
 
-struct ns_connection *ns_bind_opt(struct ns_mgr *mgr, const char *address,
-                                  ns_event_handler_t callback,
-                                  struct ns_bind_opts opts) {
-  union socket_address sa;
-  struct ns_connection *nc = NULL;
-  int proto;
-  sock_t sock;
-  struct ns_add_sock_opts add_sock_opts;
-  char host[NS_MAX_HOST_LEN];
+#ifdef NS_ENABLE_SSL
+/* Apply the result of a handshake step, `ssl_err` is from SSL_get_error() */
+static void ns_ssl_handshake_result(struct ns_connection *nc, int res,
+                                    int ssl_err) {
+  int server_side = nc->listener != NULL;
 
-  NS_COPY_COMMON_CONNECTION_OPTIONS(&add_sock_opts, &opts);
+  if (res == 1) {
+    nc->flags |= NSF_SSL_HANDSHAKE_DONE;
+    nc->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
 
-  if (ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0) {
-    NS_SET_PTRPTR(opts.error_string, "cannot parse address");
-  } else if ((sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
-    DBG(("Failed to open listener: %d", errno));
-    NS_SET_PTRPTR(opts.error_string, "failed to open listener");
-  } else if ((nc = ns_add_sock_opt(mgr, sock, callback, add_sock_opts)) ==
-             NULL) {
-    /* opts.error_string set by ns_add_sock_opt */
-    DBG(("Failed to ns_add_sock"));
-    closesocket(sock);
+#ifdef NS_SSL_OPENSSL_1_1
+    if (!server_side && nc->mgr->ssl_clients != NULL) {
+      nc->mgr->ssl_clients->stats.handshakes++;
+      if (SSL_session_reused(nc->ssl)) nc->mgr->ssl_clients->stats.resumed++;
+    }
+#endif
+    if (server_side) {
+      union socket_address sa;
+      socklen_t sa_len = sizeof(sa);
+      /* In case port was set to 0, get the real port number */
+      (void) getsockname(nc->sock, &sa.sa, &sa_len);
+      ns_call(nc, NS_ACCEPT, &sa);
+    }
   } else {
-    nc->sa = sa;
-    nc->handler = callback;
-
-    if (proto == SOCK_DGRAM) {
-      nc->flags |= NSF_UDP;
-    } else {
-      nc->flags |= NSF_LISTENING;
+    if (ssl_err == SSL_ERROR_WANT_READ) nc->flags |= NSF_WANT_READ;
+    if (ssl_err == SSL_ERROR_WANT_WRITE) nc->flags |= NSF_WANT_WRITE;
+    if (ssl_err != SSL_ERROR_WANT_READ && ssl_err != SSL_ERROR_WANT_WRITE) {
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
     }
-
-    DBG(("%p sock %d/%d", nc, sock, proto));
   }
+}
 
-  return nc;
+#ifdef NS_SSL_WORKERS
+/* A handshake step of an accepted connection */
+struct ns_ssl_job {
+  struct ns_job job;
+  int res, ssl_err; /* Results of SSL_accept() and SSL_get_error() */
+};
+
+static void ns_ssl_job_run(struct ns_job *job) {
+  struct ns_ssl_job *sj = (struct ns_ssl_job *) job;
+
+  /* The loop leaves the connection alone until the job is done */
+  ERR_clear_error();
+  sj->res = SSL_accept(job->nc->ssl);
+  sj->ssl_err = SSL_get_error(job->nc->ssl, sj->res);
 }
 
-struct ns_connection *ns_add_sock(struct ns_mgr *s, sock_t sock,
-                                  ns_event_handler_t callback) {
-  static struct ns_add_sock_opts opts;
-  return ns_add_sock_opt(s, sock, callback, opts);
+/* Resume the connection */
+static void ns_ssl_job_done(struct ns_job *job) {
+  struct ns_ssl_job *sj = (struct ns_ssl_job *) job;
+
+  if (job->nc != NULL) {
+    job->nc->flags &= ~NSF_SSL_BUSY;
+    ns_ssl_handshake_result(job->nc, sj->res, sj->ssl_err);
+  }
+  NS_FREE(sj);
 }
 
-struct ns_connection *ns_add_sock_opt(struct ns_mgr *s, sock_t sock,
-                                      ns_event_handler_t callback,
-                                      struct ns_add_sock_opts opts) {
-  struct ns_connection *nc = ns_create_connection(s, callback, opts);
-  if (nc != NULL) {
-    ns_set_sock(nc, sock);
+/* Queue the next handshake step of an accepted connection */
+static int ns_ssl_workers_add(struct ns_connection *nc) {
+  struct ns_ssl_job *sj;
+
+  if (nc->mgr->ssl_workers == NULL ||
+      (sj = (struct ns_ssl_job *) NS_CALLOC(1, sizeof(*sj))) == NULL) {
+    return -1;
   }
-  return nc;
+  sj->job.nc = nc;
+  sj->job.run = ns_ssl_job_run;
+  sj->job.done = ns_ssl_job_done;
+  nc->flags |= NSF_SSL_BUSY;
+  return ns_workers_add(nc->mgr->ssl_workers, &sj->job);
 }
 
-struct ns_connection *ns_next(struct ns_mgr *s, struct ns_connection *conn) {
-  return conn == NULL ? s->active_connections : conn->next;
+int ns_ssl_offload_handshakes(struct ns_mgr *mgr, int num_threads) {
+  if (mgr->ssl_workers != NULL) return -1;
+  mgr->ssl_workers = ns_workers_new(mgr, num_threads);
+  return mgr->ssl_workers == NULL ? -1 : 0;
+}
+#else
+int ns_ssl_offload_handshakes(struct ns_mgr *mgr, int num_threads) {
+  (void) mgr;
+  (void) num_threads;
+  return -1;
 }
+#endif /* NS_SSL_WORKERS */
 
-void ns_broadcast(struct ns_mgr *mgr, ns_event_handler_t cb, void *data,
-                  size_t len) {
-  struct ctl_msg ctl_msg;
+static void ns_ssl_begin(struct ns_connection *nc) {
+  int server_side = nc->listener != NULL;
+  int res;
 
-  /*
-   * Fossa manager has a socketpair, `struct ns_mgr::ctl`,
-   * where `ns_broadcast()` pushes the message.
-   * `ns_mgr_poll()` wakes up, reads a message from the socket pair, and calls
-   * specified callback for each connection. Thus the callback function executes
-   * in event manager thread.
-   */
-  if (mgr->ctl[0] != INVALID_SOCKET && data != NULL &&
-      len < sizeof(ctl_msg.message)) {
-    ctl_msg.callback = cb;
-    memcpy(ctl_msg.message, data, len);
-    NS_SEND_FUNC(mgr->ctl[0], (char *) &ctl_msg,
-                 offsetof(struct ctl_msg, message) + len, 0);
-    NS_RECV_FUNC(mgr->ctl[0], (char *) &len, 1, 0);
+#ifdef NS_SSL_WORKERS
+  if (nc->flags & NSF_SSL_BUSY) return;
+  if (server_side && ns_ssl_workers_add(nc) == 0) return;
+#endif
+#ifdef NS_SSL_OPENSSL_1_1
+  if (!server_side && SSL_get_session(nc->ssl) == NULL) {
+    ns_ssl_client_resume(nc);
   }
+#endif
+  res = server_side ? SSL_accept(nc->ssl) : SSL_connect(nc->ssl);
+  ns_ssl_handshake_result(nc, res,
+                          res == 1 ? SSL_ERROR_NONE : SSL_get_error(nc->ssl,
+                                                                    res));
 }
+#endif /* NS_ENABLE_SSL */
 
-static int isbyte(int n) {
-  return n >= 0 && n <= 255;
-}
-
-static int parse_net(const char *spec, uint32_t *net, uint32_t *mask) {
-  int n, a, b, c, d, slash = 32, len = 0;
+#ifdef NS_ENABLE_SPLICE
+static struct ns_splice *ns_splice_new(struct ns_connection *peer) {
+  struct ns_splice *sp = (struct ns_splice *) NS_CALLOC(1, sizeof(*sp));
+  int size;
 
-  if ((sscanf(spec, "%d.%d.%d.%d/%d%n", &a, &b, &c, &d, &slash, &n) == 5 ||
-       sscanf(spec, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) == 4) &&
-      isbyte(a) && isbyte(b) && isbyte(c) && isbyte(d) && slash >= 0 &&
-      slash < 33) {
-    len = n;
-    *net =
-        ((uint32_t) a << 24) | ((uint32_t) b << 16) | ((uint32_t) c << 8) | d;
-    *mask = slash ? 0xffffffffU << (32 - slash) : 0;
+  if (sp == NULL) return NULL;
+  if (pipe(sp->fds) != 0) {
+    NS_FREE(sp);
+    return NULL;
   }
+  /* Fewer, larger splices. The default size is fine if it's not allowed. */
+  fcntl(sp->fds[1], F_SETPIPE_SZ, NS_SPLICE_PIPE_SIZE);
+  size = fcntl(sp->fds[1], F_GETPIPE_SZ);
+  sp->size = size > 0 ? (size_t) size : 65536;
+  sp->peer = peer;
 
-  return len;
+  return sp;
 }
 
-int ns_check_ip_acl(const char *acl, uint32_t remote_ip) {
-  int allowed, flag;
-  uint32_t net, mask;
-  struct ns_str vec;
-
-  /* If any ACL is set, deny by default */
-  allowed = (acl == NULL || *acl == '\0') ? '+' : '-';
+int ns_splice(struct ns_connection *a, struct ns_connection *b) {
+  struct ns_connection *c[2];
+  int i;
 
-  while ((acl = ns_next_comma_list_entry(acl, &vec, NULL)) != NULL) {
-    flag = vec.p[0];
-    if ((flag != '+' && flag != '-') ||
-        parse_net(&vec.p[1], &net, &mask) == 0) {
+  c[0] = a;
+  c[1] = b;
+  for (i = 0; i < 2; i++) {
+    if (a == b || c[i]->mgr != a->mgr || c[i]->splice != NULL ||
+        c[i]->ssl != NULL || (c[i]->flags & (NSF_UDP | NSF_LISTENING))) {
       return -1;
     }
-
-    if (net == (remote_ip & mask)) {
-      allowed = flag;
-    }
   }
+  if ((a->splice = ns_splice_new(b)) == NULL) return -1;
+  if ((b->splice = ns_splice_new(a)) == NULL) {
+    a->splice->peer = NULL;
+    ns_splice_free(a);
+    return -1;
+  }
+  ns_forward(a, b);
+  ns_forward(b, a);
 
-  return allowed == '+';
-}
-
-/* Move data from one connection to another */
-void ns_forward(struct ns_connection *from, struct ns_connection *to) {
-  ns_send(to, from->recv_mbuf.buf, from->recv_mbuf.len);
-  mbuf_remove(&from->recv_mbuf, from->recv_mbuf.len);
+  return 0;
 }
-#ifdef NS_MODULE_LINES
-#line 1 "src/multithreading.c"
-/**/
-#endif
-/*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
- */
-
-/* Amalgamated: #include "internal.h" */
 
-#ifdef NS_ENABLE_THREADS
+static void ns_splice_free(struct ns_connection *nc) {
+  struct ns_splice *sp = nc->splice;
 
-static void multithreaded_ev_handler(struct ns_connection *c, int ev, void *p);
+  if (sp == NULL) return;
+  if (sp->peer != NULL) {
+    /* The peer sends what it has got and follows */
+    sp->peer->splice->peer = NULL;
+    sp->peer->flags |= NSF_SEND_AND_CLOSE;
+  }
+  close(sp->fds[0]);
+  close(sp->fds[1]);
+  NS_FREE(sp);
+  nc->splice = NULL;
+}
 
-/*
- * This thread function executes user event handler.
- * It runs an event manager that has only one connection, until that
- * connection is alive.
- */
-static void *per_connection_thread_function(void *param) {
-  struct ns_connection *c = (struct ns_connection *) param;
-  struct ns_mgr m;
+/* Move received data to the pipe of the peer, up to `budget` bytes */
+static void ns_splice_in(struct ns_connection *nc, size_t budget) {
+  struct ns_splice *sp = nc->splice->peer->splice;
+  size_t len;
+  int n = 0;
 
-  ns_mgr_init(&m, NULL);
-  ns_add_conn(&m, c);
-  while (m.active_connections != NULL) {
-    ns_mgr_poll(&m, 1000);
+  while (budget > 0 && sp->len < sp->size) {
+    len = sp->size - sp->len < budget ? sp->size - sp->len : budget;
+    n = (int) splice(nc->sock, NULL, sp->fds[1], NULL, len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) break;
+    DBG(("%p %d bytes <- %d (splice)", nc, n, nc->sock));
+    sp->len += n;
+    budget -= n;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_RECV, n);
+    ns_call(nc, NS_RECV, &n);
+  }
+
+  if (n > 0 && budget == 0) {
+    nc->flags |= NSF_READ_PENDING; /* See ns_read_from_socket() */
+  } else if (n == 0 && sp->len < sp->size) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY; /* EOF */
+  } else if (n < 0 && ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
   }
-  ns_mgr_free(&m);
-
-  return param;
+  /*
+   * The pipe holds a number of pages rather than bytes, and can get full
+   * before `size` bytes if the socket gives partial pages. The socket
+   * might just be empty too, but either way the peer drains the pipe,
+   * and then reading resumes.
+   */
+  if (sp->len >= sp->size || (n < 0 && sp->len > 0)) sp->full = 1;
 }
 
-static void link_conns(struct ns_connection *c1, struct ns_connection *c2) {
-  c1->priv_2 = c2;
-  c2->priv_2 = c1;
-}
+/* Send some of the pipe, called when the output buffer is empty */
+static void ns_splice_out(struct ns_connection *nc) {
+  struct ns_splice *sp = nc->splice;
+  double resume = 0;
+  size_t len;
+  int n;
 
-static void unlink_conns(struct ns_connection *c) {
-  struct ns_connection *peer = (struct ns_connection *) c->priv_2;
-  if (peer != NULL) {
-    peer->flags |= NSF_SEND_AND_CLOSE;
-    peer->priv_2 = NULL;
+  len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, sp->len, &resume);
+  if (len == 0) {
+    nc->send_resume_time = resume;
+    return;
   }
-  c->priv_2 = NULL;
+  n = (int) splice(sp->fds[0], NULL, nc->sock, NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  DBG(("%p %d bytes -> %d (splice)", nc, n, nc->sock));
+  if (n > 0) {
+    sp->len -= n;
+    sp->full = 0;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+    ns_call(nc, NS_SEND, &n);
+  } else if (ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+#else
+static void ns_splice_free(struct ns_connection *nc) {
+  (void) nc;
 }
+#endif
 
-static void forwarder_ev_handler(struct ns_connection *c, int ev, void *p) {
-  (void) p;
-  if (ev == NS_RECV && c->priv_2) {
-    ns_forward(c, c->priv_2);
-  } else if (ev == NS_CLOSE) {
-    unlink_conns(c);
+#ifdef NS_ENABLE_ZEROCOPY
+static void ns_zerocopy_free(struct ns_connection *nc) {
+  struct ns_zc_buf *zb, *next;
+
+  if (nc->zerocopy == NULL) return;
+  for (zb = nc->zerocopy->bufs; zb != NULL; zb = next) {
+    next = zb->next;
+    MBUF_FREE(zb->buf);
+    NS_FREE(zb);
   }
+  NS_FREE(nc->zerocopy);
+  nc->zerocopy = NULL;
 }
 
-static void spawn_handling_thread(struct ns_connection *nc) {
-  struct ns_mgr dummy = {};
-  sock_t sp[2];
-  struct ns_connection *c[2];
-
-  /*
-   * Create a socket pair, and wrap each socket into the connection with
-   * dummy event manager.
-   * c[0] stays in this thread, c[1] goes to another thread.
-   */
-  ns_socketpair(sp, SOCK_STREAM);
-  c[0] = ns_add_sock(&dummy, sp[0], forwarder_ev_handler);
-  c[1] = ns_add_sock(&dummy, sp[1], nc->listener->priv_1);
+/* Free the buffers that are sent and that the kernel is done with */
+static void ns_zerocopy_gc(struct ns_zerocopy *zc) {
+  struct ns_zc_buf *zb, **p = &zc->bufs;
 
-  /* Interlink client connection with c[0] */
-  link_conns(c[0], nc);
+  while ((zb = *p) != NULL) {
+    if (zb->sent == zb->len && zb->pending == 0) {
+      *p = zb->next;
+      MBUF_FREE(zb->buf);
+      NS_FREE(zb);
+    } else {
+      p = &zb->next;
+    }
+  }
+}
+
+/* Read zero-copy completions from the socket error queue */
+static void ns_zerocopy_reap(struct ns_connection *nc) {
+  struct ns_zerocopy *zc = nc->zerocopy;
+  /* Same layout as struct sock_extended_err from <linux/errqueue.h> */
+  struct {
+    uint32_t ee_errno;
+    uint8_t ee_origin, ee_type, ee_code, ee_pad;
+    uint32_t ee_info, ee_data; /* Range of completed sends */
+  } ee;
+  union {
+    struct cmsghdr align;
+    char buf[128];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct ns_zc_buf *zb;
+  uint32_t id;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(nc->sock, &msg, MSG_ERRQUEUE) < 0) break;
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_len < CMSG_LEN(sizeof(ee))) continue;
+      memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+      if (ee.ee_errno != 0 || ee.ee_origin != NS_EE_ORIGIN_ZEROCOPY) continue;
+      DBG(("%p zero-copy sends %u-%u done, code %d", nc, ee.ee_info,
+           ee.ee_data, ee.ee_code));
+      if (ee.ee_code & NS_EE_CODE_ZEROCOPY_COPIED) zc->copied = 1;
+      id = ee.ee_info;
+      do {
+        for (zb = zc->bufs; zb != NULL; zb = zb->next) {
+          if ((uint32_t)(id - zb->first_id) < zb->num_ids) {
+            zb->pending--;
+            break;
+          }
+        }
+      } while (id++ != ee.ee_data);
+    }
+  }
+  ns_zerocopy_gc(zc);
+}
 
-  /*
-   * Switch c[0] manager from the dummy one to the real one. c[1] manager
-   * will be set in another thread, allocated on stack of that thread.
-   */
-  ns_add_conn(nc->mgr, c[0]);
+/*
+ * Send from the buffer taken over for zero-copy sends, or take over the
+ * output buffer if it's large enough. Return 0 to send it as usual.
+ */
+static int ns_zerocopy_write(struct ns_connection *nc) {
+  struct ns_zerocopy *zc = nc->zerocopy;
+  struct mbuf *io = &nc->send_mbuf;
+  struct ns_zc_buf *zb;
+  double resume = 0;
+  size_t len;
+  int n, flags = MSG_ZEROCOPY;
 
-  /*
-   * Dress c[1] as nc.
-   * TODO(lsm): code in accept_conn() looks similar. Refactor.
-   */
-  c[1]->listener = nc->listener;
-  c[1]->proto_handler = nc->proto_handler;
-  c[1]->proto_data = nc->proto_data;
-  c[1]->user_data = nc->user_data;
+  if (zc->unsent == 0) {
+    if (zc->copied || zc->threshold == 0 || io->len < zc->threshold ||
+        nc->ssl != NULL ||
+        (zb = (struct ns_zc_buf *) NS_CALLOC(1, sizeof(*zb))) == NULL) {
+      return 0;
+    }
+    /* Data sent from now on goes to a new buffer */
+    zb->buf = io->buf;
+    zb->len = zc->unsent = io->len;
+    zb->first_id = zc->next_id;
+    zb->next = zc->bufs;
+    zc->bufs = zb;
+    mbuf_init(io, 0);
+  }
+  zb = zc->bufs;
 
-  ns_start_thread(per_connection_thread_function, c[1]);
-}
+  len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, zc->unsent, &resume);
+  if (len == 0) {
+    nc->send_resume_time = resume;
+    return 1;
+  }
+  n = (int) send(nc->sock, zb->buf + zb->sent, len, flags);
+  if (n < 0 && errno == ENOBUFS) {
+    /* Over the limit of pinned memory, copy this time */
+    flags = 0;
+    n = (int) send(nc->sock, zb->buf + zb->sent, len, flags);
+  }
+  DBG(("%p %d bytes -> %d (zero-copy %d)", nc, n, nc->sock, flags != 0));
 
-static void multithreaded_ev_handler(struct ns_connection *c, int ev, void *p) {
-  (void) p;
-  if (ev == NS_ACCEPT) {
-    spawn_handling_thread(c);
-    c->handler = forwarder_ev_handler;
+  if (ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    /* The kernel numbers the zero-copy sends that succeed */
+    if (flags != 0) {
+      zb->num_ids++;
+      zb->pending++;
+      zc->next_id++;
+    }
+    zb->sent += n;
+    zc->unsent -= n;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+    ns_zerocopy_gc(zc);
   }
-}
+  ns_call(nc, NS_SEND, &n);
 
-void ns_enable_multithreading(struct ns_connection *nc) {
-  /* Wrap user event handler into our multithreaded_ev_handler */
-  nc->priv_1 = nc->handler;
-  nc->handler = multithreaded_ev_handler;
+  return 1;
+}
+#else
+static void ns_zerocopy_free(struct ns_connection *nc) {
+  (void) nc;
 }
 #endif
-#ifdef NS_MODULE_LINES
-#line 1 "src/http.c"
-/**/
-#endif
-/*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
- */
 
-#ifndef NS_DISABLE_HTTP
+static void ns_read_from_socket(struct ns_connection *conn) {
+  char buf[NS_READ_BUFFER_SIZE];
+  int n = 0, to_recv;
+  size_t budget;
+  double resume = 0;
 
-/* Amalgamated: #include "internal.h" */
+  if (conn->flags & NSF_CONNECTING) {
+    int ok = 1, ret;
+#ifndef NS_CC3200
+    socklen_t len = sizeof(ok);
+#endif
 
-enum http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT, DATA_CGI };
+    (void) ret;
+#ifdef NS_CC3200
+    /* On CC3200 we use blocking connect. If we got as far as this,
+     * this means connect() was successful.
+     * TODO(rojer): Figure out why it fails where blocking succeeds.
+     */
+    ns_set_non_blocking_mode(conn->sock);
+    ret = ok = 0;
+#else
+    ret = getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char *) &ok, &len);
+#endif
+#ifdef NS_ENABLE_SSL
+    if (ret == 0 && ok == 0 && conn->ssl != NULL) {
+      ns_ssl_begin(conn);
+    }
+#endif
+    DBG(("%p connect ok=%d", conn, ok));
+    if (ok != 0) {
+      conn->flags |= NSF_CLOSE_IMMEDIATELY;
+    } else {
+      conn->flags &= ~NSF_CONNECTING;
+    }
+    ns_call(conn, NS_CONNECT, &ok);
+    return;
+  }
 
-struct proto_data_http {
-  FILE *fp;         /* Opened file. */
-  int64_t cl;       /* Content-Length. How many bytes to send. */
-  int64_t sent;     /* How many bytes have been already sent. */
-  int64_t body_len; /* How many bytes of chunked body was reassembled. */
-  struct ns_connection *cgi_nc;
-  enum http_proto_data_type type;
-};
+  conn->flags &= ~NSF_READ_PENDING;
+  budget = ns_bandwidth_avail(
+      conn, NS_BANDWIDTH_RECV,
+      conn->recv_budget > 0 ? conn->recv_budget : (size_t) ~0, &resume);
+  if (budget == 0) {
+    /* Over the receive rate, see ns_set_bandwidth() */
+    conn->recv_resume_time = resume;
+    return;
+  }
 
-/*
- * This structure helps to create an environment for the spawned CGI program.
- * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
- * last element must be NULL.
- * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
- * strings must reside in a contiguous buffer. The end of the buffer is
- * marked by two '\0' characters.
- * We satisfy both worlds: we create an envp array (which is vars), all
- * entries are actually pointers inside buf.
- */
-struct cgi_env_block {
-  struct ns_connection *nc;
-  char buf[NS_CGI_ENVIRONMENT_SIZE];       /* Environment buffer */
-  const char *vars[NS_MAX_CGI_ENVIR_VARS]; /* char *envp[] */
-  int len;                                 /* Space taken */
-  int nvars;                               /* Number of variables in envp[] */
-};
+#ifdef NS_ENABLE_SPLICE
+  if (conn->splice != NULL && conn->splice->peer != NULL) {
+    ns_splice_in(conn, budget);
+    return;
+  }
+#endif
 
-#define MIME_ENTRY(_ext, _type) \
-  { _ext, sizeof(_ext) - 1, _type }
-static const struct {
-  const char *extension;
-  size_t ext_len;
-  const char *mime_type;
-} static_builtin_mime_types[] = {
-    MIME_ENTRY("html", "text/html"),
-    MIME_ENTRY("html", "text/html"),
-    MIME_ENTRY("htm", "text/html"),
-    MIME_ENTRY("shtm", "text/html"),
-    MIME_ENTRY("shtml", "text/html"),
-    MIME_ENTRY("css", "text/css"),
-    MIME_ENTRY("js", "application/x-javascript"),
-    MIME_ENTRY("ico", "image/x-icon"),
-    MIME_ENTRY("gif", "image/gif"),
-    MIME_ENTRY("jpg", "image/jpeg"),
-    MIME_ENTRY("jpeg", "image/jpeg"),
-    MIME_ENTRY("png", "image/png"),
-    MIME_ENTRY("svg", "image/svg+xml"),
-    MIME_ENTRY("txt", "text/plain"),
-    MIME_ENTRY("torrent", "application/x-bittorrent"),
-    MIME_ENTRY("wav", "audio/x-wav"),
-    MIME_ENTRY("mp3", "audio/x-mp3"),
-    MIME_ENTRY("mid", "audio/mid"),
-    MIME_ENTRY("m3u", "audio/x-mpegurl"),
-    MIME_ENTRY("ogg", "application/ogg"),
-    MIME_ENTRY("ram", "audio/x-pn-realaudio"),
-    MIME_ENTRY("xml", "text/xml"),
-    MIME_ENTRY("ttf", "application/x-font-ttf"),
-    MIME_ENTRY("json", "application/json"),
-    MIME_ENTRY("xslt", "application/xml"),
-    MIME_ENTRY("xsl", "application/xml"),
-    MIME_ENTRY("ra", "audio/x-pn-realaudio"),
-    MIME_ENTRY("doc", "application/msword"),
-    MIME_ENTRY("exe", "application/octet-stream"),
-    MIME_ENTRY("zip", "application/x-zip-compressed"),
-    MIME_ENTRY("xls", "application/excel"),
-    MIME_ENTRY("tgz", "application/x-tar-gz"),
-    MIME_ENTRY("tar", "application/x-tar"),
-    MIME_ENTRY("gz", "application/x-gunzip"),
-    MIME_ENTRY("arj", "application/x-arj-compressed"),
-    MIME_ENTRY("rar", "application/x-rar-compressed"),
-    MIME_ENTRY("rtf", "application/rtf"),
-    MIME_ENTRY("pdf", "application/pdf"),
-    MIME_ENTRY("swf", "application/x-shockwave-flash"),
-    MIME_ENTRY("mpg", "video/mpeg"),
-    MIME_ENTRY("webm", "video/webm"),
-    MIME_ENTRY("mpeg", "video/mpeg"),
-    MIME_ENTRY("mov", "video/quicktime"),
-    MIME_ENTRY("mp4", "video/mp4"),
-    MIME_ENTRY("m4v", "video/x-m4v"),
-    MIME_ENTRY("asf", "video/x-ms-asf"),
-    MIME_ENTRY("avi", "video/x-msvideo"),
-    MIME_ENTRY("bmp", "image/bmp"),
-    {NULL, 0, NULL}};
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL) {
+    if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
+      struct mbuf *io = &conn->recv_mbuf;
+      size_t want;
 
-#ifndef NS_DISABLE_FILESYSTEM
+      /*
+       * Decrypt straight into the receive buffer, up to a whole record at a
+       * time. SSL library may have more bytes ready to read then we ask to
+       * read. Therefore, read in a loop until we read everything. Without
+       * the loop, we skip to the next select() cycle which can just timeout.
+       */
+      while (budget > 0 && conn->recv_resume_time == 0) {
+        want = budget < NS_SSL_MAX_RECORD_SIZE ? budget
+                                               : NS_SSL_MAX_RECORD_SIZE;
+        if (io->size - io->len < want) mbuf_resize(io, io->len + want);
+        if (io->size - io->len < want) want = io->size - io->len;
+        if (want == 0 ||
+            (n = SSL_read(conn->ssl, io->buf + io->len, (int) want)) <= 0) {
+          break;
+        }
+        DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
+        io->len += n;
+        budget -= n;
+        ns_bandwidth_charge(conn, NS_BANDWIDTH_RECV, n);
+        ns_call(conn, NS_RECV, &n);
+      }
+      ns_ssl_err(conn, n);
+    } else {
+      ns_ssl_begin(conn);
+      return;
+    }
+  } else
+#endif
+  {
+    to_recv =
+        recv_avail_size(conn, budget < sizeof(buf) ? budget : sizeof(buf));
+    while (to_recv > 0 &&
+           (n = (int) NS_RECV_FUNC(conn->sock, buf, to_recv, 0)) > 0) {
+      DBG(("%p %d bytes (PLAIN) <- %d", conn, n, conn->sock));
+      budget -= n;
+      ns_bandwidth_charge(conn, NS_BANDWIDTH_RECV, n);
+      mbuf_append(&conn->recv_mbuf, buf, n);
+      ns_call(conn, NS_RECV, &n);
+#ifdef NS_ESP8266
+      /*
+       * TODO(alashkin): ESP/RTOS recv implementation tend to block
+       * even in non-blocking mode, so, break the loop
+       * if received size less than buffer size
+       * and wait for next select()
+       * Some of RTOS specific call missed?
+       */
+      if (to_recv > n) {
+        break;
+      }
+#endif
+      /* Stop at the buffer limit, or at the budget of this poll */
+      to_recv =
+          recv_avail_size(conn, budget < sizeof(buf) ? budget : sizeof(buf));
+    }
+    DBG(("recv returns %d", n));
+  }
 
-static int ns_mkdir(const char *path, uint32_t mode) {
-#ifndef _WIN32
-  return mkdir(path, mode);
+  if (budget == 0 && n > 0) {
+    /*
+     * Out of budget, there might be more to read. Other connections get
+     * their turn first, then the next poll carries on without waiting for
+     * the socket (or the SSL buffer) to signal again.
+     */
+    conn->flags |= NSF_READ_PENDING;
+  }
+
+  if (ns_is_error(n)) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void ns_send_file_free(struct ns_connection *nc) {
+#ifdef NS_ENABLE_SEND_FILE
+  if (nc->send_file != NULL) {
+    close(nc->send_file->fd);
+    NS_FREE(nc->send_file);
+    nc->send_file = NULL;
+  }
 #else
-  (void) mode;
-  return _mkdir(path);
+  (void) nc;
 #endif
 }
 
-static struct ns_str get_mime_type(const char *path, const char *dflt,
-                                   const struct ns_serve_http_opts *opts) {
-  const char *ext, *overrides;
-  size_t i, path_len;
-  struct ns_str r, k, v;
+/* Whether there's anything left to send */
+static int ns_send_pending(const struct ns_connection *nc) {
+  return nc->send_mbuf.len > 0 || nc->send_file != NULL ||
+         (nc->splice != NULL && nc->splice->len > 0) ||
+         (nc->zerocopy != NULL && nc->zerocopy->unsent > 0);
+}
 
-  path_len = strlen(path);
+/* Whether the kernel still uses buffers, see ns_set_zerocopy() */
+static int ns_zerocopy_pending(const struct ns_connection *nc) {
+  return nc->zerocopy != NULL && nc->zerocopy->bufs != NULL;
+}
 
-  overrides = opts->custom_mime_types;
-  while ((overrides = ns_next_comma_list_entry(overrides, &k, &v)) != NULL) {
-    ext = path + (path_len - k.len);
-    if (path_len > k.len && ns_vcasecmp(&k, ext) == 0) {
-      return v;
-    }
+/* Whether there's no room for received data, see ns_splice() */
+static int ns_recv_full(const struct ns_connection *nc) {
+  if (nc->splice != NULL && nc->splice->peer != NULL) {
+    return nc->splice->peer->splice->full;
   }
+  return nc->recv_mbuf.len >= nc->recv_mbuf_limit;
+}
 
-  for (i = 0; static_builtin_mime_types[i].extension != NULL; i++) {
-    ext = path + (path_len - static_builtin_mime_types[i].ext_len);
-    if (path_len > static_builtin_mime_types[i].ext_len && ext[-1] == '.' &&
-        ns_casecmp(ext, static_builtin_mime_types[i].extension) == 0) {
-      r.p = static_builtin_mime_types[i].mime_type;
-      r.len = strlen(r.p);
-      return r;
-    }
-  }
+#ifdef NS_ENABLE_SEND_FILE
+int ns_send_file(struct ns_connection *nc, int fd, int64_t offset,
+                 int64_t len) {
+  struct ns_send_file *sf;
 
-  r.p = dflt;
-  r.len = strlen(r.p);
-  return r;
+  if (nc->send_file != NULL || (nc->flags & NSF_UDP) ||
+      (sf = (struct ns_send_file *) NS_CALLOC(1, sizeof(*sf))) == NULL) {
+    return -1;
+  }
+  sf->fd = fd;
+  sf->offset = offset;
+  sf->len = len;
+  nc->send_file = sf;
+  if (len <= 0) ns_send_file_free(nc);
+  return 0;
 }
-#endif
 
 /*
- * Check whether full request is buffered. Return:
- *   -1  if request is malformed
- *    0  if request is not yet fully buffered
- *   >0  actual request length, including last \r\n\r\n
+ * Send some of the file, called when the output buffer is empty. Return 1
+ * if it's done with sendfile(), or 0 after reading a chunk of the file to
+ * the output buffer.
  */
-static int get_request_len(const char *s, int buf_len) {
-  const unsigned char *buf = (unsigned char *) s;
-  int i;
+static int ns_send_file_some(struct ns_connection *nc) {
+  struct ns_send_file *sf = nc->send_file;
+  char buf[NS_SEND_FILE_BUFFER_SIZE];
+  size_t len = sf->len < (int64_t) sizeof(buf) ? (size_t) sf->len : sizeof(buf);
+  ssize_t n;
 
-  for (i = 0; i < buf_len; i++) {
-    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
-      return -1;
-    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
-      return i + 2;
-    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
-               buf[i + 2] == '\n') {
-      return i + 3;
+#ifdef NS_ENABLE_SSL
+  /* SSL needs the data in user space, unless the kernel does the records */
+  if (nc->ssl != NULL && !(ns_ssl_ktls(nc) & NS_KTLS_SEND)) {
+    sf->no_sendfile = 1;
+  }
+#endif
+#ifdef __linux__
+  if (!sf->no_sendfile) {
+    double resume = 0;
+    off_t off = (off_t) sf->offset;
+
+    len = (size_t)(sf->len < 0x7ffff000 ? sf->len : 0x7ffff000);
+    if ((len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, len, &resume)) == 0) {
+      nc->send_resume_time = resume;
+      return 1;
+    }
+    if ((n = sendfile(nc->sock, sf->fd, &off, len)) > 0) {
+      int num_sent = (int) n;
+      DBG(("%p %d bytes -> %d (sendfile)", nc, num_sent, nc->sock));
+      ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+      sf->offset += n;
+      if ((sf->len -= n) == 0) ns_send_file_free(nc);
+      ns_call(nc, NS_SEND, &num_sent);
+      return 1;
+    } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == EINTR) {
+      /* File got shorter, or the socket is full */
+      if (n == 0) nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return 1;
+    } else if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return 1;
     }
+    /* This file or socket can't do it, read the file instead */
+    sf->no_sendfile = 1;
+    len = sf->len < (int64_t) sizeof(buf) ? (size_t) sf->len : sizeof(buf);
   }
+#endif
 
+  if ((n = pread(sf->fd, buf, len, (off_t) sf->offset)) <= 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return 1;
+  }
+  mbuf_append(&nc->send_mbuf, buf, n);
+  sf->offset += n;
+  if ((sf->len -= n) == 0) ns_send_file_free(nc);
   return 0;
 }
+#endif
 
-static const char *parse_http_headers(const char *s, const char *end, int len,
-                                      struct http_message *req) {
-  int i;
-  for (i = 0; i < (int) ARRAY_SIZE(req->header_names); i++) {
-    struct ns_str *k = &req->header_names[i], *v = &req->header_values[i];
+#ifdef NS_ENABLE_SSL
+/*
+ * Pick the TLS record size for the next write and return how much of `len`
+ * to write. Until NS_SSL_SMALL_RECORDS_LIMIT bytes are sent, records fit in
+ * a TCP segment, so the peer can decrypt the first bytes without waiting
+ * for a whole 16 KB record spread over several round trips of a slow
+ * starting connection. Bulk transfers then use full records. After the
+ * connection idles, the congestion window is small again, so is the record.
+ */
+static int ns_ssl_record_size(struct ns_connection *nc, size_t len) {
+#ifdef NS_SSL_OPENSSL_1_1
+  double now = ns_time();
+
+  if (now - nc->ssl_send_time >= NS_SSL_IDLE_RESET) nc->ssl_sent = 0;
+  nc->ssl_send_time = now;
+  if (nc->ssl_sent < NS_SSL_SMALL_RECORDS_LIMIT) {
+    /* Longer retries are fine, so cap the write at the limit */
+    SSL_set_max_send_fragment(nc->ssl, NS_SSL_SMALL_RECORD_SIZE);
+    if (len > NS_SSL_SMALL_RECORDS_LIMIT - nc->ssl_sent) {
+      len = NS_SSL_SMALL_RECORDS_LIMIT - nc->ssl_sent;
+    }
+  } else {
+    /* Lowering the max fragment lowered the split fragment too */
+    SSL_set_max_send_fragment(nc->ssl, NS_SSL_MAX_RECORD_SIZE);
+    SSL_set_split_send_fragment(nc->ssl, NS_SSL_MAX_RECORD_SIZE);
+  }
+#else
+  (void) nc;
+#endif
+  return (int) len;
+}
+#endif
 
-    s = ns_skip(s, end, ": ", k);
-    s = ns_skip(s, end, "\r\n", v);
+static void ns_write_to_socket(struct ns_connection *conn) {
+  struct mbuf *io = &conn->send_mbuf;
+  int n = 0;
+  size_t len;
+  double resume = 0;
 
-    while (v->len > 0 && v->p[v->len - 1] == ' ') {
-      v->len--; /* Trim trailing spaces in header value */
-    }
+#ifdef NS_ENABLE_ZEROCOPY
+  if (conn->zerocopy != NULL && ns_zerocopy_write(conn)) return;
+#endif
+#ifdef NS_ENABLE_SEND_FILE
+  if (io->len == 0 && conn->send_file != NULL && ns_send_file_some(conn)) {
+    return;
+  }
+#endif
+#ifdef NS_ENABLE_SPLICE
+  if (io->len == 0 && conn->send_file == NULL && conn->splice != NULL) {
+    ns_splice_out(conn);
+    return;
+  }
+#endif
+  assert(io->len > 0);
 
-    if (k->len == 0 || v->len == 0) {
-      k->p = v->p = NULL;
-      k->len = v->len = 0;
-      break;
-    }
+  if ((len = ns_bandwidth_avail(conn, NS_BANDWIDTH_SEND, io->len, &resume)) ==
+      0) {
+    /* Over the send rate, see ns_set_bandwidth() */
+    conn->send_resume_time = resume;
+    return;
+  }
 
-    if (!ns_ncasecmp(k->p, "Content-Length", 14)) {
-      req->body.len = to64(v->p);
-      req->message.len = len + req->body.len;
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL && (ns_ssl_ktls(conn) & NS_KTLS_SEND)) {
+    /* The kernel makes the records, partial writes are fine */
+    n = (int) NS_SEND_FUNC(conn->sock, io->buf, len, 0);
+  } else if (conn->ssl != NULL) {
+    if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
+      /*
+       * Retries must not shrink the buffer, send it all and let the debt
+       * pause the next write.
+       */
+      n = SSL_write(conn->ssl, io->buf, ns_ssl_record_size(conn, io->len));
+      if (n <= 0) {
+        int ssl_err = ns_ssl_err(conn, n);
+        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
+          return; /* Call us again */
+        } else {
+          conn->flags |= NSF_CLOSE_IMMEDIATELY;
+        }
+      } else {
+        /* Successful SSL operation, clear off SSL wait flags */
+        conn->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
+        if (conn->ssl_sent < NS_SSL_SMALL_RECORDS_LIMIT) conn->ssl_sent += n;
+      }
+    } else {
+      ns_ssl_begin(conn);
+      return;
     }
+  } else
+#endif
+  {
+    int flags = 0;
+#if defined(NS_ENABLE_SEND_FILE) && defined(MSG_MORE)
+    /* A file follows, let it share segments with e.g. a response header */
+    if (conn->send_file != NULL) flags |= MSG_MORE;
+#endif
+    n = (int) NS_SEND_FUNC(conn->sock, io->buf, len, flags);
   }
 
-  return s;
+  DBG(("%p %d bytes -> %d", conn, n, conn->sock));
+
+  if (ns_is_error(n)) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    ns_bandwidth_charge(conn, NS_BANDWIDTH_SEND, n);
+#ifndef NS_DISABLE_FILESYSTEM
+    /* LCOV_EXCL_START */
+    if (conn->mgr->hexdump_file != NULL) {
+      ns_hexdump_connection(conn, conn->mgr->hexdump_file, n, NS_SEND);
+    }
+/* LCOV_EXCL_STOP */
+#endif
+    mbuf_remove(io, n);
+  }
+  ns_call(conn, NS_SEND, &n);
 }
 
-int ns_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
-  const char *end, *qs;
-  int len = get_request_len(s, n);
+int ns_send(struct ns_connection *conn, const void *buf, int len) {
+  return (int) ns_out(conn, buf, len);
+}
 
-  if (len <= 0) return len;
+#ifdef NS_ENABLE_UDP_GSO
+/*
+ * Receive a datagram, or several coalesced ones from the same peer. In the
+ * latter case, `*seg_size` is the size of all but the last one.
+ */
+static int ns_udp_recv_gro(struct ns_connection *ls, char *buf, size_t len,
+                           union socket_address *sa, int *seg_size) {
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  int n;
 
-  memset(hm, 0, sizeof(*hm));
-  hm->message.p = s;
-  hm->body.p = s + len;
-  hm->message.len = hm->body.len = (size_t) ~0;
-  end = s + len;
-
-  /* Request is fully buffered. Skip leading whitespaces. */
-  while (s < end && isspace(*(unsigned char *) s)) s++;
-
-  if (is_req) {
-    /* Parse request line: method, URI, proto */
-    s = ns_skip(s, end, " ", &hm->method);
-    s = ns_skip(s, end, " ", &hm->uri);
-    s = ns_skip(s, end, "\r\n", &hm->proto);
-    if (hm->uri.p <= hm->method.p || hm->proto.p <= hm->uri.p) return -1;
-
-    /* If URI contains '?' character, initialize query_string */
-    if ((qs = (char *) memchr(hm->uri.p, '?', hm->uri.len)) != NULL) {
-      hm->query_string.p = qs + 1;
-      hm->query_string.len = &hm->uri.p[hm->uri.len] - (qs + 1);
-      hm->uri.len = qs - hm->uri.p;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_name = &sa->sa;
+  msg.msg_namelen = sizeof(*sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if ((n = (int) recvmsg(ls->sock, &msg, 0)) > 0) {
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+        memcpy(seg_size, CMSG_DATA(cm), sizeof(*seg_size));
+      }
     }
-  } else {
-    s = ns_skip(s, end, " ", &hm->proto);
-    if (end - s < 4 || s[3] != ' ') return -1;
-    hm->resp_code = atoi(s);
-    if (hm->resp_code < 100 || hm->resp_code >= 600) return -1;
-    s += 4;
-    s = ns_skip(s, end, "\r\n", &hm->resp_status_msg);
-  }
-
-  s = parse_http_headers(s, end, len, hm);
-
-  /*
-   * ns_parse_http() is used to parse both HTTP requests and HTTP
-   * responses. If HTTP response does not have Content-Length set, then
-   * body is read until socket is closed, i.e. body.len is infinite (~0).
-   *
-   * For HTTP requests though, according to
-   * http://tools.ietf.org/html/rfc7231#section-8.1.3,
-   * only POST and PUT methods have defined body semantics.
-   * Therefore, if Content-Length is not specified and methods are
-   * not one of PUT or POST, set body length to 0.
-   *
-   * So,
-   * if it is HTTP request, and Content-Length is not set,
-   * and method is not (PUT or POST) then reset body length to zero.
-   */
-  if (hm->body.len == (size_t) ~0 && is_req &&
-      ns_vcasecmp(&hm->method, "PUT") != 0 &&
-      ns_vcasecmp(&hm->method, "POST") != 0) {
-    hm->body.len = 0;
-    hm->message.len = len;
   }
 
-  return len;
+  return n;
 }
+#endif
 
-struct ns_str *ns_get_http_header(struct http_message *hm, const char *name) {
-  size_t i, len = strlen(name);
-
-  for (i = 0; i < ARRAY_SIZE(hm->header_names); i++) {
-    struct ns_str *h = &hm->header_names[i], *v = &hm->header_values[i];
-    if (h->p != NULL && h->len == len && !ns_ncasecmp(h->p, name, len))
-      return v;
-  }
-
-  return NULL;
-}
+static void ns_handle_udp(struct ns_connection *ls) {
+  struct ns_connection nc;
+  char stack_buf[NS_UDP_RECEIVE_BUFFER_SIZE], *buf = stack_buf;
+  int n, len, seg_size = 0, off = 0;
+  socklen_t s_len = sizeof(nc.sa);
 
-#ifndef NS_DISABLE_HTTP_WEBSOCKET
+  memset(&nc, 0, sizeof(nc));
+#ifdef NS_ENABLE_UDP_GSO
+  if (ls->udp_offload != NULL && ls->udp_offload->gro) {
+    buf = ls->udp_offload->gro_buf;
+    n = ns_udp_recv_gro(ls, buf, NS_UDP_GRO_BUFFER_SIZE, &nc.sa, &seg_size);
+  } else
+#endif
+    n = recvfrom(ls->sock, buf, NS_UDP_RECEIVE_BUFFER_SIZE, 0, &nc.sa.sa,
+                 &s_len);
+  if (n <= 0) {
+    DBG(("%p recvfrom: %s", ls, strerror(errno)));
+  } else if (!ns_ip_acl_check(ls->ip_acl, &nc.sa)) {
+    DBG(("%p %d bytes denied by ACL", ls, n));
+  } else {
+    union socket_address sa = nc.sa;
+    /* Copy all attributes, preserving sender address */
+    nc = *ls;
 
-static int is_ws_fragment(unsigned char flags) {
-  return (flags & 0x80) == 0 || (flags & 0x0f) == 0;
-}
+    /* Then override some */
+    nc.sa = sa;
+    nc.listener = ls;
+    nc.flags = NSF_UDP;
 
-static int is_ws_first_fragment(unsigned char flags) {
-  return (flags & 0x80) == 0 && (flags & 0x0f) != 0;
-}
+    /* Call NS_RECV handler for each datagram */
+    DBG(("%p %d bytes received, %d per datagram", ls, n, seg_size));
+    for (; n > 0; n -= len, off += len) {
+      len = seg_size > 0 && n > seg_size ? seg_size : n;
+      nc.recv_mbuf.buf = buf + off;
+      nc.recv_mbuf.len = nc.recv_mbuf.size = len;
+      ns_call(&nc, NS_RECV, &len);
+    }
 
-static void handle_incoming_websocket_frame(struct ns_connection *nc,
-                                            struct websocket_message *wsm) {
-  if (wsm->flags & 0x8) {
-    nc->handler(nc, NS_WEBSOCKET_CONTROL_FRAME, wsm);
-  } else {
-    nc->handler(nc, NS_WEBSOCKET_FRAME, wsm);
+    /*
+     * See https://github.com/cesanta/fossa/issues/207
+     * ns_call migth set flags. They need to be synced back to ls.
+     */
+    ls->flags = nc.flags;
   }
 }
 
-static int deliver_websocket_data(struct ns_connection *nc) {
-  /* Using unsigned char *, cause of integer arithmetic below */
-  uint64_t i, data_len = 0, frame_len = 0, buf_len = nc->recv_mbuf.len, len,
-              mask_len = 0, header_len = 0;
-  unsigned char *p = (unsigned char *) nc->recv_mbuf.buf, *buf = p,
-                *e = p + buf_len;
-  unsigned *sizep = (unsigned *) &p[1]; /* Size ptr for defragmented frames */
-  int ok, reass = buf_len > 0 && is_ws_fragment(p[0]) &&
-                  !(nc->flags & NSF_WEBSOCKET_NO_DEFRAG);
+#define _NSF_FD_CAN_READ 1
+#define _NSF_FD_CAN_WRITE 1 << 1
+#define _NSF_FD_ERROR 1 << 2
 
-  /* If that's a continuation frame that must be reassembled, handle it */
-  if (reass && !is_ws_first_fragment(p[0]) && buf_len >= 1 + sizeof(*sizep) &&
-      buf_len >= 1 + sizeof(*sizep) + *sizep) {
-    buf += 1 + sizeof(*sizep) + *sizep;
-    buf_len -= 1 + sizeof(*sizep) + *sizep;
-  }
+static void ns_mgr_handle_connection(struct ns_connection *nc, int fd_flags,
+                                     time_t now) {
+  DBG(("%p fd=%d fd_flags=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock,
+       fd_flags, nc->flags, (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
+  /* A worker thread is using the connection, see ns_ssl_begin() */
+  if (nc->flags & NSF_SSL_BUSY) return;
+  if (fd_flags != 0) nc->last_io_time = now;
 
-  if (buf_len >= 2) {
-    len = buf[1] & 127;
-    mask_len = buf[1] & 128 ? 4 : 0;
-    if (len < 126 && buf_len >= mask_len) {
-      data_len = len;
-      header_len = 2 + mask_len;
-    } else if (len == 126 && buf_len >= 4 + mask_len) {
-      header_len = 4 + mask_len;
-      data_len = ntohs(*(uint16_t *) &buf[2]);
-    } else if (buf_len >= 10 + mask_len) {
-      header_len = 10 + mask_len;
-      data_len = (((uint64_t) ntohl(*(uint32_t *) &buf[2])) << 32) +
-                 ntohl(*(uint32_t *) &buf[6]);
+  if (nc->flags & NSF_CONNECTING) {
+    if (fd_flags != 0) {
+      ns_read_from_socket(nc);
     }
+    return;
   }
 
-  frame_len = header_len + data_len;
-  ok = frame_len > 0 && frame_len <= buf_len;
-
-  if (ok) {
-    struct websocket_message wsm;
-
-    wsm.size = (size_t) data_len;
-    wsm.data = buf + header_len;
-    wsm.flags = buf[0];
-
-    /* Apply mask if necessary */
-    if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        buf[i + header_len] ^= (buf + header_len - mask_len)[i % 4];
-      }
-    }
-
-    if (reass) {
-      /* On first fragmented frame, nullify size */
-      if (is_ws_first_fragment(wsm.flags)) {
-        mbuf_resize(&nc->recv_mbuf, nc->recv_mbuf.size + sizeof(*sizep));
-        p[0] &= ~0x0f; /* Next frames will be treated as continuation */
-        buf = p + 1 + sizeof(*sizep);
-        *sizep = 0; /* TODO(lsm): fix. this can stomp over frame data */
-      }
+  if (nc->flags & NSF_LISTENING) {
+    /*
+     * We're not looping here, and accepting just one connection at
+     * a time. The reason is that eCos does not respect non-blocking
+     * flag on a listening socket and hangs in a loop.
+     */
+    if (fd_flags & _NSF_FD_CAN_READ) accept_conn(nc);
+    return;
+  }
 
-      /* Append this frame to the reassembled buffer */
-      memmove(buf, wsm.data, e - wsm.data);
-      (*sizep) += wsm.size;
-      nc->recv_mbuf.len -= wsm.data - buf;
+#ifdef NS_ENABLE_ZEROCOPY
+  /* Completions signal an error condition, see ns_set_zerocopy() */
+  if (ns_zerocopy_pending(nc)) ns_zerocopy_reap(nc);
+#endif
 
-      /* On last fragmented frame - call user handler and remove data */
-      if (wsm.flags & 0x80) {
-        wsm.data = p + 1 + sizeof(*sizep);
-        wsm.size = *sizep;
-        handle_incoming_websocket_frame(nc, &wsm);
-        mbuf_remove(&nc->recv_mbuf, 1 + sizeof(*sizep) + *sizep);
-      }
+  if (fd_flags & _NSF_FD_CAN_READ) {
+    if (nc->flags & NSF_UDP) {
+      ns_handle_udp(nc);
     } else {
-      /* TODO(lsm): properly handle OOB control frames during defragmentation */
-      handle_incoming_websocket_frame(nc, &wsm);
-      mbuf_remove(&nc->recv_mbuf, (size_t) frame_len); /* Cleanup frame */
+      ns_read_from_socket(nc);
     }
+    if (nc->flags & NSF_CLOSE_IMMEDIATELY) return;
+  }
 
-    /* If client closes, close too */
-    if ((buf[0] & 0x0f) == WEBSOCKET_OP_CLOSE) {
-      nc->flags |= NSF_SEND_AND_CLOSE;
-    }
+  if ((fd_flags & _NSF_FD_CAN_WRITE) && !(nc->flags & NSF_DONT_SEND) &&
+      !(nc->flags & NSF_UDP)) { /* Writes to UDP sockets are not buffered. */
+    ns_write_to_socket(nc);
   }
 
-  return ok;
-}
+  if (!(fd_flags & (_NSF_FD_CAN_READ | _NSF_FD_CAN_WRITE))) {
+    ns_call(nc, NS_POLL, &now);
+  }
 
-struct ws_mask_ctx {
-  size_t pos; /* zero means unmasked */
-  uint32_t mask;
-};
+  DBG(("%p after fd=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock, nc->flags,
+       (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
+}
 
-static uint32_t ws_random_mask() {
 /*
- * The spec requires WS client to generate hard to
- * guess mask keys. From RFC6455, Section 5.3:
- *
- * The unpredictability of the masking key is essential to prevent
- * authors of malicious applications from selecting the bytes that appear on
- * the wire.
- *
- * Hence this feature is essential when the actual end user of this API
- * is untrusted code that wouldn't have access to a lower level net API
- * anyway (e.g. web browsers). Hence this feature is low prio for most
- * fossa use cases and thus can be disabled, e.g. when porting to a platform
- * that lacks random().
+ * Check whether IO is paused until `*resume_time`, see `recv_resume_time`.
+ * If so, shorten the poll timeout `milli` to resume in time.
  */
-#if NS_DISABLE_WS_RANDOM_MASK
-  return 0xefbeadde; /* generated with a random number generator, I swear */
-#else
-  if (sizeof(long) >= 4) {
-    return (uint32_t) random();
-  } else if (sizeof(long) == 2) {
-    return (uint32_t) random() << 16 | (uint32_t) random();
+static int ns_io_paused(double *resume_time, double now, int *milli) {
+  int ms;
+
+  if (*resume_time == 0) return 0;
+  if (now >= *resume_time) {
+    *resume_time = 0;
+    return 0;
   }
-#endif
+  ms = (int) ((*resume_time - now) * 1000) + 1;
+  if (*milli < 0 || ms < *milli) *milli = ms;
+
+  return 1;
 }
 
-static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len,
-                              struct ws_mask_ctx *ctx) {
-  int header_len;
-  unsigned char header[10];
+static void ns_mgr_handle_ctl_sock(struct ns_mgr *mgr) {
+  struct ctl_msg ctl_msg;
+  int len =
+      (int) NS_RECV_FUNC(mgr->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
+  NS_SEND_FUNC(mgr->ctl[1], ctl_msg.message, 1, 0);
+  if (len >= (int) sizeof(ctl_msg.callback) && ctl_msg.callback != NULL) {
+    struct ns_connection *nc;
+    for (nc = ns_next(mgr, NULL); nc != NULL; nc = ns_next(mgr, nc)) {
+      ctl_msg.callback(nc, NS_POLL, ctl_msg.message);
+    }
+  }
+}
 
-  header[0] = 0x80 + (op & 0x0f);
-  if (len < 126) {
-    header[1] = len;
-    header_len = 2;
-  } else if (len < 65535) {
-    uint16_t tmp = htons((uint16_t) len);
-    header[1] = 126;
-    memcpy(&header[2], &tmp, sizeof(tmp));
-    header_len = 4;
-  } else {
-    uint32_t tmp;
-    header[1] = 127;
-    tmp = htonl((uint32_t)((uint64_t) len >> 32));
-    memcpy(&header[2], &tmp, sizeof(tmp));
-    tmp = htonl((uint32_t)(len & 0xffffffff));
-    memcpy(&header[6], &tmp, sizeof(tmp));
-    header_len = 10;
-  }
-
-  /* client connections enable masking */
-  if (nc->listener == NULL) {
-    header[1] |= 1 << 7; /* set masking flag */
-    ns_send(nc, header, header_len);
-    ctx->mask = ws_random_mask();
-    ns_send(nc, &ctx->mask, sizeof(ctx->mask));
-    ctx->pos = nc->send_mbuf.len;
-  } else {
-    ns_send(nc, header, header_len);
-    ctx->pos = 0;
-  }
-}
+#if NS_MGR_EV_MGR == 1 /* epoll() */
 
-static void ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
-  size_t i;
-  if (ctx->pos == 0) return;
-  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
-    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
-  }
-}
+#ifndef NS_EPOLL_MAX_EVENTS
+#define NS_EPOLL_MAX_EVENTS 100
+#endif
 
-void ns_send_websocket_frame(struct ns_connection *nc, int op, const void *data,
-                             size_t len) {
-  struct ws_mask_ctx ctx;
-  ns_send_ws_header(nc, op, len, &ctx);
-  ns_send(nc, data, len);
+#define _NS_EPF_EV_EPOLLIN (1 << 0)
+#define _NS_EPF_EV_EPOLLOUT (1 << 1)
+#define _NS_EPF_NO_POLL (1 << 2)
 
-  ws_mask_frame(&nc->send_mbuf, &ctx);
+static uint32_t ns_epf_to_evflags(unsigned int epf) {
+  uint32_t result = 0;
+  if (epf & _NS_EPF_EV_EPOLLIN) result |= EPOLLIN;
+  if (epf & _NS_EPF_EV_EPOLLOUT) result |= EPOLLOUT;
+  return result;
+}
 
-  if (op == WEBSOCKET_OP_CLOSE) {
-    nc->flags |= NSF_SEND_AND_CLOSE;
+static void ns_ev_mgr_epoll_set_flags(const struct ns_connection *nc,
+                                      struct epoll_event *ev) {
+  /* NOTE: EPOLLERR and EPOLLHUP are always enabled. */
+  ev->events = 0;
+  if (nc->flags & NSF_SSL_BUSY) return;
+  if (!ns_recv_full(nc) && nc->recv_resume_time == 0) {
+    ev->events |= EPOLLIN;
+  }
+  if ((nc->flags & NSF_CONNECTING) ||
+      (ns_send_pending(nc) && !(nc->flags & NSF_DONT_SEND) &&
+       nc->send_resume_time == 0)) {
+    ev->events |= EPOLLOUT;
   }
 }
 
-void ns_send_websocket_framev(struct ns_connection *nc, int op,
-                              const struct ns_str *strv, int strvcnt) {
-  struct ws_mask_ctx ctx;
-  int i;
-  int len = 0;
-  for (i = 0; i < strvcnt; i++) {
-    len += strv[i].len;
+static void ns_ev_mgr_epoll_ctl(struct ns_connection *nc, int op) {
+  int epoll_fd = (intptr_t) nc->mgr->mgr_data;
+  struct epoll_event ev;
+  assert(op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD || EPOLL_CTL_DEL);
+  if (op != EPOLL_CTL_DEL) {
+    ns_ev_mgr_epoll_set_flags(nc, &ev);
+    if (op == EPOLL_CTL_MOD) {
+      uint32_t old_ev_flags = ns_epf_to_evflags((intptr_t) nc->mgr_data);
+      if (ev.events == old_ev_flags) return;
+    }
+    ev.data.ptr = nc;
   }
-
-  ns_send_ws_header(nc, op, len, &ctx);
-
-  for (i = 0; i < strvcnt; i++) {
-    ns_send(nc, strv[i].p, strv[i].len);
+  if (epoll_ctl(epoll_fd, op, nc->sock, &ev) != 0) {
+    perror("epoll_ctl");
+    abort();
   }
-
-  ws_mask_frame(&nc->send_mbuf, &ctx);
-
-  if (op == WEBSOCKET_OP_CLOSE) {
-    nc->flags |= NSF_SEND_AND_CLOSE;
+  if (op != EPOLL_CTL_DEL) {
+    /* Remember the interest set, so that unchanged ones are skipped */
+    intptr_t epf = (intptr_t) nc->mgr_data & _NS_EPF_NO_POLL;
+    if (ev.events & EPOLLIN) epf |= _NS_EPF_EV_EPOLLIN;
+    if (ev.events & EPOLLOUT) epf |= _NS_EPF_EV_EPOLLOUT;
+    nc->mgr_data = (void *) epf;
   }
 }
 
-void ns_printf_websocket_frame(struct ns_connection *nc, int op,
-                               const char *fmt, ...) {
-  char mem[4192], *buf = mem;
-  va_list ap;
-  int len;
-
-  va_start(ap, fmt);
-  if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
-    ns_send_websocket_frame(nc, op, buf, len);
+static void ns_ev_mgr_init(struct ns_mgr *mgr) {
+  int epoll_fd;
+  DBG(("%p using epoll()", mgr));
+  epoll_fd = epoll_create(NS_EPOLL_MAX_EVENTS /* unused but required */);
+  if (epoll_fd < 0) {
+    perror("epoll_ctl");
+    abort();
   }
-  va_end(ap);
-
-  if (buf != mem && buf != NULL) {
-    NS_FREE(buf);
+  mgr->mgr_data = (void *) ((intptr_t) epoll_fd);
+  if (mgr->ctl[1] != INVALID_SOCKET) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mgr->ctl[1], &ev) != 0) {
+      perror("epoll_ctl");
+      abort();
+    }
   }
 }
 
-static void websocket_handler(struct ns_connection *nc, int ev, void *ev_data) {
-  nc->handler(nc, ev, ev_data);
-
-  switch (ev) {
-    case NS_RECV:
-      do {
-      } while (deliver_websocket_data(nc));
-      break;
-    case NS_POLL:
-      /* Ping idle websocket connections */
-      {
-        time_t now = *(time_t *) ev_data;
-        if (nc->flags & NSF_IS_WEBSOCKET &&
-            now > nc->last_io_time + NS_WEBSOCKET_PING_INTERVAL_SECONDS) {
-          ns_send_websocket_frame(nc, WEBSOCKET_OP_PING, "", 0);
-        }
-      }
-      break;
-    default:
-      break;
-  }
+static void ns_ev_mgr_free(struct ns_mgr *mgr) {
+  int epoll_fd = (intptr_t) mgr->mgr_data;
+  close(epoll_fd);
 }
 
-static void ws_handshake(struct ns_connection *nc, const struct ns_str *key) {
-  static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-  char buf[500], sha[20], b64_sha[sizeof(sha) * 2];
-  cs_sha1_ctx sha_ctx;
-
-  snprintf(buf, sizeof(buf), "%.*s%s", (int) key->len, key->p, magic);
-
-  cs_sha1_init(&sha_ctx);
-  cs_sha1_update(&sha_ctx, (unsigned char *) buf, strlen(buf));
-  cs_sha1_final((unsigned char *) sha, &sha_ctx);
-
-  ns_base64_encode((unsigned char *) sha, sizeof(sha), b64_sha);
-  ns_printf(nc, "%s%s%s",
-            "HTTP/1.1 101 Switching Protocols\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Accept: ",
-            b64_sha, "\r\n\r\n");
+static void ns_ev_mgr_add_conn(struct ns_connection *nc) {
+  ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_ADD);
 }
 
-#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+static void ns_ev_mgr_remove_conn(struct ns_connection *nc) {
+  ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_DEL);
+}
 
-static void free_http_proto_data(struct ns_connection *nc) {
-  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
-  if (dp != NULL) {
-    if (dp->fp != NULL) {
-      fclose(dp->fp);
+time_t ns_mgr_poll(struct ns_mgr *mgr, int timeout_ms) {
+  int epoll_fd = (intptr_t) mgr->mgr_data;
+  struct epoll_event events[NS_EPOLL_MAX_EVENTS];
+  struct ns_connection *nc, *next;
+  int num_ev, fd_flags;
+  time_t now;
+  double t = ns_time();
+
+  ns_close_inherited(mgr);
+  for (nc = mgr->active_connections; nc != NULL; nc = nc->next) {
+    /* Datagrams sent since the last poll */
+    ns_udp_flush(nc);
+    /* Resume paused connections that are due */
+    if ((nc->recv_resume_time != 0 &&
+         !ns_io_paused(&nc->recv_resume_time, t, &timeout_ms)) |
+        (nc->send_resume_time != 0 &&
+         !ns_io_paused(&nc->send_resume_time, t, &timeout_ms))) {
+      ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
     }
-    if (dp->cgi_nc != NULL) {
-      dp->cgi_nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    /*
+     * Connections that ran out of read budget go on without waiting, unless
+     * they can't be read anyway: see the read below
+     */
+    if ((nc->flags & NSF_READ_PENDING) && !(nc->flags & NSF_SSL_BUSY) &&
+        nc->recv_resume_time == 0 && !ns_recv_full(nc)) {
+      timeout_ms = 0;
     }
-    NS_FREE(dp);
-    nc->proto_data = NULL;
   }
-}
-
-static void transfer_file_data(struct ns_connection *nc) {
-  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
-  char buf[NS_MAX_HTTP_SEND_IOBUF];
-  int64_t left = dp->cl - dp->sent;
-  size_t n = 0, to_read = 0;
 
-  if (dp->type == DATA_FILE) {
-    struct mbuf *io = &nc->send_mbuf;
-    if (io->len < sizeof(buf)) {
-      to_read = sizeof(buf) - io->len;
-    }
+  num_ev = epoll_wait(epoll_fd, events, NS_EPOLL_MAX_EVENTS, timeout_ms);
+  now = time(NULL);
+  DBG(("epoll_wait @ %ld num_ev=%d", (long) now, num_ev));
 
-    if (left > 0 && to_read > (size_t) left) {
-      to_read = left;
+  while (num_ev-- > 0) {
+    intptr_t epf;
+    struct epoll_event *ev = events + num_ev;
+    nc = (struct ns_connection *) ev->data.ptr;
+    if (nc == NULL) {
+      ns_mgr_handle_ctl_sock(mgr);
+      continue;
     }
+    fd_flags = ((ev->events & (EPOLLIN | EPOLLHUP)) ? _NSF_FD_CAN_READ : 0) |
+               ((ev->events & (EPOLLOUT)) ? _NSF_FD_CAN_WRITE : 0) |
+               ((ev->events & (EPOLLERR)) ? _NSF_FD_ERROR : 0);
+    ns_mgr_handle_connection(nc, fd_flags, now);
+    epf = (intptr_t) nc->mgr_data;
+    epf ^= _NS_EPF_NO_POLL;
+    nc->mgr_data = (void *) epf;
+  }
 
-    if (to_read == 0) {
-      /* Rate limiting. send_mbuf is too full, wait until it's drained. */
-    } else if (dp->sent < dp->cl && (n = fread(buf, 1, to_read, dp->fp)) > 0) {
-      ns_send(nc, buf, n);
-      dp->sent += n;
+  for (nc = mgr->active_connections; nc != NULL; nc = next) {
+    next = nc->next;
+    if (!(((intptr_t) nc->mgr_data) & _NS_EPF_NO_POLL)) {
+      fd_flags = (nc->flags & NSF_READ_PENDING) && nc->recv_resume_time == 0 &&
+                         !ns_recv_full(nc)
+                     ? _NSF_FD_CAN_READ
+                     : 0;
+      ns_mgr_handle_connection(nc, fd_flags, now);
     } else {
-      free_http_proto_data(nc);
-    }
-  } else if (dp->type == DATA_PUT) {
-    struct mbuf *io = &nc->recv_mbuf;
-    size_t to_write =
-        left <= 0 ? 0 : left < (int64_t) io->len ? (size_t) left : io->len;
-    size_t n = fwrite(io->buf, 1, to_write, dp->fp);
-    if (n > 0) {
-      mbuf_remove(io, n);
-      dp->sent += n;
-    }
-    if (n == 0 || dp->sent >= dp->cl) {
-      free_http_proto_data(nc);
+      intptr_t epf = (intptr_t) nc->mgr_data;
+      epf ^= _NS_EPF_NO_POLL;
+      nc->mgr_data = (void *) epf;
     }
-  } else if (dp->type == DATA_CGI) {
-    /* This is POST data that needs to be forwarded to the CGI process */
-    if (dp->cgi_nc != NULL) {
-      ns_forward(nc, dp->cgi_nc);
+    ns_udp_flush(nc);
+    if (!(nc->flags & NSF_SSL_BUSY) &&
+        ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
+         (!ns_send_pending(nc) && !ns_zerocopy_pending(nc) &&
+          (nc->flags & NSF_SEND_AND_CLOSE)))) {
+      ns_close_conn(nc);
     } else {
-      nc->flags |= NSF_SEND_AND_CLOSE;
+      ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
     }
   }
+
+  return now;
 }
 
-/*
- * Parse chunked-encoded buffer. Return 0 if the buffer is not encoded, or
- * if it's incomplete. If the chunk is fully buffered, return total number of
- * bytes in a chunk, and store data in `data`, `data_len`.
- */
-static size_t parse_chunk(char *buf, size_t len, char **chunk_data,
-                          size_t *chunk_len) {
-  unsigned char *s = (unsigned char *) buf;
-  size_t n = 0; /* scanned chunk length */
-  size_t i = 0; /* index in s */
+#else /* select() */
 
-  /* Scan chunk length. That should be a hexadecimal number. */
-  while (i < len && isxdigit(s[i])) {
-    n *= 16;
-    n += (s[i] >= '0' && s[i] <= '9') ? s[i] - '0' : tolower(s[i]) - 'a' + 10;
-    i++;
-  }
+static void ns_ev_mgr_init(struct ns_mgr *mgr) {
+  (void) mgr;
+  DBG(("%p using select()", mgr));
+}
 
-  /* Skip new line */
-  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
-    return 0;
-  }
-  i += 2;
+static void ns_ev_mgr_free(struct ns_mgr *mgr) {
+  (void) mgr;
+}
 
-  /* Record where the data is */
-  *chunk_data = (char *) s + i;
-  *chunk_len = n;
+static void ns_ev_mgr_add_conn(struct ns_connection *nc) {
+  (void) nc;
+}
 
-  /* Skip data */
-  i += n;
+static void ns_ev_mgr_remove_conn(struct ns_connection *nc) {
+  (void) nc;
+}
 
-  /* Skip new line */
-  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
-    return 0;
+static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
+  if (sock != INVALID_SOCKET) {
+    FD_SET(sock, set);
+    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
+      *max_fd = sock;
+    }
   }
-  return i + 2;
 }
 
-NS_INTERNAL size_t ns_handle_chunked(struct ns_connection *nc,
-                                     struct http_message *hm, char *buf,
-                                     size_t blen) {
-  struct proto_data_http *dp;
-  char *data;
-  size_t i, n, data_len, body_len, zero_chunk_received = 0;
+time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
+  time_t now;
+  struct ns_connection *nc, *tmp;
+  struct timeval tv;
+  fd_set read_set, write_set, err_set;
+  sock_t max_fd = INVALID_SOCKET;
+  int num_selected, read_pending = 0;
+  double t = ns_time();
 
-  /* If not allocated, allocate proto_data to hold reassembled offset */
-  if (nc->proto_data == NULL &&
-      (nc->proto_data = NS_CALLOC(1, sizeof(*dp))) == NULL) {
-    nc->flags |= NSF_CLOSE_IMMEDIATELY;
-    return 0;
-  }
+  ns_close_inherited(mgr);
+  FD_ZERO(&read_set);
+  FD_ZERO(&write_set);
+  FD_ZERO(&err_set);
+  ns_add_to_set(mgr->ctl[1], &read_set, &max_fd);
 
-  /* Find out piece of received data that is not yet reassembled */
-  dp = (struct proto_data_http *) nc->proto_data;
-  body_len = dp->body_len;
-  assert(blen >= body_len);
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    /* Datagrams sent since the last poll */
+    ns_udp_flush(nc);
+    if (nc->flags & NSF_SSL_BUSY) continue;
 
-  /* Traverse all fully buffered chunks */
-  for (i = body_len; (n = parse_chunk(buf + i, blen - i, &data, &data_len)) > 0;
-       i += n) {
-    /* Collapse chunk data to the rest of HTTP body */
-    memmove(buf + body_len, data, data_len);
-    body_len += data_len;
-    hm->body.len = body_len;
+    if (!(nc->flags & NSF_WANT_WRITE) && !ns_recv_full(nc) &&
+        !ns_io_paused(&nc->recv_resume_time, t, &milli)) {
+      ns_add_to_set(nc->sock, &read_set, &max_fd);
+      if (nc->flags & NSF_READ_PENDING) read_pending = 1;
+    }
 
-    if (data_len == 0) {
-      zero_chunk_received = 1;
-      i += n;
-      break;
+    if (((nc->flags & NSF_CONNECTING) && !(nc->flags & NSF_WANT_READ)) ||
+        (ns_send_pending(nc) && !(nc->flags & NSF_CONNECTING) &&
+         !(nc->flags & NSF_DONT_SEND) &&
+         !ns_io_paused(&nc->send_resume_time, t, &milli))) {
+      ns_add_to_set(nc->sock, &write_set, &max_fd);
+      ns_add_to_set(nc->sock, &err_set, &max_fd);
     }
   }
 
-  if (i > body_len) {
-    /* Shift unparsed content to the parsed body */
-    assert(i <= blen);
-    memmove(buf + body_len, buf + i, blen - i);
-    memset(buf + body_len + blen - i, 0, i - body_len);
-    nc->recv_mbuf.len -= i - body_len;
-    dp->body_len = body_len;
+  /* Connections that ran out of read budget go on without waiting */
+  if (read_pending) milli = 0;
+  tv.tv_sec = milli / 1000;
+  tv.tv_usec = (milli % 1000) * 1000;
 
-    /* Send NS_HTTP_CHUNK event */
-    nc->flags &= ~NSF_DELETE_CHUNK;
-    nc->handler(nc, NS_HTTP_CHUNK, hm);
+  num_selected = select((int) max_fd + 1, &read_set, &write_set, &err_set, &tv);
+  now = time(NULL);
+  DBG(("select @ %ld num_ev=%d", (long) now, num_selected));
 
-    /* Delete processed data if user set NSF_DELETE_CHUNK flag */
-    if (nc->flags & NSF_DELETE_CHUNK) {
-      memset(buf, 0, body_len);
-      memmove(buf, buf + body_len, blen - i);
-      nc->recv_mbuf.len -= body_len;
-      hm->body.len = dp->body_len = 0;
+  if (num_selected > 0 && mgr->ctl[1] != INVALID_SOCKET &&
+      FD_ISSET(mgr->ctl[1], &read_set)) {
+    ns_mgr_handle_ctl_sock(mgr);
+  }
+
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    int fd_flags = 0;
+    if (num_selected > 0) {
+      fd_flags = (FD_ISSET(nc->sock, &read_set) ? _NSF_FD_CAN_READ : 0) |
+                 (FD_ISSET(nc->sock, &write_set) ? _NSF_FD_CAN_WRITE : 0) |
+                 (FD_ISSET(nc->sock, &err_set) ? _NSF_FD_ERROR : 0);
+    }
+    if ((nc->flags & NSF_READ_PENDING) && nc->recv_resume_time == 0 &&
+        !ns_recv_full(nc)) {
+      fd_flags |= _NSF_FD_CAN_READ;
+    }
+#ifdef NS_CC3200
+    // CC3200 does not report UDP sockets as writeable.
+    if (nc->flags & NSF_UDP &&
+        (nc->send_mbuf.len > 0 || nc->flags & NSF_CONNECTING)) {
+      fd_flags |= _NSF_FD_CAN_WRITE;
     }
+#endif
+    tmp = nc->next;
+    ns_mgr_handle_connection(nc, fd_flags, now);
+  }
 
-    if (zero_chunk_received) {
-      hm->message.len = dp->body_len + blen - i;
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    ns_udp_flush(nc);
+    if (!(nc->flags & NSF_SSL_BUSY) &&
+        ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
+         (!ns_send_pending(nc) && !ns_zerocopy_pending(nc) &&
+          (nc->flags & NSF_SEND_AND_CLOSE)))) {
+      ns_close_conn(nc);
     }
   }
 
-  return body_len;
+  return now;
 }
 
-static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
-  struct mbuf *io = &nc->recv_mbuf;
-  struct http_message hm;
-  int req_len;
-  const int is_req = (nc->listener != NULL);
-#ifndef NS_DISABLE_HTTP_WEBSOCKET
-  struct ns_str *vec;
 #endif
-  /*
-   * For HTTP messages without Content-Length, always send HTTP message
-   * before NS_CLOSE message.
-   */
-  if (ev == NS_CLOSE && io->len > 0 &&
-      ns_parse_http(io->buf, io->len, &hm, is_req) > 0) {
-    hm.message.len = io->len;
-    hm.body.len = io->buf + io->len - hm.body.p;
-    nc->handler(nc, is_req ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
-    free_http_proto_data(nc);
-  }
-
-  if (nc->proto_data != NULL) {
-    transfer_file_data(nc);
-  }
 
-  nc->handler(nc, ev, ev_data);
+/*
+ * Schedules an async connect for a resolved address and proto.
+ * Called from two places: `ns_connect_opt()` and from async resolver.
+ * When called from the async resolver, it must trigger `NS_CONNECT` event
+ * with a failure flag to indicate connection failure.
+ */
+NS_INTERNAL struct ns_connection *ns_finish_connect(struct ns_connection *nc,
+                                                    int proto,
+                                                    union socket_address *sa,
+                                                    struct ns_add_sock_opts o) {
+  sock_t sock = INVALID_SOCKET;
+  int rc;
 
-  if (ev == NS_RECV) {
-    struct ns_str *s;
-    req_len = ns_parse_http(io->buf, io->len, &hm, is_req);
+  DBG(("%p %s://%s:%hu", nc, proto == SOCK_DGRAM ? "udp" : "tcp",
+       inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
 
-    if (req_len > 0 &&
-        (s = ns_get_http_header(&hm, "Transfer-Encoding")) != NULL &&
-        ns_vcasecmp(s, "chunked") == 0) {
-      ns_handle_chunked(nc, &hm, io->buf + req_len, io->len - req_len);
+  if ((sock = socket(sa->sa.sa_family, proto, 0)) == INVALID_SOCKET) {
+    int failure = errno;
+    NS_SET_PTRPTR(o.error_string, "cannot create socket");
+    if (nc->flags & NSF_CONNECTING) {
+      ns_call(nc, NS_CONNECT, &failure);
     }
+    ns_destroy_conn(nc);
+    return NULL;
+  }
 
-    if (req_len < 0 || (req_len == 0 && io->len >= NS_MAX_HTTP_REQUEST_SIZE)) {
-      nc->flags |= NSF_CLOSE_IMMEDIATELY;
-    } else if (req_len == 0) {
-      /* Do nothing, request is not yet fully buffered */
-    }
-#ifndef NS_DISABLE_HTTP_WEBSOCKET
-    else if (nc->listener == NULL &&
-             ns_get_http_header(&hm, "Sec-WebSocket-Accept")) {
-      /* We're websocket client, got handshake response from server. */
-      /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = websocket_handler;
-      nc->flags |= NSF_IS_WEBSOCKET;
-      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-      websocket_handler(nc, NS_RECV, ev_data);
-    } else if (nc->listener != NULL &&
-               (vec = ns_get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
-      /* This is a websocket request. Switch protocol handlers. */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = websocket_handler;
-      nc->flags |= NSF_IS_WEBSOCKET;
-
-      /* Send handshake */
-      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, &hm);
-      if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
-        if (nc->send_mbuf.len == 0) {
-          ws_handshake(nc, vec);
-        }
-        nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-        websocket_handler(nc, NS_RECV, ev_data);
-      }
+#ifndef NS_CC3200
+  ns_set_non_blocking_mode(sock);
+#endif
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(__linux__)
+  if (proto == SOCK_DGRAM && sa->sa.sa_family == AF_UNIX) {
+    /* Autobind to an abstract name, otherwise the peer can't reply */
+    union socket_address self;
+    memset(&self, 0, sizeof(self));
+    self.sa.sa_family = AF_UNIX;
+    (void) bind(sock, &self.sa, sizeof(self.un.sun_family));
+  }
+#endif
+  if (proto == SOCK_STREAM) {
+    ns_set_tcp_defaults(sock, sa);
+#ifdef TCP_FASTOPEN_CONNECT
+    /* connect() returns at once, the first write sends the SYN */
+    if ((nc->flags & NSF_TCP_FASTOPEN) && ns_is_inet(sa)) {
+      (void) ns_set_tcp_opt(sock, TCP_FASTOPEN_CONNECT, 1);
     }
-#endif /* NS_DISABLE_HTTP_WEBSOCKET */
-    else if (hm.message.len <= io->len) {
-      /* Whole HTTP message is fully buffered, call event handler */
-      nc->handler(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
-      mbuf_remove(io, hm.message.len);
+#endif
+  }
+  rc = (proto == SOCK_DGRAM) ? 0 : connect(sock, &sa->sa, ns_sa_len(sa));
+
+  if (rc != 0 && ns_is_error(rc)) {
+    NS_SET_PTRPTR(o.error_string, "cannot connect to socket");
+    if (nc->flags & NSF_CONNECTING) {
+      ns_call(nc, NS_CONNECT, &rc);
     }
+    ns_destroy_conn(nc);
+    close(sock);
+    return NULL;
   }
-}
 
-void ns_set_protocol_http_websocket(struct ns_connection *nc) {
-  nc->proto_handler = http_handler;
-}
+  /* Fire NS_CONNECT on next poll. */
+  nc->flags |= NSF_CONNECTING;
 
-#ifndef NS_DISABLE_HTTP_WEBSOCKET
+  /* No ns_destroy_conn() call after this! */
+  ns_set_sock(nc, sock);
+#ifdef NS_ENABLE_UDP_GSO
+  if (proto == SOCK_DGRAM) ns_udp_offload_init(nc);
+#endif
 
-void ns_send_websocket_handshake(struct ns_connection *nc, const char *uri,
-                                 const char *extra_headers) {
-  unsigned long random = (unsigned long) uri;
-  char key[sizeof(random) * 3];
+#ifdef NS_ENABLE_SSL
+  /*
+   * If we are using async resolver, socket isn't open
+   * before this place, so
+   * for SSL connections we have to add socket to SSL fd set
+   */
+  if (nc->ssl != NULL && !(nc->flags & NSF_LISTENING)) {
+    SSL_set_fd(nc->ssl, nc->sock);
+  }
+#endif
 
-  ns_base64_encode((unsigned char *) &random, sizeof(random), key);
-  ns_printf(nc,
-            "GET %s HTTP/1.1\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Version: 13\r\n"
-            "Sec-WebSocket-Key: %s\r\n"
-            "%s\r\n",
-            uri, key, extra_headers == NULL ? "" : extra_headers);
+  return nc;
 }
 
-#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+#ifndef NS_DISABLE_RESOLVER
+/*
+ * Callback for the async resolver on ns_connect_opt() call.
+ * Main task of this function is to trigger NS_CONNECT event with
+ *    either failure (and dealloc the connection)
+ *    or success (and proceed with connect()
+ */
+static void resolve_cb(struct ns_dns_message *msg, void *data) {
+  struct ns_connection *nc = (struct ns_connection *) data;
+  int i;
+  int failure = -1;
 
-#ifndef NS_DISABLE_FILESYSTEM
-static void send_http_error(struct ns_connection *nc, int code,
-                            const char *reason) {
-  if (reason == NULL) {
-    reason = "";
+  if (msg != NULL) {
+    /*
+     * Take the first DNS A answer and run...
+     */
+    for (i = 0; i < msg->num_answers; i++) {
+      if (msg->answers[i].rtype == NS_DNS_A_RECORD) {
+        static struct ns_add_sock_opts opts;
+        /*
+         * Async resolver guarantees that there is at least one answer.
+         * TODO(lsm): handle IPv6 answers too
+         */
+        ns_dns_parse_record_data(msg, &msg->answers[i], &nc->sa.sin.sin_addr,
+                                 4);
+        /* Make ns_finish_connect() trigger NS_CONNECT on failure */
+        nc->flags |= NSF_CONNECTING;
+        ns_finish_connect(nc, nc->flags & NSF_UDP ? SOCK_DGRAM : SOCK_STREAM,
+                          &nc->sa, opts);
+        return;
+      }
+    }
   }
-  ns_printf(nc, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", code, reason);
-}
 
-#ifndef NS_DISABLE_SSI
-static void send_ssi_file(struct ns_connection *, const char *, FILE *, int,
-                          const struct ns_serve_http_opts *);
+  /*
+   * If we get there was no NS_DNS_A_RECORD in the answer
+   */
+  ns_call(nc, NS_CONNECT, &failure);
+  ns_destroy_conn(nc);
+}
+#endif
 
-static void send_file_data(struct ns_connection *nc, FILE *fp) {
-  char buf[BUFSIZ];
-  size_t n;
-  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-    ns_send(nc, buf, n);
-  }
+struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
+                                 ns_event_handler_t callback) {
+  static struct ns_connect_opts opts;
+  return ns_connect_opt(mgr, address, callback, opts);
 }
 
-static void do_ssi_include(struct ns_connection *nc, const char *ssi, char *tag,
-                           int include_level,
-                           const struct ns_serve_http_opts *opts) {
-  char file_name[BUFSIZ], path[MAX_PATH_SIZE], *p;
-  FILE *fp;
+struct ns_connection *ns_connect_opt(struct ns_mgr *mgr, const char *address,
+                                     ns_event_handler_t callback,
+                                     struct ns_connect_opts opts) {
+  struct ns_connection *nc = NULL;
+  int proto, rc;
+  struct ns_add_sock_opts add_sock_opts;
+  char host[NS_MAX_HOST_LEN];
 
-  /*
-   * sscanf() is safe here, since send_ssi_file() also uses buffer
-   * of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
-   */
-  if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
-    /* File name is relative to the webserver root */
-    snprintf(path, sizeof(path), "%s/%s", opts->document_root, file_name);
-  } else if (sscanf(tag, " abspath=\"%[^\"]\"", file_name) == 1) {
+  NS_COPY_COMMON_CONNECTION_OPTIONS(&add_sock_opts, &opts);
+
+  if ((nc = ns_create_connection(mgr, callback, add_sock_opts)) == NULL) {
+    return NULL;
+  } else if ((rc = ns_parse_address(address, &nc->sa, &proto, host,
+                                    sizeof(host))) < 0) {
+    /* Address is malformed */
+    NS_SET_PTRPTR(opts.error_string, "cannot parse address");
+    ns_destroy_conn(nc);
+    return NULL;
+  }
+  nc->flags |= opts.flags & _NS_ALLOWED_CONNECT_FLAGS_MASK;
+  nc->flags |= (proto == SOCK_DGRAM) ? NSF_UDP : 0;
+  nc->user_data = opts.user_data;
+
+  if (rc == 0) {
+#ifndef NS_DISABLE_RESOLVER
     /*
-     * File name is relative to the webserver working directory
-     * or it is absolute system path
+     * DNS resolution is required for host.
+     * ns_parse_address() fills port in nc->sa, which we pass to resolve_cb()
      */
-    snprintf(path, sizeof(path), "%s", file_name);
-  } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1 ||
-             sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
-    /* File name is relative to the currect document */
-    snprintf(path, sizeof(path), "%s", ssi);
-    if ((p = strrchr(path, '/')) != NULL) {
-      p[1] = '\0';
+    if (ns_resolve_async(nc->mgr, host, NS_DNS_A_RECORD, resolve_cb, nc) != 0) {
+      NS_SET_PTRPTR(opts.error_string, "cannot schedule DNS lookup");
+      ns_destroy_conn(nc);
+      return NULL;
     }
-    snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", file_name);
-  } else {
-    ns_printf(nc, "Bad SSI #include: [%s]", tag);
-    return;
-  }
 
-  if ((fp = fopen(path, "rb")) == NULL) {
-    ns_printf(nc, "SSI include error: fopen(%s): %s", path, strerror(errno));
+    return nc;
+#else
+    NS_SET_PTRPTR(opts.error_string, "Resolver is disabled");
+    ns_destroy_conn(nc);
+    return NULL;
+#endif
   } else {
-    ns_set_close_on_exec(fileno(fp));
-    if (ns_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) >
-        0) {
-      send_ssi_file(nc, path, fp, include_level + 1, opts);
-    } else {
-      send_file_data(nc, fp);
-    }
-    fclose(fp);
+    /* Address is parsed and resolved to IP. proceed with connect() */
+    return ns_finish_connect(nc, proto, &nc->sa, add_sock_opts);
   }
 }
 
-#ifndef NS_DISABLE_POPEN
-static void do_ssi_exec(struct ns_connection *nc, char *tag) {
-  char cmd[BUFSIZ];
-  FILE *fp;
+struct ns_connection *ns_bind(struct ns_mgr *srv, const char *address,
+                              ns_event_handler_t event_handler) {
+  static struct ns_bind_opts opts;
+  return ns_bind_opt(srv, address, event_handler, opts);
+}
 
-  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
-    ns_printf(nc, "Bad SSI #exec: [%s]", tag);
-  } else if ((fp = popen(cmd, "r")) == NULL) {
-    ns_printf(nc, "Cannot SSI #exec: [%s]: %s", cmd, strerror(errno));
+struct ns_connection *ns_bind_opt(struct ns_mgr *mgr, const char *address,
+                                  ns_event_handler_t callback,
+                                  struct ns_bind_opts opts) {
+  union socket_address sa;
+  struct ns_connection *nc = NULL;
+  int proto;
+  sock_t sock;
+  struct ns_add_sock_opts add_sock_opts;
+  char host[NS_MAX_HOST_LEN];
+
+  NS_COPY_COMMON_CONNECTION_OPTIONS(&add_sock_opts, &opts);
+
+  if (ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0) {
+    NS_SET_PTRPTR(opts.error_string, "cannot parse address");
+  } else if ((sock = ns_take_inherited(mgr, &sa, proto)) == INVALID_SOCKET &&
+             (sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
+    DBG(("Failed to open listener: %d", errno));
+    NS_SET_PTRPTR(opts.error_string, "failed to open listener");
+  } else if ((nc = ns_add_sock_opt(mgr, sock, callback, add_sock_opts)) ==
+             NULL) {
+    /* opts.error_string set by ns_add_sock_opt */
+    DBG(("Failed to ns_add_sock"));
+    closesocket(sock);
   } else {
-    send_file_data(nc, fp);
-    pclose(fp);
+    nc->sa = sa;
+    nc->handler = callback;
+
+    if (proto == SOCK_DGRAM) {
+      nc->flags |= NSF_UDP;
+#ifdef NS_ENABLE_UDP_GSO
+      ns_udp_offload_init(nc);
+#endif
+    } else {
+      nc->flags |= NSF_LISTENING;
+#if defined(TCP_FASTOPEN) && !defined(_WIN32)
+      if ((nc->flags & NSF_TCP_FASTOPEN) && ns_is_inet(&sa)) {
+        (void) ns_set_tcp_opt(sock, TCP_FASTOPEN, NS_TCP_FASTOPEN_QUEUE);
+      }
+#endif
+    }
+
+    DBG(("%p sock %d/%d", nc, sock, proto));
   }
-}
-#endif /* !NS_DISABLE_POPEN */
 
-static void do_ssi_call(struct ns_connection *nc, char *tag) {
-  ns_call(nc, NS_SSI_CALL, tag);
+  return nc;
 }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
 /*
- * SSI directive has the following format:
- * <!--#directive parameter=value parameter=value -->
+ * Hot restart protocol. The new process connects to the control listener
+ * and receives a 1-byte message with the number of listening sockets,
+ * carrying the sockets themselves as SCM_RIGHTS. It replies with a 1-byte
+ * acknowledgement, and only then the old process closes its listeners.
  */
-static void send_ssi_file(struct ns_connection *nc, const char *path, FILE *fp,
-                          int include_level,
-                          const struct ns_serve_http_opts *opts) {
-  static const struct ns_str btag = NS_STR("<!--#");
-  static const struct ns_str d_include = NS_STR("include");
-  static const struct ns_str d_call = NS_STR("call");
-  static const struct ns_str d_exec = NS_STR("exec");
-  char buf[BUFSIZ], *p = buf + btag.len; /* p points to SSI directive */
-  int ch, offset, len, in_ssi_tag;
-
-  if (include_level > 10) {
-    ns_printf(nc, "SSI #include level is too deep (%s)", path);
-    return;
+#define NS_HANDOFF_ACK 'A'
+
+static void ns_handoff_send(struct ns_connection *nc) {
+  struct ns_connection *c;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * NS_HANDOFF_MAX_SOCKETS)];
+  } ctl;
+  int fds[NS_HANDOFF_MAX_SOCKETS];
+  unsigned char n = 0;
+
+  for (c = nc->mgr->active_connections; c != NULL; c = c->next) {
+    /* Only these are closed on acknowledgement, the rest keep serving */
+    c->flags &= ~NSF_HANDED_OFF;
+    if ((c->flags & NSF_LISTENING) && n < NS_HANDOFF_MAX_SOCKETS) {
+      fds[n++] = c->sock;
+      c->flags |= NSF_HANDED_OFF;
+    }
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (char *) &n;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
   }
 
-  in_ssi_tag = len = offset = 0;
-  while ((ch = fgetc(fp)) != EOF) {
-    if (in_ssi_tag && ch == '>' && buf[len - 1] == '-' && buf[len - 2] == '-') {
-      size_t i = len - 2;
-      in_ssi_tag = 0;
+  if (sendmsg(nc->sock, &msg, 0) != 1) {
+    DBG(("%p sendmsg: %s", nc, strerror(errno)));
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
 
-      /* Trim closing --> */
-      buf[i--] = '\0';
-      while (i > 0 && buf[i] == ' ') {
-        buf[i--] = '\0';
-      }
+static void ns_hot_restart_handler(struct ns_connection *nc, int ev,
+                                   void *ev_data) {
+  struct ns_connection *c;
+  struct ns_peer_cred cred;
+  int n = 0;
 
-      /* Handle known SSI directives */
-      if (memcmp(p, d_include.p, d_include.len) == 0) {
-        do_ssi_include(nc, path, p + d_include.len + 1, include_level, opts);
-      } else if (memcmp(p, d_call.p, d_call.len) == 0) {
-        do_ssi_call(nc, p + d_call.len + 1);
-#ifndef NS_DISABLE_POPEN
-      } else if (memcmp(p, d_exec.p, d_exec.len) == 0) {
-        do_ssi_exec(nc, p + d_exec.len + 1);
-#endif
-      } else {
-        /* Silently ignore unknown SSI directive. */
-      }
-      len = 0;
-    } else if (in_ssi_tag) {
-      if (len == (int) btag.len && memcmp(buf, btag.p, btag.len) != 0) {
-        /* Not an SSI tag */
-        in_ssi_tag = 0;
-      } else if (len == (int) sizeof(buf) - 2) {
-        ns_printf(nc, "%s: SSI tag is too large", path);
-        len = 0;
-      }
-      buf[len++] = ch & 0xff;
-    } else if (ch == '<') {
-      in_ssi_tag = 1;
-      if (len > 0) {
-        ns_send(nc, buf, (size_t) len);
-      }
-      len = 0;
-      buf[len++] = ch & 0xff;
-    } else {
-      buf[len++] = ch & 0xff;
-      if (len == (int) sizeof(buf)) {
-        ns_send(nc, buf, (size_t) len);
-        len = 0;
+  (void) ev_data;
+  if (ev == NS_ACCEPT) {
+    /* Abstract names have no file permissions: check who is asking */
+    if (ns_get_peer_cred(nc, &cred) != 0 || cred.uid != (int) geteuid()) {
+      DBG(("%p handoff refused", nc));
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return;
+    }
+    ns_handoff_send(nc);
+  } else if (ev == NS_RECV && nc->recv_mbuf.buf[0] == NS_HANDOFF_ACK) {
+    /* The new process has the sockets: stop accepting */
+    for (c = nc->mgr->active_connections; c != NULL; c = c->next) {
+      if (c->flags & NSF_HANDED_OFF) {
+        c->flags |= NSF_CLOSE_IMMEDIATELY;
+        n++;
       }
     }
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    if (nc->handler != NULL) nc->handler(nc, NS_HANDOFF, &n);
+  } else if (ev == NS_RECV) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
   }
+}
 
-  /* Send the rest of buffered data */
-  if (len > 0) {
-    ns_send(nc, buf, (size_t) len);
+struct ns_connection *ns_hot_restart_listen(struct ns_mgr *mgr,
+                                            const char *address,
+                                            ns_event_handler_t handler) {
+  struct ns_connection *nc;
+
+  if (strncmp(address, "unix://", 7) != 0) return NULL;
+  if ((nc = ns_bind(mgr, address, handler)) != NULL) {
+    nc->proto_handler = ns_hot_restart_handler;
   }
+  return nc;
 }
 
-static void handle_ssi_request(struct ns_connection *nc, const char *path,
-                               const struct ns_serve_http_opts *opts) {
-  FILE *fp;
-  struct ns_str mime_type;
-
-  if ((fp = fopen(path, "rb")) == NULL) {
-    send_http_error(nc, 404, "Not Found");
-  } else {
-    ns_set_close_on_exec(fileno(fp));
+int ns_hot_restart_takeover(struct ns_mgr *mgr, const char *address) {
+  union socket_address sa;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * NS_HANDOFF_MAX_SOCKETS)];
+  } ctl;
+  struct timeval tv;
+  char host[NS_MAX_HOST_LEN], ack = NS_HANDOFF_ACK;
+  unsigned char count;
+  sock_t sock, *p;
+  int proto, i, n = -1, fd;
+
+  if (strncmp(address, "unix://", 7) != 0 ||
+      ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0 ||
+      (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+    return -1;
+  }
+  if (connect(sock, &sa.sa, ns_sa_len(&sa)) != 0) {
+    /* Nobody to take over from, it's a cold start */
+    closesocket(sock);
+    return 0;
+  }
 
-    mime_type = get_mime_type(path, "text/plain", opts);
-    ns_printf(nc,
-              "HTTP/1.1 200 OK\r\n"
-              "Content-Type: %.*s\r\n"
-              "Connection: close\r\n\r\n",
-              (int) mime_type.len, mime_type.p);
-    send_ssi_file(nc, path, fp, 0, opts);
-    fclose(fp);
-    nc->flags |= NSF_SEND_AND_CLOSE;
+  tv.tv_sec = NS_HANDOFF_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (char *) &count;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  if (recvmsg(sock, &msg, 0) == 1) {
+    n = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      p = (sock_t *) NS_REALLOC(mgr->inherited,
+                                (mgr->num_inherited + n) * sizeof(*p));
+      for (i = 0; i < n; i++) {
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+        if (p == NULL) {
+          closesocket(fd);
+        } else {
+          ns_set_close_on_exec(fd);
+          p[mgr->num_inherited++] = fd;
+        }
+      }
+      if (p == NULL) {
+        n = -1;
+      } else {
+        mgr->inherited = p;
+      }
+    }
+    if (n != count || (msg.msg_flags & MSG_CTRUNC)) {
+      /* Keep whatever arrived, but let the old process keep serving */
+      n = -1;
+    } else if (send(sock, &ack, 1, 0) != 1) {
+      n = -1;
+    }
   }
+  closesocket(sock);
+
+  DBG(("%p took over %d sockets from %s", mgr, n, address));
+  return n;
 }
+#endif
+
+int ns_get_peer_cred(struct ns_connection *nc, struct ns_peer_cred *cred) {
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(SO_PEERCRED)
+  /* Same layout as struct ucred, which glibc hides without _GNU_SOURCE */
+  struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+  } uc;
+  socklen_t len = sizeof(uc);
+
+  if (nc->sa.sa.sa_family != AF_UNIX ||
+      getsockopt(nc->sock, SOL_SOCKET, SO_PEERCRED, &uc, &len) != 0) {
+    return -1;
+  }
+  cred->pid = (int) uc.pid;
+  cred->uid = (int) uc.uid;
+  cred->gid = (int) uc.gid;
+  return 0;
+#elif defined(NS_ENABLE_UNIX_SOCKETS) &&                    \
+    (defined(__APPLE__) || defined(__FreeBSD__) || \
+     defined(__OpenBSD__) || defined(__NetBSD__))
+  uid_t uid;
+  gid_t gid;
+
+  if (nc->sa.sa.sa_family != AF_UNIX || getpeereid(nc->sock, &uid, &gid) != 0) {
+    return -1;
+  }
+  cred->pid = -1;
+  cred->uid = (int) uid;
+  cred->gid = (int) gid;
+  return 0;
 #else
-static void handle_ssi_request(struct ns_connection *nc, const char *path,
-                               const struct ns_serve_http_opts *opts) {
-  (void) path;
-  (void) opts;
-  send_http_error(nc, 500, "SSI disabled");
+  (void) nc;
+  (void) cred;
+  return -1;
+#endif
 }
-#endif /* NS_DISABLE_SSI */
 
-static void construct_etag(char *buf, size_t buf_len, const ns_stat_t *st) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"", (unsigned long) st->st_mtime,
-           (int64_t) st->st_size);
+struct ns_connection *ns_add_sock(struct ns_mgr *s, sock_t sock,
+                                  ns_event_handler_t callback) {
+  static struct ns_add_sock_opts opts;
+  return ns_add_sock_opt(s, sock, callback, opts);
 }
-static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
-  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+
+struct ns_connection *ns_add_sock_opt(struct ns_mgr *s, sock_t sock,
+                                      ns_event_handler_t callback,
+                                      struct ns_add_sock_opts opts) {
+  struct ns_connection *nc = ns_create_connection(s, callback, opts);
+  if (nc != NULL) {
+    ns_set_sock(nc, sock);
+  }
+  return nc;
 }
 
-static int parse_range_header(const struct ns_str *header, int64_t *a,
-                              int64_t *b) {
+struct ns_connection *ns_next(struct ns_mgr *s, struct ns_connection *conn) {
+  return conn == NULL ? s->active_connections : conn->next;
+}
+
+void ns_broadcast(struct ns_mgr *mgr, ns_event_handler_t cb, void *data,
+                  size_t len) {
+  struct ctl_msg ctl_msg;
+
   /*
-   * There is no snscanf. Headers are not guaranteed to be NUL-terminated,
-   * so we have this. Ugh.
+   * Fossa manager has a socketpair, `struct ns_mgr::ctl`,
+   * where `ns_broadcast()` pushes the message.
+   * `ns_mgr_poll()` wakes up, reads a message from the socket pair, and calls
+   * specified callback for each connection. Thus the callback function executes
+   * in event manager thread.
    */
-  int result;
-  char *p = (char *) NS_MALLOC(header->len + 1);
-  if (p == NULL) return 0;
-  memcpy(p, header->p, header->len);
-  p[header->len] = '\0';
-  result = sscanf(p, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
-  NS_FREE(p);
-  return result;
+  if (mgr->ctl[0] != INVALID_SOCKET && data != NULL &&
+      len < sizeof(ctl_msg.message)) {
+    ctl_msg.callback = cb;
+    memcpy(ctl_msg.message, data, len);
+    NS_SEND_FUNC(mgr->ctl[0], (char *) &ctl_msg,
+                 offsetof(struct ctl_msg, message) + len, 0);
+    NS_RECV_FUNC(mgr->ctl[0], (char *) &len, 1, 0);
+  }
 }
 
-static void ns_send_http_file2(struct ns_connection *nc, const char *path,
-                               ns_stat_t *st, struct http_message *hm,
-                               struct ns_serve_http_opts *opts) {
-  struct proto_data_http *dp;
-  struct ns_str mime_type;
-
-  free_http_proto_data(nc);
-  if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) == NULL) {
-    send_http_error(nc, 500, "Server Error"); /* LCOV_EXCL_LINE */
-  } else if ((dp->fp = fopen(path, "rb")) == NULL) {
-    NS_FREE(dp);
-    nc->proto_data = NULL;
-    send_http_error(nc, 500, "Server Error");
-  } else if (ns_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern),
-                             path) > 0) {
-    handle_ssi_request(nc, path, opts);
-  } else {
-    char etag[50], current_time[50], last_modified[50], range[50];
-    time_t t = time(NULL);
-    int64_t r1 = 0, r2 = 0, cl = st->st_size;
-    struct ns_str *range_hdr = ns_get_http_header(hm, "Range");
-    int n, status_code = 200;
-    const char *status_message = "OK";
+static int isbyte(int n) {
+  return n >= 0 && n <= 255;
+}
 
-    /* Handle Range header */
-    range[0] = '\0';
-    if (range_hdr != NULL &&
-        (n = parse_range_header(range_hdr, &r1, &r2)) > 0 && r1 >= 0 &&
-        r2 >= 0) {
-      /* If range is specified like "400-", set second limit to content len */
-      if (n == 1) {
-        r2 = cl - 1;
-      }
-      if (r1 > r2 || r2 >= cl) {
-        status_code = 416;
-        status_message = "Requested range not satisfiable";
-        cl = 0;
-        snprintf(range, sizeof(range),
-                 "Content-Range: bytes */%" INT64_FMT "\r\n",
-                 (int64_t) st->st_size);
-      } else {
-        status_code = 206;
-        status_message = "Partial Content";
-        cl = r2 - r1 + 1;
-        snprintf(range, sizeof(range), "Content-Range: bytes %" INT64_FMT
-                                       "-%" INT64_FMT "/%" INT64_FMT "\r\n",
-                 r1, r1 + cl - 1, (int64_t) st->st_size);
-        fseeko(dp->fp, r1, SEEK_SET);
-      }
-    }
+static int parse_net(const char *spec, uint32_t *net, uint32_t *mask) {
+  int n, a, b, c, d, slash = 32, len = 0;
 
-    construct_etag(etag, sizeof(etag), st);
-    gmt_time_string(current_time, sizeof(current_time), &t);
-    gmt_time_string(last_modified, sizeof(last_modified), &st->st_mtime);
-    mime_type = get_mime_type(path, "text/plain", opts);
-    ns_printf(nc,
-              "HTTP/1.1 %d %s\r\n"
-              "Date: %s\r\n"
-              "Last-Modified: %s\r\n"
-              "Accept-Ranges: bytes\r\n"
-              "Content-Type: %.*s\r\n"
-              "Content-Length: %" INT64_FMT
-              "\r\n"
-              "%s"
-              "Etag: %s\r\n"
-              "\r\n",
-              status_code, status_message, current_time, last_modified,
-              (int) mime_type.len, mime_type.p, cl, range, etag);
-    nc->proto_data = (void *) dp;
-    dp->cl = cl;
-    dp->type = DATA_FILE;
-    transfer_file_data(nc);
+  if ((sscanf(spec, "%d.%d.%d.%d/%d%n", &a, &b, &c, &d, &slash, &n) == 5 ||
+       sscanf(spec, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) == 4) &&
+      isbyte(a) && isbyte(b) && isbyte(c) && isbyte(d) && slash >= 0 &&
+      slash < 33) {
+    len = n;
+    *net =
+        ((uint32_t) a << 24) | ((uint32_t) b << 16) | ((uint32_t) c << 8) | d;
+    *mask = slash ? 0xffffffffU << (32 - slash) : 0;
   }
+
+  return len;
 }
 
-static void remove_double_dots(char *s) {
-  char *p = s;
+int ns_check_ip_acl(const char *acl, uint32_t remote_ip) {
+  int allowed, flag;
+  uint32_t net, mask;
+  struct ns_str vec;
 
-  while (*s != '\0') {
-    *p++ = *s++;
-    if (s[-1] == '/' || s[-1] == '\\') {
-      while (s[0] != '\0') {
-        if (s[0] == '/' || s[0] == '\\') {
-          s++;
-        } else if (s[0] == '.' && s[1] == '.') {
-          s += 2;
-        } else {
-          break;
-        }
-      }
+  /* If any ACL is set, deny by default */
+  allowed = (acl == NULL || *acl == '\0') ? '+' : '-';
+
+  while ((acl = ns_next_comma_list_entry(acl, &vec, NULL)) != NULL) {
+    flag = vec.p[0];
+    if ((flag != '+' && flag != '-') ||
+        parse_net(&vec.p[1], &net, &mask) == 0) {
+      return -1;
+    }
+
+    if (net == (remote_ip & mask)) {
+      allowed = flag;
     }
   }
-  *p = '\0';
+
+  return allowed == '+';
 }
 
-#endif
+/*
+ * Compiled ACL: a binary trie per address family, indexed by address bits.
+ * A node at depth N stands for an N-bit prefix and holds the last rule for
+ * that prefix. A lookup walks the address bits once, and the latest rule met
+ * on the way wins, as in ns_check_ip_acl().
+ */
+struct ns_ip_acl_node {
+  int child[2]; /* Indices in ns_ip_acl::nodes, 0 if none */
+  int rule;     /* 1 + index of the rule in the ACL string, 0 if none */
+  int allow;
+};
 
-static int ns_url_decode(const char *src, int src_len, char *dst, int dst_len,
-                         int is_form_url_encoded) {
-  int i, j, a, b;
-#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+struct ns_ip_acl {
+  struct ns_ip_acl_node *nodes; /* nodes[0] is the IPv4 root, [1] IPv6 */
+  int num_nodes;
+  int size;
+  int num_rules; /* 0 allows everything */
+};
 
-  for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
-    if (src[i] == '%') {
-      if (i < src_len - 2 && isxdigit(*(const unsigned char *) (src + i + 1)) &&
-          isxdigit(*(const unsigned char *) (src + i + 2))) {
-        a = tolower(*(const unsigned char *) (src + i + 1));
-        b = tolower(*(const unsigned char *) (src + i + 2));
-        dst[j] = (char) ((HEXTOI(a) << 4) | HEXTOI(b));
-        i += 2;
-      } else {
-        return -1;
+static int ns_ip_acl_insert(struct ns_ip_acl *acl, int root,
+                            const unsigned char *addr, int prefix_len,
+                            int allow, int rule) {
+  struct ns_ip_acl_node *nodes;
+  int i, bit, n = root;
+
+  for (i = 0; i < prefix_len; i++) {
+    bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+    if (acl->nodes[n].child[bit] == 0) {
+      if (acl->num_nodes == acl->size) {
+        nodes = (struct ns_ip_acl_node *) NS_REALLOC(
+            acl->nodes, acl->size * 2 * sizeof(*nodes));
+        if (nodes == NULL) return -1;
+        acl->nodes = nodes;
+        acl->size *= 2;
       }
-    } else if (is_form_url_encoded && src[i] == '+') {
-      dst[j] = ' ';
-    } else {
-      dst[j] = src[i];
+      memset(&acl->nodes[acl->num_nodes], 0, sizeof(*nodes));
+      acl->nodes[n].child[bit] = acl->num_nodes++;
     }
+    n = acl->nodes[n].child[bit];
   }
+  acl->nodes[n].rule = rule;
+  acl->nodes[n].allow = allow;
 
-  dst[j] = '\0'; /* Null-terminate the destination */
-
-  return i >= src_len ? j : -1;
+  return 0;
 }
 
-int ns_get_http_var(const struct ns_str *buf, const char *name, char *dst,
-                    size_t dst_len) {
-  const char *p, *e, *s;
-  size_t name_len;
-  int len;
+/* Parse `x.x.x.x[/n]` or, with IPv6 support, `x:x::x[/n]` */
+static int ns_ip_acl_parse(const struct ns_str *spec, unsigned char *addr,
+                           int *prefix_len) {
+  uint32_t net, mask;
+  char buf[60], *slash;
+  int n;
 
-  if (dst == NULL || dst_len == 0) {
-    len = -2;
-  } else if (buf->p == NULL || name == NULL || buf->len == 0) {
-    len = -1;
-    dst[0] = '\0';
-  } else {
-    name_len = strlen(name);
-    e = buf->p + buf->len;
-    len = -1;
-    dst[0] = '\0';
+  if (spec->len >= sizeof(buf)) return -1;
+  memcpy(buf, spec->p, spec->len);
+  buf[spec->len] = '\0';
 
-    for (p = buf->p; p + name_len < e; p++) {
-      if ((p == buf->p || p[-1] == '&') && p[name_len] == '=' &&
-          !ns_ncasecmp(name, p, name_len)) {
-        p += name_len + 1;
-        s = (const char *) memchr(p, '&', (size_t)(e - p));
-        if (s == NULL) {
-          s = e;
-        }
-        len = ns_url_decode(p, (size_t)(s - p), dst, dst_len, 1);
-        if (len == -1) {
-          len = -2;
-        }
-        break;
-      }
+  if ((n = parse_net(buf, &net, &mask)) == (int) spec->len) {
+    for (*prefix_len = 0; *prefix_len < 32 && (mask & 0x80000000U);
+         mask <<= 1) {
+      (*prefix_len)++;
+    }
+    net = htonl(net);
+    memcpy(addr, &net, sizeof(net));
+    return AF_INET;
+  }
+#ifdef NS_ENABLE_IPV6
+  *prefix_len = 128;
+  if ((slash = strchr(buf, '/')) != NULL) {
+    *slash++ = '\0';
+    if (sscanf(slash, "%d%n", prefix_len, &n) != 1 || slash[n] != '\0' ||
+        *prefix_len < 0 || *prefix_len > 128) {
+      return -1;
     }
   }
+  if (inet_pton(AF_INET6, buf, addr) == 1) {
+    return AF_INET6;
+  }
+#else
+  (void) slash;
+#endif
 
-  return len;
+  return -1;
 }
 
-void ns_send_http_chunk(struct ns_connection *nc, const char *buf, size_t len) {
-  char chunk_size[50];
-  int n;
+struct ns_ip_acl *ns_ip_acl_compile(const char *spec) {
+  struct ns_ip_acl *acl;
+  unsigned char addr[16];
+  int family, prefix_len, rule = 0;
+  struct ns_str vec, net;
 
-  n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n", (unsigned long) len);
-  ns_send(nc, chunk_size, n);
-  ns_send(nc, buf, len);
-  ns_send(nc, "\r\n", 2);
+  if ((acl = (struct ns_ip_acl *) NS_CALLOC(1, sizeof(*acl))) == NULL ||
+      (acl->nodes = (struct ns_ip_acl_node *) NS_CALLOC(
+           16, sizeof(*acl->nodes))) == NULL) {
+    NS_FREE(acl);
+    return NULL;
+  }
+  acl->size = 16;
+  acl->num_nodes = 2;
+
+  while (spec != NULL &&
+         (spec = ns_next_comma_list_entry(spec, &vec, NULL)) != NULL) {
+    net.p = vec.p + 1;
+    net.len = vec.len - 1;
+    if ((vec.p[0] != '+' && vec.p[0] != '-') ||
+        (family = ns_ip_acl_parse(&net, addr, &prefix_len)) < 0 ||
+        ns_ip_acl_insert(acl, family == AF_INET ? 0 : 1, addr, prefix_len,
+                         vec.p[0] == '+', ++rule) != 0) {
+      ns_ip_acl_free(acl);
+      return NULL;
+    }
+  }
+  /* /0 rules add no nodes, so count rules rather than nodes */
+  acl->num_rules = rule;
+
+  return acl;
 }
 
-void ns_printf_http_chunk(struct ns_connection *nc, const char *fmt, ...) {
-  char mem[500], *buf = mem;
-  int len;
-  va_list ap;
+void ns_ip_acl_free(struct ns_ip_acl *acl) {
+  if (acl != NULL) {
+    NS_FREE(acl->nodes);
+    NS_FREE(acl);
+  }
+}
 
-  va_start(ap, fmt);
-  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
-  va_end(ap);
+static int ns_ip_acl_lookup(const struct ns_ip_acl *acl, int n,
+                            const unsigned char *addr, int bits) {
+  int i, rule = 0, allow = 0;
 
-  if (len >= 0) {
-    ns_send_http_chunk(nc, buf, len);
+  for (i = 0;; i++) {
+    if (acl->nodes[n].rule > rule) {
+      rule = acl->nodes[n].rule;
+      allow = acl->nodes[n].allow;
+    }
+    if (i == bits ||
+        (n = acl->nodes[n].child[(addr[i / 8] >> (7 - i % 8)) & 1]) == 0) {
+      break;
+    }
   }
 
-  /* LCOV_EXCL_START */
-  if (buf != mem && buf != NULL) {
-    NS_FREE(buf);
-  }
-  /* LCOV_EXCL_STOP */
+  /* An empty ACL allows everything, otherwise deny by default */
+  return rule > 0 ? allow : acl->num_rules == 0;
 }
 
-void ns_printf_html_escape(struct ns_connection *nc, const char *fmt, ...) {
-  char mem[500], *buf = mem;
-  int i, j, len;
-  va_list ap;
-
-  va_start(ap, fmt);
-  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
-  va_end(ap);
+int ns_ip_acl_check(const struct ns_ip_acl *acl,
+                    const union socket_address *sa) {
+  const unsigned char *addr;
 
-  if (len >= 0) {
-    for (i = j = 0; i < len; i++) {
-      if (buf[i] == '<' || buf[i] == '>') {
-        ns_send(nc, buf + j, i - j);
-        ns_send(nc, buf[i] == '<' ? "&lt;" : "&gt;", 4);
-        j = i + 1;
-      }
+  if (acl == NULL) return 1;
+  if (sa->sa.sa_family == AF_INET) {
+    return ns_ip_acl_lookup(acl, 0, (const unsigned char *) &sa->sin.sin_addr,
+                            32);
+  }
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) {
+    addr = (const unsigned char *) &sa->sin6.sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&sa->sin6.sin6_addr)) {
+      /* IPv4 client on a dual-stack socket */
+      return ns_ip_acl_lookup(acl, 0, addr + 12, 32);
     }
-    ns_send(nc, buf + j, i - j);
+    return ns_ip_acl_lookup(acl, 1, addr, 128);
   }
+#endif
+  (void) addr;
 
-  /* LCOV_EXCL_START */
-  if (buf != mem && buf != NULL) {
-    NS_FREE(buf);
+  /* Not an IP peer: only an empty ACL lets it in */
+  return acl->num_rules == 0;
+}
+
+int ns_set_ip_acl(struct ns_connection *nc, const char *spec) {
+  struct ns_ip_acl *acl = NULL;
+
+  if (spec != NULL && *spec != '\0' &&
+      (acl = ns_ip_acl_compile(spec)) == NULL) {
+    return -1;
   }
-  /* LCOV_EXCL_STOP */
+  /* Swap in one step, a bad ACL leaves the old one in place */
+  ns_ip_acl_free(nc->ip_acl);
+  nc->ip_acl = acl;
+
+  return 0;
 }
 
-int ns_http_parse_header(struct ns_str *hdr, const char *var_name, char *buf,
-                         size_t buf_size) {
-  int ch = ' ', ch1 = ',', len = 0, n = strlen(var_name);
-  const char *p, *end = hdr->p + hdr->len, *s = NULL;
+struct ns_rate_limit *ns_rate_limit_create(struct ns_rate_limit_opts opts) {
+  struct ns_rate_limit *rl;
+  int i;
 
-  if (buf != NULL && buf_size > 0) buf[0] = '\0';
+  if (opts.rate <= 0) return NULL;
+  if (opts.burst < 1) opts.burst = 1;
+  if (opts.max_clients <= 0) opts.max_clients = NS_RATE_LIMIT_DEFAULT_CLIENTS;
+  if (opts.action == 0) opts.action = NS_RATE_LIMIT_REJECT;
 
-  /* Find where variable starts */
-  for (s = hdr->p; s != NULL && s + n < end; s++) {
-    if ((s == hdr->p || s[-1] == ch || s[-1] == ch1) && s[n] == '=' &&
-        !memcmp(s, var_name, n))
-      break;
+  if ((rl = (struct ns_rate_limit *) NS_CALLOC(1, sizeof(*rl))) == NULL) {
+    return NULL;
   }
-
-  if (s != NULL && &s[n + 1] < end) {
-    s += n + 1;
-    if (*s == '"' || *s == '\'') {
-      ch = ch1 = *s++;
-    }
-    p = s;
-    while (p < end && p[0] != ch && p[0] != ch1 && len < (int) buf_size) {
-      if (ch != ' ' && p[0] == '\\' && p[1] == ch) p++;
-      buf[len++] = *p++;
-    }
-    if (len >= (int) buf_size || (ch != ' ' && *p != ch)) {
-      len = 0;
-    } else {
-      if (len > 0 && s[len - 1] == ',') len--;
-      if (len > 0 && s[len - 1] == ';') len--;
-      buf[len] = '\0';
-    }
+  rl->opts = opts;
+  rl->refs = 1;
+  rl->lru_head = rl->lru_tail = -1;
+  /* At least two chains per bucket keeps chains short */
+  for (rl->mask = 1; rl->mask < (uint32_t) opts.max_clients * 2;) {
+    rl->mask <<= 1;
+  }
+  rl->buckets = (struct ns_rate_limit_bucket *) NS_MALLOC(
+      opts.max_clients * sizeof(*rl->buckets));
+  rl->chains = (int *) NS_MALLOC(rl->mask * sizeof(*rl->chains));
+  if (rl->buckets == NULL || rl->chains == NULL) {
+    ns_rate_limit_free(rl);
+    return NULL;
   }
+  for (i = 0; i < (int) rl->mask; i++) rl->chains[i] = -1;
+  rl->mask--;
 
-  return len;
+  return rl;
 }
 
-#ifndef NS_DISABLE_FILESYSTEM
-static int is_file_hidden(const char *path,
-                          const struct ns_serve_http_opts *opts) {
-  const char *p1 = opts->per_directory_auth_file;
-  const char *p2 = opts->hidden_file_pattern;
-  return !strcmp(path, ".") || !strcmp(path, "..") ||
-         (p1 != NULL && !strcmp(path, p1)) ||
-         (p2 != NULL && ns_match_prefix(p2, strlen(p2), path) > 0);
+void ns_rate_limit_free(struct ns_rate_limit *rl) {
+  if (rl != NULL && --rl->refs == 0) {
+    NS_FREE(rl->buckets);
+    NS_FREE(rl->chains);
+    NS_FREE(rl);
+  }
 }
 
-#ifndef NS_DISABLE_HTTP_DIGEST_AUTH
-static FILE *open_auth_file(const char *path, int is_directory,
-                            const struct ns_serve_http_opts *opts) {
-  char buf[MAX_PATH_SIZE];
-  const char *p;
-  FILE *fp = NULL;
+static void ns_rate_limit_lru_unlink(struct ns_rate_limit *rl, int i) {
+  struct ns_rate_limit_bucket *b = &rl->buckets[i];
 
-  if (opts->global_auth_file != NULL) {
-    fp = fopen(opts->global_auth_file, "r");
-  } else if (is_directory && opts->per_directory_auth_file) {
-    snprintf(buf, sizeof(buf), "%s%c%s", path, DIRSEP,
-             opts->per_directory_auth_file);
-    fp = fopen(buf, "r");
-  } else if (opts->per_directory_auth_file) {
-    if ((p = strrchr(path, '/')) == NULL && (p = strrchr(path, '\\')) == NULL) {
-      p = path;
-    }
-    snprintf(buf, sizeof(buf), "%.*s/%s", (int) (p - path), path,
-             opts->per_directory_auth_file);
-    fp = fopen(buf, "r");
+  if (b->lru_prev >= 0) {
+    rl->buckets[b->lru_prev].lru_next = b->lru_next;
+  } else {
+    rl->lru_head = b->lru_next;
+  }
+  if (b->lru_next >= 0) {
+    rl->buckets[b->lru_next].lru_prev = b->lru_prev;
+  } else {
+    rl->lru_tail = b->lru_prev;
   }
-
-  return fp;
 }
 
-/*
- * Stringify binary data. Output buffer size must be 2 * size_of_input + 1
- * because each byte of input takes 2 bytes in string representation
- * plus 1 byte for the terminating \0 character.
- */
-static void bin2str(char *to, const unsigned char *p, size_t len) {
-  static const char *hex = "0123456789abcdef";
+static void ns_rate_limit_lru_push(struct ns_rate_limit *rl, int i) {
+  struct ns_rate_limit_bucket *b = &rl->buckets[i];
 
-  for (; len--; p++) {
-    *to++ = hex[p[0] >> 4];
-    *to++ = hex[p[0] & 0x0f];
-  }
-  *to = '\0';
+  b->lru_prev = -1;
+  b->lru_next = rl->lru_head;
+  if (rl->lru_head >= 0) rl->buckets[rl->lru_head].lru_prev = i;
+  rl->lru_head = i;
+  if (rl->lru_tail < 0) rl->lru_tail = i;
 }
 
-static char *ns_md5(char *buf, ...) {
-  unsigned char hash[16];
-  const unsigned char *p;
-  va_list ap;
-  MD5_CTX ctx;
+/* Find the bucket of a key, taking over the least recently used if new */
+static struct ns_rate_limit_bucket *ns_rate_limit_bucket(
+    struct ns_rate_limit *rl, const void *key, size_t key_len, double now) {
+  const unsigned char *p = (const unsigned char *) key;
+  size_t n =
+      key_len < NS_RATE_LIMIT_KEY_SIZE ? key_len : NS_RATE_LIMIT_KEY_SIZE;
+  uint32_t hash = 2166136261U; /* FNV-1a */
+  struct ns_rate_limit_bucket *b;
+  int i, *link;
 
-  MD5_Init(&ctx);
+  for (i = 0; i < (int) key_len; i++) hash = (hash ^ p[i]) * 16777619U;
 
-  va_start(ap, buf);
-  while ((p = va_arg(ap, const unsigned char *) ) != NULL) {
-    size_t len = va_arg(ap, size_t);
-    MD5_Update(&ctx, p, len);
+  for (i = rl->chains[hash & rl->mask]; i >= 0; i = b->next) {
+    b = &rl->buckets[i];
+    if (b->hash == hash && b->key_len == key_len &&
+        memcmp(b->key, key, n) == 0) {
+      if (i != rl->lru_head) {
+        ns_rate_limit_lru_unlink(rl, i);
+        ns_rate_limit_lru_push(rl, i);
+      }
+      return b;
+    }
   }
-  va_end(ap);
 
-  MD5_Final(hash, &ctx);
-  bin2str(buf, hash, sizeof(hash));
+  if (rl->stats.num_clients < rl->opts.max_clients) {
+    i = rl->stats.num_clients++;
+  } else {
+    i = rl->lru_tail;
+    b = &rl->buckets[i];
+    for (link = &rl->chains[b->hash & rl->mask]; *link != i;
+         link = &rl->buckets[*link].next) {
+    }
+    *link = b->next;
+    ns_rate_limit_lru_unlink(rl, i);
+    rl->stats.evicted++;
+  }
+
+  b = &rl->buckets[i];
+  b->tokens = rl->opts.burst;
+  b->last = now;
+  b->hash = hash;
+  b->key_len = key_len;
+  memcpy(b->key, key, n);
+  b->next = rl->chains[hash & rl->mask];
+  rl->chains[hash & rl->mask] = i;
+  ns_rate_limit_lru_push(rl, i);
+
+  return b;
+}
+
+double ns_rate_limit_take(struct ns_rate_limit *rl, const void *key,
+                          size_t key_len, double now) {
+  struct ns_rate_limit_bucket *b;
+
+  if (rl == NULL) return 0;
+  b = ns_rate_limit_bucket(rl, key, key_len, now);
+  if (now > b->last) {
+    b->tokens += (now - b->last) * rl->opts.rate;
+    if (b->tokens > rl->opts.burst) b->tokens = rl->opts.burst;
+    b->last = now;
+  }
+  if (b->tokens >= 1) {
+    b->tokens -= 1;
+    rl->stats.allowed++;
+    return 0;
+  }
+  rl->stats.limited++;
 
-  return buf;
+  return (1 - b->tokens) / rl->opts.rate;
 }
 
-static void mkmd5resp(const char *method, size_t method_len, const char *uri,
-                      size_t uri_len, const char *ha1, size_t ha1_len,
-                      const char *nonce, size_t nonce_len, const char *nc,
-                      size_t nc_len, const char *cnonce, size_t cnonce_len,
-                      const char *qop, size_t qop_len, char *resp) {
-  static const char colon[] = ":";
-  static const size_t one = 1;
-  char ha2[33];
+double ns_rate_limit_take_addr(struct ns_rate_limit *rl,
+                               const union socket_address *sa, double now) {
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) {
+    const unsigned char *a = sa->sin6.sin6_addr.s6_addr;
+    /* IPv4-mapped addresses share the bucket of the IPv4 address */
+    if (IN6_IS_ADDR_V4MAPPED(&sa->sin6.sin6_addr)) {
+      return ns_rate_limit_take(rl, a + 12, 4, now);
+    }
+    return ns_rate_limit_take(rl, a, 16, now);
+  }
+#endif
+  if (sa->sa.sa_family == AF_INET) {
+    return ns_rate_limit_take(rl, &sa->sin.sin_addr, 4, now);
+  }
+  return ns_rate_limit_take(rl, "", 0, now);
+}
 
-  ns_md5(ha2, method, method_len, colon, one, uri, uri_len, NULL);
-  ns_md5(resp, ha1, ha1_len, colon, one, nonce, nonce_len, colon, one, nc,
-         nc_len, colon, one, cnonce, cnonce_len, colon, one, qop, qop_len,
-         colon, one, ha2, sizeof(ha2) - 1, NULL);
+void ns_rate_limit_get_stats(const struct ns_rate_limit *rl,
+                             struct ns_rate_limit_stats *stats) {
+  *stats = rl->stats;
 }
 
-int ns_http_create_digest_auth_header(char *buf, size_t buf_len,
-                                      const char *method, const char *uri,
-                                      const char *auth_domain, const char *user,
-                                      const char *passwd) {
-  static const char colon[] = ":", qop[] = "auth";
-  static const size_t one = 1;
-  char ha1[33], resp[33], cnonce[40];
+void ns_set_rate_limit(struct ns_connection *nc, int which,
+                       struct ns_rate_limit *rl) {
+  if (rl != NULL) rl->refs++;
+  ns_rate_limit_free(nc->rate_limit[which]);
+  nc->rate_limit[which] = rl;
+}
 
-  snprintf(cnonce, sizeof(cnonce), "%x", (unsigned int) time(NULL));
-  ns_md5(ha1, user, (size_t) strlen(user), colon, one, auth_domain,
-         (size_t) strlen(auth_domain), colon, one, passwd,
-         (size_t) strlen(passwd), NULL);
-  mkmd5resp(method, strlen(method), uri, strlen(uri), ha1, sizeof(ha1) - 1,
-            cnonce, strlen(cnonce), "1", one, cnonce, strlen(cnonce), qop,
-            sizeof(qop) - 1, resp);
-  return snprintf(buf, buf_len,
-                  "Authorization: Digest username=\"%s\","
-                  "realm=\"%s\",uri=\"%s\",qop=%s,nc=1,cnonce=%s,"
-                  "nonce=%s,response=%s\r\n",
-                  user, auth_domain, uri, qop, cnonce, cnonce, resp);
+int ns_rate_limit_message(struct ns_connection *nc, void *msg,
+                          double *retry_after) {
+  struct ns_rate_limit *rl = nc->rate_limit[NS_RATE_LIMIT_MESSAGES];
+  struct ns_str key;
+  double now;
+
+  *retry_after = 0;
+  if (rl == NULL) return 0;
+
+  now = ns_time();
+  if (rl->opts.get_key != NULL && rl->opts.get_key(nc, msg, &key)) {
+    *retry_after = ns_rate_limit_take(rl, key.p, key.len, now);
+  } else {
+    *retry_after = ns_rate_limit_take_addr(rl, &nc->sa, now);
+  }
+  if (*retry_after <= 0) return 0;
+
+  DBG(("%p rate limited for %g s", nc, *retry_after));
+  if (rl->opts.action == NS_RATE_LIMIT_CLOSE) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (rl->opts.action == NS_RATE_LIMIT_DELAY) {
+    nc->flags |= NSF_RATE_LIMITED;
+    nc->recv_resume_time = now + *retry_after;
+  }
+
+  return rl->opts.action;
 }
 
+/* Move data from one connection to another */
+void ns_forward(struct ns_connection *from, struct ns_connection *to) {
+  ns_send(to, from->recv_mbuf.buf, from->recv_mbuf.len);
+  mbuf_remove(&from->recv_mbuf, from->recv_mbuf.len);
+}
+#ifdef NS_MODULE_LINES
+#line 1 "src/multithreading.c"
+/**/
+#endif
 /*
- * Check for authentication timeout.
- * Clients send time stamp encoded in nonce. Make sure it is not too old,
- * to prevent replay attacks.
- * Assumption: nonce is a hexadecimal number of seconds since 1970.
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
  */
-static int check_nonce(const char *nonce) {
-  unsigned long now = (unsigned long) time(NULL);
-  unsigned long val = (unsigned long) strtoul(nonce, NULL, 16);
-  return 1 || now < val || now - val < 3600;
-}
+
+/* Amalgamated: #include "internal.h" */
+
+#ifdef NS_ENABLE_THREADS
+
+static void multithreaded_ev_handler(struct ns_connection *c, int ev, void *p);
+
+/*
+ * This thread function executes user event handler.
+ * It runs an event manager that has only one connection, until that
+ * connection is alive.
+ */
+static void *per_connection_thread_function(void *param) {
+  struct ns_connection *c = (struct ns_connection *) param;
+  struct ns_mgr m;
+
+  ns_mgr_init(&m, NULL);
+  ns_add_conn(&m, c);
+  while (m.active_connections != NULL) {
+    ns_mgr_poll(&m, 1000);
+  }
+  ns_mgr_free(&m);
+
+  return param;
+}
+
+static void link_conns(struct ns_connection *c1, struct ns_connection *c2) {
+  c1->priv_2 = c2;
+  c2->priv_2 = c1;
+}
+
+static void unlink_conns(struct ns_connection *c) {
+  struct ns_connection *peer = (struct ns_connection *) c->priv_2;
+  if (peer != NULL) {
+    peer->flags |= NSF_SEND_AND_CLOSE;
+    peer->priv_2 = NULL;
+  }
+  c->priv_2 = NULL;
+}
+
+static void forwarder_ev_handler(struct ns_connection *c, int ev, void *p) {
+  (void) p;
+  if (ev == NS_RECV && c->priv_2) {
+    ns_forward(c, c->priv_2);
+  } else if (ev == NS_CLOSE) {
+    unlink_conns(c);
+  }
+}
+
+static void spawn_handling_thread(struct ns_connection *nc) {
+  struct ns_mgr dummy = {};
+  sock_t sp[2];
+  struct ns_connection *c[2];
+
+  /*
+   * Create a socket pair, and wrap each socket into the connection with
+   * dummy event manager.
+   * c[0] stays in this thread, c[1] goes to another thread.
+   */
+  ns_socketpair(sp, SOCK_STREAM);
+  c[0] = ns_add_sock(&dummy, sp[0], forwarder_ev_handler);
+  c[1] = ns_add_sock(&dummy, sp[1], nc->listener->priv_1);
+
+  /* Interlink client connection with c[0] */
+  link_conns(c[0], nc);
+
+  /*
+   * Switch c[0] manager from the dummy one to the real one. c[1] manager
+   * will be set in another thread, allocated on stack of that thread.
+   */
+  ns_add_conn(nc->mgr, c[0]);
+#ifdef NS_ENABLE_SPLICE
+  /* Plain sockets go through the kernel, forwarder_ev_handler does the rest */
+  ns_splice(nc, c[0]);
+#endif
+
+  /*
+   * Dress c[1] as nc.
+   * TODO(lsm): code in accept_conn() looks similar. Refactor.
+   */
+  c[1]->listener = nc->listener;
+  c[1]->proto_handler = nc->proto_handler;
+  c[1]->proto_data = nc->proto_data;
+  c[1]->user_data = nc->user_data;
+
+  ns_start_thread(per_connection_thread_function, c[1]);
+}
+
+static void multithreaded_ev_handler(struct ns_connection *c, int ev, void *p) {
+  (void) p;
+  if (ev == NS_ACCEPT) {
+    spawn_handling_thread(c);
+    c->handler = forwarder_ev_handler;
+  }
+}
+
+void ns_enable_multithreading(struct ns_connection *nc) {
+  /* Wrap user event handler into our multithreaded_ev_handler */
+  nc->priv_1 = nc->handler;
+  nc->handler = multithreaded_ev_handler;
+}
+#endif
+#ifdef NS_MODULE_LINES
+#line 1 "src/http.c"
+/**/
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef NS_DISABLE_HTTP
+
+/* Amalgamated: #include "internal.h" */
+
+enum http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT, DATA_CGI };
+
+struct proto_data_http {
+  FILE *fp;         /* Opened file. */
+  int64_t offset;   /* File offset of the first byte to send or write. */
+  int64_t cl;       /* Content-Length. How many bytes to send. */
+  int64_t sent;     /* How many bytes have been already sent. */
+  int64_t body_len; /* How many bytes of chunked body was reassembled. */
+  struct ns_http_file_job *file_job; /* See ns_offload_file_io() */
+  double write_pause; /* recv_resume_time set while file_job writes */
+  struct ns_connection *cgi_nc;
+  enum http_proto_data_type type;
+};
+
+/*
+ * This structure helps to create an environment for the spawned CGI program.
+ * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
+ * last element must be NULL.
+ * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
+ * strings must reside in a contiguous buffer. The end of the buffer is
+ * marked by two '\0' characters.
+ * We satisfy both worlds: we create an envp array (which is vars), all
+ * entries are actually pointers inside buf.
+ */
+struct cgi_env_block {
+  struct ns_connection *nc;
+  char buf[NS_CGI_ENVIRONMENT_SIZE];       /* Environment buffer */
+  const char *vars[NS_MAX_CGI_ENVIR_VARS]; /* char *envp[] */
+  int len;                                 /* Space taken */
+  int nvars;                               /* Number of variables in envp[] */
+};
+
+#define MIME_ENTRY(_ext, _type) \
+  { _ext, sizeof(_ext) - 1, _type }
+static const struct {
+  const char *extension;
+  size_t ext_len;
+  const char *mime_type;
+} static_builtin_mime_types[] = {
+    MIME_ENTRY("html", "text/html"),
+    MIME_ENTRY("html", "text/html"),
+    MIME_ENTRY("htm", "text/html"),
+    MIME_ENTRY("shtm", "text/html"),
+    MIME_ENTRY("shtml", "text/html"),
+    MIME_ENTRY("css", "text/css"),
+    MIME_ENTRY("js", "application/x-javascript"),
+    MIME_ENTRY("ico", "image/x-icon"),
+    MIME_ENTRY("gif", "image/gif"),
+    MIME_ENTRY("jpg", "image/jpeg"),
+    MIME_ENTRY("jpeg", "image/jpeg"),
+    MIME_ENTRY("png", "image/png"),
+    MIME_ENTRY("svg", "image/svg+xml"),
+    MIME_ENTRY("txt", "text/plain"),
+    MIME_ENTRY("torrent", "application/x-bittorrent"),
+    MIME_ENTRY("wav", "audio/x-wav"),
+    MIME_ENTRY("mp3", "audio/x-mp3"),
+    MIME_ENTRY("mid", "audio/mid"),
+    MIME_ENTRY("m3u", "audio/x-mpegurl"),
+    MIME_ENTRY("ogg", "application/ogg"),
+    MIME_ENTRY("ram", "audio/x-pn-realaudio"),
+    MIME_ENTRY("xml", "text/xml"),
+    MIME_ENTRY("ttf", "application/x-font-ttf"),
+    MIME_ENTRY("json", "application/json"),
+    MIME_ENTRY("xslt", "application/xml"),
+    MIME_ENTRY("xsl", "application/xml"),
+    MIME_ENTRY("ra", "audio/x-pn-realaudio"),
+    MIME_ENTRY("doc", "application/msword"),
+    MIME_ENTRY("exe", "application/octet-stream"),
+    MIME_ENTRY("zip", "application/x-zip-compressed"),
+    MIME_ENTRY("xls", "application/excel"),
+    MIME_ENTRY("tgz", "application/x-tar-gz"),
+    MIME_ENTRY("tar", "application/x-tar"),
+    MIME_ENTRY("gz", "application/x-gunzip"),
+    MIME_ENTRY("arj", "application/x-arj-compressed"),
+    MIME_ENTRY("rar", "application/x-rar-compressed"),
+    MIME_ENTRY("rtf", "application/rtf"),
+    MIME_ENTRY("pdf", "application/pdf"),
+    MIME_ENTRY("swf", "application/x-shockwave-flash"),
+    MIME_ENTRY("mpg", "video/mpeg"),
+    MIME_ENTRY("webm", "video/webm"),
+    MIME_ENTRY("mpeg", "video/mpeg"),
+    MIME_ENTRY("mov", "video/quicktime"),
+    MIME_ENTRY("mp4", "video/mp4"),
+    MIME_ENTRY("m4v", "video/x-m4v"),
+    MIME_ENTRY("asf", "video/x-ms-asf"),
+    MIME_ENTRY("avi", "video/x-msvideo"),
+    MIME_ENTRY("bmp", "image/bmp"),
+    {NULL, 0, NULL}};
+
+#ifndef NS_DISABLE_FILESYSTEM
+
+static int ns_mkdir(const char *path, uint32_t mode) {
+#ifndef _WIN32
+  return mkdir(path, mode);
+#else
+  (void) mode;
+  return _mkdir(path);
+#endif
+}
+
+static struct ns_str get_mime_type(const char *path, const char *dflt,
+                                   const struct ns_serve_http_opts *opts) {
+  const char *ext, *overrides;
+  size_t i, path_len;
+  struct ns_str r, k, v;
+
+  path_len = strlen(path);
+
+  overrides = opts->custom_mime_types;
+  while ((overrides = ns_next_comma_list_entry(overrides, &k, &v)) != NULL) {
+    ext = path + (path_len - k.len);
+    if (path_len > k.len && ns_vcasecmp(&k, ext) == 0) {
+      return v;
+    }
+  }
+
+  for (i = 0; static_builtin_mime_types[i].extension != NULL; i++) {
+    ext = path + (path_len - static_builtin_mime_types[i].ext_len);
+    if (path_len > static_builtin_mime_types[i].ext_len && ext[-1] == '.' &&
+        ns_casecmp(ext, static_builtin_mime_types[i].extension) == 0) {
+      r.p = static_builtin_mime_types[i].mime_type;
+      r.len = strlen(r.p);
+      return r;
+    }
+  }
+
+  r.p = dflt;
+  r.len = strlen(r.p);
+  return r;
+}
+#endif
+
+/*
+ * Check whether full request is buffered. Return:
+ *   -1  if request is malformed
+ *    0  if request is not yet fully buffered
+ *   >0  actual request length, including last \r\n\r\n
+ */
+static int get_request_len(const char *s, int buf_len) {
+  const unsigned char *buf = (unsigned char *) s;
+  int i;
+
+  for (i = 0; i < buf_len; i++) {
+    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
+      return -1;
+    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
+      return i + 2;
+    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
+               buf[i + 2] == '\n') {
+      return i + 3;
+    }
+  }
+
+  return 0;
+}
+
+static const char *parse_http_headers(const char *s, const char *end, int len,
+                                      struct http_message *req) {
+  int i;
+  for (i = 0; i < (int) ARRAY_SIZE(req->header_names); i++) {
+    struct ns_str *k = &req->header_names[i], *v = &req->header_values[i];
+
+    s = ns_skip(s, end, ": ", k);
+    s = ns_skip(s, end, "\r\n", v);
+
+    while (v->len > 0 && v->p[v->len - 1] == ' ') {
+      v->len--; /* Trim trailing spaces in header value */
+    }
+
+    if (k->len == 0 || v->len == 0) {
+      k->p = v->p = NULL;
+      k->len = v->len = 0;
+      break;
+    }
+
+    if (!ns_ncasecmp(k->p, "Content-Length", 14)) {
+      req->body.len = to64(v->p);
+      req->message.len = len + req->body.len;
+    }
+  }
+
+  return s;
+}
+
+int ns_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
+  const char *end, *qs;
+  int len = get_request_len(s, n);
+
+  if (len <= 0) return len;
+
+  memset(hm, 0, sizeof(*hm));
+  hm->message.p = s;
+  hm->body.p = s + len;
+  hm->message.len = hm->body.len = (size_t) ~0;
+  end = s + len;
+
+  /* Request is fully buffered. Skip leading whitespaces. */
+  while (s < end && isspace(*(unsigned char *) s)) s++;
+
+  if (is_req) {
+    /* Parse request line: method, URI, proto */
+    s = ns_skip(s, end, " ", &hm->method);
+    s = ns_skip(s, end, " ", &hm->uri);
+    s = ns_skip(s, end, "\r\n", &hm->proto);
+    if (hm->uri.p <= hm->method.p || hm->proto.p <= hm->uri.p) return -1;
+
+    /* If URI contains '?' character, initialize query_string */
+    if ((qs = (char *) memchr(hm->uri.p, '?', hm->uri.len)) != NULL) {
+      hm->query_string.p = qs + 1;
+      hm->query_string.len = &hm->uri.p[hm->uri.len] - (qs + 1);
+      hm->uri.len = qs - hm->uri.p;
+    }
+  } else {
+    s = ns_skip(s, end, " ", &hm->proto);
+    if (end - s < 4 || s[3] != ' ') return -1;
+    hm->resp_code = atoi(s);
+    if (hm->resp_code < 100 || hm->resp_code >= 600) return -1;
+    s += 4;
+    s = ns_skip(s, end, "\r\n", &hm->resp_status_msg);
+  }
+
+  s = parse_http_headers(s, end, len, hm);
+
+  /*
+   * ns_parse_http() is used to parse both HTTP requests and HTTP
+   * responses. If HTTP response does not have Content-Length set, then
+   * body is read until socket is closed, i.e. body.len is infinite (~0).
+   *
+   * For HTTP requests though, according to
+   * http://tools.ietf.org/html/rfc7231#section-8.1.3,
+   * only POST and PUT methods have defined body semantics.
+   * Therefore, if Content-Length is not specified and methods are
+   * not one of PUT or POST, set body length to 0.
+   *
+   * So,
+   * if it is HTTP request, and Content-Length is not set,
+   * and method is not (PUT or POST) then reset body length to zero.
+   */
+  if (hm->body.len == (size_t) ~0 && is_req &&
+      ns_vcasecmp(&hm->method, "PUT") != 0 &&
+      ns_vcasecmp(&hm->method, "POST") != 0) {
+    hm->body.len = 0;
+    hm->message.len = len;
+  }
+
+  return len;
+}
+
+struct ns_str *ns_get_http_header(struct http_message *hm, const char *name) {
+  size_t i, len = strlen(name);
+
+  for (i = 0; i < ARRAY_SIZE(hm->header_names); i++) {
+    struct ns_str *h = &hm->header_names[i], *v = &hm->header_values[i];
+    if (h->p != NULL && h->len == len && !ns_ncasecmp(h->p, name, len))
+      return v;
+  }
+
+  return NULL;
+}
+
+#ifndef NS_DISABLE_HTTP_WEBSOCKET
+
+static int is_ws_fragment(unsigned char flags) {
+  return (flags & 0x80) == 0 || (flags & 0x0f) == 0;
+}
+
+static int is_ws_first_fragment(unsigned char flags) {
+  return (flags & 0x80) == 0 && (flags & 0x0f) != 0;
+}
+
+static void handle_incoming_websocket_frame(struct ns_connection *nc,
+                                            struct websocket_message *wsm) {
+  if (wsm->flags & 0x8) {
+    nc->handler(nc, NS_WEBSOCKET_CONTROL_FRAME, wsm);
+  } else {
+    nc->handler(nc, NS_WEBSOCKET_FRAME, wsm);
+  }
+}
+
+static int deliver_websocket_data(struct ns_connection *nc) {
+  /* Using unsigned char *, cause of integer arithmetic below */
+  uint64_t i, data_len = 0, frame_len = 0, buf_len = nc->recv_mbuf.len, len,
+              mask_len = 0, header_len = 0;
+  unsigned char *p = (unsigned char *) nc->recv_mbuf.buf, *buf = p,
+                *e = p + buf_len;
+  unsigned *sizep = (unsigned *) &p[1]; /* Size ptr for defragmented frames */
+  int ok, reass = buf_len > 0 && is_ws_fragment(p[0]) &&
+                  !(nc->flags & NSF_WEBSOCKET_NO_DEFRAG);
+
+  /* If that's a continuation frame that must be reassembled, handle it */
+  if (reass && !is_ws_first_fragment(p[0]) && buf_len >= 1 + sizeof(*sizep) &&
+      buf_len >= 1 + sizeof(*sizep) + *sizep) {
+    buf += 1 + sizeof(*sizep) + *sizep;
+    buf_len -= 1 + sizeof(*sizep) + *sizep;
+  }
+
+  if (buf_len >= 2) {
+    len = buf[1] & 127;
+    mask_len = buf[1] & 128 ? 4 : 0;
+    if (len < 126 && buf_len >= mask_len) {
+      data_len = len;
+      header_len = 2 + mask_len;
+    } else if (len == 126 && buf_len >= 4 + mask_len) {
+      header_len = 4 + mask_len;
+      data_len = ntohs(*(uint16_t *) &buf[2]);
+    } else if (buf_len >= 10 + mask_len) {
+      header_len = 10 + mask_len;
+      data_len = (((uint64_t) ntohl(*(uint32_t *) &buf[2])) << 32) +
+                 ntohl(*(uint32_t *) &buf[6]);
+    }
+  }
+
+  frame_len = header_len + data_len;
+  ok = frame_len > 0 && frame_len <= buf_len;
+
+  if (ok) {
+    struct websocket_message wsm;
+
+    wsm.size = (size_t) data_len;
+    wsm.data = buf + header_len;
+    wsm.flags = buf[0];
+
+    /* Apply mask if necessary */
+    if (mask_len > 0) {
+      for (i = 0; i < data_len; i++) {
+        buf[i + header_len] ^= (buf + header_len - mask_len)[i % 4];
+      }
+    }
+
+    if (reass) {
+      /* On first fragmented frame, nullify size */
+      if (is_ws_first_fragment(wsm.flags)) {
+        mbuf_resize(&nc->recv_mbuf, nc->recv_mbuf.size + sizeof(*sizep));
+        p[0] &= ~0x0f; /* Next frames will be treated as continuation */
+        buf = p + 1 + sizeof(*sizep);
+        *sizep = 0; /* TODO(lsm): fix. this can stomp over frame data */
+      }
+
+      /* Append this frame to the reassembled buffer */
+      memmove(buf, wsm.data, e - wsm.data);
+      (*sizep) += wsm.size;
+      nc->recv_mbuf.len -= wsm.data - buf;
+
+      /* On last fragmented frame - call user handler and remove data */
+      if (wsm.flags & 0x80) {
+        wsm.data = p + 1 + sizeof(*sizep);
+        wsm.size = *sizep;
+        handle_incoming_websocket_frame(nc, &wsm);
+        mbuf_remove(&nc->recv_mbuf, 1 + sizeof(*sizep) + *sizep);
+      }
+    } else {
+      /* TODO(lsm): properly handle OOB control frames during defragmentation */
+      handle_incoming_websocket_frame(nc, &wsm);
+      mbuf_remove(&nc->recv_mbuf, (size_t) frame_len); /* Cleanup frame */
+    }
+
+    /* If client closes, close too */
+    if ((buf[0] & 0x0f) == WEBSOCKET_OP_CLOSE) {
+      nc->flags |= NSF_SEND_AND_CLOSE;
+    }
+  }
+
+  return ok;
+}
+
+struct ws_mask_ctx {
+  size_t pos; /* zero means unmasked */
+  uint32_t mask;
+};
+
+static uint32_t ws_random_mask() {
+/*
+ * The spec requires WS client to generate hard to
+ * guess mask keys. From RFC6455, Section 5.3:
+ *
+ * The unpredictability of the masking key is essential to prevent
+ * authors of malicious applications from selecting the bytes that appear on
+ * the wire.
+ *
+ * Hence this feature is essential when the actual end user of this API
+ * is untrusted code that wouldn't have access to a lower level net API
+ * anyway (e.g. web browsers). Hence this feature is low prio for most
+ * fossa use cases and thus can be disabled, e.g. when porting to a platform
+ * that lacks random().
+ */
+#if NS_DISABLE_WS_RANDOM_MASK
+  return 0xefbeadde; /* generated with a random number generator, I swear */
+#else
+  if (sizeof(long) >= 4) {
+    return (uint32_t) random();
+  } else if (sizeof(long) == 2) {
+    return (uint32_t) random() << 16 | (uint32_t) random();
+  }
+#endif
+}
+
+/* Build a frame header, including the mask on client connections */
+static int ns_build_ws_header(struct ns_connection *nc, int op, size_t len,
+                              unsigned char *header, uint32_t *mask) {
+  int header_len;
+
+  header[0] = 0x80 + (op & 0x0f);
+  if (len < 126) {
+    header[1] = len;
+    header_len = 2;
+  } else if (len < 65535) {
+    uint16_t tmp = htons((uint16_t) len);
+    header[1] = 126;
+    memcpy(&header[2], &tmp, sizeof(tmp));
+    header_len = 4;
+  } else {
+    uint32_t tmp;
+    header[1] = 127;
+    tmp = htonl((uint32_t)((uint64_t) len >> 32));
+    memcpy(&header[2], &tmp, sizeof(tmp));
+    tmp = htonl((uint32_t)(len & 0xffffffff));
+    memcpy(&header[6], &tmp, sizeof(tmp));
+    header_len = 10;
+  }
+
+  /* client connections enable masking */
+  if (nc->listener == NULL) {
+    header[1] |= 1 << 7; /* set masking flag */
+    *mask = ws_random_mask();
+    memcpy(&header[header_len], mask, sizeof(*mask));
+    header_len += sizeof(*mask);
+  }
+
+  return header_len;
+}
+
+static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len,
+                              struct ws_mask_ctx *ctx) {
+  unsigned char header[14];
+
+  ns_send(nc, header, ns_build_ws_header(nc, op, len, header, &ctx->mask));
+  ctx->pos = nc->listener == NULL ? nc->send_mbuf.len : 0;
+}
+
+static void ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
+  size_t i;
+  if (ctx->pos == 0) return;
+  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
+    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
+  }
+}
+
+void ns_send_websocket_frame(struct ns_connection *nc, int op, const void *data,
+                             size_t len) {
+  struct ws_mask_ctx ctx;
+  ns_send_ws_header(nc, op, len, &ctx);
+  ns_send(nc, data, len);
+
+  ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+void ns_send_websocket_frame_at(struct ns_connection *nc, int op, size_t off) {
+  struct ws_mask_ctx ctx;
+  unsigned char header[14];
+  int n = ns_build_ws_header(nc, op, nc->send_mbuf.len - off, header,
+                             &ctx.mask);
+
+  mbuf_insert(&nc->send_mbuf, off, header, n);
+  ctx.pos = nc->listener == NULL ? off + n : 0;
+  ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+void ns_send_websocket_framev(struct ns_connection *nc, int op,
+                              const struct ns_str *strv, int strvcnt) {
+  struct ws_mask_ctx ctx;
+  int i;
+  int len = 0;
+  for (i = 0; i < strvcnt; i++) {
+    len += strv[i].len;
+  }
+
+  ns_send_ws_header(nc, op, len, &ctx);
+
+  for (i = 0; i < strvcnt; i++) {
+    ns_send(nc, strv[i].p, strv[i].len);
+  }
+
+  ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+void ns_printf_websocket_frame(struct ns_connection *nc, int op,
+                               const char *fmt, ...) {
+  size_t off = nc->send_mbuf.len;
+  va_list ap;
+
+  va_start(ap, fmt);
+  if (ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap) > 0) {
+    ns_send_websocket_frame_at(nc, op, off);
+  }
+  va_end(ap);
+}
+
+static void websocket_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  nc->handler(nc, ev, ev_data);
+
+  switch (ev) {
+    case NS_RECV:
+      do {
+      } while (deliver_websocket_data(nc));
+      break;
+    case NS_POLL:
+      /* Ping idle websocket connections */
+      {
+        time_t now = *(time_t *) ev_data;
+        if (nc->flags & NSF_IS_WEBSOCKET &&
+            now > nc->last_io_time + NS_WEBSOCKET_PING_INTERVAL_SECONDS) {
+          ns_send_websocket_frame(nc, WEBSOCKET_OP_PING, "", 0);
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static void ws_handshake(struct ns_connection *nc, const struct ns_str *key) {
+  static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  char buf[500], sha[20], b64_sha[sizeof(sha) * 2];
+  cs_sha1_ctx sha_ctx;
+
+  snprintf(buf, sizeof(buf), "%.*s%s", (int) key->len, key->p, magic);
+
+  cs_sha1_init(&sha_ctx);
+  cs_sha1_update(&sha_ctx, (unsigned char *) buf, strlen(buf));
+  cs_sha1_final((unsigned char *) sha, &sha_ctx);
+
+  ns_base64_encode((unsigned char *) sha, sizeof(sha), b64_sha);
+  ns_printf(nc, "%s%s%s",
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: ",
+            b64_sha, "\r\n\r\n");
+}
+
+#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+
+#ifdef NS_WORKERS
+/* A read or write of the file being served or uploaded */
+struct ns_http_file_job {
+  struct ns_job job;
+  int fd;          /* A dup() of the file's descriptor */
+  int is_write;
+  int64_t offset;  /* File offset */
+  size_t len;      /* Bytes to read or write */
+  size_t done;     /* Bytes read or written, fewer on EOF or error */
+  struct mbuf buf; /* Data to write, or data read */
+};
+#endif
+
+static void free_http_proto_data(struct ns_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  if (dp != NULL) {
+    if (dp->fp != NULL) {
+      fclose(dp->fp);
+    }
+    if (dp->cgi_nc != NULL) {
+      dp->cgi_nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    }
+#ifdef NS_WORKERS
+    if (dp->file_job != NULL) {
+      /* It has its own file descriptor, and won't report back */
+      dp->file_job->job.nc = NULL;
+    }
+#endif
+    NS_FREE(dp);
+    nc->proto_data = NULL;
+  }
+}
+
+#ifdef NS_WORKERS
+static void transfer_file_data(struct ns_connection *nc);
+static void http_handle_recv(struct ns_connection *nc, void *ev_data);
+
+static void ns_http_file_run(struct ns_job *job) {
+  struct ns_http_file_job *fj = (struct ns_http_file_job *) job;
+  char *p;
+  size_t left;
+  off_t off;
+  ssize_t n;
+
+  while (fj->done < fj->len) {
+    p = fj->buf.buf + fj->done;
+    left = fj->len - fj->done;
+    off = (off_t)(fj->offset + fj->done);
+    n = fj->is_write ? pwrite(fj->fd, p, left, off)
+                     : pread(fj->fd, p, left, off);
+    if (n > 0) {
+      fj->done += n;
+    } else if (n == 0 || errno != EINTR) {
+      break;
+    }
+  }
+}
+
+/* Send the data read, or go on with the upload */
+static void ns_http_file_done(struct ns_job *job) {
+  struct ns_http_file_job *fj = (struct ns_http_file_job *) job;
+  struct ns_connection *nc = job->nc;
+  struct proto_data_http *dp;
+  int n;
+
+  if (nc != NULL) {
+    dp = (struct proto_data_http *) nc->proto_data;
+    dp->file_job = NULL;
+    if (fj->is_write) {
+      /* Resume reading, unless someone else paused it meanwhile */
+      if (dp->write_pause != 0 && nc->recv_resume_time == dp->write_pause) {
+        nc->recv_resume_time = 0;
+      }
+      dp->write_pause = 0;
+    } else {
+      ns_send(nc, fj->buf.buf, (int) fj->done);
+    }
+    if (fj->done < fj->len) {
+      free_http_proto_data(nc);
+    } else {
+      transfer_file_data(nc);
+    }
+    if (fj->is_write && nc->proto_data == NULL && nc->recv_mbuf.len > 0) {
+      /* A request that came after the body */
+      n = (int) nc->recv_mbuf.len;
+      http_handle_recv(nc, &n);
+    }
+  }
+  close(fj->fd);
+  mbuf_free(&fj->buf);
+  NS_FREE(fj);
+}
+
+/*
+ * Read `len` bytes of the file into a new buffer, or write `len` bytes of
+ * the input buffer to it, in a worker thread. The connection waits for one
+ * job at a time; more writes are only started to flush a closing upload,
+ * and don't report back.
+ */
+static int ns_http_file_start(struct ns_connection *nc, int is_write,
+                              size_t len) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  struct ns_http_file_job *fj;
+  struct mbuf *io = &nc->recv_mbuf;
+
+  if ((fj = (struct ns_http_file_job *) NS_CALLOC(1, sizeof(*fj))) == NULL) {
+    return -1;
+  } else if ((fj->fd = dup(fileno(dp->fp))) < 0) {
+    NS_FREE(fj);
+    return -1;
+  }
+
+  if (!is_write) {
+    mbuf_init(&fj->buf, len);
+  } else if (len == io->len) {
+    /* Take the whole input buffer over */
+    fj->buf = *io;
+    mbuf_init(io, 0);
+  } else if (mbuf_append(&fj->buf, io->buf, len) == len) {
+    mbuf_remove(io, len);
+  }
+  if (fj->buf.size < len) {
+    close(fj->fd);
+    mbuf_free(&fj->buf);
+    NS_FREE(fj);
+    return -1;
+  }
+
+  fj->job.run = ns_http_file_run;
+  fj->job.done = ns_http_file_done;
+  fj->is_write = is_write;
+  fj->offset = dp->offset + dp->sent;
+  fj->len = len;
+  dp->sent += len;
+  if (dp->file_job == NULL) {
+    fj->job.nc = nc;
+    dp->file_job = fj;
+  }
+  return ns_workers_add(nc->mgr->file_workers, &fj->job);
+}
+
+/* Read ahead the file being served, or write the upload received so far */
+static void transfer_file_data_async(struct ns_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  int64_t left = dp->cl - dp->sent;
+  size_t len = 0;
+
+  if (left <= 0) {
+    /* All of it is read or written, or being so */
+  } else if (dp->type == DATA_PUT) {
+    if (dp->file_job == NULL || (nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+      len = left < (int64_t) nc->recv_mbuf.len ? (size_t) left
+                                                : nc->recv_mbuf.len;
+    } else if (nc->recv_mbuf.len >= NS_HTTP_READ_AHEAD &&
+               nc->recv_resume_time == 0) {
+      /* Stop reading until the write is done, re-check every second */
+      nc->recv_resume_time = dp->write_pause = ns_time() + 1;
+    }
+  } else if (dp->file_job == NULL && !(nc->flags & NSF_CLOSE_IMMEDIATELY) &&
+             nc->send_mbuf.len < NS_HTTP_READ_AHEAD / 2) {
+    len = NS_HTTP_READ_AHEAD - nc->send_mbuf.len;
+    if ((int64_t) len > left) len = (size_t) left;
+  }
+
+  if (dp->file_job == NULL && left <= 0) {
+    free_http_proto_data(nc);
+  } else if (len > 0 && ns_http_file_start(nc, dp->type == DATA_PUT, len) !=
+                            0) {
+    free_http_proto_data(nc);
+  }
+}
+#endif /* NS_WORKERS */
+
+static void transfer_file_data(struct ns_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  char buf[NS_MAX_HTTP_SEND_IOBUF];
+  int64_t left = dp->cl - dp->sent;
+  size_t n = 0, to_read = 0;
+
+#ifdef NS_WORKERS
+  if (nc->mgr->file_workers != NULL &&
+      (dp->type == DATA_FILE || dp->type == DATA_PUT)) {
+    transfer_file_data_async(nc);
+    return;
+  }
+#endif
+
+  if (dp->type == DATA_FILE) {
+    struct mbuf *io = &nc->send_mbuf;
+    if (io->len < sizeof(buf)) {
+      to_read = sizeof(buf) - io->len;
+    }
+
+    if (left > 0 && to_read > (size_t) left) {
+      to_read = left;
+    }
+
+    if (to_read == 0) {
+      /* Rate limiting. send_mbuf is too full, wait until it's drained. */
+    } else if (dp->sent < dp->cl && (n = fread(buf, 1, to_read, dp->fp)) > 0) {
+      ns_send(nc, buf, n);
+      dp->sent += n;
+    } else {
+      free_http_proto_data(nc);
+    }
+  } else if (dp->type == DATA_PUT) {
+    struct mbuf *io = &nc->recv_mbuf;
+    size_t to_write =
+        left <= 0 ? 0 : left < (int64_t) io->len ? (size_t) left : io->len;
+    size_t n = fwrite(io->buf, 1, to_write, dp->fp);
+    if (n > 0) {
+      mbuf_remove(io, n);
+      dp->sent += n;
+    }
+    if (n == 0 || dp->sent >= dp->cl) {
+      free_http_proto_data(nc);
+    }
+  } else if (dp->type == DATA_CGI) {
+    /* This is POST data that needs to be forwarded to the CGI process */
+    if (dp->cgi_nc != NULL) {
+      ns_forward(nc, dp->cgi_nc);
+    } else {
+      nc->flags |= NSF_SEND_AND_CLOSE;
+    }
+  }
+}
+
+/*
+ * Parse chunked-encoded buffer. Return 0 if the buffer is not encoded, or
+ * if it's incomplete. If the chunk is fully buffered, return total number of
+ * bytes in a chunk, and store data in `data`, `data_len`.
+ */
+static size_t parse_chunk(char *buf, size_t len, char **chunk_data,
+                          size_t *chunk_len) {
+  unsigned char *s = (unsigned char *) buf;
+  size_t n = 0; /* scanned chunk length */
+  size_t i = 0; /* index in s */
+
+  /* Scan chunk length. That should be a hexadecimal number. */
+  while (i < len && isxdigit(s[i])) {
+    n *= 16;
+    n += (s[i] >= '0' && s[i] <= '9') ? s[i] - '0' : tolower(s[i]) - 'a' + 10;
+    i++;
+  }
+
+  /* Skip new line */
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
+    return 0;
+  }
+  i += 2;
+
+  /* Record where the data is */
+  *chunk_data = (char *) s + i;
+  *chunk_len = n;
+
+  /* Skip data */
+  i += n;
+
+  /* Skip new line */
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
+    return 0;
+  }
+  return i + 2;
+}
+
+NS_INTERNAL size_t ns_handle_chunked(struct ns_connection *nc,
+                                     struct http_message *hm, char *buf,
+                                     size_t blen) {
+  struct proto_data_http *dp;
+  char *data;
+  size_t i, n, data_len, body_len, zero_chunk_received = 0;
+
+  /* If not allocated, allocate proto_data to hold reassembled offset */
+  if (nc->proto_data == NULL &&
+      (nc->proto_data = NS_CALLOC(1, sizeof(*dp))) == NULL) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return 0;
+  }
+
+  /* Find out piece of received data that is not yet reassembled */
+  dp = (struct proto_data_http *) nc->proto_data;
+  body_len = dp->body_len;
+  assert(blen >= body_len);
+
+  /* Traverse all fully buffered chunks */
+  for (i = body_len; (n = parse_chunk(buf + i, blen - i, &data, &data_len)) > 0;
+       i += n) {
+    /* Collapse chunk data to the rest of HTTP body */
+    memmove(buf + body_len, data, data_len);
+    body_len += data_len;
+    hm->body.len = body_len;
+
+    if (data_len == 0) {
+      zero_chunk_received = 1;
+      i += n;
+      break;
+    }
+  }
+
+  if (i > body_len) {
+    /* Shift unparsed content to the parsed body */
+    assert(i <= blen);
+    memmove(buf + body_len, buf + i, blen - i);
+    memset(buf + body_len + blen - i, 0, i - body_len);
+    nc->recv_mbuf.len -= i - body_len;
+    dp->body_len = body_len;
+
+    /* Send NS_HTTP_CHUNK event */
+    nc->flags &= ~NSF_DELETE_CHUNK;
+    nc->handler(nc, NS_HTTP_CHUNK, hm);
+
+    /* Delete processed data if user set NSF_DELETE_CHUNK flag */
+    if (nc->flags & NSF_DELETE_CHUNK) {
+      memset(buf, 0, body_len);
+      memmove(buf, buf + body_len, blen - i);
+      nc->recv_mbuf.len -= body_len;
+      hm->body.len = dp->body_len = 0;
+    }
+
+    if (zero_chunk_received) {
+      hm->message.len = dp->body_len + blen - i;
+    }
+  }
+
+  return body_len;
+}
+
+/* Apply the message rate limit to a request. Return 1 if it's held back. */
+static int ns_http_rate_limited(struct ns_connection *nc,
+                                struct http_message *hm) {
+  double retry_after;
+
+  switch (ns_rate_limit_message(nc, hm, &retry_after)) {
+    case 0:
+      return 0;
+    case NS_RATE_LIMIT_REJECT:
+      ns_printf(nc,
+                "HTTP/1.1 429 Too Many Requests\r\n"
+                "Retry-After: %d\r\n"
+                "Content-Length: 0\r\n\r\n",
+                (int) retry_after + 1);
+      mbuf_remove(&nc->recv_mbuf, hm->message.len);
+      break;
+    default:
+      /* Closing, or delayed: the request stays buffered */
+      break;
+  }
+
+  return 1;
+}
+
+/* Handle the requests, replies or websocket handshake in the input buffer */
+static void http_handle_recv(struct ns_connection *nc, void *ev_data) {
+  struct mbuf *io = &nc->recv_mbuf;
+  struct http_message hm;
+  struct ns_str *s;
+  int req_len;
+  const int is_req = (nc->listener != NULL);
+#ifndef NS_DISABLE_HTTP_WEBSOCKET
+  struct ns_str *vec;
+#endif
+
+  req_len = ns_parse_http(io->buf, io->len, &hm, is_req);
+
+  if (req_len > 0 &&
+      (s = ns_get_http_header(&hm, "Transfer-Encoding")) != NULL &&
+      ns_vcasecmp(s, "chunked") == 0) {
+    ns_handle_chunked(nc, &hm, io->buf + req_len, io->len - req_len);
+  }
+
+  if (req_len < 0 || (req_len == 0 && io->len >= NS_MAX_HTTP_REQUEST_SIZE)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (req_len == 0) {
+    /* Do nothing, request is not yet fully buffered */
+  } else if (is_req && hm.message.len <= io->len &&
+             ns_http_rate_limited(nc, &hm)) {
+    /* Rejected or delayed, see ns_set_rate_limit() */
+  }
+#ifndef NS_DISABLE_HTTP_WEBSOCKET
+  else if (nc->listener == NULL &&
+           ns_get_http_header(&hm, "Sec-WebSocket-Accept")) {
+    /* We're websocket client, got handshake response from server. */
+    /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
+    mbuf_remove(io, req_len);
+    nc->proto_handler = websocket_handler;
+    nc->flags |= NSF_IS_WEBSOCKET;
+    nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+    websocket_handler(nc, NS_RECV, ev_data);
+  } else if (nc->listener != NULL &&
+             (vec = ns_get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
+    /* This is a websocket request. Switch protocol handlers. */
+    mbuf_remove(io, req_len);
+    nc->proto_handler = websocket_handler;
+    nc->flags |= NSF_IS_WEBSOCKET;
+
+    /* Send handshake */
+    nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, &hm);
+    if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+      if (nc->send_mbuf.len == 0) {
+        ws_handshake(nc, vec);
+      }
+      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+      websocket_handler(nc, NS_RECV, ev_data);
+    }
+  }
+#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+  else if (hm.message.len <= io->len) {
+    /* Whole HTTP message is fully buffered, call event handler */
+    nc->handler(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
+    mbuf_remove(io, hm.message.len);
+  }
+}
+
+static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct mbuf *io = &nc->recv_mbuf;
+  struct http_message hm;
+  struct proto_data_http *dp;
+  const int is_req = (nc->listener != NULL);
+  /*
+   * For HTTP messages without Content-Length, always send HTTP message
+   * before NS_CLOSE message.
+   */
+  if (ev == NS_CLOSE && io->len > 0 &&
+      ns_parse_http(io->buf, io->len, &hm, is_req) > 0) {
+    hm.message.len = io->len;
+    hm.body.len = io->buf + io->len - hm.body.p;
+    nc->handler(nc, is_req ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
+    free_http_proto_data(nc);
+  }
+
+  if (nc->proto_data != NULL) {
+    transfer_file_data(nc);
+  }
+
+  nc->handler(nc, ev, ev_data);
+
+  if (ev == NS_POLL && (nc->flags & NSF_RATE_LIMITED) &&
+      nc->recv_resume_time == 0) {
+    /* Retry the request delayed by the rate limit */
+    nc->flags &= ~NSF_RATE_LIMITED;
+    ev = NS_RECV;
+  }
+
+  dp = (struct proto_data_http *) nc->proto_data;
+  if (ev == NS_RECV && (dp == NULL || dp->type != DATA_PUT)) {
+    /* Not while the body of an upload is being written, see handle_put() */
+    http_handle_recv(nc, ev_data);
+  } else if (ev == NS_CLOSE && dp != NULL && dp->type != DATA_CGI) {
+    /* CGI state goes away with the CGI connection, see cgi_ev_handler() */
+    free_http_proto_data(nc);
+  }
+}
+
+void ns_set_protocol_http_websocket(struct ns_connection *nc) {
+  nc->proto_handler = http_handler;
+}
+
+#ifndef NS_DISABLE_HTTP_WEBSOCKET
+
+void ns_send_websocket_handshake(struct ns_connection *nc, const char *uri,
+                                 const char *extra_headers) {
+  unsigned long random = (unsigned long) uri;
+  char key[sizeof(random) * 3];
+
+  ns_base64_encode((unsigned char *) &random, sizeof(random), key);
+  ns_printf(nc,
+            "GET %s HTTP/1.1\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Version: 13\r\n"
+            "Sec-WebSocket-Key: %s\r\n"
+            "%s\r\n",
+            uri, key, extra_headers == NULL ? "" : extra_headers);
+}
+
+#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+
+#ifndef NS_DISABLE_FILESYSTEM
+static void send_http_error(struct ns_connection *nc, int code,
+                            const char *reason) {
+  if (reason == NULL) {
+    reason = "";
+  }
+  ns_printf(nc, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", code, reason);
+}
+
+#ifndef NS_DISABLE_SSI
+static void send_ssi_file(struct ns_connection *, const char *, FILE *, int,
+                          const struct ns_serve_http_opts *);
+
+static void send_file_data(struct ns_connection *nc, FILE *fp) {
+  char buf[BUFSIZ];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    ns_send(nc, buf, n);
+  }
+}
+
+static void do_ssi_include(struct ns_connection *nc, const char *ssi, char *tag,
+                           int include_level,
+                           const struct ns_serve_http_opts *opts) {
+  char file_name[BUFSIZ], path[MAX_PATH_SIZE], *p;
+  FILE *fp;
+
+  /*
+   * sscanf() is safe here, since send_ssi_file() also uses buffer
+   * of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
+   */
+  if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
+    /* File name is relative to the webserver root */
+    snprintf(path, sizeof(path), "%s/%s", opts->document_root, file_name);
+  } else if (sscanf(tag, " abspath=\"%[^\"]\"", file_name) == 1) {
+    /*
+     * File name is relative to the webserver working directory
+     * or it is absolute system path
+     */
+    snprintf(path, sizeof(path), "%s", file_name);
+  } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1 ||
+             sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
+    /* File name is relative to the currect document */
+    snprintf(path, sizeof(path), "%s", ssi);
+    if ((p = strrchr(path, '/')) != NULL) {
+      p[1] = '\0';
+    }
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", file_name);
+  } else {
+    ns_printf(nc, "Bad SSI #include: [%s]", tag);
+    return;
+  }
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    ns_printf(nc, "SSI include error: fopen(%s): %s", path, strerror(errno));
+  } else {
+    ns_set_close_on_exec(fileno(fp));
+    if (ns_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) >
+        0) {
+      send_ssi_file(nc, path, fp, include_level + 1, opts);
+    } else {
+      send_file_data(nc, fp);
+    }
+    fclose(fp);
+  }
+}
+
+#ifndef NS_DISABLE_POPEN
+static void do_ssi_exec(struct ns_connection *nc, char *tag) {
+  char cmd[BUFSIZ];
+  FILE *fp;
+
+  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
+    ns_printf(nc, "Bad SSI #exec: [%s]", tag);
+  } else if ((fp = popen(cmd, "r")) == NULL) {
+    ns_printf(nc, "Cannot SSI #exec: [%s]: %s", cmd, strerror(errno));
+  } else {
+    send_file_data(nc, fp);
+    pclose(fp);
+  }
+}
+#endif /* !NS_DISABLE_POPEN */
+
+static void do_ssi_call(struct ns_connection *nc, char *tag) {
+  ns_call(nc, NS_SSI_CALL, tag);
+}
+
+/*
+ * SSI directive has the following format:
+ * <!--#directive parameter=value parameter=value -->
+ */
+static void send_ssi_file(struct ns_connection *nc, const char *path, FILE *fp,
+                          int include_level,
+                          const struct ns_serve_http_opts *opts) {
+  static const struct ns_str btag = NS_STR("<!--#");
+  static const struct ns_str d_include = NS_STR("include");
+  static const struct ns_str d_call = NS_STR("call");
+  static const struct ns_str d_exec = NS_STR("exec");
+  char buf[BUFSIZ], *p = buf + btag.len; /* p points to SSI directive */
+  int ch, offset, len, in_ssi_tag;
+
+  if (include_level > 10) {
+    ns_printf(nc, "SSI #include level is too deep (%s)", path);
+    return;
+  }
+
+  in_ssi_tag = len = offset = 0;
+  while ((ch = fgetc(fp)) != EOF) {
+    if (in_ssi_tag && ch == '>' && buf[len - 1] == '-' && buf[len - 2] == '-') {
+      size_t i = len - 2;
+      in_ssi_tag = 0;
+
+      /* Trim closing --> */
+      buf[i--] = '\0';
+      while (i > 0 && buf[i] == ' ') {
+        buf[i--] = '\0';
+      }
+
+      /* Handle known SSI directives */
+      if (memcmp(p, d_include.p, d_include.len) == 0) {
+        do_ssi_include(nc, path, p + d_include.len + 1, include_level, opts);
+      } else if (memcmp(p, d_call.p, d_call.len) == 0) {
+        do_ssi_call(nc, p + d_call.len + 1);
+#ifndef NS_DISABLE_POPEN
+      } else if (memcmp(p, d_exec.p, d_exec.len) == 0) {
+        do_ssi_exec(nc, p + d_exec.len + 1);
+#endif
+      } else {
+        /* Silently ignore unknown SSI directive. */
+      }
+      len = 0;
+    } else if (in_ssi_tag) {
+      if (len == (int) btag.len && memcmp(buf, btag.p, btag.len) != 0) {
+        /* Not an SSI tag */
+        in_ssi_tag = 0;
+      } else if (len == (int) sizeof(buf) - 2) {
+        ns_printf(nc, "%s: SSI tag is too large", path);
+        len = 0;
+      }
+      buf[len++] = ch & 0xff;
+    } else if (ch == '<') {
+      in_ssi_tag = 1;
+      if (len > 0) {
+        ns_send(nc, buf, (size_t) len);
+      }
+      len = 0;
+      buf[len++] = ch & 0xff;
+    } else {
+      buf[len++] = ch & 0xff;
+      if (len == (int) sizeof(buf)) {
+        ns_send(nc, buf, (size_t) len);
+        len = 0;
+      }
+    }
+  }
+
+  /* Send the rest of buffered data */
+  if (len > 0) {
+    ns_send(nc, buf, (size_t) len);
+  }
+}
+
+static void handle_ssi_request(struct ns_connection *nc, const char *path,
+                               const struct ns_serve_http_opts *opts) {
+  FILE *fp;
+  struct ns_str mime_type;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    send_http_error(nc, 404, "Not Found");
+  } else {
+    ns_set_close_on_exec(fileno(fp));
+
+    mime_type = get_mime_type(path, "text/plain", opts);
+    ns_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: %.*s\r\n"
+              "Connection: close\r\n\r\n",
+              (int) mime_type.len, mime_type.p);
+    send_ssi_file(nc, path, fp, 0, opts);
+    fclose(fp);
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+#else
+static void handle_ssi_request(struct ns_connection *nc, const char *path,
+                               const struct ns_serve_http_opts *opts) {
+  (void) path;
+  (void) opts;
+  send_http_error(nc, 500, "SSI disabled");
+}
+#endif /* NS_DISABLE_SSI */
+
+static void construct_etag(char *buf, size_t buf_len, const ns_stat_t *st) {
+  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"", (unsigned long) st->st_mtime,
+           (int64_t) st->st_size);
+}
+static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
+  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+}
+
+static int parse_range_header(const struct ns_str *header, int64_t *a,
+                              int64_t *b) {
+  /*
+   * There is no snscanf. Headers are not guaranteed to be NUL-terminated,
+   * so we have this. Ugh.
+   */
+  int result;
+  char *p = (char *) NS_MALLOC(header->len + 1);
+  if (p == NULL) return 0;
+  memcpy(p, header->p, header->len);
+  p[header->len] = '\0';
+  result = sscanf(p, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+  NS_FREE(p);
+  return result;
+}
+
+static void ns_send_http_file2(struct ns_connection *nc, const char *path,
+                               ns_stat_t *st, struct http_message *hm,
+                               struct ns_serve_http_opts *opts) {
+  struct proto_data_http *dp;
+  struct ns_str mime_type;
+
+  free_http_proto_data(nc);
+  if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) == NULL) {
+    send_http_error(nc, 500, "Server Error"); /* LCOV_EXCL_LINE */
+  } else if ((dp->fp = fopen(path, "rb")) == NULL) {
+    NS_FREE(dp);
+    nc->proto_data = NULL;
+    send_http_error(nc, 500, "Server Error");
+  } else if (ns_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern),
+                             path) > 0) {
+    handle_ssi_request(nc, path, opts);
+  } else {
+    char etag[50], current_time[50], last_modified[50], range[50];
+    time_t t = time(NULL);
+    int64_t r1 = 0, r2 = 0, cl = st->st_size;
+    struct ns_str *range_hdr = ns_get_http_header(hm, "Range");
+    int n, status_code = 200;
+    const char *status_message = "OK";
+
+    /* Handle Range header */
+    range[0] = '\0';
+    if (range_hdr != NULL &&
+        (n = parse_range_header(range_hdr, &r1, &r2)) > 0 && r1 >= 0 &&
+        r2 >= 0) {
+      /* If range is specified like "400-", set second limit to content len */
+      if (n == 1) {
+        r2 = cl - 1;
+      }
+      if (r1 > r2 || r2 >= cl) {
+        status_code = 416;
+        status_message = "Requested range not satisfiable";
+        cl = 0;
+        snprintf(range, sizeof(range),
+                 "Content-Range: bytes */%" INT64_FMT "\r\n",
+                 (int64_t) st->st_size);
+      } else {
+        status_code = 206;
+        status_message = "Partial Content";
+        cl = r2 - r1 + 1;
+        snprintf(range, sizeof(range), "Content-Range: bytes %" INT64_FMT
+                                       "-%" INT64_FMT "/%" INT64_FMT "\r\n",
+                 r1, r1 + cl - 1, (int64_t) st->st_size);
+        fseeko(dp->fp, r1, SEEK_SET);
+      }
+    }
+
+    construct_etag(etag, sizeof(etag), st);
+    gmt_time_string(current_time, sizeof(current_time), &t);
+    gmt_time_string(last_modified, sizeof(last_modified), &st->st_mtime);
+    mime_type = get_mime_type(path, "text/plain", opts);
+    ns_printf(nc,
+              "HTTP/1.1 %d %s\r\n"
+              "Date: %s\r\n"
+              "Last-Modified: %s\r\n"
+              "Accept-Ranges: bytes\r\n"
+              "Content-Type: %.*s\r\n"
+              "Content-Length: %" INT64_FMT
+              "\r\n"
+              "%s"
+              "Etag: %s\r\n"
+              "\r\n",
+              status_code, status_message, current_time, last_modified,
+              (int) mime_type.len, mime_type.p, cl, range, etag);
+#ifdef NS_ENABLE_SEND_FILE
+    if (nc->mgr->file_workers == NULL) {
+      /* Let the core send it, with sendfile() where possible */
+      int fd = dup(fileno(dp->fp));
+      if (fd >= 0 && ns_send_file(nc, fd, r1, cl) == 0) {
+        fclose(dp->fp);
+        NS_FREE(dp);
+        return;
+      }
+      if (fd >= 0) close(fd);
+    }
+#endif
+    nc->proto_data = (void *) dp;
+    dp->offset = r1;
+    dp->cl = cl;
+    dp->type = DATA_FILE;
+    transfer_file_data(nc);
+  }
+}
+
+static void remove_double_dots(char *s) {
+  char *p = s;
+
+  while (*s != '\0') {
+    *p++ = *s++;
+    if (s[-1] == '/' || s[-1] == '\\') {
+      while (s[0] != '\0') {
+        if (s[0] == '/' || s[0] == '\\') {
+          s++;
+        } else if (s[0] == '.' && s[1] == '.') {
+          s += 2;
+        } else {
+          break;
+        }
+      }
+    }
+  }
+  *p = '\0';
+}
+
+#endif
+
+static int ns_url_decode(const char *src, int src_len, char *dst, int dst_len,
+                         int is_form_url_encoded) {
+  int i, j, a, b;
+#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+
+  for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
+    if (src[i] == '%') {
+      if (i < src_len - 2 && isxdigit(*(const unsigned char *) (src + i + 1)) &&
+          isxdigit(*(const unsigned char *) (src + i + 2))) {
+        a = tolower(*(const unsigned char *) (src + i + 1));
+        b = tolower(*(const unsigned char *) (src + i + 2));
+        dst[j] = (char) ((HEXTOI(a) << 4) | HEXTOI(b));
+        i += 2;
+      } else {
+        return -1;
+      }
+    } else if (is_form_url_encoded && src[i] == '+') {
+      dst[j] = ' ';
+    } else {
+      dst[j] = src[i];
+    }
+  }
+
+  dst[j] = '\0'; /* Null-terminate the destination */
+
+  return i >= src_len ? j : -1;
+}
+
+int ns_get_http_var(const struct ns_str *buf, const char *name, char *dst,
+                    size_t dst_len) {
+  const char *p, *e, *s;
+  size_t name_len;
+  int len;
+
+  if (dst == NULL || dst_len == 0) {
+    len = -2;
+  } else if (buf->p == NULL || name == NULL || buf->len == 0) {
+    len = -1;
+    dst[0] = '\0';
+  } else {
+    name_len = strlen(name);
+    e = buf->p + buf->len;
+    len = -1;
+    dst[0] = '\0';
+
+    for (p = buf->p; p + name_len < e; p++) {
+      if ((p == buf->p || p[-1] == '&') && p[name_len] == '=' &&
+          !ns_ncasecmp(name, p, name_len)) {
+        p += name_len + 1;
+        s = (const char *) memchr(p, '&', (size_t)(e - p));
+        if (s == NULL) {
+          s = e;
+        }
+        len = ns_url_decode(p, (size_t)(s - p), dst, dst_len, 1);
+        if (len == -1) {
+          len = -2;
+        }
+        break;
+      }
+    }
+  }
+
+  return len;
+}
+
+void ns_send_http_chunk(struct ns_connection *nc, const char *buf, size_t len) {
+  char chunk_size[50];
+  int n;
+
+  n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n", (unsigned long) len);
+  ns_send(nc, chunk_size, n);
+  ns_send(nc, buf, len);
+  ns_send(nc, "\r\n", 2);
+}
+
+static const char *ns_http_status_message(int status_code) {
+  switch (status_code) {
+    case 101:
+      return "Switching Protocols";
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
+    case 207:
+      return "Multi-Status";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 304:
+      return "Not Modified";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 409:
+      return "Conflict";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Payload Too Large";
+    case 416:
+      return "Range Not Satisfiable";
+    case 423:
+      return "Locked";
+    case 429:
+      return "Too Many Requests";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 503:
+      return "Service Unavailable";
+    default:
+      /* Never contradict the code */
+      return "Unknown";
+  }
+}
+
+void ns_send_http_response_at(struct ns_connection *nc, size_t off,
+                              int status_code, const char *extra_headers) {
+  size_t extra_len = extra_headers == NULL ? 0 : strlen(extra_headers);
+  char status[100];
+  char *p;
+  int n;
+
+  n = snprintf(status, sizeof(status),
+               "HTTP/1.1 %d %s\r\nContent-Length: %lu\r\n", status_code,
+               ns_http_status_message(status_code),
+               (unsigned long) (nc->send_mbuf.len - off));
+
+  /* Open a gap for the whole header, the body is moved only once */
+  if (mbuf_insert(&nc->send_mbuf, off, NULL, n + extra_len + 2) > 0) {
+    p = nc->send_mbuf.buf + off;
+    memcpy(p, status, n);
+    if (extra_len > 0) {
+      memcpy(p + n, extra_headers, extra_len);
+    }
+    memcpy(p + n + extra_len, "\r\n", 2);
+  }
+}
+
+void ns_printf_http_chunk(struct ns_connection *nc, const char *fmt, ...) {
+  size_t off = nc->send_mbuf.len;
+  char chunk_size[50];
+  va_list ap;
+  int len, n;
+
+  va_start(ap, fmt);
+  len = ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    /* Chunk data is formatted in place, prepend its size */
+    n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n",
+                 (unsigned long) len);
+    mbuf_insert(&nc->send_mbuf, off, chunk_size, n);
+    mbuf_append(&nc->send_mbuf, "\r\n", 2);
+  }
+}
+
+void ns_printf_html_escape(struct ns_connection *nc, const char *fmt, ...) {
+  char mem[500], *buf = mem;
+  int i, j, len;
+  va_list ap;
+
+  va_start(ap, fmt);
+  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    for (i = j = 0; i < len; i++) {
+      if (buf[i] == '<' || buf[i] == '>') {
+        ns_send(nc, buf + j, i - j);
+        ns_send(nc, buf[i] == '<' ? "&lt;" : "&gt;", 4);
+        j = i + 1;
+      }
+    }
+    ns_send(nc, buf + j, i - j);
+  }
+
+  /* LCOV_EXCL_START */
+  if (buf != mem && buf != NULL) {
+    NS_FREE(buf);
+  }
+  /* LCOV_EXCL_STOP */
+}
+
+int ns_http_parse_header(struct ns_str *hdr, const char *var_name, char *buf,
+                         size_t buf_size) {
+  int ch = ' ', ch1 = ',', len = 0, n = strlen(var_name);
+  const char *p, *end = hdr->p + hdr->len, *s = NULL;
+
+  if (buf != NULL && buf_size > 0) buf[0] = '\0';
+
+  /* Find where variable starts */
+  for (s = hdr->p; s != NULL && s + n < end; s++) {
+    if ((s == hdr->p || s[-1] == ch || s[-1] == ch1) && s[n] == '=' &&
+        !memcmp(s, var_name, n))
+      break;
+  }
+
+  if (s != NULL && &s[n + 1] < end) {
+    s += n + 1;
+    if (*s == '"' || *s == '\'') {
+      ch = ch1 = *s++;
+    }
+    p = s;
+    while (p < end && p[0] != ch && p[0] != ch1 && len < (int) buf_size) {
+      if (ch != ' ' && p[0] == '\\' && p[1] == ch) p++;
+      buf[len++] = *p++;
+    }
+    if (len >= (int) buf_size || (ch != ' ' && *p != ch)) {
+      len = 0;
+    } else {
+      if (len > 0 && s[len - 1] == ',') len--;
+      if (len > 0 && s[len - 1] == ';') len--;
+      buf[len] = '\0';
+    }
+  }
+
+  return len;
+}
+
+#ifndef NS_DISABLE_FILESYSTEM
+static int is_file_hidden(const char *path,
+                          const struct ns_serve_http_opts *opts) {
+  const char *p1 = opts->per_directory_auth_file;
+  const char *p2 = opts->hidden_file_pattern;
+  return !strcmp(path, ".") || !strcmp(path, "..") ||
+         (p1 != NULL && !strcmp(path, p1)) ||
+         (p2 != NULL && ns_match_prefix(p2, strlen(p2), path) > 0);
+}
+
+#ifndef NS_DISABLE_HTTP_DIGEST_AUTH
+static FILE *open_auth_file(const char *path, int is_directory,
+                            const struct ns_serve_http_opts *opts) {
+  char buf[MAX_PATH_SIZE];
+  const char *p;
+  FILE *fp = NULL;
+
+  if (opts->global_auth_file != NULL) {
+    fp = fopen(opts->global_auth_file, "r");
+  } else if (is_directory && opts->per_directory_auth_file) {
+    snprintf(buf, sizeof(buf), "%s%c%s", path, DIRSEP,
+             opts->per_directory_auth_file);
+    fp = fopen(buf, "r");
+  } else if (opts->per_directory_auth_file) {
+    if ((p = strrchr(path, '/')) == NULL && (p = strrchr(path, '\\')) == NULL) {
+      p = path;
+    }
+    snprintf(buf, sizeof(buf), "%.*s/%s", (int) (p - path), path,
+             opts->per_directory_auth_file);
+    fp = fopen(buf, "r");
+  }
+
+  return fp;
+}
+
+/*
+ * Stringify binary data. Output buffer size must be 2 * size_of_input + 1
+ * because each byte of input takes 2 bytes in string representation
+ * plus 1 byte for the terminating \0 character.
+ */
+static void bin2str(char *to, const unsigned char *p, size_t len) {
+  static const char *hex = "0123456789abcdef";
+
+  for (; len--; p++) {
+    *to++ = hex[p[0] >> 4];
+    *to++ = hex[p[0] & 0x0f];
+  }
+  *to = '\0';
+}
+
+static char *ns_md5(char *buf, ...) {
+  unsigned char hash[16];
+  const unsigned char *p;
+  va_list ap;
+  MD5_CTX ctx;
+
+  MD5_Init(&ctx);
+
+  va_start(ap, buf);
+  while ((p = va_arg(ap, const unsigned char *) ) != NULL) {
+    size_t len = va_arg(ap, size_t);
+    MD5_Update(&ctx, p, len);
+  }
+  va_end(ap);
+
+  MD5_Final(hash, &ctx);
+  bin2str(buf, hash, sizeof(hash));
+
+  return buf;
+}
+
+static void mkmd5resp(const char *method, size_t method_len, const char *uri,
+                      size_t uri_len, const char *ha1, size_t ha1_len,
+                      const char *nonce, size_t nonce_len, const char *nc,
+                      size_t nc_len, const char *cnonce, size_t cnonce_len,
+                      const char *qop, size_t qop_len, char *resp) {
+  static const char colon[] = ":";
+  static const size_t one = 1;
+  char ha2[33];
+
+  ns_md5(ha2, method, method_len, colon, one, uri, uri_len, NULL);
+  ns_md5(resp, ha1, ha1_len, colon, one, nonce, nonce_len, colon, one, nc,
+         nc_len, colon, one, cnonce, cnonce_len, colon, one, qop, qop_len,
+         colon, one, ha2, sizeof(ha2) - 1, NULL);
+}
+
+int ns_http_create_digest_auth_header(char *buf, size_t buf_len,
+                                      const char *method, const char *uri,
+                                      const char *auth_domain, const char *user,
+                                      const char *passwd) {
+  static const char colon[] = ":", qop[] = "auth";
+  static const size_t one = 1;
+  char ha1[33], resp[33], cnonce[40];
+
+  snprintf(cnonce, sizeof(cnonce), "%x", (unsigned int) time(NULL));
+  ns_md5(ha1, user, (size_t) strlen(user), colon, one, auth_domain,
+         (size_t) strlen(auth_domain), colon, one, passwd,
+         (size_t) strlen(passwd), NULL);
+  mkmd5resp(method, strlen(method), uri, strlen(uri), ha1, sizeof(ha1) - 1,
+            cnonce, strlen(cnonce), "1", one, cnonce, strlen(cnonce), qop,
+            sizeof(qop) - 1, resp);
+  return snprintf(buf, buf_len,
+                  "Authorization: Digest username=\"%s\","
+                  "realm=\"%s\",uri=\"%s\",qop=%s,nc=1,cnonce=%s,"
+                  "nonce=%s,response=%s\r\n",
+                  user, auth_domain, uri, qop, cnonce, cnonce, resp);
+}
+
+/*
+ * Check for authentication timeout.
+ * Clients send time stamp encoded in nonce. Make sure it is not too old,
+ * to prevent replay attacks.
+ * Assumption: nonce is a hexadecimal number of seconds since 1970.
+ */
+static int check_nonce(const char *nonce) {
+  unsigned long now = (unsigned long) time(NULL);
+  unsigned long val = (unsigned long) strtoul(nonce, NULL, 16);
+  return 1 || now < val || now - val < 3600;
+}
 
 /*
  * Authenticate HTTP request against opened passwords file.
  * Returns 1 if authenticated, 0 otherwise.
  */
-static int ns_http_check_digest_auth(struct http_message *hm,
-                                     const char *auth_domain, FILE *fp) {
-  struct ns_str *hdr;
-  char buf[128], f_user[sizeof(buf)], f_ha1[sizeof(buf)], f_domain[sizeof(buf)];
-  char user[50], cnonce[20], response[40], uri[200], qop[20], nc[20], nonce[30];
-  char expected_response[33];
+static int ns_http_check_digest_auth(struct http_message *hm,
+                                     const char *auth_domain, FILE *fp) {
+  struct ns_str *hdr;
+  char buf[128], f_user[sizeof(buf)], f_ha1[sizeof(buf)], f_domain[sizeof(buf)];
+  char user[50], cnonce[20], response[40], uri[200], qop[20], nc[20], nonce[30];
+  char expected_response[33];
+
+  /* Parse "Authorization:" header, fail fast on parse error */
+  if (hm == NULL || fp == NULL ||
+      (hdr = ns_get_http_header(hm, "Authorization")) == NULL ||
+      ns_http_parse_header(hdr, "username", user, sizeof(user)) == 0 ||
+      ns_http_parse_header(hdr, "cnonce", cnonce, sizeof(cnonce)) == 0 ||
+      ns_http_parse_header(hdr, "response", response, sizeof(response)) == 0 ||
+      ns_http_parse_header(hdr, "uri", uri, sizeof(uri)) == 0 ||
+      ns_http_parse_header(hdr, "qop", qop, sizeof(qop)) == 0 ||
+      ns_http_parse_header(hdr, "nc", nc, sizeof(nc)) == 0 ||
+      ns_http_parse_header(hdr, "nonce", nonce, sizeof(nonce)) == 0 ||
+      check_nonce(nonce) == 0) {
+    return 0;
+  }
+
+  /*
+   * Read passwords file line by line. If should have htdigest format,
+   * i.e. each line should be a colon-separated sequence:
+   * USER_NAME:DOMAIN_NAME:HA1_HASH_OF_USER_DOMAIN_AND_PASSWORD
+   */
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    if (sscanf(buf, "%[^:]:%[^:]:%s", f_user, f_domain, f_ha1) == 3 &&
+        strcmp(user, f_user) == 0 &&
+        /* NOTE(lsm): due to a bug in MSIE, we do not compare URIs */
+        strcmp(auth_domain, f_domain) == 0) {
+      /* User and domain matched, check the password */
+      mkmd5resp(hm->method.p, hm->method.len, hm->uri.p, hm->uri.len, f_ha1,
+                strlen(f_ha1), nonce, strlen(nonce), nc, strlen(nc), cnonce,
+                strlen(cnonce), qop, strlen(qop), expected_response);
+      return ns_casecmp(response, expected_response) == 0;
+    }
+  }
+
+  /* None of the entries in the passwords file matched - return failure */
+  return 0;
+}
+
+static int is_authorized(struct http_message *hm, const char *path,
+                         int is_directory, struct ns_serve_http_opts *opts) {
+  FILE *fp;
+  int authorized = 1;
+
+  if (opts->auth_domain != NULL && (opts->per_directory_auth_file != NULL ||
+                                    opts->global_auth_file != NULL) &&
+      (fp = open_auth_file(path, is_directory, opts)) != NULL) {
+    authorized = ns_http_check_digest_auth(hm, opts->auth_domain, fp);
+    fclose(fp);
+  }
+
+  return authorized;
+}
+#else
+static int is_authorized(struct http_message *hm, const char *path,
+                         int is_directory, struct ns_serve_http_opts *opts) {
+  (void) hm;
+  (void) path;
+  (void) is_directory;
+  (void) opts;
+  return 1;
+}
+#endif
+
+#ifndef NS_DISABLE_DIRECTORY_LISTING
+static size_t ns_url_encode(const char *src, size_t s_len, char *dst,
+                            size_t dst_len) {
+  static const char *dont_escape = "._-$,;~()";
+  static const char *hex = "0123456789abcdef";
+  size_t i = 0, j = 0;
+
+  for (i = j = 0; dst_len > 0 && i < s_len && j + 2 < dst_len - 1; i++, j++) {
+    if (isalnum(*(const unsigned char *) (src + i)) ||
+        strchr(dont_escape, *(const unsigned char *) (src + i)) != NULL) {
+      dst[j] = src[i];
+    } else if (j + 3 < dst_len) {
+      dst[j] = '%';
+      dst[j + 1] = hex[(*(const unsigned char *) (src + i)) >> 4];
+      dst[j + 2] = hex[(*(const unsigned char *) (src + i)) & 0xf];
+      j += 2;
+    }
+  }
+
+  dst[j] = '\0';
+  return j;
+}
+
+static void escape(const char *src, char *dst, size_t dst_len) {
+  size_t n = 0;
+  while (*src != '\0' && n + 5 < dst_len) {
+    unsigned char ch = *(unsigned char *) src++;
+    if (ch == '<') {
+      n += snprintf(dst + n, dst_len - n, "%s", "&lt;");
+    } else {
+      dst[n++] = ch;
+    }
+  }
+  dst[n] = '\0';
+}
+
+static void print_dir_entry(struct ns_connection *nc, const char *file_name,
+                            ns_stat_t *stp) {
+  char size[64], mod[64], href[MAX_PATH_SIZE * 3], path[MAX_PATH_SIZE];
+  int64_t fsize = stp->st_size;
+  int is_dir = S_ISDIR(stp->st_mode);
+  const char *slash = is_dir ? "/" : "";
+
+  if (is_dir) {
+    snprintf(size, sizeof(size), "%s", "[DIRECTORY]");
+  } else {
+    /*
+     * We use (double) cast below because MSVC 6 compiler cannot
+     * convert unsigned __int64 to double.
+     */
+    if (fsize < 1024) {
+      snprintf(size, sizeof(size), "%d", (int) fsize);
+    } else if (fsize < 0x100000) {
+      snprintf(size, sizeof(size), "%.1fk", (double) fsize / 1024.0);
+    } else if (fsize < 0x40000000) {
+      snprintf(size, sizeof(size), "%.1fM", (double) fsize / 1048576);
+    } else {
+      snprintf(size, sizeof(size), "%.1fG", (double) fsize / 1073741824);
+    }
+  }
+  strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&stp->st_mtime));
+  escape(file_name, path, sizeof(path));
+  ns_url_encode(file_name, strlen(file_name), href, sizeof(href));
+  ns_printf_http_chunk(nc,
+                       "<tr><td><a href=\"%s%s\">%s%s</a></td>"
+                       "<td>%s</td><td name=%" INT64_FMT ">%s</td></tr>\n",
+                       href, slash, path, slash, mod, is_dir ? -1 : fsize,
+                       size);
+}
+
+static void scan_directory(struct ns_connection *nc, const char *dir,
+                           const struct ns_serve_http_opts *opts,
+                           void (*func)(struct ns_connection *, const char *,
+                                        ns_stat_t *)) {
+  char path[MAX_PATH_SIZE];
+  ns_stat_t st;
+  struct dirent *dp;
+  DIR *dirp;
+
+  if ((dirp = (opendir(dir))) != NULL) {
+    while ((dp = readdir(dirp)) != NULL) {
+      /* Do not show current dir and hidden files */
+      if (is_file_hidden(dp->d_name, opts)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+      if (ns_stat(path, &st) == 0) {
+        func(nc, dp->d_name, &st);
+      }
+    }
+    closedir(dirp);
+  }
+}
+
+static void send_directory_listing(struct ns_connection *nc, const char *dir,
+                                   struct http_message *hm,
+                                   struct ns_serve_http_opts *opts) {
+  static const char *sort_js_code =
+      "<script>function srt(tb, col) {"
+      "var tr = Array.prototype.slice.call(tb.rows, 0),"
+      "tr = tr.sort(function (a, b) { var c1 = a.cells[col], c2 = b.cells[col],"
+      "n1 = c1.getAttribute('name'), n2 = c2.getAttribute('name'), "
+      "t1 = a.cells[2].getAttribute('name'), "
+      "t2 = b.cells[2].getAttribute('name'); "
+      "return t1 < 0 && t2 >= 0 ? -1 : t2 < 0 && t1 >= 0 ? 1 : "
+      "n1 ? parseInt(n2) - parseInt(n1) : "
+      "c1.textContent.trim().localeCompare(c2.textContent.trim()); });";
+  static const char *sort_js_code2 =
+      "for (var i = 0; i < tr.length; i++) tb.appendChild(tr[i]);}"
+      "window.onload = function() { "
+      "var tb = document.getElementById('tb');"
+      "document.onclick = function(ev){ "
+      "var c = ev.target.rel; if (c) srt(tb, c)}; srt(tb, 2); };</script>";
+
+  ns_printf(nc, "%s\r\n%s: %s\r\n%s: %s\r\n\r\n", "HTTP/1.1 200 OK",
+            "Transfer-Encoding", "chunked", "Content-Type",
+            "text/html; charset=utf-8");
+
+  ns_printf_http_chunk(
+      nc,
+      "<html><head><title>Index of %.*s</title>%s%s"
+      "<style>th,td {text-align: left; padding-right: 1em; }</style></head>"
+      "<body><h1>Index of %.*s</h1><pre><table cellpadding=\"0\"><thead>"
+      "<tr><th><a href=# rel=0>Name</a></th><th>"
+      "<a href=# rel=1>Modified</a</th>"
+      "<th><a href=# rel=2>Size</a></th></tr>"
+      "<tr><td colspan=\"3\"><hr></td></tr></thead><tbody id=tb>",
+      (int) hm->uri.len, hm->uri.p, sort_js_code, sort_js_code2,
+      (int) hm->uri.len, hm->uri.p);
+  scan_directory(nc, dir, opts, print_dir_entry);
+  ns_printf_http_chunk(nc, "%s", "</tbody></body></html>");
+  ns_send_http_chunk(nc, "", 0);
+  /* TODO(rojer): Remove when cesanta/dev/issues/197 is fixed. */
+  nc->flags |= NSF_SEND_AND_CLOSE;
+}
+#endif /* NS_DISABLE_DIRECTORY_LISTING */
+
+#ifndef NS_DISABLE_DAV
+static void print_props(struct ns_connection *nc, const char *name,
+                        ns_stat_t *stp) {
+  char mtime[64], buf[MAX_PATH_SIZE * 3];
+  time_t t = stp->st_mtime; /* store in local variable for NDK compile */
+  gmt_time_string(mtime, sizeof(mtime), &t);
+  ns_url_encode(name, strlen(name), buf, sizeof(buf));
+  ns_printf(nc,
+            "<d:response>"
+            "<d:href>%s</d:href>"
+            "<d:propstat>"
+            "<d:prop>"
+            "<d:resourcetype>%s</d:resourcetype>"
+            "<d:getcontentlength>%" INT64_FMT
+            "</d:getcontentlength>"
+            "<d:getlastmodified>%s</d:getlastmodified>"
+            "</d:prop>"
+            "<d:status>HTTP/1.1 200 OK</d:status>"
+            "</d:propstat>"
+            "</d:response>\n",
+            buf, S_ISDIR(stp->st_mode) ? "<d:collection/>" : "",
+            (int64_t) stp->st_size, mtime);
+}
+
+static void handle_propfind(struct ns_connection *nc, const char *path,
+                            ns_stat_t *stp, struct http_message *hm,
+                            struct ns_serve_http_opts *opts) {
+  static const char header[] =
+      "HTTP/1.1 207 Multi-Status\r\n"
+      "Connection: close\r\n"
+      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
+      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+      "<d:multistatus xmlns:d='DAV:'>\n";
+  static const char footer[] = "</d:multistatus>\n";
+  const struct ns_str *depth = ns_get_http_header(hm, "Depth");
+
+  /* Print properties for the requested resource itself */
+  if (S_ISDIR(stp->st_mode) &&
+      strcmp(opts->enable_directory_listing, "yes") != 0) {
+    ns_printf(nc, "%s", "HTTP/1.1 403 Directory Listing Denied\r\n\r\n");
+  } else {
+    char uri[MAX_PATH_SIZE];
+    ns_send(nc, header, sizeof(header) - 1);
+    snprintf(uri, sizeof(uri), "%.*s", (int) hm->uri.len, hm->uri.p);
+    print_props(nc, uri, stp);
+    if (S_ISDIR(stp->st_mode) && (depth == NULL || ns_vcmp(depth, "0") != 0)) {
+      scan_directory(nc, path, opts, print_props);
+    }
+    ns_send(nc, footer, sizeof(footer) - 1);
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+static void handle_mkcol(struct ns_connection *nc, const char *path,
+                         struct http_message *hm) {
+  int status_code = 500;
+  if (ns_get_http_header(hm, "Content-Length") != NULL) {
+    status_code = 415;
+  } else if (!ns_mkdir(path, 0755)) {
+    status_code = 201;
+  } else if (errno == EEXIST) {
+    status_code = 405;
+  } else if (errno == EACCES) {
+    status_code = 403;
+  } else if (errno == ENOENT) {
+    status_code = 409;
+  }
+  send_http_error(nc, status_code, NULL);
+}
+
+static int remove_directory(const char *dir) {
+  char path[MAX_PATH_SIZE];
+  struct dirent *dp;
+  ns_stat_t st;
+  DIR *dirp;
+
+  if ((dirp = opendir(dir)) == NULL) return 0;
+
+  while ((dp = readdir(dirp)) != NULL) {
+    if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
+    snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
+    ns_stat(path, &st);
+    if (S_ISDIR(st.st_mode)) {
+      remove_directory(path);
+    } else {
+      remove(path);
+    }
+  }
+  closedir(dirp);
+  rmdir(dir);
+
+  return 1;
+}
+
+static void handle_delete(struct ns_connection *nc, const char *path) {
+  ns_stat_t st;
+  if (ns_stat(path, &st) != 0) {
+    send_http_error(nc, 404, NULL);
+  } else if (S_ISDIR(st.st_mode)) {
+    remove_directory(path);
+    send_http_error(nc, 204, NULL);
+  } else if (remove(path) == 0) {
+    send_http_error(nc, 204, NULL);
+  } else {
+    send_http_error(nc, 423, NULL);
+  }
+}
+
+/* Return -1 on error, 1 on success. */
+static int create_itermediate_directories(const char *path) {
+  const char *s = path;
+
+  /* Create intermediate directories if they do not exist */
+  while (*s) {
+    if (*s == '/') {
+      char buf[MAX_PATH_SIZE];
+      ns_stat_t st;
+      snprintf(buf, sizeof(buf), "%.*s", (int) (s - path), path);
+      buf[sizeof(buf) - 1] = '\0';
+      if (ns_stat(buf, &st) != 0 && ns_mkdir(buf, 0755) != 0) {
+        return -1;
+      }
+    }
+    s++;
+  }
+
+  return 1;
+}
+
+static void handle_put(struct ns_connection *nc, const char *path,
+                       struct http_message *hm) {
+  ns_stat_t st;
+  const struct ns_str *cl_hdr = ns_get_http_header(hm, "Content-Length");
+  int rc, status_code = ns_stat(path, &st) == 0 ? 200 : 201;
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+
+  free_http_proto_data(nc);
+  if ((rc = create_itermediate_directories(path)) == 0) {
+    ns_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
+  } else if (rc == -1) {
+    send_http_error(nc, 500, NULL);
+  } else if (cl_hdr == NULL) {
+    send_http_error(nc, 411, NULL);
+  } else if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) ==
+             NULL) {
+    send_http_error(nc, 500, NULL); /* LCOV_EXCL_LINE */
+  } else if ((dp->fp = fopen(path, "w+b")) == NULL) {
+    send_http_error(nc, 500, NULL);
+    free_http_proto_data(nc);
+  } else {
+    const struct ns_str *range_hdr = ns_get_http_header(hm, "Content-Range");
+    int64_t r1 = 0, r2 = 0;
+    dp->type = DATA_PUT;
+    ns_set_close_on_exec(fileno(dp->fp));
+    dp->cl = to64(cl_hdr->p);
+    if (range_hdr != NULL && parse_range_header(range_hdr, &r1, &r2) > 0) {
+      status_code = 206;
+      fseeko(dp->fp, r1, SEEK_SET);
+      dp->offset = r1;
+      dp->cl = r2 > r1 ? r2 - r1 + 1 : dp->cl - r1;
+    }
+    ns_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
+    nc->proto_data = dp;
+    /* Remove HTTP request from the mbuf, leave only payload */
+    mbuf_remove(&nc->recv_mbuf, hm->message.len - hm->body.len);
+    transfer_file_data(nc);
+  }
+}
+#endif /* NS_DISABLE_DAV */
+
+static int is_dav_request(const struct ns_str *s) {
+  return !ns_vcmp(s, "PUT") || !ns_vcmp(s, "DELETE") || !ns_vcmp(s, "MKCOL") ||
+         !ns_vcmp(s, "PROPFIND");
+}
+
+/*
+ * Given a directory path, find one of the files specified in the
+ * comma-separated list of index files `list`.
+ * First found index file wins. If an index file is found, then gets
+ * appended to the `path`, stat-ed, and result of `stat()` passed to `stp`.
+ * If index file is not found, then `path` and `stp` remain unchanged.
+ */
+NS_INTERNAL int find_index_file(char *path, size_t path_len, const char *list,
+                                ns_stat_t *stp) {
+  ns_stat_t st;
+  size_t n = strlen(path);
+  struct ns_str vec;
+  int found = 0;
+
+  /* The 'path' given to us points to the directory. Remove all trailing */
+  /* directory separator characters from the end of the path, and */
+  /* then append single directory separator character. */
+  while (n > 0 && (path[n - 1] == '/' || path[n - 1] == '\\')) {
+    n--;
+  }
+
+  /* Traverse index files list. For each entry, append it to the given */
+  /* path and see if the file exists. If it exists, break the loop */
+  while ((list = ns_next_comma_list_entry(list, &vec, NULL)) != NULL) {
+    /* Prepare full path to the index file */
+    snprintf(path + n, path_len - n, "/%.*s", (int) vec.len, vec.p);
+    path[path_len - 1] = '\0';
+
+    /* Does it exist? */
+    if (!ns_stat(path, &st)) {
+      /* Yes it does, break the loop */
+      *stp = st;
+      found = 1;
+      break;
+    }
+  }
+
+  /* If no index file exists, restore directory path, keep trailing slash. */
+  if (!found) {
+    path[n] = '\0';
+    strncat(path + n, "/", path_len - n);
+  }
+
+  return found;
+}
+
+static void uri_to_path(struct http_message *hm, char *buf, size_t buf_len,
+                        const struct ns_serve_http_opts *opts) {
+  char uri[NS_MAX_PATH];
+  struct ns_str a, b, *host_hdr = ns_get_http_header(hm, "Host");
+  const char *rewrites = opts->url_rewrites;
+
+  ns_url_decode(hm->uri.p, hm->uri.len, uri, sizeof(uri), 0);
+  remove_double_dots(uri);
+  snprintf(buf, buf_len, "%s%s", opts->document_root, uri);
+
+#ifndef NS_DISABLE_DAV
+  if (is_dav_request(&hm->method) && opts->dav_document_root != NULL) {
+    snprintf(buf, buf_len, "%s%s", opts->dav_document_root, uri);
+  }
+#endif
+
+  /* Handle URL rewrites */
+  while ((rewrites = ns_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
+    if (a.len > 1 && a.p[0] == '@' && host_hdr != NULL &&
+        host_hdr->len == a.len - 1 &&
+        ns_ncasecmp(a.p + 1, host_hdr->p, a.len - 1) == 0) {
+      /* This is a virtual host rewrite: @domain.name=document_root_dir */
+      snprintf(buf, buf_len, "%.*s%s", (int) b.len, b.p, uri);
+      break;
+    } else {
+      /* This is a usual rewrite, URI=directory */
+      int match_len = ns_match_prefix(a.p, a.len, uri);
+      if (match_len > 0) {
+        snprintf(buf, buf_len, "%.*s%s", (int) b.len, b.p, uri + match_len);
+        break;
+      }
+    }
+  }
+}
+
+#ifndef NS_DISABLE_CGI
+#ifdef _WIN32
+struct threadparam {
+  sock_t s;
+  HANDLE hPipe;
+};
+
+static int wait_until_ready(sock_t sock, int for_read) {
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(sock, &set);
+  return select(sock + 1, for_read ? &set : 0, for_read ? 0 : &set, 0, 0) == 1;
+}
+
+static void *push_to_stdin(void *arg) {
+  struct threadparam *tp = (struct threadparam *) arg;
+  int n, sent, stop = 0;
+  DWORD k;
+  char buf[BUFSIZ];
+
+  while (!stop && wait_until_ready(tp->s, 1) &&
+         (n = recv(tp->s, buf, sizeof(buf), 0)) > 0) {
+    if (n == -1 && GetLastError() == WSAEWOULDBLOCK) continue;
+    for (sent = 0; !stop && sent < n; sent += k) {
+      if (!WriteFile(tp->hPipe, buf + sent, n - sent, &k, 0)) stop = 1;
+    }
+  }
+  DBG(("%s", "FORWARED EVERYTHING TO CGI"));
+  CloseHandle(tp->hPipe);
+  NS_FREE(tp);
+  _endthread();
+  return NULL;
+}
+
+static void *pull_from_stdout(void *arg) {
+  struct threadparam *tp = (struct threadparam *) arg;
+  int k = 0, stop = 0;
+  DWORD n, sent;
+  char buf[BUFSIZ];
+
+  while (!stop && ReadFile(tp->hPipe, buf, sizeof(buf), &n, NULL)) {
+    for (sent = 0; !stop && sent < n; sent += k) {
+      if (wait_until_ready(tp->s, 0) &&
+          (k = send(tp->s, buf + sent, n - sent, 0)) <= 0)
+        stop = 1;
+    }
+  }
+  DBG(("%s", "EOF FROM CGI"));
+  CloseHandle(tp->hPipe);
+  shutdown(tp->s, 2);  // Without this, IO thread may get truncated data
+  closesocket(tp->s);
+  NS_FREE(tp);
+  _endthread();
+  return NULL;
+}
+
+static void spawn_stdio_thread(sock_t sock, HANDLE hPipe,
+                               void *(*func)(void *)) {
+  struct threadparam *tp = (struct threadparam *) NS_MALLOC(sizeof(*tp));
+  if (tp != NULL) {
+    tp->s = sock;
+    tp->hPipe = hPipe;
+    ns_start_thread(func, tp);
+  }
+}
+
+static void abs_path(const char *utf8_path, char *abs_path, size_t len) {
+  wchar_t buf[MAX_PATH_SIZE], buf2[MAX_PATH_SIZE];
+  to_wchar(utf8_path, buf, ARRAY_SIZE(buf));
+  GetFullPathNameW(buf, ARRAY_SIZE(buf2), buf2, NULL);
+  WideCharToMultiByte(CP_UTF8, 0, buf2, wcslen(buf2) + 1, abs_path, len, 0, 0);
+}
+
+static pid_t start_process(const char *interp, const char *cmd, const char *env,
+                           const char *envp[], const char *dir, sock_t sock) {
+  STARTUPINFOW si;
+  PROCESS_INFORMATION pi;
+  HANDLE a[2], b[2], me = GetCurrentProcess();
+  wchar_t wcmd[MAX_PATH_SIZE], full_dir[MAX_PATH_SIZE];
+  char buf[MAX_PATH_SIZE], buf2[MAX_PATH_SIZE], buf5[MAX_PATH_SIZE],
+      buf4[MAX_PATH_SIZE], cmdline[MAX_PATH_SIZE];
+  DWORD flags = DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS;
+  FILE *fp;
+
+  memset(&si, 0, sizeof(si));
+  memset(&pi, 0, sizeof(pi));
+
+  si.cb = sizeof(si);
+  si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+  si.wShowWindow = SW_HIDE;
+  si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+  CreatePipe(&a[0], &a[1], NULL, 0);
+  CreatePipe(&b[0], &b[1], NULL, 0);
+  DuplicateHandle(me, a[0], me, &si.hStdInput, 0, TRUE, flags);
+  DuplicateHandle(me, b[1], me, &si.hStdOutput, 0, TRUE, flags);
+
+  if (interp == NULL && (fp = fopen(cmd, "r")) != NULL) {
+    buf[0] = buf[1] = '\0';
+    fgets(buf, sizeof(buf), fp);
+    buf[sizeof(buf) - 1] = '\0';
+    if (buf[0] == '#' && buf[1] == '!') {
+      interp = buf + 2;
+      /* Trim leading spaces: https://github.com/cesanta/mongoose/issues/489 */
+      while (*interp != '\0' && isspace(*(unsigned char *) interp)) {
+        interp++;
+      }
+    }
+    fclose(fp);
+  }
+
+  snprintf(buf, sizeof(buf), "%s/%s", dir, cmd);
+  abs_path(buf, buf2, ARRAY_SIZE(buf2));
+
+  abs_path(dir, buf5, ARRAY_SIZE(buf5));
+  to_wchar(dir, full_dir, ARRAY_SIZE(full_dir));
+
+  if (interp != NULL) {
+    abs_path(interp, buf4, ARRAY_SIZE(buf4));
+    snprintf(cmdline, sizeof(cmdline), "%s \"%s\"", buf4, buf2);
+  } else {
+    snprintf(cmdline, sizeof(cmdline), "\"%s\"", buf2);
+  }
+  to_wchar(cmdline, wcmd, ARRAY_SIZE(wcmd));
+
+#if 0
+  printf("[%ls] [%ls]\n", full_dir, wcmd);
+#endif
+
+  if (CreateProcessW(NULL, wcmd, NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP,
+                     (void *) env, full_dir, &si, &pi) != 0) {
+    spawn_stdio_thread(sock, a[1], push_to_stdin);
+    spawn_stdio_thread(sock, b[0], pull_from_stdout);
+  } else {
+    CloseHandle(a[1]);
+    CloseHandle(b[0]);
+    closesocket(sock);
+  }
+  DBG(("CGI command: [%ls] -> %p", wcmd, pi.hProcess));
+
+  /* Not closing a[0] and b[1] because we've used DUPLICATE_CLOSE_SOURCE */
+  CloseHandle(si.hStdOutput);
+  CloseHandle(si.hStdInput);
+  /* TODO(lsm): check if we need close process and thread handles too */
+  /* CloseHandle(pi.hThread); */
+  /* CloseHandle(pi.hProcess); */
+
+  return pi.hProcess;
+}
+#else
+static pid_t start_process(const char *interp, const char *cmd, const char *env,
+                           const char *envp[], const char *dir, sock_t sock) {
+  char buf[500];
+  pid_t pid = fork();
+  (void) env;
+
+  if (pid == 0) {
+    /*
+     * In Linux `chdir` declared with `warn_unused_result` attribute
+     * To shutup compiler we have yo use result in some way
+     */
+    int tmp = chdir(dir);
+    (void) tmp;
+    (void) dup2(sock, 0);
+    (void) dup2(sock, 1);
+    closesocket(sock);
+
+    /*
+     * After exec, all signal handlers are restored to their default values,
+     * with one exception of SIGCHLD. According to POSIX.1-2001 and Linux's
+     * implementation, SIGCHLD's handler will leave unchanged after exec
+     * if it was set to be ignored. Restore it to default action.
+     */
+    signal(SIGCHLD, SIG_DFL);
+
+    if (interp == NULL) {
+      execle(cmd, cmd, (char *) 0, envp); /* (char *) 0 to squash warning */
+    } else {
+      execle(interp, interp, cmd, (char *) 0, envp);
+    }
+    snprintf(buf, sizeof(buf),
+             "Status: 500\r\n\r\n"
+             "500 Server Error: %s%s%s: %s",
+             interp == NULL ? "" : interp, interp == NULL ? "" : " ", cmd,
+             strerror(errno));
+    send(1, buf, strlen(buf), 0);
+    exit(EXIT_FAILURE); /* exec call failed */
+  }
+
+  return pid;
+}
+#endif /* _WIN32 */
+
+/*
+ * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
+ * pointer into the vars array.
+ */
+static char *addenv(struct cgi_env_block *block, const char *fmt, ...) {
+  int n, space;
+  char *added = block->buf + block->len;
+  va_list ap;
 
-  /* Parse "Authorization:" header, fail fast on parse error */
-  if (hm == NULL || fp == NULL ||
-      (hdr = ns_get_http_header(hm, "Authorization")) == NULL ||
-      ns_http_parse_header(hdr, "username", user, sizeof(user)) == 0 ||
-      ns_http_parse_header(hdr, "cnonce", cnonce, sizeof(cnonce)) == 0 ||
-      ns_http_parse_header(hdr, "response", response, sizeof(response)) == 0 ||
-      ns_http_parse_header(hdr, "uri", uri, sizeof(uri)) == 0 ||
-      ns_http_parse_header(hdr, "qop", qop, sizeof(qop)) == 0 ||
-      ns_http_parse_header(hdr, "nc", nc, sizeof(nc)) == 0 ||
-      ns_http_parse_header(hdr, "nonce", nonce, sizeof(nonce)) == 0 ||
-      check_nonce(nonce) == 0) {
-    return 0;
+  /* Calculate how much space is left in the buffer */
+  space = sizeof(block->buf) - (block->len + 2);
+  if (space > 0) {
+    /* Copy VARIABLE=VALUE\0 string into the free space */
+    va_start(ap, fmt);
+    n = vsnprintf(added, (size_t) space, fmt, ap);
+    va_end(ap);
+
+    /* Make sure we do not overflow buffer and the envp array */
+    if (n > 0 && n + 1 < space &&
+        block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
+      /* Append a pointer to the added string into the envp array */
+      block->vars[block->nvars++] = added;
+      /* Bump up used length counter. Include \0 terminator */
+      block->len += n + 1;
+    }
+  }
+
+  return added;
+}
+
+static void addenv2(struct cgi_env_block *blk, const char *name) {
+  const char *s;
+  if ((s = getenv(name)) != NULL) addenv(blk, "%s=%s", name, s);
+}
+
+static void prepare_cgi_environment(struct ns_connection *nc, const char *prog,
+                                    const struct http_message *hm,
+                                    const struct ns_serve_http_opts *opts,
+                                    struct cgi_env_block *blk) {
+  const char *s, *slash;
+  struct ns_str *h;
+  char *p;
+  size_t i;
+
+  blk->len = blk->nvars = 0;
+  blk->nc = nc;
+
+  if ((s = getenv("SERVER_NAME")) != NULL) {
+    addenv(blk, "SERVER_NAME=%s", s);
+  } else {
+    char buf[100];
+    ns_sock_to_str(nc->sock, buf, sizeof(buf), 3);
+    addenv(blk, "SERVER_NAME=%s", buf);
+  }
+  addenv(blk, "SERVER_ROOT=%s", opts->document_root);
+  addenv(blk, "DOCUMENT_ROOT=%s", opts->document_root);
+  addenv(blk, "SERVER_SOFTWARE=%s/%s", "Fossa", NS_FOSSA_VERSION);
+
+  /* Prepare the environment block */
+  addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
+  addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
+  addenv(blk, "%s", "REDIRECT_STATUS=200"); /* For PHP */
+
+  /* TODO(lsm): fix this for IPv6 case */
+  /*addenv(blk, "SERVER_PORT=%d", ri->remote_port); */
+
+  addenv(blk, "REQUEST_METHOD=%.*s", (int) hm->method.len, hm->method.p);
+#if 0
+  addenv(blk, "REMOTE_ADDR=%s", ri->remote_ip);
+  addenv(blk, "REMOTE_PORT=%d", ri->remote_port);
+#endif
+  addenv(blk, "REQUEST_URI=%.*s%s%.*s", (int) hm->uri.len, hm->uri.p,
+         hm->query_string.len == 0 ? "" : "?", (int) hm->query_string.len,
+         hm->query_string.p);
+
+/* SCRIPT_NAME */
+#if 0
+  if (nc->path_info != NULL) {
+    addenv(blk, "SCRIPT_NAME=%.*s",
+           (int) (strlen(ri->uri) - strlen(nc->path_info)), ri->uri);
+    addenv(blk, "PATH_INFO=%s", nc->path_info);
+  } else {
+#endif
+  s = strrchr(prog, '/');
+  slash = hm->uri.p + hm->uri.len;
+  while (slash > hm->uri.p && *slash != '/') {
+    slash--;
+  }
+  addenv(blk, "SCRIPT_NAME=%.*s%s", (int) (slash - hm->uri.p), hm->uri.p,
+         s == NULL ? prog : s);
+#if 0
+  }
+#endif
+
+  addenv(blk, "SCRIPT_FILENAME=%s", prog);
+  addenv(blk, "PATH_TRANSLATED=%s", prog);
+  addenv(blk, "HTTPS=%s", nc->ssl != NULL ? "on" : "off");
+
+  if ((h = ns_get_http_header((struct http_message *) hm, "Content-Type")) !=
+      NULL) {
+    addenv(blk, "CONTENT_TYPE=%.*s", (int) h->len, h->p);
+  }
+
+  if (hm->query_string.len > 0) {
+    addenv(blk, "QUERY_STRING=%.*s", (int) hm->query_string.len,
+           hm->query_string.p);
+  }
+
+  if ((h = ns_get_http_header((struct http_message *) hm, "Content-Length")) !=
+      NULL) {
+    addenv(blk, "CONTENT_LENGTH=%.*s", (int) h->len, h->p);
+  }
+
+  addenv2(blk, "PATH");
+  addenv2(blk, "TMP");
+  addenv2(blk, "TEMP");
+  addenv2(blk, "TMPDIR");
+  addenv2(blk, "PERLLIB");
+  addenv2(blk, NS_ENV_EXPORT_TO_CGI);
+
+#if defined(_WIN32)
+  addenv2(blk, "COMSPEC");
+  addenv2(blk, "SYSTEMROOT");
+  addenv2(blk, "SystemDrive");
+  addenv2(blk, "ProgramFiles");
+  addenv2(blk, "ProgramFiles(x86)");
+  addenv2(blk, "CommonProgramFiles(x86)");
+#else
+  addenv2(blk, "LD_LIBRARY_PATH");
+#endif /* _WIN32 */
+
+  /* Add all headers as HTTP_* variables */
+  for (i = 0; hm->header_names[i].len > 0; i++) {
+    p = addenv(blk, "HTTP_%.*s=%.*s", (int) hm->header_names[i].len,
+               hm->header_names[i].p, (int) hm->header_values[i].len,
+               hm->header_values[i].p);
+
+    /* Convert variable name into uppercase, and change - to _ */
+    for (; *p != '=' && *p != '\0'; p++) {
+      if (*p == '-') *p = '_';
+      *p = (char) toupper(*(unsigned char *) p);
+    }
+  }
+
+  blk->vars[blk->nvars++] = NULL;
+  blk->buf[blk->len++] = '\0';
+}
+
+static void cgi_ev_handler(struct ns_connection *cgi_nc, int ev,
+                           void *ev_data) {
+  struct ns_connection *nc = (struct ns_connection *) cgi_nc->user_data;
+  (void) ev_data;
+
+  if (nc == NULL) return;
+
+  switch (ev) {
+    case NS_RECV:
+      /*
+       * CGI script does not output reply line, like "HTTP/1.1 CODE XXXXX\n"
+       * It outputs headers, then body. Headers might include "Status"
+       * header, which changes CODE, and it might include "Location" header
+       * which changes CODE to 302.
+       *
+       * Therefore we do not send the output from the CGI script to the user
+       * until all CGI headers are parsed (by setting NSF_DONT_SEND flag).
+       *
+       * Here we parse the output from the CGI script, and if all headers has
+       * been received, amend the reply line, and clear NSF_DONT_SEND flag,
+       * which makes data to be sent to the user.
+       */
+      if (nc->flags & NSF_USER_1) {
+        struct mbuf *io = &cgi_nc->recv_mbuf;
+        int len = get_request_len(io->buf, io->len);
+
+        if (len == 0) break;
+        if (len < 0 || io->len > NS_MAX_HTTP_REQUEST_SIZE) {
+          cgi_nc->flags |= NSF_CLOSE_IMMEDIATELY;
+          send_http_error(nc, 500, "Bad headers");
+        } else {
+          struct http_message hm;
+          struct ns_str *h;
+          parse_http_headers(io->buf, io->buf + io->len, io->len, &hm);
+          /*printf("=== %d [%.*s]\n", k, k, io->buf);*/
+          if (ns_get_http_header(&hm, "Location") != NULL) {
+            ns_printf(nc, "%s", "HTTP/1.1 302 Moved\r\n");
+          } else if ((h = ns_get_http_header(&hm, "Status")) != NULL) {
+            ns_printf(nc, "HTTP/1.1 %.*s\r\n", (int) h->len, h->p);
+          } else {
+            ns_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
+          }
+        }
+        nc->flags &= ~NSF_USER_1;
+      }
+      if (!(nc->flags & NSF_USER_1)) {
+        ns_forward(cgi_nc, nc);
+      }
+      break;
+    case NS_CLOSE:
+      free_http_proto_data(nc);
+      nc->flags |= NSF_SEND_AND_CLOSE;
+      nc->user_data = NULL;
+      break;
+  }
+}
+
+static void handle_cgi(struct ns_connection *nc, const char *prog,
+                       const struct http_message *hm,
+                       const struct ns_serve_http_opts *opts) {
+  struct proto_data_http *dp;
+  struct cgi_env_block blk;
+  char dir[MAX_PATH_SIZE];
+  const char *p;
+  sock_t fds[2];
+
+  prepare_cgi_environment(nc, prog, hm, opts, &blk);
+  /*
+   * CGI must be executed in its own directory. 'dir' must point to the
+   * directory containing executable program, 'p' must point to the
+   * executable program name relative to 'dir'.
+   */
+  if ((p = strrchr(prog, '/')) == NULL) {
+    snprintf(dir, sizeof(dir), "%s", ".");
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int) (p - prog), prog);
+    prog = p + 1;
   }
 
   /*
-   * Read passwords file line by line. If should have htdigest format,
-   * i.e. each line should be a colon-separated sequence:
-   * USER_NAME:DOMAIN_NAME:HA1_HASH_OF_USER_DOMAIN_AND_PASSWORD
+   * Try to create socketpair in a loop until success. ns_socketpair()
+   * can be interrupted by a signal and fail.
+   * TODO(lsm): use sigaction to restart interrupted syscall
    */
-  while (fgets(buf, sizeof(buf), fp) != NULL) {
-    if (sscanf(buf, "%[^:]:%[^:]:%s", f_user, f_domain, f_ha1) == 3 &&
-        strcmp(user, f_user) == 0 &&
-        /* NOTE(lsm): due to a bug in MSIE, we do not compare URIs */
-        strcmp(auth_domain, f_domain) == 0) {
-      /* User and domain matched, check the password */
-      mkmd5resp(hm->method.p, hm->method.len, hm->uri.p, hm->uri.len, f_ha1,
-                strlen(f_ha1), nonce, strlen(nonce), nc, strlen(nc), cnonce,
-                strlen(cnonce), qop, strlen(qop), expected_response);
-      return ns_casecmp(response, expected_response) == 0;
+  do {
+    ns_socketpair(fds, SOCK_STREAM);
+  } while (fds[0] == INVALID_SOCKET);
+
+  free_http_proto_data(nc);
+  if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) == NULL) {
+    send_http_error(nc, 500, "OOM"); /* LCOV_EXCL_LINE */
+  } else if (start_process(opts->cgi_interpreter, prog, blk.buf, blk.vars, dir,
+                           fds[1]) != 0) {
+    size_t n = nc->recv_mbuf.len - (hm->message.len - hm->body.len);
+    dp->type = DATA_CGI;
+    dp->cgi_nc = ns_add_sock(nc->mgr, fds[0], cgi_ev_handler);
+    dp->cgi_nc->user_data = nc;
+    nc->flags |= NSF_USER_1;
+    /* Push POST data to the CGI */
+    if (n > 0 && n < nc->recv_mbuf.len) {
+      ns_send(dp->cgi_nc, hm->body.p, n);
     }
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else {
+    closesocket(fds[0]);
+    send_http_error(nc, 500, "CGI failure");
   }
 
-  /* None of the entries in the passwords file matched - return failure */
-  return 0;
+#ifndef _WIN32
+  closesocket(fds[1]); /* On Windows, CGI stdio thread closes that socket */
+#endif
 }
+#endif
 
-static int is_authorized(struct http_message *hm, const char *path,
-                         int is_directory, struct ns_serve_http_opts *opts) {
-  FILE *fp;
-  int authorized = 1;
+static int ns_http_check_acl(struct ns_connection *nc, const char *spec) {
+  struct ns_ip_acl *acl;
+  int allowed;
 
-  if (opts->auth_domain != NULL && (opts->per_directory_auth_file != NULL ||
-                                    opts->global_auth_file != NULL) &&
-      (fp = open_auth_file(path, is_directory, opts)) != NULL) {
-    authorized = ns_http_check_digest_auth(hm, opts->auth_domain, fp);
-    fclose(fp);
+  if (spec == NULL || *spec == '\0') {
+    return 1;
+  } else if (nc->sa.sa.sa_family == AF_INET) {
+    return ns_check_ip_acl(spec, ntohl(nc->sa.sin.sin_addr.s_addr)) == 1;
   }
+  /* IPv6 peer, the string matcher only knows IPv4 */
+  acl = ns_ip_acl_compile(spec);
+  allowed = acl != NULL && ns_ip_acl_check(acl, &nc->sa);
+  ns_ip_acl_free(acl);
 
-  return authorized;
-}
-#else
-static int is_authorized(struct http_message *hm, const char *path,
-                         int is_directory, struct ns_serve_http_opts *opts) {
-  (void) hm;
-  (void) path;
-  (void) is_directory;
-  (void) opts;
-  return 1;
+  return allowed;
 }
-#endif
 
-#ifndef NS_DISABLE_DIRECTORY_LISTING
-static size_t ns_url_encode(const char *src, size_t s_len, char *dst,
-                            size_t dst_len) {
-  static const char *dont_escape = "._-$,;~()";
-  static const char *hex = "0123456789abcdef";
-  size_t i = 0, j = 0;
+void ns_send_http_file(struct ns_connection *nc, char *path,
+                       size_t path_buf_len, struct http_message *hm,
+                       struct ns_serve_http_opts *opts) {
+  int stat_result, is_directory, is_dav = is_dav_request(&hm->method);
+  ns_stat_t st;
 
-  for (i = j = 0; dst_len > 0 && i < s_len && j + 2 < dst_len - 1; i++, j++) {
-    if (isalnum(*(const unsigned char *) (src + i)) ||
-        strchr(dont_escape, *(const unsigned char *) (src + i)) != NULL) {
-      dst[j] = src[i];
-    } else if (j + 3 < dst_len) {
-      dst[j] = '%';
-      dst[j + 1] = hex[(*(const unsigned char *) (src + i)) >> 4];
-      dst[j + 2] = hex[(*(const unsigned char *) (src + i)) & 0xf];
-      j += 2;
+  stat_result = ns_stat(path, &st);
+  is_directory = !stat_result && S_ISDIR(st.st_mode);
+
+  if (!ns_http_check_acl(nc, opts->ip_acl)) {
+    /* Not allowed to connect */
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (is_dav && opts->dav_document_root == NULL) {
+    send_http_error(nc, 501, NULL);
+  } else if (!is_authorized(hm, path, is_directory, opts)) {
+    ns_printf(nc,
+              "HTTP/1.1 401 Unauthorized\r\n"
+              "WWW-Authenticate: Digest qop=\"auth\", "
+              "realm=\"%s\", nonce=\"%lu\"\r\n"
+              "Content-Length: 0\r\n\r\n",
+              opts->auth_domain, (unsigned long) time(NULL));
+  } else if ((stat_result != 0 || is_file_hidden(path, opts)) && !is_dav) {
+    ns_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+  } else if (is_directory && path[strlen(path) - 1] != '/' && !is_dav) {
+    ns_printf(nc,
+              "HTTP/1.1 301 Moved\r\nLocation: %.*s/\r\n"
+              "Content-Length: 0\r\n\r\n",
+              (int) hm->uri.len, hm->uri.p);
+#ifndef NS_DISABLE_DAV
+  } else if (!ns_vcmp(&hm->method, "PROPFIND")) {
+    handle_propfind(nc, path, &st, hm, opts);
+  } else if (!ns_vcmp(&hm->method, "MKCOL")) {
+    handle_mkcol(nc, path, hm);
+  } else if (!ns_vcmp(&hm->method, "DELETE")) {
+    handle_delete(nc, path);
+  } else if (!ns_vcmp(&hm->method, "PUT")) {
+    handle_put(nc, path, hm);
+#endif
+  } else if (S_ISDIR(st.st_mode) &&
+             !find_index_file(path, path_buf_len, opts->index_files, &st)) {
+    if (strcmp(opts->enable_directory_listing, "yes") == 0) {
+#ifndef NS_DISABLE_DIRECTORY_LISTING
+      send_directory_listing(nc, path, hm, opts);
+#else
+      send_http_error(nc, 501, NULL);
+#endif
+    } else {
+      send_http_error(nc, 403, NULL);
     }
+  } else if (ns_match_prefix(opts->cgi_file_pattern,
+                             strlen(opts->cgi_file_pattern), path) > 0) {
+#if !defined(NS_DISABLE_CGI)
+    handle_cgi(nc, path, hm, opts);
+#else
+    send_http_error(nc, 501, NULL);
+#endif /* NS_DISABLE_CGI */
+  } else {
+    ns_send_http_file2(nc, path, &st, hm, opts);
   }
-
-  dst[j] = '\0';
-  return j;
 }
 
-static void escape(const char *src, char *dst, size_t dst_len) {
-  size_t n = 0;
-  while (*src != '\0' && n + 5 < dst_len) {
-    unsigned char ch = *(unsigned char *) src++;
-    if (ch == '<') {
-      n += snprintf(dst + n, dst_len - n, "%s", "&lt;");
-    } else {
-      dst[n++] = ch;
-    }
+void ns_serve_http(struct ns_connection *nc, struct http_message *hm,
+                   struct ns_serve_http_opts opts) {
+  char path[NS_MAX_PATH];
+  uri_to_path(hm, path, sizeof(path), &opts);
+  if (opts.per_directory_auth_file == NULL) {
+    opts.per_directory_auth_file = ".htpasswd";
   }
-  dst[n] = '\0';
+  if (opts.enable_directory_listing == NULL) {
+    opts.enable_directory_listing = "yes";
+  }
+  if (opts.cgi_file_pattern == NULL) {
+    opts.cgi_file_pattern = "**.cgi$|**.php$";
+  }
+  if (opts.ssi_pattern == NULL) {
+    opts.ssi_pattern = "**.shtml$|**.shtm$";
+  }
+  if (opts.index_files == NULL) {
+    opts.index_files = "index.html,index.htm,index.shtml,index.cgi,index.php";
+  }
+  ns_send_http_file(nc, path, sizeof(path), hm, &opts);
 }
 
-static void print_dir_entry(struct ns_connection *nc, const char *file_name,
-                            ns_stat_t *stp) {
-  char size[64], mod[64], href[MAX_PATH_SIZE * 3], path[MAX_PATH_SIZE];
-  int64_t fsize = stp->st_size;
-  int is_dir = S_ISDIR(stp->st_mode);
-  const char *slash = is_dir ? "/" : "";
+#endif /* NS_DISABLE_FILESYSTEM */
 
-  if (is_dir) {
-    snprintf(size, sizeof(size), "%s", "[DIRECTORY]");
-  } else {
-    /*
-     * We use (double) cast below because MSVC 6 compiler cannot
-     * convert unsigned __int64 to double.
-     */
-    if (fsize < 1024) {
-      snprintf(size, sizeof(size), "%d", (int) fsize);
-    } else if (fsize < 0x100000) {
-      snprintf(size, sizeof(size), "%.1fk", (double) fsize / 1024.0);
-    } else if (fsize < 0x40000000) {
-      snprintf(size, sizeof(size), "%.1fM", (double) fsize / 1048576);
-    } else {
-      snprintf(size, sizeof(size), "%.1fG", (double) fsize / 1073741824);
-    }
+struct ns_connection *ns_connect_http(struct ns_mgr *mgr,
+                                      ns_event_handler_t ev_handler,
+                                      const char *url,
+                                      const char *extra_headers,
+                                      const char *post_data) {
+  struct ns_connection *nc;
+  char addr[1100], path[4096]; /* NOTE: keep sizes in sync with sscanf below */
+  int use_ssl = 0, addr_len = 0;
+
+  if (memcmp(url, "http://", 7) == 0) {
+    url += 7;
+  } else if (memcmp(url, "https://", 8) == 0) {
+    url += 8;
+    use_ssl = 1;
+#ifndef NS_ENABLE_SSL
+    return NULL; /* SSL is not enabled, cannot do HTTPS URLs */
+#endif
   }
-  strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&stp->st_mtime));
-  escape(file_name, path, sizeof(path));
-  ns_url_encode(file_name, strlen(file_name), href, sizeof(href));
-  ns_printf_http_chunk(nc,
-                       "<tr><td><a href=\"%s%s\">%s%s</a></td>"
-                       "<td>%s</td><td name=%" INT64_FMT ">%s</td></tr>\n",
-                       href, slash, path, slash, mod, is_dir ? -1 : fsize,
-                       size);
-}
 
-static void scan_directory(struct ns_connection *nc, const char *dir,
-                           const struct ns_serve_http_opts *opts,
-                           void (*func)(struct ns_connection *, const char *,
-                                        ns_stat_t *)) {
-  char path[MAX_PATH_SIZE];
-  ns_stat_t st;
-  struct dirent *dp;
-  DIR *dirp;
+  addr[0] = path[0] = '\0';
 
-  if ((dirp = (opendir(dir))) != NULL) {
-    while ((dp = readdir(dirp)) != NULL) {
-      /* Do not show current dir and hidden files */
-      if (is_file_hidden(dp->d_name, opts)) {
-        continue;
-      }
-      snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
-      if (ns_stat(path, &st) == 0) {
-        func(nc, dp->d_name, &st);
-      }
-    }
-    closedir(dirp);
+  /* addr buffer size made smaller to allow for port to be prepended */
+  sscanf(url, "%1095[^/]/%4095s", addr, path);
+  if (strchr(addr, ':') == NULL) {
+    addr_len = strlen(addr);
+    strncat(addr, use_ssl ? ":443" : ":80", sizeof(addr) - (addr_len + 1));
   }
-}
 
-static void send_directory_listing(struct ns_connection *nc, const char *dir,
-                                   struct http_message *hm,
-                                   struct ns_serve_http_opts *opts) {
-  static const char *sort_js_code =
-      "<script>function srt(tb, col) {"
-      "var tr = Array.prototype.slice.call(tb.rows, 0),"
-      "tr = tr.sort(function (a, b) { var c1 = a.cells[col], c2 = b.cells[col],"
-      "n1 = c1.getAttribute('name'), n2 = c2.getAttribute('name'), "
-      "t1 = a.cells[2].getAttribute('name'), "
-      "t2 = b.cells[2].getAttribute('name'); "
-      "return t1 < 0 && t2 >= 0 ? -1 : t2 < 0 && t1 >= 0 ? 1 : "
-      "n1 ? parseInt(n2) - parseInt(n1) : "
-      "c1.textContent.trim().localeCompare(c2.textContent.trim()); });";
-  static const char *sort_js_code2 =
-      "for (var i = 0; i < tr.length; i++) tb.appendChild(tr[i]);}"
-      "window.onload = function() { "
-      "var tb = document.getElementById('tb');"
-      "document.onclick = function(ev){ "
-      "var c = ev.target.rel; if (c) srt(tb, c)}; srt(tb, 2); };</script>";
+  if ((nc = ns_connect(mgr, addr, ev_handler)) != NULL) {
+    ns_set_protocol_http_websocket(nc);
 
-  ns_printf(nc, "%s\r\n%s: %s\r\n%s: %s\r\n\r\n", "HTTP/1.1 200 OK",
-            "Transfer-Encoding", "chunked", "Content-Type",
-            "text/html; charset=utf-8");
+    if (use_ssl) {
+#ifdef NS_ENABLE_SSL
+      ns_set_ssl(nc, NULL, NULL);
+#endif
+    }
+
+    if (addr_len) {
+      /* Do not add port. See https://github.com/cesanta/fossa/pull/304 */
+      addr[addr_len] = '\0';
+    }
+#if defined(NS_ENABLE_SSL) && defined(SSL_set_tlsext_host_name)
+    if (use_ssl && nc->ssl != NULL) {
+      /* Tell the server which certificate we want (SNI), unless it's an IP */
+      char host[sizeof(addr)];
+      snprintf(host, sizeof(host), "%.*s", (int) strcspn(addr, ":"), addr);
+      if (host[0] != '[' && host[strspn(host, "0123456789.")] != '\0') {
+        SSL_set_tlsext_host_name(nc->ssl, host);
+      }
+    }
+#endif
+    ns_printf(nc,
+              "%s /%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %lu\r\n%s\r\n%s",
+              post_data == NULL ? "GET" : "POST", path, addr,
+              post_data == NULL ? 0 : strlen(post_data),
+              extra_headers == NULL ? "" : extra_headers,
+              post_data == NULL ? "" : post_data);
+  }
 
-  ns_printf_http_chunk(
-      nc,
-      "<html><head><title>Index of %.*s</title>%s%s"
-      "<style>th,td {text-align: left; padding-right: 1em; }</style></head>"
-      "<body><h1>Index of %.*s</h1><pre><table cellpadding=\"0\"><thead>"
-      "<tr><th><a href=# rel=0>Name</a></th><th>"
-      "<a href=# rel=1>Modified</a</th>"
-      "<th><a href=# rel=2>Size</a></th></tr>"
-      "<tr><td colspan=\"3\"><hr></td></tr></thead><tbody id=tb>",
-      (int) hm->uri.len, hm->uri.p, sort_js_code, sort_js_code2,
-      (int) hm->uri.len, hm->uri.p);
-  scan_directory(nc, dir, opts, print_dir_entry);
-  ns_printf_http_chunk(nc, "%s", "</tbody></body></html>");
-  ns_send_http_chunk(nc, "", 0);
-  /* TODO(rojer): Remove when cesanta/dev/issues/197 is fixed. */
-  nc->flags |= NSF_SEND_AND_CLOSE;
+  return nc;
 }
-#endif /* NS_DISABLE_DIRECTORY_LISTING */
 
-#ifndef NS_DISABLE_DAV
-static void print_props(struct ns_connection *nc, const char *name,
-                        ns_stat_t *stp) {
-  char mtime[64], buf[MAX_PATH_SIZE * 3];
-  time_t t = stp->st_mtime; /* store in local variable for NDK compile */
-  gmt_time_string(mtime, sizeof(mtime), &t);
-  ns_url_encode(name, strlen(name), buf, sizeof(buf));
-  ns_printf(nc,
-            "<d:response>"
-            "<d:href>%s</d:href>"
-            "<d:propstat>"
-            "<d:prop>"
-            "<d:resourcetype>%s</d:resourcetype>"
-            "<d:getcontentlength>%" INT64_FMT
-            "</d:getcontentlength>"
-            "<d:getlastmodified>%s</d:getlastmodified>"
-            "</d:prop>"
-            "<d:status>HTTP/1.1 200 OK</d:status>"
-            "</d:propstat>"
-            "</d:response>\n",
-            buf, S_ISDIR(stp->st_mode) ? "<d:collection/>" : "",
-            (int64_t) stp->st_size, mtime);
+static size_t get_line_len(const char *buf, size_t buf_len) {
+  size_t len = 0;
+  while (len < buf_len && buf[len] != '\n') len++;
+  return buf[len] == '\n' ? len + 1 : 0;
 }
 
-static void handle_propfind(struct ns_connection *nc, const char *path,
-                            ns_stat_t *stp, struct http_message *hm,
-                            struct ns_serve_http_opts *opts) {
-  static const char header[] =
-      "HTTP/1.1 207 Multi-Status\r\n"
-      "Connection: close\r\n"
-      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
-      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-      "<d:multistatus xmlns:d='DAV:'>\n";
-  static const char footer[] = "</d:multistatus>\n";
-  const struct ns_str *depth = ns_get_http_header(hm, "Depth");
+size_t ns_parse_multipart(const char *buf, size_t buf_len, char *var_name,
+                          size_t var_name_len, char *file_name,
+                          size_t file_name_len, const char **data,
+                          size_t *data_len) {
+  static const char cd[] = "Content-Disposition: ";
+  size_t hl, bl, n, ll, pos, cdl = sizeof(cd) - 1;
 
-  /* Print properties for the requested resource itself */
-  if (S_ISDIR(stp->st_mode) &&
-      strcmp(opts->enable_directory_listing, "yes") != 0) {
-    ns_printf(nc, "%s", "HTTP/1.1 403 Directory Listing Denied\r\n\r\n");
-  } else {
-    char uri[MAX_PATH_SIZE];
-    ns_send(nc, header, sizeof(header) - 1);
-    snprintf(uri, sizeof(uri), "%.*s", (int) hm->uri.len, hm->uri.p);
-    print_props(nc, uri, stp);
-    if (S_ISDIR(stp->st_mode) && (depth == NULL || ns_vcmp(depth, "0") != 0)) {
-      scan_directory(nc, path, opts, print_props);
+  if (buf == NULL || buf_len <= 0) return 0;
+  if ((hl = get_request_len(buf, buf_len)) <= 0) return 0;
+  if (buf[0] != '-' || buf[1] != '-' || buf[2] == '\n') return 0;
+
+  /* Get boundary length */
+  bl = get_line_len(buf, buf_len);
+
+  /* Loop through headers, fetch variable name and file name */
+  var_name[0] = file_name[0] = '\0';
+  for (n = bl; (ll = get_line_len(buf + n, hl - n)) > 0; n += ll) {
+    if (ns_ncasecmp(cd, buf + n, cdl) == 0) {
+      struct ns_str header;
+      header.p = buf + n + cdl;
+      header.len = ll - (cdl + 2);
+      ns_http_parse_header(&header, "name", var_name, var_name_len);
+      ns_http_parse_header(&header, "filename", file_name, file_name_len);
     }
-    ns_send(nc, footer, sizeof(footer) - 1);
-    nc->flags |= NSF_SEND_AND_CLOSE;
   }
-}
 
-static void handle_mkcol(struct ns_connection *nc, const char *path,
-                         struct http_message *hm) {
-  int status_code = 500;
-  if (ns_get_http_header(hm, "Content-Length") != NULL) {
-    status_code = 415;
-  } else if (!ns_mkdir(path, 0755)) {
-    status_code = 201;
-  } else if (errno == EEXIST) {
-    status_code = 405;
-  } else if (errno == EACCES) {
-    status_code = 403;
-  } else if (errno == ENOENT) {
-    status_code = 409;
+  /* Scan through the body, search for terminating boundary */
+  for (pos = hl; pos + (bl - 2) < buf_len; pos++) {
+    if (buf[pos] == '-' && !memcmp(buf, &buf[pos], bl - 2)) {
+      if (data_len != NULL) *data_len = (pos - 2) - hl;
+      if (data != NULL) *data = buf + hl;
+      return pos;
+    }
   }
-  send_http_error(nc, status_code, NULL);
+
+  return 0;
 }
 
-static int remove_directory(const char *dir) {
-  char path[MAX_PATH_SIZE];
-  struct dirent *dp;
-  ns_stat_t st;
-  DIR *dirp;
+#endif /* NS_DISABLE_HTTP */
+#ifdef NS_MODULE_LINES
+#line 1 "src/util.c"
+/**/
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
 
-  if ((dirp = opendir(dir)) == NULL) return 0;
+/* Amalgamated: #include "internal.h" */
 
-  while ((dp = readdir(dirp)) != NULL) {
-    if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
-    snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
-    ns_stat(path, &st);
-    if (S_ISDIR(st.st_mode)) {
-      remove_directory(path);
-    } else {
-      remove(path);
-    }
-  }
-  closedir(dirp);
-  rmdir(dir);
+#if !defined(_WIN32) && !defined(NS_CC3200) && !defined(NS_ESP8266)
+#include <sys/time.h> /* For gettimeofday() */
+#endif
 
-  return 1;
+const char *ns_skip(const char *s, const char *end, const char *delims,
+                    struct ns_str *v) {
+  v->p = s;
+  while (s < end && strchr(delims, *(unsigned char *) s) == NULL) s++;
+  v->len = s - v->p;
+  while (s < end && strchr(delims, *(unsigned char *) s) != NULL) s++;
+  return s;
 }
 
-static void handle_delete(struct ns_connection *nc, const char *path) {
-  ns_stat_t st;
-  if (ns_stat(path, &st) != 0) {
-    send_http_error(nc, 404, NULL);
-  } else if (S_ISDIR(st.st_mode)) {
-    remove_directory(path);
-    send_http_error(nc, 204, NULL);
-  } else if (remove(path) == 0) {
-    send_http_error(nc, 204, NULL);
-  } else {
-    send_http_error(nc, 423, NULL);
-  }
+static int lowercase(const char *s) {
+  return tolower(*(const unsigned char *) s);
 }
 
-/* Return -1 on error, 1 on success. */
-static int create_itermediate_directories(const char *path) {
-  const char *s = path;
+int ns_ncasecmp(const char *s1, const char *s2, size_t len) {
+  int diff = 0;
 
-  /* Create intermediate directories if they do not exist */
-  while (*s) {
-    if (*s == '/') {
-      char buf[MAX_PATH_SIZE];
-      ns_stat_t st;
-      snprintf(buf, sizeof(buf), "%.*s", (int) (s - path), path);
-      buf[sizeof(buf) - 1] = '\0';
-      if (ns_stat(buf, &st) != 0 && ns_mkdir(buf, 0755) != 0) {
-        return -1;
-      }
-    }
-    s++;
-  }
+  if (len > 0) do {
+      diff = lowercase(s1++) - lowercase(s2++);
+    } while (diff == 0 && s1[-1] != '\0' && --len > 0);
 
-  return 1;
+  return diff;
 }
 
-static void handle_put(struct ns_connection *nc, const char *path,
-                       struct http_message *hm) {
-  ns_stat_t st;
-  const struct ns_str *cl_hdr = ns_get_http_header(hm, "Content-Length");
-  int rc, status_code = ns_stat(path, &st) == 0 ? 200 : 201;
-  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+int ns_casecmp(const char *s1, const char *s2) {
+  return ns_ncasecmp(s1, s2, (size_t) ~0);
+}
 
-  free_http_proto_data(nc);
-  if ((rc = create_itermediate_directories(path)) == 0) {
-    ns_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
-  } else if (rc == -1) {
-    send_http_error(nc, 500, NULL);
-  } else if (cl_hdr == NULL) {
-    send_http_error(nc, 411, NULL);
-  } else if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) ==
-             NULL) {
-    send_http_error(nc, 500, NULL); /* LCOV_EXCL_LINE */
-  } else if ((dp->fp = fopen(path, "w+b")) == NULL) {
-    send_http_error(nc, 500, NULL);
-    free_http_proto_data(nc);
-  } else {
-    const struct ns_str *range_hdr = ns_get_http_header(hm, "Content-Range");
-    int64_t r1 = 0, r2 = 0;
-    dp->type = DATA_PUT;
-    ns_set_close_on_exec(fileno(dp->fp));
-    dp->cl = to64(cl_hdr->p);
-    if (range_hdr != NULL && parse_range_header(range_hdr, &r1, &r2) > 0) {
-      status_code = 206;
-      fseeko(dp->fp, r1, SEEK_SET);
-      dp->cl = r2 > r1 ? r2 - r1 + 1 : dp->cl - r1;
-    }
-    ns_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
-    nc->proto_data = dp;
-    /* Remove HTTP request from the mbuf, leave only payload */
-    mbuf_remove(&nc->recv_mbuf, hm->message.len - hm->body.len);
-    transfer_file_data(nc);
+int ns_vcasecmp(const struct ns_str *str1, const char *str2) {
+  size_t n2 = strlen(str2), n1 = str1->len;
+  int r = ns_ncasecmp(str1->p, str2, (n1 < n2) ? n1 : n2);
+  if (r == 0) {
+    return n1 - n2;
+  }
+  return r;
+}
+
+int ns_vcmp(const struct ns_str *str1, const char *str2) {
+  size_t n2 = strlen(str2), n1 = str1->len;
+  int r = memcmp(str1->p, str2, (n1 < n2) ? n1 : n2);
+  if (r == 0) {
+    return n1 - n2;
   }
+  return r;
+}
+
+#ifndef NS_DISABLE_FILESYSTEM
+int ns_stat(const char *path, ns_stat_t *st) {
+#ifdef _WIN32
+  wchar_t wpath[MAX_PATH_SIZE];
+  to_wchar(path, wpath, ARRAY_SIZE(wpath));
+  DBG(("[%ls] -> %d", wpath, _wstati64(wpath, st)));
+  return _wstati64(wpath, (struct _stati64 *) st);
+#else
+  return stat(path, st);
+#endif
 }
-#endif /* NS_DISABLE_DAV */
 
-static int is_dav_request(const struct ns_str *s) {
-  return !ns_vcmp(s, "PUT") || !ns_vcmp(s, "DELETE") || !ns_vcmp(s, "MKCOL") ||
-         !ns_vcmp(s, "PROPFIND");
+FILE *ns_fopen(const char *path, const char *mode) {
+#ifdef _WIN32
+  wchar_t wpath[MAX_PATH_SIZE], wmode[10];
+  to_wchar(path, wpath, ARRAY_SIZE(wpath));
+  to_wchar(mode, wmode, ARRAY_SIZE(wmode));
+  return _wfopen(wpath, wmode);
+#else
+  return fopen(path, mode);
+#endif
 }
 
-/*
- * Given a directory path, find one of the files specified in the
- * comma-separated list of index files `list`.
- * First found index file wins. If an index file is found, then gets
- * appended to the `path`, stat-ed, and result of `stat()` passed to `stp`.
- * If index file is not found, then `path` and `stp` remain unchanged.
- */
-NS_INTERNAL int find_index_file(char *path, size_t path_len, const char *list,
-                                ns_stat_t *stp) {
-  ns_stat_t st;
-  size_t n = strlen(path);
-  struct ns_str vec;
-  int found = 0;
+int ns_open(const char *path, int flag, int mode) { /* LCOV_EXCL_LINE */
+#ifdef _WIN32
+  wchar_t wpath[MAX_PATH_SIZE];
+  to_wchar(path, wpath, ARRAY_SIZE(wpath));
+  return _wopen(wpath, flag, mode);
+#else
+  return open(path, flag, mode); /* LCOV_EXCL_LINE */
+#endif
+}
+#endif
 
-  /* The 'path' given to us points to the directory. Remove all trailing */
-  /* directory separator characters from the end of the path, and */
-  /* then append single directory separator character. */
-  while (n > 0 && (path[n - 1] == '/' || path[n - 1] == '\\')) {
-    n--;
-  }
+void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
+  cs_base64_encode(src, src_len, dst);
+}
 
-  /* Traverse index files list. For each entry, append it to the given */
-  /* path and see if the file exists. If it exists, break the loop */
-  while ((list = ns_next_comma_list_entry(list, &vec, NULL)) != NULL) {
-    /* Prepare full path to the index file */
-    snprintf(path + n, path_len - n, "/%.*s", (int) vec.len, vec.p);
-    path[path_len - 1] = '\0';
+int ns_base64_decode(const unsigned char *s, int len, char *dst) {
+  return cs_base64_decode(s, len, dst);
+}
 
-    /* Does it exist? */
-    if (!ns_stat(path, &st)) {
-      /* Yes it does, break the loop */
-      *stp = st;
-      found = 1;
-      break;
-    }
-  }
+#ifdef NS_ENABLE_THREADS
+void *ns_start_thread(void *(*f)(void *), void *p) {
+#ifdef _WIN32
+  return (void *) _beginthread((void(__cdecl *) (void *) ) f, 0, p);
+#else
+  pthread_t thread_id = (pthread_t) 0;
+  pthread_attr_t attr;
 
-  /* If no index file exists, restore directory path, keep trailing slash. */
-  if (!found) {
-    path[n] = '\0';
-    strncat(path + n, "/", path_len - n);
-  }
+  (void) pthread_attr_init(&attr);
+  (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-  return found;
+#if defined(NS_STACK_SIZE) && NS_STACK_SIZE > 1
+  (void) pthread_attr_setstacksize(&attr, NS_STACK_SIZE);
+#endif
+
+  pthread_create(&thread_id, &attr, f, p);
+  pthread_attr_destroy(&attr);
+
+  return (void *) thread_id;
+#endif
 }
+#endif /* NS_ENABLE_THREADS */
 
-static void uri_to_path(struct http_message *hm, char *buf, size_t buf_len,
-                        const struct ns_serve_http_opts *opts) {
-  char uri[NS_MAX_PATH];
-  struct ns_str a, b, *host_hdr = ns_get_http_header(hm, "Host");
-  const char *rewrites = opts->url_rewrites;
+/* Set close-on-exec bit for a given socket. */
+void ns_set_close_on_exec(sock_t sock) {
+#ifdef _WIN32
+  (void) SetHandleInformation((HANDLE) sock, HANDLE_FLAG_INHERIT, 0);
+#else
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
+}
 
-  ns_url_decode(hm->uri.p, hm->uri.len, uri, sizeof(uri), 0);
-  remove_double_dots(uri);
-  snprintf(buf, buf_len, "%s%s", opts->document_root, uri);
+void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags) {
+  union socket_address sa;
+#ifndef NS_CC3200
+  socklen_t slen = sizeof(sa);
+#endif
 
-#ifndef NS_DISABLE_DAV
-  if (is_dav_request(&hm->method) && opts->dav_document_root != NULL) {
-    snprintf(buf, buf_len, "%s%s", opts->dav_document_root, uri);
+  memset(&sa, 0, sizeof(sa));
+#ifndef NS_CC3200
+  if (flags & NS_SOCK_STRINGIFY_REMOTE) {
+    getpeername(sock, &sa.sa, &slen);
+  } else {
+    getsockname(sock, &sa.sa, &slen);
   }
 #endif
+  ns_sock_addr_to_str(&sa, buf, len, flags);
+}
 
-  /* Handle URL rewrites */
-  while ((rewrites = ns_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
-    if (a.len > 1 && a.p[0] == '@' && host_hdr != NULL &&
-        host_hdr->len == a.len - 1 &&
-        ns_ncasecmp(a.p + 1, host_hdr->p, a.len - 1) == 0) {
-      /* This is a virtual host rewrite: @domain.name=document_root_dir */
-      snprintf(buf, buf_len, "%.*s%s", (int) b.len, b.p, uri);
-      break;
+void ns_sock_addr_to_str(const union socket_address *sa, char *buf, size_t len,
+                         int flags) {
+  int is_v6;
+  if (buf == NULL || len <= 0) return;
+  buf[0] = '\0';
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* No port: the path, or @name if abstract, stands for both */
+    const char *path = sa->un.sun_path;
+    if (flags & (NS_SOCK_STRINGIFY_IP | NS_SOCK_STRINGIFY_PORT)) {
+      snprintf(buf, len, "%s%s", path[0] == '\0' && path[1] != '\0' ? "@" : "",
+               path[0] == '\0' ? path + 1 : path);
+    }
+    return;
+  }
+#endif
+#if defined(NS_ENABLE_IPV6)
+  is_v6 = sa->sa.sa_family == AF_INET6;
+#else
+  is_v6 = 0;
+#endif
+  if (flags & NS_SOCK_STRINGIFY_IP) {
+#if defined(NS_ENABLE_IPV6)
+    const void *addr = NULL;
+    char *start = buf;
+    socklen_t capacity = len;
+    if (!is_v6) {
+      addr = &sa->sin.sin_addr;
     } else {
-      /* This is a usual rewrite, URI=directory */
-      int match_len = ns_match_prefix(a.p, a.len, uri);
-      if (match_len > 0) {
-        snprintf(buf, buf_len, "%.*s%s", (int) b.len, b.p, uri + match_len);
-        break;
+      addr = (void *) &sa->sin6.sin6_addr;
+      if (flags & NS_SOCK_STRINGIFY_PORT) {
+        *buf = '[';
+        start++;
+        capacity--;
       }
     }
+    if (inet_ntop(sa->sa.sa_family, addr, start, capacity) == NULL) {
+      *buf = '\0';
+    }
+#elif defined(_WIN32) || defined(NS_ESP8266)
+    /* Only Windoze Vista (and newer) have inet_ntop() */
+    strncpy(buf, inet_ntoa(sa->sin.sin_addr), len);
+#else
+    inet_ntop(AF_INET, (void *) &sa->sin.sin_addr, buf, len);
+#endif
+  }
+  if (flags & NS_SOCK_STRINGIFY_PORT) {
+    int port = ntohs(sa->sin.sin_port);
+    if (flags & NS_SOCK_STRINGIFY_IP) {
+      snprintf(buf + strlen(buf), len - (strlen(buf) + 1), "%s:%d",
+               (is_v6 ? "]" : ""), port);
+    } else {
+      snprintf(buf, len, "%d", port);
+    }
   }
 }
 
-#ifndef NS_DISABLE_CGI
-#ifdef _WIN32
-struct threadparam {
-  sock_t s;
-  HANDLE hPipe;
-};
+int ns_hexdump(const void *buf, int len, char *dst, int dst_len) {
+  const unsigned char *p = (const unsigned char *) buf;
+  char ascii[17] = "";
+  int i, idx, n = 0;
 
-static int wait_until_ready(sock_t sock, int for_read) {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(sock, &set);
-  return select(sock + 1, for_read ? &set : 0, for_read ? 0 : &set, 0, 0) == 1;
+  for (i = 0; i < len; i++) {
+    idx = i % 16;
+    if (idx == 0) {
+      if (i > 0) n += snprintf(dst + n, dst_len - n, "  %s\n", ascii);
+      n += snprintf(dst + n, dst_len - n, "%04x ", i);
+    }
+    n += snprintf(dst + n, dst_len - n, " %02x", p[i]);
+    ascii[idx] = p[i] < 0x20 || p[i] > 0x7e ? '.' : p[i];
+    ascii[idx + 1] = '\0';
+  }
+
+  while (i++ % 16) n += snprintf(dst + n, dst_len - n, "%s", "   ");
+  n += snprintf(dst + n, dst_len - n, "  %s\n\n", ascii);
+
+  return n;
 }
 
-static void *push_to_stdin(void *arg) {
-  struct threadparam *tp = (struct threadparam *) arg;
-  int n, sent, stop = 0;
-  DWORD k;
-  char buf[BUFSIZ];
+int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap) {
+  va_list ap_copy;
+  int len;
 
-  while (!stop && wait_until_ready(tp->s, 1) &&
-         (n = recv(tp->s, buf, sizeof(buf), 0)) > 0) {
-    if (n == -1 && GetLastError() == WSAEWOULDBLOCK) continue;
-    for (sent = 0; !stop && sent < n; sent += k) {
-      if (!WriteFile(tp->hPipe, buf + sent, n - sent, &k, 0)) stop = 1;
+  va_copy(ap_copy, ap);
+  len = vsnprintf(*buf, size, fmt, ap_copy);
+  va_end(ap_copy);
+
+  if (len < 0) {
+    /* eCos and Windows are not standard-compliant and return -1 when
+     * the buffer is too small. Keep allocating larger buffers until we
+     * succeed or out of memory. */
+    *buf = NULL; /* LCOV_EXCL_START */
+    while (len < 0) {
+      NS_FREE(*buf);
+      size *= 2;
+      if ((*buf = (char *) NS_MALLOC(size)) == NULL) break;
+      va_copy(ap_copy, ap);
+      len = vsnprintf(*buf, size, fmt, ap_copy);
+      va_end(ap_copy);
+    }
+    /* LCOV_EXCL_STOP */
+  } else if (len > (int) size) {
+    /* Standard-compliant code path. Allocate a buffer that is large enough. */
+    if ((*buf = (char *) NS_MALLOC(len + 1)) == NULL) {
+      len = -1; /* LCOV_EXCL_LINE */
+    } else {    /* LCOV_EXCL_LINE */
+      va_copy(ap_copy, ap);
+      len = vsnprintf(*buf, len + 1, fmt, ap_copy);
+      va_end(ap_copy);
     }
   }
-  DBG(("%s", "FORWARED EVERYTHING TO CGI"));
-  CloseHandle(tp->hPipe);
-  NS_FREE(tp);
-  _endthread();
-  return NULL;
+
+  return len;
 }
 
-static void *pull_from_stdout(void *arg) {
-  struct threadparam *tp = (struct threadparam *) arg;
-  int k = 0, stop = 0;
-  DWORD n, sent;
-  char buf[BUFSIZ];
+/* Free space to have before formatting, so that most output fits at once */
+#define NS_MBUF_PRINTF_RESERVE 100
 
-  while (!stop && ReadFile(tp->hPipe, buf, sizeof(buf), &n, NULL)) {
-    for (sent = 0; !stop && sent < n; sent += k) {
-      if (wait_until_ready(tp->s, 0) &&
-          (k = send(tp->s, buf + sent, n - sent, 0)) <= 0)
-        stop = 1;
-    }
+int ns_mbuf_vprintf(struct mbuf *io, const char *fmt, va_list ap) {
+  char mem[NS_MBUF_PRINTF_RESERVE], *buf = mem;
+  va_list ap_copy;
+  size_t avail;
+  int len;
+
+  if (io->size - io->len < NS_MBUF_PRINTF_RESERVE) {
+    mbuf_resize(io, (io->len + NS_MBUF_PRINTF_RESERVE) * MBUF_SIZE_MULTIPLIER);
   }
-  DBG(("%s", "EOF FROM CGI"));
-  CloseHandle(tp->hPipe);
-  shutdown(tp->s, 2);  // Without this, IO thread may get truncated data
-  closesocket(tp->s);
-  NS_FREE(tp);
-  _endthread();
-  return NULL;
-}
+  avail = io->size - io->len;
 
-static void spawn_stdio_thread(sock_t sock, HANDLE hPipe,
-                               void *(*func)(void *)) {
-  struct threadparam *tp = (struct threadparam *) NS_MALLOC(sizeof(*tp));
-  if (tp != NULL) {
-    tp->s = sock;
-    tp->hPipe = hPipe;
-    ns_start_thread(func, tp);
+  va_copy(ap_copy, ap);
+  len = vsnprintf(io->buf + io->len, avail, fmt, ap_copy);
+  va_end(ap_copy);
+
+  if (len >= (int) avail) {
+    /* Now that the length is known, make room and format again */
+    mbuf_resize(io, io->len + len + 1);
+    if (io->size - io->len <= (size_t) len) {
+      return -1; /* LCOV_EXCL_LINE */
+    }
+    va_copy(ap_copy, ap);
+    vsnprintf(io->buf + io->len, len + 1, fmt, ap_copy);
+    va_end(ap_copy);
+  } else if (len < 0) {
+    /* Non-compliant vsnprintf() doesn't tell the length, see ns_avprintf() */
+    /* LCOV_EXCL_START */
+    if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
+      mbuf_append(io, buf, len);
+    }
+    if (buf != mem && buf != NULL) {
+      NS_FREE(buf);
+    }
+    return len;
+    /* LCOV_EXCL_STOP */
   }
-}
+  io->len += len;
 
-static void abs_path(const char *utf8_path, char *abs_path, size_t len) {
-  wchar_t buf[MAX_PATH_SIZE], buf2[MAX_PATH_SIZE];
-  to_wchar(utf8_path, buf, ARRAY_SIZE(buf));
-  GetFullPathNameW(buf, ARRAY_SIZE(buf2), buf2, NULL);
-  WideCharToMultiByte(CP_UTF8, 0, buf2, wcslen(buf2) + 1, abs_path, len, 0, 0);
+  return len;
 }
 
-static pid_t start_process(const char *interp, const char *cmd, const char *env,
-                           const char *envp[], const char *dir, sock_t sock) {
-  STARTUPINFOW si;
-  PROCESS_INFORMATION pi;
-  HANDLE a[2], b[2], me = GetCurrentProcess();
-  wchar_t wcmd[MAX_PATH_SIZE], full_dir[MAX_PATH_SIZE];
-  char buf[MAX_PATH_SIZE], buf2[MAX_PATH_SIZE], buf5[MAX_PATH_SIZE],
-      buf4[MAX_PATH_SIZE], cmdline[MAX_PATH_SIZE];
-  DWORD flags = DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS;
-  FILE *fp;
+int ns_mbuf_printf(struct mbuf *io, const char *fmt, ...) {
+  va_list ap;
+  int len;
 
-  memset(&si, 0, sizeof(si));
-  memset(&pi, 0, sizeof(pi));
+  va_start(ap, fmt);
+  len = ns_mbuf_vprintf(io, fmt, ap);
+  va_end(ap);
 
-  si.cb = sizeof(si);
-  si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
-  si.wShowWindow = SW_HIDE;
-  si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+  return len;
+}
 
-  CreatePipe(&a[0], &a[1], NULL, 0);
-  CreatePipe(&b[0], &b[1], NULL, 0);
-  DuplicateHandle(me, a[0], me, &si.hStdInput, 0, TRUE, flags);
-  DuplicateHandle(me, b[1], me, &si.hStdOutput, 0, TRUE, flags);
+#ifndef NS_DISABLE_FILESYSTEM
+void ns_hexdump_connection(struct ns_connection *nc, const char *path,
+                           int num_bytes, int ev) {
+  const struct mbuf *io = ev == NS_SEND ? &nc->send_mbuf : &nc->recv_mbuf;
+  FILE *fp;
+  char *buf, src[60], dst[60];
+  int buf_size = num_bytes * 5 + 100;
 
-  if (interp == NULL && (fp = fopen(cmd, "r")) != NULL) {
-    buf[0] = buf[1] = '\0';
-    fgets(buf, sizeof(buf), fp);
-    buf[sizeof(buf) - 1] = '\0';
-    if (buf[0] == '#' && buf[1] == '!') {
-      interp = buf + 2;
-      /* Trim leading spaces: https://github.com/cesanta/mongoose/issues/489 */
-      while (*interp != '\0' && isspace(*(unsigned char *) interp)) {
-        interp++;
-      }
+  if ((fp = fopen(path, "a")) != NULL) {
+    ns_sock_to_str(nc->sock, src, sizeof(src), 3);
+    ns_sock_to_str(nc->sock, dst, sizeof(dst), 7);
+    fprintf(fp, "%lu %p %s %s %s %d\n", (unsigned long) time(NULL), nc, src,
+            ev == NS_RECV ? "<-" : ev == NS_SEND ? "->" : ev == NS_ACCEPT
+                                                              ? "<A"
+                                                              : ev == NS_CONNECT
+                                                                    ? "C>"
+                                                                    : "XX",
+            dst, num_bytes);
+    if (num_bytes > 0 && (buf = (char *) NS_MALLOC(buf_size)) != NULL) {
+      ns_hexdump(io->buf + (ev == NS_SEND ? 0 : io->len) -
+                     (ev == NS_SEND ? 0 : num_bytes),
+                 num_bytes, buf, buf_size);
+      fprintf(fp, "%s", buf);
+      NS_FREE(buf);
     }
     fclose(fp);
   }
+}
+#endif
 
-  snprintf(buf, sizeof(buf), "%s/%s", dir, cmd);
-  abs_path(buf, buf2, ARRAY_SIZE(buf2));
-
-  abs_path(dir, buf5, ARRAY_SIZE(buf5));
-  to_wchar(dir, full_dir, ARRAY_SIZE(full_dir));
+int ns_is_big_endian(void) {
+  static const int n = 1;
+  /* TODO(mkm) use compiletime check with 4-byte char literal */
+  return ((char *) &n)[0] == 0;
+}
 
-  if (interp != NULL) {
-    abs_path(interp, buf4, ARRAY_SIZE(buf4));
-    snprintf(cmdline, sizeof(cmdline), "%s \"%s\"", buf4, buf2);
+const char *ns_next_comma_list_entry(const char *list, struct ns_str *val,
+                                     struct ns_str *eq_val) {
+  if (list == NULL || *list == '\0') {
+    /* End of the list */
+    list = NULL;
   } else {
-    snprintf(cmdline, sizeof(cmdline), "\"%s\"", buf2);
-  }
-  to_wchar(cmdline, wcmd, ARRAY_SIZE(wcmd));
-
-#if 0
-  printf("[%ls] [%ls]\n", full_dir, wcmd);
-#endif
+    val->p = list;
+    if ((list = strchr(val->p, ',')) != NULL) {
+      /* Comma found. Store length and shift the list ptr */
+      val->len = list - val->p;
+      list++;
+    } else {
+      /* This value is the last one */
+      list = val->p + strlen(val->p);
+      val->len = list - val->p;
+    }
 
-  if (CreateProcessW(NULL, wcmd, NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP,
-                     (void *) env, full_dir, &si, &pi) != 0) {
-    spawn_stdio_thread(sock, a[1], push_to_stdin);
-    spawn_stdio_thread(sock, b[0], pull_from_stdout);
-  } else {
-    CloseHandle(a[1]);
-    CloseHandle(b[0]);
-    closesocket(sock);
+    if (eq_val != NULL) {
+      /* Value has form "x=y", adjust pointers and lengths */
+      /* so that val points to "x", and eq_val points to "y". */
+      eq_val->len = 0;
+      eq_val->p = (const char *) memchr(val->p, '=', val->len);
+      if (eq_val->p != NULL) {
+        eq_val->p++; /* Skip over '=' character */
+        eq_val->len = val->p + val->len - eq_val->p;
+        val->len = (eq_val->p - val->p) - 1;
+      }
+    }
   }
-  DBG(("CGI command: [%ls] -> %p", wcmd, pi.hProcess));
 
-  /* Not closing a[0] and b[1] because we've used DUPLICATE_CLOSE_SOURCE */
-  CloseHandle(si.hStdOutput);
-  CloseHandle(si.hStdInput);
-  /* TODO(lsm): check if we need close process and thread handles too */
-  /* CloseHandle(pi.hThread); */
-  /* CloseHandle(pi.hProcess); */
-
-  return pi.hProcess;
+  return list;
 }
-#else
-static pid_t start_process(const char *interp, const char *cmd, const char *env,
-                           const char *envp[], const char *dir, sock_t sock) {
-  char buf[500];
-  pid_t pid = fork();
-  (void) env;
 
-  if (pid == 0) {
-    /*
-     * In Linux `chdir` declared with `warn_unused_result` attribute
-     * To shutup compiler we have yo use result in some way
-     */
-    int tmp = chdir(dir);
-    (void) tmp;
-    (void) dup2(sock, 0);
-    (void) dup2(sock, 1);
-    closesocket(sock);
+int ns_match_prefix(const char *pattern, int pattern_len, const char *str) {
+  const char *or_str;
+  int len, res, i = 0, j = 0;
 
-    /*
-     * After exec, all signal handlers are restored to their default values,
-     * with one exception of SIGCHLD. According to POSIX.1-2001 and Linux's
-     * implementation, SIGCHLD's handler will leave unchanged after exec
-     * if it was set to be ignored. Restore it to default action.
-     */
-    signal(SIGCHLD, SIG_DFL);
+  if ((or_str = (const char *) memchr(pattern, '|', pattern_len)) != NULL) {
+    res = ns_match_prefix(pattern, or_str - pattern, str);
+    return res > 0 ? res : ns_match_prefix(
+                               or_str + 1,
+                               (pattern + pattern_len) - (or_str + 1), str);
+  }
 
-    if (interp == NULL) {
-      execle(cmd, cmd, (char *) 0, envp); /* (char *) 0 to squash warning */
-    } else {
-      execle(interp, interp, cmd, (char *) 0, envp);
+  for (; i < pattern_len; i++, j++) {
+    if (pattern[i] == '?' && str[j] != '\0') {
+      continue;
+    } else if (pattern[i] == '$') {
+      return str[j] == '\0' ? j : -1;
+    } else if (pattern[i] == '*') {
+      i++;
+      if (pattern[i] == '*') {
+        i++;
+        len = (int) strlen(str + j);
+      } else {
+        len = (int) strcspn(str + j, "/");
+      }
+      if (i == pattern_len) {
+        return j + len;
+      }
+      do {
+        res = ns_match_prefix(pattern + i, pattern_len - i, str + j + len);
+      } while (res == -1 && len-- > 0);
+      return res == -1 ? -1 : j + res + len;
+    } else if (lowercase(&pattern[i]) != lowercase(&str[j])) {
+      return -1;
     }
-    snprintf(buf, sizeof(buf),
-             "Status: 500\r\n\r\n"
-             "500 Server Error: %s%s%s: %s",
-             interp == NULL ? "" : interp, interp == NULL ? "" : " ", cmd,
-             strerror(errno));
-    send(1, buf, strlen(buf), 0);
-    exit(EXIT_FAILURE); /* exec call failed */
   }
+  return j;
+}
+
+double ns_time(void) {
+#if defined(_WIN32)
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  /* 100ns intervals since 1601-01-01 */
+  return ((double) ft.dwHighDateTime * 4294967296.0 + ft.dwLowDateTime) /
+             10000000.0 -
+         11644473600.0;
+#elif defined(NS_CC3200) || defined(NS_ESP8266)
+  return (double) time(NULL);
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+#endif
+}
+#ifdef NS_MODULE_LINES
+#line 1 "src/json.c"
+/**/
+#endif
+/*
+ * Copyright (c) 2015 Cesanta Software Limited
+ * All rights reserved
+ */
 
-  return pid;
-}
-#endif /* _WIN32 */
+/* Amalgamated: #include "internal.h" */
 
 /*
- * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
- * pointer into the vars array.
+ * Escape sequence for each byte: 0 if the byte is copied as is,
+ * 'u' for \u00XX, or the letter following the backslash.
  */
-static char *addenv(struct cgi_env_block *block, const char *fmt, ...) {
-  int n, space;
-  char *added = block->buf + block->len;
-  va_list ap;
+static const char ns_json_esc[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   '\\'};
 
-  /* Calculate how much space is left in the buffer */
-  space = sizeof(block->buf) - (block->len + 2);
-  if (space > 0) {
-    /* Copy VARIABLE=VALUE\0 string into the free space */
-    va_start(ap, fmt);
-    n = vsnprintf(added, (size_t) space, fmt, ap);
-    va_end(ap);
+static const char ns_json_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-    /* Make sure we do not overflow buffer and the envp array */
-    if (n > 0 && n + 1 < space &&
-        block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
-      /* Append a pointer to the added string into the envp array */
-      block->vars[block->nvars++] = added;
-      /* Bump up used length counter. Include \0 terminator */
-      block->len += n + 1;
-    }
+static void ns_json_put(struct ns_json_writer *w, const void *p, size_t len) {
+  if (mbuf_append(w->io, p, len) != len) {
+    w->error = 1; /* LCOV_EXCL_LINE */
   }
-
-  return added;
 }
 
-static void addenv2(struct cgi_env_block *blk, const char *name) {
-  const char *s;
-  if ((s = getenv(name)) != NULL) addenv(blk, "%s=%s", name, s);
+/* Grow the buffer once for output of a known maximum size */
+static void ns_json_reserve(struct ns_json_writer *w, size_t len) {
+  struct mbuf *io = w->io;
+
+  if (io->size - io->len < len) {
+    mbuf_resize(io, io->len + len + io->len / 2);
+  }
 }
 
-static void prepare_cgi_environment(struct ns_connection *nc, const char *prog,
-                                    const struct http_message *hm,
-                                    const struct ns_serve_http_opts *opts,
-                                    struct cgi_env_block *blk) {
-  const char *s, *slash;
-  struct ns_str *h;
-  char *p;
-  size_t i;
+/* Comma before a value, unless it's the first item or follows a key */
+static void ns_json_sep(struct ns_json_writer *w) {
+  uint32_t bit;
 
-  blk->len = blk->nvars = 0;
-  blk->nc = nc;
+  if (w->after_key) {
+    w->after_key = 0;
+  } else if (w->depth > 0) {
+    bit = (uint32_t) 1 << (w->depth - 1);
+    if (w->has_items & bit) {
+      ns_json_put(w, ",", 1);
+    }
+    w->has_items |= bit;
+  }
+}
 
-  if ((s = getenv("SERVER_NAME")) != NULL) {
-    addenv(blk, "SERVER_NAME=%s", s);
-  } else {
-    char buf[100];
-    ns_sock_to_str(nc->sock, buf, sizeof(buf), 3);
-    addenv(blk, "SERVER_NAME=%s", buf);
+static void ns_json_open(struct ns_json_writer *w, char c) {
+  ns_json_sep(w);
+  if (w->depth >= NS_JSON_MAX_DEPTH) {
+    w->error = 1;
+    return;
   }
-  addenv(blk, "SERVER_ROOT=%s", opts->document_root);
-  addenv(blk, "DOCUMENT_ROOT=%s", opts->document_root);
-  addenv(blk, "SERVER_SOFTWARE=%s/%s", "Fossa", NS_FOSSA_VERSION);
+  ns_json_put(w, &c, 1);
+  w->has_items &= ~((uint32_t) 1 << w->depth);
+  w->depth++;
+}
 
-  /* Prepare the environment block */
-  addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
-  addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
-  addenv(blk, "%s", "REDIRECT_STATUS=200"); /* For PHP */
+static void ns_json_close(struct ns_json_writer *w, char c) {
+  if (w->depth == 0) {
+    w->error = 1;
+    return;
+  }
+  ns_json_put(w, &c, 1);
+  w->depth--;
+  w->after_key = 0;
+}
 
-  /* TODO(lsm): fix this for IPv6 case */
-  /*addenv(blk, "SERVER_PORT=%d", ri->remote_port); */
+void ns_json_init(struct ns_json_writer *w, struct mbuf *io) {
+  memset(w, 0, sizeof(*w));
+  w->io = io;
+}
 
-  addenv(blk, "REQUEST_METHOD=%.*s", (int) hm->method.len, hm->method.p);
-#if 0
-  addenv(blk, "REMOTE_ADDR=%s", ri->remote_ip);
-  addenv(blk, "REMOTE_PORT=%d", ri->remote_port);
-#endif
-  addenv(blk, "REQUEST_URI=%.*s%s%.*s", (int) hm->uri.len, hm->uri.p,
-         hm->query_string.len == 0 ? "" : "?", (int) hm->query_string.len,
-         hm->query_string.p);
+void ns_json_begin_object(struct ns_json_writer *w) {
+  ns_json_open(w, '{');
+}
 
-/* SCRIPT_NAME */
-#if 0
-  if (nc->path_info != NULL) {
-    addenv(blk, "SCRIPT_NAME=%.*s",
-           (int) (strlen(ri->uri) - strlen(nc->path_info)), ri->uri);
-    addenv(blk, "PATH_INFO=%s", nc->path_info);
-  } else {
-#endif
-  s = strrchr(prog, '/');
-  slash = hm->uri.p + hm->uri.len;
-  while (slash > hm->uri.p && *slash != '/') {
-    slash--;
-  }
-  addenv(blk, "SCRIPT_NAME=%.*s%s", (int) (slash - hm->uri.p), hm->uri.p,
-         s == NULL ? prog : s);
-#if 0
-  }
-#endif
+void ns_json_end_object(struct ns_json_writer *w) {
+  ns_json_close(w, '}');
+}
 
-  addenv(blk, "SCRIPT_FILENAME=%s", prog);
-  addenv(blk, "PATH_TRANSLATED=%s", prog);
-  addenv(blk, "HTTPS=%s", nc->ssl != NULL ? "on" : "off");
+void ns_json_begin_array(struct ns_json_writer *w) {
+  ns_json_open(w, '[');
+}
 
-  if ((h = ns_get_http_header((struct http_message *) hm, "Content-Type")) !=
-      NULL) {
-    addenv(blk, "CONTENT_TYPE=%.*s", (int) h->len, h->p);
-  }
+void ns_json_end_array(struct ns_json_writer *w) {
+  ns_json_close(w, ']');
+}
 
-  if (hm->query_string.len > 0) {
-    addenv(blk, "QUERY_STRING=%.*s", (int) hm->query_string.len,
-           hm->query_string.p);
-  }
+/* Copy runs of plain bytes at once, escape the rest */
+static void ns_json_put_quoted(struct ns_json_writer *w, const char *s,
+                               size_t len) {
+  const unsigned char *p = (const unsigned char *) s, *end = p + len, *run;
+  char esc[6] = {'\\', 'u', '0', '0'};
+  char c;
 
-  if ((h = ns_get_http_header((struct http_message *) hm, "Content-Length")) !=
-      NULL) {
-    addenv(blk, "CONTENT_LENGTH=%.*s", (int) h->len, h->p);
+  ns_json_reserve(w, len + 2);
+  ns_json_put(w, "\"", 1);
+  while (p < end) {
+    for (run = p; p < end && ns_json_esc[*p] == 0; p++) {
+    }
+    if (p > run) {
+      ns_json_put(w, run, p - run);
+    }
+    if (p < end) {
+      if ((c = ns_json_esc[*p]) == 'u') {
+        esc[4] = "0123456789abcdef"[*p >> 4];
+        esc[5] = "0123456789abcdef"[*p & 0xf];
+        ns_json_put(w, esc, 6);
+      } else {
+        esc[1] = c;
+        ns_json_put(w, esc, 2);
+        esc[1] = 'u';
+      }
+      p++;
+    }
   }
+  ns_json_put(w, "\"", 1);
+}
 
-  addenv2(blk, "PATH");
-  addenv2(blk, "TMP");
-  addenv2(blk, "TEMP");
-  addenv2(blk, "TMPDIR");
-  addenv2(blk, "PERLLIB");
-  addenv2(blk, NS_ENV_EXPORT_TO_CGI);
+void ns_json_key(struct ns_json_writer *w, const char *key) {
+  ns_json_sep(w);
+  ns_json_put_quoted(w, key, strlen(key));
+  ns_json_put(w, ":", 1);
+  w->after_key = 1;
+}
 
-#if defined(_WIN32)
-  addenv2(blk, "COMSPEC");
-  addenv2(blk, "SYSTEMROOT");
-  addenv2(blk, "SystemDrive");
-  addenv2(blk, "ProgramFiles");
-  addenv2(blk, "ProgramFiles(x86)");
-  addenv2(blk, "CommonProgramFiles(x86)");
-#else
-  addenv2(blk, "LD_LIBRARY_PATH");
-#endif /* _WIN32 */
+void ns_json_string(struct ns_json_writer *w, const char *s, size_t len) {
+  ns_json_sep(w);
+  ns_json_put_quoted(w, s, len);
+}
 
-  /* Add all headers as HTTP_* variables */
-  for (i = 0; hm->header_names[i].len > 0; i++) {
-    p = addenv(blk, "HTTP_%.*s=%.*s", (int) hm->header_names[i].len,
-               hm->header_names[i].p, (int) hm->header_values[i].len,
-               hm->header_values[i].p);
+/* Format two digits at a time, right to left */
+static void ns_json_put_int(struct ns_json_writer *w, int64_t v) {
+  char buf[24], *p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? 0 - (uint64_t) v : (uint64_t) v;
+  int i;
 
-    /* Convert variable name into uppercase, and change - to _ */
-    for (; *p != '=' && *p != '\0'; p++) {
-      if (*p == '-') *p = '_';
-      *p = (char) toupper(*(unsigned char *) p);
-    }
+  while (u >= 100) {
+    i = (int) (u % 100) * 2;
+    u /= 100;
+    *--p = ns_json_digits[i + 1];
+    *--p = ns_json_digits[i];
+  }
+  if (u >= 10) {
+    i = (int) u * 2;
+    *--p = ns_json_digits[i + 1];
+    *--p = ns_json_digits[i];
+  } else {
+    *--p = (char) ('0' + u);
   }
+  if (v < 0) {
+    *--p = '-';
+  }
+  ns_json_put(w, p, buf + sizeof(buf) - p);
+}
 
-  blk->vars[blk->nvars++] = NULL;
-  blk->buf[blk->len++] = '\0';
+void ns_json_int(struct ns_json_writer *w, int64_t v) {
+  ns_json_sep(w);
+  ns_json_put_int(w, v);
 }
 
-static void cgi_ev_handler(struct ns_connection *cgi_nc, int ev,
-                           void *ev_data) {
-  struct ns_connection *nc = (struct ns_connection *) cgi_nc->user_data;
-  (void) ev_data;
+void ns_json_double(struct ns_json_writer *w, double v) {
+  char buf[32];
+  int n;
 
-  if (nc == NULL) return;
+  ns_json_sep(w);
+  if (v != v || v - v != 0) {
+    /* NaN or infinity */
+    ns_json_put(w, "null", 4);
+  } else if (v > -1e15 && v < 1e15 && v == (double) (int64_t) v) {
+    ns_json_put_int(w, (int64_t) v);
+  } else {
+    /* Shortest of the two precisions that reads back the same */
+    n = snprintf(buf, sizeof(buf), "%.15g", v);
+    if (strtod(buf, NULL) != v) {
+      n = snprintf(buf, sizeof(buf), "%.17g", v);
+    }
+    ns_json_put(w, buf, n);
+  }
+}
 
-  switch (ev) {
-    case NS_RECV:
-      /*
-       * CGI script does not output reply line, like "HTTP/1.1 CODE XXXXX\n"
-       * It outputs headers, then body. Headers might include "Status"
-       * header, which changes CODE, and it might include "Location" header
-       * which changes CODE to 302.
-       *
-       * Therefore we do not send the output from the CGI script to the user
-       * until all CGI headers are parsed (by setting NSF_DONT_SEND flag).
-       *
-       * Here we parse the output from the CGI script, and if all headers has
-       * been received, amend the reply line, and clear NSF_DONT_SEND flag,
-       * which makes data to be sent to the user.
-       */
-      if (nc->flags & NSF_USER_1) {
-        struct mbuf *io = &cgi_nc->recv_mbuf;
-        int len = get_request_len(io->buf, io->len);
+void ns_json_bool(struct ns_json_writer *w, int v) {
+  ns_json_sep(w);
+  ns_json_put(w, v ? "true" : "false", v ? 4 : 5);
+}
 
-        if (len == 0) break;
-        if (len < 0 || io->len > NS_MAX_HTTP_REQUEST_SIZE) {
-          cgi_nc->flags |= NSF_CLOSE_IMMEDIATELY;
-          send_http_error(nc, 500, "Bad headers");
-        } else {
-          struct http_message hm;
-          struct ns_str *h;
-          parse_http_headers(io->buf, io->buf + io->len, io->len, &hm);
-          /*printf("=== %d [%.*s]\n", k, k, io->buf);*/
-          if (ns_get_http_header(&hm, "Location") != NULL) {
-            ns_printf(nc, "%s", "HTTP/1.1 302 Moved\r\n");
-          } else if ((h = ns_get_http_header(&hm, "Status")) != NULL) {
-            ns_printf(nc, "HTTP/1.1 %.*s\r\n", (int) h->len, h->p);
-          } else {
-            ns_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
-          }
-        }
-        nc->flags &= ~NSF_USER_1;
-      }
-      if (!(nc->flags & NSF_USER_1)) {
-        ns_forward(cgi_nc, nc);
-      }
-      break;
-    case NS_CLOSE:
-      free_http_proto_data(nc);
-      nc->flags |= NSF_SEND_AND_CLOSE;
-      nc->user_data = NULL;
-      break;
-  }
+void ns_json_null(struct ns_json_writer *w) {
+  ns_json_sep(w);
+  ns_json_put(w, "null", 4);
 }
 
-static void handle_cgi(struct ns_connection *nc, const char *prog,
-                       const struct http_message *hm,
-                       const struct ns_serve_http_opts *opts) {
-  struct proto_data_http *dp;
-  struct cgi_env_block blk;
-  char dir[MAX_PATH_SIZE];
-  const char *p;
-  sock_t fds[2];
+void ns_json_raw(struct ns_json_writer *w, const char *json, size_t len) {
+  ns_json_sep(w);
+  ns_json_put(w, json, len);
+}
 
-  prepare_cgi_environment(nc, prog, hm, opts, &blk);
-  /*
-   * CGI must be executed in its own directory. 'dir' must point to the
-   * directory containing executable program, 'p' must point to the
-   * executable program name relative to 'dir'.
-   */
-  if ((p = strrchr(prog, '/')) == NULL) {
-    snprintf(dir, sizeof(dir), "%s", ".");
-  } else {
-    snprintf(dir, sizeof(dir), "%.*s", (int) (p - prog), prog);
-    prog = p + 1;
-  }
+/*
+ * Lazy reader.
+ *
+ * Values on the path are located by skipping everything else: skipped
+ * subtrees are only checked for balanced brackets and terminated strings.
+ */
 
-  /*
-   * Try to create socketpair in a loop until success. ns_socketpair()
-   * can be interrupted by a signal and fail.
-   * TODO(lsm): use sigaction to restart interrupted syscall
-   */
-  do {
-    ns_socketpair(fds, SOCK_STREAM);
-  } while (fds[0] == INVALID_SOCKET);
+/* Bytes that change the scanner state inside a container */
+static const unsigned char ns_json_structural[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 1, 0, 1};
 
-  free_http_proto_data(nc);
-  if ((dp = (struct proto_data_http *) NS_CALLOC(1, sizeof(*dp))) == NULL) {
-    send_http_error(nc, 500, "OOM"); /* LCOV_EXCL_LINE */
-  } else if (start_process(opts->cgi_interpreter, prog, blk.buf, blk.vars, dir,
-                           fds[1]) != 0) {
-    size_t n = nc->recv_mbuf.len - (hm->message.len - hm->body.len);
-    dp->type = DATA_CGI;
-    dp->cgi_nc = ns_add_sock(nc->mgr, fds[0], cgi_ev_handler);
-    dp->cgi_nc->user_data = nc;
-    nc->flags |= NSF_USER_1;
-    /* Push POST data to the CGI */
-    if (n > 0 && n < nc->recv_mbuf.len) {
-      ns_send(dp->cgi_nc, hm->body.p, n);
+static const char *ns_json_skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+  return p;
+}
+
+/*
+ * `p` points after the opening quote. Return the closing quote, or NULL.
+ * Eight bytes are checked at a time for a quote or a backslash.
+ */
+static const char *ns_json_string_end(const char *p, const char *end) {
+  const uint64_t ones = ~(uint64_t) 0 / 255, highs = ones * 0x80;
+  const uint64_t quotes = ones * '"', slashes = ones * '\\';
+  uint64_t v, q, s;
+
+  for (;;) {
+    while (end - p >= 8) {
+      memcpy(&v, p, sizeof(v));
+      q = v ^ quotes;
+      s = v ^ slashes;
+      if ((((q - ones) & ~q) | ((s - ones) & ~s)) & highs) break;
+      p += 8;
+    }
+    while (p < end && *p != '"' && *p != '\\') p++;
+    if (p >= end) return NULL;
+    if (*p == '"') return p;
+    p += 2; /* Escaped character */
+  }
+}
+
+/* Return the end of the value starting at `p`, or NULL if malformed */
+static const char *ns_json_value_end(const char *p, const char *end) {
+  int depth = 0;
+
+  if (p >= end) return NULL;
+  if (*p == '"') {
+    p = ns_json_string_end(p + 1, end);
+    return p == NULL ? NULL : p + 1;
+  }
+  if (*p != '{' && *p != '[') {
+    /* Scalar: number, true, false or null */
+    const char *s = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+           *p != '\t' && *p != '\n' && *p != '\r') {
+      p++;
+    }
+    if ((*s == 't' && (p - s != 4 || memcmp(s, "true", 4) != 0)) ||
+        (*s == 'f' && (p - s != 5 || memcmp(s, "false", 5) != 0)) ||
+        (*s == 'n' && (p - s != 4 || memcmp(s, "null", 4) != 0))) {
+      return NULL;
     }
-    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
-  } else {
-    closesocket(fds[0]);
-    send_http_error(nc, 500, "CGI failure");
+    return p > s ? p : NULL;
   }
 
-#ifndef _WIN32
-  closesocket(fds[1]); /* On Windows, CGI stdio thread closes that socket */
-#endif
+  for (; p < end; p++) {
+    if (!ns_json_structural[*(const unsigned char *) p]) continue;
+    if (*p == '"') {
+      if ((p = ns_json_string_end(p + 1, end)) == NULL) return NULL;
+    } else if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (--depth == 0) {
+      return p + 1;
+    }
+  }
+  return NULL;
 }
-#endif
 
-void ns_send_http_file(struct ns_connection *nc, char *path,
-                       size_t path_buf_len, struct http_message *hm,
-                       struct ns_serve_http_opts *opts) {
-  int stat_result, is_directory, is_dav = is_dav_request(&hm->method);
-  uint32_t remote_ip = ntohl(*(uint32_t *) &nc->sa.sin.sin_addr);
-  ns_stat_t st;
+static int ns_json_value_type(const char *p) {
+  switch (*p) {
+    case '"':
+      return JSON_TYPE_STRING;
+    case '{':
+      return JSON_TYPE_OBJECT;
+    case '[':
+      return JSON_TYPE_ARRAY;
+    case 't':
+      return JSON_TYPE_TRUE;
+    case 'f':
+      return JSON_TYPE_FALSE;
+    case 'n':
+      return JSON_TYPE_NULL;
+    default:
+      return JSON_TYPE_NUMBER;
+  }
+}
 
-  stat_result = ns_stat(path, &st);
-  is_directory = !stat_result && S_ISDIR(st.st_mode);
+/* Move `p` to the member `key`, `key_len` of the object at `p` */
+static const char *ns_json_find_key(const char *p, const char *end,
+                                    const char *key, size_t key_len) {
+  const char *k;
 
-  if (ns_check_ip_acl(opts->ip_acl, remote_ip) != 1) {
-    /* Not allowed to connect */
-    nc->flags |= NSF_CLOSE_IMMEDIATELY;
-  } else if (is_dav && opts->dav_document_root == NULL) {
-    send_http_error(nc, 501, NULL);
-  } else if (!is_authorized(hm, path, is_directory, opts)) {
-    ns_printf(nc,
-              "HTTP/1.1 401 Unauthorized\r\n"
-              "WWW-Authenticate: Digest qop=\"auth\", "
-              "realm=\"%s\", nonce=\"%lu\"\r\n"
-              "Content-Length: 0\r\n\r\n",
-              opts->auth_domain, (unsigned long) time(NULL));
-  } else if ((stat_result != 0 || is_file_hidden(path, opts)) && !is_dav) {
-    ns_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
-  } else if (is_directory && path[strlen(path) - 1] != '/' && !is_dav) {
-    ns_printf(nc,
-              "HTTP/1.1 301 Moved\r\nLocation: %.*s/\r\n"
-              "Content-Length: 0\r\n\r\n",
-              (int) hm->uri.len, hm->uri.p);
-#ifndef NS_DISABLE_DAV
-  } else if (!ns_vcmp(&hm->method, "PROPFIND")) {
-    handle_propfind(nc, path, &st, hm, opts);
-  } else if (!ns_vcmp(&hm->method, "MKCOL")) {
-    handle_mkcol(nc, path, hm);
-  } else if (!ns_vcmp(&hm->method, "DELETE")) {
-    handle_delete(nc, path);
-  } else if (!ns_vcmp(&hm->method, "PUT")) {
-    handle_put(nc, path, hm);
-#endif
-  } else if (S_ISDIR(st.st_mode) &&
-             !find_index_file(path, path_buf_len, opts->index_files, &st)) {
-    if (strcmp(opts->enable_directory_listing, "yes") == 0) {
-#ifndef NS_DISABLE_DIRECTORY_LISTING
-      send_directory_listing(nc, path, hm, opts);
-#else
-      send_http_error(nc, 501, NULL);
-#endif
-    } else {
-      send_http_error(nc, 403, NULL);
+  p = ns_json_skip_ws(p + 1, end);
+  if (p < end && *p == '}') return NULL;
+  while (p < end && *p == '"') {
+    k = p + 1;
+    if ((p = ns_json_string_end(k, end)) == NULL) return NULL;
+    /* Keys are compared as written, like find_json_token() does */
+    if ((size_t)(p - k) == key_len && memcmp(k, key, key_len) == 0) {
+      p = ns_json_skip_ws(p + 1, end);
+      return p < end && *p == ':' ? ns_json_skip_ws(p + 1, end) : NULL;
     }
-  } else if (ns_match_prefix(opts->cgi_file_pattern,
-                             strlen(opts->cgi_file_pattern), path) > 0) {
-#if !defined(NS_DISABLE_CGI)
-    handle_cgi(nc, path, hm, opts);
-#else
-    send_http_error(nc, 501, NULL);
-#endif /* NS_DISABLE_CGI */
-  } else {
-    ns_send_http_file2(nc, path, &st, hm, opts);
+    p = ns_json_skip_ws(p + 1, end);
+    if (p >= end || *p != ':') return NULL;
+    p = ns_json_value_end(ns_json_skip_ws(p + 1, end), end);
+    if (p == NULL) return NULL;
+    p = ns_json_skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = ns_json_skip_ws(p + 1, end);
   }
+  return NULL;
 }
 
-void ns_serve_http(struct ns_connection *nc, struct http_message *hm,
-                   struct ns_serve_http_opts opts) {
-  char path[NS_MAX_PATH];
-  uri_to_path(hm, path, sizeof(path), &opts);
-  if (opts.per_directory_auth_file == NULL) {
-    opts.per_directory_auth_file = ".htpasswd";
+/* Move `p` to the element `index` of the array at `p` */
+static const char *ns_json_find_index(const char *p, const char *end,
+                                      int index) {
+  p = ns_json_skip_ws(p + 1, end);
+  if (p < end && *p == ']') return NULL;
+  while (index-- > 0) {
+    if ((p = ns_json_value_end(p, end)) == NULL) return NULL;
+    p = ns_json_skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = ns_json_skip_ws(p + 1, end);
   }
-  if (opts.enable_directory_listing == NULL) {
-    opts.enable_directory_listing = "yes";
+  return p < end ? p : NULL;
+}
+
+int ns_json_find(const char *buf, size_t len, const char *path,
+                 struct ns_str *value) {
+  const char *p = ns_json_skip_ws(buf, buf + len), *end = buf + len, *v;
+  int index, nested = *path != '\0';
+  size_t n;
+
+  while (p != NULL && p < end && *path != '\0') {
+    if (*path == '[') {
+      if (*p != '[' || !isdigit(*(const unsigned char *) (path + 1))) {
+        return JSON_TYPE_EOF;
+      }
+      for (index = 0, path++; isdigit(*(const unsigned char *) path); path++) {
+        index = index * 10 + (*path - '0');
+      }
+      if (*path++ != ']') return JSON_TYPE_EOF;
+      p = ns_json_find_index(p, end, index);
+    } else {
+      if (*p != '{') return JSON_TYPE_EOF;
+      n = strcspn(path, ".[");
+      p = ns_json_find_key(p, end, path, n);
+      path += n;
+    }
+    if (*path == '.') path++;
   }
-  if (opts.cgi_file_pattern == NULL) {
-    opts.cgi_file_pattern = "**.cgi$|**.php$";
+
+  /* A member or element is always followed by something, at least `}` */
+  if (p == NULL || p >= end || *path != '\0' ||
+      (v = ns_json_value_end(p, end)) == NULL || (nested && v == end)) {
+    return JSON_TYPE_EOF;
   }
-  if (opts.ssi_pattern == NULL) {
-    opts.ssi_pattern = "**.shtml$|**.shtm$";
+  if (*p == '"') {
+    /* Like frozen tokens, strings exclude the quotes */
+    value->p = p + 1;
+    value->len = v - p - 2;
+  } else {
+    value->p = p;
+    value->len = v - p;
   }
-  if (opts.index_files == NULL) {
-    opts.index_files = "index.html,index.htm,index.shtml,index.cgi,index.php";
+  return ns_json_value_type(p);
+}
+#ifdef NS_MODULE_LINES
+#line 1 "src/json-rpc.c"
+/**/
+#endif
+/* Copyright (c) 2014 Cesanta Software Limited */
+/* All rights reserved */
+
+#ifndef NS_DISABLE_JSON_RPC
+
+/* Amalgamated: #include "internal.h" */
+
+int ns_rpc_create_reply(char *buf, int len, const struct ns_rpc_request *req,
+                        const char *result_fmt, ...) {
+  static const struct json_token null_tok = {"null", 4, 0, JSON_TYPE_NULL};
+  const struct json_token *id = req->id == NULL ? &null_tok : req->id;
+  va_list ap;
+  int n = 0;
+
+  n += json_emit(buf + n, len - n, "{s:s,s:", "jsonrpc", "2.0", "id");
+  if (id->type == JSON_TYPE_STRING) {
+    n += json_emit_quoted_str(buf + n, len - n, id->ptr, id->len);
+  } else {
+    n += json_emit_unquoted_str(buf + n, len - n, id->ptr, id->len);
   }
-  ns_send_http_file(nc, path, sizeof(path), hm, &opts);
+  n += json_emit(buf + n, len - n, ",s:", "result");
+
+  va_start(ap, result_fmt);
+  n += json_emit_va(buf + n, len - n, result_fmt, ap);
+  va_end(ap);
+
+  n += json_emit(buf + n, len - n, "}");
+
+  return n;
 }
 
-#endif /* NS_DISABLE_FILESYSTEM */
+int ns_rpc_create_request(char *buf, int len, const char *method,
+                          const char *id, const char *params_fmt, ...) {
+  va_list ap;
+  int n = 0;
 
-struct ns_connection *ns_connect_http(struct ns_mgr *mgr,
-                                      ns_event_handler_t ev_handler,
-                                      const char *url,
-                                      const char *extra_headers,
-                                      const char *post_data) {
-  struct ns_connection *nc;
-  char addr[1100], path[4096]; /* NOTE: keep sizes in sync with sscanf below */
-  int use_ssl = 0, addr_len = 0;
+  n += json_emit(buf + n, len - n, "{s:s,s:s,s:s,s:", "jsonrpc", "2.0", "id",
+                 id, "method", method, "params");
+  va_start(ap, params_fmt);
+  n += json_emit_va(buf + n, len - n, params_fmt, ap);
+  va_end(ap);
 
-  if (memcmp(url, "http://", 7) == 0) {
-    url += 7;
-  } else if (memcmp(url, "https://", 8) == 0) {
-    url += 8;
-    use_ssl = 1;
-#ifndef NS_ENABLE_SSL
-    return NULL; /* SSL is not enabled, cannot do HTTPS URLs */
-#endif
+  n += json_emit(buf + n, len - n, "}");
+
+  return n;
+}
+
+int ns_rpc_create_error(char *buf, int len, struct ns_rpc_request *req,
+                        int code, const char *message, const char *fmt, ...) {
+  va_list ap;
+  int n = 0;
+
+  n += json_emit(buf + n, len - n, "{s:s,s:V,s:{s:i,s:s,s:", "jsonrpc", "2.0",
+                 "id", req->id == NULL ? "null" : req->id->ptr,
+                 req->id == NULL ? 4 : req->id->len, "error", "code", code,
+                 "message", message, "data");
+  va_start(ap, fmt);
+  n += json_emit_va(buf + n, len - n, fmt, ap);
+  va_end(ap);
+
+  n += json_emit(buf + n, len - n, "}}");
+
+  return n;
+}
+
+static const char *ns_rpc_std_error_message(int code) {
+  switch (code) {
+    case JSON_RPC_PARSE_ERROR:
+      return "parse error";
+    case JSON_RPC_INVALID_REQUEST_ERROR:
+      return "invalid request";
+    case JSON_RPC_METHOD_NOT_FOUND_ERROR:
+      return "method not found";
+    case JSON_RPC_INVALID_PARAMS_ERROR:
+      return "invalid parameters";
+    case JSON_RPC_SERVER_ERROR:
+      return "server error";
+    default:
+      return "unspecified error";
   }
+}
 
-  addr[0] = path[0] = '\0';
+int ns_rpc_create_std_error(char *buf, int len, struct ns_rpc_request *req,
+                            int code) {
+  return ns_rpc_create_error(buf, len, req, code,
+                             ns_rpc_std_error_message(code), "N");
+}
 
-  /* addr buffer size made smaller to allow for port to be prepended */
-  sscanf(url, "%1095[^/]/%4095s", addr, path);
-  if (strchr(addr, ':') == NULL) {
-    addr_len = strlen(addr);
-    strncat(addr, use_ssl ? ":443" : ":80", sizeof(addr) - (addr_len + 1));
+int ns_rpc_dispatch(const char *buf, int len, char *dst, int dst_len,
+                    const char **methods, ns_rpc_handler_t *handlers) {
+  struct json_token tokens[200];
+  struct ns_rpc_request req;
+  int i, n;
+
+  memset(&req, 0, sizeof(req));
+  n = parse_json(buf, len, tokens, sizeof(tokens) / sizeof(tokens[0]));
+  if (n <= 0) {
+    int err_code = (n == JSON_STRING_INVALID) ? JSON_RPC_PARSE_ERROR
+                                              : JSON_RPC_SERVER_ERROR;
+    return ns_rpc_create_std_error(dst, dst_len, &req, err_code);
   }
 
-  if ((nc = ns_connect(mgr, addr, ev_handler)) != NULL) {
-    ns_set_protocol_http_websocket(nc);
+  req.message = tokens;
+  req.id = find_json_token(tokens, "id");
+  req.method = find_json_token(tokens, "method");
+  req.params = find_json_token(tokens, "params");
 
-    if (use_ssl) {
-#ifdef NS_ENABLE_SSL
-      ns_set_ssl(nc, NULL, NULL);
-#endif
-    }
+  if (req.id == NULL || req.method == NULL) {
+    return ns_rpc_create_std_error(dst, dst_len, &req,
+                                   JSON_RPC_INVALID_REQUEST_ERROR);
+  }
 
-    if (addr_len) {
-      /* Do not add port. See https://github.com/cesanta/fossa/pull/304 */
-      addr[addr_len] = '\0';
-    }
-    ns_printf(nc,
-              "%s /%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %lu\r\n%s\r\n%s",
-              post_data == NULL ? "GET" : "POST", path, addr,
-              post_data == NULL ? 0 : strlen(post_data),
-              extra_headers == NULL ? "" : extra_headers,
-              post_data == NULL ? "" : post_data);
+  for (i = 0; methods[i] != NULL; i++) {
+    int mlen = strlen(methods[i]);
+    if (mlen == req.method->len &&
+        memcmp(methods[i], req.method->ptr, mlen) == 0)
+      break;
+  }
+
+  if (methods[i] == NULL) {
+    return ns_rpc_create_std_error(dst, dst_len, &req,
+                                   JSON_RPC_METHOD_NOT_FOUND_ERROR);
+  }
+
+  return handlers[i](dst, dst_len, &req);
+}
+
+/* Append `json_emit_va()` output, growing the buffer if it doesn't fit */
+static int ns_rpc_emit_va(struct mbuf *io, const char *fmt, va_list ap) {
+  va_list ap_copy;
+  int n;
+
+  if (io->size - io->len < 64) {
+    mbuf_resize(io, io->len + 64);
+  }
+
+  va_copy(ap_copy, ap);
+  n = json_emit_va(io->buf + io->len, io->size - io->len, fmt, ap_copy);
+  va_end(ap_copy);
+
+  if (n >= (int) (io->size - io->len)) {
+    mbuf_resize(io, io->len + n + 1);
+    if (n >= (int) (io->size - io->len)) {
+      return 0; /* LCOV_EXCL_LINE */
+    }
+    va_copy(ap_copy, ap);
+    json_emit_va(io->buf + io->len, io->size - io->len, fmt, ap_copy);
+    va_end(ap_copy);
   }
+  io->len += n;
 
-  return nc;
+  return n;
 }
 
-static size_t get_line_len(const char *buf, size_t buf_len) {
-  size_t len = 0;
-  while (len < buf_len && buf[len] != '\n') len++;
-  return buf[len] == '\n' ? len + 1 : 0;
-}
+static int ns_rpc_emit(struct mbuf *io, const char *fmt, ...) {
+  va_list ap;
+  int n;
 
-size_t ns_parse_multipart(const char *buf, size_t buf_len, char *var_name,
-                          size_t var_name_len, char *file_name,
-                          size_t file_name_len, const char **data,
-                          size_t *data_len) {
-  static const char cd[] = "Content-Disposition: ";
-  size_t hl, bl, n, ll, pos, cdl = sizeof(cd) - 1;
+  va_start(ap, fmt);
+  n = ns_rpc_emit_va(io, fmt, ap);
+  va_end(ap);
 
-  if (buf == NULL || buf_len <= 0) return 0;
-  if ((hl = get_request_len(buf, buf_len)) <= 0) return 0;
-  if (buf[0] != '-' || buf[1] != '-' || buf[2] == '\n') return 0;
+  return n;
+}
 
-  /* Get boundary length */
-  bl = get_line_len(buf, buf_len);
+/* Append the request ID as is, strings are already escaped */
+static void ns_rpc_append_id(struct mbuf *io,
+                             const struct ns_rpc_request *req) {
+  const struct json_token *id = req->id;
 
-  /* Loop through headers, fetch variable name and file name */
-  var_name[0] = file_name[0] = '\0';
-  for (n = bl; (ll = get_line_len(buf + n, hl - n)) > 0; n += ll) {
-    if (ns_ncasecmp(cd, buf + n, cdl) == 0) {
-      struct ns_str header;
-      header.p = buf + n + cdl;
-      header.len = ll - (cdl + 2);
-      ns_http_parse_header(&header, "name", var_name, var_name_len);
-      ns_http_parse_header(&header, "filename", file_name, file_name_len);
-    }
+  if (id == NULL) {
+    mbuf_append(io, "null", 4);
+  } else if (id->type == JSON_TYPE_STRING) {
+    mbuf_append(io, id->ptr - 1, id->len + 2);
+  } else {
+    mbuf_append(io, id->ptr, id->len);
   }
+}
 
-  /* Scan through the body, search for terminating boundary */
-  for (pos = hl; pos + (bl - 2) < buf_len; pos++) {
-    if (buf[pos] == '-' && !memcmp(buf, &buf[pos], bl - 2)) {
-      if (data_len != NULL) *data_len = (pos - 2) - hl;
-      if (data != NULL) *data = buf + hl;
-      return pos;
-    }
-  }
+static int ns_rpc_append_reply_va(struct mbuf *io,
+                                  const struct ns_rpc_request *req,
+                                  const char *result_fmt, va_list ap) {
+  size_t start = io->len;
 
-  return 0;
+  ns_rpc_emit(io, "{s:s,s:", "jsonrpc", "2.0", "id");
+  ns_rpc_append_id(io, req);
+  ns_rpc_emit(io, ",s:", "result");
+  ns_rpc_emit_va(io, result_fmt, ap);
+  mbuf_append(io, "}", 1);
+
+  return io->len - start;
 }
 
-#endif /* NS_DISABLE_HTTP */
-#ifdef NS_MODULE_LINES
-#line 1 "src/util.c"
-/**/
-#endif
-/*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
- */
+int ns_rpc_append_reply(struct mbuf *io, const struct ns_rpc_request *req,
+                        const char *result_fmt, ...) {
+  va_list ap;
+  int n;
 
-/* Amalgamated: #include "internal.h" */
+  va_start(ap, result_fmt);
+  n = ns_rpc_append_reply_va(io, req, result_fmt, ap);
+  va_end(ap);
 
-const char *ns_skip(const char *s, const char *end, const char *delims,
-                    struct ns_str *v) {
-  v->p = s;
-  while (s < end && strchr(delims, *(unsigned char *) s) == NULL) s++;
-  v->len = s - v->p;
-  while (s < end && strchr(delims, *(unsigned char *) s) != NULL) s++;
-  return s;
+  return n;
 }
 
-static int lowercase(const char *s) {
-  return tolower(*(const unsigned char *) s);
+void ns_rpc_begin_reply(struct ns_json_writer *w,
+                        const struct ns_rpc_request *req) {
+  const struct json_token *id = req->id;
+
+  ns_json_begin_object(w);
+  ns_json_key(w, "jsonrpc");
+  ns_json_string(w, "2.0", 3);
+  ns_json_key(w, "id");
+  if (id == NULL) {
+    ns_json_null(w);
+  } else if (id->type == JSON_TYPE_STRING) {
+    /* Already escaped, keep as is */
+    ns_json_raw(w, id->ptr - 1, id->len + 2);
+  } else {
+    ns_json_raw(w, id->ptr, id->len);
+  }
+  ns_json_key(w, "result");
 }
 
-int ns_ncasecmp(const char *s1, const char *s2, size_t len) {
-  int diff = 0;
+int ns_rpc_append_error(struct mbuf *io, const struct ns_rpc_request *req,
+                        int code, const char *message, const char *fmt, ...) {
+  size_t start = io->len;
+  va_list ap;
 
-  if (len > 0) do {
-      diff = lowercase(s1++) - lowercase(s2++);
-    } while (diff == 0 && s1[-1] != '\0' && --len > 0);
+  ns_rpc_emit(io, "{s:s,s:", "jsonrpc", "2.0", "id");
+  ns_rpc_append_id(io, req);
+  ns_rpc_emit(io, ",s:{s:i,s:s,s:", "error", "code", (long) code, "message",
+              message, "data");
 
-  return diff;
+  va_start(ap, fmt);
+  ns_rpc_emit_va(io, fmt, ap);
+  va_end(ap);
+
+  mbuf_append(io, "}}", 2);
+
+  return io->len - start;
 }
 
-int ns_casecmp(const char *s1, const char *s2) {
-  return ns_ncasecmp(s1, s2, (size_t) ~0);
+int ns_rpc_append_std_error(struct mbuf *io, const struct ns_rpc_request *req,
+                            int code) {
+  return ns_rpc_append_error(io, req, code, ns_rpc_std_error_message(code),
+                             "N");
 }
 
-int ns_vcasecmp(const struct ns_str *str1, const char *str2) {
-  size_t n2 = strlen(str2), n1 = str1->len;
-  int r = ns_ncasecmp(str1->p, str2, (n1 < n2) ? n1 : n2);
-  if (r == 0) {
-    return n1 - n2;
+/* FNV-1a */
+static uint32_t ns_rpc_hash(const char *s, int len) {
+  uint32_t h = 2166136261U;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 16777619U;
   }
-  return r;
+  return h;
 }
 
-int ns_vcmp(const struct ns_str *str1, const char *str2) {
-  size_t n2 = strlen(str2), n1 = str1->len;
-  int r = memcmp(str1->p, str2, (n1 < n2) ? n1 : n2);
-  if (r == 0) {
-    return n1 - n2;
+/* Find the slot of `name`, or the empty slot where it should go */
+static struct ns_rpc_method *ns_rpc_find_slot(struct ns_rpc_methods *methods,
+                                              const char *name, int len,
+                                              uint32_t hash) {
+  int i = hash & (methods->size - 1);
+  struct ns_rpc_method *m;
+
+  for (;;) {
+    m = &methods->table[i];
+    if (m->name == NULL || (m->hash == hash && m->name_len == len &&
+                            memcmp(m->name, name, len) == 0)) {
+      return m;
+    }
+    i = (i + 1) & (methods->size - 1);
   }
-  return r;
 }
 
-#ifndef NS_DISABLE_FILESYSTEM
-int ns_stat(const char *path, ns_stat_t *st) {
-#ifdef _WIN32
-  wchar_t wpath[MAX_PATH_SIZE];
-  to_wchar(path, wpath, ARRAY_SIZE(wpath));
-  DBG(("[%ls] -> %d", wpath, _wstati64(wpath, st)));
-  return _wstati64(wpath, (struct _stati64 *) st);
-#else
-  return stat(path, st);
-#endif
+void ns_rpc_methods_init(struct ns_rpc_methods *methods) {
+  memset(methods, 0, sizeof(*methods));
 }
 
-FILE *ns_fopen(const char *path, const char *mode) {
-#ifdef _WIN32
-  wchar_t wpath[MAX_PATH_SIZE], wmode[10];
-  to_wchar(path, wpath, ARRAY_SIZE(wpath));
-  to_wchar(mode, wmode, ARRAY_SIZE(wmode));
-  return _wfopen(wpath, wmode);
-#else
-  return fopen(path, mode);
-#endif
+void ns_rpc_methods_free(struct ns_rpc_methods *methods) {
+  NS_FREE(methods->table);
+  ns_rpc_methods_init(methods);
 }
 
-int ns_open(const char *path, int flag, int mode) { /* LCOV_EXCL_LINE */
-#ifdef _WIN32
-  wchar_t wpath[MAX_PATH_SIZE];
-  to_wchar(path, wpath, ARRAY_SIZE(wpath));
-  return _wopen(wpath, flag, mode);
-#else
-  return open(path, flag, mode); /* LCOV_EXCL_LINE */
-#endif
+int ns_rpc_add_method(struct ns_rpc_methods *methods, const char *name,
+                      ns_rpc_method_t handler, void *user_data) {
+  struct ns_rpc_method *m;
+  int len = strlen(name), i;
+
+  /* Keep the load factor under 1/2 so that probe sequences stay short */
+  if ((methods->num_methods + 1) * 2 > methods->size) {
+    struct ns_rpc_methods grown;
+    grown.size = methods->size == 0 ? 16 : methods->size * 2;
+    grown.num_methods = methods->num_methods;
+    grown.table = (struct ns_rpc_method *) NS_CALLOC(grown.size,
+                                                     sizeof(*grown.table));
+    if (grown.table == NULL) {
+      return -1;
+    }
+    for (i = 0; i < methods->size; i++) {
+      m = &methods->table[i];
+      if (m->name != NULL) {
+        *ns_rpc_find_slot(&grown, m->name, m->name_len, m->hash) = *m;
+      }
+    }
+    NS_FREE(methods->table);
+    *methods = grown;
+  }
+
+  m = ns_rpc_find_slot(methods, name, len, ns_rpc_hash(name, len));
+  if (m->name == NULL) {
+    methods->num_methods++;
+  }
+  m->name = name;
+  m->name_len = len;
+  m->hash = ns_rpc_hash(name, len);
+  m->handler = handler;
+  m->user_data = user_data;
+
+  return 0;
 }
-#endif
 
-void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  cs_base64_encode(src, src_len, dst);
+/*
+ * Dispatch a request parsed into `toks`, return the number of bytes appended.
+ * Notifications (requests without ID) get no reply.
+ */
+static int ns_rpc_dispatch_tokens(struct ns_rpc_methods *methods,
+                                  struct ns_rpc_channel *ch,
+                                  struct json_token *toks, struct mbuf *out) {
+  struct ns_rpc_request req;
+  struct ns_rpc_method *m = NULL;
+  size_t start = out->len;
+
+  memset(&req, 0, sizeof(req));
+  req.message = toks;
+  req.id = find_json_token(toks, "id");
+  req.method = find_json_token(toks, "method");
+  req.params = find_json_token(toks, "params");
+  req.channel = ch;
+
+  if (req.method == NULL || req.method->type != JSON_TYPE_STRING) {
+    ns_rpc_append_std_error(out, &req, JSON_RPC_INVALID_REQUEST_ERROR);
+  } else {
+    if (methods != NULL && methods->size > 0) {
+      m = ns_rpc_find_slot(methods, req.method->ptr, req.method->len,
+                           ns_rpc_hash(req.method->ptr, req.method->len));
+    }
+    if (m == NULL || m->name == NULL) {
+      ns_rpc_append_std_error(out, &req, JSON_RPC_METHOD_NOT_FOUND_ERROR);
+    } else {
+      m->handler(out, &req, m->user_data);
+    }
+    if (req.id == NULL) {
+      out->len = start;
+    }
+  }
+
+  return out->len - start;
 }
 
-int ns_base64_decode(const unsigned char *s, int len, char *dst) {
-  return cs_base64_decode(s, len, dst);
+static const char *ns_rpc_skip_space(const char *p, const char *end) {
+  while (p < end && isspace(*(unsigned char *) p)) p++;
+  return p;
 }
 
-#ifdef NS_ENABLE_THREADS
-void *ns_start_thread(void *(*f)(void *), void *p) {
-#ifdef _WIN32
-  return (void *) _beginthread((void(__cdecl *) (void *) ) f, 0, p);
-#else
-  pthread_t thread_id = (pthread_t) 0;
-  pthread_attr_t attr;
+/* Parse and dispatch a single request */
+static int ns_rpc_dispatch_one(struct ns_rpc_methods *methods,
+                               struct ns_rpc_channel *ch, const char *buf,
+                               int len, struct mbuf *out) {
+  const char *p = ns_rpc_skip_space(buf, buf + len);
+  struct json_token *toks;
+  struct ns_rpc_request req;
+  int n;
 
-  (void) pthread_attr_init(&attr);
-  (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  memset(&req, 0, sizeof(req));
+  if (p == buf + len) {
+    /* Nothing at all is not valid JSON */
+    return ns_rpc_append_std_error(out, &req, JSON_RPC_PARSE_ERROR);
+  } else if ((toks = parse_json2(p, (int) (buf + len - p))) == NULL) {
+    /* Frozen only parses objects, anything else is not a request */
+    return ns_rpc_append_std_error(
+        out, &req,
+        *p == '{' ? JSON_RPC_PARSE_ERROR : JSON_RPC_INVALID_REQUEST_ERROR);
+  }
 
-#if defined(NS_STACK_SIZE) && NS_STACK_SIZE > 1
-  (void) pthread_attr_setstacksize(&attr, NS_STACK_SIZE);
-#endif
+  n = ns_rpc_dispatch_tokens(methods, ch, toks, out);
 
-  pthread_create(&thread_id, &attr, f, p);
-  pthread_attr_destroy(&attr);
+  /* Allocated by parse_json2() with realloc() */
+  free(toks);
 
-  return (void *) thread_id;
-#endif
+  return n;
 }
-#endif /* NS_ENABLE_THREADS */
 
-/* Set close-on-exec bit for a given socket. */
-void ns_set_close_on_exec(sock_t sock) {
-#ifdef _WIN32
-  (void) SetHandleInformation((HANDLE) sock, HANDLE_FLAG_INHERIT, 0);
-#else
-  fcntl(sock, F_SETFD, FD_CLOEXEC);
-#endif
+/*
+ * Return the length of the JSON value at `p`, or -1 if it's unterminated.
+ * Only nesting and strings are checked, frozen parses the value later.
+ */
+static int ns_rpc_value_len(const char *p, const char *end) {
+  const char *s;
+  int depth = 0, in_string = 0;
+
+  for (s = p; s < end; s++) {
+    if (in_string) {
+      if (*s == '\\') {
+        s++;
+      } else if (*s == '"') {
+        in_string = 0;
+        if (depth == 0) return s + 1 - p;
+      }
+    } else if (*s == '"') {
+      in_string = 1;
+    } else if (*s == '{' || *s == '[') {
+      depth++;
+    } else if (*s == '}' || *s == ']') {
+      if (depth == 0) return s - p;
+      if (--depth == 0) return s + 1 - p;
+    } else if (depth == 0 && (*s == ',' || isspace(*(unsigned char *) s))) {
+      return s - p;
+    }
+  }
+  return -1;
 }
 
-void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags) {
-  union socket_address sa;
-#ifndef NS_CC3200
-  socklen_t slen = sizeof(sa);
-#endif
+static int ns_rpc_dispatch_batch(struct ns_rpc_methods *methods,
+                                 struct ns_rpc_channel *ch, const char *buf,
+                                 int len, struct mbuf *out) {
+  const char *p, *end = buf + len;
+  struct ns_rpc_request req;
+  size_t start = out->len, pos;
+  int n, num_requests = 0, num_replies = 0;
 
-  memset(&sa, 0, sizeof(sa));
-#ifndef NS_CC3200
-  if (flags & NS_SOCK_STRINGIFY_REMOTE) {
-    getpeername(sock, &sa.sa, &slen);
-  } else {
-    getsockname(sock, &sa.sa, &slen);
+  memset(&req, 0, sizeof(req));
+  p = ns_rpc_skip_space(buf, end);
+  if (p == end || *p != '[') {
+    return ns_rpc_dispatch_one(methods, ch, buf, len, out);
   }
-#endif
-  ns_sock_addr_to_str(&sa, buf, len, flags);
-}
 
-void ns_sock_addr_to_str(const union socket_address *sa, char *buf, size_t len,
-                         int flags) {
-  int is_v6;
-  if (buf == NULL || len <= 0) return;
-  buf[0] = '\0';
-#if defined(NS_ENABLE_IPV6)
-  is_v6 = sa->sa.sa_family == AF_INET6;
-#else
-  is_v6 = 0;
-#endif
-  if (flags & NS_SOCK_STRINGIFY_IP) {
-#if defined(NS_ENABLE_IPV6)
-    const void *addr = NULL;
-    char *start = buf;
-    socklen_t capacity = len;
-    if (!is_v6) {
-      addr = &sa->sin.sin_addr;
-    } else {
-      addr = (void *) &sa->sin6.sin6_addr;
-      if (flags & NS_SOCK_STRINGIFY_PORT) {
-        *buf = '[';
-        start++;
-        capacity--;
-      }
+  /* Batch: dispatch array elements one by one */
+  mbuf_append(out, "[", 1);
+  for (p = ns_rpc_skip_space(p + 1, end); p < end && *p != ']';) {
+    if ((n = ns_rpc_value_len(p, end)) <= 0) {
+      break;
     }
-    if (inet_ntop(sa->sa.sa_family, addr, start, capacity) == NULL) {
-      *buf = '\0';
+    num_requests++;
+    pos = out->len;
+    if (num_replies > 0) {
+      mbuf_append(out, ",", 1);
     }
-#elif defined(_WIN32) || defined(NS_ESP8266)
-    /* Only Windoze Vista (and newer) have inet_ntop() */
-    strncpy(buf, inet_ntoa(sa->sin.sin_addr), len);
-#else
-    inet_ntop(AF_INET, (void *) &sa->sin.sin_addr, buf, len);
-#endif
-  }
-  if (flags & NS_SOCK_STRINGIFY_PORT) {
-    int port = ntohs(sa->sin.sin_port);
-    if (flags & NS_SOCK_STRINGIFY_IP) {
-      snprintf(buf + strlen(buf), len - (strlen(buf) + 1), "%s:%d",
-               (is_v6 ? "]" : ""), port);
+    if (ns_rpc_dispatch_one(methods, ch, p, n, out) > 0) {
+      num_replies++;
     } else {
-      snprintf(buf, len, "%d", port);
+      out->len = pos;
     }
+
+    p = ns_rpc_skip_space(p + n, end);
+    if (p < end && *p == ',') {
+      p = ns_rpc_skip_space(p + 1, end);
+    } else if (p < end && *p != ']') {
+      break;
+    }
+  }
+
+  if (p == end || *p != ']') {
+    out->len = start;
+    ns_rpc_append_std_error(out, &req, JSON_RPC_PARSE_ERROR);
+  } else if (num_requests == 0) {
+    /* Empty batch */
+    out->len = start;
+    ns_rpc_append_std_error(out, &req, JSON_RPC_INVALID_REQUEST_ERROR);
+  } else if (num_replies > 0) {
+    mbuf_append(out, "]", 1);
+  } else {
+    /* Batch of notifications */
+    out->len = start;
   }
+
+  return out->len - start;
 }
 
-int ns_hexdump(const void *buf, int len, char *dst, int dst_len) {
-  const unsigned char *p = (const unsigned char *) buf;
-  char ascii[17] = "";
-  int i, idx, n = 0;
+int ns_rpc_dispatch_mbuf(struct ns_rpc_methods *methods, const char *buf,
+                         int len, struct mbuf *out) {
+  return ns_rpc_dispatch_batch(methods, NULL, buf, len, out);
+}
 
-  for (i = 0; i < len; i++) {
-    idx = i % 16;
-    if (idx == 0) {
-      if (i > 0) n += snprintf(dst + n, dst_len - n, "  %s\n", ascii);
-      n += snprintf(dst + n, dst_len - n, "%04x ", i);
-    }
-    n += snprintf(dst + n, dst_len - n, " %02x", p[i]);
-    ascii[idx] = p[i] < 0x20 || p[i] > 0x7e ? '.' : p[i];
-    ascii[idx + 1] = '\0';
+/* Populate either `rep` or `er` from a parsed reply message */
+static void ns_rpc_fill_reply(struct json_token *toks, struct ns_rpc_reply *rep,
+                              struct ns_rpc_error *er) {
+  if ((rep->result = find_json_token(toks, "result")) != NULL) {
+    rep->message = toks;
+    rep->id = find_json_token(toks, "id");
+  } else {
+    er->message = toks;
+    er->id = find_json_token(toks, "id");
+    er->error_code = find_json_token(toks, "error.code");
+    er->error_message = find_json_token(toks, "error.message");
+    er->error_data = find_json_token(toks, "error.data");
   }
+}
 
-  while (i++ % 16) n += snprintf(dst + n, dst_len - n, "%s", "   ");
-  n += snprintf(dst + n, dst_len - n, "  %s\n\n", ascii);
+int ns_rpc_parse_reply(const char *buf, int len, struct json_token *toks,
+                       int max_toks, struct ns_rpc_reply *rep,
+                       struct ns_rpc_error *er) {
+  int n = parse_json(buf, len, toks, max_toks);
+
+  memset(rep, 0, sizeof(*rep));
+  memset(er, 0, sizeof(*er));
 
+  if (n > 0) {
+    ns_rpc_fill_reply(toks, rep, er);
+  }
   return n;
 }
 
-int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap) {
-  va_list ap_copy;
-  int len;
+/* Outstanding call made with ns_rpc_call() */
+struct ns_rpc_pending {
+  unsigned long id;
+  time_t expire;
+  ns_rpc_reply_cb_t cb;
+  void *cb_data;
+  struct ns_rpc_pending *next_in_bucket;
+  struct ns_rpc_pending *prev, *next; /* In the order of expiry */
+};
 
-  va_copy(ap_copy, ap);
-  len = vsnprintf(*buf, size, fmt, ap_copy);
-  va_end(ap_copy);
+/* Request whose reply is sent later, see ns_rpc_defer() */
+struct ns_rpc_deferred {
+  struct ns_rpc_channel *ch; /* NULL once the channel is closed */
+  struct ns_rpc_deferred *prev, *next;
+  int id_len;
+  char id[1]; /* Raw JSON text of the request ID, allocated with the struct */
+};
 
-  if (len < 0) {
-    /* eCos and Windows are not standard-compliant and return -1 when
-     * the buffer is too small. Keep allocating larger buffers until we
-     * succeed or out of memory. */
-    *buf = NULL; /* LCOV_EXCL_START */
-    while (len < 0) {
-      NS_FREE(*buf);
-      size *= 2;
-      if ((*buf = (char *) NS_MALLOC(size)) == NULL) break;
-      va_copy(ap_copy, ap);
-      len = vsnprintf(*buf, size, fmt, ap_copy);
-      va_end(ap_copy);
-    }
-    /* LCOV_EXCL_STOP */
-  } else if (len > (int) size) {
-    /* Standard-compliant code path. Allocate a buffer that is large enough. */
-    if ((*buf = (char *) NS_MALLOC(len + 1)) == NULL) {
-      len = -1; /* LCOV_EXCL_LINE */
-    } else {    /* LCOV_EXCL_LINE */
-      va_copy(ap_copy, ap);
-      len = vsnprintf(*buf, len + 1, fmt, ap_copy);
-      va_end(ap_copy);
-    }
+void ns_rpc_channel_init(struct ns_rpc_channel *ch, struct ns_connection *nc,
+                         struct ns_rpc_methods *methods, int flags) {
+  memset(ch, 0, sizeof(*ch));
+  ch->nc = nc;
+  ch->methods = methods;
+  ch->flags = flags;
+  ch->timeout = NS_RPC_DEFAULT_TIMEOUT;
+  ch->next_id = 1;
+}
+
+static void ns_rpc_channel_send(struct ns_rpc_channel *ch, const char *buf,
+                                size_t len) {
+  if (ch->nc == NULL) return;
+#if !defined(NS_DISABLE_HTTP) && !defined(NS_DISABLE_HTTP_WEBSOCKET)
+  if (!(ch->flags & NS_RPC_CHANNEL_TCP)) {
+    ns_send_websocket_frame(ch->nc, WEBSOCKET_OP_TEXT, buf, len);
+    return;
   }
+#endif
+  ns_send(ch->nc, buf, len);
+  ns_send(ch->nc, "\n", 1);
+}
 
-  return len;
+static struct ns_rpc_pending **ns_rpc_bucket(struct ns_rpc_channel *ch,
+                                             unsigned long id) {
+  return &ch->buckets[id & (NS_RPC_CHANNEL_BUCKETS - 1)];
 }
 
-#ifndef NS_DISABLE_FILESYSTEM
-void ns_hexdump_connection(struct ns_connection *nc, const char *path,
-                           int num_bytes, int ev) {
-  const struct mbuf *io = ev == NS_SEND ? &nc->send_mbuf : &nc->recv_mbuf;
-  FILE *fp;
-  char *buf, src[60], dst[60];
-  int buf_size = num_bytes * 5 + 100;
+/* Unlink a pending call from both the hash table and the call list */
+static void ns_rpc_unlink_pending(struct ns_rpc_channel *ch,
+                                  struct ns_rpc_pending *pc) {
+  struct ns_rpc_pending **pp = ns_rpc_bucket(ch, pc->id);
 
-  if ((fp = fopen(path, "a")) != NULL) {
-    ns_sock_to_str(nc->sock, src, sizeof(src), 3);
-    ns_sock_to_str(nc->sock, dst, sizeof(dst), 7);
-    fprintf(fp, "%lu %p %s %s %s %d\n", (unsigned long) time(NULL), nc, src,
-            ev == NS_RECV ? "<-" : ev == NS_SEND ? "->" : ev == NS_ACCEPT
-                                                              ? "<A"
-                                                              : ev == NS_CONNECT
-                                                                    ? "C>"
-                                                                    : "XX",
-            dst, num_bytes);
-    if (num_bytes > 0 && (buf = (char *) NS_MALLOC(buf_size)) != NULL) {
-      ns_hexdump(io->buf + (ev == NS_SEND ? 0 : io->len) -
-                     (ev == NS_SEND ? 0 : num_bytes),
-                 num_bytes, buf, buf_size);
-      fprintf(fp, "%s", buf);
-      NS_FREE(buf);
-    }
-    fclose(fp);
+  while (*pp != pc) pp = &(*pp)->next_in_bucket;
+  *pp = pc->next_in_bucket;
+
+  if (pc->prev != NULL) {
+    pc->prev->next = pc->next;
+  } else {
+    ch->oldest = pc->next;
   }
+  if (pc->next != NULL) {
+    pc->next->prev = pc->prev;
+  } else {
+    ch->newest = pc->prev;
+  }
+  ch->num_pending--;
 }
-#endif
 
-int ns_is_big_endian(void) {
-  static const int n = 1;
-  /* TODO(mkm) use compiletime check with 4-byte char literal */
-  return ((char *) &n)[0] == 0;
-}
+unsigned long ns_rpc_call(struct ns_rpc_channel *ch, const char *method,
+                          ns_rpc_reply_cb_t cb, void *cb_data,
+                          const char *params_fmt, ...) {
+  struct ns_rpc_pending *pc = NULL, *prev, **bucket;
+  struct mbuf msg;
+  unsigned long id;
+  va_list ap;
 
-const char *ns_next_comma_list_entry(const char *list, struct ns_str *val,
-                                     struct ns_str *eq_val) {
-  if (list == NULL || *list == '\0') {
-    /* End of the list */
-    list = NULL;
-  } else {
-    val->p = list;
-    if ((list = strchr(val->p, ',')) != NULL) {
-      /* Comma found. Store length and shift the list ptr */
-      val->len = list - val->p;
-      list++;
+  if (ch->nc == NULL) return 0;
+  if (cb != NULL &&
+      (pc = (struct ns_rpc_pending *) NS_CALLOC(1, sizeof(*pc))) == NULL) {
+    return 0;
+  }
+  id = ch->next_id++;
+  if (ch->next_id == 0) ch->next_id = 1;
+
+  mbuf_init(&msg, 0);
+  ns_rpc_emit(&msg, "{s:s,", "jsonrpc", "2.0");
+  if (cb != NULL) {
+    /* Calls without a callback are sent as notifications */
+    ns_rpc_emit(&msg, "s:i,", "id", (long) id);
+  }
+  ns_rpc_emit(&msg, "s:s,s:", "method", method, "params");
+  va_start(ap, params_fmt);
+  ns_rpc_emit_va(&msg, params_fmt, ap);
+  va_end(ap);
+  mbuf_append(&msg, "}", 1);
+  ns_rpc_channel_send(ch, msg.buf, msg.len);
+  mbuf_free(&msg);
+
+  if (pc != NULL) {
+    pc->id = id;
+    pc->expire = time(NULL) + ch->timeout;
+    pc->cb = cb;
+    pc->cb_data = cb_data;
+    bucket = ns_rpc_bucket(ch, id);
+    pc->next_in_bucket = *bucket;
+    *bucket = pc;
+    /* Usually last, unless the timeout was lowered since earlier calls */
+    prev = ch->newest;
+    while (prev != NULL && prev->expire > pc->expire) prev = prev->prev;
+    pc->prev = prev;
+    pc->next = prev != NULL ? prev->next : ch->oldest;
+    if (pc->next != NULL) {
+      pc->next->prev = pc;
     } else {
-      /* This value is the last one */
-      list = val->p + strlen(val->p);
-      val->len = list - val->p;
+      ch->newest = pc;
     }
-
-    if (eq_val != NULL) {
-      /* Value has form "x=y", adjust pointers and lengths */
-      /* so that val points to "x", and eq_val points to "y". */
-      eq_val->len = 0;
-      eq_val->p = (const char *) memchr(val->p, '=', val->len);
-      if (eq_val->p != NULL) {
-        eq_val->p++; /* Skip over '=' character */
-        eq_val->len = val->p + val->len - eq_val->p;
-        val->len = (eq_val->p - val->p) - 1;
-      }
+    if (prev != NULL) {
+      prev->next = pc;
+    } else {
+      ch->oldest = pc;
     }
+    ch->num_pending++;
   }
 
-  return list;
+  return id;
 }
 
-int ns_match_prefix(const char *pattern, int pattern_len, const char *str) {
-  const char *or_str;
-  int len, res, i = 0, j = 0;
+/* Match a reply to its pending call and invoke the callback */
+static void ns_rpc_handle_reply(struct ns_rpc_channel *ch,
+                                struct json_token *toks) {
+  struct ns_rpc_reply rep;
+  struct ns_rpc_error er;
+  struct json_token *id_tok = find_json_token(toks, "id");
+  struct ns_rpc_pending *pc;
+  unsigned long id = 0;
+  int i;
 
-  if ((or_str = (const char *) memchr(pattern, '|', pattern_len)) != NULL) {
-    res = ns_match_prefix(pattern, or_str - pattern, str);
-    return res > 0 ? res : ns_match_prefix(
-                               or_str + 1,
-                               (pattern + pattern_len) - (or_str + 1), str);
+  if (id_tok == NULL || id_tok->type != JSON_TYPE_NUMBER) return;
+  for (i = 0; i < id_tok->len; i++) {
+    if (!isdigit(*(unsigned char *) &id_tok->ptr[i])) return;
+    id = id * 10 + (id_tok->ptr[i] - '0');
   }
 
-  for (; i < pattern_len; i++, j++) {
-    if (pattern[i] == '?' && str[j] != '\0') {
-      continue;
-    } else if (pattern[i] == '$') {
-      return str[j] == '\0' ? j : -1;
-    } else if (pattern[i] == '*') {
-      i++;
-      if (pattern[i] == '*') {
-        i++;
-        len = (int) strlen(str + j);
-      } else {
-        len = (int) strcspn(str + j, "/");
-      }
-      if (i == pattern_len) {
-        return j + len;
-      }
-      do {
-        res = ns_match_prefix(pattern + i, pattern_len - i, str + j + len);
-      } while (res == -1 && len-- > 0);
-      return res == -1 ? -1 : j + res + len;
-    } else if (lowercase(&pattern[i]) != lowercase(&str[j])) {
-      return -1;
-    }
+  for (pc = *ns_rpc_bucket(ch, id); pc != NULL; pc = pc->next_in_bucket) {
+    if (pc->id == id) break;
   }
-  return j;
-}
-#ifdef NS_MODULE_LINES
-#line 1 "src/json-rpc.c"
-/**/
-#endif
-/* Copyright (c) 2014 Cesanta Software Limited */
-/* All rights reserved */
-
-#ifndef NS_DISABLE_JSON_RPC
+  if (pc == NULL) return; /* Late reply to a call that has timed out */
 
-/* Amalgamated: #include "internal.h" */
+  memset(&rep, 0, sizeof(rep));
+  memset(&er, 0, sizeof(er));
+  ns_rpc_fill_reply(toks, &rep, &er);
+  ns_rpc_unlink_pending(ch, pc);
+  pc->cb(ch, pc->cb_data, rep.result != NULL ? &rep : NULL,
+         rep.result != NULL ? NULL : &er);
+  NS_FREE(pc);
+}
 
-int ns_rpc_create_reply(char *buf, int len, const struct ns_rpc_request *req,
-                        const char *result_fmt, ...) {
-  static const struct json_token null_tok = {"null", 4, 0, JSON_TYPE_NULL};
-  const struct json_token *id = req->id == NULL ? &null_tok : req->id;
-  va_list ap;
-  int n = 0;
+/* Fail calls that have been waiting for longer than the channel timeout */
+static void ns_rpc_expire_calls(struct ns_rpc_channel *ch, time_t now) {
+  struct ns_rpc_pending *pc;
 
-  n += json_emit(buf + n, len - n, "{s:s,s:", "jsonrpc", "2.0", "id");
-  if (id->type == JSON_TYPE_STRING) {
-    n += json_emit_quoted_str(buf + n, len - n, id->ptr, id->len);
-  } else {
-    n += json_emit_unquoted_str(buf + n, len - n, id->ptr, id->len);
+  while ((pc = ch->oldest) != NULL && (now == 0 || now > pc->expire)) {
+    ns_rpc_unlink_pending(ch, pc);
+    pc->cb(ch, pc->cb_data, NULL, NULL);
+    NS_FREE(pc);
   }
-  n += json_emit(buf + n, len - n, ",s:", "result");
-
-  va_start(ap, result_fmt);
-  n += json_emit_va(buf + n, len - n, result_fmt, ap);
-  va_end(ap);
-
-  n += json_emit(buf + n, len - n, "}");
-
-  return n;
 }
 
-int ns_rpc_create_request(char *buf, int len, const char *method,
-                          const char *id, const char *params_fmt, ...) {
-  va_list ap;
-  int n = 0;
+/* Handle one message: a request, a batch of requests, or a reply */
+static void ns_rpc_channel_message(struct ns_rpc_channel *ch, const char *buf,
+                                   int len) {
+  struct json_token *toks;
+  const char *p = ns_rpc_skip_space(buf, buf + len);
+  struct mbuf out;
 
-  n += json_emit(buf + n, len - n, "{s:s,s:s,s:s,s:", "jsonrpc", "2.0", "id",
-                 id, "method", method, "params");
-  va_start(ap, params_fmt);
-  n += json_emit_va(buf + n, len - n, params_fmt, ap);
-  va_end(ap);
+  if (p == buf + len) return;
+  mbuf_init(&out, 0);
 
-  n += json_emit(buf + n, len - n, "}");
+  if (*p == '{' && (toks = parse_json2(buf, len)) != NULL) {
+    /* Parsed once, then routed by its members */
+    if (find_json_token(toks, "method") == NULL &&
+        (find_json_token(toks, "result") != NULL ||
+         find_json_token(toks, "error") != NULL)) {
+      ns_rpc_handle_reply(ch, toks);
+    } else {
+      ns_rpc_dispatch_tokens(ch->methods, ch, toks, &out);
+    }
+    free(toks);
+  } else {
+    ns_rpc_dispatch_batch(ch->methods, ch, buf, len, &out);
+  }
 
-  return n;
+  if (out.len > 0) {
+    ns_rpc_channel_send(ch, out.buf, out.len);
+  }
+  mbuf_free(&out);
 }
 
-int ns_rpc_create_error(char *buf, int len, struct ns_rpc_request *req,
-                        int code, const char *message, const char *fmt, ...) {
-  va_list ap;
-  int n = 0;
+/* Split newline-delimited messages, keep a trailing partial one */
+static void ns_rpc_channel_recv(struct ns_rpc_channel *ch, struct mbuf *io) {
+  size_t i, start = 0;
 
-  n += json_emit(buf + n, len - n, "{s:s,s:V,s:{s:i,s:s,s:", "jsonrpc", "2.0",
-                 "id", req->id == NULL ? "null" : req->id->ptr,
-                 req->id == NULL ? 4 : req->id->len, "error", "code", code,
-                 "message", message, "data");
-  va_start(ap, fmt);
-  n += json_emit_va(buf + n, len - n, fmt, ap);
-  va_end(ap);
+  for (i = 0; i < io->len; i++) {
+    if (io->buf[i] == '\n') {
+      ns_rpc_channel_message(ch, io->buf + start, i - start);
+      start = i + 1;
+    }
+  }
+  mbuf_remove(io, start);
+}
 
-  n += json_emit(buf + n, len - n, "}}");
+static void ns_rpc_channel_close(struct ns_rpc_channel *ch) {
+  struct ns_rpc_deferred *d;
 
-  return n;
+  ns_rpc_expire_calls(ch, 0);
+  for (d = ch->deferred; d != NULL; d = d->next) {
+    d->ch = NULL;
+  }
+  ch->deferred = NULL;
+  ch->nc = NULL;
 }
 
-int ns_rpc_create_std_error(char *buf, int len, struct ns_rpc_request *req,
-                            int code) {
-  const char *message = NULL;
+void ns_rpc_channel_handler(struct ns_rpc_channel *ch, int ev, void *ev_data) {
+  if (ch->nc == NULL) return;
 
-  switch (code) {
-    case JSON_RPC_PARSE_ERROR:
-      message = "parse error";
-      break;
-    case JSON_RPC_INVALID_REQUEST_ERROR:
-      message = "invalid request";
-      break;
-    case JSON_RPC_METHOD_NOT_FOUND_ERROR:
-      message = "method not found";
-      break;
-    case JSON_RPC_INVALID_PARAMS_ERROR:
-      message = "invalid parameters";
+  switch (ev) {
+#if !defined(NS_DISABLE_HTTP) && !defined(NS_DISABLE_HTTP_WEBSOCKET)
+    case NS_WEBSOCKET_FRAME:
+      if (!(ch->flags & NS_RPC_CHANNEL_TCP)) {
+        struct websocket_message *wm = (struct websocket_message *) ev_data;
+        ns_rpc_channel_message(ch, (const char *) wm->data, wm->size);
+      }
       break;
-    case JSON_RPC_SERVER_ERROR:
-      message = "server error";
+#endif
+    case NS_RECV:
+      if (ch->flags & NS_RPC_CHANNEL_TCP) {
+        ns_rpc_channel_recv(ch, &ch->nc->recv_mbuf);
+      }
       break;
+    case NS_CLOSE:
+      ns_rpc_channel_close(ch);
+      return;
     default:
-      message = "unspecified error";
       break;
   }
 
-  return ns_rpc_create_error(buf, len, req, code, message, "N");
+  /* NS_POLL is skipped for busy connections, so check on every event */
+  if (ch->oldest != NULL) {
+    ns_rpc_expire_calls(ch, time(NULL));
+  }
+}
+
+struct ns_rpc_deferred *ns_rpc_defer(struct ns_rpc_request *req) {
+  struct ns_rpc_channel *ch = req->channel;
+  const struct json_token *id = req->id;
+  struct ns_rpc_deferred *d;
+  const char *p;
+  int len;
+
+  if (ch == NULL || id == NULL) return NULL;
+  /* Keep string IDs quoted, they are echoed verbatim */
+  p = id->type == JSON_TYPE_STRING ? id->ptr - 1 : id->ptr;
+  len = id->type == JSON_TYPE_STRING ? id->len + 2 : id->len;
+  if ((d = (struct ns_rpc_deferred *) NS_MALLOC(sizeof(*d) + len)) == NULL) {
+    return NULL;
+  }
+  memcpy(d->id, p, len);
+  d->id_len = len;
+  d->ch = ch;
+  d->prev = NULL;
+  d->next = ch->deferred;
+  if (ch->deferred != NULL) ch->deferred->prev = d;
+  ch->deferred = d;
+
+  return d;
 }
 
-int ns_rpc_dispatch(const char *buf, int len, char *dst, int dst_len,
-                    const char **methods, ns_rpc_handler_t *handlers) {
-  struct json_token tokens[200];
-  struct ns_rpc_request req;
-  int i, n;
+/* Send the reply accumulated in `out`, release the handle */
+static int ns_rpc_deferred_done(struct ns_rpc_deferred *d, struct mbuf *out) {
+  struct ns_rpc_channel *ch = d->ch;
+  int sent = ch != NULL;
 
-  memset(&req, 0, sizeof(req));
-  n = parse_json(buf, len, tokens, sizeof(tokens) / sizeof(tokens[0]));
-  if (n <= 0) {
-    int err_code = (n == JSON_STRING_INVALID) ? JSON_RPC_PARSE_ERROR
-                                              : JSON_RPC_SERVER_ERROR;
-    return ns_rpc_create_std_error(dst, dst_len, &req, err_code);
+  if (ch != NULL) {
+    ns_rpc_channel_send(ch, out->buf, out->len);
+    if (d->prev != NULL) {
+      d->prev->next = d->next;
+    } else {
+      ch->deferred = d->next;
+    }
+    if (d->next != NULL) d->next->prev = d->prev;
   }
+  mbuf_free(out);
+  NS_FREE(d);
 
-  req.message = tokens;
-  req.id = find_json_token(tokens, "id");
-  req.method = find_json_token(tokens, "method");
-  req.params = find_json_token(tokens, "params");
+  return sent ? 0 : -1;
+}
 
-  if (req.id == NULL || req.method == NULL) {
-    return ns_rpc_create_std_error(dst, dst_len, &req,
-                                   JSON_RPC_INVALID_REQUEST_ERROR);
-  }
+/* Request carrying only the saved ID, for the ns_rpc_append_*() functions */
+static void ns_rpc_deferred_request(struct ns_rpc_deferred *d,
+                                    struct ns_rpc_request *req,
+                                    struct json_token *id) {
+  memset(req, 0, sizeof(*req));
+  memset(id, 0, sizeof(*id));
+  id->ptr = d->id;
+  id->len = d->id_len;
+  id->type = JSON_TYPE_NUMBER;
+  req->id = id;
+}
 
-  for (i = 0; methods[i] != NULL; i++) {
-    int mlen = strlen(methods[i]);
-    if (mlen == req.method->len &&
-        memcmp(methods[i], req.method->ptr, mlen) == 0)
-      break;
-  }
+int ns_rpc_deferred_reply(struct ns_rpc_deferred *d, const char *result_fmt,
+                          ...) {
+  struct ns_rpc_request req;
+  struct json_token id;
+  struct mbuf out;
+  va_list ap;
 
-  if (methods[i] == NULL) {
-    return ns_rpc_create_std_error(dst, dst_len, &req,
-                                   JSON_RPC_METHOD_NOT_FOUND_ERROR);
-  }
+  ns_rpc_deferred_request(d, &req, &id);
+  mbuf_init(&out, 0);
+  va_start(ap, result_fmt);
+  ns_rpc_append_reply_va(&out, &req, result_fmt, ap);
+  va_end(ap);
 
-  return handlers[i](dst, dst_len, &req);
+  return ns_rpc_deferred_done(d, &out);
 }
 
-int ns_rpc_parse_reply(const char *buf, int len, struct json_token *toks,
-                       int max_toks, struct ns_rpc_reply *rep,
-                       struct ns_rpc_error *er) {
-  int n = parse_json(buf, len, toks, max_toks);
+int ns_rpc_deferred_error(struct ns_rpc_deferred *d, int code,
+                          const char *message) {
+  struct ns_rpc_request req;
+  struct json_token id;
+  struct mbuf out;
 
-  memset(rep, 0, sizeof(*rep));
-  memset(er, 0, sizeof(*er));
+  ns_rpc_deferred_request(d, &req, &id);
+  mbuf_init(&out, 0);
+  ns_rpc_append_error(&out, &req, code,
+                      message != NULL ? message
+                                      : ns_rpc_std_error_message(code),
+                      "N");
 
-  if (n > 0) {
-    if ((rep->result = find_json_token(toks, "result")) != NULL) {
-      rep->message = toks;
-      rep->id = find_json_token(toks, "id");
-    } else {
-      er->message = toks;
-      er->id = find_json_token(toks, "id");
-      er->error_code = find_json_token(toks, "error.code");
-      er->error_message = find_json_token(toks, "error.message");
-      er->error_data = find_json_token(toks, "error.data");
-    }
-  }
-  return n;
+  return ns_rpc_deferred_done(d, &out);
 }
 
 #endif /* NS_DISABLE_JSON_RPC */
@@ -6216,7 +10495,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
   int cmd;
   size_t len = 0;
   int var_len = 0;
-  char *vlen = &io->buf[1];
+  char *vlen = &io->buf[1], *p;
 
   if (io->len < 2) return -1;
 
@@ -6228,9 +10507,10 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
     len += (*vlen & 127) << 7 * (vlen - &io->buf[1]);
   } while ((*vlen++ & 128) != 0 && ((size_t)(vlen - io->buf) <= io->len));
 
-  if (io->len < (size_t)(len - 1)) return -1;
+  if (io->len < (size_t)(vlen - io->buf) + len) return -1;
 
-  mbuf_remove(io, 1 + (vlen - &io->buf[1]));
+  /* The message stays buffered until the handler is done with it */
+  p = vlen;
   mm->cmd = cmd;
   mm->qos = NS_MQTT_GET_QOS(header);
 
@@ -6239,7 +10519,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
       /* TODO(mkm): parse keepalive and will */
       break;
     case NS_MQTT_CMD_CONNACK:
-      mm->connack_ret_code = io->buf[1];
+      mm->connack_ret_code = p[1];
       var_len = 2;
       break;
     case NS_MQTT_CMD_PUBACK:
@@ -6247,18 +10527,18 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
     case NS_MQTT_CMD_PUBREL:
     case NS_MQTT_CMD_PUBCOMP:
     case NS_MQTT_CMD_SUBACK:
-      mm->message_id = ntohs(*(uint16_t *) io->buf);
+      mm->message_id = ntohs(*(uint16_t *) p);
       var_len = 2;
       break;
     case NS_MQTT_CMD_PUBLISH: {
-      uint16_t topic_len = ntohs(*(uint16_t *) io->buf);
+      uint16_t topic_len = ntohs(*(uint16_t *) p);
       mm->topic = (char *) NS_MALLOC(topic_len + 1);
       mm->topic[topic_len] = 0;
-      strncpy(mm->topic, io->buf + 2, topic_len);
+      strncpy(mm->topic, p + 2, topic_len);
       var_len = topic_len + 2;
 
       if (NS_MQTT_GET_QOS(header) > 0) {
-        mm->message_id = ntohs(*(uint16_t *) io->buf);
+        mm->message_id = ntohs(*(uint16_t *) p);
         var_len += 2;
       }
     } break;
@@ -6267,7 +10547,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
        * topic expressions are left in the payload and can be parsed with
        * `ns_mqtt_next_subscribe_topic`
        */
-      mm->message_id = ntohs(*(uint16_t *) io->buf);
+      mm->message_id = ntohs(*(uint16_t *) p);
       var_len = 2;
       break;
     default:
@@ -6275,31 +10555,57 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
       break;
   }
 
-  mbuf_remove(io, var_len);
+  mm->payload.p = p + var_len;
   return len - var_len;
 }
 
 static void mqtt_handler(struct ns_connection *nc, int ev, void *ev_data) {
   int len;
+  size_t msg_len;
   struct mbuf *io = &nc->recv_mbuf;
   struct ns_mqtt_message mm;
   memset(&mm, 0, sizeof(mm));
 
   nc->handler(nc, ev, ev_data);
 
+  if (ev == NS_POLL && (nc->flags & NSF_RATE_LIMITED) &&
+      nc->recv_resume_time == 0) {
+    /* Retry the PUBLISH delayed by the rate limit */
+    nc->flags &= ~NSF_RATE_LIMITED;
+    ev = NS_RECV;
+  }
+
   switch (ev) {
     case NS_RECV:
       len = parse_mqtt(io, &mm);
       if (len == -1) break; /* not fully buffered */
-      mm.payload.p = io->buf;
       mm.payload.len = len;
+      msg_len = mm.payload.p + len - io->buf;
+
+      if (mm.cmd == NS_MQTT_CMD_PUBLISH) {
+        double retry_after;
+        switch (ns_rate_limit_message(nc, &mm, &retry_after)) {
+          case 0:
+            break;
+          case NS_RATE_LIMIT_REJECT:
+            /* MQTT has no way to refuse a PUBLISH, drop it */
+            mm.cmd = 0;
+            break;
+          default:
+            /* Closing, or delayed: the message stays buffered */
+            if (mm.topic) NS_FREE(mm.topic);
+            return;
+        }
+      }
 
-      nc->handler(nc, NS_MQTT_EVENT_BASE + mm.cmd, &mm);
+      if (mm.cmd != 0) {
+        nc->handler(nc, NS_MQTT_EVENT_BASE + mm.cmd, &mm);
+      }
 
       if (mm.topic) {
         NS_FREE(mm.topic);
       }
-      mbuf_remove(io, mm.payload.len);
+      mbuf_remove(io, msg_len);
       break;
   }
 }
@@ -6711,15 +11017,128 @@ struct ns_dns_resource_record *ns_dns_next_record(
   return NULL;
 }
 
-int ns_dns_parse_record_data(struct ns_dns_message *msg,
-                             struct ns_dns_resource_record *rr, void *data,
-                             size_t data_len) {
+/*
+ * Follow at most that many compression pointers while walking a name,
+ * so that malicious pointer loops can't hang the parser.
+ */
+#define NS_DNS_MAX_NAME_POINTERS 16
+
+static size_t ns_dns_uncompress(const struct ns_str *pkt,
+                                const struct ns_str *name, char *dst,
+                                int dst_len) {
+  int chunk_len, pointers = 0;
+  char *old_dst = dst;
+  const unsigned char *data = (unsigned char *) name->p;
+  const unsigned char *end = (unsigned char *) pkt->p + pkt->len;
+
+  if (data >= end) {
+    return 0;
+  }
+
+  while ((chunk_len = *data++)) {
+    int leeway = dst_len - (dst - old_dst);
+    if (data >= end) {
+      return 0;
+    }
+
+    if (chunk_len & 0xc0) {
+      uint16_t off = (data[-1] & (~0xc0)) << 8 | data[0];
+      if (off >= pkt->len || ++pointers > NS_DNS_MAX_NAME_POINTERS) {
+        return 0;
+      }
+      data = (unsigned char *) pkt->p + off;
+      continue;
+    }
+    if (chunk_len > leeway) {
+      chunk_len = leeway;
+    }
+
+    if (data + chunk_len >= end) {
+      return 0;
+    }
+
+    memcpy(dst, data, chunk_len);
+    data += chunk_len;
+    dst += chunk_len;
+    leeway -= chunk_len;
+    if (leeway == 0) {
+      return dst - old_dst;
+    }
+    *dst++ = '.';
+  }
+
+  if (dst != old_dst) {
+    *--dst = 0;
+  }
+  return dst - old_dst;
+}
+
+static int ns_dns_name_ncmp(const struct ns_str *pkt, const struct ns_str *name,
+                            const char *want, size_t want_len) {
+  const unsigned char *start = (const unsigned char *) pkt->p;
+  const unsigned char *end = start + pkt->len;
+  const unsigned char *data = (const unsigned char *) name->p;
+  const char *want_end = want + want_len;
+  int chunk_len, i, pointers = 0, first = 1;
+
+  for (;;) {
+    if (data < start || data >= end) {
+      return -1;
+    }
+    if ((chunk_len = *data++) == 0) {
+      break;
+    }
+
+    if (chunk_len & 0xc0) {
+      if (data >= end || ++pointers > NS_DNS_MAX_NAME_POINTERS) {
+        return -1;
+      }
+      data = start + ((chunk_len & ~0xc0) << 8 | data[0]);
+      continue;
+    }
+
+    if (end - data < chunk_len) {
+      return -1;
+    }
+    if (!first && (want == want_end || *want++ != '.')) {
+      return 1;
+    }
+    if (want_end - want < chunk_len) {
+      return 1;
+    }
+    for (i = 0; i < chunk_len; i++) {
+      if (tolower((unsigned char) want[i]) != tolower(data[i])) {
+        return 1;
+      }
+    }
+    want += chunk_len;
+    data += chunk_len;
+    first = 0;
+  }
+
+  /* Fully qualified names can have a trailing dot */
+  if (want_end - want == 1 && *want == '.' && !first) want++;
+  return want == want_end ? 0 : 1;
+}
+
+int ns_dns_name_cmp(const struct ns_str *pkt, const struct ns_str *name,
+                    const char *want) {
+  return ns_dns_name_ncmp(pkt, name, want, strlen(want));
+}
+
+static int ns_dns_parse_rdata(const struct ns_str *pkt,
+                              struct ns_dns_resource_record *rr, void *data,
+                              size_t data_len) {
+  if (rr->kind != NS_DNS_ANSWER) {
+    return -1;
+  }
+
   switch (rr->rtype) {
     case NS_DNS_A_RECORD:
       if (data_len < sizeof(struct in_addr)) {
         return -1;
       }
-      if (rr->rdata.p + data_len > msg->pkt.p + msg->pkt.len) {
+      if (rr->rdata.p + data_len > pkt->p + pkt->len) {
         return -1;
       }
       memcpy(data, rr->rdata.p, data_len);
@@ -6729,67 +11148,190 @@ int ns_dns_parse_record_data(struct ns_dns_message *msg,
       if (data_len < sizeof(struct in6_addr)) {
         return -1; /* LCOV_EXCL_LINE */
       }
+      if (rr->rdata.p + data_len > pkt->p + pkt->len) {
+        return -1;
+      }
       memcpy(data, rr->rdata.p, data_len);
       return 0;
 #endif
     case NS_DNS_CNAME_RECORD:
-      ns_dns_uncompress_name(msg, &rr->rdata, (char *) data, data_len);
+    case NS_DNS_PTR_RECORD:
+      ns_dns_uncompress(pkt, &rr->rdata, (char *) data, data_len);
       return 0;
+    case NS_DNS_SRV_RECORD: {
+      struct ns_str target;
+      if (rr->rdata.len < 7 || data_len < 6) {
+        return -1;
+      }
+      memcpy(data, rr->rdata.p, 6);
+      target.p = rr->rdata.p + 6;
+      target.len = rr->rdata.len - 6;
+      ns_dns_uncompress(pkt, &target, (char *) data + 6, data_len - 6);
+      return 0;
+    }
   }
 
   return -1;
 }
 
+int ns_dns_parse_record_data(struct ns_dns_message *msg,
+                             struct ns_dns_resource_record *rr, void *data,
+                             size_t data_len) {
+  return ns_dns_parse_rdata(&msg->pkt, rr, data, data_len);
+}
+
+int ns_dns_iter_record_data(struct ns_dns_iterator *it,
+                            struct ns_dns_resource_record *rr, void *data,
+                            size_t data_len) {
+  return ns_dns_parse_rdata(&it->pkt, rr, data, data_len);
+}
+
+static void ns_dns_fill_header(struct ns_dns_header *header,
+                               struct ns_dns_message *msg) {
+  memset(header, 0, sizeof(*header));
+  header->transaction_id = msg->transaction_id;
+  header->flags = htons(msg->flags);
+  header->num_questions = htons(msg->num_questions);
+  header->num_answers = htons(msg->num_answers);
+}
+
 int ns_dns_insert_header(struct mbuf *io, size_t pos,
                          struct ns_dns_message *msg) {
   struct ns_dns_header header;
 
-  memset(&header, 0, sizeof(header));
-  header.transaction_id = msg->transaction_id;
-  header.flags = htons(msg->flags);
-  header.num_questions = htons(msg->num_questions);
-  header.num_answers = htons(msg->num_answers);
-
+  ns_dns_fill_header(&header, msg);
   return mbuf_insert(io, pos, &header, sizeof(header));
 }
 
+#ifdef NS_ENABLE_DNS_SERVER
+NS_INTERNAL void ns_dns_update_header(struct mbuf *io, size_t pos,
+                                      struct ns_dns_message *msg) {
+  struct ns_dns_header header;
+
+  ns_dns_fill_header(&header, msg);
+  memcpy(io->buf + pos, &header, sizeof(header));
+}
+#endif
+
 int ns_dns_copy_body(struct mbuf *io, struct ns_dns_message *msg) {
   return mbuf_append(io, msg->pkt.p + sizeof(struct ns_dns_header),
                      msg->pkt.len - sizeof(struct ns_dns_header));
 }
 
-static int ns_dns_encode_name(struct mbuf *io, const char *name, size_t len) {
-  const char *s;
-  unsigned char n;
-  size_t pos = io->len;
+void ns_dns_name_table_init(struct ns_dns_name_table *names, size_t start) {
+  names->start = start;
+  names->num_names = 0;
+}
 
-  do {
-    if ((s = strchr(name, '.')) == NULL) {
-      s = name + len;
+void ns_dns_name_table_add(struct ns_dns_name_table *names, size_t off) {
+  /* Pointers have only 14 bits for the offset */
+  if (names->num_names < (int) ARRAY_SIZE(names->offsets) && off < 0x4000) {
+    names->offsets[names->num_names++] = (uint16_t) off;
+  }
+}
+
+/*
+ * Find an already encoded name, or a suffix of one, equal to `name`, `len`.
+ * Return its offset from the message header, or -1 if not found.
+ */
+static int ns_dns_find_name(struct mbuf *io, struct ns_dns_name_table *names,
+                            const char *name, size_t len) {
+  struct ns_str pkt, n;
+  size_t off;
+  int i, chunk_len;
+
+  pkt.p = io->buf + names->start;
+  pkt.len = io->len - names->start;
+  for (i = 0; i < names->num_names; i++) {
+    /* Try each label boundary up to the end or a pointer */
+    for (off = names->offsets[i]; off < pkt.len; off += chunk_len + 1) {
+      chunk_len = (unsigned char) pkt.p[off];
+      if (chunk_len == 0 || (chunk_len & 0xc0) || off >= 0x4000) {
+        break;
+      }
+      n.p = pkt.p + off;
+      n.len = pkt.len - off;
+      if (ns_dns_name_ncmp(&pkt, &n, name, len) == 0) {
+        return (int) off;
+      }
+    }
+  }
+  return -1;
+}
+
+/*
+ * Encode a dotted name in a single pass, straight into the IO buffer.
+ *
+ * If `names` is not NULL, the longest suffix already present in the message
+ * is replaced with a pointer, and newly written suffixes are remembered.
+ */
+static int ns_dns_encode_name(struct mbuf *io, struct ns_dns_name_table *names,
+                              const char *name, size_t len) {
+  const char *end, *s;
+  size_t pos = io->len, max_len;
+  int off, n;
+  unsigned char *p;
+
+  /* Fully qualified names can have a trailing dot */
+  if (len > 0 && name[len - 1] == '.') {
+    len--;
+  }
+  end = name + len;
+
+  /* Every dot becomes a length byte, plus the first length and the root */
+  max_len = io->len + len + 2;
+  if (io->size < max_len) {
+    mbuf_resize(io, max_len);
+    if (io->size < max_len) {
+      return -1; /* LCOV_EXCL_LINE */
     }
+  }
+  p = (unsigned char *) io->buf + io->len;
 
-    if (s - name > 127) {
-      return -1; /* TODO(mkm) cover */
+  while (name < end) {
+    if (names != NULL &&
+        (off = ns_dns_find_name(io, names, name, end - name)) >= 0) {
+      *p++ = 0xc0 | off >> 8;
+      *p++ = off & 0xff;
+      break;
     }
-    n = s - name;           /* chunk length */
-    mbuf_append(io, &n, 1); /* send length */
-    mbuf_append(io, name, n);
 
-    if (*s == '.') {
-      n++;
+    if ((s = (const char *) memchr(name, '.', end - name)) == NULL) {
+      s = end;
+    }
+    n = s - name;
+    if (n == 0 || n > 63) {
+      /* Empty or too long label */
+      io->len = pos;
+      return -1;
     }
 
-    name += n;
-    len -= n;
-  } while (*s != '\0');
-  mbuf_append(io, "\0", 1); /* Mark end of host name */
+    *p++ = (unsigned char) n;
+    memcpy(p, name, n);
+    p += n;
+    /* Make the labels visible to ns_dns_find_name() */
+    io->len = (char *) p - io->buf;
+
+    name = s < end ? s + 1 : end;
+  }
+  if (name >= end) {
+    *p++ = '\0'; /* Mark end of host name */
+  }
+
+  /* Suffixes are found by walking labels, so only remember the start */
+  if (names != NULL && io->len > pos) {
+    ns_dns_name_table_add(names, pos - names->start);
+  }
+  io->len = (char *) p - io->buf;
 
   return io->len - pos;
 }
 
-int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
-                         const char *name, size_t nlen, const void *rdata,
-                         size_t rlen) {
+static int ns_dns_encode_record2(struct mbuf *io,
+                                 struct ns_dns_name_table *names,
+                                 struct ns_dns_resource_record *rr,
+                                 const char *name, size_t nlen,
+                                 const void *rdata, size_t rlen) {
   size_t pos = io->len;
   uint16_t u16;
   uint32_t u32;
@@ -6798,7 +11340,7 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
     return -1; /* LCOV_EXCL_LINE */
   }
 
-  if (ns_dns_encode_name(io, name, nlen) == -1) {
+  if (ns_dns_encode_name(io, names, name, nlen) == -1) {
     return -1;
   }
 
@@ -6811,15 +11353,24 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
     u32 = htonl(rr->ttl);
     mbuf_append(io, &u32, 4);
 
-    if (rr->rtype == NS_DNS_CNAME_RECORD) {
-      int clen;
+    if (rr->rtype == NS_DNS_CNAME_RECORD || rr->rtype == NS_DNS_PTR_RECORD ||
+        rr->rtype == NS_DNS_SRV_RECORD) {
       /* fill size after encoding */
       size_t off = io->len;
       mbuf_append(io, &u16, 2);
-      if ((clen = ns_dns_encode_name(io, (const char *) rdata, rlen)) == -1) {
+      if (rr->rtype == NS_DNS_SRV_RECORD) {
+        /* Priority, weight and port come before the target name */
+        if (rlen < 6) {
+          return -1;
+        }
+        mbuf_append(io, rdata, 6);
+        rdata = (const char *) rdata + 6;
+        rlen -= 6;
+      }
+      if (ns_dns_encode_name(io, names, (const char *) rdata, rlen) == -1) {
         return -1;
       }
-      u16 = clen;
+      u16 = io->len - off - 2;
       io->buf[off] = u16 >> 8;
       io->buf[off + 1] = u16 & 0xff;
     } else {
@@ -6832,6 +11383,20 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
   return io->len - pos;
 }
 
+int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
+                         const char *name, size_t nlen, const void *rdata,
+                         size_t rlen) {
+  return ns_dns_encode_record2(io, NULL, rr, name, nlen, rdata, rlen);
+}
+
+int ns_dns_encode_record_compressed(struct mbuf *io,
+                                    struct ns_dns_name_table *names,
+                                    struct ns_dns_resource_record *rr,
+                                    const char *name, size_t nlen,
+                                    const void *rdata, size_t rlen) {
+  return ns_dns_encode_record2(io, names, rr, name, nlen, rdata, rlen);
+}
+
 void ns_send_dns_query(struct ns_connection *nc, const char *name,
                        int query_type) {
   struct ns_dns_message *msg =
@@ -6871,130 +11436,123 @@ cleanup:
   NS_FREE(msg);
 }
 
-static unsigned char *ns_parse_dns_resource_record(
-    unsigned char *data, unsigned char *end, struct ns_dns_resource_record *rr,
-    int reply) {
-  unsigned char *name = data;
+int ns_dns_iter_init(struct ns_dns_iterator *it, const char *buf, int len) {
+  const struct ns_dns_header *header = (const struct ns_dns_header *) buf;
+
+  memset(it, 0, sizeof(*it));
+  if (len < (int) sizeof(*header)) {
+    return -1;
+  }
+
+  it->pkt.p = buf;
+  it->pkt.len = len;
+  it->transaction_id = header->transaction_id;
+  it->flags = ntohs(header->flags);
+  it->num_questions = ntohs(header->num_questions);
+  it->num_answers = ntohs(header->num_answers);
+  it->pos = buf + sizeof(*header);
+
+  return 0;
+}
+
+int ns_dns_iter_next(struct ns_dns_iterator *it,
+                     struct ns_dns_resource_record *rr) {
+  const unsigned char *data = (const unsigned char *) it->pos;
+  const unsigned char *end = (const unsigned char *) it->pkt.p + it->pkt.len;
+  int reply = it->index >= it->num_questions;
   int chunk_len, data_len;
 
+  if (it->index >= it->num_questions + it->num_answers) {
+    return 0;
+  }
+
+  memset(rr, 0, sizeof(*rr));
+  rr->name.p = (const char *) data;
+
+  /* Skip the name, which ends with a zero length label or a pointer */
   while (data < end && (chunk_len = *data)) {
-    if (((unsigned char *) data)[0] & 0xc0) {
-      data += 1;
+    if (chunk_len & 0xc0) {
+      data++;
       break;
     }
     data += chunk_len + 1;
   }
-
-  rr->name.p = (char *) name;
-  rr->name.len = data - name + 1;
-
+  if (data >= end) {
+    return -1;
+  }
   data++;
-  if (data > end - 4) {
-    return data;
+  rr->name.len = data - (const unsigned char *) rr->name.p;
+
+  if (end - data < (reply ? 10 : 4)) {
+    return -1;
   }
 
   rr->rtype = data[0] << 8 | data[1];
-  data += 2;
-
-  rr->rclass = data[0] << 8 | data[1];
-  data += 2;
+  rr->rclass = data[2] << 8 | data[3];
+  data += 4;
 
   rr->kind = reply ? NS_DNS_ANSWER : NS_DNS_QUESTION;
   if (reply) {
-    if (data >= end - 6) {
-      return data;
-    }
-
     rr->ttl = (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 |
               data[2] << 8 | data[3];
     data += 4;
 
-    data_len = *data << 8 | *(data + 1);
+    data_len = data[0] << 8 | data[1];
     data += 2;
+    if (end - data < data_len) {
+      return -1;
+    }
 
-    rr->rdata.p = (char *) data;
+    rr->rdata.p = (const char *) data;
     rr->rdata.len = data_len;
     data += data_len;
   }
-  return data;
+
+  it->pos = (const char *) data;
+  it->index++;
+  return 1;
 }
 
 int ns_parse_dns(const char *buf, int len, struct ns_dns_message *msg) {
-  struct ns_dns_header *header = (struct ns_dns_header *) buf;
-  unsigned char *data = (unsigned char *) buf + sizeof(*header);
-  unsigned char *end = (unsigned char *) buf + len;
-  int i;
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+
   msg->pkt.p = buf;
   msg->pkt.len = len;
-
-  if (len < (int) sizeof(*header)) {
-    return -1; /* LCOV_EXCL_LINE */
-  }
-
-  msg->transaction_id = header->transaction_id;
-  msg->flags = ntohs(header->flags);
-  msg->num_questions = ntohs(header->num_questions);
-  msg->num_answers = ntohs(header->num_answers);
-
-  for (i = 0; i < msg->num_questions && i < (int) ARRAY_SIZE(msg->questions);
-       i++) {
-    data = ns_parse_dns_resource_record(data, end, &msg->questions[i], 0);
-  }
-
-  for (i = 0; i < msg->num_answers && i < (int) ARRAY_SIZE(msg->answers); i++) {
-    data = ns_parse_dns_resource_record(data, end, &msg->answers[i], 1);
-  }
-
-  return 0;
-}
-
-size_t ns_dns_uncompress_name(struct ns_dns_message *msg, struct ns_str *name,
-                              char *dst, int dst_len) {
-  int chunk_len;
-  char *old_dst = dst;
-  const unsigned char *data = (unsigned char *) name->p;
-  const unsigned char *end = (unsigned char *) msg->pkt.p + msg->pkt.len;
-
-  if (data >= end) {
-    return 0;
+
+  if (ns_dns_iter_init(&it, buf, len) == -1) {
+    return -1; /* LCOV_EXCL_LINE */
   }
 
-  while ((chunk_len = *data++)) {
-    int leeway = dst_len - (dst - old_dst);
-    if (data >= end) {
-      return 0;
-    }
+  msg->transaction_id = it.transaction_id;
+  msg->flags = it.flags;
+  msg->num_questions = msg->num_answers = 0;
 
-    if (chunk_len & 0xc0) {
-      uint16_t off = (data[-1] & (~0xc0)) << 8 | data[0];
-      if (off >= msg->pkt.len) {
-        return 0;
+  /* Records that don't fit or can't be decoded are not counted */
+  while (ns_dns_iter_next(&it, &rr) > 0) {
+    if (rr.kind == NS_DNS_QUESTION) {
+      if (msg->num_questions < (int) ARRAY_SIZE(msg->questions)) {
+        msg->questions[msg->num_questions++] = rr;
       }
-      data = (unsigned char *) msg->pkt.p + off;
-      continue;
-    }
-    if (chunk_len > leeway) {
-      chunk_len = leeway;
+    } else if (msg->num_answers < (int) ARRAY_SIZE(msg->answers)) {
+      msg->answers[msg->num_answers++] = rr;
+    } else {
+      break;
     }
+  }
 
-    if (data + chunk_len >= end) {
-      return 0;
-    }
+  return 0;
+}
 
-    memcpy(dst, data, chunk_len);
-    data += chunk_len;
-    dst += chunk_len;
-    leeway -= chunk_len;
-    if (leeway == 0) {
-      return dst - old_dst;
-    }
-    *dst++ = '.';
-  }
+size_t ns_dns_uncompress_name(struct ns_dns_message *msg, struct ns_str *name,
+                              char *dst, int dst_len) {
+  return ns_dns_uncompress(&msg->pkt, name, dst, dst_len);
+}
 
-  if (dst != old_dst) {
-    *--dst = 0;
-  }
-  return dst - old_dst;
+size_t ns_dns_iter_uncompress_name(struct ns_dns_iterator *it,
+                                   struct ns_str *name, char *dst,
+                                   int dst_len) {
+  return ns_dns_uncompress(&it->pkt, name, dst, dst_len);
 }
 
 static void dns_handler(struct ns_connection *nc, int ev, void *ev_data) {
@@ -7049,21 +11607,33 @@ void ns_set_protocol_dns(struct ns_connection *nc) {
 struct ns_dns_reply ns_dns_create_reply(struct mbuf *io,
                                         struct ns_dns_message *msg) {
   struct ns_dns_reply rep;
+  int i;
   rep.msg = msg;
   rep.io = io;
   rep.start = io->len;
 
   /* reply + recursion allowed */
   msg->flags |= 0x8080;
+
+  /*
+   * Reserve room for the header, it's filled in by ns_dns_send_reply().
+   * Having it in place lets answers point to names in the question section.
+   */
+  ns_dns_insert_header(io, io->len, msg);
   ns_dns_copy_body(io, msg);
 
+  ns_dns_name_table_init(&rep.names, rep.start);
+  for (i = 0; i < msg->num_questions; i++) {
+    ns_dns_name_table_add(&rep.names, msg->questions[i].name.p - msg->pkt.p);
+  }
+
   msg->num_answers = 0;
   return rep;
 }
 
 int ns_dns_send_reply(struct ns_connection *nc, struct ns_dns_reply *r) {
   size_t sent = r->io->len - r->start;
-  ns_dns_insert_header(r->io, r->start, r->msg);
+  ns_dns_update_header(r->io, r->start, r->msg);
   if (!(nc->flags & NSF_UDP)) {
     uint16_t len = htons(sent);
     mbuf_insert(r->io, r->start, &len, 2);
@@ -7098,8 +11668,8 @@ int ns_dns_reply_record(struct ns_dns_reply *reply,
   ans->rtype = rtype;
   ans->ttl = ttl;
 
-  if (ns_dns_encode_record(reply->io, ans, name, strlen(name), rdata,
-                           rdata_len) == -1) {
+  if (ns_dns_encode_record_compressed(reply->io, &reply->names, ans, name,
+                                      strlen(name), rdata, rdata_len) == -1) {
     return -1; /* LCOV_EXCL_LINE */
   };
 
@@ -7107,6 +11677,568 @@ int ns_dns_reply_record(struct ns_dns_reply *reply,
   return 0;
 }
 
+#define NS_MDNS_GROUP 0xe00000fb /* 224.0.0.251 */
+#define NS_MDNS_NUM_PROBES 3
+#define NS_MDNS_NUM_ANNOUNCEMENTS 2
+#define NS_MDNS_CACHE_FLUSH 0x8000 /* rclass bit of unique records */
+#define NS_MDNS_SERVICES "_services._dns-sd._udp.local"
+
+/* glibc hides struct ip_mreq with _XOPEN_SOURCE, its layout is standard */
+struct ns_mdns_mreq {
+  struct in_addr imr_multiaddr;
+  struct in_addr imr_interface;
+};
+
+enum ns_mdns_state { NS_MDNS_PROBING, NS_MDNS_ANNOUNCING, NS_MDNS_IDLE };
+
+/* One of our own records, generated on the fly from `struct ns_mdns` */
+struct ns_mdns_rr {
+  char name[NS_MDNS_MAX_NAME_LEN];
+  int rtype;
+  int unique; /* Nobody else can have records with this name and type */
+  int service; /* Index of the service, or -1 for the host record */
+  const char *rdata;
+  size_t rdata_len;
+  char buf[NS_MDNS_MAX_NAME_LEN + 6]; /* Storage for `rdata` */
+};
+
+/*
+ * Generate the `i`-th record we're authoritative for: the host A record,
+ * then service enumeration PTR, PTR, SRV and TXT records of each service.
+ * Return 0 if there is no such record.
+ */
+static int ns_mdns_own_record(struct ns_mdns *mdns, int i,
+                              struct ns_mdns_rr *rr) {
+  struct ns_mdns_service *svc;
+
+  if (mdns->host == NULL) {
+    return 0;
+  } else if (i == 0) {
+    snprintf(rr->name, sizeof(rr->name), "%s", mdns->host);
+    rr->rtype = NS_DNS_A_RECORD;
+    rr->unique = 1;
+    rr->service = -1;
+    rr->rdata = (const char *) &mdns->addr;
+    rr->rdata_len = sizeof(mdns->addr);
+    return 1;
+  } else if ((i - 1) / 4 >= mdns->num_services) {
+    return 0;
+  }
+
+  rr->service = (i - 1) / 4;
+  svc = &mdns->services[rr->service];
+  rr->rdata = rr->buf;
+  switch ((i - 1) % 4) {
+    case 0:
+      snprintf(rr->name, sizeof(rr->name), "%s", NS_MDNS_SERVICES);
+      snprintf(rr->buf, sizeof(rr->buf), "%s", svc->type);
+      rr->rtype = NS_DNS_PTR_RECORD;
+      rr->unique = 0;
+      rr->rdata_len = strlen(rr->buf);
+      break;
+    case 1:
+      snprintf(rr->name, sizeof(rr->name), "%s", svc->type);
+      snprintf(rr->buf, sizeof(rr->buf), "%s.%s", svc->instance, svc->type);
+      rr->rtype = NS_DNS_PTR_RECORD;
+      rr->unique = 0;
+      rr->rdata_len = strlen(rr->buf);
+      break;
+    case 2:
+      snprintf(rr->name, sizeof(rr->name), "%s.%s", svc->instance, svc->type);
+      /* Priority and weight are 0 */
+      memset(rr->buf, 0, 4);
+      rr->buf[4] = svc->port >> 8;
+      rr->buf[5] = svc->port & 0xff;
+      snprintf(rr->buf + 6, sizeof(rr->buf) - 6, "%s", mdns->host);
+      rr->rtype = NS_DNS_SRV_RECORD;
+      rr->unique = 1;
+      rr->rdata_len = 6 + strlen(rr->buf + 6);
+      break;
+    default:
+      snprintf(rr->name, sizeof(rr->name), "%s.%s", svc->instance, svc->type);
+      rr->rtype = NS_DNS_TXT_RECORD;
+      rr->unique = 1;
+      if (svc->txt != NULL) {
+        rr->rdata = svc->txt;
+        rr->rdata_len = svc->txt_len;
+      } else {
+        /* TXT record must contain at least one (empty) string */
+        rr->buf[0] = '\0';
+        rr->rdata_len = 1;
+      }
+      break;
+  }
+  return 1;
+}
+
+/* Return 1 if the record `rr` decoded from `it` has the same data as `own` */
+static int ns_mdns_same_data(struct ns_dns_iterator *it,
+                             struct ns_dns_resource_record *rr,
+                             const char *rdata, size_t rdata_len, int rtype) {
+  struct ns_str name = rr->rdata;
+
+  switch (rtype) {
+    case NS_DNS_PTR_RECORD:
+    case NS_DNS_CNAME_RECORD:
+      return ns_dns_name_cmp(&it->pkt, &name, rdata) == 0;
+    case NS_DNS_SRV_RECORD:
+      if (name.len < 7 || memcmp(name.p, rdata, 6) != 0) {
+        return 0;
+      }
+      name.p += 6;
+      name.len -= 6;
+      return ns_dns_name_cmp(&it->pkt, &name, rdata + 6) == 0;
+    default:
+      return rr->rdata.len == rdata_len &&
+             memcmp(rr->rdata.p, rdata, rdata_len) == 0;
+  }
+}
+
+/* Start a new outgoing packet, the header is filled by ns_mdns_finish() */
+static void ns_mdns_begin(struct mbuf *io, struct ns_dns_name_table *names) {
+  static const char header[12] = {0};
+  mbuf_init(io, 512);
+  mbuf_append(io, header, sizeof(header));
+  ns_dns_name_table_init(names, 0);
+}
+
+static void ns_mdns_finish(struct mbuf *io, uint16_t id, uint16_t flags,
+                           int num_questions, int num_answers) {
+  uint16_t header[4];
+
+  /* Authority and additional counts stay 0 */
+  header[0] = id;
+  header[1] = htons(flags);
+  header[2] = htons(num_questions);
+  header[3] = htons(num_answers);
+  memcpy(io->buf, header, sizeof(header));
+}
+
+static int ns_mdns_encode(struct mbuf *io, struct ns_dns_name_table *names,
+                          enum ns_dns_resource_record_kind kind, int rtype,
+                          int rclass, int ttl, const char *name,
+                          const char *rdata, size_t rdata_len) {
+  struct ns_dns_resource_record rr;
+
+  memset(&rr, 0, sizeof(rr));
+  rr.kind = kind;
+  rr.rtype = rtype;
+  rr.rclass = rclass;
+  rr.ttl = ttl;
+  return ns_dns_encode_record_compressed(io, names, &rr, name, strlen(name),
+                                         rdata, rdata_len);
+}
+
+/* Send a packet to the multicast group through the listening connection */
+static void ns_mdns_send(struct ns_mdns *mdns, struct mbuf *io) {
+  struct ns_connection *nc = mdns->nc;
+  union socket_address sa = nc->sa;
+
+  nc->sa.sin.sin_family = AF_INET;
+  nc->sa.sin.sin_addr.s_addr = htonl(NS_MDNS_GROUP);
+  ns_send(nc, io->buf, io->len);
+  nc->sa = sa;
+}
+
+static int ns_mdns_ttl(struct ns_mdns *mdns) {
+  return mdns->ttl > 0 ? mdns->ttl : NS_MDNS_DEFAULT_TTL;
+}
+
+/* Send all our records with the given TTL: announcement or goodbye */
+static void ns_mdns_send_records(struct ns_mdns *mdns, int ttl) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    if (ns_mdns_encode(&io, &names, NS_DNS_ANSWER, rr.rtype,
+                       rr.unique ? 1 | NS_MDNS_CACHE_FLUSH : 1, ttl, rr.name,
+                       rr.rdata, rr.rdata_len) > 0) {
+      n++;
+    }
+  }
+  /* response + authoritative answer */
+  ns_mdns_finish(&io, 0, 0x8400, 0, n);
+  if (n > 0) {
+    ns_mdns_send(mdns, &io);
+  }
+  mbuf_free(&io);
+}
+
+/* Ask whether anybody else uses our unique names */
+static void ns_mdns_send_probe(struct ns_mdns *mdns) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    /* A and SRV records carry the host and the service instance names */
+    if ((rr.rtype == NS_DNS_A_RECORD || rr.rtype == NS_DNS_SRV_RECORD) &&
+        ns_mdns_encode(&io, &names, NS_DNS_QUESTION, NS_DNS_ANY_RECORD, 1, 0,
+                       rr.name, NULL, 0) > 0) {
+      n++;
+    }
+  }
+  ns_mdns_finish(&io, 0, 0, n, 0);
+  ns_mdns_send(mdns, &io);
+  mbuf_free(&io);
+}
+
+static void ns_mdns_tick(struct ns_mdns *mdns, time_t now) {
+  if (mdns->nc == NULL || mdns->state == NS_MDNS_IDLE || now < mdns->next) {
+    return;
+  }
+
+  if (mdns->state == NS_MDNS_PROBING) {
+    if (mdns->count < NS_MDNS_NUM_PROBES) {
+      ns_mdns_send_probe(mdns);
+      mdns->count++;
+      mdns->next = now + 1;
+      return;
+    }
+    /* Nobody objected, the names are ours */
+    mdns->state = NS_MDNS_ANNOUNCING;
+    mdns->count = 0;
+  }
+
+  ns_mdns_send_records(mdns, ns_mdns_ttl(mdns));
+  mdns->next = now + (1 << mdns->count);
+  if (++mdns->count >= NS_MDNS_NUM_ANNOUNCEMENTS) {
+    mdns->state = NS_MDNS_IDLE;
+    mdns->nc->handler(mdns->nc, NS_MDNS_READY, NULL);
+  }
+}
+
+/* Return 1 if a question in the packet asks for `rr` */
+static int ns_mdns_is_asked(struct ns_dns_iterator *q, struct ns_mdns_rr *rr) {
+  struct ns_dns_iterator it = *q;
+  struct ns_dns_resource_record qr;
+
+  while (ns_dns_iter_next(&it, &qr) > 0 && qr.kind == NS_DNS_QUESTION) {
+    if ((qr.rtype == rr->rtype || qr.rtype == NS_DNS_ANY_RECORD) &&
+        ns_dns_name_cmp(&it.pkt, &qr.name, rr->name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Return 1 if the querier already has `rr` with at least half of its TTL */
+static int ns_mdns_is_known(struct ns_mdns *mdns, struct ns_dns_iterator *q,
+                            struct ns_mdns_rr *rr) {
+  struct ns_dns_iterator it = *q;
+  struct ns_dns_resource_record ar;
+
+  while (ns_dns_iter_next(&it, &ar) > 0) {
+    if (ar.kind == NS_DNS_ANSWER && ar.rtype == rr->rtype &&
+        ar.ttl >= ns_mdns_ttl(mdns) / 2 &&
+        ns_dns_name_cmp(&it.pkt, &ar.name, rr->name) == 0 &&
+        ns_mdns_same_data(&it, &ar, rr->rdata, rr->rdata_len, rr->rtype)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return 1 if `rr` should be in the answer: either asked directly, or an
+ * SRV, TXT or A record completing an asked service PTR record not yet known
+ * by the querier.
+ */
+static int ns_mdns_is_wanted(struct ns_mdns *mdns, struct ns_dns_iterator *q,
+                             struct ns_mdns_rr *rr) {
+  struct ns_mdns_rr ptr;
+  int i;
+
+  if (ns_mdns_is_asked(q, rr)) {
+    return 1;
+  } else if (rr->rtype != NS_DNS_A_RECORD && rr->rtype != NS_DNS_SRV_RECORD &&
+             rr->rtype != NS_DNS_TXT_RECORD) {
+    return 0;
+  }
+  for (i = 0; i < mdns->num_services; i++) {
+    if ((rr->service == -1 || rr->service == i) &&
+        ns_mdns_own_record(mdns, 2 + i * 4, &ptr) &&
+        ns_mdns_is_asked(q, &ptr) && !ns_mdns_is_known(mdns, q, &ptr)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void ns_mdns_answer(struct ns_connection *nc, struct ns_mdns *mdns,
+                           struct ns_dns_iterator *q) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0, ttl = ns_mdns_ttl(mdns);
+  int legacy = nc->sa.sin.sin_port != mdns->nc->sa.sin.sin_port;
+
+  /* Legacy resolvers get short lived records */
+  if (legacy && ttl > 10) ttl = 10;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    if (ns_mdns_is_wanted(mdns, q, &rr) && !ns_mdns_is_known(mdns, q, &rr) &&
+        ns_mdns_encode(&io, &names, NS_DNS_ANSWER, rr.rtype,
+                       rr.unique && !legacy ? 1 | NS_MDNS_CACHE_FLUSH : 1, ttl,
+                       rr.name, rr.rdata, rr.rdata_len) > 0) {
+      n++;
+    }
+  }
+
+  if (n > 0) {
+    ns_mdns_finish(&io, legacy ? q->transaction_id : 0, 0x8400, 0, n);
+    if (legacy) {
+      ns_send(nc, io.buf, io.len);
+    } else {
+      ns_mdns_send(mdns, &io);
+    }
+  }
+  mbuf_free(&io);
+}
+
+static int ns_mdns_same_record(struct ns_mdns_record *a,
+                               struct ns_mdns_record *b) {
+  return a->rtype == b->rtype && a->rdata_len == b->rdata_len &&
+         ns_casecmp(a->name, b->name) == 0 &&
+         memcmp(a->rdata, b->rdata, a->rdata_len) == 0;
+}
+
+static void ns_mdns_cache_add(struct ns_mdns *mdns, struct ns_dns_iterator *it,
+                              struct ns_dns_resource_record *rr, time_t now) {
+  struct ns_mdns_record rec, *r, *found = NULL, *slot = NULL;
+
+  memset(&rec, 0, sizeof(rec));
+  ns_dns_iter_uncompress_name(it, &rr->name, rec.name, sizeof(rec.name) - 1);
+  rec.rtype = rr->rtype;
+  rec.ttl = rr->ttl;
+  rec.expire = now + rr->ttl;
+
+  switch (rr->rtype) {
+    case NS_DNS_PTR_RECORD:
+    case NS_DNS_CNAME_RECORD:
+    case NS_DNS_SRV_RECORD:
+      if (ns_dns_iter_record_data(it, rr, rec.rdata, sizeof(rec.rdata) - 1) ==
+          -1) {
+        return;
+      }
+      rec.rdata_len = rr->rtype == NS_DNS_SRV_RECORD
+                          ? 6 + strlen(rec.rdata + 6)
+                          : strlen(rec.rdata);
+      break;
+    default:
+      if (rr->rdata.len > sizeof(rec.rdata)) {
+        return;
+      }
+      memcpy(rec.rdata, rr->rdata.p, rr->rdata.len);
+      rec.rdata_len = rr->rdata.len;
+      break;
+  }
+
+  for (r = mdns->cache; r < mdns->cache + ARRAY_SIZE(mdns->cache); r++) {
+    if (r->expire <= now) {
+      r->expire = 0;
+    } else if (ns_mdns_same_record(r, &rec)) {
+      found = r;
+    } else if ((rr->rclass & NS_MDNS_CACHE_FLUSH) && r->rtype == rec.rtype &&
+               ns_casecmp(r->name, rec.name) == 0 && r->expire - r->ttl < now) {
+      /* Unique record: forget stale data, but keep the rest of this packet */
+      r->expire = 0;
+    }
+    /* Reuse a free slot, or evict the one closest to expiration */
+    if (slot == NULL || (slot->expire != 0 && r->expire < slot->expire)) {
+      slot = r;
+    }
+  }
+
+  if (found != NULL) {
+    /* Refresh, or expire a goodbye */
+    found->ttl = rec.ttl;
+    found->expire = rr->ttl == 0 ? 0 : rec.expire;
+  } else if (rr->ttl > 0) {
+    *slot = rec;
+    mdns->nc->handler(mdns->nc, NS_MDNS_RECORD, slot);
+  }
+}
+
+/*
+ * Check a response for records conflicting with ours, and cache the others.
+ * Return 1 if there was a conflict.
+ */
+static int ns_mdns_handle_response(struct ns_mdns *mdns,
+                                   struct ns_dns_iterator *it, time_t now) {
+  struct ns_dns_resource_record ar;
+  struct ns_mdns_rr rr;
+  int i, own;
+
+  while (ns_dns_iter_next(it, &ar) > 0) {
+    if (ar.kind != NS_DNS_ANSWER) continue;
+
+    for (own = i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+      if (ar.rtype != rr.rtype ||
+          ns_dns_name_cmp(&it->pkt, &ar.name, rr.name) != 0) {
+        continue;
+      } else if (ns_mdns_same_data(it, &ar, rr.rdata, rr.rdata_len,
+                                   rr.rtype)) {
+        own = 1; /* Our own packet, or somebody agreeing with us */
+        break;
+      } else if (rr.unique && ar.ttl > 0) {
+        mdns->nc->handler(mdns->nc, NS_MDNS_CONFLICT, rr.name);
+        return 1;
+      }
+    }
+
+    if (!own) {
+      ns_mdns_cache_add(mdns, it, &ar, now);
+    }
+  }
+  return 0;
+}
+
+static void ns_mdns_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct ns_mdns *mdns = (struct ns_mdns *) nc->user_data;
+  struct ns_dns_iterator it;
+  time_t now = time(NULL);
+
+  /* Pass low-level events to the user handler */
+  nc->handler(nc, ev, ev_data);
+
+  switch (ev) {
+    case NS_RECV:
+      if (ns_dns_iter_init(&it, nc->recv_mbuf.buf, nc->recv_mbuf.len) == 0) {
+        if (!(it.flags & 0x8000)) {
+          /* Don't answer before our names are confirmed */
+          if (mdns->state != NS_MDNS_PROBING) {
+            ns_mdns_answer(nc, mdns, &it);
+          }
+        } else if (ns_mdns_handle_response(mdns, &it, now)) {
+          /* Names might have been changed by the handler, probe them */
+          ns_mdns_announce(mdns);
+          mdns->next = now + 1;
+        }
+      }
+      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+      /* Busy sockets don't get NS_POLL, so timers are checked here too */
+      ns_mdns_tick(mdns, now);
+      break;
+    case NS_POLL:
+      ns_mdns_tick(mdns, now);
+      break;
+    case NS_CLOSE:
+      if (nc == mdns->nc) {
+        if (mdns->state == NS_MDNS_IDLE) {
+          ns_mdns_send_records(mdns, 0);
+        }
+        mdns->nc = NULL;
+      }
+      break;
+  }
+}
+
+struct ns_connection *ns_mdns_bind(struct ns_mgr *mgr, const char *address,
+                                   ns_event_handler_t handler,
+                                   struct ns_mdns *mdns) {
+  struct ns_connection *nc;
+  union socket_address sa;
+  struct ns_mdns_mreq mreq;
+  char host[NS_MAX_HOST_LEN], addr[50];
+  int proto, loop = 1;
+
+  /* Listen on all addresses, the IP only selects the interface */
+  if (ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0 ||
+      proto != SOCK_DGRAM || sa.sa.sa_family != AF_INET) {
+    return NULL;
+  }
+  snprintf(addr, sizeof(addr), "udp://:%d", (int) ntohs(sa.sin.sin_port));
+  if ((nc = ns_bind(mgr, addr, handler)) == NULL) {
+    return NULL;
+  }
+
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_multiaddr.s_addr = htonl(NS_MDNS_GROUP);
+  mreq.imr_interface = sa.sin.sin_addr;
+  if (setsockopt(nc->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq,
+                 sizeof(mreq)) != 0 ||
+      setsockopt(nc->sock, IPPROTO_IP, IP_MULTICAST_IF,
+                 (char *) &sa.sin.sin_addr, sizeof(sa.sin.sin_addr)) != 0 ||
+      setsockopt(nc->sock, IPPROTO_IP, IP_MULTICAST_LOOP, (char *) &loop,
+                 sizeof(loop)) != 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return NULL;
+  }
+
+  memset(mdns->cache, 0, sizeof(mdns->cache));
+  mdns->nc = nc;
+  nc->user_data = mdns;
+  nc->proto_handler = ns_mdns_handler;
+  ns_mdns_announce(mdns);
+
+  return nc;
+}
+
+void ns_mdns_announce(struct ns_mdns *mdns) {
+  mdns->state = mdns->host == NULL ? NS_MDNS_IDLE : NS_MDNS_PROBING;
+  mdns->count = 0;
+  mdns->next = 0;
+}
+
+int ns_mdns_query(struct ns_mdns *mdns, const char *name, int rtype) {
+  struct ns_dns_name_table names;
+  struct ns_mdns_record *r = NULL;
+  struct mbuf io;
+  time_t now = time(NULL);
+  int n = 0;
+
+  if (mdns->nc == NULL) {
+    return -1;
+  }
+
+  ns_mdns_begin(&io, &names);
+  if (ns_mdns_encode(&io, &names, NS_DNS_QUESTION, rtype, 1, 0, name, NULL,
+                     0) == -1) {
+    mbuf_free(&io);
+    return -1;
+  }
+
+  /* Known answers: cached records with more than half of their TTL left */
+  while ((r = ns_mdns_next_record(mdns, name, rtype, r)) != NULL) {
+    if (r->expire - now > r->ttl / 2 &&
+        ns_mdns_encode(&io, &names, NS_DNS_ANSWER, r->rtype, 1,
+                       (int) (r->expire - now), r->name, r->rdata,
+                       r->rdata_len) > 0) {
+      n++;
+    }
+  }
+
+  ns_mdns_finish(&io, 0, 0, 1, n);
+  ns_mdns_send(mdns, &io);
+  mbuf_free(&io);
+  return 0;
+}
+
+struct ns_mdns_record *ns_mdns_next_record(struct ns_mdns *mdns,
+                                           const char *name, int rtype,
+                                           struct ns_mdns_record *prev) {
+  struct ns_mdns_record *r;
+  time_t now = time(NULL);
+
+  for (r = prev == NULL ? mdns->cache : prev + 1;
+       r < mdns->cache + ARRAY_SIZE(mdns->cache); r++) {
+    if (r->expire <= now) {
+      r->expire = 0;
+    } else if ((rtype == NS_DNS_ANY_RECORD || r->rtype == rtype) &&
+               (name == NULL || ns_casecmp(r->name, name) == 0)) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
 #endif /* NS_ENABLE_DNS_SERVER */
 #ifdef NS_MODULE_LINES
 #line 1 "src/resolv.c"
@@ -7252,6 +12384,25 @@ int ns_resolve_from_hosts_file(const char *name, union socket_address *usa) {
   return -1;
 }
 
+/*
+ * Check that a reply carries at least one well-formed answer, without
+ * allocating a full `struct ns_dns_message` for it.
+ */
+static int ns_resolve_has_answer(const char *buf, int len) {
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+
+  if (ns_dns_iter_init(&it, buf, len) == -1) {
+    return 0;
+  }
+  while (ns_dns_iter_next(&it, &rr) > 0) {
+    if (rr.kind == NS_DNS_ANSWER) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static void ns_resolve_async_eh(struct ns_connection *nc, int ev, void *data) {
   time_t now = time(NULL);
   struct ns_resolve_async_request *req;
@@ -7277,8 +12428,10 @@ static void ns_resolve_async_eh(struct ns_connection *nc, int ev, void *data) {
       }
       break;
     case NS_RECV:
-      msg = (struct ns_dns_message *) NS_MALLOC(sizeof(*msg));
-      if (ns_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
+      msg = NULL;
+      if (ns_resolve_has_answer(nc->recv_mbuf.buf, *(int *) data) &&
+          (msg = (struct ns_dns_message *) NS_MALLOC(sizeof(*msg))) != NULL &&
+          ns_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
           msg->num_answers > 0) {
         req->callback(msg, req->data);
       } else {
@@ -562,6 +562,29 @@ typedef void *SSL_CTX;
 extern "C" {
 #endif /* __cplusplus */
 
+#if !defined(NS_DISABLE_UNIX_SOCKETS) && !defined(_WIN32) && \
+    !defined(NS_CC3200) && !defined(NS_ESP8266) && !defined(PICOTCP)
+#define NS_ENABLE_UNIX_SOCKETS
+#include <sys/un.h>
+#endif
+
+#if !defined(NS_DISABLE_FILESYSTEM) && !defined(_WIN32) && \
+    !defined(NS_CC3200) && !defined(NS_ESP8266) && !defined(PICOTCP)
+#define NS_ENABLE_SEND_FILE
+#endif
+
+#if !defined(NS_DISABLE_SPLICE) && defined(__linux__)
+#define NS_ENABLE_SPLICE
+#endif
+
+#if !defined(NS_DISABLE_ZEROCOPY) && defined(__linux__)
+#define NS_ENABLE_ZEROCOPY
+#endif
+
+#if !defined(NS_DISABLE_UDP_GSO) && defined(__linux__)
+#define NS_ENABLE_UDP_GSO
+#endif
+
 union socket_address {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -570,6 +593,9 @@ union socket_address {
 #else
   struct sockaddr sin6;
 #endif
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  struct sockaddr_un un;
+#endif
 };
 
 /* Describes chunk of memory */
@@ -595,6 +621,7 @@ typedef void (*ns_event_handler_t)(struct ns_connection *, int ev, void *);
 #define NS_RECV 3    /* Data has benn received. int *num_bytes */
 #define NS_SEND 4    /* Data has been written to a socket. int *num_bytes */
 #define NS_CLOSE 5   /* Connection is closed. NULL */
+#define NS_HANDOFF 6 /* Listeners went to a new process. int *num_sockets */
 
 /*
  * Fossa event manager.
@@ -605,6 +632,11 @@ struct ns_mgr {
   sock_t ctl[2];            /* Socketpair for mg_wakeup() */
   void *user_data;          /* User data */
   void *mgr_data;           /* Implementation-specific event manager's data. */
+  sock_t *inherited;        /* Sockets from ns_hot_restart_takeover() */
+  int num_inherited;
+  struct ns_ssl_client_cache *ssl_clients; /* See ns_set_ssl() */
+  struct ns_workers *ssl_workers;  /* See ns_ssl_offload_handshakes() */
+  struct ns_workers *file_workers; /* See ns_offload_file_io() */
 };
 
 /*
@@ -618,6 +650,7 @@ struct ns_connection {
   sock_t sock;             /* Socket to the remote peer */
   union socket_address sa; /* Remote peer address */
   size_t recv_mbuf_limit;  /* Max size of recv buffer */
+  size_t recv_budget;      /* Max bytes read per poll, 0 for no limit */
   struct mbuf recv_mbuf;   /* Received data */
   struct mbuf send_mbuf;   /* Data scheduled for sending */
   SSL *ssl;
@@ -630,6 +663,17 @@ struct ns_connection {
   void *priv_1;                     /* Used by ns_enable_multithreading() */
   void *priv_2;                     /* Used by ns_enable_multithreading() */
   void *mgr_data; /* Implementation-specific event manager's data. */
+  struct ns_ip_acl *ip_acl; /* Listeners: see ns_set_ip_acl() */
+  struct ns_rate_limit *rate_limit[2]; /* See ns_set_rate_limit() */
+  double recv_resume_time; /* If not 0, don't read before this ns_time() */
+  double send_resume_time; /* If not 0, don't write before this ns_time() */
+  struct ns_bandwidth *bandwidth; /* See ns_set_bandwidth() */
+  struct ns_send_file *send_file; /* See ns_send_file() */
+  struct ns_splice *splice;       /* See ns_splice() */
+  struct ns_zerocopy *zerocopy;   /* See ns_set_zerocopy() */
+  struct ns_udp_offload *udp_offload; /* UDP GSO and GRO, see ns_send() */
+  size_t ssl_sent;       /* SSL bytes sent since idle, picks the record size */
+  double ssl_send_time;  /* ns_time() of the last SSL write */
 
   unsigned long flags;
 /* Flags set by Fossa */
@@ -641,6 +685,10 @@ struct ns_connection {
 #define NSF_WANT_READ (1 << 5)          /* SSL specific */
 #define NSF_WANT_WRITE (1 << 6)         /* SSL specific */
 #define NSF_IS_WEBSOCKET (1 << 7)       /* Websocket specific */
+#define NSF_RATE_LIMITED (1 << 8)       /* A message is delayed, see below */
+#define NSF_READ_PENDING (1 << 9)       /* Out of recv_budget, more to read */
+#define NSF_SSL_BUSY (1 << 15)          /* Handshake step in a worker thread */
+#define NSF_HANDED_OFF (1 << 17)        /* Sent by ns_hot_restart_listen() */
 
 /* Flags that are settable by user */
 #define NSF_SEND_AND_CLOSE (1 << 10)      /* Push remaining data and close  */
@@ -648,6 +696,7 @@ struct ns_connection {
 #define NSF_CLOSE_IMMEDIATELY (1 << 12)   /* Disconnect */
 #define NSF_WEBSOCKET_NO_DEFRAG (1 << 13) /* Websocket specific */
 #define NSF_DELETE_CHUNK (1 << 14)        /* HTTP specific */
+#define NSF_TCP_FASTOPEN (1 << 16)        /* ns_bind_opt(), ns_connect_opt() */
 
 #define NSF_USER_1 (1 << 20) /* Flags left for application */
 #define NSF_USER_2 (1 << 21)
@@ -772,8 +821,20 @@ struct ns_connection *ns_bind(struct ns_mgr *, const char *,
  * e.g. `udp://:8000`. To summarize, `address` paramer has following format:
  * `[PROTO://][IP_ADDRESS]:PORT`, where `PROTO` could be `tcp` or `udp`.
  *
+ * Unix domain sockets are addressed by path instead, e.g.
+ * `unix:///var/run/app.sock` for a stream socket or
+ * `unixgram:///var/run/app.sock` for a datagram socket. A socket file left
+ * behind by a process that's gone is removed first, but a live one is not.
+ * The file isn't removed when the listener is closed. On Linux, a name
+ * starting with `@` is in the abstract namespace, e.g. `unix://@app`, and
+ * needs no file at all.
+ *
  * See the `ns_bind_opts` structure for a description of the optional
- * parameters.
+ * parameters. With `NSF_TCP_FASTOPEN` in `flags`, a TCP listener accepts
+ * TCP Fast Open, where supported: the first data of a client that
+ * connected before arrives with its SYN packet. That data may be
+ * replayed, so it should be idempotent. On Linux, the server side must
+ * also be enabled with the `net.ipv4.tcp_fastopen` sysctl.
  *
  * Return a new listening connection, or `NULL` on error.
  * NOTE: Connection remains owned by the manager, do not free().
@@ -804,7 +865,8 @@ struct ns_connection *ns_connect(struct ns_mgr *, const char *,
  * IPv6 address (if Fossa is compiled with `-DNS_ENABLE_IPV6`), or a host name.
  * If `HOST` is a name, Fossa will resolve it asynchronously. Examples of
  * valid addresses: `google.com:80`, `udp://1.2.3.4:53`, `10.0.0.1:443`,
- * `[::1]:80`
+ * `[::1]:80`, `unix:///var/run/app.sock`. See `ns_bind_opt()` for the
+ * format of Unix domain socket addresses.
  *
  * See the `ns_connect_opts` structure for a description of the optional
  * parameters.
@@ -816,6 +878,13 @@ struct ns_connection *ns_connect(struct ns_mgr *, const char *,
  * NOTE: To enable IPv6 addresses, `-DNS_ENABLE_IPV6` should be specified
  * in the compilation flags.
  *
+ * NOTE: With `NSF_TCP_FASTOPEN` in `flags`, a TCP connection uses TCP Fast
+ * Open where supported (Linux 4.11+), and silently doesn't otherwise: when
+ * the server gave a cookie on a previous connection, the data buffered
+ * when the connection is first written goes in the SYN packet, saving a
+ * round trip. `NS_CONNECT` then reports success before the server
+ * answers, and a refused connection is only seen as `NS_CLOSE`.
+ *
  * NOTE: New connection will receive `NS_CONNECT` as it's first event
  * which will report connect success status.
  * If asynchronous resolution fail, or `connect()` syscall fail for whatever
@@ -849,6 +918,73 @@ struct ns_connection *ns_connect_opt(struct ns_mgr *, const char *,
                                      ns_event_handler_t,
                                      struct ns_connect_opts);
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+/*
+ * Hot restart: let a new process take over listening sockets of this one.
+ *
+ * Create a control listener on `address`, which must be a `unix://` address.
+ * When a new process calls `ns_hot_restart_takeover()` on the same address,
+ * it gets copies of up to `NS_HANDOFF_MAX_SOCKETS` listening connections of
+ * this manager, the control listener included. Once the new process confirms
+ * that it has them, this manager closes the listeners it handed over and
+ * `handler` receives `NS_HANDOFF` with their number. Connections accepted
+ * before that are served as usual: it's up to the application to exit when
+ * they're done.
+ *
+ * Clients don't notice the switch: the listening sockets stay open
+ * throughout, and both processes accept from them for a moment.
+ *
+ * Only processes with the same effective user ID get the sockets, checked
+ * with `ns_get_peer_cred()`; for others `ns_hot_restart_takeover()` fails.
+ * Platforms where that can't be checked refuse every handoff.
+ *
+ * Return the control listener, or `NULL` on error.
+ */
+struct ns_connection *ns_hot_restart_listen(struct ns_mgr *,
+                                            const char *address,
+                                            ns_event_handler_t handler);
+
+/*
+ * Take over listening sockets from the process that called
+ * `ns_hot_restart_listen()` on `address`. Blocks for up to
+ * `NS_HANDOFF_TIMEOUT` seconds.
+ *
+ * Call it before creating listeners: `ns_bind()` then reuses a taken over
+ * socket bound to the same address instead of creating a new one. Sockets
+ * that aren't reused by the first `ns_mgr_poll()` are closed.
+ *
+ * [source,c]
+ * ----
+ * ns_mgr_init(&mgr, NULL);
+ * ns_hot_restart_takeover(&mgr, "unix:///var/run/app.ctl");
+ * ns_bind(&mgr, "80", ev_handler);
+ * ns_hot_restart_listen(&mgr, "unix:///var/run/app.ctl", ctl_handler);
+ * ----
+ *
+ * Return the number of sockets taken over, 0 if there's no process to take
+ * them from, or -1 on error.
+ */
+int ns_hot_restart_takeover(struct ns_mgr *, const char *address);
+#endif
+
+/* Credentials of the process on the other end of a Unix domain socket */
+struct ns_peer_cred {
+  int pid; /* -1 where the platform doesn't tell */
+  int uid;
+  int gid;
+};
+
+/*
+ * Get credentials of the peer of a connected Unix domain stream socket,
+ * e.g. in the `NS_ACCEPT` handler of a `unix://` listener. The kernel
+ * records them when the peer connects, so they can be trusted for access
+ * control.
+ *
+ * Return 0 on success, or -1 if the connection isn't a Unix domain socket
+ * or the platform can't tell.
+ */
+int ns_get_peer_cred(struct ns_connection *, struct ns_peer_cred *);
+
 /*
  * Enable SSL for a given connection.
  * `cert` is a server certificate file name for a listening connection,
@@ -857,12 +993,113 @@ struct ns_connection *ns_connect_opt(struct ns_mgr *, const char *,
  * must contain a certificate, concatenated with a private key, optionally
  * concatenated with parameters.
  * `ca_cert` is a CA certificate, or NULL if peer verification is not
- * required.
+ * required. Outgoing connections share contexts and resume sessions, see
+ * `ns_ssl_get_client_stats()`.
  * Return: NULL on success, or error message on error.
  */
 const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
                        const char *ca_cert);
 
+struct ns_ssl_client_stats {
+  unsigned long handshakes; /* Client handshakes completed */
+  unsigned long resumed;    /* Of these, resumed stored sessions */
+  int num_contexts;         /* Cached contexts */
+  int num_sessions;         /* Stored sessions */
+};
+
+/*
+ * Get counters of the client SSL context cache, e.g. the session
+ * resumption rate is `resumed / handshakes`.
+ *
+ * With OpenSSL 1.1 or later, `ns_set_ssl()` on outgoing connections
+ * shares one context per `cert`, `ca_cert` pair in the manager, so
+ * certificate files are only read once. Sessions handed out by servers
+ * (IDs or tickets) are stored per server IP address and port, and offered
+ * by the next connection to the same server, skipping the key exchange if
+ * the server accepts. Contexts are freed by `ns_mgr_free()`.
+ */
+void ns_ssl_get_client_stats(struct ns_mgr *, struct ns_ssl_client_stats *);
+
+/*
+ * Server-side SSL settings. They apply to a listener after `ns_set_ssl()`
+ * and need OpenSSL 1.1 or later. They return NULL on success, or an error
+ * message.
+ */
+
+#define NS_SSL_TICKET_KEY_SIZE 80
+
+/*
+ * Set the keys protecting session tickets issued by a listener, so that
+ * managers and processes given the same keys resume each other's
+ * sessions. By default, each listener makes up its own keys.
+ *
+ * `keys` is one or more keys of `NS_SSL_TICKET_KEY_SIZE` random bytes
+ * (16 bytes name, 32 bytes HMAC key, 32 bytes AES key), e.g. made with
+ * `openssl rand 80`. The first key encrypts new tickets. Tickets made with
+ * the other ones are still accepted and replaced. To rotate, call again
+ * with a new key prepended and the oldest dropped. `len` 0 turns tickets
+ * off.
+ */
+const char *ns_ssl_set_ticket_keys(struct ns_connection *, const void *keys,
+                                   size_t len);
+
+/*
+ * Tune the in-memory session cache of a listener, used by clients resuming
+ * by session ID rather than by ticket. Keep up to `max_sessions` sessions
+ * (0 turns the cache off) for `timeout` seconds, which is also the
+ * lifetime of tickets. 0 keeps the default timeout of 300 seconds.
+ */
+const char *ns_ssl_set_session_cache(struct ns_connection *,
+                                     int max_sessions, int timeout);
+
+/*
+ * Serve the certificate file `cert` to clients asking for `server_name`
+ * with SNI, rather than the listener's one. A name starting with `*.`
+ * matches one more label, e.g. `*.example.com` matches `www.example.com`.
+ * Certificates are loaded when added, not per handshake.
+ */
+const char *ns_ssl_add_sni_cert(struct ns_connection *,
+                                const char *server_name, const char *cert);
+
+/*
+ * Staple an OCSP response (DER encoded) to the certificate added for
+ * `server_name`, or to the listener's certificate if NULL, when clients
+ * ask for it. The response is copied; call again to refresh it before it
+ * expires, e.g. with one fetched by `openssl ocsp -respout`. `len` 0 stops
+ * stapling. Responses aren't checked.
+ */
+const char *ns_ssl_set_ocsp_response(struct ns_connection *,
+                                     const char *server_name, const void *der,
+                                     size_t len);
+
+/*
+ * Run the handshakes of SSL connections accepted by the manager in
+ * `num_threads` worker threads, so that the public key operations of a
+ * burst of new clients don't stall established connections. The event
+ * loop only waits for the sockets to get ready, and `NS_ACCEPT` is sent
+ * when the handshake completes, as usual. Outgoing connections still
+ * handshake in the event loop.
+ *
+ * Needs `NS_ENABLE_THREADS` and OpenSSL 1.1 or later, not on Windows.
+ * Return 0 on success, -1 on failure or if already enabled.
+ */
+int ns_ssl_offload_handshakes(struct ns_mgr *, int num_threads);
+
+#define NS_KTLS_SEND 1 /* The kernel encrypts data sent */
+#define NS_KTLS_RECV 2 /* The kernel decrypts data received */
+
+/*
+ * Tell whether the kernel does the record encryption of an SSL connection
+ * after the handshake: a bitmask of `NS_KTLS_SEND` and `NS_KTLS_RECV`.
+ *
+ * Kernel TLS is tried if Fossa is built with `-DNS_ENABLE_KTLS` against
+ * OpenSSL 3.0 or later, and used if the kernel (Linux `tls` module) and the
+ * negotiated cipher support it. Otherwise OpenSSL does it as usual. With
+ * `NS_KTLS_SEND`, Fossa writes to the socket directly, and `ns_send_file()`
+ * can use `sendfile()`.
+ */
+int ns_ssl_ktls(struct ns_connection *);
+
 /*
  * Send data to the connection.
  *
@@ -871,9 +1108,93 @@ const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
  * to the output buffer. The exception is UDP connections. For UDP, data is
  * sent immediately, and returned value indicates an actual number of bytes
  * sent to the socket.
+ *
+ * On Linux, if the kernel supports UDP segmentation offload, small UDP
+ * datagrams to the same peer are queued instead, and the queue goes out in
+ * a single `UDP_SEGMENT` send when the poll iteration ends, or when the
+ * next `ns_mgr_poll()` starts for datagrams sent outside of event handlers.
+ * UDP sockets also accept coalesced datagrams with `UDP_GRO`, which are
+ * split back into an `NS_RECV` event per datagram.
  */
 int ns_send(struct ns_connection *, const void *buf, int len);
 
+#ifdef NS_ENABLE_SEND_FILE
+/*
+ * Send `len` bytes of file `fd`, starting at `offset`, after the data
+ * already in the output buffer. The connection takes ownership of `fd` and
+ * closes it when done.
+ *
+ * On Linux, the file goes from the page cache to the socket with
+ * `sendfile()`, without passing through the output buffer: for plain TCP
+ * connections, and for SSL connections with kernel TLS, see `ns_ssl_ktls()`.
+ * Otherwise, it's read in chunks as the output buffer drains. `NS_SEND`
+ * reports progress either way, and `send_file` is reset to `NULL` when the
+ * file is sent. Data must not be sent on the connection before that.
+ *
+ * Return 0 on success, or -1 if a file is already being sent, or on error.
+ * On error, `fd` isn't closed.
+ */
+int ns_send_file(struct ns_connection *, int fd, int64_t offset, int64_t len);
+#endif
+
+#ifdef NS_ENABLE_SPLICE
+/*
+ * Forward everything received on either of two plain stream connections, TCP
+ * or Unix domain sockets, to the other one, e.g. to make a TCP proxy.
+ *
+ * Each direction goes through a pipe with `splice()`, so the data never
+ * reaches user space. A connection isn't read while the pipe to its peer is
+ * full, and the other way around. Data that is already in the receive
+ * buffers is sent first. Afterwards, `NS_RECV` and `NS_SEND` only report
+ * byte counts, `recv_mbuf` stays empty. Data can still be sent with
+ * `ns_send()`, it goes before what's left in the pipe. When one connection
+ * closes, the other one sends what's left and closes too.
+ *
+ * Return 0 on success, or -1 if a connection is not a plain stream (e.g. SSL,
+ * UDP or listening), is already spliced, or on error.
+ */
+int ns_splice(struct ns_connection *, struct ns_connection *);
+#endif
+
+/*
+ * Enable or disable Nagle's algorithm for a TCP connection. Fossa enables
+ * `TCP_NODELAY` on accepted and outgoing TCP connections: data buffered
+ * during a poll iteration is written at once anyway, so Nagle only delays
+ * the small writes that follow, by up to the peer's delayed ACK timeout.
+ *
+ * Return 0 on success, -1 on error or if it's not a TCP connection.
+ */
+int ns_set_nodelay(struct ns_connection *, int on);
+
+/*
+ * Cork or uncork a TCP connection. While corked, the kernel only sends
+ * full segments, so that data written by several calls, e.g. several SSL
+ * records, or a response header and a file, leave together. Uncorking
+ * sends what is left. Linux sends it anyway after 200 ms.
+ *
+ * Return 0 on success, -1 on error or if not supported.
+ */
+int ns_set_cork(struct ns_connection *, int on);
+
+/*
+ * Send output buffers of at least `threshold` bytes without copying them to
+ * the kernel, with Linux `MSG_ZEROCOPY`. 0 turns it off. Set on a listener,
+ * it applies to accepted connections.
+ *
+ * Zero-copy only pays off for large sends, e.g. 16 KB or more, since
+ * pinning the pages and the completion notifications have a cost. When
+ * the output buffer is sent this way, the connection takes it over and
+ * keeps it until the kernel reports that the data is acknowledged, and a
+ * new buffer collects data sent in the meantime. Completions are read by
+ * the event loop, and `NSF_SEND_AND_CLOSE` waits for them. If the kernel
+ * reports it had to copy anyway, e.g. on loopback, the connection goes
+ * back to regular sends.
+ *
+ * Return 0 on success, or -1 if not supported, e.g. for SSL, UDP or Unix
+ * domain connections.
+ */
+int ns_set_zerocopy(struct ns_connection *, size_t threshold);
+
 /*
  * Send `printf`-style formatted data to the connection.
  *
@@ -925,6 +1246,160 @@ int ns_resolve(const char *domain_name, char *ip_addr_buf, size_t buf_len);
  */
 int ns_check_ip_acl(const char *acl, uint32_t remote_ip);
 
+/*
+ * Compile an ACL for fast repeated checks with `ns_ip_acl_check()`.
+ *
+ * The syntax is that of `ns_check_ip_acl()`. With `NS_ENABLE_IPV6`, IPv6
+ * subnets such as `+2001:db8::/32` or `-::1` are accepted as well.
+ * The compiled form is a bitwise trie per address family: checks take one
+ * walk along the address bits, however long the ACL. As with
+ * `ns_check_ip_acl()`, the last matching entry wins.
+ *
+ * Return NULL if the ACL is malformed or out of memory.
+ */
+struct ns_ip_acl *ns_ip_acl_compile(const char *acl);
+
+/* Free a compiled ACL. */
+void ns_ip_acl_free(struct ns_ip_acl *);
+
+/*
+ * Check a peer address against a compiled ACL.
+ *
+ * IPv4 and IPv6 peers are checked against the rules of their family;
+ * IPv4-mapped IPv6 addresses are checked as IPv4. A NULL ACL allows
+ * everything. Return 1 if allowed, 0 if not.
+ */
+int ns_ip_acl_check(const struct ns_ip_acl *, const union socket_address *);
+
+/*
+ * Set the ACL of a listening connection.
+ *
+ * Connections accepted (or UDP datagrams received) from disallowed addresses
+ * are dropped right after `accept()`, before a connection is allocated and
+ * before any event handler runs.
+ *
+ * The ACL is compiled first and replaces the previous one only if valid,
+ * so it can be reloaded at any time between events. NULL or an empty
+ * string removes the ACL. Return -1 if the ACL is malformed.
+ */
+int ns_set_ip_acl(struct ns_connection *nc, const char *acl);
+
+/* What a rate limit applies to, see `ns_set_rate_limit()` */
+#define NS_RATE_LIMIT_CONNECTIONS 0 /* New connections, checked at accept */
+#define NS_RATE_LIMIT_MESSAGES 1    /* HTTP requests and MQTT publishes */
+
+/* What to do when a client exceeds its rate */
+#define NS_RATE_LIMIT_REJECT 1 /* Drop it; HTTP: reply 429 Too Many Requests */
+#define NS_RATE_LIMIT_CLOSE 2  /* Close the connection */
+#define NS_RATE_LIMIT_DELAY 3  /* Stop reading until the client is in budget */
+
+struct ns_rate_limit_opts {
+  double rate;     /* Tokens (connections, messages) per second per client */
+  double burst;    /* Bucket size, at least 1 */
+  int max_clients; /* Buckets kept, least recently used are evicted */
+  int action;      /* NS_RATE_LIMIT_*, default NS_RATE_LIMIT_REJECT */
+  /*
+   * Optional: key messages by something else than the client IP address,
+   * e.g. an API key. `msg` is a `struct http_message *` or a
+   * `struct ns_mqtt_message *`. Return 0 to use the IP address.
+   */
+  int (*get_key)(struct ns_connection *nc, void *msg, struct ns_str *key);
+};
+
+struct ns_rate_limit_stats {
+  unsigned long allowed; /* Tokens taken */
+  unsigned long limited; /* Requests over the rate */
+  unsigned long evicted; /* Buckets evicted to make room for new clients */
+  int num_clients;       /* Buckets in use */
+};
+
+/*
+ * Create a token bucket rate limiter.
+ *
+ * Each client gets a bucket of `burst` tokens, refilled at `rate` tokens
+ * per second. Buckets live in a fixed-size hash table; when it's full, the
+ * least recently seen client is forgotten, so `max_clients` should exceed
+ * the number of clients active at any one time.
+ *
+ * The limiter is reference counted: listeners and connections using it
+ * hold a reference, `ns_rate_limit_free()` drops the creator's one.
+ * Return NULL if options are invalid or out of memory.
+ */
+struct ns_rate_limit *ns_rate_limit_create(struct ns_rate_limit_opts opts);
+
+/* Release a limiter reference, see `ns_rate_limit_create()`. */
+void ns_rate_limit_free(struct ns_rate_limit *);
+
+/*
+ * Take a token from the bucket of `key` at time `now` (see `ns_time()`).
+ *
+ * Keys are arbitrary bytes; keys longer than 32 bytes are compared by
+ * prefix and hash. Return 0 if a token was taken, otherwise the number of
+ * seconds until one is available.
+ */
+double ns_rate_limit_take(struct ns_rate_limit *, const void *key,
+                          size_t key_len, double now);
+
+/* Same as `ns_rate_limit_take()`, keyed by IP address. */
+double ns_rate_limit_take_addr(struct ns_rate_limit *,
+                               const union socket_address *, double now);
+
+/* Get limiter counters, e.g. for a metrics endpoint. */
+void ns_rate_limit_get_stats(const struct ns_rate_limit *,
+                             struct ns_rate_limit_stats *);
+
+/*
+ * Attach a rate limiter to a connection, replacing the previous one.
+ *
+ * `which` is `NS_RATE_LIMIT_CONNECTIONS` (listeners only: checked right
+ * after `accept()`, before any event handler runs) or
+ * `NS_RATE_LIMIT_MESSAGES` (checked by the HTTP handler for each request
+ * and by the MQTT handler for each PUBLISH). Connections accepted by a
+ * listener inherit its message limiter. NULL removes the limiter.
+ *
+ * With `NS_RATE_LIMIT_DELAY` the connection stops reading, and a delayed
+ * message stays buffered and is processed once it's within the rate;
+ * `NSF_RATE_LIMITED` is set meanwhile.
+ */
+void ns_set_rate_limit(struct ns_connection *nc, int which,
+                       struct ns_rate_limit *);
+
+/*
+ * Charge a message received on `nc` to its message limiter, keyed by
+ * `get_key()` or the peer address. Protocol handlers call this.
+ *
+ * Return 0 if the message can be processed. Otherwise, return the action
+ * taken: `NS_RATE_LIMIT_CLOSE` and `NS_RATE_LIMIT_DELAY` are handled here,
+ * for `NS_RATE_LIMIT_REJECT` the caller drops the message. `retry_after`
+ * receives the number of seconds until the client is in budget again.
+ */
+int ns_rate_limit_message(struct ns_connection *nc, void *msg,
+                          double *retry_after);
+
+/* Directions of a bandwidth limit, see `ns_set_bandwidth()` */
+#define NS_BANDWIDTH_SEND 0
+#define NS_BANDWIDTH_RECV 1
+
+/*
+ * Limit the byte rate of a connection in one direction.
+ *
+ * `rate` is in bytes per second, 0 removes the limit. `burst` is the token
+ * bucket size in bytes: up to that much can be transferred at once after
+ * an idle period. 0 means a tenth of a second worth of `rate`.
+ *
+ * Once over the rate, the connection is taken out of the poll set for that
+ * direction until the bucket refills, so a shaped download doesn't spin
+ * the event loop. Limits can be changed at any time.
+ *
+ * On a listening connection, the limit applies to all the connections it
+ * accepts from then on, together: e.g. the total upload of an HTTP server.
+ * Each of them can have its own limit on top.
+ *
+ * Return 0 on success, -1 if `dir` or `rate` is invalid or out of memory.
+ */
+int ns_set_bandwidth(struct ns_connection *nc, int dir, double rate,
+                     double burst);
+
 /*
  * Enable multi-threaded handling for the given listening connection `nc`.
  * For each accepted connection, Mongoose will create a separate thread
@@ -934,6 +1409,23 @@ int ns_check_ip_acl(const char *acl, uint32_t remote_ip);
  */
 void ns_enable_multithreading(struct ns_connection *nc);
 
+/*
+ * Read and write files served by `ns_serve_http()`, and uploaded with DAV
+ * `PUT`, in `num_threads` worker threads, so that a cold cache or a slow
+ * disk doesn't stall other connections of the manager.
+ *
+ * Downloads are read ahead in chunks, up to `NS_HTTP_READ_AHEAD` bytes of
+ * the output buffer; they don't use `ns_send_file()`, whose `sendfile()`
+ * calls would read the disk in the event loop. Uploads are written as they
+ * arrive; while a write is in progress, reading stops once
+ * `NS_HTTP_READ_AHEAD` bytes are buffered. Completions are handled by the
+ * event loop.
+ *
+ * Needs `NS_ENABLE_THREADS`, not on Windows.
+ * Return 0 on success, -1 on failure or if already enabled.
+ */
+int ns_offload_file_io(struct ns_mgr *, int num_threads);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -1070,6 +1562,8 @@ void ns_set_close_on_exec(sock_t);
  *
  * If both port number and IP address are printed, they are separated by `:`.
  * If compiled with `-DNS_ENABLE_IPV6`, IPv6 addresses are supported.
+ * Unix domain sockets have no port: either flag prints the path, or `@name`
+ * for an abstract name, or nothing for an unnamed socket.
  */
 void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags);
 
@@ -1117,6 +1611,19 @@ void ns_hexdump_connection(struct ns_connection *nc, const char *path,
  */
 int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap);
 
+/*
+ * Append printf-formatted output to an IO buffer.
+ *
+ * The output is formatted straight into the free space of `io`, which grows
+ * as needed: no temporary buffer is used, and the format is processed a
+ * second time only when the buffer had to grow.
+ * Return the number of bytes appended, or -1 on error.
+ */
+int ns_mbuf_vprintf(struct mbuf *io, const char *fmt, va_list ap);
+
+/* Same as `ns_mbuf_vprintf()`, with a variable argument list. */
+int ns_mbuf_printf(struct mbuf *io, const char *fmt, ...);
+
 /*
  * Return true if target platform is big endian.
  */
@@ -1144,10 +1651,127 @@ const char *ns_next_comma_list_entry(const char *list, struct ns_str *val,
  */
 int ns_match_prefix(const char *pattern, int pattern_len, const char *str);
 
+/*
+ * Return current time in seconds since the epoch, with sub-second precision
+ * where the platform provides it.
+ */
+double ns_time(void);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
 #endif /* NS_UTIL_HEADER_DEFINED */
+/*
+ * Copyright (c) 2015 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * === JSON
+ */
+
+#ifndef NS_JSON_HEADER_DEFINED
+#define NS_JSON_HEADER_DEFINED
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define NS_JSON_MAX_DEPTH 32
+
+/*
+ * Streaming JSON writer.
+ *
+ * Values are appended straight to an IO buffer, which grows as needed:
+ * output is never truncated. Commas and colons are inserted automatically.
+ * The IO buffer can be a connection's `send_mbuf`, see
+ * `ns_send_http_response_at()` and `ns_send_websocket_frame_at()`:
+ *
+ * [source,c]
+ * ----
+ * struct ns_json_writer w;
+ * size_t off = nc->send_mbuf.len;
+ *
+ * ns_json_init(&w, &nc->send_mbuf);
+ * ns_json_begin_object(&w);
+ * ns_json_key(&w, "name");
+ * ns_json_string(&w, name, strlen(name));
+ * ns_json_key(&w, "size");
+ * ns_json_int(&w, size);
+ * ns_json_end_object(&w);
+ * ns_send_http_response_at(nc, off, 200, "Content-Type: application/json\r\n");
+ * ----
+ */
+struct ns_json_writer {
+  struct mbuf *io;    /* Output buffer */
+  int depth;          /* Number of open objects and arrays */
+  int after_key;      /* The next value belongs to a key just written */
+  uint32_t has_items; /* Bit N: open container N has items */
+  int error;          /* Non-zero if nested too deep or out of memory */
+};
+
+/* Initialize a writer appending to `io`. */
+void ns_json_init(struct ns_json_writer *, struct mbuf *io);
+
+void ns_json_begin_object(struct ns_json_writer *);
+void ns_json_end_object(struct ns_json_writer *);
+void ns_json_begin_array(struct ns_json_writer *);
+void ns_json_end_array(struct ns_json_writer *);
+
+/* Write an object key, 0-terminated. The value must follow. */
+void ns_json_key(struct ns_json_writer *, const char *key);
+
+/* Write a string value, escaping it as needed. */
+void ns_json_string(struct ns_json_writer *, const char *s, size_t len);
+
+void ns_json_int(struct ns_json_writer *, int64_t v);
+
+/*
+ * Write a number with enough digits to read back the same value.
+ * NaN and infinities have no JSON representation and are written as `null`.
+ */
+void ns_json_double(struct ns_json_writer *, double v);
+
+void ns_json_bool(struct ns_json_writer *, int v);
+void ns_json_null(struct ns_json_writer *);
+
+/* Write an already encoded JSON value as is. */
+void ns_json_raw(struct ns_json_writer *, const char *json, size_t len);
+
+/*
+ * Find the value at `path` in the JSON document `buf`, `len`, without
+ * tokenizing the whole document.
+ *
+ * `path` has the same syntax as for `find_json_token()`, e.g.
+ * `"params.items[2].name"`; an empty path selects the whole document.
+ * Subtrees that aren't on the path are skipped by a fast scanner that only
+ * checks brackets and strings, so a malformed document might not be
+ * detected. Keys are compared as written, without unescaping.
+ *
+ * On success, `value` points to the value in `buf`. As with frozen tokens,
+ * quotes are excluded for strings, and objects and arrays include their
+ * brackets. Return the type of the value (`JSON_TYPE_*`), or
+ * `JSON_TYPE_EOF` (0) if it's not found or the document is malformed.
+ *
+ * [source,c]
+ * ----
+ * struct ns_str user, id;
+ *
+ * if (ns_json_find(hm->body.p, hm->body.len, "user.name", &user) ==
+ *         JSON_TYPE_STRING &&
+ *     ns_json_find(hm->body.p, hm->body.len, "id", &id) == JSON_TYPE_NUMBER) {
+ *   ...
+ * }
+ * ----
+ */
+int ns_json_find(const char *buf, size_t len, const char *path,
+                 struct ns_str *value);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* NS_JSON_HEADER_DEFINED */
 /*
  * Copyright (c) 2014 Cesanta Software Limited
  * All rights reserved
@@ -1181,6 +1805,10 @@ extern "C" {
 #define NS_MAX_HTTP_SEND_IOBUF 4096
 #endif
 
+#ifndef NS_HTTP_READ_AHEAD
+#define NS_HTTP_READ_AHEAD 65536 /* See ns_offload_file_io() */
+#endif
+
 #ifndef NS_WEBSOCKET_PING_INTERVAL_SECONDS
 #define NS_WEBSOCKET_PING_INTERVAL_SECONDS 5
 #endif
@@ -1299,6 +1927,15 @@ void ns_send_websocket_handshake(struct ns_connection *nc, const char *uri,
 void ns_send_websocket_frame(struct ns_connection *nc, int op, const void *data,
                              size_t data_len);
 
+/*
+ * Send websocket frame whose data has been appended to `nc->send_mbuf`
+ * in place, starting at offset `off` (e.g. by a `struct ns_json_writer`).
+ *
+ * The frame header is inserted in front of the data, which is masked in
+ * place on client connections. Avoids a copy of the data.
+ */
+void ns_send_websocket_frame_at(struct ns_connection *nc, int op, size_t off);
+
 /*
  * Send multiple websocket frames.
  *
@@ -1336,6 +1973,17 @@ void ns_printf_websocket_frame(struct ns_connection *nc, int op,
  */
 void ns_send_http_chunk(struct ns_connection *nc, const char *buf, size_t len);
 
+/*
+ * Send HTTP response whose body has been appended to `nc->send_mbuf`
+ * in place, starting at offset `off` (e.g. by a `struct ns_json_writer`).
+ *
+ * The status line, `Content-Length` and `extra_headers` (which can be NULL,
+ * and must end with `\r\n` otherwise) are inserted in front of the body.
+ * Avoids a copy of the body.
+ */
+void ns_send_http_response_at(struct ns_connection *nc, size_t off,
+                              int status_code, const char *extra_headers);
+
 /*
  * Send printf-formatted HTTP chunk.
  * Functionality is similar to `ns_send_http_chunk()`.
@@ -1512,7 +2160,11 @@ struct ns_serve_http_opts {
   /* SSI files pattern. If not set, "**.shtml$|**.shtm$" is used. */
   const char *ssi_pattern;
 
-  /* IP ACL. By default, NULL, meaning all IPs are allowed to connect */
+  /*
+   * IP ACL. By default, NULL, meaning all IPs are allowed to connect.
+   * Checked on every request; `ns_set_ip_acl()` on the listening connection
+   * rejects clients earlier and faster, at accept time.
+   */
   const char *ip_acl;
 
   /* URL rewrites.
@@ -1596,12 +2248,15 @@ void ns_serve_http(struct ns_connection *, struct http_message *,
 extern "C" {
 #endif /* __cplusplus */
 
+struct ns_rpc_channel;
+
 /* JSON-RPC request */
 struct ns_rpc_request {
-  struct json_token *message; /* Whole RPC message */
-  struct json_token *id;      /* Message ID */
-  struct json_token *method;  /* Method name */
-  struct json_token *params;  /* Method params */
+  struct json_token *message;     /* Whole RPC message */
+  struct json_token *id;          /* Message ID */
+  struct json_token *method;      /* Method name */
+  struct json_token *params;      /* Method params */
+  struct ns_rpc_channel *channel; /* Channel the request came from, or NULL */
 };
 
 /* JSON-RPC response */
@@ -1709,10 +2364,239 @@ typedef int (*ns_rpc_handler_t)(char *buf, int len, struct ns_rpc_request *);
  * can be larger then `dst_len` that indicates an overflow.
  * Overflown bytes are not written to the buffer.
  * If method is not found, an error is automatically generated.
+ *
+ * See `ns_rpc_dispatch_mbuf()` for a faster version that supports batch
+ * requests and doesn't truncate the output.
  */
 int ns_rpc_dispatch(const char *buf, int, char *dst, int dst_len,
                     const char **methods, ns_rpc_handler_t *handlers);
 
+/*
+ * Handler of a method registered with `ns_rpc_add_method()`.
+ *
+ * The handler appends the reply to `out`, typically with
+ * `ns_rpc_append_reply()` or `ns_rpc_append_std_error()`.
+ */
+typedef int (*ns_rpc_method_t)(struct mbuf *out, struct ns_rpc_request *,
+                               void *user_data);
+
+/* Entry of the method hash table. */
+struct ns_rpc_method {
+  const char *name; /* Method name, NULL for empty slots */
+  int name_len;
+  uint32_t hash;
+  ns_rpc_method_t handler;
+  void *user_data;
+};
+
+/* JSON-RPC method table, zero-initialize or use `ns_rpc_methods_init()`. */
+struct ns_rpc_methods {
+  struct ns_rpc_method *table; /* Open addressing hash table */
+  int size;                    /* Number of slots, a power of 2 */
+  int num_methods;             /* Number of used slots */
+};
+
+/* Initialize an empty method table. */
+void ns_rpc_methods_init(struct ns_rpc_methods *);
+
+/* Free memory used by a method table. */
+void ns_rpc_methods_free(struct ns_rpc_methods *);
+
+/*
+ * Register a method handler. `name` is not copied and must stay valid.
+ * Registering an existing name replaces its handler.
+ *
+ * Return -1 if out of memory.
+ */
+int ns_rpc_add_method(struct ns_rpc_methods *, const char *name,
+                      ns_rpc_method_t handler, void *user_data);
+
+/*
+ * Dispatch a JSON-RPC request or batch of requests contained in `buf`, `len`
+ * to the methods registered in `methods`, appending the reply to `out`.
+ *
+ * A batch (JSON array of requests) gets an array of replies. Requests
+ * without an `id` are notifications and get no reply; if there's nothing to
+ * reply, nothing is appended. Unknown methods and malformed requests
+ * are answered with standard errors.
+ *
+ * Return the number of bytes appended.
+ */
+int ns_rpc_dispatch_mbuf(struct ns_rpc_methods *methods, const char *buf,
+                         int len, struct mbuf *out);
+
+/*
+ * Append a JSON-RPC reply to an IO buffer.
+ *
+ * Same as `ns_rpc_create_reply()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_reply(struct mbuf *, const struct ns_rpc_request *req,
+                        const char *result_fmt, ...);
+
+/*
+ * Start a JSON-RPC reply with a JSON writer.
+ *
+ * Writes the reply object up to the `result` key. The caller then writes the
+ * result value and closes the reply with `ns_json_end_object()`:
+ *
+ * [source,c]
+ * ----
+ * static int rpc_list(struct mbuf *out, struct ns_rpc_request *req,
+ *                     void *user_data) {
+ *   struct ns_json_writer w;
+ *   int i;
+ *
+ *   ns_json_init(&w, out);
+ *   ns_rpc_begin_reply(&w, req);
+ *   ns_json_begin_array(&w);
+ *   for (i = 0; i < num_items; i++) {
+ *     ns_json_string(&w, items[i], strlen(items[i]));
+ *   }
+ *   ns_json_end_array(&w);
+ *   ns_json_end_object(&w);
+ *   return 0;
+ * }
+ * ----
+ */
+void ns_rpc_begin_reply(struct ns_json_writer *, const struct ns_rpc_request *);
+
+/*
+ * Append a JSON-RPC error to an IO buffer.
+ *
+ * Same as `ns_rpc_create_error()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_error(struct mbuf *, const struct ns_rpc_request *req,
+                        int code, const char *message, const char *fmt, ...);
+
+/*
+ * Append a standard JSON-RPC error to an IO buffer.
+ *
+ * Same as `ns_rpc_create_std_error()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_std_error(struct mbuf *, const struct ns_rpc_request *req,
+                            int code);
+
+/*
+ * Reply callback of `ns_rpc_call()`.
+ *
+ * On success `reply` is set, on JSON-RPC error `error` is set. Both are NULL
+ * if the call timed out or the connection was closed before a reply came.
+ */
+typedef void (*ns_rpc_reply_cb_t)(struct ns_rpc_channel *, void *cb_data,
+                                  struct ns_rpc_reply *reply,
+                                  struct ns_rpc_error *error);
+
+struct ns_rpc_pending;
+struct ns_rpc_deferred;
+
+#define NS_RPC_CHANNEL_TCP (1 << 0) /* Newline-delimited messages over TCP */
+
+#ifndef NS_RPC_DEFAULT_TIMEOUT
+#define NS_RPC_DEFAULT_TIMEOUT 10 /* Seconds */
+#endif
+
+#ifndef NS_RPC_CHANNEL_BUCKETS
+#define NS_RPC_CHANNEL_BUCKETS 64 /* Must be a power of 2 */
+#endif
+
+/*
+ * JSON-RPC channel: a connection that carries requests and replies
+ * in both directions.
+ *
+ * By default messages are websocket text frames. With `NS_RPC_CHANNEL_TCP`
+ * each message is a line of JSON terminated by `\n`.
+ */
+struct ns_rpc_channel {
+  struct ns_connection *nc;       /* NULL once the connection is closed */
+  struct ns_rpc_methods *methods; /* Methods served, can be NULL */
+  int flags;                      /* NS_RPC_CHANNEL_* flags */
+  int timeout;                    /* For calls made next, in seconds */
+  void *user_data;
+
+  /* Private */
+  unsigned long next_id;
+  int num_pending; /* Number of calls waiting for a reply */
+  struct ns_rpc_pending *buckets[NS_RPC_CHANNEL_BUCKETS]; /* Keyed by ID */
+  struct ns_rpc_pending *oldest, *newest;
+  struct ns_rpc_deferred *deferred;
+};
+
+/*
+ * Initialize a channel over connection `nc`, serving `methods`.
+ *
+ * The channel must stay valid until the connection is closed.
+ * The connection event handler must pass all events to
+ * `ns_rpc_channel_handler()`:
+ *
+ * [source,c]
+ * ----
+ * static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
+ *   struct ns_rpc_channel *ch = (struct ns_rpc_channel *) nc->user_data;
+ *   ns_rpc_channel_handler(ch, ev, ev_data);
+ *   if (ev == NS_CLOSE) free(ch);
+ * }
+ * ----
+ */
+void ns_rpc_channel_init(struct ns_rpc_channel *, struct ns_connection *nc,
+                         struct ns_rpc_methods *methods, int flags);
+
+/*
+ * Channel event handler.
+ *
+ * Dispatches incoming requests, matches replies to outstanding calls and
+ * fails calls that timed out. On `NS_CLOSE`, all outstanding calls fail.
+ */
+void ns_rpc_channel_handler(struct ns_rpc_channel *, int ev, void *ev_data);
+
+/*
+ * Call a remote method. `params_fmt` follows the `json_emit()` API.
+ *
+ * The call is sent right away, without waiting for replies to previous
+ * calls: any number of calls can be in flight on the same channel. `cb` is
+ * invoked once, when the reply arrives or the call times out. If `cb` is
+ * NULL, the call is sent as a notification.
+ *
+ * Return the ID of the call, or 0 on error.
+ */
+unsigned long ns_rpc_call(struct ns_rpc_channel *, const char *method,
+                          ns_rpc_reply_cb_t cb, void *cb_data,
+                          const char *params_fmt, ...);
+
+/*
+ * Reply to a request later.
+ *
+ * Called from a method handler instead of appending a reply. The returned
+ * handle must be passed to `ns_rpc_deferred_reply()` or
+ * `ns_rpc_deferred_error()`, which send the reply and release the handle.
+ * If the request is in a batch, its reply is sent as a separate message.
+ *
+ * Return NULL if the request is a notification, didn't come from a channel,
+ * or if out of memory.
+ */
+struct ns_rpc_deferred *ns_rpc_defer(struct ns_rpc_request *);
+
+/*
+ * Send the result of a deferred request and release the handle.
+ *
+ * Return -1 if the channel has been closed in the meantime; the handle is
+ * released anyway.
+ */
+int ns_rpc_deferred_reply(struct ns_rpc_deferred *, const char *result_fmt,
+                          ...);
+
+/*
+ * Send an error reply to a deferred request and release the handle.
+ * If `message` is NULL, the standard message for `code` is used.
+ *
+ * Return -1 if the channel has been closed in the meantime; the handle is
+ * released anyway.
+ */
+int ns_rpc_deferred_error(struct ns_rpc_deferred *, int code,
+                          const char *message);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -2030,7 +2914,11 @@ extern "C" {
 #define NS_DNS_A_RECORD 0x01     /* Lookup IP address */
 #define NS_DNS_CNAME_RECORD 0x05 /* Lookup CNAME */
 #define NS_DNS_AAAA_RECORD 0x1c  /* Lookup IPv6 address */
+#define NS_DNS_PTR_RECORD 0x0c   /* Lookup domain name pointer */
 #define NS_DNS_MX_RECORD 0x0f    /* Lookup mail server for domain */
+#define NS_DNS_TXT_RECORD 0x10   /* Lookup text strings */
+#define NS_DNS_SRV_RECORD 0x21   /* Lookup service location */
+#define NS_DNS_ANY_RECORD 0xff   /* Lookup all records */
 
 #define NS_MAX_DNS_QUESTIONS 32
 #define NS_MAX_DNS_ANSWERS 32
@@ -2072,7 +2960,9 @@ struct ns_dns_resource_record *ns_dns_next_record(
  *
  *  - A:     struct in_addr *ina
  *  - AAAA:  struct in6_addr *ina
- *  - CNAME: char buffer
+ *  - CNAME, PTR: char buffer
+ *  - SRV:   char buffer, receives priority, weight and port (2 bytes each,
+ *           network byte order) followed by the target name
  *
  * Returns -1 on error.
  *
@@ -2117,11 +3007,54 @@ int ns_dns_copy_body(struct mbuf *, struct ns_dns_message *);
  *struct
  * because they might be invalidated as soon as the IO buffer grows again.
  *
+ * CNAME and PTR data is a dotted name. SRV data is priority, weight and port
+ * (2 bytes each, network byte order) followed by the dotted target name.
+ *
  * Return the number of bytes appened or -1 in case of error.
  */
 int ns_dns_encode_record(struct mbuf *, struct ns_dns_resource_record *,
                          const char *, size_t, const void *, size_t);
 
+#define NS_DNS_MAX_COMPRESSED_NAMES 32
+
+/*
+ * Name compression table of a DNS message being encoded.
+ *
+ * Remembers where names (and their suffixes) have been written, so that
+ * later occurrences can be replaced by RFC 1035 compression pointers.
+ */
+struct ns_dns_name_table {
+  size_t start;  /* Offset of the message header in the IO buffer */
+  int num_names; /* Number of used entries in `offsets` */
+  uint16_t offsets[NS_DNS_MAX_COMPRESSED_NAMES]; /* Relative to `start` */
+};
+
+/*
+ * Initialize name compression table for a message whose header starts at
+ * offset `start` of the IO buffer.
+ */
+void ns_dns_name_table_init(struct ns_dns_name_table *, size_t start);
+
+/*
+ * Register a name already present in the message, at offset `off` from the
+ * message header. Useful for names that haven't been encoded with
+ * `ns_dns_encode_record_compressed()`, e.g. question records copied from a
+ * request with `ns_dns_copy_body()`.
+ */
+void ns_dns_name_table_add(struct ns_dns_name_table *, size_t off);
+
+/*
+ * Same as `ns_dns_encode_record()`, but compresses the record name (and
+ * CNAME data) with pointers to names already written to the message.
+ *
+ * The message header must already be present in the IO buffer (possibly
+ * as a placeholder), at offset `names->start`.
+ */
+int ns_dns_encode_record_compressed(struct mbuf *, struct ns_dns_name_table *,
+                                    struct ns_dns_resource_record *,
+                                    const char *, size_t, const void *,
+                                    size_t);
+
 /* Low-level: parses a DNS response. */
 int ns_parse_dns(const char *, int, struct ns_dns_message *);
 
@@ -2141,6 +3074,77 @@ int ns_parse_dns(const char *, int, struct ns_dns_message *);
 size_t ns_dns_uncompress_name(struct ns_dns_message *, struct ns_str *, char *,
                               int);
 
+/*
+ * Lazy DNS message parser.
+ *
+ * Unlike `ns_parse_dns()`, the iterator doesn't need a `struct
+ * ns_dns_message` and doesn't allocate: records are decoded one at a time
+ * straight from the wire bytes, and names stay compressed (`rr->name` and
+ * `rr->rdata` point into the packet).
+ */
+struct ns_dns_iterator {
+  struct ns_str pkt; /* packet body */
+  uint16_t flags;
+  uint16_t transaction_id;
+  int num_questions;
+  int num_answers;
+  const char *pos; /* next record to decode */
+  int index;       /* number of records decoded so far */
+};
+
+/*
+ * Initialize a DNS iterator over the packet `buf`, `len`.
+ *
+ * Only the header is decoded. Return -1 if the packet is too short.
+ */
+int ns_dns_iter_init(struct ns_dns_iterator *, const char *, int);
+
+/*
+ * Decode the next record into `rr`.
+ *
+ * Questions come first, followed by answers; `rr->kind` tells them apart.
+ * Return 1 if a record was decoded, 0 when there are no more records, or -1
+ * if the packet is malformed. All bounds are checked against the packet.
+ *
+ * [source,c]
+ * ----
+ * struct ns_dns_iterator it;
+ * struct ns_dns_resource_record rr;
+ * struct in_addr ina;
+ *
+ * ns_dns_iter_init(&it, buf, len);
+ * while (ns_dns_iter_next(&it, &rr) > 0) {
+ *   if (rr.kind == NS_DNS_ANSWER && rr.rtype == NS_DNS_A_RECORD &&
+ *       ns_dns_name_cmp(&it.pkt, &rr.name, "www.cesanta.com") == 0) {
+ *     ns_dns_iter_record_data(&it, &rr, &ina, sizeof(ina));
+ *   }
+ * }
+ * ----
+ */
+int ns_dns_iter_next(struct ns_dns_iterator *, struct ns_dns_resource_record *);
+
+/*
+ * Same as `ns_dns_parse_record_data()`, for records decoded by an iterator.
+ */
+int ns_dns_iter_record_data(struct ns_dns_iterator *,
+                            struct ns_dns_resource_record *, void *, size_t);
+
+/*
+ * Same as `ns_dns_uncompress_name()`, for records decoded by an iterator.
+ */
+size_t ns_dns_iter_uncompress_name(struct ns_dns_iterator *, struct ns_str *,
+                                   char *, int);
+
+/*
+ * Compare a (possibly compressed) DNS name stored in packet `pkt` with the
+ * dotted name `want`, without uncompressing it into a buffer.
+ *
+ * The comparison is case-insensitive, as per RFC 1035.
+ * Return 0 if names are equal, non-zero otherwise or if `name` is malformed.
+ */
+int ns_dns_name_cmp(const struct ns_str *pkt, const struct ns_str *name,
+                    const char *want);
+
 /*
  * Attach built-in DNS event handler to the given listening connection.
  *
@@ -2186,13 +3190,15 @@ struct ns_dns_reply {
   struct ns_dns_message *msg;
   struct mbuf *io;
   size_t start;
+  struct ns_dns_name_table names; /* Used to compress answer names */
 };
 
 /*
  * Create a DNS reply.
  *
  * The reply will be based on an existing query message `msg`.
- * The query body will be appended to the output buffer.
+ * A placeholder header and the query body will be appended to the output
+ * buffer.
  * "reply + recursion allowed" will be added to the message flags and
  * message's num_answers will be set to 0.
  *
@@ -2225,6 +3231,9 @@ struct ns_dns_reply ns_dns_create_reply(struct mbuf *, struct ns_dns_message *);
  * The message num_answers field will be incremented. It's caller's duty
  * to ensure num_answers is propertly initialized.
  *
+ * Record names (and CNAME data) are compressed against the names already
+ * present in the reply, so repeated names take only two bytes.
+ *
  * Returns -1 on error.
  */
 int ns_dns_reply_record(struct ns_dns_reply *, struct ns_dns_resource_record *,
@@ -2244,6 +3253,125 @@ int ns_dns_reply_record(struct ns_dns_reply *, struct ns_dns_resource_record *,
  */
 int ns_dns_send_reply(struct ns_connection *, struct ns_dns_reply *);
 
+/*
+ * === mDNS / DNS-SD responder
+ */
+
+#define NS_MDNS_PORT 5353
+#define NS_MDNS_DEFAULT_TTL 120
+
+#define NS_MDNS_READY 110    /* NULL */
+#define NS_MDNS_CONFLICT 111 /* const char *: name claimed by another host */
+#define NS_MDNS_RECORD 112   /* struct ns_mdns_record *: new peer record */
+
+#ifndef NS_MDNS_CACHE_SIZE
+#define NS_MDNS_CACHE_SIZE 16
+#endif
+
+#ifndef NS_MDNS_MAX_NAME_LEN
+#define NS_MDNS_MAX_NAME_LEN 128
+#endif
+
+/* DNS-SD service announced by the responder. */
+struct ns_mdns_service {
+  const char *instance; /* Instance name, e.g. "Kitchen light", no dots */
+  const char *type;     /* Service type, e.g. "_http._tcp.local" */
+  uint16_t port;        /* Service port, host byte order */
+  const char *txt;      /* Encoded TXT data, e.g. "\x06path=/", or NULL */
+  size_t txt_len;
+};
+
+/* Peer record learned from the network. */
+struct ns_mdns_record {
+  char name[NS_MDNS_MAX_NAME_LEN];
+  int rtype;
+  int ttl;       /* TTL as announced by the peer */
+  time_t expire; /* Expiration time, 0 if the slot is free */
+  size_t rdata_len;
+  /* Decoded as per `ns_dns_parse_record_data()`, raw for other types */
+  char rdata[NS_MDNS_MAX_NAME_LEN + 6];
+};
+
+/* mDNS responder state. */
+struct ns_mdns {
+  const char *host;                 /* Host name, e.g. "device.local" */
+  struct in_addr addr;              /* Address announced for `host` */
+  struct ns_mdns_service *services; /* Services announced for `host` */
+  int num_services;
+  int ttl;         /* TTL of our records, NS_MDNS_DEFAULT_TTL if 0 */
+  void *user_data; /* User data */
+
+  /* Private */
+  struct ns_connection *nc; /* Listening connection */
+  int state;                /* Probing, announcing or ready */
+  int count;                /* Packets sent in the current state */
+  time_t next;              /* When to send the next probe or announcement */
+  struct ns_mdns_record cache[NS_MDNS_CACHE_SIZE];
+};
+
+/*
+ * Start an mDNS responder.
+ *
+ * `address` is the UDP port to listen on, e.g. `udp://:5353`. If it contains
+ * an IP address, it selects the interface used to join the 224.0.0.251
+ * multicast group (e.g. `udp://127.0.0.1:5353` to stay on loopback).
+ *
+ * The fields of `mdns` up to `user_data` must be filled by the caller, and
+ * `mdns` must stay valid while the connection is open. If `host` is NULL,
+ * the responder only queries and caches peer records.
+ *
+ * Otherwise it probes for its unique names (the host and the service
+ * instances), announces its records, answers queries for them and says
+ * goodbye when the connection is closed. Answers already known by the
+ * querier (known-answer suppression) are not sent. Responses are multicast,
+ * except for legacy unicast queries coming from ports other than the mDNS
+ * one. The simultaneous probe tiebreaker is not implemented, and timers have
+ * a one second resolution.
+ *
+ * The handler receives the connection's `user_data` pointing to `mdns`,
+ * the low-level events, and:
+ *
+ * - `NS_MDNS_READY` once announcing is done.
+ * - `NS_MDNS_CONFLICT` when another host claims one of our names with
+ *   different data. The handler can change the names; probing restarts
+ *   automatically.
+ * - `NS_MDNS_RECORD` when a new peer record is cached.
+ */
+struct ns_connection *ns_mdns_bind(struct ns_mgr *, const char *address,
+                                   ns_event_handler_t, struct ns_mdns *);
+
+/*
+ * Restart probing and announcing, e.g. after changing host name or services.
+ */
+void ns_mdns_announce(struct ns_mdns *);
+
+/*
+ * Send a multicast query for `name` and record type `rtype`.
+ *
+ * Cached records that are still fresh are included as known answers, so that
+ * peers don't repeat them. Answers are stored in the cache.
+ *
+ * Return -1 on error.
+ */
+int ns_mdns_query(struct ns_mdns *, const char *name, int rtype);
+
+/*
+ * Iterate over cached peer records matching `name` (any if NULL) and
+ * `rtype` (any if NS_DNS_ANY_RECORD). Expired records are skipped.
+ *
+ * [source,c]
+ * ----
+ * struct ns_mdns_record *r = NULL;
+ * while ((r = ns_mdns_next_record(mdns, "_http._tcp.local",
+ *                                 NS_DNS_PTR_RECORD, r)) != NULL) {
+ *   printf("%s\n", r->rdata);
+ * }
+ * ----
+ */
+struct ns_mdns_record *ns_mdns_next_record(struct ns_mdns *, const char *name,
+                                           int rtype,
+                                           struct ns_mdns_record *prev);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -10,21 +10,33 @@
 struct ns_dns_reply ns_dns_create_reply(struct mbuf *io,
                                         struct ns_dns_message *msg) {
   struct ns_dns_reply rep;
+  int i;
   rep.msg = msg;
   rep.io = io;
   rep.start = io->len;
 
   /* reply + recursion allowed */
   msg->flags |= 0x8080;
+
+  /*
+   * Reserve room for the header, it's filled in by ns_dns_send_reply().
+   * Having it in place lets answers point to names in the question section.
+   */
+  ns_dns_insert_header(io, io->len, msg);
   ns_dns_copy_body(io, msg);
 
+  ns_dns_name_table_init(&rep.names, rep.start);
+  for (i = 0; i < msg->num_questions; i++) {
+    ns_dns_name_table_add(&rep.names, msg->questions[i].name.p - msg->pkt.p);
+  }
+
   msg->num_answers = 0;
   return rep;
 }
 
 int ns_dns_send_reply(struct ns_connection *nc, struct ns_dns_reply *r) {
   size_t sent = r->io->len - r->start;
-  ns_dns_insert_header(r->io, r->start, r->msg);
+  ns_dns_update_header(r->io, r->start, r->msg);
   if (!(nc->flags & NSF_UDP)) {
     uint16_t len = htons(sent);
     mbuf_insert(r->io, r->start, &len, 2);
@@ -59,8 +71,8 @@ int ns_dns_reply_record(struct ns_dns_reply *reply,
   ans->rtype = rtype;
   ans->ttl = ttl;
 
-  if (ns_dns_encode_record(reply->io, ans, name, strlen(name), rdata,
-                           rdata_len) == -1) {
+  if (ns_dns_encode_record_compressed(reply->io, &reply->names, ans, name,
+                                      strlen(name), rdata, rdata_len) == -1) {
     return -1; /* LCOV_EXCL_LINE */
   };
 
@@ -68,4 +80,566 @@ int ns_dns_reply_record(struct ns_dns_reply *reply,
   return 0;
 }
 
+#define NS_MDNS_GROUP 0xe00000fb /* 224.0.0.251 */
+#define NS_MDNS_NUM_PROBES 3
+#define NS_MDNS_NUM_ANNOUNCEMENTS 2
+#define NS_MDNS_CACHE_FLUSH 0x8000 /* rclass bit of unique records */
+#define NS_MDNS_SERVICES "_services._dns-sd._udp.local"
+
+/* glibc hides struct ip_mreq with _XOPEN_SOURCE, its layout is standard */
+struct ns_mdns_mreq {
+  struct in_addr imr_multiaddr;
+  struct in_addr imr_interface;
+};
+
+enum ns_mdns_state { NS_MDNS_PROBING, NS_MDNS_ANNOUNCING, NS_MDNS_IDLE };
+
+/* One of our own records, generated on the fly from `struct ns_mdns` */
+struct ns_mdns_rr {
+  char name[NS_MDNS_MAX_NAME_LEN];
+  int rtype;
+  int unique; /* Nobody else can have records with this name and type */
+  int service; /* Index of the service, or -1 for the host record */
+  const char *rdata;
+  size_t rdata_len;
+  char buf[NS_MDNS_MAX_NAME_LEN + 6]; /* Storage for `rdata` */
+};
+
+/*
+ * Generate the `i`-th record we're authoritative for: the host A record,
+ * then service enumeration PTR, PTR, SRV and TXT records of each service.
+ * Return 0 if there is no such record.
+ */
+static int ns_mdns_own_record(struct ns_mdns *mdns, int i,
+                              struct ns_mdns_rr *rr) {
+  struct ns_mdns_service *svc;
+
+  if (mdns->host == NULL) {
+    return 0;
+  } else if (i == 0) {
+    snprintf(rr->name, sizeof(rr->name), "%s", mdns->host);
+    rr->rtype = NS_DNS_A_RECORD;
+    rr->unique = 1;
+    rr->service = -1;
+    rr->rdata = (const char *) &mdns->addr;
+    rr->rdata_len = sizeof(mdns->addr);
+    return 1;
+  } else if ((i - 1) / 4 >= mdns->num_services) {
+    return 0;
+  }
+
+  rr->service = (i - 1) / 4;
+  svc = &mdns->services[rr->service];
+  rr->rdata = rr->buf;
+  switch ((i - 1) % 4) {
+    case 0:
+      snprintf(rr->name, sizeof(rr->name), "%s", NS_MDNS_SERVICES);
+      snprintf(rr->buf, sizeof(rr->buf), "%s", svc->type);
+      rr->rtype = NS_DNS_PTR_RECORD;
+      rr->unique = 0;
+      rr->rdata_len = strlen(rr->buf);
+      break;
+    case 1:
+      snprintf(rr->name, sizeof(rr->name), "%s", svc->type);
+      snprintf(rr->buf, sizeof(rr->buf), "%s.%s", svc->instance, svc->type);
+      rr->rtype = NS_DNS_PTR_RECORD;
+      rr->unique = 0;
+      rr->rdata_len = strlen(rr->buf);
+      break;
+    case 2:
+      snprintf(rr->name, sizeof(rr->name), "%s.%s", svc->instance, svc->type);
+      /* Priority and weight are 0 */
+      memset(rr->buf, 0, 4);
+      rr->buf[4] = svc->port >> 8;
+      rr->buf[5] = svc->port & 0xff;
+      snprintf(rr->buf + 6, sizeof(rr->buf) - 6, "%s", mdns->host);
+      rr->rtype = NS_DNS_SRV_RECORD;
+      rr->unique = 1;
+      rr->rdata_len = 6 + strlen(rr->buf + 6);
+      break;
+    default:
+      snprintf(rr->name, sizeof(rr->name), "%s.%s", svc->instance, svc->type);
+      rr->rtype = NS_DNS_TXT_RECORD;
+      rr->unique = 1;
+      if (svc->txt != NULL) {
+        rr->rdata = svc->txt;
+        rr->rdata_len = svc->txt_len;
+      } else {
+        /* TXT record must contain at least one (empty) string */
+        rr->buf[0] = '\0';
+        rr->rdata_len = 1;
+      }
+      break;
+  }
+  return 1;
+}
+
+/* Return 1 if the record `rr` decoded from `it` has the same data as `own` */
+static int ns_mdns_same_data(struct ns_dns_iterator *it,
+                             struct ns_dns_resource_record *rr,
+                             const char *rdata, size_t rdata_len, int rtype) {
+  struct ns_str name = rr->rdata;
+
+  switch (rtype) {
+    case NS_DNS_PTR_RECORD:
+    case NS_DNS_CNAME_RECORD:
+      return ns_dns_name_cmp(&it->pkt, &name, rdata) == 0;
+    case NS_DNS_SRV_RECORD:
+      if (name.len < 7 || memcmp(name.p, rdata, 6) != 0) {
+        return 0;
+      }
+      name.p += 6;
+      name.len -= 6;
+      return ns_dns_name_cmp(&it->pkt, &name, rdata + 6) == 0;
+    default:
+      return rr->rdata.len == rdata_len &&
+             memcmp(rr->rdata.p, rdata, rdata_len) == 0;
+  }
+}
+
+/* Start a new outgoing packet, the header is filled by ns_mdns_finish() */
+static void ns_mdns_begin(struct mbuf *io, struct ns_dns_name_table *names) {
+  static const char header[12] = {0};
+  mbuf_init(io, 512);
+  mbuf_append(io, header, sizeof(header));
+  ns_dns_name_table_init(names, 0);
+}
+
+static void ns_mdns_finish(struct mbuf *io, uint16_t id, uint16_t flags,
+                           int num_questions, int num_answers) {
+  uint16_t header[4];
+
+  /* Authority and additional counts stay 0 */
+  header[0] = id;
+  header[1] = htons(flags);
+  header[2] = htons(num_questions);
+  header[3] = htons(num_answers);
+  memcpy(io->buf, header, sizeof(header));
+}
+
+static int ns_mdns_encode(struct mbuf *io, struct ns_dns_name_table *names,
+                          enum ns_dns_resource_record_kind kind, int rtype,
+                          int rclass, int ttl, const char *name,
+                          const char *rdata, size_t rdata_len) {
+  struct ns_dns_resource_record rr;
+
+  memset(&rr, 0, sizeof(rr));
+  rr.kind = kind;
+  rr.rtype = rtype;
+  rr.rclass = rclass;
+  rr.ttl = ttl;
+  return ns_dns_encode_record_compressed(io, names, &rr, name, strlen(name),
+                                         rdata, rdata_len);
+}
+
+/* Send a packet to the multicast group through the listening connection */
+static void ns_mdns_send(struct ns_mdns *mdns, struct mbuf *io) {
+  struct ns_connection *nc = mdns->nc;
+  union socket_address sa = nc->sa;
+
+  nc->sa.sin.sin_family = AF_INET;
+  nc->sa.sin.sin_addr.s_addr = htonl(NS_MDNS_GROUP);
+  ns_send(nc, io->buf, io->len);
+  nc->sa = sa;
+}
+
+static int ns_mdns_ttl(struct ns_mdns *mdns) {
+  return mdns->ttl > 0 ? mdns->ttl : NS_MDNS_DEFAULT_TTL;
+}
+
+/* Send all our records with the given TTL: announcement or goodbye */
+static void ns_mdns_send_records(struct ns_mdns *mdns, int ttl) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    if (ns_mdns_encode(&io, &names, NS_DNS_ANSWER, rr.rtype,
+                       rr.unique ? 1 | NS_MDNS_CACHE_FLUSH : 1, ttl, rr.name,
+                       rr.rdata, rr.rdata_len) > 0) {
+      n++;
+    }
+  }
+  /* response + authoritative answer */
+  ns_mdns_finish(&io, 0, 0x8400, 0, n);
+  if (n > 0) {
+    ns_mdns_send(mdns, &io);
+  }
+  mbuf_free(&io);
+}
+
+/* Ask whether anybody else uses our unique names */
+static void ns_mdns_send_probe(struct ns_mdns *mdns) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    /* A and SRV records carry the host and the service instance names */
+    if ((rr.rtype == NS_DNS_A_RECORD || rr.rtype == NS_DNS_SRV_RECORD) &&
+        ns_mdns_encode(&io, &names, NS_DNS_QUESTION, NS_DNS_ANY_RECORD, 1, 0,
+                       rr.name, NULL, 0) > 0) {
+      n++;
+    }
+  }
+  ns_mdns_finish(&io, 0, 0, n, 0);
+  ns_mdns_send(mdns, &io);
+  mbuf_free(&io);
+}
+
+static void ns_mdns_tick(struct ns_mdns *mdns, time_t now) {
+  if (mdns->nc == NULL || mdns->state == NS_MDNS_IDLE || now < mdns->next) {
+    return;
+  }
+
+  if (mdns->state == NS_MDNS_PROBING) {
+    if (mdns->count < NS_MDNS_NUM_PROBES) {
+      ns_mdns_send_probe(mdns);
+      mdns->count++;
+      mdns->next = now + 1;
+      return;
+    }
+    /* Nobody objected, the names are ours */
+    mdns->state = NS_MDNS_ANNOUNCING;
+    mdns->count = 0;
+  }
+
+  ns_mdns_send_records(mdns, ns_mdns_ttl(mdns));
+  mdns->next = now + (1 << mdns->count);
+  if (++mdns->count >= NS_MDNS_NUM_ANNOUNCEMENTS) {
+    mdns->state = NS_MDNS_IDLE;
+    mdns->nc->handler(mdns->nc, NS_MDNS_READY, NULL);
+  }
+}
+
+/* Return 1 if a question in the packet asks for `rr` */
+static int ns_mdns_is_asked(struct ns_dns_iterator *q, struct ns_mdns_rr *rr) {
+  struct ns_dns_iterator it = *q;
+  struct ns_dns_resource_record qr;
+
+  while (ns_dns_iter_next(&it, &qr) > 0 && qr.kind == NS_DNS_QUESTION) {
+    if ((qr.rtype == rr->rtype || qr.rtype == NS_DNS_ANY_RECORD) &&
+        ns_dns_name_cmp(&it.pkt, &qr.name, rr->name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Return 1 if the querier already has `rr` with at least half of its TTL */
+static int ns_mdns_is_known(struct ns_mdns *mdns, struct ns_dns_iterator *q,
+                            struct ns_mdns_rr *rr) {
+  struct ns_dns_iterator it = *q;
+  struct ns_dns_resource_record ar;
+
+  while (ns_dns_iter_next(&it, &ar) > 0) {
+    if (ar.kind == NS_DNS_ANSWER && ar.rtype == rr->rtype &&
+        ar.ttl >= ns_mdns_ttl(mdns) / 2 &&
+        ns_dns_name_cmp(&it.pkt, &ar.name, rr->name) == 0 &&
+        ns_mdns_same_data(&it, &ar, rr->rdata, rr->rdata_len, rr->rtype)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return 1 if `rr` should be in the answer: either asked directly, or an
+ * SRV, TXT or A record completing an asked service PTR record not yet known
+ * by the querier.
+ */
+static int ns_mdns_is_wanted(struct ns_mdns *mdns, struct ns_dns_iterator *q,
+                             struct ns_mdns_rr *rr) {
+  struct ns_mdns_rr ptr;
+  int i;
+
+  if (ns_mdns_is_asked(q, rr)) {
+    return 1;
+  } else if (rr->rtype != NS_DNS_A_RECORD && rr->rtype != NS_DNS_SRV_RECORD &&
+             rr->rtype != NS_DNS_TXT_RECORD) {
+    return 0;
+  }
+  for (i = 0; i < mdns->num_services; i++) {
+    if ((rr->service == -1 || rr->service == i) &&
+        ns_mdns_own_record(mdns, 2 + i * 4, &ptr) &&
+        ns_mdns_is_asked(q, &ptr) && !ns_mdns_is_known(mdns, q, &ptr)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void ns_mdns_answer(struct ns_connection *nc, struct ns_mdns *mdns,
+                           struct ns_dns_iterator *q) {
+  struct ns_mdns_rr rr;
+  struct ns_dns_name_table names;
+  struct mbuf io;
+  int i, n = 0, ttl = ns_mdns_ttl(mdns);
+  int legacy = nc->sa.sin.sin_port != mdns->nc->sa.sin.sin_port;
+
+  /* Legacy resolvers get short lived records */
+  if (legacy && ttl > 10) ttl = 10;
+
+  ns_mdns_begin(&io, &names);
+  for (i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+    if (ns_mdns_is_wanted(mdns, q, &rr) && !ns_mdns_is_known(mdns, q, &rr) &&
+        ns_mdns_encode(&io, &names, NS_DNS_ANSWER, rr.rtype,
+                       rr.unique && !legacy ? 1 | NS_MDNS_CACHE_FLUSH : 1, ttl,
+                       rr.name, rr.rdata, rr.rdata_len) > 0) {
+      n++;
+    }
+  }
+
+  if (n > 0) {
+    ns_mdns_finish(&io, legacy ? q->transaction_id : 0, 0x8400, 0, n);
+    if (legacy) {
+      ns_send(nc, io.buf, io.len);
+    } else {
+      ns_mdns_send(mdns, &io);
+    }
+  }
+  mbuf_free(&io);
+}
+
+static int ns_mdns_same_record(struct ns_mdns_record *a,
+                               struct ns_mdns_record *b) {
+  return a->rtype == b->rtype && a->rdata_len == b->rdata_len &&
+         ns_casecmp(a->name, b->name) == 0 &&
+         memcmp(a->rdata, b->rdata, a->rdata_len) == 0;
+}
+
+static void ns_mdns_cache_add(struct ns_mdns *mdns, struct ns_dns_iterator *it,
+                              struct ns_dns_resource_record *rr, time_t now) {
+  struct ns_mdns_record rec, *r, *found = NULL, *slot = NULL;
+
+  memset(&rec, 0, sizeof(rec));
+  ns_dns_iter_uncompress_name(it, &rr->name, rec.name, sizeof(rec.name) - 1);
+  rec.rtype = rr->rtype;
+  rec.ttl = rr->ttl;
+  rec.expire = now + rr->ttl;
+
+  switch (rr->rtype) {
+    case NS_DNS_PTR_RECORD:
+    case NS_DNS_CNAME_RECORD:
+    case NS_DNS_SRV_RECORD:
+      if (ns_dns_iter_record_data(it, rr, rec.rdata, sizeof(rec.rdata) - 1) ==
+          -1) {
+        return;
+      }
+      rec.rdata_len = rr->rtype == NS_DNS_SRV_RECORD
+                          ? 6 + strlen(rec.rdata + 6)
+                          : strlen(rec.rdata);
+      break;
+    default:
+      if (rr->rdata.len > sizeof(rec.rdata)) {
+        return;
+      }
+      memcpy(rec.rdata, rr->rdata.p, rr->rdata.len);
+      rec.rdata_len = rr->rdata.len;
+      break;
+  }
+
+  for (r = mdns->cache; r < mdns->cache + ARRAY_SIZE(mdns->cache); r++) {
+    if (r->expire <= now) {
+      r->expire = 0;
+    } else if (ns_mdns_same_record(r, &rec)) {
+      found = r;
+    } else if ((rr->rclass & NS_MDNS_CACHE_FLUSH) && r->rtype == rec.rtype &&
+               ns_casecmp(r->name, rec.name) == 0 && r->expire - r->ttl < now) {
+      /* Unique record: forget stale data, but keep the rest of this packet */
+      r->expire = 0;
+    }
+    /* Reuse a free slot, or evict the one closest to expiration */
+    if (slot == NULL || (slot->expire != 0 && r->expire < slot->expire)) {
+      slot = r;
+    }
+  }
+
+  if (found != NULL) {
+    /* Refresh, or expire a goodbye */
+    found->ttl = rec.ttl;
+    found->expire = rr->ttl == 0 ? 0 : rec.expire;
+  } else if (rr->ttl > 0) {
+    *slot = rec;
+    mdns->nc->handler(mdns->nc, NS_MDNS_RECORD, slot);
+  }
+}
+
+/*
+ * Check a response for records conflicting with ours, and cache the others.
+ * Return 1 if there was a conflict.
+ */
+static int ns_mdns_handle_response(struct ns_mdns *mdns,
+                                   struct ns_dns_iterator *it, time_t now) {
+  struct ns_dns_resource_record ar;
+  struct ns_mdns_rr rr;
+  int i, own;
+
+  while (ns_dns_iter_next(it, &ar) > 0) {
+    if (ar.kind != NS_DNS_ANSWER) continue;
+
+    for (own = i = 0; ns_mdns_own_record(mdns, i, &rr); i++) {
+      if (ar.rtype != rr.rtype ||
+          ns_dns_name_cmp(&it->pkt, &ar.name, rr.name) != 0) {
+        continue;
+      } else if (ns_mdns_same_data(it, &ar, rr.rdata, rr.rdata_len,
+                                   rr.rtype)) {
+        own = 1; /* Our own packet, or somebody agreeing with us */
+        break;
+      } else if (rr.unique && ar.ttl > 0) {
+        mdns->nc->handler(mdns->nc, NS_MDNS_CONFLICT, rr.name);
+        return 1;
+      }
+    }
+
+    if (!own) {
+      ns_mdns_cache_add(mdns, it, &ar, now);
+    }
+  }
+  return 0;
+}
+
+static void ns_mdns_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct ns_mdns *mdns = (struct ns_mdns *) nc->user_data;
+  struct ns_dns_iterator it;
+  time_t now = time(NULL);
+
+  /* Pass low-level events to the user handler */
+  nc->handler(nc, ev, ev_data);
+
+  switch (ev) {
+    case NS_RECV:
+      if (ns_dns_iter_init(&it, nc->recv_mbuf.buf, nc->recv_mbuf.len) == 0) {
+        if (!(it.flags & 0x8000)) {
+          /* Don't answer before our names are confirmed */
+          if (mdns->state != NS_MDNS_PROBING) {
+            ns_mdns_answer(nc, mdns, &it);
+          }
+        } else if (ns_mdns_handle_response(mdns, &it, now)) {
+          /* Names might have been changed by the handler, probe them */
+          ns_mdns_announce(mdns);
+          mdns->next = now + 1;
+        }
+      }
+      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+      /* Busy sockets don't get NS_POLL, so timers are checked here too */
+      ns_mdns_tick(mdns, now);
+      break;
+    case NS_POLL:
+      ns_mdns_tick(mdns, now);
+      break;
+    case NS_CLOSE:
+      if (nc == mdns->nc) {
+        if (mdns->state == NS_MDNS_IDLE) {
+          ns_mdns_send_records(mdns, 0);
+        }
+        mdns->nc = NULL;
+      }
+      break;
+  }
+}
+
+struct ns_connection *ns_mdns_bind(struct ns_mgr *mgr, const char *address,
+                                   ns_event_handler_t handler,
+                                   struct ns_mdns *mdns) {
+  struct ns_connection *nc;
+  union socket_address sa;
+  struct ns_mdns_mreq mreq;
+  char host[NS_MAX_HOST_LEN], addr[50];
+  int proto, loop = 1;
+
+  /* Listen on all addresses, the IP only selects the interface */
+  if (ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0 ||
+      proto != SOCK_DGRAM || sa.sa.sa_family != AF_INET) {
+    return NULL;
+  }
+  snprintf(addr, sizeof(addr), "udp://:%d", (int) ntohs(sa.sin.sin_port));
+  if ((nc = ns_bind(mgr, addr, handler)) == NULL) {
+    return NULL;
+  }
+
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_multiaddr.s_addr = htonl(NS_MDNS_GROUP);
+  mreq.imr_interface = sa.sin.sin_addr;
+  if (setsockopt(nc->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq,
+                 sizeof(mreq)) != 0 ||
+      setsockopt(nc->sock, IPPROTO_IP, IP_MULTICAST_IF,
+                 (char *) &sa.sin.sin_addr, sizeof(sa.sin.sin_addr)) != 0 ||
+      setsockopt(nc->sock, IPPROTO_IP, IP_MULTICAST_LOOP, (char *) &loop,
+                 sizeof(loop)) != 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return NULL;
+  }
+
+  memset(mdns->cache, 0, sizeof(mdns->cache));
+  mdns->nc = nc;
+  nc->user_data = mdns;
+  nc->proto_handler = ns_mdns_handler;
+  ns_mdns_announce(mdns);
+
+  return nc;
+}
+
+void ns_mdns_announce(struct ns_mdns *mdns) {
+  mdns->state = mdns->host == NULL ? NS_MDNS_IDLE : NS_MDNS_PROBING;
+  mdns->count = 0;
+  mdns->next = 0;
+}
+
+int ns_mdns_query(struct ns_mdns *mdns, const char *name, int rtype) {
+  struct ns_dns_name_table names;
+  struct ns_mdns_record *r = NULL;
+  struct mbuf io;
+  time_t now = time(NULL);
+  int n = 0;
+
+  if (mdns->nc == NULL) {
+    return -1;
+  }
+
+  ns_mdns_begin(&io, &names);
+  if (ns_mdns_encode(&io, &names, NS_DNS_QUESTION, rtype, 1, 0, name, NULL,
+                     0) == -1) {
+    mbuf_free(&io);
+    return -1;
+  }
+
+  /* Known answers: cached records with more than half of their TTL left */
+  while ((r = ns_mdns_next_record(mdns, name, rtype, r)) != NULL) {
+    if (r->expire - now > r->ttl / 2 &&
+        ns_mdns_encode(&io, &names, NS_DNS_ANSWER, r->rtype, 1,
+                       (int) (r->expire - now), r->name, r->rdata,
+                       r->rdata_len) > 0) {
+      n++;
+    }
+  }
+
+  ns_mdns_finish(&io, 0, 0, 1, n);
+  ns_mdns_send(mdns, &io);
+  mbuf_free(&io);
+  return 0;
+}
+
+struct ns_mdns_record *ns_mdns_next_record(struct ns_mdns *mdns,
+                                           const char *name, int rtype,
+                                           struct ns_mdns_record *prev) {
+  struct ns_mdns_record *r;
+  time_t now = time(NULL);
+
+  for (r = prev == NULL ? mdns->cache : prev + 1;
+       r < mdns->cache + ARRAY_SIZE(mdns->cache); r++) {
+    if (r->expire <= now) {
+      r->expire = 0;
+    } else if ((rtype == NS_DNS_ANY_RECORD || r->rtype == rtype) &&
+               (name == NULL || ns_casecmp(r->name, name) == 0)) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
 #endif /* NS_ENABLE_DNS_SERVER */
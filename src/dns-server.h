@@ -26,13 +26,15 @@ struct ns_dns_reply {
   struct ns_dns_message *msg;
   struct mbuf *io;
   size_t start;
+  struct ns_dns_name_table names; /* Used to compress answer names */
 };
 
 /*
  * Create a DNS reply.
  *
  * The reply will be based on an existing query message `msg`.
- * The query body will be appended to the output buffer.
+ * A placeholder header and the query body will be appended to the output
+ * buffer.
  * "reply + recursion allowed" will be added to the message flags and
  * message's num_answers will be set to 0.
  *
@@ -65,6 +67,9 @@ struct ns_dns_reply ns_dns_create_reply(struct mbuf *, struct ns_dns_message *);
  * The message num_answers field will be incremented. It's caller's duty
  * to ensure num_answers is propertly initialized.
  *
+ * Record names (and CNAME data) are compressed against the names already
+ * present in the reply, so repeated names take only two bytes.
+ *
  * Returns -1 on error.
  */
 int ns_dns_reply_record(struct ns_dns_reply *, struct ns_dns_resource_record *,
@@ -84,6 +89,125 @@ int ns_dns_reply_record(struct ns_dns_reply *, struct ns_dns_resource_record *,
  */
 int ns_dns_send_reply(struct ns_connection *, struct ns_dns_reply *);
 
+/*
+ * === mDNS / DNS-SD responder
+ */
+
+#define NS_MDNS_PORT 5353
+#define NS_MDNS_DEFAULT_TTL 120
+
+#define NS_MDNS_READY 110    /* NULL */
+#define NS_MDNS_CONFLICT 111 /* const char *: name claimed by another host */
+#define NS_MDNS_RECORD 112   /* struct ns_mdns_record *: new peer record */
+
+#ifndef NS_MDNS_CACHE_SIZE
+#define NS_MDNS_CACHE_SIZE 16
+#endif
+
+#ifndef NS_MDNS_MAX_NAME_LEN
+#define NS_MDNS_MAX_NAME_LEN 128
+#endif
+
+/* DNS-SD service announced by the responder. */
+struct ns_mdns_service {
+  const char *instance; /* Instance name, e.g. "Kitchen light", no dots */
+  const char *type;     /* Service type, e.g. "_http._tcp.local" */
+  uint16_t port;        /* Service port, host byte order */
+  const char *txt;      /* Encoded TXT data, e.g. "\x06path=/", or NULL */
+  size_t txt_len;
+};
+
+/* Peer record learned from the network. */
+struct ns_mdns_record {
+  char name[NS_MDNS_MAX_NAME_LEN];
+  int rtype;
+  int ttl;       /* TTL as announced by the peer */
+  time_t expire; /* Expiration time, 0 if the slot is free */
+  size_t rdata_len;
+  /* Decoded as per `ns_dns_parse_record_data()`, raw for other types */
+  char rdata[NS_MDNS_MAX_NAME_LEN + 6];
+};
+
+/* mDNS responder state. */
+struct ns_mdns {
+  const char *host;                 /* Host name, e.g. "device.local" */
+  struct in_addr addr;              /* Address announced for `host` */
+  struct ns_mdns_service *services; /* Services announced for `host` */
+  int num_services;
+  int ttl;         /* TTL of our records, NS_MDNS_DEFAULT_TTL if 0 */
+  void *user_data; /* User data */
+
+  /* Private */
+  struct ns_connection *nc; /* Listening connection */
+  int state;                /* Probing, announcing or ready */
+  int count;                /* Packets sent in the current state */
+  time_t next;              /* When to send the next probe or announcement */
+  struct ns_mdns_record cache[NS_MDNS_CACHE_SIZE];
+};
+
+/*
+ * Start an mDNS responder.
+ *
+ * `address` is the UDP port to listen on, e.g. `udp://:5353`. If it contains
+ * an IP address, it selects the interface used to join the 224.0.0.251
+ * multicast group (e.g. `udp://127.0.0.1:5353` to stay on loopback).
+ *
+ * The fields of `mdns` up to `user_data` must be filled by the caller, and
+ * `mdns` must stay valid while the connection is open. If `host` is NULL,
+ * the responder only queries and caches peer records.
+ *
+ * Otherwise it probes for its unique names (the host and the service
+ * instances), announces its records, answers queries for them and says
+ * goodbye when the connection is closed. Answers already known by the
+ * querier (known-answer suppression) are not sent. Responses are multicast,
+ * except for legacy unicast queries coming from ports other than the mDNS
+ * one. The simultaneous probe tiebreaker is not implemented, and timers have
+ * a one second resolution.
+ *
+ * The handler receives the connection's `user_data` pointing to `mdns`,
+ * the low-level events, and:
+ *
+ * - `NS_MDNS_READY` once announcing is done.
+ * - `NS_MDNS_CONFLICT` when another host claims one of our names with
+ *   different data. The handler can change the names; probing restarts
+ *   automatically.
+ * - `NS_MDNS_RECORD` when a new peer record is cached.
+ */
+struct ns_connection *ns_mdns_bind(struct ns_mgr *, const char *address,
+                                   ns_event_handler_t, struct ns_mdns *);
+
+/*
+ * Restart probing and announcing, e.g. after changing host name or services.
+ */
+void ns_mdns_announce(struct ns_mdns *);
+
+/*
+ * Send a multicast query for `name` and record type `rtype`.
+ *
+ * Cached records that are still fresh are included as known answers, so that
+ * peers don't repeat them. Answers are stored in the cache.
+ *
+ * Return -1 on error.
+ */
+int ns_mdns_query(struct ns_mdns *, const char *name, int rtype);
+
+/*
+ * Iterate over cached peer records matching `name` (any if NULL) and
+ * `rtype` (any if NS_DNS_ANY_RECORD). Expired records are skipped.
+ *
+ * [source,c]
+ * ----
+ * struct ns_mdns_record *r = NULL;
+ * while ((r = ns_mdns_next_record(mdns, "_http._tcp.local",
+ *                                 NS_DNS_PTR_RECORD, r)) != NULL) {
+ *   printf("%s\n", r->rdata);
+ * }
+ * ----
+ */
+struct ns_mdns_record *ns_mdns_next_record(struct ns_mdns *, const char *name,
+                                           int rtype,
+                                           struct ns_mdns_record *prev);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -34,15 +34,128 @@ struct ns_dns_resource_record *ns_dns_next_record(
   return NULL;
 }
 
-int ns_dns_parse_record_data(struct ns_dns_message *msg,
-                             struct ns_dns_resource_record *rr, void *data,
-                             size_t data_len) {
+/*
+ * Follow at most that many compression pointers while walking a name,
+ * so that malicious pointer loops can't hang the parser.
+ */
+#define NS_DNS_MAX_NAME_POINTERS 16
+
+static size_t ns_dns_uncompress(const struct ns_str *pkt,
+                                const struct ns_str *name, char *dst,
+                                int dst_len) {
+  int chunk_len, pointers = 0;
+  char *old_dst = dst;
+  const unsigned char *data = (unsigned char *) name->p;
+  const unsigned char *end = (unsigned char *) pkt->p + pkt->len;
+
+  if (data >= end) {
+    return 0;
+  }
+
+  while ((chunk_len = *data++)) {
+    int leeway = dst_len - (dst - old_dst);
+    if (data >= end) {
+      return 0;
+    }
+
+    if (chunk_len & 0xc0) {
+      uint16_t off = (data[-1] & (~0xc0)) << 8 | data[0];
+      if (off >= pkt->len || ++pointers > NS_DNS_MAX_NAME_POINTERS) {
+        return 0;
+      }
+      data = (unsigned char *) pkt->p + off;
+      continue;
+    }
+    if (chunk_len > leeway) {
+      chunk_len = leeway;
+    }
+
+    if (data + chunk_len >= end) {
+      return 0;
+    }
+
+    memcpy(dst, data, chunk_len);
+    data += chunk_len;
+    dst += chunk_len;
+    leeway -= chunk_len;
+    if (leeway == 0) {
+      return dst - old_dst;
+    }
+    *dst++ = '.';
+  }
+
+  if (dst != old_dst) {
+    *--dst = 0;
+  }
+  return dst - old_dst;
+}
+
+static int ns_dns_name_ncmp(const struct ns_str *pkt, const struct ns_str *name,
+                            const char *want, size_t want_len) {
+  const unsigned char *start = (const unsigned char *) pkt->p;
+  const unsigned char *end = start + pkt->len;
+  const unsigned char *data = (const unsigned char *) name->p;
+  const char *want_end = want + want_len;
+  int chunk_len, i, pointers = 0, first = 1;
+
+  for (;;) {
+    if (data < start || data >= end) {
+      return -1;
+    }
+    if ((chunk_len = *data++) == 0) {
+      break;
+    }
+
+    if (chunk_len & 0xc0) {
+      if (data >= end || ++pointers > NS_DNS_MAX_NAME_POINTERS) {
+        return -1;
+      }
+      data = start + ((chunk_len & ~0xc0) << 8 | data[0]);
+      continue;
+    }
+
+    if (end - data < chunk_len) {
+      return -1;
+    }
+    if (!first && (want == want_end || *want++ != '.')) {
+      return 1;
+    }
+    if (want_end - want < chunk_len) {
+      return 1;
+    }
+    for (i = 0; i < chunk_len; i++) {
+      if (tolower((unsigned char) want[i]) != tolower(data[i])) {
+        return 1;
+      }
+    }
+    want += chunk_len;
+    data += chunk_len;
+    first = 0;
+  }
+
+  /* Fully qualified names can have a trailing dot */
+  if (want_end - want == 1 && *want == '.' && !first) want++;
+  return want == want_end ? 0 : 1;
+}
+
+int ns_dns_name_cmp(const struct ns_str *pkt, const struct ns_str *name,
+                    const char *want) {
+  return ns_dns_name_ncmp(pkt, name, want, strlen(want));
+}
+
+static int ns_dns_parse_rdata(const struct ns_str *pkt,
+                              struct ns_dns_resource_record *rr, void *data,
+                              size_t data_len) {
+  if (rr->kind != NS_DNS_ANSWER) {
+    return -1;
+  }
+
   switch (rr->rtype) {
     case NS_DNS_A_RECORD:
       if (data_len < sizeof(struct in_addr)) {
         return -1;
       }
-      if (rr->rdata.p + data_len > msg->pkt.p + msg->pkt.len) {
+      if (rr->rdata.p + data_len > pkt->p + pkt->len) {
         return -1;
       }
       memcpy(data, rr->rdata.p, data_len);
@@ -52,67 +165,190 @@ int ns_dns_parse_record_data(struct ns_dns_message *msg,
       if (data_len < sizeof(struct in6_addr)) {
         return -1; /* LCOV_EXCL_LINE */
       }
+      if (rr->rdata.p + data_len > pkt->p + pkt->len) {
+        return -1;
+      }
       memcpy(data, rr->rdata.p, data_len);
       return 0;
 #endif
     case NS_DNS_CNAME_RECORD:
-      ns_dns_uncompress_name(msg, &rr->rdata, (char *) data, data_len);
+    case NS_DNS_PTR_RECORD:
+      ns_dns_uncompress(pkt, &rr->rdata, (char *) data, data_len);
+      return 0;
+    case NS_DNS_SRV_RECORD: {
+      struct ns_str target;
+      if (rr->rdata.len < 7 || data_len < 6) {
+        return -1;
+      }
+      memcpy(data, rr->rdata.p, 6);
+      target.p = rr->rdata.p + 6;
+      target.len = rr->rdata.len - 6;
+      ns_dns_uncompress(pkt, &target, (char *) data + 6, data_len - 6);
       return 0;
+    }
   }
 
   return -1;
 }
 
+int ns_dns_parse_record_data(struct ns_dns_message *msg,
+                             struct ns_dns_resource_record *rr, void *data,
+                             size_t data_len) {
+  return ns_dns_parse_rdata(&msg->pkt, rr, data, data_len);
+}
+
+int ns_dns_iter_record_data(struct ns_dns_iterator *it,
+                            struct ns_dns_resource_record *rr, void *data,
+                            size_t data_len) {
+  return ns_dns_parse_rdata(&it->pkt, rr, data, data_len);
+}
+
+static void ns_dns_fill_header(struct ns_dns_header *header,
+                               struct ns_dns_message *msg) {
+  memset(header, 0, sizeof(*header));
+  header->transaction_id = msg->transaction_id;
+  header->flags = htons(msg->flags);
+  header->num_questions = htons(msg->num_questions);
+  header->num_answers = htons(msg->num_answers);
+}
+
 int ns_dns_insert_header(struct mbuf *io, size_t pos,
                          struct ns_dns_message *msg) {
   struct ns_dns_header header;
 
-  memset(&header, 0, sizeof(header));
-  header.transaction_id = msg->transaction_id;
-  header.flags = htons(msg->flags);
-  header.num_questions = htons(msg->num_questions);
-  header.num_answers = htons(msg->num_answers);
-
+  ns_dns_fill_header(&header, msg);
   return mbuf_insert(io, pos, &header, sizeof(header));
 }
 
+#ifdef NS_ENABLE_DNS_SERVER
+NS_INTERNAL void ns_dns_update_header(struct mbuf *io, size_t pos,
+                                      struct ns_dns_message *msg) {
+  struct ns_dns_header header;
+
+  ns_dns_fill_header(&header, msg);
+  memcpy(io->buf + pos, &header, sizeof(header));
+}
+#endif
+
 int ns_dns_copy_body(struct mbuf *io, struct ns_dns_message *msg) {
   return mbuf_append(io, msg->pkt.p + sizeof(struct ns_dns_header),
                      msg->pkt.len - sizeof(struct ns_dns_header));
 }
 
-static int ns_dns_encode_name(struct mbuf *io, const char *name, size_t len) {
-  const char *s;
-  unsigned char n;
-  size_t pos = io->len;
+void ns_dns_name_table_init(struct ns_dns_name_table *names, size_t start) {
+  names->start = start;
+  names->num_names = 0;
+}
 
-  do {
-    if ((s = strchr(name, '.')) == NULL) {
-      s = name + len;
+void ns_dns_name_table_add(struct ns_dns_name_table *names, size_t off) {
+  /* Pointers have only 14 bits for the offset */
+  if (names->num_names < (int) ARRAY_SIZE(names->offsets) && off < 0x4000) {
+    names->offsets[names->num_names++] = (uint16_t) off;
+  }
+}
+
+/*
+ * Find an already encoded name, or a suffix of one, equal to `name`, `len`.
+ * Return its offset from the message header, or -1 if not found.
+ */
+static int ns_dns_find_name(struct mbuf *io, struct ns_dns_name_table *names,
+                            const char *name, size_t len) {
+  struct ns_str pkt, n;
+  size_t off;
+  int i, chunk_len;
+
+  pkt.p = io->buf + names->start;
+  pkt.len = io->len - names->start;
+  for (i = 0; i < names->num_names; i++) {
+    /* Try each label boundary up to the end or a pointer */
+    for (off = names->offsets[i]; off < pkt.len; off += chunk_len + 1) {
+      chunk_len = (unsigned char) pkt.p[off];
+      if (chunk_len == 0 || (chunk_len & 0xc0) || off >= 0x4000) {
+        break;
+      }
+      n.p = pkt.p + off;
+      n.len = pkt.len - off;
+      if (ns_dns_name_ncmp(&pkt, &n, name, len) == 0) {
+        return (int) off;
+      }
     }
+  }
+  return -1;
+}
 
-    if (s - name > 127) {
-      return -1; /* TODO(mkm) cover */
+/*
+ * Encode a dotted name in a single pass, straight into the IO buffer.
+ *
+ * If `names` is not NULL, the longest suffix already present in the message
+ * is replaced with a pointer, and newly written suffixes are remembered.
+ */
+static int ns_dns_encode_name(struct mbuf *io, struct ns_dns_name_table *names,
+                              const char *name, size_t len) {
+  const char *end, *s;
+  size_t pos = io->len, max_len;
+  int off, n;
+  unsigned char *p;
+
+  /* Fully qualified names can have a trailing dot */
+  if (len > 0 && name[len - 1] == '.') {
+    len--;
+  }
+  end = name + len;
+
+  /* Every dot becomes a length byte, plus the first length and the root */
+  max_len = io->len + len + 2;
+  if (io->size < max_len) {
+    mbuf_resize(io, max_len);
+    if (io->size < max_len) {
+      return -1; /* LCOV_EXCL_LINE */
     }
-    n = s - name;           /* chunk length */
-    mbuf_append(io, &n, 1); /* send length */
-    mbuf_append(io, name, n);
+  }
+  p = (unsigned char *) io->buf + io->len;
 
-    if (*s == '.') {
-      n++;
+  while (name < end) {
+    if (names != NULL &&
+        (off = ns_dns_find_name(io, names, name, end - name)) >= 0) {
+      *p++ = 0xc0 | off >> 8;
+      *p++ = off & 0xff;
+      break;
+    }
+
+    if ((s = (const char *) memchr(name, '.', end - name)) == NULL) {
+      s = end;
     }
+    n = s - name;
+    if (n == 0 || n > 63) {
+      /* Empty or too long label */
+      io->len = pos;
+      return -1;
+    }
+
+    *p++ = (unsigned char) n;
+    memcpy(p, name, n);
+    p += n;
+    /* Make the labels visible to ns_dns_find_name() */
+    io->len = (char *) p - io->buf;
+
+    name = s < end ? s + 1 : end;
+  }
+  if (name >= end) {
+    *p++ = '\0'; /* Mark end of host name */
+  }
 
-    name += n;
-    len -= n;
-  } while (*s != '\0');
-  mbuf_append(io, "\0", 1); /* Mark end of host name */
+  /* Suffixes are found by walking labels, so only remember the start */
+  if (names != NULL && io->len > pos) {
+    ns_dns_name_table_add(names, pos - names->start);
+  }
+  io->len = (char *) p - io->buf;
 
   return io->len - pos;
 }
 
-int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
-                         const char *name, size_t nlen, const void *rdata,
-                         size_t rlen) {
+static int ns_dns_encode_record2(struct mbuf *io,
+                                 struct ns_dns_name_table *names,
+                                 struct ns_dns_resource_record *rr,
+                                 const char *name, size_t nlen,
+                                 const void *rdata, size_t rlen) {
   size_t pos = io->len;
   uint16_t u16;
   uint32_t u32;
@@ -121,7 +357,7 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
     return -1; /* LCOV_EXCL_LINE */
   }
 
-  if (ns_dns_encode_name(io, name, nlen) == -1) {
+  if (ns_dns_encode_name(io, names, name, nlen) == -1) {
     return -1;
   }
 
@@ -134,15 +370,24 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
     u32 = htonl(rr->ttl);
     mbuf_append(io, &u32, 4);
 
-    if (rr->rtype == NS_DNS_CNAME_RECORD) {
-      int clen;
+    if (rr->rtype == NS_DNS_CNAME_RECORD || rr->rtype == NS_DNS_PTR_RECORD ||
+        rr->rtype == NS_DNS_SRV_RECORD) {
       /* fill size after encoding */
       size_t off = io->len;
       mbuf_append(io, &u16, 2);
-      if ((clen = ns_dns_encode_name(io, (const char *) rdata, rlen)) == -1) {
+      if (rr->rtype == NS_DNS_SRV_RECORD) {
+        /* Priority, weight and port come before the target name */
+        if (rlen < 6) {
+          return -1;
+        }
+        mbuf_append(io, rdata, 6);
+        rdata = (const char *) rdata + 6;
+        rlen -= 6;
+      }
+      if (ns_dns_encode_name(io, names, (const char *) rdata, rlen) == -1) {
         return -1;
       }
-      u16 = clen;
+      u16 = io->len - off - 2;
       io->buf[off] = u16 >> 8;
       io->buf[off + 1] = u16 & 0xff;
     } else {
@@ -155,6 +400,20 @@ int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
   return io->len - pos;
 }
 
+int ns_dns_encode_record(struct mbuf *io, struct ns_dns_resource_record *rr,
+                         const char *name, size_t nlen, const void *rdata,
+                         size_t rlen) {
+  return ns_dns_encode_record2(io, NULL, rr, name, nlen, rdata, rlen);
+}
+
+int ns_dns_encode_record_compressed(struct mbuf *io,
+                                    struct ns_dns_name_table *names,
+                                    struct ns_dns_resource_record *rr,
+                                    const char *name, size_t nlen,
+                                    const void *rdata, size_t rlen) {
+  return ns_dns_encode_record2(io, names, rr, name, nlen, rdata, rlen);
+}
+
 void ns_send_dns_query(struct ns_connection *nc, const char *name,
                        int query_type) {
   struct ns_dns_message *msg =
@@ -194,78 +453,109 @@ cleanup:
   NS_FREE(msg);
 }
 
-static unsigned char *ns_parse_dns_resource_record(
-    unsigned char *data, unsigned char *end, struct ns_dns_resource_record *rr,
-    int reply) {
-  unsigned char *name = data;
+int ns_dns_iter_init(struct ns_dns_iterator *it, const char *buf, int len) {
+  const struct ns_dns_header *header = (const struct ns_dns_header *) buf;
+
+  memset(it, 0, sizeof(*it));
+  if (len < (int) sizeof(*header)) {
+    return -1;
+  }
+
+  it->pkt.p = buf;
+  it->pkt.len = len;
+  it->transaction_id = header->transaction_id;
+  it->flags = ntohs(header->flags);
+  it->num_questions = ntohs(header->num_questions);
+  it->num_answers = ntohs(header->num_answers);
+  it->pos = buf + sizeof(*header);
+
+  return 0;
+}
+
+int ns_dns_iter_next(struct ns_dns_iterator *it,
+                     struct ns_dns_resource_record *rr) {
+  const unsigned char *data = (const unsigned char *) it->pos;
+  const unsigned char *end = (const unsigned char *) it->pkt.p + it->pkt.len;
+  int reply = it->index >= it->num_questions;
   int chunk_len, data_len;
 
+  if (it->index >= it->num_questions + it->num_answers) {
+    return 0;
+  }
+
+  memset(rr, 0, sizeof(*rr));
+  rr->name.p = (const char *) data;
+
+  /* Skip the name, which ends with a zero length label or a pointer */
   while (data < end && (chunk_len = *data)) {
-    if (((unsigned char *) data)[0] & 0xc0) {
-      data += 1;
+    if (chunk_len & 0xc0) {
+      data++;
       break;
     }
     data += chunk_len + 1;
   }
-
-  rr->name.p = (char *) name;
-  rr->name.len = data - name + 1;
-
+  if (data >= end) {
+    return -1;
+  }
   data++;
-  if (data > end - 4) {
-    return data;
+  rr->name.len = data - (const unsigned char *) rr->name.p;
+
+  if (end - data < (reply ? 10 : 4)) {
+    return -1;
   }
 
   rr->rtype = data[0] << 8 | data[1];
-  data += 2;
-
-  rr->rclass = data[0] << 8 | data[1];
-  data += 2;
+  rr->rclass = data[2] << 8 | data[3];
+  data += 4;
 
   rr->kind = reply ? NS_DNS_ANSWER : NS_DNS_QUESTION;
   if (reply) {
-    if (data >= end - 6) {
-      return data;
-    }
-
     rr->ttl = (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 |
               data[2] << 8 | data[3];
     data += 4;
 
-    data_len = *data << 8 | *(data + 1);
+    data_len = data[0] << 8 | data[1];
     data += 2;
+    if (end - data < data_len) {
+      return -1;
+    }
 
-    rr->rdata.p = (char *) data;
+    rr->rdata.p = (const char *) data;
     rr->rdata.len = data_len;
     data += data_len;
   }
-  return data;
+
+  it->pos = (const char *) data;
+  it->index++;
+  return 1;
 }
 
 int ns_parse_dns(const char *buf, int len, struct ns_dns_message *msg) {
-  struct ns_dns_header *header = (struct ns_dns_header *) buf;
-  unsigned char *data = (unsigned char *) buf + sizeof(*header);
-  unsigned char *end = (unsigned char *) buf + len;
-  int i;
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+
   msg->pkt.p = buf;
   msg->pkt.len = len;
 
-  if (len < (int) sizeof(*header)) {
+  if (ns_dns_iter_init(&it, buf, len) == -1) {
     return -1; /* LCOV_EXCL_LINE */
   }
 
-  msg->transaction_id = header->transaction_id;
-  msg->flags = ntohs(header->flags);
-  msg->num_questions = ntohs(header->num_questions);
-  msg->num_answers = ntohs(header->num_answers);
+  msg->transaction_id = it.transaction_id;
+  msg->flags = it.flags;
+  msg->num_questions = msg->num_answers = 0;
 
-  for (i = 0; i < msg->num_questions && i < (int) ARRAY_SIZE(msg->questions);
-       i++) {
-    data = ns_parse_dns_resource_record(data, end, &msg->questions[i], 0);
-  }
-
-  for (i = 0; i < msg->num_answers && i < (int) ARRAY_SIZE(msg->answers); i++) {
-    data = ns_parse_dns_resource_record(data, end, &msg->answers[i], 1);
+  /* Records that don't fit or can't be decoded are not counted */
+  while (ns_dns_iter_next(&it, &rr) > 0) {
+    if (rr.kind == NS_DNS_QUESTION) {
+      if (msg->num_questions < (int) ARRAY_SIZE(msg->questions)) {
+        msg->questions[msg->num_questions++] = rr;
+      }
+    } else if (msg->num_answers < (int) ARRAY_SIZE(msg->answers)) {
+      msg->answers[msg->num_answers++] = rr;
+    } else {
+      break;
+    }
   }
 
   return 0;
@@ -273,51 +563,13 @@ int ns_parse_dns(const char *buf, int len, struct ns_dns_message *msg) {
 
 size_t ns_dns_uncompress_name(struct ns_dns_message *msg, struct ns_str *name,
                               char *dst, int dst_len) {
-  int chunk_len;
-  char *old_dst = dst;
-  const unsigned char *data = (unsigned char *) name->p;
-  const unsigned char *end = (unsigned char *) msg->pkt.p + msg->pkt.len;
-
-  if (data >= end) {
-    return 0;
-  }
-
-  while ((chunk_len = *data++)) {
-    int leeway = dst_len - (dst - old_dst);
-    if (data >= end) {
-      return 0;
-    }
-
-    if (chunk_len & 0xc0) {
-      uint16_t off = (data[-1] & (~0xc0)) << 8 | data[0];
-      if (off >= msg->pkt.len) {
-        return 0;
-      }
-      data = (unsigned char *) msg->pkt.p + off;
-      continue;
-    }
-    if (chunk_len > leeway) {
-      chunk_len = leeway;
-    }
-
-    if (data + chunk_len >= end) {
-      return 0;
-    }
-
-    memcpy(dst, data, chunk_len);
-    data += chunk_len;
-    dst += chunk_len;
-    leeway -= chunk_len;
-    if (leeway == 0) {
-      return dst - old_dst;
-    }
-    *dst++ = '.';
-  }
+  return ns_dns_uncompress(&msg->pkt, name, dst, dst_len);
+}
 
-  if (dst != old_dst) {
-    *--dst = 0;
-  }
-  return dst - old_dst;
+size_t ns_dns_iter_uncompress_name(struct ns_dns_iterator *it,
+                                   struct ns_str *name, char *dst,
+                                   int dst_len) {
+  return ns_dns_uncompress(&it->pkt, name, dst, dst_len);
 }
 
 static void dns_handler(struct ns_connection *nc, int ev, void *ev_data) {
@@ -19,7 +19,11 @@ extern "C" {
 #define NS_DNS_A_RECORD 0x01     /* Lookup IP address */
 #define NS_DNS_CNAME_RECORD 0x05 /* Lookup CNAME */
 #define NS_DNS_AAAA_RECORD 0x1c  /* Lookup IPv6 address */
+#define NS_DNS_PTR_RECORD 0x0c   /* Lookup domain name pointer */
 #define NS_DNS_MX_RECORD 0x0f    /* Lookup mail server for domain */
+#define NS_DNS_TXT_RECORD 0x10   /* Lookup text strings */
+#define NS_DNS_SRV_RECORD 0x21   /* Lookup service location */
+#define NS_DNS_ANY_RECORD 0xff   /* Lookup all records */
 
 #define NS_MAX_DNS_QUESTIONS 32
 #define NS_MAX_DNS_ANSWERS 32
@@ -61,7 +65,9 @@ struct ns_dns_resource_record *ns_dns_next_record(
  *
  *  - A:     struct in_addr *ina
  *  - AAAA:  struct in6_addr *ina
- *  - CNAME: char buffer
+ *  - CNAME, PTR: char buffer
+ *  - SRV:   char buffer, receives priority, weight and port (2 bytes each,
+ *           network byte order) followed by the target name
  *
  * Returns -1 on error.
  *
@@ -106,11 +112,54 @@ int ns_dns_copy_body(struct mbuf *, struct ns_dns_message *);
  *struct
  * because they might be invalidated as soon as the IO buffer grows again.
  *
+ * CNAME and PTR data is a dotted name. SRV data is priority, weight and port
+ * (2 bytes each, network byte order) followed by the dotted target name.
+ *
  * Return the number of bytes appened or -1 in case of error.
  */
 int ns_dns_encode_record(struct mbuf *, struct ns_dns_resource_record *,
                          const char *, size_t, const void *, size_t);
 
+#define NS_DNS_MAX_COMPRESSED_NAMES 32
+
+/*
+ * Name compression table of a DNS message being encoded.
+ *
+ * Remembers where names (and their suffixes) have been written, so that
+ * later occurrences can be replaced by RFC 1035 compression pointers.
+ */
+struct ns_dns_name_table {
+  size_t start;  /* Offset of the message header in the IO buffer */
+  int num_names; /* Number of used entries in `offsets` */
+  uint16_t offsets[NS_DNS_MAX_COMPRESSED_NAMES]; /* Relative to `start` */
+};
+
+/*
+ * Initialize name compression table for a message whose header starts at
+ * offset `start` of the IO buffer.
+ */
+void ns_dns_name_table_init(struct ns_dns_name_table *, size_t start);
+
+/*
+ * Register a name already present in the message, at offset `off` from the
+ * message header. Useful for names that haven't been encoded with
+ * `ns_dns_encode_record_compressed()`, e.g. question records copied from a
+ * request with `ns_dns_copy_body()`.
+ */
+void ns_dns_name_table_add(struct ns_dns_name_table *, size_t off);
+
+/*
+ * Same as `ns_dns_encode_record()`, but compresses the record name (and
+ * CNAME data) with pointers to names already written to the message.
+ *
+ * The message header must already be present in the IO buffer (possibly
+ * as a placeholder), at offset `names->start`.
+ */
+int ns_dns_encode_record_compressed(struct mbuf *, struct ns_dns_name_table *,
+                                    struct ns_dns_resource_record *,
+                                    const char *, size_t, const void *,
+                                    size_t);
+
 /* Low-level: parses a DNS response. */
 int ns_parse_dns(const char *, int, struct ns_dns_message *);
 
@@ -130,6 +179,77 @@ int ns_parse_dns(const char *, int, struct ns_dns_message *);
 size_t ns_dns_uncompress_name(struct ns_dns_message *, struct ns_str *, char *,
                               int);
 
+/*
+ * Lazy DNS message parser.
+ *
+ * Unlike `ns_parse_dns()`, the iterator doesn't need a `struct
+ * ns_dns_message` and doesn't allocate: records are decoded one at a time
+ * straight from the wire bytes, and names stay compressed (`rr->name` and
+ * `rr->rdata` point into the packet).
+ */
+struct ns_dns_iterator {
+  struct ns_str pkt; /* packet body */
+  uint16_t flags;
+  uint16_t transaction_id;
+  int num_questions;
+  int num_answers;
+  const char *pos; /* next record to decode */
+  int index;       /* number of records decoded so far */
+};
+
+/*
+ * Initialize a DNS iterator over the packet `buf`, `len`.
+ *
+ * Only the header is decoded. Return -1 if the packet is too short.
+ */
+int ns_dns_iter_init(struct ns_dns_iterator *, const char *, int);
+
+/*
+ * Decode the next record into `rr`.
+ *
+ * Questions come first, followed by answers; `rr->kind` tells them apart.
+ * Return 1 if a record was decoded, 0 when there are no more records, or -1
+ * if the packet is malformed. All bounds are checked against the packet.
+ *
+ * [source,c]
+ * ----
+ * struct ns_dns_iterator it;
+ * struct ns_dns_resource_record rr;
+ * struct in_addr ina;
+ *
+ * ns_dns_iter_init(&it, buf, len);
+ * while (ns_dns_iter_next(&it, &rr) > 0) {
+ *   if (rr.kind == NS_DNS_ANSWER && rr.rtype == NS_DNS_A_RECORD &&
+ *       ns_dns_name_cmp(&it.pkt, &rr.name, "www.cesanta.com") == 0) {
+ *     ns_dns_iter_record_data(&it, &rr, &ina, sizeof(ina));
+ *   }
+ * }
+ * ----
+ */
+int ns_dns_iter_next(struct ns_dns_iterator *, struct ns_dns_resource_record *);
+
+/*
+ * Same as `ns_dns_parse_record_data()`, for records decoded by an iterator.
+ */
+int ns_dns_iter_record_data(struct ns_dns_iterator *,
+                            struct ns_dns_resource_record *, void *, size_t);
+
+/*
+ * Same as `ns_dns_uncompress_name()`, for records decoded by an iterator.
+ */
+size_t ns_dns_iter_uncompress_name(struct ns_dns_iterator *, struct ns_str *,
+                                   char *, int);
+
+/*
+ * Compare a (possibly compressed) DNS name stored in packet `pkt` with the
+ * dotted name `want`, without uncompressing it into a buffer.
+ *
+ * The comparison is case-insensitive, as per RFC 1035.
+ * Return 0 if names are equal, non-zero otherwise or if `name` is malformed.
+ */
+int ns_dns_name_cmp(const struct ns_str *pkt, const struct ns_str *name,
+                    const char *want);
+
 /*
  * Attach built-in DNS event handler to the given listening connection.
  *
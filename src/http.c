@@ -11,9 +11,12 @@ enum http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT, DATA_CGI };
 
 struct proto_data_http {
   FILE *fp;         /* Opened file. */
+  int64_t offset;   /* File offset of the first byte to send or write. */
   int64_t cl;       /* Content-Length. How many bytes to send. */
   int64_t sent;     /* How many bytes have been already sent. */
   int64_t body_len; /* How many bytes of chunked body was reassembled. */
+  struct ns_http_file_job *file_job; /* See ns_offload_file_io() */
+  double write_pause; /* recv_resume_time set while file_job writes */
   struct ns_connection *cgi_nc;
   enum http_proto_data_type type;
 };
@@ -400,10 +403,10 @@ static uint32_t ws_random_mask() {
 #endif
 }
 
-static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len,
-                              struct ws_mask_ctx *ctx) {
+/* Build a frame header, including the mask on client connections */
+static int ns_build_ws_header(struct ns_connection *nc, int op, size_t len,
+                              unsigned char *header, uint32_t *mask) {
   int header_len;
-  unsigned char header[10];
 
   header[0] = 0x80 + (op & 0x0f);
   if (len < 126) {
@@ -427,14 +430,20 @@ static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len,
   /* client connections enable masking */
   if (nc->listener == NULL) {
     header[1] |= 1 << 7; /* set masking flag */
-    ns_send(nc, header, header_len);
-    ctx->mask = ws_random_mask();
-    ns_send(nc, &ctx->mask, sizeof(ctx->mask));
-    ctx->pos = nc->send_mbuf.len;
-  } else {
-    ns_send(nc, header, header_len);
-    ctx->pos = 0;
+    *mask = ws_random_mask();
+    memcpy(&header[header_len], mask, sizeof(*mask));
+    header_len += sizeof(*mask);
   }
+
+  return header_len;
+}
+
+static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len,
+                              struct ws_mask_ctx *ctx) {
+  unsigned char header[14];
+
+  ns_send(nc, header, ns_build_ws_header(nc, op, len, header, &ctx->mask));
+  ctx->pos = nc->listener == NULL ? nc->send_mbuf.len : 0;
 }
 
 static void ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
@@ -458,6 +467,21 @@ void ns_send_websocket_frame(struct ns_connection *nc, int op, const void *data,
   }
 }
 
+void ns_send_websocket_frame_at(struct ns_connection *nc, int op, size_t off) {
+  struct ws_mask_ctx ctx;
+  unsigned char header[14];
+  int n = ns_build_ws_header(nc, op, nc->send_mbuf.len - off, header,
+                             &ctx.mask);
+
+  mbuf_insert(&nc->send_mbuf, off, header, n);
+  ctx.pos = nc->listener == NULL ? off + n : 0;
+  ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
 void ns_send_websocket_framev(struct ns_connection *nc, int op,
                               const struct ns_str *strv, int strvcnt) {
   struct ws_mask_ctx ctx;
@@ -482,19 +506,14 @@ void ns_send_websocket_framev(struct ns_connection *nc, int op,
 
 void ns_printf_websocket_frame(struct ns_connection *nc, int op,
                                const char *fmt, ...) {
-  char mem[4192], *buf = mem;
+  size_t off = nc->send_mbuf.len;
   va_list ap;
-  int len;
 
   va_start(ap, fmt);
-  if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
-    ns_send_websocket_frame(nc, op, buf, len);
+  if (ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap) > 0) {
+    ns_send_websocket_frame_at(nc, op, off);
   }
   va_end(ap);
-
-  if (buf != mem && buf != NULL) {
-    NS_FREE(buf);
-  }
 }
 
 static void websocket_handler(struct ns_connection *nc, int ev, void *ev_data) {
@@ -542,6 +561,19 @@ static void ws_handshake(struct ns_connection *nc, const struct ns_str *key) {
 
 #endif /* NS_DISABLE_HTTP_WEBSOCKET */
 
+#ifdef NS_WORKERS
+/* A read or write of the file being served or uploaded */
+struct ns_http_file_job {
+  struct ns_job job;
+  int fd;          /* A dup() of the file's descriptor */
+  int is_write;
+  int64_t offset;  /* File offset */
+  size_t len;      /* Bytes to read or write */
+  size_t done;     /* Bytes read or written, fewer on EOF or error */
+  struct mbuf buf; /* Data to write, or data read */
+};
+#endif
+
 static void free_http_proto_data(struct ns_connection *nc) {
   struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
   if (dp != NULL) {
@@ -551,17 +583,171 @@ static void free_http_proto_data(struct ns_connection *nc) {
     if (dp->cgi_nc != NULL) {
       dp->cgi_nc->flags |= NSF_CLOSE_IMMEDIATELY;
     }
+#ifdef NS_WORKERS
+    if (dp->file_job != NULL) {
+      /* It has its own file descriptor, and won't report back */
+      dp->file_job->job.nc = NULL;
+    }
+#endif
     NS_FREE(dp);
     nc->proto_data = NULL;
   }
 }
 
+#ifdef NS_WORKERS
+static void transfer_file_data(struct ns_connection *nc);
+static void http_handle_recv(struct ns_connection *nc, void *ev_data);
+
+static void ns_http_file_run(struct ns_job *job) {
+  struct ns_http_file_job *fj = (struct ns_http_file_job *) job;
+  char *p;
+  size_t left;
+  off_t off;
+  ssize_t n;
+
+  while (fj->done < fj->len) {
+    p = fj->buf.buf + fj->done;
+    left = fj->len - fj->done;
+    off = (off_t)(fj->offset + fj->done);
+    n = fj->is_write ? pwrite(fj->fd, p, left, off)
+                     : pread(fj->fd, p, left, off);
+    if (n > 0) {
+      fj->done += n;
+    } else if (n == 0 || errno != EINTR) {
+      break;
+    }
+  }
+}
+
+/* Send the data read, or go on with the upload */
+static void ns_http_file_done(struct ns_job *job) {
+  struct ns_http_file_job *fj = (struct ns_http_file_job *) job;
+  struct ns_connection *nc = job->nc;
+  struct proto_data_http *dp;
+  int n;
+
+  if (nc != NULL) {
+    dp = (struct proto_data_http *) nc->proto_data;
+    dp->file_job = NULL;
+    if (fj->is_write) {
+      /* Resume reading, unless someone else paused it meanwhile */
+      if (dp->write_pause != 0 && nc->recv_resume_time == dp->write_pause) {
+        nc->recv_resume_time = 0;
+      }
+      dp->write_pause = 0;
+    } else {
+      ns_send(nc, fj->buf.buf, (int) fj->done);
+    }
+    if (fj->done < fj->len) {
+      free_http_proto_data(nc);
+    } else {
+      transfer_file_data(nc);
+    }
+    if (fj->is_write && nc->proto_data == NULL && nc->recv_mbuf.len > 0) {
+      /* A request that came after the body */
+      n = (int) nc->recv_mbuf.len;
+      http_handle_recv(nc, &n);
+    }
+  }
+  close(fj->fd);
+  mbuf_free(&fj->buf);
+  NS_FREE(fj);
+}
+
+/*
+ * Read `len` bytes of the file into a new buffer, or write `len` bytes of
+ * the input buffer to it, in a worker thread. The connection waits for one
+ * job at a time; more writes are only started to flush a closing upload,
+ * and don't report back.
+ */
+static int ns_http_file_start(struct ns_connection *nc, int is_write,
+                              size_t len) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  struct ns_http_file_job *fj;
+  struct mbuf *io = &nc->recv_mbuf;
+
+  if ((fj = (struct ns_http_file_job *) NS_CALLOC(1, sizeof(*fj))) == NULL) {
+    return -1;
+  } else if ((fj->fd = dup(fileno(dp->fp))) < 0) {
+    NS_FREE(fj);
+    return -1;
+  }
+
+  if (!is_write) {
+    mbuf_init(&fj->buf, len);
+  } else if (len == io->len) {
+    /* Take the whole input buffer over */
+    fj->buf = *io;
+    mbuf_init(io, 0);
+  } else if (mbuf_append(&fj->buf, io->buf, len) == len) {
+    mbuf_remove(io, len);
+  }
+  if (fj->buf.size < len) {
+    close(fj->fd);
+    mbuf_free(&fj->buf);
+    NS_FREE(fj);
+    return -1;
+  }
+
+  fj->job.run = ns_http_file_run;
+  fj->job.done = ns_http_file_done;
+  fj->is_write = is_write;
+  fj->offset = dp->offset + dp->sent;
+  fj->len = len;
+  dp->sent += len;
+  if (dp->file_job == NULL) {
+    fj->job.nc = nc;
+    dp->file_job = fj;
+  }
+  return ns_workers_add(nc->mgr->file_workers, &fj->job);
+}
+
+/* Read ahead the file being served, or write the upload received so far */
+static void transfer_file_data_async(struct ns_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  int64_t left = dp->cl - dp->sent;
+  size_t len = 0;
+
+  if (left <= 0) {
+    /* All of it is read or written, or being so */
+  } else if (dp->type == DATA_PUT) {
+    if (dp->file_job == NULL || (nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+      len = left < (int64_t) nc->recv_mbuf.len ? (size_t) left
+                                                : nc->recv_mbuf.len;
+    } else if (nc->recv_mbuf.len >= NS_HTTP_READ_AHEAD &&
+               nc->recv_resume_time == 0) {
+      /* Stop reading until the write is done, re-check every second */
+      nc->recv_resume_time = dp->write_pause = ns_time() + 1;
+    }
+  } else if (dp->file_job == NULL && !(nc->flags & NSF_CLOSE_IMMEDIATELY) &&
+             nc->send_mbuf.len < NS_HTTP_READ_AHEAD / 2) {
+    len = NS_HTTP_READ_AHEAD - nc->send_mbuf.len;
+    if ((int64_t) len > left) len = (size_t) left;
+  }
+
+  if (dp->file_job == NULL && left <= 0) {
+    free_http_proto_data(nc);
+  } else if (len > 0 && ns_http_file_start(nc, dp->type == DATA_PUT, len) !=
+                            0) {
+    free_http_proto_data(nc);
+  }
+}
+#endif /* NS_WORKERS */
+
 static void transfer_file_data(struct ns_connection *nc) {
   struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
   char buf[NS_MAX_HTTP_SEND_IOBUF];
   int64_t left = dp->cl - dp->sent;
   size_t n = 0, to_read = 0;
 
+#ifdef NS_WORKERS
+  if (nc->mgr->file_workers != NULL &&
+      (dp->type == DATA_FILE || dp->type == DATA_PUT)) {
+    transfer_file_data_async(nc);
+    return;
+  }
+#endif
+
   if (dp->type == DATA_FILE) {
     struct mbuf *io = &nc->send_mbuf;
     if (io->len < sizeof(buf)) {
@@ -702,14 +888,97 @@ NS_INTERNAL size_t ns_handle_chunked(struct ns_connection *nc,
   return body_len;
 }
 
-static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
+/* Apply the message rate limit to a request. Return 1 if it's held back. */
+static int ns_http_rate_limited(struct ns_connection *nc,
+                                struct http_message *hm) {
+  double retry_after;
+
+  switch (ns_rate_limit_message(nc, hm, &retry_after)) {
+    case 0:
+      return 0;
+    case NS_RATE_LIMIT_REJECT:
+      ns_printf(nc,
+                "HTTP/1.1 429 Too Many Requests\r\n"
+                "Retry-After: %d\r\n"
+                "Content-Length: 0\r\n\r\n",
+                (int) retry_after + 1);
+      mbuf_remove(&nc->recv_mbuf, hm->message.len);
+      break;
+    default:
+      /* Closing, or delayed: the request stays buffered */
+      break;
+  }
+
+  return 1;
+}
+
+/* Handle the requests, replies or websocket handshake in the input buffer */
+static void http_handle_recv(struct ns_connection *nc, void *ev_data) {
   struct mbuf *io = &nc->recv_mbuf;
   struct http_message hm;
+  struct ns_str *s;
   int req_len;
   const int is_req = (nc->listener != NULL);
 #ifndef NS_DISABLE_HTTP_WEBSOCKET
   struct ns_str *vec;
 #endif
+
+  req_len = ns_parse_http(io->buf, io->len, &hm, is_req);
+
+  if (req_len > 0 &&
+      (s = ns_get_http_header(&hm, "Transfer-Encoding")) != NULL &&
+      ns_vcasecmp(s, "chunked") == 0) {
+    ns_handle_chunked(nc, &hm, io->buf + req_len, io->len - req_len);
+  }
+
+  if (req_len < 0 || (req_len == 0 && io->len >= NS_MAX_HTTP_REQUEST_SIZE)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (req_len == 0) {
+    /* Do nothing, request is not yet fully buffered */
+  } else if (is_req && hm.message.len <= io->len &&
+             ns_http_rate_limited(nc, &hm)) {
+    /* Rejected or delayed, see ns_set_rate_limit() */
+  }
+#ifndef NS_DISABLE_HTTP_WEBSOCKET
+  else if (nc->listener == NULL &&
+           ns_get_http_header(&hm, "Sec-WebSocket-Accept")) {
+    /* We're websocket client, got handshake response from server. */
+    /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
+    mbuf_remove(io, req_len);
+    nc->proto_handler = websocket_handler;
+    nc->flags |= NSF_IS_WEBSOCKET;
+    nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+    websocket_handler(nc, NS_RECV, ev_data);
+  } else if (nc->listener != NULL &&
+             (vec = ns_get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
+    /* This is a websocket request. Switch protocol handlers. */
+    mbuf_remove(io, req_len);
+    nc->proto_handler = websocket_handler;
+    nc->flags |= NSF_IS_WEBSOCKET;
+
+    /* Send handshake */
+    nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, &hm);
+    if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+      if (nc->send_mbuf.len == 0) {
+        ws_handshake(nc, vec);
+      }
+      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+      websocket_handler(nc, NS_RECV, ev_data);
+    }
+  }
+#endif /* NS_DISABLE_HTTP_WEBSOCKET */
+  else if (hm.message.len <= io->len) {
+    /* Whole HTTP message is fully buffered, call event handler */
+    nc->handler(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
+    mbuf_remove(io, hm.message.len);
+  }
+}
+
+static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct mbuf *io = &nc->recv_mbuf;
+  struct http_message hm;
+  struct proto_data_http *dp;
+  const int is_req = (nc->listener != NULL);
   /*
    * For HTTP messages without Content-Length, always send HTTP message
    * before NS_CLOSE message.
@@ -728,54 +997,20 @@ static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
 
   nc->handler(nc, ev, ev_data);
 
-  if (ev == NS_RECV) {
-    struct ns_str *s;
-    req_len = ns_parse_http(io->buf, io->len, &hm, is_req);
-
-    if (req_len > 0 &&
-        (s = ns_get_http_header(&hm, "Transfer-Encoding")) != NULL &&
-        ns_vcasecmp(s, "chunked") == 0) {
-      ns_handle_chunked(nc, &hm, io->buf + req_len, io->len - req_len);
-    }
+  if (ev == NS_POLL && (nc->flags & NSF_RATE_LIMITED) &&
+      nc->recv_resume_time == 0) {
+    /* Retry the request delayed by the rate limit */
+    nc->flags &= ~NSF_RATE_LIMITED;
+    ev = NS_RECV;
+  }
 
-    if (req_len < 0 || (req_len == 0 && io->len >= NS_MAX_HTTP_REQUEST_SIZE)) {
-      nc->flags |= NSF_CLOSE_IMMEDIATELY;
-    } else if (req_len == 0) {
-      /* Do nothing, request is not yet fully buffered */
-    }
-#ifndef NS_DISABLE_HTTP_WEBSOCKET
-    else if (nc->listener == NULL &&
-             ns_get_http_header(&hm, "Sec-WebSocket-Accept")) {
-      /* We're websocket client, got handshake response from server. */
-      /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = websocket_handler;
-      nc->flags |= NSF_IS_WEBSOCKET;
-      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-      websocket_handler(nc, NS_RECV, ev_data);
-    } else if (nc->listener != NULL &&
-               (vec = ns_get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
-      /* This is a websocket request. Switch protocol handlers. */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = websocket_handler;
-      nc->flags |= NSF_IS_WEBSOCKET;
-
-      /* Send handshake */
-      nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, &hm);
-      if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
-        if (nc->send_mbuf.len == 0) {
-          ws_handshake(nc, vec);
-        }
-        nc->handler(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-        websocket_handler(nc, NS_RECV, ev_data);
-      }
-    }
-#endif /* NS_DISABLE_HTTP_WEBSOCKET */
-    else if (hm.message.len <= io->len) {
-      /* Whole HTTP message is fully buffered, call event handler */
-      nc->handler(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
-      mbuf_remove(io, hm.message.len);
-    }
+  dp = (struct proto_data_http *) nc->proto_data;
+  if (ev == NS_RECV && (dp == NULL || dp->type != DATA_PUT)) {
+    /* Not while the body of an upload is being written, see handle_put() */
+    http_handle_recv(nc, ev_data);
+  } else if (ev == NS_CLOSE && dp != NULL && dp->type != DATA_CGI) {
+    /* CGI state goes away with the CGI connection, see cgi_ev_handler() */
+    free_http_proto_data(nc);
   }
 }
 
@@ -1087,7 +1322,20 @@ static void ns_send_http_file2(struct ns_connection *nc, const char *path,
               "\r\n",
               status_code, status_message, current_time, last_modified,
               (int) mime_type.len, mime_type.p, cl, range, etag);
+#ifdef NS_ENABLE_SEND_FILE
+    if (nc->mgr->file_workers == NULL) {
+      /* Let the core send it, with sendfile() where possible */
+      int fd = dup(fileno(dp->fp));
+      if (fd >= 0 && ns_send_file(nc, fd, r1, cl) == 0) {
+        fclose(dp->fp);
+        NS_FREE(dp);
+        return;
+      }
+      if (fd >= 0) close(fd);
+    }
+#endif
     nc->proto_data = (void *) dp;
+    dp->offset = r1;
     dp->cl = cl;
     dp->type = DATA_FILE;
     transfer_file_data(nc);
@@ -1191,24 +1439,100 @@ void ns_send_http_chunk(struct ns_connection *nc, const char *buf, size_t len) {
   ns_send(nc, "\r\n", 2);
 }
 
+static const char *ns_http_status_message(int status_code) {
+  switch (status_code) {
+    case 101:
+      return "Switching Protocols";
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
+    case 207:
+      return "Multi-Status";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 304:
+      return "Not Modified";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 409:
+      return "Conflict";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Payload Too Large";
+    case 416:
+      return "Range Not Satisfiable";
+    case 423:
+      return "Locked";
+    case 429:
+      return "Too Many Requests";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 503:
+      return "Service Unavailable";
+    default:
+      /* Never contradict the code */
+      return "Unknown";
+  }
+}
+
+void ns_send_http_response_at(struct ns_connection *nc, size_t off,
+                              int status_code, const char *extra_headers) {
+  size_t extra_len = extra_headers == NULL ? 0 : strlen(extra_headers);
+  char status[100];
+  char *p;
+  int n;
+
+  n = snprintf(status, sizeof(status),
+               "HTTP/1.1 %d %s\r\nContent-Length: %lu\r\n", status_code,
+               ns_http_status_message(status_code),
+               (unsigned long) (nc->send_mbuf.len - off));
+
+  /* Open a gap for the whole header, the body is moved only once */
+  if (mbuf_insert(&nc->send_mbuf, off, NULL, n + extra_len + 2) > 0) {
+    p = nc->send_mbuf.buf + off;
+    memcpy(p, status, n);
+    if (extra_len > 0) {
+      memcpy(p + n, extra_headers, extra_len);
+    }
+    memcpy(p + n + extra_len, "\r\n", 2);
+  }
+}
+
 void ns_printf_http_chunk(struct ns_connection *nc, const char *fmt, ...) {
-  char mem[500], *buf = mem;
-  int len;
+  size_t off = nc->send_mbuf.len;
+  char chunk_size[50];
   va_list ap;
+  int len, n;
 
   va_start(ap, fmt);
-  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
+  len = ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap);
   va_end(ap);
 
   if (len >= 0) {
-    ns_send_http_chunk(nc, buf, len);
-  }
-
-  /* LCOV_EXCL_START */
-  if (buf != mem && buf != NULL) {
-    NS_FREE(buf);
+    /* Chunk data is formatted in place, prepend its size */
+    n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n",
+                 (unsigned long) len);
+    mbuf_insert(&nc->send_mbuf, off, chunk_size, n);
+    mbuf_append(&nc->send_mbuf, "\r\n", 2);
   }
-  /* LCOV_EXCL_STOP */
 }
 
 void ns_printf_html_escape(struct ns_connection *nc, const char *fmt, ...) {
@@ -1761,6 +2085,7 @@ static void handle_put(struct ns_connection *nc, const char *path,
     if (range_hdr != NULL && parse_range_header(range_hdr, &r1, &r2) > 0) {
       status_code = 206;
       fseeko(dp->fp, r1, SEEK_SET);
+      dp->offset = r1;
       dp->cl = r2 > r1 ? r2 - r1 + 1 : dp->cl - r1;
     }
     ns_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
@@ -2313,17 +2638,33 @@ static void handle_cgi(struct ns_connection *nc, const char *prog,
 }
 #endif
 
+static int ns_http_check_acl(struct ns_connection *nc, const char *spec) {
+  struct ns_ip_acl *acl;
+  int allowed;
+
+  if (spec == NULL || *spec == '\0') {
+    return 1;
+  } else if (nc->sa.sa.sa_family == AF_INET) {
+    return ns_check_ip_acl(spec, ntohl(nc->sa.sin.sin_addr.s_addr)) == 1;
+  }
+  /* IPv6 peer, the string matcher only knows IPv4 */
+  acl = ns_ip_acl_compile(spec);
+  allowed = acl != NULL && ns_ip_acl_check(acl, &nc->sa);
+  ns_ip_acl_free(acl);
+
+  return allowed;
+}
+
 void ns_send_http_file(struct ns_connection *nc, char *path,
                        size_t path_buf_len, struct http_message *hm,
                        struct ns_serve_http_opts *opts) {
   int stat_result, is_directory, is_dav = is_dav_request(&hm->method);
-  uint32_t remote_ip = ntohl(*(uint32_t *) &nc->sa.sin.sin_addr);
   ns_stat_t st;
 
   stat_result = ns_stat(path, &st);
   is_directory = !stat_result && S_ISDIR(st.st_mode);
 
-  if (ns_check_ip_acl(opts->ip_acl, remote_ip) != 1) {
+  if (!ns_http_check_acl(nc, opts->ip_acl)) {
     /* Not allowed to connect */
     nc->flags |= NSF_CLOSE_IMMEDIATELY;
   } else if (is_dav && opts->dav_document_root == NULL) {
@@ -2440,6 +2781,16 @@ struct ns_connection *ns_connect_http(struct ns_mgr *mgr,
       /* Do not add port. See https://github.com/cesanta/fossa/pull/304 */
       addr[addr_len] = '\0';
     }
+#if defined(NS_ENABLE_SSL) && defined(SSL_set_tlsext_host_name)
+    if (use_ssl && nc->ssl != NULL) {
+      /* Tell the server which certificate we want (SNI), unless it's an IP */
+      char host[sizeof(addr)];
+      snprintf(host, sizeof(host), "%.*s", (int) strcspn(addr, ":"), addr);
+      if (host[0] != '[' && host[strspn(host, "0123456789.")] != '\0') {
+        SSL_set_tlsext_host_name(nc->ssl, host);
+      }
+    }
+#endif
     ns_printf(nc,
               "%s /%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %lu\r\n%s\r\n%s",
               post_data == NULL ? "GET" : "POST", path, addr,
@@ -32,6 +32,10 @@ extern "C" {
 #define NS_MAX_HTTP_SEND_IOBUF 4096
 #endif
 
+#ifndef NS_HTTP_READ_AHEAD
+#define NS_HTTP_READ_AHEAD 65536 /* See ns_offload_file_io() */
+#endif
+
 #ifndef NS_WEBSOCKET_PING_INTERVAL_SECONDS
 #define NS_WEBSOCKET_PING_INTERVAL_SECONDS 5
 #endif
@@ -150,6 +154,15 @@ void ns_send_websocket_handshake(struct ns_connection *nc, const char *uri,
 void ns_send_websocket_frame(struct ns_connection *nc, int op, const void *data,
                              size_t data_len);
 
+/*
+ * Send websocket frame whose data has been appended to `nc->send_mbuf`
+ * in place, starting at offset `off` (e.g. by a `struct ns_json_writer`).
+ *
+ * The frame header is inserted in front of the data, which is masked in
+ * place on client connections. Avoids a copy of the data.
+ */
+void ns_send_websocket_frame_at(struct ns_connection *nc, int op, size_t off);
+
 /*
  * Send multiple websocket frames.
  *
@@ -187,6 +200,17 @@ void ns_printf_websocket_frame(struct ns_connection *nc, int op,
  */
 void ns_send_http_chunk(struct ns_connection *nc, const char *buf, size_t len);
 
+/*
+ * Send HTTP response whose body has been appended to `nc->send_mbuf`
+ * in place, starting at offset `off` (e.g. by a `struct ns_json_writer`).
+ *
+ * The status line, `Content-Length` and `extra_headers` (which can be NULL,
+ * and must end with `\r\n` otherwise) are inserted in front of the body.
+ * Avoids a copy of the body.
+ */
+void ns_send_http_response_at(struct ns_connection *nc, size_t off,
+                              int status_code, const char *extra_headers);
+
 /*
  * Send printf-formatted HTTP chunk.
  * Functionality is similar to `ns_send_http_chunk()`.
@@ -363,7 +387,11 @@ struct ns_serve_http_opts {
   /* SSI files pattern. If not set, "**.shtml$|**.shtm$" is used. */
   const char *ssi_pattern;
 
-  /* IP ACL. By default, NULL, meaning all IPs are allowed to connect */
+  /*
+   * IP ACL. By default, NULL, meaning all IPs are allowed to connect.
+   * Checked on every request; `ns_set_ip_acl()` on the listening connection
+   * rejects clients earlier and faster, at accept time.
+   */
   const char *ip_acl;
 
   /* URL rewrites.
@@ -71,6 +71,31 @@ NS_INTERNAL void ns_forward(struct ns_connection *, struct ns_connection *);
 NS_INTERNAL void ns_add_conn(struct ns_mgr *mgr, struct ns_connection *c);
 NS_INTERNAL void ns_remove_conn(struct ns_connection *c);
 
+#if defined(NS_ENABLE_THREADS) && !defined(NS_DISABLE_SOCKETPAIR) && \
+    !defined(_WIN32)
+#define NS_WORKERS
+
+/* Work for a pool of worker threads, see ns_workers_add() */
+struct ns_job {
+  struct ns_job *next;
+  struct ns_connection *nc;      /* NULL if the connection went away */
+  void (*run)(struct ns_job *);  /* Called in a worker thread */
+  void (*done)(struct ns_job *); /* Called in the event loop, frees the job */
+};
+
+/*
+ * Queue a job. `done` is called when it has run, or with `nc` NULL when the
+ * manager is freed. Return 0 on success, -1 if the pool is NULL.
+ */
+NS_INTERNAL int ns_workers_add(struct ns_workers *, struct ns_job *);
+#endif
+
+#if !defined(NS_DISABLE_DNS) && defined(NS_ENABLE_DNS_SERVER)
+/* Overwrite the DNS header at offset `pos` with the one from `msg`. */
+NS_INTERNAL void ns_dns_update_header(struct mbuf *, size_t,
+                                      struct ns_dns_message *);
+#endif
+
 #ifndef NS_DISABLE_FILESYSTEM
 NS_INTERNAL int find_index_file(char *, size_t, const char *, ns_stat_t *);
 #endif
@@ -63,32 +63,27 @@ int ns_rpc_create_error(char *buf, int len, struct ns_rpc_request *req,
   return n;
 }
 
-int ns_rpc_create_std_error(char *buf, int len, struct ns_rpc_request *req,
-                            int code) {
-  const char *message = NULL;
-
+static const char *ns_rpc_std_error_message(int code) {
   switch (code) {
     case JSON_RPC_PARSE_ERROR:
-      message = "parse error";
-      break;
+      return "parse error";
     case JSON_RPC_INVALID_REQUEST_ERROR:
-      message = "invalid request";
-      break;
+      return "invalid request";
     case JSON_RPC_METHOD_NOT_FOUND_ERROR:
-      message = "method not found";
-      break;
+      return "method not found";
     case JSON_RPC_INVALID_PARAMS_ERROR:
-      message = "invalid parameters";
-      break;
+      return "invalid parameters";
     case JSON_RPC_SERVER_ERROR:
-      message = "server error";
-      break;
+      return "server error";
     default:
-      message = "unspecified error";
-      break;
+      return "unspecified error";
   }
+}
 
-  return ns_rpc_create_error(buf, len, req, code, message, "N");
+int ns_rpc_create_std_error(char *buf, int len, struct ns_rpc_request *req,
+                            int code) {
+  return ns_rpc_create_error(buf, len, req, code,
+                             ns_rpc_std_error_message(code), "N");
 }
 
 int ns_rpc_dispatch(const char *buf, int len, char *dst, int dst_len,
@@ -130,6 +125,381 @@ int ns_rpc_dispatch(const char *buf, int len, char *dst, int dst_len,
   return handlers[i](dst, dst_len, &req);
 }
 
+/* Append `json_emit_va()` output, growing the buffer if it doesn't fit */
+static int ns_rpc_emit_va(struct mbuf *io, const char *fmt, va_list ap) {
+  va_list ap_copy;
+  int n;
+
+  if (io->size - io->len < 64) {
+    mbuf_resize(io, io->len + 64);
+  }
+
+  va_copy(ap_copy, ap);
+  n = json_emit_va(io->buf + io->len, io->size - io->len, fmt, ap_copy);
+  va_end(ap_copy);
+
+  if (n >= (int) (io->size - io->len)) {
+    mbuf_resize(io, io->len + n + 1);
+    if (n >= (int) (io->size - io->len)) {
+      return 0; /* LCOV_EXCL_LINE */
+    }
+    va_copy(ap_copy, ap);
+    json_emit_va(io->buf + io->len, io->size - io->len, fmt, ap_copy);
+    va_end(ap_copy);
+  }
+  io->len += n;
+
+  return n;
+}
+
+static int ns_rpc_emit(struct mbuf *io, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = ns_rpc_emit_va(io, fmt, ap);
+  va_end(ap);
+
+  return n;
+}
+
+/* Append the request ID as is, strings are already escaped */
+static void ns_rpc_append_id(struct mbuf *io,
+                             const struct ns_rpc_request *req) {
+  const struct json_token *id = req->id;
+
+  if (id == NULL) {
+    mbuf_append(io, "null", 4);
+  } else if (id->type == JSON_TYPE_STRING) {
+    mbuf_append(io, id->ptr - 1, id->len + 2);
+  } else {
+    mbuf_append(io, id->ptr, id->len);
+  }
+}
+
+static int ns_rpc_append_reply_va(struct mbuf *io,
+                                  const struct ns_rpc_request *req,
+                                  const char *result_fmt, va_list ap) {
+  size_t start = io->len;
+
+  ns_rpc_emit(io, "{s:s,s:", "jsonrpc", "2.0", "id");
+  ns_rpc_append_id(io, req);
+  ns_rpc_emit(io, ",s:", "result");
+  ns_rpc_emit_va(io, result_fmt, ap);
+  mbuf_append(io, "}", 1);
+
+  return io->len - start;
+}
+
+int ns_rpc_append_reply(struct mbuf *io, const struct ns_rpc_request *req,
+                        const char *result_fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, result_fmt);
+  n = ns_rpc_append_reply_va(io, req, result_fmt, ap);
+  va_end(ap);
+
+  return n;
+}
+
+void ns_rpc_begin_reply(struct ns_json_writer *w,
+                        const struct ns_rpc_request *req) {
+  const struct json_token *id = req->id;
+
+  ns_json_begin_object(w);
+  ns_json_key(w, "jsonrpc");
+  ns_json_string(w, "2.0", 3);
+  ns_json_key(w, "id");
+  if (id == NULL) {
+    ns_json_null(w);
+  } else if (id->type == JSON_TYPE_STRING) {
+    /* Already escaped, keep as is */
+    ns_json_raw(w, id->ptr - 1, id->len + 2);
+  } else {
+    ns_json_raw(w, id->ptr, id->len);
+  }
+  ns_json_key(w, "result");
+}
+
+int ns_rpc_append_error(struct mbuf *io, const struct ns_rpc_request *req,
+                        int code, const char *message, const char *fmt, ...) {
+  size_t start = io->len;
+  va_list ap;
+
+  ns_rpc_emit(io, "{s:s,s:", "jsonrpc", "2.0", "id");
+  ns_rpc_append_id(io, req);
+  ns_rpc_emit(io, ",s:{s:i,s:s,s:", "error", "code", (long) code, "message",
+              message, "data");
+
+  va_start(ap, fmt);
+  ns_rpc_emit_va(io, fmt, ap);
+  va_end(ap);
+
+  mbuf_append(io, "}}", 2);
+
+  return io->len - start;
+}
+
+int ns_rpc_append_std_error(struct mbuf *io, const struct ns_rpc_request *req,
+                            int code) {
+  return ns_rpc_append_error(io, req, code, ns_rpc_std_error_message(code),
+                             "N");
+}
+
+/* FNV-1a */
+static uint32_t ns_rpc_hash(const char *s, int len) {
+  uint32_t h = 2166136261U;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+/* Find the slot of `name`, or the empty slot where it should go */
+static struct ns_rpc_method *ns_rpc_find_slot(struct ns_rpc_methods *methods,
+                                              const char *name, int len,
+                                              uint32_t hash) {
+  int i = hash & (methods->size - 1);
+  struct ns_rpc_method *m;
+
+  for (;;) {
+    m = &methods->table[i];
+    if (m->name == NULL || (m->hash == hash && m->name_len == len &&
+                            memcmp(m->name, name, len) == 0)) {
+      return m;
+    }
+    i = (i + 1) & (methods->size - 1);
+  }
+}
+
+void ns_rpc_methods_init(struct ns_rpc_methods *methods) {
+  memset(methods, 0, sizeof(*methods));
+}
+
+void ns_rpc_methods_free(struct ns_rpc_methods *methods) {
+  NS_FREE(methods->table);
+  ns_rpc_methods_init(methods);
+}
+
+int ns_rpc_add_method(struct ns_rpc_methods *methods, const char *name,
+                      ns_rpc_method_t handler, void *user_data) {
+  struct ns_rpc_method *m;
+  int len = strlen(name), i;
+
+  /* Keep the load factor under 1/2 so that probe sequences stay short */
+  if ((methods->num_methods + 1) * 2 > methods->size) {
+    struct ns_rpc_methods grown;
+    grown.size = methods->size == 0 ? 16 : methods->size * 2;
+    grown.num_methods = methods->num_methods;
+    grown.table = (struct ns_rpc_method *) NS_CALLOC(grown.size,
+                                                     sizeof(*grown.table));
+    if (grown.table == NULL) {
+      return -1;
+    }
+    for (i = 0; i < methods->size; i++) {
+      m = &methods->table[i];
+      if (m->name != NULL) {
+        *ns_rpc_find_slot(&grown, m->name, m->name_len, m->hash) = *m;
+      }
+    }
+    NS_FREE(methods->table);
+    *methods = grown;
+  }
+
+  m = ns_rpc_find_slot(methods, name, len, ns_rpc_hash(name, len));
+  if (m->name == NULL) {
+    methods->num_methods++;
+  }
+  m->name = name;
+  m->name_len = len;
+  m->hash = ns_rpc_hash(name, len);
+  m->handler = handler;
+  m->user_data = user_data;
+
+  return 0;
+}
+
+/*
+ * Dispatch a request parsed into `toks`, return the number of bytes appended.
+ * Notifications (requests without ID) get no reply.
+ */
+static int ns_rpc_dispatch_tokens(struct ns_rpc_methods *methods,
+                                  struct ns_rpc_channel *ch,
+                                  struct json_token *toks, struct mbuf *out) {
+  struct ns_rpc_request req;
+  struct ns_rpc_method *m = NULL;
+  size_t start = out->len;
+
+  memset(&req, 0, sizeof(req));
+  req.message = toks;
+  req.id = find_json_token(toks, "id");
+  req.method = find_json_token(toks, "method");
+  req.params = find_json_token(toks, "params");
+  req.channel = ch;
+
+  if (req.method == NULL || req.method->type != JSON_TYPE_STRING) {
+    ns_rpc_append_std_error(out, &req, JSON_RPC_INVALID_REQUEST_ERROR);
+  } else {
+    if (methods != NULL && methods->size > 0) {
+      m = ns_rpc_find_slot(methods, req.method->ptr, req.method->len,
+                           ns_rpc_hash(req.method->ptr, req.method->len));
+    }
+    if (m == NULL || m->name == NULL) {
+      ns_rpc_append_std_error(out, &req, JSON_RPC_METHOD_NOT_FOUND_ERROR);
+    } else {
+      m->handler(out, &req, m->user_data);
+    }
+    if (req.id == NULL) {
+      out->len = start;
+    }
+  }
+
+  return out->len - start;
+}
+
+static const char *ns_rpc_skip_space(const char *p, const char *end) {
+  while (p < end && isspace(*(unsigned char *) p)) p++;
+  return p;
+}
+
+/* Parse and dispatch a single request */
+static int ns_rpc_dispatch_one(struct ns_rpc_methods *methods,
+                               struct ns_rpc_channel *ch, const char *buf,
+                               int len, struct mbuf *out) {
+  const char *p = ns_rpc_skip_space(buf, buf + len);
+  struct json_token *toks;
+  struct ns_rpc_request req;
+  int n;
+
+  memset(&req, 0, sizeof(req));
+  if (p == buf + len) {
+    /* Nothing at all is not valid JSON */
+    return ns_rpc_append_std_error(out, &req, JSON_RPC_PARSE_ERROR);
+  } else if ((toks = parse_json2(p, (int) (buf + len - p))) == NULL) {
+    /* Frozen only parses objects, anything else is not a request */
+    return ns_rpc_append_std_error(
+        out, &req,
+        *p == '{' ? JSON_RPC_PARSE_ERROR : JSON_RPC_INVALID_REQUEST_ERROR);
+  }
+
+  n = ns_rpc_dispatch_tokens(methods, ch, toks, out);
+
+  /* Allocated by parse_json2() with realloc() */
+  free(toks);
+
+  return n;
+}
+
+/*
+ * Return the length of the JSON value at `p`, or -1 if it's unterminated.
+ * Only nesting and strings are checked, frozen parses the value later.
+ */
+static int ns_rpc_value_len(const char *p, const char *end) {
+  const char *s;
+  int depth = 0, in_string = 0;
+
+  for (s = p; s < end; s++) {
+    if (in_string) {
+      if (*s == '\\') {
+        s++;
+      } else if (*s == '"') {
+        in_string = 0;
+        if (depth == 0) return s + 1 - p;
+      }
+    } else if (*s == '"') {
+      in_string = 1;
+    } else if (*s == '{' || *s == '[') {
+      depth++;
+    } else if (*s == '}' || *s == ']') {
+      if (depth == 0) return s - p;
+      if (--depth == 0) return s + 1 - p;
+    } else if (depth == 0 && (*s == ',' || isspace(*(unsigned char *) s))) {
+      return s - p;
+    }
+  }
+  return -1;
+}
+
+static int ns_rpc_dispatch_batch(struct ns_rpc_methods *methods,
+                                 struct ns_rpc_channel *ch, const char *buf,
+                                 int len, struct mbuf *out) {
+  const char *p, *end = buf + len;
+  struct ns_rpc_request req;
+  size_t start = out->len, pos;
+  int n, num_requests = 0, num_replies = 0;
+
+  memset(&req, 0, sizeof(req));
+  p = ns_rpc_skip_space(buf, end);
+  if (p == end || *p != '[') {
+    return ns_rpc_dispatch_one(methods, ch, buf, len, out);
+  }
+
+  /* Batch: dispatch array elements one by one */
+  mbuf_append(out, "[", 1);
+  for (p = ns_rpc_skip_space(p + 1, end); p < end && *p != ']';) {
+    if ((n = ns_rpc_value_len(p, end)) <= 0) {
+      break;
+    }
+    num_requests++;
+    pos = out->len;
+    if (num_replies > 0) {
+      mbuf_append(out, ",", 1);
+    }
+    if (ns_rpc_dispatch_one(methods, ch, p, n, out) > 0) {
+      num_replies++;
+    } else {
+      out->len = pos;
+    }
+
+    p = ns_rpc_skip_space(p + n, end);
+    if (p < end && *p == ',') {
+      p = ns_rpc_skip_space(p + 1, end);
+    } else if (p < end && *p != ']') {
+      break;
+    }
+  }
+
+  if (p == end || *p != ']') {
+    out->len = start;
+    ns_rpc_append_std_error(out, &req, JSON_RPC_PARSE_ERROR);
+  } else if (num_requests == 0) {
+    /* Empty batch */
+    out->len = start;
+    ns_rpc_append_std_error(out, &req, JSON_RPC_INVALID_REQUEST_ERROR);
+  } else if (num_replies > 0) {
+    mbuf_append(out, "]", 1);
+  } else {
+    /* Batch of notifications */
+    out->len = start;
+  }
+
+  return out->len - start;
+}
+
+int ns_rpc_dispatch_mbuf(struct ns_rpc_methods *methods, const char *buf,
+                         int len, struct mbuf *out) {
+  return ns_rpc_dispatch_batch(methods, NULL, buf, len, out);
+}
+
+/* Populate either `rep` or `er` from a parsed reply message */
+static void ns_rpc_fill_reply(struct json_token *toks, struct ns_rpc_reply *rep,
+                              struct ns_rpc_error *er) {
+  if ((rep->result = find_json_token(toks, "result")) != NULL) {
+    rep->message = toks;
+    rep->id = find_json_token(toks, "id");
+  } else {
+    er->message = toks;
+    er->id = find_json_token(toks, "id");
+    er->error_code = find_json_token(toks, "error.code");
+    er->error_message = find_json_token(toks, "error.message");
+    er->error_data = find_json_token(toks, "error.data");
+  }
+}
+
 int ns_rpc_parse_reply(const char *buf, int len, struct json_token *toks,
                        int max_toks, struct ns_rpc_reply *rep,
                        struct ns_rpc_error *er) {
@@ -139,18 +509,349 @@ int ns_rpc_parse_reply(const char *buf, int len, struct json_token *toks,
   memset(er, 0, sizeof(*er));
 
   if (n > 0) {
-    if ((rep->result = find_json_token(toks, "result")) != NULL) {
-      rep->message = toks;
-      rep->id = find_json_token(toks, "id");
+    ns_rpc_fill_reply(toks, rep, er);
+  }
+  return n;
+}
+
+/* Outstanding call made with ns_rpc_call() */
+struct ns_rpc_pending {
+  unsigned long id;
+  time_t expire;
+  ns_rpc_reply_cb_t cb;
+  void *cb_data;
+  struct ns_rpc_pending *next_in_bucket;
+  struct ns_rpc_pending *prev, *next; /* In the order of expiry */
+};
+
+/* Request whose reply is sent later, see ns_rpc_defer() */
+struct ns_rpc_deferred {
+  struct ns_rpc_channel *ch; /* NULL once the channel is closed */
+  struct ns_rpc_deferred *prev, *next;
+  int id_len;
+  char id[1]; /* Raw JSON text of the request ID, allocated with the struct */
+};
+
+void ns_rpc_channel_init(struct ns_rpc_channel *ch, struct ns_connection *nc,
+                         struct ns_rpc_methods *methods, int flags) {
+  memset(ch, 0, sizeof(*ch));
+  ch->nc = nc;
+  ch->methods = methods;
+  ch->flags = flags;
+  ch->timeout = NS_RPC_DEFAULT_TIMEOUT;
+  ch->next_id = 1;
+}
+
+static void ns_rpc_channel_send(struct ns_rpc_channel *ch, const char *buf,
+                                size_t len) {
+  if (ch->nc == NULL) return;
+#if !defined(NS_DISABLE_HTTP) && !defined(NS_DISABLE_HTTP_WEBSOCKET)
+  if (!(ch->flags & NS_RPC_CHANNEL_TCP)) {
+    ns_send_websocket_frame(ch->nc, WEBSOCKET_OP_TEXT, buf, len);
+    return;
+  }
+#endif
+  ns_send(ch->nc, buf, len);
+  ns_send(ch->nc, "\n", 1);
+}
+
+static struct ns_rpc_pending **ns_rpc_bucket(struct ns_rpc_channel *ch,
+                                             unsigned long id) {
+  return &ch->buckets[id & (NS_RPC_CHANNEL_BUCKETS - 1)];
+}
+
+/* Unlink a pending call from both the hash table and the call list */
+static void ns_rpc_unlink_pending(struct ns_rpc_channel *ch,
+                                  struct ns_rpc_pending *pc) {
+  struct ns_rpc_pending **pp = ns_rpc_bucket(ch, pc->id);
+
+  while (*pp != pc) pp = &(*pp)->next_in_bucket;
+  *pp = pc->next_in_bucket;
+
+  if (pc->prev != NULL) {
+    pc->prev->next = pc->next;
+  } else {
+    ch->oldest = pc->next;
+  }
+  if (pc->next != NULL) {
+    pc->next->prev = pc->prev;
+  } else {
+    ch->newest = pc->prev;
+  }
+  ch->num_pending--;
+}
+
+unsigned long ns_rpc_call(struct ns_rpc_channel *ch, const char *method,
+                          ns_rpc_reply_cb_t cb, void *cb_data,
+                          const char *params_fmt, ...) {
+  struct ns_rpc_pending *pc = NULL, *prev, **bucket;
+  struct mbuf msg;
+  unsigned long id;
+  va_list ap;
+
+  if (ch->nc == NULL) return 0;
+  if (cb != NULL &&
+      (pc = (struct ns_rpc_pending *) NS_CALLOC(1, sizeof(*pc))) == NULL) {
+    return 0;
+  }
+  id = ch->next_id++;
+  if (ch->next_id == 0) ch->next_id = 1;
+
+  mbuf_init(&msg, 0);
+  ns_rpc_emit(&msg, "{s:s,", "jsonrpc", "2.0");
+  if (cb != NULL) {
+    /* Calls without a callback are sent as notifications */
+    ns_rpc_emit(&msg, "s:i,", "id", (long) id);
+  }
+  ns_rpc_emit(&msg, "s:s,s:", "method", method, "params");
+  va_start(ap, params_fmt);
+  ns_rpc_emit_va(&msg, params_fmt, ap);
+  va_end(ap);
+  mbuf_append(&msg, "}", 1);
+  ns_rpc_channel_send(ch, msg.buf, msg.len);
+  mbuf_free(&msg);
+
+  if (pc != NULL) {
+    pc->id = id;
+    pc->expire = time(NULL) + ch->timeout;
+    pc->cb = cb;
+    pc->cb_data = cb_data;
+    bucket = ns_rpc_bucket(ch, id);
+    pc->next_in_bucket = *bucket;
+    *bucket = pc;
+    /* Usually last, unless the timeout was lowered since earlier calls */
+    prev = ch->newest;
+    while (prev != NULL && prev->expire > pc->expire) prev = prev->prev;
+    pc->prev = prev;
+    pc->next = prev != NULL ? prev->next : ch->oldest;
+    if (pc->next != NULL) {
+      pc->next->prev = pc;
+    } else {
+      ch->newest = pc;
+    }
+    if (prev != NULL) {
+      prev->next = pc;
     } else {
-      er->message = toks;
-      er->id = find_json_token(toks, "id");
-      er->error_code = find_json_token(toks, "error.code");
-      er->error_message = find_json_token(toks, "error.message");
-      er->error_data = find_json_token(toks, "error.data");
+      ch->oldest = pc;
     }
+    ch->num_pending++;
   }
-  return n;
+
+  return id;
+}
+
+/* Match a reply to its pending call and invoke the callback */
+static void ns_rpc_handle_reply(struct ns_rpc_channel *ch,
+                                struct json_token *toks) {
+  struct ns_rpc_reply rep;
+  struct ns_rpc_error er;
+  struct json_token *id_tok = find_json_token(toks, "id");
+  struct ns_rpc_pending *pc;
+  unsigned long id = 0;
+  int i;
+
+  if (id_tok == NULL || id_tok->type != JSON_TYPE_NUMBER) return;
+  for (i = 0; i < id_tok->len; i++) {
+    if (!isdigit(*(unsigned char *) &id_tok->ptr[i])) return;
+    id = id * 10 + (id_tok->ptr[i] - '0');
+  }
+
+  for (pc = *ns_rpc_bucket(ch, id); pc != NULL; pc = pc->next_in_bucket) {
+    if (pc->id == id) break;
+  }
+  if (pc == NULL) return; /* Late reply to a call that has timed out */
+
+  memset(&rep, 0, sizeof(rep));
+  memset(&er, 0, sizeof(er));
+  ns_rpc_fill_reply(toks, &rep, &er);
+  ns_rpc_unlink_pending(ch, pc);
+  pc->cb(ch, pc->cb_data, rep.result != NULL ? &rep : NULL,
+         rep.result != NULL ? NULL : &er);
+  NS_FREE(pc);
+}
+
+/* Fail calls that have been waiting for longer than the channel timeout */
+static void ns_rpc_expire_calls(struct ns_rpc_channel *ch, time_t now) {
+  struct ns_rpc_pending *pc;
+
+  while ((pc = ch->oldest) != NULL && (now == 0 || now > pc->expire)) {
+    ns_rpc_unlink_pending(ch, pc);
+    pc->cb(ch, pc->cb_data, NULL, NULL);
+    NS_FREE(pc);
+  }
+}
+
+/* Handle one message: a request, a batch of requests, or a reply */
+static void ns_rpc_channel_message(struct ns_rpc_channel *ch, const char *buf,
+                                   int len) {
+  struct json_token *toks;
+  const char *p = ns_rpc_skip_space(buf, buf + len);
+  struct mbuf out;
+
+  if (p == buf + len) return;
+  mbuf_init(&out, 0);
+
+  if (*p == '{' && (toks = parse_json2(buf, len)) != NULL) {
+    /* Parsed once, then routed by its members */
+    if (find_json_token(toks, "method") == NULL &&
+        (find_json_token(toks, "result") != NULL ||
+         find_json_token(toks, "error") != NULL)) {
+      ns_rpc_handle_reply(ch, toks);
+    } else {
+      ns_rpc_dispatch_tokens(ch->methods, ch, toks, &out);
+    }
+    free(toks);
+  } else {
+    ns_rpc_dispatch_batch(ch->methods, ch, buf, len, &out);
+  }
+
+  if (out.len > 0) {
+    ns_rpc_channel_send(ch, out.buf, out.len);
+  }
+  mbuf_free(&out);
+}
+
+/* Split newline-delimited messages, keep a trailing partial one */
+static void ns_rpc_channel_recv(struct ns_rpc_channel *ch, struct mbuf *io) {
+  size_t i, start = 0;
+
+  for (i = 0; i < io->len; i++) {
+    if (io->buf[i] == '\n') {
+      ns_rpc_channel_message(ch, io->buf + start, i - start);
+      start = i + 1;
+    }
+  }
+  mbuf_remove(io, start);
+}
+
+static void ns_rpc_channel_close(struct ns_rpc_channel *ch) {
+  struct ns_rpc_deferred *d;
+
+  ns_rpc_expire_calls(ch, 0);
+  for (d = ch->deferred; d != NULL; d = d->next) {
+    d->ch = NULL;
+  }
+  ch->deferred = NULL;
+  ch->nc = NULL;
+}
+
+void ns_rpc_channel_handler(struct ns_rpc_channel *ch, int ev, void *ev_data) {
+  if (ch->nc == NULL) return;
+
+  switch (ev) {
+#if !defined(NS_DISABLE_HTTP) && !defined(NS_DISABLE_HTTP_WEBSOCKET)
+    case NS_WEBSOCKET_FRAME:
+      if (!(ch->flags & NS_RPC_CHANNEL_TCP)) {
+        struct websocket_message *wm = (struct websocket_message *) ev_data;
+        ns_rpc_channel_message(ch, (const char *) wm->data, wm->size);
+      }
+      break;
+#endif
+    case NS_RECV:
+      if (ch->flags & NS_RPC_CHANNEL_TCP) {
+        ns_rpc_channel_recv(ch, &ch->nc->recv_mbuf);
+      }
+      break;
+    case NS_CLOSE:
+      ns_rpc_channel_close(ch);
+      return;
+    default:
+      break;
+  }
+
+  /* NS_POLL is skipped for busy connections, so check on every event */
+  if (ch->oldest != NULL) {
+    ns_rpc_expire_calls(ch, time(NULL));
+  }
+}
+
+struct ns_rpc_deferred *ns_rpc_defer(struct ns_rpc_request *req) {
+  struct ns_rpc_channel *ch = req->channel;
+  const struct json_token *id = req->id;
+  struct ns_rpc_deferred *d;
+  const char *p;
+  int len;
+
+  if (ch == NULL || id == NULL) return NULL;
+  /* Keep string IDs quoted, they are echoed verbatim */
+  p = id->type == JSON_TYPE_STRING ? id->ptr - 1 : id->ptr;
+  len = id->type == JSON_TYPE_STRING ? id->len + 2 : id->len;
+  if ((d = (struct ns_rpc_deferred *) NS_MALLOC(sizeof(*d) + len)) == NULL) {
+    return NULL;
+  }
+  memcpy(d->id, p, len);
+  d->id_len = len;
+  d->ch = ch;
+  d->prev = NULL;
+  d->next = ch->deferred;
+  if (ch->deferred != NULL) ch->deferred->prev = d;
+  ch->deferred = d;
+
+  return d;
+}
+
+/* Send the reply accumulated in `out`, release the handle */
+static int ns_rpc_deferred_done(struct ns_rpc_deferred *d, struct mbuf *out) {
+  struct ns_rpc_channel *ch = d->ch;
+  int sent = ch != NULL;
+
+  if (ch != NULL) {
+    ns_rpc_channel_send(ch, out->buf, out->len);
+    if (d->prev != NULL) {
+      d->prev->next = d->next;
+    } else {
+      ch->deferred = d->next;
+    }
+    if (d->next != NULL) d->next->prev = d->prev;
+  }
+  mbuf_free(out);
+  NS_FREE(d);
+
+  return sent ? 0 : -1;
+}
+
+/* Request carrying only the saved ID, for the ns_rpc_append_*() functions */
+static void ns_rpc_deferred_request(struct ns_rpc_deferred *d,
+                                    struct ns_rpc_request *req,
+                                    struct json_token *id) {
+  memset(req, 0, sizeof(*req));
+  memset(id, 0, sizeof(*id));
+  id->ptr = d->id;
+  id->len = d->id_len;
+  id->type = JSON_TYPE_NUMBER;
+  req->id = id;
+}
+
+int ns_rpc_deferred_reply(struct ns_rpc_deferred *d, const char *result_fmt,
+                          ...) {
+  struct ns_rpc_request req;
+  struct json_token id;
+  struct mbuf out;
+  va_list ap;
+
+  ns_rpc_deferred_request(d, &req, &id);
+  mbuf_init(&out, 0);
+  va_start(ap, result_fmt);
+  ns_rpc_append_reply_va(&out, &req, result_fmt, ap);
+  va_end(ap);
+
+  return ns_rpc_deferred_done(d, &out);
+}
+
+int ns_rpc_deferred_error(struct ns_rpc_deferred *d, int code,
+                          const char *message) {
+  struct ns_rpc_request req;
+  struct json_token id;
+  struct mbuf out;
+
+  ns_rpc_deferred_request(d, &req, &id);
+  mbuf_init(&out, 0);
+  ns_rpc_append_error(&out, &req, code,
+                      message != NULL ? message
+                                      : ns_rpc_std_error_message(code),
+                      "N");
+
+  return ns_rpc_deferred_done(d, &out);
 }
 
 #endif /* NS_DISABLE_JSON_RPC */
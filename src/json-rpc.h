@@ -14,12 +14,15 @@
 extern "C" {
 #endif /* __cplusplus */
 
+struct ns_rpc_channel;
+
 /* JSON-RPC request */
 struct ns_rpc_request {
-  struct json_token *message; /* Whole RPC message */
-  struct json_token *id;      /* Message ID */
-  struct json_token *method;  /* Method name */
-  struct json_token *params;  /* Method params */
+  struct json_token *message;     /* Whole RPC message */
+  struct json_token *id;          /* Message ID */
+  struct json_token *method;      /* Method name */
+  struct json_token *params;      /* Method params */
+  struct ns_rpc_channel *channel; /* Channel the request came from, or NULL */
 };
 
 /* JSON-RPC response */
@@ -127,10 +130,239 @@ typedef int (*ns_rpc_handler_t)(char *buf, int len, struct ns_rpc_request *);
  * can be larger then `dst_len` that indicates an overflow.
  * Overflown bytes are not written to the buffer.
  * If method is not found, an error is automatically generated.
+ *
+ * See `ns_rpc_dispatch_mbuf()` for a faster version that supports batch
+ * requests and doesn't truncate the output.
  */
 int ns_rpc_dispatch(const char *buf, int, char *dst, int dst_len,
                     const char **methods, ns_rpc_handler_t *handlers);
 
+/*
+ * Handler of a method registered with `ns_rpc_add_method()`.
+ *
+ * The handler appends the reply to `out`, typically with
+ * `ns_rpc_append_reply()` or `ns_rpc_append_std_error()`.
+ */
+typedef int (*ns_rpc_method_t)(struct mbuf *out, struct ns_rpc_request *,
+                               void *user_data);
+
+/* Entry of the method hash table. */
+struct ns_rpc_method {
+  const char *name; /* Method name, NULL for empty slots */
+  int name_len;
+  uint32_t hash;
+  ns_rpc_method_t handler;
+  void *user_data;
+};
+
+/* JSON-RPC method table, zero-initialize or use `ns_rpc_methods_init()`. */
+struct ns_rpc_methods {
+  struct ns_rpc_method *table; /* Open addressing hash table */
+  int size;                    /* Number of slots, a power of 2 */
+  int num_methods;             /* Number of used slots */
+};
+
+/* Initialize an empty method table. */
+void ns_rpc_methods_init(struct ns_rpc_methods *);
+
+/* Free memory used by a method table. */
+void ns_rpc_methods_free(struct ns_rpc_methods *);
+
+/*
+ * Register a method handler. `name` is not copied and must stay valid.
+ * Registering an existing name replaces its handler.
+ *
+ * Return -1 if out of memory.
+ */
+int ns_rpc_add_method(struct ns_rpc_methods *, const char *name,
+                      ns_rpc_method_t handler, void *user_data);
+
+/*
+ * Dispatch a JSON-RPC request or batch of requests contained in `buf`, `len`
+ * to the methods registered in `methods`, appending the reply to `out`.
+ *
+ * A batch (JSON array of requests) gets an array of replies. Requests
+ * without an `id` are notifications and get no reply; if there's nothing to
+ * reply, nothing is appended. Unknown methods and malformed requests
+ * are answered with standard errors.
+ *
+ * Return the number of bytes appended.
+ */
+int ns_rpc_dispatch_mbuf(struct ns_rpc_methods *methods, const char *buf,
+                         int len, struct mbuf *out);
+
+/*
+ * Append a JSON-RPC reply to an IO buffer.
+ *
+ * Same as `ns_rpc_create_reply()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_reply(struct mbuf *, const struct ns_rpc_request *req,
+                        const char *result_fmt, ...);
+
+/*
+ * Start a JSON-RPC reply with a JSON writer.
+ *
+ * Writes the reply object up to the `result` key. The caller then writes the
+ * result value and closes the reply with `ns_json_end_object()`:
+ *
+ * [source,c]
+ * ----
+ * static int rpc_list(struct mbuf *out, struct ns_rpc_request *req,
+ *                     void *user_data) {
+ *   struct ns_json_writer w;
+ *   int i;
+ *
+ *   ns_json_init(&w, out);
+ *   ns_rpc_begin_reply(&w, req);
+ *   ns_json_begin_array(&w);
+ *   for (i = 0; i < num_items; i++) {
+ *     ns_json_string(&w, items[i], strlen(items[i]));
+ *   }
+ *   ns_json_end_array(&w);
+ *   ns_json_end_object(&w);
+ *   return 0;
+ * }
+ * ----
+ */
+void ns_rpc_begin_reply(struct ns_json_writer *, const struct ns_rpc_request *);
+
+/*
+ * Append a JSON-RPC error to an IO buffer.
+ *
+ * Same as `ns_rpc_create_error()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_error(struct mbuf *, const struct ns_rpc_request *req,
+                        int code, const char *message, const char *fmt, ...);
+
+/*
+ * Append a standard JSON-RPC error to an IO buffer.
+ *
+ * Same as `ns_rpc_create_std_error()`, but the output buffer grows as needed.
+ * Return the number of bytes appended.
+ */
+int ns_rpc_append_std_error(struct mbuf *, const struct ns_rpc_request *req,
+                            int code);
+
+/*
+ * Reply callback of `ns_rpc_call()`.
+ *
+ * On success `reply` is set, on JSON-RPC error `error` is set. Both are NULL
+ * if the call timed out or the connection was closed before a reply came.
+ */
+typedef void (*ns_rpc_reply_cb_t)(struct ns_rpc_channel *, void *cb_data,
+                                  struct ns_rpc_reply *reply,
+                                  struct ns_rpc_error *error);
+
+struct ns_rpc_pending;
+struct ns_rpc_deferred;
+
+#define NS_RPC_CHANNEL_TCP (1 << 0) /* Newline-delimited messages over TCP */
+
+#ifndef NS_RPC_DEFAULT_TIMEOUT
+#define NS_RPC_DEFAULT_TIMEOUT 10 /* Seconds */
+#endif
+
+#ifndef NS_RPC_CHANNEL_BUCKETS
+#define NS_RPC_CHANNEL_BUCKETS 64 /* Must be a power of 2 */
+#endif
+
+/*
+ * JSON-RPC channel: a connection that carries requests and replies
+ * in both directions.
+ *
+ * By default messages are websocket text frames. With `NS_RPC_CHANNEL_TCP`
+ * each message is a line of JSON terminated by `\n`.
+ */
+struct ns_rpc_channel {
+  struct ns_connection *nc;       /* NULL once the connection is closed */
+  struct ns_rpc_methods *methods; /* Methods served, can be NULL */
+  int flags;                      /* NS_RPC_CHANNEL_* flags */
+  int timeout;                    /* For calls made next, in seconds */
+  void *user_data;
+
+  /* Private */
+  unsigned long next_id;
+  int num_pending; /* Number of calls waiting for a reply */
+  struct ns_rpc_pending *buckets[NS_RPC_CHANNEL_BUCKETS]; /* Keyed by ID */
+  struct ns_rpc_pending *oldest, *newest;
+  struct ns_rpc_deferred *deferred;
+};
+
+/*
+ * Initialize a channel over connection `nc`, serving `methods`.
+ *
+ * The channel must stay valid until the connection is closed.
+ * The connection event handler must pass all events to
+ * `ns_rpc_channel_handler()`:
+ *
+ * [source,c]
+ * ----
+ * static void ev_handler(struct ns_connection *nc, int ev, void *ev_data) {
+ *   struct ns_rpc_channel *ch = (struct ns_rpc_channel *) nc->user_data;
+ *   ns_rpc_channel_handler(ch, ev, ev_data);
+ *   if (ev == NS_CLOSE) free(ch);
+ * }
+ * ----
+ */
+void ns_rpc_channel_init(struct ns_rpc_channel *, struct ns_connection *nc,
+                         struct ns_rpc_methods *methods, int flags);
+
+/*
+ * Channel event handler.
+ *
+ * Dispatches incoming requests, matches replies to outstanding calls and
+ * fails calls that timed out. On `NS_CLOSE`, all outstanding calls fail.
+ */
+void ns_rpc_channel_handler(struct ns_rpc_channel *, int ev, void *ev_data);
+
+/*
+ * Call a remote method. `params_fmt` follows the `json_emit()` API.
+ *
+ * The call is sent right away, without waiting for replies to previous
+ * calls: any number of calls can be in flight on the same channel. `cb` is
+ * invoked once, when the reply arrives or the call times out. If `cb` is
+ * NULL, the call is sent as a notification.
+ *
+ * Return the ID of the call, or 0 on error.
+ */
+unsigned long ns_rpc_call(struct ns_rpc_channel *, const char *method,
+                          ns_rpc_reply_cb_t cb, void *cb_data,
+                          const char *params_fmt, ...);
+
+/*
+ * Reply to a request later.
+ *
+ * Called from a method handler instead of appending a reply. The returned
+ * handle must be passed to `ns_rpc_deferred_reply()` or
+ * `ns_rpc_deferred_error()`, which send the reply and release the handle.
+ * If the request is in a batch, its reply is sent as a separate message.
+ *
+ * Return NULL if the request is a notification, didn't come from a channel,
+ * or if out of memory.
+ */
+struct ns_rpc_deferred *ns_rpc_defer(struct ns_rpc_request *);
+
+/*
+ * Send the result of a deferred request and release the handle.
+ *
+ * Return -1 if the channel has been closed in the meantime; the handle is
+ * released anyway.
+ */
+int ns_rpc_deferred_reply(struct ns_rpc_deferred *, const char *result_fmt,
+                          ...);
+
+/*
+ * Send an error reply to a deferred request and release the handle.
+ * If `message` is NULL, the standard message for `code` is used.
+ *
+ * Return -1 if the channel has been closed in the meantime; the handle is
+ * released anyway.
+ */
+int ns_rpc_deferred_error(struct ns_rpc_deferred *, int code,
+                          const char *message);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2015 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#include "internal.h"
+
+/*
+ * Escape sequence for each byte: 0 if the byte is copied as is,
+ * 'u' for \u00XX, or the letter following the backslash.
+ */
+static const char ns_json_esc[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   '\\'};
+
+static const char ns_json_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void ns_json_put(struct ns_json_writer *w, const void *p, size_t len) {
+  if (mbuf_append(w->io, p, len) != len) {
+    w->error = 1; /* LCOV_EXCL_LINE */
+  }
+}
+
+/* Grow the buffer once for output of a known maximum size */
+static void ns_json_reserve(struct ns_json_writer *w, size_t len) {
+  struct mbuf *io = w->io;
+
+  if (io->size - io->len < len) {
+    mbuf_resize(io, io->len + len + io->len / 2);
+  }
+}
+
+/* Comma before a value, unless it's the first item or follows a key */
+static void ns_json_sep(struct ns_json_writer *w) {
+  uint32_t bit;
+
+  if (w->after_key) {
+    w->after_key = 0;
+  } else if (w->depth > 0) {
+    bit = (uint32_t) 1 << (w->depth - 1);
+    if (w->has_items & bit) {
+      ns_json_put(w, ",", 1);
+    }
+    w->has_items |= bit;
+  }
+}
+
+static void ns_json_open(struct ns_json_writer *w, char c) {
+  ns_json_sep(w);
+  if (w->depth >= NS_JSON_MAX_DEPTH) {
+    w->error = 1;
+    return;
+  }
+  ns_json_put(w, &c, 1);
+  w->has_items &= ~((uint32_t) 1 << w->depth);
+  w->depth++;
+}
+
+static void ns_json_close(struct ns_json_writer *w, char c) {
+  if (w->depth == 0) {
+    w->error = 1;
+    return;
+  }
+  ns_json_put(w, &c, 1);
+  w->depth--;
+  w->after_key = 0;
+}
+
+void ns_json_init(struct ns_json_writer *w, struct mbuf *io) {
+  memset(w, 0, sizeof(*w));
+  w->io = io;
+}
+
+void ns_json_begin_object(struct ns_json_writer *w) {
+  ns_json_open(w, '{');
+}
+
+void ns_json_end_object(struct ns_json_writer *w) {
+  ns_json_close(w, '}');
+}
+
+void ns_json_begin_array(struct ns_json_writer *w) {
+  ns_json_open(w, '[');
+}
+
+void ns_json_end_array(struct ns_json_writer *w) {
+  ns_json_close(w, ']');
+}
+
+/* Copy runs of plain bytes at once, escape the rest */
+static void ns_json_put_quoted(struct ns_json_writer *w, const char *s,
+                               size_t len) {
+  const unsigned char *p = (const unsigned char *) s, *end = p + len, *run;
+  char esc[6] = {'\\', 'u', '0', '0'};
+  char c;
+
+  ns_json_reserve(w, len + 2);
+  ns_json_put(w, "\"", 1);
+  while (p < end) {
+    for (run = p; p < end && ns_json_esc[*p] == 0; p++) {
+    }
+    if (p > run) {
+      ns_json_put(w, run, p - run);
+    }
+    if (p < end) {
+      if ((c = ns_json_esc[*p]) == 'u') {
+        esc[4] = "0123456789abcdef"[*p >> 4];
+        esc[5] = "0123456789abcdef"[*p & 0xf];
+        ns_json_put(w, esc, 6);
+      } else {
+        esc[1] = c;
+        ns_json_put(w, esc, 2);
+        esc[1] = 'u';
+      }
+      p++;
+    }
+  }
+  ns_json_put(w, "\"", 1);
+}
+
+void ns_json_key(struct ns_json_writer *w, const char *key) {
+  ns_json_sep(w);
+  ns_json_put_quoted(w, key, strlen(key));
+  ns_json_put(w, ":", 1);
+  w->after_key = 1;
+}
+
+void ns_json_string(struct ns_json_writer *w, const char *s, size_t len) {
+  ns_json_sep(w);
+  ns_json_put_quoted(w, s, len);
+}
+
+/* Format two digits at a time, right to left */
+static void ns_json_put_int(struct ns_json_writer *w, int64_t v) {
+  char buf[24], *p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? 0 - (uint64_t) v : (uint64_t) v;
+  int i;
+
+  while (u >= 100) {
+    i = (int) (u % 100) * 2;
+    u /= 100;
+    *--p = ns_json_digits[i + 1];
+    *--p = ns_json_digits[i];
+  }
+  if (u >= 10) {
+    i = (int) u * 2;
+    *--p = ns_json_digits[i + 1];
+    *--p = ns_json_digits[i];
+  } else {
+    *--p = (char) ('0' + u);
+  }
+  if (v < 0) {
+    *--p = '-';
+  }
+  ns_json_put(w, p, buf + sizeof(buf) - p);
+}
+
+void ns_json_int(struct ns_json_writer *w, int64_t v) {
+  ns_json_sep(w);
+  ns_json_put_int(w, v);
+}
+
+void ns_json_double(struct ns_json_writer *w, double v) {
+  char buf[32];
+  int n;
+
+  ns_json_sep(w);
+  if (v != v || v - v != 0) {
+    /* NaN or infinity */
+    ns_json_put(w, "null", 4);
+  } else if (v > -1e15 && v < 1e15 && v == (double) (int64_t) v) {
+    ns_json_put_int(w, (int64_t) v);
+  } else {
+    /* Shortest of the two precisions that reads back the same */
+    n = snprintf(buf, sizeof(buf), "%.15g", v);
+    if (strtod(buf, NULL) != v) {
+      n = snprintf(buf, sizeof(buf), "%.17g", v);
+    }
+    ns_json_put(w, buf, n);
+  }
+}
+
+void ns_json_bool(struct ns_json_writer *w, int v) {
+  ns_json_sep(w);
+  ns_json_put(w, v ? "true" : "false", v ? 4 : 5);
+}
+
+void ns_json_null(struct ns_json_writer *w) {
+  ns_json_sep(w);
+  ns_json_put(w, "null", 4);
+}
+
+void ns_json_raw(struct ns_json_writer *w, const char *json, size_t len) {
+  ns_json_sep(w);
+  ns_json_put(w, json, len);
+}
+
+/*
+ * Lazy reader.
+ *
+ * Values on the path are located by skipping everything else: skipped
+ * subtrees are only checked for balanced brackets and terminated strings.
+ */
+
+/* Bytes that change the scanner state inside a container */
+static const unsigned char ns_json_structural[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 1, 0, 1};
+
+static const char *ns_json_skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+  return p;
+}
+
+/*
+ * `p` points after the opening quote. Return the closing quote, or NULL.
+ * Eight bytes are checked at a time for a quote or a backslash.
+ */
+static const char *ns_json_string_end(const char *p, const char *end) {
+  const uint64_t ones = ~(uint64_t) 0 / 255, highs = ones * 0x80;
+  const uint64_t quotes = ones * '"', slashes = ones * '\\';
+  uint64_t v, q, s;
+
+  for (;;) {
+    while (end - p >= 8) {
+      memcpy(&v, p, sizeof(v));
+      q = v ^ quotes;
+      s = v ^ slashes;
+      if ((((q - ones) & ~q) | ((s - ones) & ~s)) & highs) break;
+      p += 8;
+    }
+    while (p < end && *p != '"' && *p != '\\') p++;
+    if (p >= end) return NULL;
+    if (*p == '"') return p;
+    p += 2; /* Escaped character */
+  }
+}
+
+/* Return the end of the value starting at `p`, or NULL if malformed */
+static const char *ns_json_value_end(const char *p, const char *end) {
+  int depth = 0;
+
+  if (p >= end) return NULL;
+  if (*p == '"') {
+    p = ns_json_string_end(p + 1, end);
+    return p == NULL ? NULL : p + 1;
+  }
+  if (*p != '{' && *p != '[') {
+    /* Scalar: number, true, false or null */
+    const char *s = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+           *p != '\t' && *p != '\n' && *p != '\r') {
+      p++;
+    }
+    if ((*s == 't' && (p - s != 4 || memcmp(s, "true", 4) != 0)) ||
+        (*s == 'f' && (p - s != 5 || memcmp(s, "false", 5) != 0)) ||
+        (*s == 'n' && (p - s != 4 || memcmp(s, "null", 4) != 0))) {
+      return NULL;
+    }
+    return p > s ? p : NULL;
+  }
+
+  for (; p < end; p++) {
+    if (!ns_json_structural[*(const unsigned char *) p]) continue;
+    if (*p == '"') {
+      if ((p = ns_json_string_end(p + 1, end)) == NULL) return NULL;
+    } else if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (--depth == 0) {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+static int ns_json_value_type(const char *p) {
+  switch (*p) {
+    case '"':
+      return JSON_TYPE_STRING;
+    case '{':
+      return JSON_TYPE_OBJECT;
+    case '[':
+      return JSON_TYPE_ARRAY;
+    case 't':
+      return JSON_TYPE_TRUE;
+    case 'f':
+      return JSON_TYPE_FALSE;
+    case 'n':
+      return JSON_TYPE_NULL;
+    default:
+      return JSON_TYPE_NUMBER;
+  }
+}
+
+/* Move `p` to the member `key`, `key_len` of the object at `p` */
+static const char *ns_json_find_key(const char *p, const char *end,
+                                    const char *key, size_t key_len) {
+  const char *k;
+
+  p = ns_json_skip_ws(p + 1, end);
+  if (p < end && *p == '}') return NULL;
+  while (p < end && *p == '"') {
+    k = p + 1;
+    if ((p = ns_json_string_end(k, end)) == NULL) return NULL;
+    /* Keys are compared as written, like find_json_token() does */
+    if ((size_t)(p - k) == key_len && memcmp(k, key, key_len) == 0) {
+      p = ns_json_skip_ws(p + 1, end);
+      return p < end && *p == ':' ? ns_json_skip_ws(p + 1, end) : NULL;
+    }
+    p = ns_json_skip_ws(p + 1, end);
+    if (p >= end || *p != ':') return NULL;
+    p = ns_json_value_end(ns_json_skip_ws(p + 1, end), end);
+    if (p == NULL) return NULL;
+    p = ns_json_skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = ns_json_skip_ws(p + 1, end);
+  }
+  return NULL;
+}
+
+/* Move `p` to the element `index` of the array at `p` */
+static const char *ns_json_find_index(const char *p, const char *end,
+                                      int index) {
+  p = ns_json_skip_ws(p + 1, end);
+  if (p < end && *p == ']') return NULL;
+  while (index-- > 0) {
+    if ((p = ns_json_value_end(p, end)) == NULL) return NULL;
+    p = ns_json_skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = ns_json_skip_ws(p + 1, end);
+  }
+  return p < end ? p : NULL;
+}
+
+int ns_json_find(const char *buf, size_t len, const char *path,
+                 struct ns_str *value) {
+  const char *p = ns_json_skip_ws(buf, buf + len), *end = buf + len, *v;
+  int index, nested = *path != '\0';
+  size_t n;
+
+  while (p != NULL && p < end && *path != '\0') {
+    if (*path == '[') {
+      if (*p != '[' || !isdigit(*(const unsigned char *) (path + 1))) {
+        return JSON_TYPE_EOF;
+      }
+      for (index = 0, path++; isdigit(*(const unsigned char *) path); path++) {
+        index = index * 10 + (*path - '0');
+      }
+      if (*path++ != ']') return JSON_TYPE_EOF;
+      p = ns_json_find_index(p, end, index);
+    } else {
+      if (*p != '{') return JSON_TYPE_EOF;
+      n = strcspn(path, ".[");
+      p = ns_json_find_key(p, end, path, n);
+      path += n;
+    }
+    if (*path == '.') path++;
+  }
+
+  /* A member or element is always followed by something, at least `}` */
+  if (p == NULL || p >= end || *path != '\0' ||
+      (v = ns_json_value_end(p, end)) == NULL || (nested && v == end)) {
+    return JSON_TYPE_EOF;
+  }
+  if (*p == '"') {
+    /* Like frozen tokens, strings exclude the quotes */
+    value->p = p + 1;
+    value->len = v - p - 2;
+  } else {
+    value->p = p;
+    value->len = v - p;
+  }
+  return ns_json_value_type(p);
+}
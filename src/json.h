@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2015 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * === JSON
+ */
+
+#ifndef NS_JSON_HEADER_DEFINED
+#define NS_JSON_HEADER_DEFINED
+
+#include "net.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define NS_JSON_MAX_DEPTH 32
+
+/*
+ * Streaming JSON writer.
+ *
+ * Values are appended straight to an IO buffer, which grows as needed:
+ * output is never truncated. Commas and colons are inserted automatically.
+ * The IO buffer can be a connection's `send_mbuf`, see
+ * `ns_send_http_response_at()` and `ns_send_websocket_frame_at()`:
+ *
+ * [source,c]
+ * ----
+ * struct ns_json_writer w;
+ * size_t off = nc->send_mbuf.len;
+ *
+ * ns_json_init(&w, &nc->send_mbuf);
+ * ns_json_begin_object(&w);
+ * ns_json_key(&w, "name");
+ * ns_json_string(&w, name, strlen(name));
+ * ns_json_key(&w, "size");
+ * ns_json_int(&w, size);
+ * ns_json_end_object(&w);
+ * ns_send_http_response_at(nc, off, 200, "Content-Type: application/json\r\n");
+ * ----
+ */
+struct ns_json_writer {
+  struct mbuf *io;    /* Output buffer */
+  int depth;          /* Number of open objects and arrays */
+  int after_key;      /* The next value belongs to a key just written */
+  uint32_t has_items; /* Bit N: open container N has items */
+  int error;          /* Non-zero if nested too deep or out of memory */
+};
+
+/* Initialize a writer appending to `io`. */
+void ns_json_init(struct ns_json_writer *, struct mbuf *io);
+
+void ns_json_begin_object(struct ns_json_writer *);
+void ns_json_end_object(struct ns_json_writer *);
+void ns_json_begin_array(struct ns_json_writer *);
+void ns_json_end_array(struct ns_json_writer *);
+
+/* Write an object key, 0-terminated. The value must follow. */
+void ns_json_key(struct ns_json_writer *, const char *key);
+
+/* Write a string value, escaping it as needed. */
+void ns_json_string(struct ns_json_writer *, const char *s, size_t len);
+
+void ns_json_int(struct ns_json_writer *, int64_t v);
+
+/*
+ * Write a number with enough digits to read back the same value.
+ * NaN and infinities have no JSON representation and are written as `null`.
+ */
+void ns_json_double(struct ns_json_writer *, double v);
+
+void ns_json_bool(struct ns_json_writer *, int v);
+void ns_json_null(struct ns_json_writer *);
+
+/* Write an already encoded JSON value as is. */
+void ns_json_raw(struct ns_json_writer *, const char *json, size_t len);
+
+/*
+ * Find the value at `path` in the JSON document `buf`, `len`, without
+ * tokenizing the whole document.
+ *
+ * `path` has the same syntax as for `find_json_token()`, e.g.
+ * `"params.items[2].name"`; an empty path selects the whole document.
+ * Subtrees that aren't on the path are skipped by a fast scanner that only
+ * checks brackets and strings, so a malformed document might not be
+ * detected. Keys are compared as written, without unescaping.
+ *
+ * On success, `value` points to the value in `buf`. As with frozen tokens,
+ * quotes are excluded for strings, and objects and arrays include their
+ * brackets. Return the type of the value (`JSON_TYPE_*`), or
+ * `JSON_TYPE_EOF` (0) if it's not found or the document is malformed.
+ *
+ * [source,c]
+ * ----
+ * struct ns_str user, id;
+ *
+ * if (ns_json_find(hm->body.p, hm->body.len, "user.name", &user) ==
+ *         JSON_TYPE_STRING &&
+ *     ns_json_find(hm->body.p, hm->body.len, "id", &id) == JSON_TYPE_NUMBER) {
+ *   ...
+ * }
+ * ----
+ */
+int ns_json_find(const char *buf, size_t len, const char *path,
+                 struct ns_str *value);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* NS_JSON_HEADER_DEFINED */
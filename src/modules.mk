@@ -11,6 +11,7 @@ HEADERS = common.h \
           $(FROZEN)/frozen.h \
           net.h \
           util.h \
+          json.h \
           http.h \
           json-rpc.h \
           mqtt.h \
@@ -31,6 +32,7 @@ SOURCES = $(COMMON)/mbuf.c \
           multithreading.c \
           http.c \
           util.c \
+          json.c \
           json-rpc.c \
           mqtt.c \
           mqtt-broker.c \
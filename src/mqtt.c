@@ -12,7 +12,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
   int cmd;
   size_t len = 0;
   int var_len = 0;
-  char *vlen = &io->buf[1];
+  char *vlen = &io->buf[1], *p;
 
   if (io->len < 2) return -1;
 
@@ -24,9 +24,10 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
     len += (*vlen & 127) << 7 * (vlen - &io->buf[1]);
   } while ((*vlen++ & 128) != 0 && ((size_t)(vlen - io->buf) <= io->len));
 
-  if (io->len < (size_t)(len - 1)) return -1;
+  if (io->len < (size_t)(vlen - io->buf) + len) return -1;
 
-  mbuf_remove(io, 1 + (vlen - &io->buf[1]));
+  /* The message stays buffered until the handler is done with it */
+  p = vlen;
   mm->cmd = cmd;
   mm->qos = NS_MQTT_GET_QOS(header);
 
@@ -35,7 +36,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
       /* TODO(mkm): parse keepalive and will */
       break;
     case NS_MQTT_CMD_CONNACK:
-      mm->connack_ret_code = io->buf[1];
+      mm->connack_ret_code = p[1];
       var_len = 2;
       break;
     case NS_MQTT_CMD_PUBACK:
@@ -43,18 +44,18 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
     case NS_MQTT_CMD_PUBREL:
     case NS_MQTT_CMD_PUBCOMP:
     case NS_MQTT_CMD_SUBACK:
-      mm->message_id = ntohs(*(uint16_t *) io->buf);
+      mm->message_id = ntohs(*(uint16_t *) p);
       var_len = 2;
       break;
     case NS_MQTT_CMD_PUBLISH: {
-      uint16_t topic_len = ntohs(*(uint16_t *) io->buf);
+      uint16_t topic_len = ntohs(*(uint16_t *) p);
       mm->topic = (char *) NS_MALLOC(topic_len + 1);
       mm->topic[topic_len] = 0;
-      strncpy(mm->topic, io->buf + 2, topic_len);
+      strncpy(mm->topic, p + 2, topic_len);
       var_len = topic_len + 2;
 
       if (NS_MQTT_GET_QOS(header) > 0) {
-        mm->message_id = ntohs(*(uint16_t *) io->buf);
+        mm->message_id = ntohs(*(uint16_t *) p);
         var_len += 2;
       }
     } break;
@@ -63,7 +64,7 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
        * topic expressions are left in the payload and can be parsed with
        * `ns_mqtt_next_subscribe_topic`
        */
-      mm->message_id = ntohs(*(uint16_t *) io->buf);
+      mm->message_id = ntohs(*(uint16_t *) p);
       var_len = 2;
       break;
     default:
@@ -71,31 +72,57 @@ static int parse_mqtt(struct mbuf *io, struct ns_mqtt_message *mm) {
       break;
   }
 
-  mbuf_remove(io, var_len);
+  mm->payload.p = p + var_len;
   return len - var_len;
 }
 
 static void mqtt_handler(struct ns_connection *nc, int ev, void *ev_data) {
   int len;
+  size_t msg_len;
   struct mbuf *io = &nc->recv_mbuf;
   struct ns_mqtt_message mm;
   memset(&mm, 0, sizeof(mm));
 
   nc->handler(nc, ev, ev_data);
 
+  if (ev == NS_POLL && (nc->flags & NSF_RATE_LIMITED) &&
+      nc->recv_resume_time == 0) {
+    /* Retry the PUBLISH delayed by the rate limit */
+    nc->flags &= ~NSF_RATE_LIMITED;
+    ev = NS_RECV;
+  }
+
   switch (ev) {
     case NS_RECV:
       len = parse_mqtt(io, &mm);
       if (len == -1) break; /* not fully buffered */
-      mm.payload.p = io->buf;
       mm.payload.len = len;
+      msg_len = mm.payload.p + len - io->buf;
+
+      if (mm.cmd == NS_MQTT_CMD_PUBLISH) {
+        double retry_after;
+        switch (ns_rate_limit_message(nc, &mm, &retry_after)) {
+          case 0:
+            break;
+          case NS_RATE_LIMIT_REJECT:
+            /* MQTT has no way to refuse a PUBLISH, drop it */
+            mm.cmd = 0;
+            break;
+          default:
+            /* Closing, or delayed: the message stays buffered */
+            if (mm.topic) NS_FREE(mm.topic);
+            return;
+        }
+      }
 
-      nc->handler(nc, NS_MQTT_EVENT_BASE + mm.cmd, &mm);
+      if (mm.cmd != 0) {
+        nc->handler(nc, NS_MQTT_EVENT_BASE + mm.cmd, &mm);
+      }
 
       if (mm.topic) {
         NS_FREE(mm.topic);
       }
-      mbuf_remove(io, mm.payload.len);
+      mbuf_remove(io, msg_len);
       break;
   }
 }
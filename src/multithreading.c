@@ -73,6 +73,10 @@ static void spawn_handling_thread(struct ns_connection *nc) {
    * will be set in another thread, allocated on stack of that thread.
    */
   ns_add_conn(nc->mgr, c[0]);
+#ifdef NS_ENABLE_SPLICE
+  /* Plain sockets go through the kernel, forwarder_ev_handler does the rest */
+  ns_splice(nc, c[0]);
+#endif
 
   /*
    * Dress c[1] as nc.
@@ -22,10 +22,103 @@
 #include <sys/epoll.h>
 #endif
 
+#if defined(NS_ENABLE_SEND_FILE) && defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#if !defined(_WIN32) && !defined(NS_ESP8266) && !defined(NO_LIBC) && \
+    !defined(NO_BSD_SOCKETS)
+#include <netinet/tcp.h>
+#endif
+
+#if defined(NS_ENABLE_SPLICE) && !defined(SPLICE_F_MOVE)
+/* glibc hides them without _GNU_SOURCE */
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+ssize_t splice(int, void *, int, void *, size_t, unsigned int);
+#endif
+#if defined(NS_ENABLE_SPLICE) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+#ifdef NS_ENABLE_UDP_GSO
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+#ifdef NS_ENABLE_ZEROCOPY
+#ifndef SO_ZEROCOPY
+#include <asm/socket.h> /* glibc hides it without _DEFAULT_SOURCE */
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#define NS_EE_ORIGIN_ZEROCOPY 5       /* SO_EE_ORIGIN_ZEROCOPY */
+#define NS_EE_CODE_ZEROCOPY_COPIED 1 /* SO_EE_CODE_ZEROCOPY_COPIED */
+#endif
+
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(__linux__) && \
+    !defined(SO_PEERCRED)
+#include <asm/socket.h> /* glibc hides it without _DEFAULT_SOURCE */
+#endif
+
+#if defined(NS_ENABLE_SSL) && defined(OPENSSL_VERSION_NUMBER) && \
+    OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define NS_SSL_OPENSSL_1_1 /* Not krypton or an older OpenSSL */
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+static void ns_ssl_client_cache_free(struct ns_ssl_client_cache *);
+#endif
+
+#ifdef NS_WORKERS
+#include <pthread.h>
+static void ns_workers_free(struct ns_workers *);
+#endif
+#if defined(NS_SSL_OPENSSL_1_1) && defined(NS_WORKERS)
+#define NS_SSL_WORKERS
+static void ns_workers_quiesce(struct ns_workers *);
+#endif
+
 #define NS_CTL_MSG_MESSAGE_SIZE 8192
 #define NS_READ_BUFFER_SIZE 1024
+#define NS_SSL_MAX_RECORD_SIZE 16384 /* Max TLS record payload */
+#ifndef NS_SSL_SMALL_RECORD_SIZE
+#define NS_SSL_SMALL_RECORD_SIZE 1400 /* A record per TCP segment */
+#endif
+#ifndef NS_SSL_SMALL_RECORDS_LIMIT
+#define NS_SSL_SMALL_RECORDS_LIMIT (1024 * 1024) /* Then switch to bulk */
+#endif
+#ifndef NS_SSL_IDLE_RESET
+#define NS_SSL_IDLE_RESET 1.0 /* Seconds idle before small records again */
+#endif
+#ifndef NS_TCP_FASTOPEN_QUEUE
+#define NS_TCP_FASTOPEN_QUEUE 256 /* Pending Fast Open connections */
+#endif
+#ifndef NS_RECV_BUDGET
+#define NS_RECV_BUDGET 65536
+#endif
 #define NS_UDP_RECEIVE_BUFFER_SIZE 1500
+#define NS_UDP_GRO_BUFFER_SIZE 65536   /* Largest coalesced datagram */
+#define NS_UDP_GSO_MAX_SEGMENT 1400    /* Datagrams that fit a frame */
+#define NS_UDP_GSO_MAX_SEGMENTS 64     /* Kernel limit before Linux 5.5 */
+#define NS_UDP_GSO_MAX_SIZE 65000      /* Bytes per UDP_SEGMENT send */
+#ifndef NS_HANDOFF_TIMEOUT
+#define NS_HANDOFF_TIMEOUT 5 /* Seconds */
+#endif
+#define NS_HANDOFF_MAX_SOCKETS 64
 #define NS_VPRINTF_BUFFER_SIZE 100
+#ifndef NS_SSL_CLIENT_SESSIONS
+#define NS_SSL_CLIENT_SESSIONS 64 /* Per client context */
+#endif
 #define NS_MAX_HOST_LEN 200
 
 #define NS_COPY_COMMON_CONNECTION_OPTIONS(dst, src) \
@@ -34,12 +127,12 @@
 /* Which flags can be pre-set by the user at connection creation time. */
 #define _NS_ALLOWED_CONNECT_FLAGS_MASK                              \
   (NSF_USER_1 | NSF_USER_2 | NSF_USER_3 | NSF_USER_4 | NSF_USER_5 | \
-   NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG)
+   NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG | NSF_TCP_FASTOPEN)
 /* Which flags should be modifiable by user's callbacks. */
 #define _NS_CALLBACK_MODIFIABLE_FLAGS_MASK                                     \
   (NSF_USER_1 | NSF_USER_2 | NSF_USER_3 | NSF_USER_4 | NSF_USER_5 |            \
    NSF_USER_6 | NSF_WEBSOCKET_NO_DEFRAG | NSF_SEND_AND_CLOSE | NSF_DONT_SEND | \
-   NSF_CLOSE_IMMEDIATELY | NSF_IS_WEBSOCKET)
+   NSF_CLOSE_IMMEDIATELY | NSF_IS_WEBSOCKET | NSF_RATE_LIMITED)
 
 #ifndef intptr_t
 #define intptr_t long
@@ -50,10 +143,105 @@ struct ctl_msg {
   char message[NS_CTL_MSG_MESSAGE_SIZE];
 };
 
+#define NS_RATE_LIMIT_KEY_SIZE 32
+#define NS_RATE_LIMIT_DEFAULT_CLIENTS 1024
+
+struct ns_rate_limit_bucket {
+  double tokens;                    /* Tokens left at `last` */
+  double last;                      /* Time of the last refill */
+  uint32_t hash;                    /* Hash of the whole key */
+  int next;                         /* Next bucket in the hash chain, or -1 */
+  int lru_prev, lru_next;           /* LRU list linkage, or -1 */
+  size_t key_len;                   /* Length of the whole key */
+  char key[NS_RATE_LIMIT_KEY_SIZE]; /* Key prefix */
+};
+
+struct ns_byte_bucket {
+  double rate;   /* Bytes per second, 0 for no limit */
+  double burst;  /* Bucket size, bytes */
+  double tokens; /* Bytes allowed at `last`, negative if in debt */
+  double last;   /* Time of the last refill */
+};
+
+struct ns_bandwidth {
+  struct ns_byte_bucket dirs[2]; /* NS_BANDWIDTH_SEND, NS_BANDWIDTH_RECV */
+  struct ns_bandwidth *shared;   /* Limits of the listener, if any */
+  int refs;                      /* Connections using these limits */
+};
+
+/* Don't transfer less than that unless the bucket is smaller */
+#define NS_BANDWIDTH_QUANTUM 1024
+
+struct ns_send_file {
+  int fd;
+  int64_t offset; /* Next byte to send */
+  int64_t len;    /* Bytes left to send */
+  int no_sendfile; /* sendfile() failed, read the file instead */
+};
+
+#define NS_SEND_FILE_BUFFER_SIZE 16384
+
+/* Pipe of a spliced connection, holds data received by the peer */
+struct ns_splice {
+  struct ns_connection *peer; /* NULL once the peer is closed */
+  int fds[2];                 /* Read and write ends of the pipe */
+  size_t len;                 /* Bytes in the pipe */
+  size_t size;                /* Pipe capacity */
+  int full;                   /* Don't read the peer before the pipe drains */
+};
+
+#ifndef NS_SPLICE_PIPE_SIZE
+#define NS_SPLICE_PIPE_SIZE 262144
+#endif
+
+/* Output buffer taken over by a zero-copy send, see ns_set_zerocopy() */
+struct ns_zc_buf {
+  char *buf;
+  size_t len;               /* Bytes in the buffer */
+  size_t sent;              /* Bytes sent */
+  uint32_t first_id;        /* Kernel's id of the first zero-copy send */
+  uint32_t num_ids;         /* Number of zero-copy sends */
+  uint32_t pending;         /* Sends not completed yet */
+  struct ns_zc_buf *next;   /* Older buffer */
+};
+
+/* UDP offloads of a socket, see ns_send() */
+struct ns_udp_offload {
+  int gso, gro;            /* Supported by the kernel */
+  union socket_address sa; /* Destination of the queued datagrams */
+  size_t seg_size;         /* Size of the first queued datagram */
+  int num_segs;            /* Number of queued datagrams */
+  struct mbuf queue;       /* Queued datagrams */
+  char *gro_buf;           /* NS_UDP_GRO_BUFFER_SIZE bytes if gro */
+};
+
+struct ns_zerocopy {
+  size_t threshold;       /* Smallest output buffer to send this way */
+  int copied;             /* The kernel copied, use regular sends */
+  uint32_t next_id;       /* Kernel's id of the next zero-copy send */
+  size_t unsent;          /* Bytes not sent yet from `bufs` */
+  struct ns_zc_buf *bufs; /* Newest first */
+};
+
+struct ns_rate_limit {
+  struct ns_rate_limit_opts opts;
+  struct ns_rate_limit_stats stats;
+  struct ns_rate_limit_bucket *buckets; /* opts.max_clients buckets */
+  int *chains;            /* Hash table: first bucket of each chain, or -1 */
+  uint32_t mask;          /* Number of chains - 1 */
+  int lru_head, lru_tail; /* Most and least recently used buckets */
+  int refs;
+};
+
 static void ns_ev_mgr_init(struct ns_mgr *mgr);
 static void ns_ev_mgr_free(struct ns_mgr *mgr);
 static void ns_ev_mgr_add_conn(struct ns_connection *nc);
 static void ns_ev_mgr_remove_conn(struct ns_connection *nc);
+static void ns_bandwidth_free(struct ns_bandwidth *bw);
+static void ns_send_file_free(struct ns_connection *nc);
+static void ns_splice_free(struct ns_connection *nc);
+static void ns_zerocopy_free(struct ns_connection *nc);
+static int ns_zerocopy_pending(const struct ns_connection *nc);
 
 NS_INTERNAL void ns_add_conn(struct ns_mgr *mgr, struct ns_connection *c) {
   c->mgr = mgr;
@@ -104,9 +292,139 @@ NS_INTERNAL void ns_call(struct ns_connection *nc, int ev, void *ev_data) {
   DBG(("call done, flags %d", (int) nc->flags));
 }
 
+/* Size of the part of `sa` that bind(), connect() and sendto() look at */
+static socklen_t ns_sa_len(const union socket_address *sa) {
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* Abstract names start with a 0 byte and aren't 0-terminated */
+    const char *path = sa->un.sun_path;
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) +
+                       (path[0] == '\0' ? 1 + strlen(path + 1)
+                                        : strlen(path) + 1));
+  }
+#endif
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) return sizeof(sa->sin6);
+#endif
+  return sizeof(sa->sin);
+}
+
+#ifdef NS_ENABLE_UDP_GSO
+/* Send the queued datagrams as one, the kernel splits them */
+static int ns_udp_send_gso(struct ns_connection *nc) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+  uint16_t seg_size = (uint16_t) uo->seg_size;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = uo->queue.buf;
+  iov.iov_len = uo->queue.len;
+  msg.msg_name = &uo->sa.sa;
+  msg.msg_namelen = ns_sa_len(&uo->sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = IPPROTO_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(seg_size));
+  memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+
+  return (int) sendmsg(nc->sock, &msg, 0);
+}
+
+static void ns_udp_flush(struct ns_connection *nc) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+  size_t off, len;
+  int n = -1;
+
+  if (uo == NULL || uo->num_segs == 0) return;
+  if (uo->num_segs > 1) {
+    n = ns_udp_send_gso(nc);
+    DBG(("%p %d datagrams, %d bytes -> %d (GSO %d)", nc, uo->num_segs,
+         (int) uo->queue.len, nc->sock, n));
+    if (n < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+      n = 0; /* Dropped, as they would be one by one */
+    } else if (n < 0 && errno != EINVAL) {
+      uo->gso = 0; /* E.g. no checksum offload on the route */
+    }
+  }
+  if (n < 0) {
+    /* One by one, e.g. datagrams don't fit the MTU, or a single one */
+    for (off = 0; off < uo->queue.len; off += len) {
+      len = uo->queue.len - off < uo->seg_size ? uo->queue.len - off
+                                               : uo->seg_size;
+      (void) sendto(nc->sock, uo->queue.buf + off, len, 0, &uo->sa.sa,
+                    ns_sa_len(&uo->sa));
+    }
+  }
+  uo->num_segs = 0;
+  uo->queue.len = 0;
+}
+
+/*
+ * Queue a datagram, to send it with other ones to the same peer. All but the
+ * last one must have the same size. Return 0 if it must be sent right away.
+ */
+static int ns_udp_queue(struct ns_connection *nc, const void *buf,
+                        size_t len) {
+  struct ns_udp_offload *uo = nc->udp_offload;
+
+  if (uo == NULL || !uo->gso) return 0;
+  if (uo->num_segs > 0 &&
+      (len > uo->seg_size || uo->queue.len != uo->num_segs * uo->seg_size ||
+       uo->queue.len + len > NS_UDP_GSO_MAX_SIZE ||
+       uo->num_segs >= NS_UDP_GSO_MAX_SEGMENTS ||
+       memcmp(&uo->sa, &nc->sa, ns_sa_len(&nc->sa)) != 0)) {
+    ns_udp_flush(nc);
+  }
+  if (len == 0 || len > NS_UDP_GSO_MAX_SEGMENT) {
+    ns_udp_flush(nc);
+    return 0;
+  }
+  if (uo->num_segs == 0) {
+    uo->sa = nc->sa;
+    uo->seg_size = len;
+  }
+  if (mbuf_append(&uo->queue, buf, len) != len) {
+    ns_udp_flush(nc);
+    return 0;
+  }
+  uo->num_segs++;
+
+  return 1;
+}
+
+static void ns_udp_offload_free(struct ns_connection *nc) {
+  if (nc->udp_offload != NULL) {
+    mbuf_free(&nc->udp_offload->queue);
+    NS_FREE(nc->udp_offload->gro_buf);
+    NS_FREE(nc->udp_offload);
+    nc->udp_offload = NULL;
+  }
+}
+#else
+static void ns_udp_flush(struct ns_connection *nc) {
+  (void) nc;
+}
+#endif
+
 static size_t ns_out(struct ns_connection *nc, const void *buf, size_t len) {
   if (nc->flags & NSF_UDP) {
-    int n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, sizeof(nc->sa.sin));
+    int n;
+#ifdef NS_ENABLE_UDP_GSO
+    if (ns_udp_queue(nc, buf, len)) return len;
+#endif
+    n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, ns_sa_len(&nc->sa));
     DBG(("%p %d %d %d %s:%hu", nc, nc->sock, n, errno,
          inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
     return n < 0 ? 0 : n;
@@ -116,7 +434,23 @@ static size_t ns_out(struct ns_connection *nc, const void *buf, size_t len) {
 }
 
 static void ns_destroy_conn(struct ns_connection *conn) {
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL && (conn->flags & NSF_SSL_HANDSHAKE_DONE)) {
+    /* Best effort close_notify. OpenSSL forgets sessions closed without */
+    SSL_shutdown(conn->ssl);
+  }
+#endif
   if (conn->sock != INVALID_SOCKET) {
+    ns_udp_flush(conn);
+#ifdef NS_ENABLE_ZEROCOPY
+    if (ns_zerocopy_pending(conn)) {
+      /* The buffers go away, the kernel must drop what it has to send */
+      struct linger l;
+      l.l_onoff = 1;
+      l.l_linger = 0;
+      setsockopt(conn->sock, SOL_SOCKET, SO_LINGER, (char *) &l, sizeof(l));
+    }
+#endif
     closesocket(conn->sock);
     /*
      * avoid users accidentally double close a socket
@@ -129,6 +463,16 @@ static void ns_destroy_conn(struct ns_connection *conn) {
   }
   mbuf_free(&conn->recv_mbuf);
   mbuf_free(&conn->send_mbuf);
+  ns_ip_acl_free(conn->ip_acl);
+  ns_rate_limit_free(conn->rate_limit[NS_RATE_LIMIT_CONNECTIONS]);
+  ns_rate_limit_free(conn->rate_limit[NS_RATE_LIMIT_MESSAGES]);
+  ns_bandwidth_free(conn->bandwidth);
+  ns_send_file_free(conn);
+  ns_splice_free(conn);
+  ns_zerocopy_free(conn);
+#ifdef NS_ENABLE_UDP_GSO
+  ns_udp_offload_free(conn);
+#endif
 #ifdef NS_ENABLE_SSL
   if (conn->ssl != NULL) {
     SSL_free(conn->ssl);
@@ -192,6 +536,10 @@ void ns_mgr_free(struct ns_mgr *s) {
   if (s == NULL) return;
   /* Do one last poll, see https://github.com/cesanta/mongoose/issues/286 */
   ns_mgr_poll(s, 0);
+#ifdef NS_SSL_WORKERS
+  ns_workers_free(s->ssl_workers);
+  s->ssl_workers = NULL;
+#endif
 
   if (s->ctl[0] != INVALID_SOCKET) closesocket(s->ctl[0]);
   if (s->ctl[1] != INVALID_SOCKET) closesocket(s->ctl[1]);
@@ -201,7 +549,16 @@ void ns_mgr_free(struct ns_mgr *s) {
     tmp_conn = conn->next;
     ns_close_conn(conn);
   }
+#ifdef NS_WORKERS
+  /* Closed connections have let go of their file jobs */
+  ns_workers_free(s->file_workers);
+  s->file_workers = NULL;
+#endif
 
+#ifdef NS_SSL_OPENSSL_1_1
+  ns_ssl_client_cache_free(s->ssl_clients);
+  s->ssl_clients = NULL;
+#endif
   ns_ev_mgr_free(s);
 }
 
@@ -209,6 +566,11 @@ int ns_vprintf(struct ns_connection *nc, const char *fmt, va_list ap) {
   char mem[NS_VPRINTF_BUFFER_SIZE], *buf = mem;
   int len;
 
+  if (!(nc->flags & NSF_UDP)) {
+    /* Format straight into the send buffer, without a temporary copy */
+    return ns_mbuf_vprintf(&nc->send_mbuf, fmt, ap);
+  }
+
   if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
     ns_out(nc, buf, len);
   }
@@ -339,11 +701,114 @@ NS_INTERNAL struct ns_connection *ns_create_connection(
      * doesn't compile with pedantic ansi flags.
      */
     conn->recv_mbuf_limit = ~0;
+    conn->recv_budget = NS_RECV_BUDGET;
   }
 
   return conn;
 }
 
+static int ns_set_tcp_opt(sock_t sock, int opt, int value) {
+  int rc = setsockopt(sock, IPPROTO_TCP, opt, (char *) &value, sizeof(value));
+  return rc == 0 ? 0 : -1;
+}
+
+static int ns_is_inet(const union socket_address *sa) {
+  return sa->sa.sa_family == AF_INET
+#ifdef NS_ENABLE_IPV6
+         || sa->sa.sa_family == AF_INET6
+#endif
+      ;
+}
+
+/* Defaults for new TCP connections: see ns_set_nodelay() */
+static void ns_set_tcp_defaults(sock_t sock, const union socket_address *sa) {
+#ifdef TCP_NODELAY
+  if (ns_is_inet(sa)) (void) ns_set_tcp_opt(sock, TCP_NODELAY, 1);
+#else
+  (void) sock;
+  (void) sa;
+#endif
+}
+
+int ns_set_nodelay(struct ns_connection *nc, int on) {
+#ifdef TCP_NODELAY
+  if (!(nc->flags & (NSF_UDP | NSF_LISTENING))) {
+    return ns_set_tcp_opt(nc->sock, TCP_NODELAY, on);
+  }
+#endif
+  (void) nc;
+  (void) on;
+  return -1;
+}
+
+int ns_set_cork(struct ns_connection *nc, int on) {
+  if (!(nc->flags & (NSF_UDP | NSF_LISTENING))) {
+#if defined(TCP_CORK)
+    return ns_set_tcp_opt(nc->sock, TCP_CORK, on);
+#elif defined(TCP_NOPUSH)
+    return ns_set_tcp_opt(nc->sock, TCP_NOPUSH, on);
+#endif
+  }
+  (void) nc;
+  (void) on;
+  return -1;
+}
+
+#ifdef NS_ENABLE_UDP_GSO
+/* Enable UDP offloads the kernel has, for UDP connections and listeners */
+static void ns_udp_offload_init(struct ns_connection *nc) {
+  struct ns_udp_offload *uo;
+  int on = 1, seg_size = 0;
+  socklen_t len = sizeof(seg_size);
+
+  if (!ns_is_inet(&nc->sa) ||
+      (uo = (struct ns_udp_offload *) NS_CALLOC(1, sizeof(*uo))) == NULL) {
+    return;
+  }
+  uo->gso = getsockopt(nc->sock, IPPROTO_UDP, UDP_SEGMENT, (char *) &seg_size,
+                       &len) == 0;
+  uo->gro = setsockopt(nc->sock, IPPROTO_UDP, UDP_GRO, (char *) &on,
+                       sizeof(on)) == 0;
+  if (uo->gro && (uo->gro_buf = (char *) NS_MALLOC(NS_UDP_GRO_BUFFER_SIZE)) ==
+                     NULL) {
+    /* Coalesced datagrams wouldn't fit in the regular buffer */
+    on = 0;
+    setsockopt(nc->sock, IPPROTO_UDP, UDP_GRO, (char *) &on, sizeof(on));
+    uo->gro = 0;
+  }
+  DBG(("%p UDP gso=%d gro=%d", nc, uo->gso, uo->gro));
+  if (uo->gso || uo->gro) {
+    nc->udp_offload = uo;
+  } else {
+    NS_FREE(uo);
+  }
+}
+#endif
+
+int ns_set_zerocopy(struct ns_connection *nc, size_t threshold) {
+#if defined(NS_ENABLE_ZEROCOPY) && defined(SO_ZEROCOPY)
+  int on = 1;
+
+  if (nc->ssl != NULL || nc->ssl_ctx != NULL || (nc->flags & NSF_UDP)) {
+    return -1;
+  }
+  if (threshold > 0 && nc->zerocopy == NULL) {
+    if (setsockopt(nc->sock, SOL_SOCKET, SO_ZEROCOPY, (char *) &on,
+                   sizeof(on)) != 0 ||
+        (nc->zerocopy = (struct ns_zerocopy *) NS_CALLOC(
+             1, sizeof(*nc->zerocopy))) == NULL) {
+      return -1;
+    }
+  }
+  if (nc->zerocopy != NULL) nc->zerocopy->threshold = threshold;
+  return 0;
+#else
+  (void) nc;
+  (void) threshold;
+  return -1;
+#endif
+}
+
 /* Associate a socket to a connection and and add to the manager. */
 NS_INTERNAL void ns_set_sock(struct ns_connection *nc, sock_t sock) {
 #ifndef NS_CC3200
@@ -390,6 +855,23 @@ NS_INTERNAL int ns_parse_address(const char *str, union socket_address *sa,
 
   *proto = SOCK_STREAM;
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (strncmp(str, "unix://", 7) == 0 || strncmp(str, "unixgram://", 11) == 0) {
+    /* Path, e.g. unix:///var/run/app.sock, or abstract name, unix://@app */
+    if (str[4] == 'g') *proto = SOCK_DGRAM;
+    str += *proto == SOCK_DGRAM ? 11 : 7;
+    len = (int) strlen(str);
+    if (len == 0 || (len == 1 && str[0] == '@') ||
+        (size_t) len >= sizeof(sa->un.sun_path)) {
+      return -1;
+    }
+    sa->un.sun_family = AF_UNIX;
+    memcpy(sa->un.sun_path, str, len);
+    if (str[0] == '@') sa->un.sun_path[0] = '\0';
+    return len;
+  }
+#endif
+
   if (strncmp(str, "udp://", 6) == 0) {
     str += 6;
     *proto = SOCK_DGRAM;
@@ -428,15 +910,40 @@ NS_INTERNAL int ns_parse_address(const char *str, union socket_address *sa,
   return port < 0xffffUL && str[len] == '\0' ? len : -1;
 }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+/*
+ * Remove a socket file left behind by a process that's gone, otherwise
+ * bind() fails with EADDRINUSE. A socket that somebody listens on is kept.
+ */
+static void ns_unlink_stale_socket(union socket_address *sa, int proto) {
+  const char *path = sa->un.sun_path;
+  struct stat st;
+  sock_t sock;
+
+  if (path[0] == '\0' || stat(path, &st) != 0 || !S_ISSOCK(st.st_mode) ||
+      (sock = socket(AF_UNIX, proto, 0)) == INVALID_SOCKET) {
+    return;
+  }
+  if (connect(sock, &sa->sa, ns_sa_len(sa)) != 0 && errno == ECONNREFUSED) {
+    DBG(("removing stale socket %s", path));
+    unlink(path);
+  }
+  closesocket(sock);
+}
+#endif
+
 /* 'sa' must be an initialized address to bind to */
 static sock_t ns_open_listening_socket(union socket_address *sa, int proto) {
-  socklen_t sa_len =
-      (sa->sa.sa_family == AF_INET) ? sizeof(sa->sin) : sizeof(sa->sin6);
+  socklen_t sa_len = ns_sa_len(sa);
   sock_t sock = INVALID_SOCKET;
 #ifndef NS_CC3200
   int on = 1;
 #endif
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) ns_unlink_stale_socket(sa, proto);
+#endif
+
   if ((sock = socket(sa->sa.sa_family, proto, 0)) != INVALID_SOCKET &&
 #ifndef NS_CC3200 /* CC3200 doesn't support either */
 #if defined(_WIN32) && defined(SO_EXCLUSIVEADDRUSE)
@@ -474,6 +981,69 @@ static sock_t ns_open_listening_socket(union socket_address *sa, int proto) {
   return sock;
 }
 
+/* Whether `sock` is a socket of type `proto` bound to `sa` */
+static int ns_is_bound_to(sock_t sock, const union socket_address *sa,
+                          int proto) {
+  union socket_address bound;
+  socklen_t len = sizeof(bound), type_len = sizeof(int);
+  int type = 0;
+
+  memset(&bound, 0, sizeof(bound));
+  if (getsockname(sock, &bound.sa, &len) != 0 ||
+      getsockopt(sock, SOL_SOCKET, SO_TYPE, (char *) &type, &type_len) != 0 ||
+      type != proto || bound.sa.sa_family != sa->sa.sa_family) {
+    return 0;
+  }
+  switch (sa->sa.sa_family) {
+    case AF_INET:
+      return bound.sin.sin_port == sa->sin.sin_port &&
+             bound.sin.sin_addr.s_addr == sa->sin.sin_addr.s_addr;
+#ifdef NS_ENABLE_IPV6
+    case AF_INET6:
+      return bound.sin6.sin6_port == sa->sin6.sin6_port &&
+             memcmp(&bound.sin6.sin6_addr, &sa->sin6.sin6_addr,
+                    sizeof(sa->sin6.sin6_addr)) == 0;
+#endif
+#ifdef NS_ENABLE_UNIX_SOCKETS
+    case AF_UNIX:
+      return memcmp(bound.un.sun_path, sa->un.sun_path,
+                    sizeof(sa->un.sun_path)) == 0;
+#endif
+  }
+  return 0;
+}
+
+/* Claim a socket taken over by ns_hot_restart_takeover(), if one matches */
+static sock_t ns_take_inherited(struct ns_mgr *mgr, union socket_address *sa,
+                                int proto) {
+  sock_t sock;
+  int i;
+
+  for (i = 0; i < mgr->num_inherited; i++) {
+    if (ns_is_bound_to(mgr->inherited[i], sa, proto)) {
+      sock = mgr->inherited[i];
+      mgr->inherited[i] = mgr->inherited[--mgr->num_inherited];
+      DBG(("%p reusing sock %d", mgr, sock));
+      return sock;
+    }
+  }
+  return INVALID_SOCKET;
+}
+
+/* Close taken over sockets that nobody claimed */
+static void ns_close_inherited(struct ns_mgr *mgr) {
+  int i;
+
+  if (mgr->inherited == NULL) return;
+  for (i = 0; i < mgr->num_inherited; i++) {
+    DBG(("%p closing unclaimed sock %d", mgr, mgr->inherited[i]));
+    closesocket(mgr->inherited[i]);
+  }
+  NS_FREE(mgr->inherited);
+  mgr->inherited = NULL;
+  mgr->num_inherited = 0;
+}
+
 #ifdef NS_ENABLE_SSL
 /*
  * Certificate generation script is at
@@ -591,97 +1161,774 @@ static int ns_use_cert(SSL_CTX *ctx, const char *pem_file) {
   }
 }
 
-/*
- * Turn the connection into SSL mode.
- * `cert` is the certificate file in PEM format. For listening connections,
- * certificate file must contain private key and server certificate,
- * concatenated. It may also contain DH params - these will be used for more
- * secure key exchange. `ca_cert` is a certificate authority (CA) PEM file, and
- * it is optional (can be set to NULL). If `ca_cert` is non-NULL, then
- * the connection is so-called two-way-SSL: other peer's certificate is
- * checked against the `ca_cert`.
- *
- * Handy OpenSSL command to generate test self-signed certificate:
- *
- *    openssl req -x509 -newkey rsa:2048 -keyout key.pem -out cert.pem -days 999
- *
- * Return NULL on success, or error message on failure.
- */
-const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
-                       const char *ca_cert) {
+/* Create an SSL context and load certificates into it */
+static const char *ns_ssl_ctx_new(SSL_CTX **ctx, int server_side,
+                                  const char *cert, const char *ca_cert) {
   const char *result = NULL;
 
-  if ((nc->flags & NSF_LISTENING) &&
-      (nc->ssl_ctx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
-    result = "SSL_CTX_new() failed";
-  } else if (!(nc->flags & NSF_LISTENING) &&
-             (nc->ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
-    result = "SSL_CTX_new() failed";
-  } else if (ns_use_cert(nc->ssl_ctx, cert) != 0) {
+  if ((*ctx = SSL_CTX_new(server_side ? SSLv23_server_method()
+                                      : SSLv23_client_method())) == NULL) {
+    return "SSL_CTX_new() failed";
+  } else if (ns_use_cert(*ctx, cert) != 0) {
     result = "Invalid ssl cert";
-  } else if (ns_use_ca_cert(nc->ssl_ctx, ca_cert) != 0) {
+  } else if (ns_use_ca_cert(*ctx, ca_cert) != 0) {
     result = "Invalid CA cert";
-  } else if (!(nc->flags & NSF_LISTENING) &&
-             (nc->ssl = SSL_new(nc->ssl_ctx)) == NULL) {
-    result = "SSL_new() failed";
-  } else if (!(nc->flags & NSF_LISTENING) && nc->sock != INVALID_SOCKET) {
-    /*
-     * Socket is open here only if we are connecting to IP address
-     * and does not open if we are connecting using async DNS resolver
-     */
-    SSL_set_fd(nc->ssl, nc->sock);
   }
 
 /* TODO(rojer): remove when krypton exposes this function, even a dummy one */
 #ifdef OPENSSL_VERSION_NUMBER
-  SSL_CTX_set_cipher_list(nc->ssl_ctx, ns_s_cipher_list);
+  SSL_CTX_set_cipher_list(*ctx, ns_s_cipher_list);
+  if (server_side) {
+    /* Without it, sessions of verified clients can't be resumed */
+    SSL_CTX_set_session_id_context(*ctx, (const unsigned char *) "fossa", 5);
+  }
+#endif
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  /* OpenSSL hands the keys to the kernel after the handshake if it can */
+  SSL_CTX_set_options(*ctx, SSL_OP_ENABLE_KTLS);
 #endif
   return result;
 }
 
-static int ns_ssl_err(struct ns_connection *conn, int res) {
-  int ssl_err = SSL_get_error(conn->ssl, res);
-  if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
-  if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
-  return ssl_err;
+#ifdef NS_SSL_OPENSSL_1_1
+/* A session to resume with a server, most recently stored first */
+struct ns_ssl_client_session {
+  struct ns_ssl_client_session *next;
+  char addr[128]; /* Server address, see ns_sock_addr_to_str() */
+  SSL_SESSION *session;
+};
+
+/* A client context shared by connections with the same certificates */
+struct ns_ssl_client_ctx {
+  struct ns_ssl_client_ctx *next;
+  struct ns_ssl_client_cache *cache;
+  char *cert, *ca_cert; /* Empty strings for none */
+  SSL_CTX *ctx;
+  struct ns_ssl_client_session *sessions;
+};
+
+struct ns_ssl_client_cache {
+  struct ns_ssl_client_ctx *contexts;
+  struct ns_ssl_client_stats stats;
+};
+
+static void ns_ssl_client_cache_free(struct ns_ssl_client_cache *cache) {
+  struct ns_ssl_client_ctx *cc;
+  struct ns_ssl_client_session *cs;
+
+  if (cache == NULL) return;
+  while ((cc = cache->contexts) != NULL) {
+    cache->contexts = cc->next;
+    while ((cs = cc->sessions) != NULL) {
+      cc->sessions = cs->next;
+      SSL_SESSION_free(cs->session);
+      NS_FREE(cs);
+    }
+    /* Connections still using the context hold their own reference */
+    SSL_CTX_free(cc->ctx);
+    NS_FREE(cc->cert);
+    NS_FREE(cc->ca_cert);
+    NS_FREE(cc);
+  }
+  NS_FREE(cache);
 }
-#endif /* NS_ENABLE_SSL */
 
-static struct ns_connection *accept_conn(struct ns_connection *ls) {
-  struct ns_connection *c = NULL;
-  union socket_address sa;
-  socklen_t len = sizeof(sa);
-  sock_t sock = INVALID_SOCKET;
+/* Key of the sessions with a server: its address and SNI name, if any */
+static void ns_ssl_client_addr(struct ns_connection *nc, char *buf,
+                               size_t len) {
+  const char *name = SSL_get_servername(nc->ssl, TLSEXT_NAMETYPE_host_name);
+  size_t n;
 
-  /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
-  if ((sock = accept(ls->sock, &sa.sa, &len)) == INVALID_SOCKET) {
-  } else if ((c = ns_add_sock(ls->mgr, sock, ls->handler)) == NULL) {
-    closesocket(sock);
-#ifdef NS_ENABLE_SSL
-  } else if (ls->ssl_ctx != NULL && ((c->ssl = SSL_new(ls->ssl_ctx)) == NULL ||
-                                     SSL_set_fd(c->ssl, sock) != 1)) {
-    DBG(("SSL error"));
-    ns_close_conn(c);
-    c = NULL;
-#endif
-  } else {
-    c->listener = ls;
-    c->proto_data = ls->proto_data;
-    c->proto_handler = ls->proto_handler;
-    c->user_data = ls->user_data;
-    c->recv_mbuf_limit = ls->recv_mbuf_limit;
-    if (c->ssl == NULL) { /* SSL connections need to perform handshake. */
-      ns_call(c, NS_ACCEPT, &sa);
+  ns_sock_addr_to_str(&nc->sa, buf, len,
+                      NS_SOCK_STRINGIFY_IP | NS_SOCK_STRINGIFY_PORT);
+  n = strlen(buf);
+  if (name != NULL) snprintf(buf + n, len - n, "/%s", name);
+}
+
+/*
+ * Called by OpenSSL when the server hands out a session: at the end of
+ * a TLS 1.2 handshake, or in a TLS 1.3 ticket at any time after it.
+ */
+static int ns_ssl_client_new_session(SSL *ssl, SSL_SESSION *session) {
+  struct ns_connection *nc = (struct ns_connection *) SSL_get_app_data(ssl);
+  struct ns_ssl_client_ctx *cc =
+      (struct ns_ssl_client_ctx *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  struct ns_ssl_client_session *cs, **p;
+  char addr[sizeof(cs->addr)];
+  int n = 0;
+
+  if (nc == NULL || cc == NULL) return 0;
+  ns_ssl_client_addr(nc, addr, sizeof(addr));
+
+  /* Replace the previous session with this server, evict the oldest ones */
+  for (p = &cc->sessions; (cs = *p) != NULL;) {
+    if (strcmp(cs->addr, addr) == 0 || ++n >= NS_SSL_CLIENT_SESSIONS) {
+      *p = cs->next;
+      SSL_SESSION_free(cs->session);
+      NS_FREE(cs);
+      cc->cache->stats.num_sessions--;
+    } else {
+      p = &cs->next;
     }
-    DBG(("%p %d %p %p", c, c->sock, c->ssl_ctx, c->ssl));
   }
 
-  return c;
+  if ((cs = (struct ns_ssl_client_session *) NS_CALLOC(1, sizeof(*cs))) ==
+      NULL) {
+    return 0;
+  }
+  strcpy(cs->addr, addr);
+  cs->session = session;
+  cs->next = cc->sessions;
+  cc->sessions = cs;
+  cc->cache->stats.num_sessions++;
+  return 1; /* We own the session now */
 }
 
-static int ns_is_error(int n) {
-#ifdef NS_CC3200
-  DBG(("n = %d, errno = %d", n, errno));
+/* Offer the session stored for the server, if any, before connecting */
+static void ns_ssl_client_resume(struct ns_connection *nc) {
+  struct ns_ssl_client_ctx *cc =
+      (struct ns_ssl_client_ctx *) SSL_CTX_get_app_data(nc->ssl_ctx);
+  struct ns_ssl_client_session *cs;
+  char addr[sizeof(cs->addr)];
+
+  if (cc == NULL || cc->sessions == NULL) return;
+  ns_ssl_client_addr(nc, addr, sizeof(addr));
+  for (cs = cc->sessions; cs != NULL; cs = cs->next) {
+    if (strcmp(cs->addr, addr) == 0) {
+      if (SSL_SESSION_is_resumable(cs->session)) {
+        SSL_set_session(nc->ssl, cs->session);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Get the manager's client context for the given certificates, creating
+ * it on first use. The connection gets its own reference.
+ */
+static const char *ns_ssl_client_ctx(struct ns_connection *nc,
+                                     const char *cert, const char *ca_cert) {
+  struct ns_ssl_client_cache *cache = nc->mgr->ssl_clients;
+  struct ns_ssl_client_ctx *cc;
+  const char *result;
+
+  if (cert == NULL) cert = "";
+  if (ca_cert == NULL) ca_cert = "";
+  if (cache == NULL &&
+      (cache = nc->mgr->ssl_clients = (struct ns_ssl_client_cache *) NS_CALLOC(
+           1, sizeof(*cache))) == NULL) {
+    return "Out of memory";
+  }
+
+  for (cc = cache->contexts; cc != NULL; cc = cc->next) {
+    if (strcmp(cc->cert, cert) == 0 && strcmp(cc->ca_cert, ca_cert) == 0) {
+      SSL_CTX_up_ref(cc->ctx);
+      nc->ssl_ctx = cc->ctx;
+      return NULL;
+    }
+  }
+
+  if ((result = ns_ssl_ctx_new(&nc->ssl_ctx, 0, cert, ca_cert)) != NULL) {
+    return result;
+  } else if ((cc = (struct ns_ssl_client_ctx *) NS_CALLOC(1, sizeof(*cc))) ==
+                 NULL ||
+             (cc->cert = strdup(cert)) == NULL ||
+             (cc->ca_cert = strdup(ca_cert)) == NULL) {
+    if (cc != NULL) {
+      NS_FREE(cc->cert);
+      NS_FREE(cc);
+    }
+    return NULL; /* Works, just isn't shared */
+  }
+
+  SSL_CTX_set_session_cache_mode(
+      nc->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(nc->ssl_ctx, ns_ssl_client_new_session);
+  SSL_CTX_set_app_data(nc->ssl_ctx, cc);
+  SSL_CTX_up_ref(nc->ssl_ctx);
+  cc->ctx = nc->ssl_ctx;
+  cc->cache = cache;
+  cc->next = cache->contexts;
+  cache->contexts = cc;
+  cache->stats.num_contexts++;
+  return NULL;
+}
+
+void ns_ssl_get_client_stats(struct ns_mgr *mgr,
+                             struct ns_ssl_client_stats *stats) {
+  if (mgr->ssl_clients != NULL) {
+    *stats = mgr->ssl_clients->stats;
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+/* Certificate served to clients asking for a name with SNI */
+struct ns_ssl_sni_cert {
+  struct ns_ssl_sni_cert *next;
+  char *name; /* Host name, or "*." followed by a domain */
+  SSL_CTX *ctx;
+  unsigned char *ocsp; /* Stapled OCSP response, DER */
+  size_t ocsp_len;
+};
+
+/*
+ * Listener settings. They live as long as the listener's SSL_CTX, which
+ * accepted connections keep alive after the listener is closed.
+ */
+struct ns_ssl_server {
+  unsigned char *ticket_keys; /* NS_SSL_TICKET_KEY_SIZE bytes each */
+  int num_ticket_keys;
+  struct ns_ssl_sni_cert *certs;
+  unsigned char *ocsp; /* For the listener's own certificate */
+  size_t ocsp_len;
+};
+
+static int s_ns_ssl_server_index = -1;
+
+static void ns_ssl_server_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                               int idx, long argl, void *argp) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) ptr;
+  struct ns_ssl_sni_cert *sc;
+
+  (void) parent;
+  (void) ad;
+  (void) idx;
+  (void) argl;
+  (void) argp;
+  if (srv == NULL) return;
+  while ((sc = srv->certs) != NULL) {
+    srv->certs = sc->next;
+    SSL_CTX_free(sc->ctx);
+    NS_FREE(sc->name);
+    NS_FREE(sc->ocsp);
+    NS_FREE(sc);
+  }
+  if (srv->ticket_keys != NULL) {
+    OPENSSL_cleanse(srv->ticket_keys,
+                    srv->num_ticket_keys * NS_SSL_TICKET_KEY_SIZE);
+    NS_FREE(srv->ticket_keys);
+  }
+  NS_FREE(srv->ocsp);
+  NS_FREE(srv);
+}
+
+/* Get the settings of an SSL listener, creating them if needed */
+static struct ns_ssl_server *ns_ssl_server_get(struct ns_connection *nc) {
+  struct ns_ssl_server *srv;
+
+  if (!(nc->flags & NSF_LISTENING) || nc->ssl_ctx == NULL) return NULL;
+  if (s_ns_ssl_server_index < 0) {
+    s_ns_ssl_server_index =
+        SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ns_ssl_server_free);
+  }
+  srv = (struct ns_ssl_server *) SSL_CTX_get_app_data(nc->ssl_ctx);
+  if (srv == NULL && (srv = (struct ns_ssl_server *) NS_CALLOC(
+                          1, sizeof(*srv))) != NULL) {
+    /* App data is for callbacks, the indexed copy frees it with the ctx */
+    SSL_CTX_set_app_data(nc->ssl_ctx, srv);
+    SSL_CTX_set_ex_data(nc->ssl_ctx, s_ns_ssl_server_index, srv);
+  }
+  return srv;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define NS_TICKET_HMAC_CTX EVP_MAC_CTX
+#else
+#define NS_TICKET_HMAC_CTX HMAC_CTX
+#endif
+
+static int ns_ssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *ectx, NS_TICKET_HMAC_CTX *hctx,
+                            int enc) {
+  struct ns_ssl_server *srv =
+      (struct ns_ssl_server *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  const unsigned char *key = NULL;
+  int i;
+
+  if (srv == NULL || srv->num_ticket_keys == 0) return -1;
+  if (enc) {
+    key = srv->ticket_keys;
+    if (RAND_bytes(iv, 16) != 1) return -1;
+    memcpy(name, key, 16);
+  } else {
+    for (i = 0; i < srv->num_ticket_keys && key == NULL; i++) {
+      if (memcmp(name, srv->ticket_keys + i * NS_SSL_TICKET_KEY_SIZE, 16) ==
+          0) {
+        key = srv->ticket_keys + i * NS_SSL_TICKET_KEY_SIZE;
+      }
+    }
+    if (key == NULL) return 0; /* Retired key: full handshake */
+  }
+
+  /* Key layout: 16 bytes name, 32 bytes HMAC-SHA256 key, 32 bytes AES key */
+  if (EVP_CipherInit_ex(ectx, EVP_aes_256_cbc(), NULL, key + 48, iv, enc) !=
+      1) {
+    return -1;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  {
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *) "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_init(hctx, key + 16, 32, params) != 1) return -1;
+  }
+#else
+  if (HMAC_Init_ex(hctx, key + 16, 32, EVP_sha256(), NULL) != 1) return -1;
+#endif
+  /*
+   * Always issue a new ticket on resumption: tickets of older keys must be
+   * replaced, and TLS 1.3 clients can't resume twice with the same one.
+   */
+  return enc ? 1 : 2;
+}
+
+const char *ns_ssl_set_ticket_keys(struct ns_connection *nc, const void *keys,
+                                   size_t len) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  unsigned char *copy = NULL;
+
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
+
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if (len % NS_SSL_TICKET_KEY_SIZE != 0) {
+    return "Invalid ticket keys";
+  } else if (len > 0 && (copy = (unsigned char *) NS_MALLOC(len)) == NULL) {
+    return "Out of memory";
+  }
+
+  if (len > 0) memcpy(copy, keys, len);
+  if (srv->ticket_keys != NULL) {
+    OPENSSL_cleanse(srv->ticket_keys,
+                    srv->num_ticket_keys * NS_SSL_TICKET_KEY_SIZE);
+    NS_FREE(srv->ticket_keys);
+  }
+  srv->ticket_keys = copy;
+  srv->num_ticket_keys = (int) (len / NS_SSL_TICKET_KEY_SIZE);
+
+  if (len == 0) {
+    SSL_CTX_set_options(nc->ssl_ctx, SSL_OP_NO_TICKET);
+  } else {
+    SSL_CTX_clear_options(nc->ssl_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(nc->ssl_ctx, ns_ssl_ticket_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(nc->ssl_ctx, ns_ssl_ticket_cb);
+#endif
+  }
+  return NULL;
+}
+
+const char *ns_ssl_set_session_cache(struct ns_connection *nc,
+                                     int max_sessions, int timeout) {
+  if (!(nc->flags & NSF_LISTENING) || nc->ssl_ctx == NULL) {
+    return "Not an SSL listener";
+  }
+#ifdef NS_SSL_WORKERS
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
+  if (max_sessions > 0) {
+    SSL_CTX_set_session_cache_mode(nc->ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(nc->ssl_ctx, max_sessions);
+  } else {
+    SSL_CTX_set_session_cache_mode(nc->ssl_ctx, SSL_SESS_CACHE_OFF);
+  }
+  if (timeout > 0) SSL_CTX_set_timeout(nc->ssl_ctx, timeout);
+  return NULL;
+}
+
+/* Find the certificate for a name, preferring exact matches to wildcards */
+static struct ns_ssl_sni_cert *ns_ssl_find_sni_cert(struct ns_ssl_server *srv,
+                                                    const char *name,
+                                                    int exact) {
+  struct ns_ssl_sni_cert *sc, *wildcard = NULL;
+  const char *domain = strchr(name, '.');
+
+  for (sc = srv->certs; sc != NULL; sc = sc->next) {
+    if (ns_casecmp(sc->name, name) == 0) {
+      return sc;
+    } else if (!exact && wildcard == NULL && sc->name[0] == '*' &&
+               domain != NULL && ns_casecmp(sc->name + 1, domain) == 0) {
+      wildcard = sc;
+    }
+  }
+  return wildcard;
+}
+
+static int ns_ssl_sni_cb(SSL *ssl, int *alert, void *arg) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) arg;
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  struct ns_ssl_sni_cert *sc;
+
+  (void) alert;
+  /* Other names get the listener's certificate */
+  if (name != NULL && (sc = ns_ssl_find_sni_cert(srv, name, 0)) != NULL) {
+    SSL_set_SSL_CTX(ssl, sc->ctx);
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int ns_ssl_status_cb(SSL *ssl, void *arg) {
+  struct ns_ssl_server *srv = (struct ns_ssl_server *) arg;
+  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+  struct ns_ssl_sni_cert *sc;
+  const unsigned char *der = srv->ocsp;
+  size_t len = srv->ocsp_len;
+  unsigned char *resp;
+
+  for (sc = srv->certs; sc != NULL; sc = sc->next) {
+    if (sc->ctx == ctx) {
+      der = sc->ocsp;
+      len = sc->ocsp_len;
+    }
+  }
+  if (len == 0 || (resp = (unsigned char *) OPENSSL_malloc(len)) == NULL) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  memcpy(resp, der, len);
+  SSL_set_tlsext_status_ocsp_resp(ssl, resp, (long) len);
+  return SSL_TLSEXT_ERR_OK;
+}
+
+const char *ns_ssl_add_sni_cert(struct ns_connection *nc,
+                                const char *server_name, const char *cert) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  struct ns_ssl_sni_cert *sc;
+  X509_STORE *store;
+  const char *result;
+
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
+
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if ((sc = (struct ns_ssl_sni_cert *) NS_CALLOC(1, sizeof(*sc))) ==
+                 NULL ||
+             (sc->name = strdup(server_name)) == NULL) {
+    NS_FREE(sc);
+    return "Out of memory";
+  } else if ((result = ns_ssl_ctx_new(&sc->ctx, 1, cert, NULL)) != NULL) {
+    SSL_CTX_free(sc->ctx);
+    NS_FREE(sc->name);
+    NS_FREE(sc);
+    return result;
+  }
+
+  /* Switching to this context must not change client certificate checks */
+  store = SSL_CTX_get_cert_store(nc->ssl_ctx);
+  X509_STORE_up_ref(store);
+  SSL_CTX_set_cert_store(sc->ctx, store);
+  SSL_CTX_set_verify(sc->ctx, SSL_CTX_get_verify_mode(nc->ssl_ctx), NULL);
+
+  SSL_CTX_set_app_data(sc->ctx, srv);
+  SSL_CTX_set_tlsext_status_cb(sc->ctx, ns_ssl_status_cb);
+  SSL_CTX_set_tlsext_status_arg(sc->ctx, srv);
+  sc->next = srv->certs;
+  srv->certs = sc;
+
+  SSL_CTX_set_tlsext_servername_callback(nc->ssl_ctx, ns_ssl_sni_cb);
+  SSL_CTX_set_tlsext_servername_arg(nc->ssl_ctx, srv);
+  return NULL;
+}
+
+const char *ns_ssl_set_ocsp_response(struct ns_connection *nc,
+                                     const char *server_name, const void *der,
+                                     size_t len) {
+  struct ns_ssl_server *srv = ns_ssl_server_get(nc);
+  struct ns_ssl_sni_cert *sc = NULL;
+  unsigned char *copy = NULL, **dst;
+  size_t *dst_len;
+
+#ifdef NS_SSL_WORKERS
+  /* Handshakes in worker threads read the settings */
+  ns_workers_quiesce(nc->mgr->ssl_workers);
+#endif
+
+  if (srv == NULL) {
+    return "Not an SSL listener";
+  } else if (server_name != NULL &&
+             (sc = ns_ssl_find_sni_cert(srv, server_name, 1)) == NULL) {
+    return "Unknown server name";
+  } else if (len > 0 && (copy = (unsigned char *) NS_MALLOC(len)) == NULL) {
+    return "Out of memory";
+  }
+
+  if (len > 0) memcpy(copy, der, len);
+  dst = sc != NULL ? &sc->ocsp : &srv->ocsp;
+  dst_len = sc != NULL ? &sc->ocsp_len : &srv->ocsp_len;
+  NS_FREE(*dst);
+  *dst = copy;
+  *dst_len = len;
+
+  SSL_CTX_set_tlsext_status_cb(nc->ssl_ctx, ns_ssl_status_cb);
+  SSL_CTX_set_tlsext_status_arg(nc->ssl_ctx, srv);
+  return NULL;
+}
+#else
+void ns_ssl_get_client_stats(struct ns_mgr *mgr,
+                             struct ns_ssl_client_stats *stats) {
+  (void) mgr;
+  memset(stats, 0, sizeof(*stats));
+}
+
+const char *ns_ssl_set_ticket_keys(struct ns_connection *nc, const void *keys,
+                                   size_t len) {
+  (void) nc;
+  (void) keys;
+  (void) len;
+  return "Not supported";
+}
+
+const char *ns_ssl_set_session_cache(struct ns_connection *nc,
+                                     int max_sessions, int timeout) {
+  (void) nc;
+  (void) max_sessions;
+  (void) timeout;
+  return "Not supported";
+}
+
+const char *ns_ssl_add_sni_cert(struct ns_connection *nc,
+                                const char *server_name, const char *cert) {
+  (void) nc;
+  (void) server_name;
+  (void) cert;
+  return "Not supported";
+}
+
+const char *ns_ssl_set_ocsp_response(struct ns_connection *nc,
+                                     const char *server_name, const void *der,
+                                     size_t len) {
+  (void) nc;
+  (void) server_name;
+  (void) der;
+  (void) len;
+  return "Not supported";
+}
+#endif /* NS_SSL_OPENSSL_1_1 */
+
+/*
+ * Turn the connection into SSL mode.
+ * `cert` is the certificate file in PEM format. For listening connections,
+ * certificate file must contain private key and server certificate,
+ * concatenated. It may also contain DH params - these will be used for more
+ * secure key exchange. `ca_cert` is a certificate authority (CA) PEM file, and
+ * it is optional (can be set to NULL). If `ca_cert` is non-NULL, then
+ * the connection is so-called two-way-SSL: other peer's certificate is
+ * checked against the `ca_cert`.
+ *
+ * Handy OpenSSL command to generate test self-signed certificate:
+ *
+ *    openssl req -x509 -newkey rsa:2048 -keyout key.pem -out cert.pem -days 999
+ *
+ * Return NULL on success, or error message on failure.
+ */
+const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
+                       const char *ca_cert) {
+  const char *result = NULL;
+
+  if (nc->flags & NSF_LISTENING) {
+    result = ns_ssl_ctx_new(&nc->ssl_ctx, 1, cert, ca_cert);
+#ifdef NS_SSL_OPENSSL_1_1
+  } else if ((result = ns_ssl_client_ctx(nc, cert, ca_cert)) != NULL) {
+#else
+  } else if ((result = ns_ssl_ctx_new(&nc->ssl_ctx, 0, cert, ca_cert)) !=
+             NULL) {
+#endif
+  } else if ((nc->ssl = SSL_new(nc->ssl_ctx)) == NULL) {
+    result = "SSL_new() failed";
+  } else {
+    SSL_set_app_data(nc->ssl, nc);
+    /*
+     * Socket is open here only if we are connecting to IP address
+     * and does not open if we are connecting using async DNS resolver
+     */
+    if (nc->sock != INVALID_SOCKET) SSL_set_fd(nc->ssl, nc->sock);
+  }
+  return result;
+}
+
+int ns_ssl_ktls(struct ns_connection *nc) {
+  int res = 0;
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  if (nc->ssl != NULL && (nc->flags & NSF_SSL_HANDSHAKE_DONE)) {
+    if (BIO_get_ktls_send(SSL_get_wbio(nc->ssl))) res |= NS_KTLS_SEND;
+    if (BIO_get_ktls_recv(SSL_get_rbio(nc->ssl))) res |= NS_KTLS_RECV;
+  }
+#else
+  (void) nc;
+#endif
+  return res;
+}
+
+static int ns_ssl_err(struct ns_connection *conn, int res) {
+  int ssl_err = SSL_get_error(conn->ssl, res);
+  if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
+  if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
+  return ssl_err;
+}
+#endif /* NS_ENABLE_SSL */
+
+static void ns_bandwidth_free(struct ns_bandwidth *bw) {
+  if (bw != NULL && --bw->refs == 0) {
+    ns_bandwidth_free(bw->shared);
+    NS_FREE(bw);
+  }
+}
+
+/* Get the bandwidth limits of a connection, creating them if needed */
+static struct ns_bandwidth *ns_bandwidth_get(struct ns_connection *nc) {
+  if (nc->bandwidth == NULL &&
+      (nc->bandwidth = (struct ns_bandwidth *) NS_CALLOC(
+           1, sizeof(*nc->bandwidth))) != NULL) {
+    nc->bandwidth->refs = 1;
+  }
+  return nc->bandwidth;
+}
+
+/*
+ * Refill a byte bucket and return how many of `max` bytes can be
+ * transferred now. If none, set `*resume` to when enough will be.
+ */
+static size_t ns_byte_bucket_avail(struct ns_byte_bucket *b, double now,
+                                   size_t max, double *resume) {
+  double quantum, t;
+
+  if (b->rate <= 0) return max;
+  if (now > b->last) {
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+  }
+  quantum = b->burst < NS_BANDWIDTH_QUANTUM ? b->burst : NS_BANDWIDTH_QUANTUM;
+  if (b->tokens >= quantum) {
+    return b->tokens < max ? (size_t) b->tokens : max;
+  }
+  t = now + (quantum - b->tokens) / b->rate;
+  if (t > *resume) *resume = t;
+
+  return 0;
+}
+
+/* Return how many of `max` bytes `nc` may transfer in direction `dir` */
+static size_t ns_bandwidth_avail(struct ns_connection *nc, int dir,
+                                 size_t max, double *resume) {
+  struct ns_bandwidth *bw = nc->bandwidth;
+  double now;
+
+  if (bw == NULL) return max;
+  now = ns_time();
+  max = ns_byte_bucket_avail(&bw->dirs[dir], now, max, resume);
+  if (bw->shared != NULL && max > 0) {
+    max = ns_byte_bucket_avail(&bw->shared->dirs[dir], now, max, resume);
+  }
+  return max;
+}
+
+static void ns_bandwidth_charge(struct ns_connection *nc, int dir, size_t n) {
+  struct ns_bandwidth *bw = nc->bandwidth;
+
+  if (bw != NULL) {
+    bw->dirs[dir].tokens -= n;
+    if (bw->shared != NULL) bw->shared->dirs[dir].tokens -= n;
+  }
+}
+
+int ns_set_bandwidth(struct ns_connection *nc, int dir, double rate,
+                     double burst) {
+  struct ns_byte_bucket *b;
+  double now = ns_time(), resume = 0;
+
+  if ((dir != NS_BANDWIDTH_SEND && dir != NS_BANDWIDTH_RECV) || rate < 0 ||
+      ns_bandwidth_get(nc) == NULL) {
+    return -1;
+  }
+  b = &nc->bandwidth->dirs[dir];
+  if (burst <= 0) burst = rate / 10;
+  if (burst < 1) burst = 1;
+  if (b->rate > 0) {
+    /* Adjusting: refill at the old rate, keep any debt */
+    ns_byte_bucket_avail(b, now, 0, &resume);
+    if (b->tokens > burst) b->tokens = burst;
+  } else {
+    b->tokens = burst;
+  }
+  b->rate = rate;
+  b->burst = burst;
+  b->last = now;
+
+  return 0;
+}
+
+static struct ns_connection *accept_conn(struct ns_connection *ls) {
+  struct ns_connection *c = NULL;
+  struct ns_rate_limit *rl = ls->rate_limit[NS_RATE_LIMIT_CONNECTIONS];
+  union socket_address sa;
+  socklen_t len = sizeof(sa);
+  sock_t sock = INVALID_SOCKET;
+  double now = 0, wait = 0;
+
+  /* Unix domain peers are usually unnamed: accept() fills in the family only */
+  memset(&sa, 0, sizeof(sa));
+
+  /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
+  if ((sock = accept(ls->sock, &sa.sa, &len)) == INVALID_SOCKET) {
+  } else if (!ns_ip_acl_check(ls->ip_acl, &sa)) {
+    /* Denied before anything is allocated for the connection */
+    DBG(("%p %d denied by ACL", ls, sock));
+    closesocket(sock);
+  } else if (rl != NULL &&
+             (wait = ns_rate_limit_take_addr(rl, &sa, now = ns_time())) > 0 &&
+             rl->opts.action != NS_RATE_LIMIT_DELAY) {
+    DBG(("%p %d rate limited", ls, sock));
+    closesocket(sock);
+  } else if ((c = ns_add_sock(ls->mgr, sock, ls->handler)) == NULL) {
+    closesocket(sock);
+#ifdef NS_ENABLE_SSL
+  } else if (ls->ssl_ctx != NULL && ((c->ssl = SSL_new(ls->ssl_ctx)) == NULL ||
+                                     SSL_set_fd(c->ssl, sock) != 1)) {
+    DBG(("SSL error"));
+    ns_close_conn(c);
+    c = NULL;
+#endif
+  } else {
+    c->listener = ls;
+    c->proto_data = ls->proto_data;
+    c->proto_handler = ls->proto_handler;
+    c->user_data = ls->user_data;
+    c->recv_mbuf_limit = ls->recv_mbuf_limit;
+    c->recv_budget = ls->recv_budget;
+    c->sa = sa;
+    ns_set_tcp_defaults(sock, &sa);
+    if (ls->zerocopy != NULL && ls->zerocopy->threshold > 0) {
+      ns_set_zerocopy(c, ls->zerocopy->threshold);
+    }
+    ns_set_rate_limit(c, NS_RATE_LIMIT_MESSAGES,
+                      ls->rate_limit[NS_RATE_LIMIT_MESSAGES]);
+    if (ls->bandwidth != NULL && ns_bandwidth_get(c) != NULL) {
+      c->bandwidth->shared = ls->bandwidth;
+      ls->bandwidth->refs++;
+    }
+    if (wait > 0) c->recv_resume_time = now + wait;
+    if (c->ssl == NULL) { /* SSL connections need to perform handshake. */
+      ns_call(c, NS_ACCEPT, &sa);
+    }
+    DBG(("%p %d %p %p", c, c->sock, c->ssl_ctx, c->ssl));
+  }
+
+  return c;
+}
+
+static int ns_is_error(int n) {
+#ifdef NS_CC3200
+  DBG(("n = %d, errno = %d", n, errno));
   if (n < 0) errno = n;
 #endif
   return n == 0 || (n < 0 && errno != EINTR && errno != EINPROGRESS &&
@@ -698,20 +1945,185 @@ static int ns_is_error(int n) {
 
 static size_t recv_avail_size(struct ns_connection *conn, size_t max) {
   size_t avail;
+  /* Paused by a handler, e.g. the rate limit */
+  if (conn->recv_resume_time != 0) return 0;
   if (conn->recv_mbuf_limit < conn->recv_mbuf.len) return 0;
   avail = conn->recv_mbuf_limit - conn->recv_mbuf.len;
   return avail > max ? max : avail;
 }
 
+#ifdef NS_WORKERS
+struct ns_workers {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* Jobs to do, or stop */
+  pthread_cond_t idle; /* num_busy dropped to 0 */
+  struct ns_job *todo, **todo_tail;
+  struct ns_job *done;
+  int num_busy; /* Jobs queued or running */
+  int stop;
+  int num_threads;
+  pthread_t *threads;
+  sock_t wake[2]; /* A byte to wake[0] tells the loop that jobs are done */
+};
+
+static void *ns_worker(void *param) {
+  struct ns_workers *w = (struct ns_workers *) param;
+  struct ns_job *job;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->todo == NULL && !w->stop) pthread_cond_wait(&w->work, &w->lock);
+    if ((job = w->todo) == NULL) break;
+    if ((w->todo = job->next) == NULL) w->todo_tail = &w->todo;
+    pthread_mutex_unlock(&w->lock);
+
+    job->run(job);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->done == NULL) (void) NS_SEND_FUNC(w->wake[0], "", 1, 0);
+    job->next = w->done;
+    w->done = job;
+    if (--w->num_busy == 0) pthread_cond_broadcast(&w->idle);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* Finish the jobs that are done */
+static void ns_workers_handler(struct ns_connection *nc, int ev, void *p) {
+  struct ns_workers *w = (struct ns_workers *) nc->user_data;
+  struct ns_job *job, *done;
+
+  (void) p;
+  if (ev != NS_RECV) return;
+  mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+
+  pthread_mutex_lock(&w->lock);
+  done = w->done;
+  w->done = NULL;
+  pthread_mutex_unlock(&w->lock);
+
+  while ((job = done) != NULL) {
+    done = job->next;
+    job->done(job);
+  }
+}
+
+NS_INTERNAL int ns_workers_add(struct ns_workers *w, struct ns_job *job) {
+  if (w == NULL) return -1;
+  job->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  *w->todo_tail = job;
+  w->todo_tail = &job->next;
+  w->num_busy++;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+#ifdef NS_SSL_WORKERS
+/* Wait for the workers to finish their jobs */
+static void ns_workers_quiesce(struct ns_workers *w) {
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  while (w->num_busy > 0) pthread_cond_wait(&w->idle, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+}
+#endif
+
+static void ns_workers_free(struct ns_workers *w) {
+  struct ns_job *job;
+  int i;
+
+  if (w == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->num_threads; i++) pthread_join(w->threads[i], NULL);
+
+  while ((job = w->done) != NULL) {
+    w->done = job->next;
+    job->nc = NULL;
+    job->done(job);
+  }
+  /* wake[1] belongs to a connection, closed with the others */
+  closesocket(w->wake[0]);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->idle);
+  NS_FREE(w->threads);
+  NS_FREE(w);
+}
+
+static struct ns_workers *ns_workers_new(struct ns_mgr *mgr, int num_threads) {
+  struct ns_workers *w;
+  struct ns_connection *nc;
+
+  if (num_threads <= 0 ||
+      (w = (struct ns_workers *) NS_CALLOC(1, sizeof(*w))) == NULL) {
+    return NULL;
+  } else if ((w->threads = (pthread_t *) NS_CALLOC(
+                  num_threads, sizeof(*w->threads))) == NULL ||
+             !ns_socketpair(w->wake, SOCK_STREAM)) {
+    NS_FREE(w->threads);
+    NS_FREE(w);
+    return NULL;
+  } else if ((nc = ns_add_sock(mgr, w->wake[1], ns_workers_handler)) ==
+             NULL) {
+    closesocket(w->wake[0]);
+    closesocket(w->wake[1]);
+    NS_FREE(w->threads);
+    NS_FREE(w);
+    return NULL;
+  }
+
+  nc->user_data = w;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->idle, NULL);
+  w->todo_tail = &w->todo;
+  while (w->num_threads < num_threads &&
+         pthread_create(&w->threads[w->num_threads], NULL, ns_worker, w) ==
+             0) {
+    w->num_threads++;
+  }
+  if (w->num_threads == 0) {
+    ns_workers_free(w);
+    return NULL;
+  }
+  return w;
+}
+
+int ns_offload_file_io(struct ns_mgr *mgr, int num_threads) {
+  if (mgr->file_workers != NULL) return -1;
+  mgr->file_workers = ns_workers_new(mgr, num_threads);
+  return mgr->file_workers == NULL ? -1 : 0;
+}
+#else
+int ns_offload_file_io(struct ns_mgr *mgr, int num_threads) {
+  (void) mgr;
+  (void) num_threads;
+  return -1;
+}
+#endif /* NS_WORKERS */
+
 #ifdef NS_ENABLE_SSL
-static void ns_ssl_begin(struct ns_connection *nc) {
+/* Apply the result of a handshake step, `ssl_err` is from SSL_get_error() */
+static void ns_ssl_handshake_result(struct ns_connection *nc, int res,
+                                    int ssl_err) {
   int server_side = nc->listener != NULL;
-  int res = server_side ? SSL_accept(nc->ssl) : SSL_connect(nc->ssl);
 
   if (res == 1) {
     nc->flags |= NSF_SSL_HANDSHAKE_DONE;
     nc->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
 
+#ifdef NS_SSL_OPENSSL_1_1
+    if (!server_side && nc->mgr->ssl_clients != NULL) {
+      nc->mgr->ssl_clients->stats.handshakes++;
+      if (SSL_session_reused(nc->ssl)) nc->mgr->ssl_clients->stats.resumed++;
+    }
+#endif
     if (server_side) {
       union socket_address sa;
       socklen_t sa_len = sizeof(sa);
@@ -720,17 +2132,354 @@ static void ns_ssl_begin(struct ns_connection *nc) {
       ns_call(nc, NS_ACCEPT, &sa);
     }
   } else {
-    int ssl_err = ns_ssl_err(nc, res);
+    if (ssl_err == SSL_ERROR_WANT_READ) nc->flags |= NSF_WANT_READ;
+    if (ssl_err == SSL_ERROR_WANT_WRITE) nc->flags |= NSF_WANT_WRITE;
     if (ssl_err != SSL_ERROR_WANT_READ && ssl_err != SSL_ERROR_WANT_WRITE) {
       nc->flags |= NSF_CLOSE_IMMEDIATELY;
     }
   }
 }
+
+#ifdef NS_SSL_WORKERS
+/* A handshake step of an accepted connection */
+struct ns_ssl_job {
+  struct ns_job job;
+  int res, ssl_err; /* Results of SSL_accept() and SSL_get_error() */
+};
+
+static void ns_ssl_job_run(struct ns_job *job) {
+  struct ns_ssl_job *sj = (struct ns_ssl_job *) job;
+
+  /* The loop leaves the connection alone until the job is done */
+  ERR_clear_error();
+  sj->res = SSL_accept(job->nc->ssl);
+  sj->ssl_err = SSL_get_error(job->nc->ssl, sj->res);
+}
+
+/* Resume the connection */
+static void ns_ssl_job_done(struct ns_job *job) {
+  struct ns_ssl_job *sj = (struct ns_ssl_job *) job;
+
+  if (job->nc != NULL) {
+    job->nc->flags &= ~NSF_SSL_BUSY;
+    ns_ssl_handshake_result(job->nc, sj->res, sj->ssl_err);
+  }
+  NS_FREE(sj);
+}
+
+/* Queue the next handshake step of an accepted connection */
+static int ns_ssl_workers_add(struct ns_connection *nc) {
+  struct ns_ssl_job *sj;
+
+  if (nc->mgr->ssl_workers == NULL ||
+      (sj = (struct ns_ssl_job *) NS_CALLOC(1, sizeof(*sj))) == NULL) {
+    return -1;
+  }
+  sj->job.nc = nc;
+  sj->job.run = ns_ssl_job_run;
+  sj->job.done = ns_ssl_job_done;
+  nc->flags |= NSF_SSL_BUSY;
+  return ns_workers_add(nc->mgr->ssl_workers, &sj->job);
+}
+
+int ns_ssl_offload_handshakes(struct ns_mgr *mgr, int num_threads) {
+  if (mgr->ssl_workers != NULL) return -1;
+  mgr->ssl_workers = ns_workers_new(mgr, num_threads);
+  return mgr->ssl_workers == NULL ? -1 : 0;
+}
+#else
+int ns_ssl_offload_handshakes(struct ns_mgr *mgr, int num_threads) {
+  (void) mgr;
+  (void) num_threads;
+  return -1;
+}
+#endif /* NS_SSL_WORKERS */
+
+static void ns_ssl_begin(struct ns_connection *nc) {
+  int server_side = nc->listener != NULL;
+  int res;
+
+#ifdef NS_SSL_WORKERS
+  if (nc->flags & NSF_SSL_BUSY) return;
+  if (server_side && ns_ssl_workers_add(nc) == 0) return;
+#endif
+#ifdef NS_SSL_OPENSSL_1_1
+  if (!server_side && SSL_get_session(nc->ssl) == NULL) {
+    ns_ssl_client_resume(nc);
+  }
+#endif
+  res = server_side ? SSL_accept(nc->ssl) : SSL_connect(nc->ssl);
+  ns_ssl_handshake_result(nc, res,
+                          res == 1 ? SSL_ERROR_NONE : SSL_get_error(nc->ssl,
+                                                                    res));
+}
 #endif /* NS_ENABLE_SSL */
 
+#ifdef NS_ENABLE_SPLICE
+static struct ns_splice *ns_splice_new(struct ns_connection *peer) {
+  struct ns_splice *sp = (struct ns_splice *) NS_CALLOC(1, sizeof(*sp));
+  int size;
+
+  if (sp == NULL) return NULL;
+  if (pipe(sp->fds) != 0) {
+    NS_FREE(sp);
+    return NULL;
+  }
+  /* Fewer, larger splices. The default size is fine if it's not allowed. */
+  fcntl(sp->fds[1], F_SETPIPE_SZ, NS_SPLICE_PIPE_SIZE);
+  size = fcntl(sp->fds[1], F_GETPIPE_SZ);
+  sp->size = size > 0 ? (size_t) size : 65536;
+  sp->peer = peer;
+
+  return sp;
+}
+
+int ns_splice(struct ns_connection *a, struct ns_connection *b) {
+  struct ns_connection *c[2];
+  int i;
+
+  c[0] = a;
+  c[1] = b;
+  for (i = 0; i < 2; i++) {
+    if (a == b || c[i]->mgr != a->mgr || c[i]->splice != NULL ||
+        c[i]->ssl != NULL || (c[i]->flags & (NSF_UDP | NSF_LISTENING))) {
+      return -1;
+    }
+  }
+  if ((a->splice = ns_splice_new(b)) == NULL) return -1;
+  if ((b->splice = ns_splice_new(a)) == NULL) {
+    a->splice->peer = NULL;
+    ns_splice_free(a);
+    return -1;
+  }
+  ns_forward(a, b);
+  ns_forward(b, a);
+
+  return 0;
+}
+
+static void ns_splice_free(struct ns_connection *nc) {
+  struct ns_splice *sp = nc->splice;
+
+  if (sp == NULL) return;
+  if (sp->peer != NULL) {
+    /* The peer sends what it has got and follows */
+    sp->peer->splice->peer = NULL;
+    sp->peer->flags |= NSF_SEND_AND_CLOSE;
+  }
+  close(sp->fds[0]);
+  close(sp->fds[1]);
+  NS_FREE(sp);
+  nc->splice = NULL;
+}
+
+/* Move received data to the pipe of the peer, up to `budget` bytes */
+static void ns_splice_in(struct ns_connection *nc, size_t budget) {
+  struct ns_splice *sp = nc->splice->peer->splice;
+  size_t len;
+  int n = 0;
+
+  while (budget > 0 && sp->len < sp->size) {
+    len = sp->size - sp->len < budget ? sp->size - sp->len : budget;
+    n = (int) splice(nc->sock, NULL, sp->fds[1], NULL, len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) break;
+    DBG(("%p %d bytes <- %d (splice)", nc, n, nc->sock));
+    sp->len += n;
+    budget -= n;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_RECV, n);
+    ns_call(nc, NS_RECV, &n);
+  }
+
+  if (n > 0 && budget == 0) {
+    nc->flags |= NSF_READ_PENDING; /* See ns_read_from_socket() */
+  } else if (n == 0 && sp->len < sp->size) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY; /* EOF */
+  } else if (n < 0 && ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+  /*
+   * The pipe holds a number of pages rather than bytes, and can get full
+   * before `size` bytes if the socket gives partial pages. The socket
+   * might just be empty too, but either way the peer drains the pipe,
+   * and then reading resumes.
+   */
+  if (sp->len >= sp->size || (n < 0 && sp->len > 0)) sp->full = 1;
+}
+
+/* Send some of the pipe, called when the output buffer is empty */
+static void ns_splice_out(struct ns_connection *nc) {
+  struct ns_splice *sp = nc->splice;
+  double resume = 0;
+  size_t len;
+  int n;
+
+  len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, sp->len, &resume);
+  if (len == 0) {
+    nc->send_resume_time = resume;
+    return;
+  }
+  n = (int) splice(sp->fds[0], NULL, nc->sock, NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  DBG(("%p %d bytes -> %d (splice)", nc, n, nc->sock));
+  if (n > 0) {
+    sp->len -= n;
+    sp->full = 0;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+    ns_call(nc, NS_SEND, &n);
+  } else if (ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+#else
+static void ns_splice_free(struct ns_connection *nc) {
+  (void) nc;
+}
+#endif
+
+#ifdef NS_ENABLE_ZEROCOPY
+static void ns_zerocopy_free(struct ns_connection *nc) {
+  struct ns_zc_buf *zb, *next;
+
+  if (nc->zerocopy == NULL) return;
+  for (zb = nc->zerocopy->bufs; zb != NULL; zb = next) {
+    next = zb->next;
+    MBUF_FREE(zb->buf);
+    NS_FREE(zb);
+  }
+  NS_FREE(nc->zerocopy);
+  nc->zerocopy = NULL;
+}
+
+/* Free the buffers that are sent and that the kernel is done with */
+static void ns_zerocopy_gc(struct ns_zerocopy *zc) {
+  struct ns_zc_buf *zb, **p = &zc->bufs;
+
+  while ((zb = *p) != NULL) {
+    if (zb->sent == zb->len && zb->pending == 0) {
+      *p = zb->next;
+      MBUF_FREE(zb->buf);
+      NS_FREE(zb);
+    } else {
+      p = &zb->next;
+    }
+  }
+}
+
+/* Read zero-copy completions from the socket error queue */
+static void ns_zerocopy_reap(struct ns_connection *nc) {
+  struct ns_zerocopy *zc = nc->zerocopy;
+  /* Same layout as struct sock_extended_err from <linux/errqueue.h> */
+  struct {
+    uint32_t ee_errno;
+    uint8_t ee_origin, ee_type, ee_code, ee_pad;
+    uint32_t ee_info, ee_data; /* Range of completed sends */
+  } ee;
+  union {
+    struct cmsghdr align;
+    char buf[128];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct ns_zc_buf *zb;
+  uint32_t id;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(nc->sock, &msg, MSG_ERRQUEUE) < 0) break;
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_len < CMSG_LEN(sizeof(ee))) continue;
+      memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+      if (ee.ee_errno != 0 || ee.ee_origin != NS_EE_ORIGIN_ZEROCOPY) continue;
+      DBG(("%p zero-copy sends %u-%u done, code %d", nc, ee.ee_info,
+           ee.ee_data, ee.ee_code));
+      if (ee.ee_code & NS_EE_CODE_ZEROCOPY_COPIED) zc->copied = 1;
+      id = ee.ee_info;
+      do {
+        for (zb = zc->bufs; zb != NULL; zb = zb->next) {
+          if ((uint32_t)(id - zb->first_id) < zb->num_ids) {
+            zb->pending--;
+            break;
+          }
+        }
+      } while (id++ != ee.ee_data);
+    }
+  }
+  ns_zerocopy_gc(zc);
+}
+
+/*
+ * Send from the buffer taken over for zero-copy sends, or take over the
+ * output buffer if it's large enough. Return 0 to send it as usual.
+ */
+static int ns_zerocopy_write(struct ns_connection *nc) {
+  struct ns_zerocopy *zc = nc->zerocopy;
+  struct mbuf *io = &nc->send_mbuf;
+  struct ns_zc_buf *zb;
+  double resume = 0;
+  size_t len;
+  int n, flags = MSG_ZEROCOPY;
+
+  if (zc->unsent == 0) {
+    if (zc->copied || zc->threshold == 0 || io->len < zc->threshold ||
+        nc->ssl != NULL ||
+        (zb = (struct ns_zc_buf *) NS_CALLOC(1, sizeof(*zb))) == NULL) {
+      return 0;
+    }
+    /* Data sent from now on goes to a new buffer */
+    zb->buf = io->buf;
+    zb->len = zc->unsent = io->len;
+    zb->first_id = zc->next_id;
+    zb->next = zc->bufs;
+    zc->bufs = zb;
+    mbuf_init(io, 0);
+  }
+  zb = zc->bufs;
+
+  len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, zc->unsent, &resume);
+  if (len == 0) {
+    nc->send_resume_time = resume;
+    return 1;
+  }
+  n = (int) send(nc->sock, zb->buf + zb->sent, len, flags);
+  if (n < 0 && errno == ENOBUFS) {
+    /* Over the limit of pinned memory, copy this time */
+    flags = 0;
+    n = (int) send(nc->sock, zb->buf + zb->sent, len, flags);
+  }
+  DBG(("%p %d bytes -> %d (zero-copy %d)", nc, n, nc->sock, flags != 0));
+
+  if (ns_is_error(n)) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    /* The kernel numbers the zero-copy sends that succeed */
+    if (flags != 0) {
+      zb->num_ids++;
+      zb->pending++;
+      zc->next_id++;
+    }
+    zb->sent += n;
+    zc->unsent -= n;
+    ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+    ns_zerocopy_gc(zc);
+  }
+  ns_call(nc, NS_SEND, &n);
+
+  return 1;
+}
+#else
+static void ns_zerocopy_free(struct ns_connection *nc) {
+  (void) nc;
+}
+#endif
+
 static void ns_read_from_socket(struct ns_connection *conn) {
   char buf[NS_READ_BUFFER_SIZE];
   int n = 0, to_recv;
+  size_t budget;
+  double resume = 0;
 
   if (conn->flags & NSF_CONNECTING) {
     int ok = 1, ret;
@@ -764,15 +2513,48 @@ static void ns_read_from_socket(struct ns_connection *conn) {
     return;
   }
 
+  conn->flags &= ~NSF_READ_PENDING;
+  budget = ns_bandwidth_avail(
+      conn, NS_BANDWIDTH_RECV,
+      conn->recv_budget > 0 ? conn->recv_budget : (size_t) ~0, &resume);
+  if (budget == 0) {
+    /* Over the receive rate, see ns_set_bandwidth() */
+    conn->recv_resume_time = resume;
+    return;
+  }
+
+#ifdef NS_ENABLE_SPLICE
+  if (conn->splice != NULL && conn->splice->peer != NULL) {
+    ns_splice_in(conn, budget);
+    return;
+  }
+#endif
+
 #ifdef NS_ENABLE_SSL
   if (conn->ssl != NULL) {
     if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
-      /* SSL library may have more bytes ready to read then we ask to read.
-       * Therefore, read in a loop until we read everything. Without the loop,
-       * we skip to the next select() cycle which can just timeout. */
-      while ((n = SSL_read(conn->ssl, buf, sizeof(buf))) > 0) {
+      struct mbuf *io = &conn->recv_mbuf;
+      size_t want;
+
+      /*
+       * Decrypt straight into the receive buffer, up to a whole record at a
+       * time. SSL library may have more bytes ready to read then we ask to
+       * read. Therefore, read in a loop until we read everything. Without
+       * the loop, we skip to the next select() cycle which can just timeout.
+       */
+      while (budget > 0 && conn->recv_resume_time == 0) {
+        want = budget < NS_SSL_MAX_RECORD_SIZE ? budget
+                                               : NS_SSL_MAX_RECORD_SIZE;
+        if (io->size - io->len < want) mbuf_resize(io, io->len + want);
+        if (io->size - io->len < want) want = io->size - io->len;
+        if (want == 0 ||
+            (n = SSL_read(conn->ssl, io->buf + io->len, (int) want)) <= 0) {
+          break;
+        }
         DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
-        mbuf_append(&conn->recv_mbuf, buf, n);
+        io->len += n;
+        budget -= n;
+        ns_bandwidth_charge(conn, NS_BANDWIDTH_RECV, n);
         ns_call(conn, NS_RECV, &n);
       }
       ns_ssl_err(conn, n);
@@ -783,9 +2565,13 @@ static void ns_read_from_socket(struct ns_connection *conn) {
   } else
 #endif
   {
-    to_recv = recv_avail_size(conn, sizeof(buf));
-    while ((n = (int) NS_RECV_FUNC(conn->sock, buf, to_recv, 0)) > 0) {
+    to_recv =
+        recv_avail_size(conn, budget < sizeof(buf) ? budget : sizeof(buf));
+    while (to_recv > 0 &&
+           (n = (int) NS_RECV_FUNC(conn->sock, buf, to_recv, 0)) > 0) {
       DBG(("%p %d bytes (PLAIN) <- %d", conn, n, conn->sock));
+      budget -= n;
+      ns_bandwidth_charge(conn, NS_BANDWIDTH_RECV, n);
       mbuf_append(&conn->recv_mbuf, buf, n);
       ns_call(conn, NS_RECV, &n);
 #ifdef NS_ESP8266
@@ -799,27 +2585,211 @@ static void ns_read_from_socket(struct ns_connection *conn) {
       if (to_recv > n) {
         break;
       }
-      to_recv = recv_avail_size(conn, sizeof(buf));
 #endif
+      /* Stop at the buffer limit, or at the budget of this poll */
+      to_recv =
+          recv_avail_size(conn, budget < sizeof(buf) ? budget : sizeof(buf));
     }
     DBG(("recv returns %d", n));
   }
 
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  if (budget == 0 && n > 0) {
+    /*
+     * Out of budget, there might be more to read. Other connections get
+     * their turn first, then the next poll carries on without waiting for
+     * the socket (or the SSL buffer) to signal again.
+     */
+    conn->flags |= NSF_READ_PENDING;
+  }
+
+  if (ns_is_error(n)) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void ns_send_file_free(struct ns_connection *nc) {
+#ifdef NS_ENABLE_SEND_FILE
+  if (nc->send_file != NULL) {
+    close(nc->send_file->fd);
+    NS_FREE(nc->send_file);
+    nc->send_file = NULL;
+  }
+#else
+  (void) nc;
+#endif
+}
+
+/* Whether there's anything left to send */
+static int ns_send_pending(const struct ns_connection *nc) {
+  return nc->send_mbuf.len > 0 || nc->send_file != NULL ||
+         (nc->splice != NULL && nc->splice->len > 0) ||
+         (nc->zerocopy != NULL && nc->zerocopy->unsent > 0);
+}
+
+/* Whether the kernel still uses buffers, see ns_set_zerocopy() */
+static int ns_zerocopy_pending(const struct ns_connection *nc) {
+  return nc->zerocopy != NULL && nc->zerocopy->bufs != NULL;
+}
+
+/* Whether there's no room for received data, see ns_splice() */
+static int ns_recv_full(const struct ns_connection *nc) {
+  if (nc->splice != NULL && nc->splice->peer != NULL) {
+    return nc->splice->peer->splice->full;
+  }
+  return nc->recv_mbuf.len >= nc->recv_mbuf_limit;
+}
+
+#ifdef NS_ENABLE_SEND_FILE
+int ns_send_file(struct ns_connection *nc, int fd, int64_t offset,
+                 int64_t len) {
+  struct ns_send_file *sf;
+
+  if (nc->send_file != NULL || (nc->flags & NSF_UDP) ||
+      (sf = (struct ns_send_file *) NS_CALLOC(1, sizeof(*sf))) == NULL) {
+    return -1;
+  }
+  sf->fd = fd;
+  sf->offset = offset;
+  sf->len = len;
+  nc->send_file = sf;
+  if (len <= 0) ns_send_file_free(nc);
+  return 0;
+}
+
+/*
+ * Send some of the file, called when the output buffer is empty. Return 1
+ * if it's done with sendfile(), or 0 after reading a chunk of the file to
+ * the output buffer.
+ */
+static int ns_send_file_some(struct ns_connection *nc) {
+  struct ns_send_file *sf = nc->send_file;
+  char buf[NS_SEND_FILE_BUFFER_SIZE];
+  size_t len = sf->len < (int64_t) sizeof(buf) ? (size_t) sf->len : sizeof(buf);
+  ssize_t n;
+
+#ifdef NS_ENABLE_SSL
+  /* SSL needs the data in user space, unless the kernel does the records */
+  if (nc->ssl != NULL && !(ns_ssl_ktls(nc) & NS_KTLS_SEND)) {
+    sf->no_sendfile = 1;
+  }
+#endif
+#ifdef __linux__
+  if (!sf->no_sendfile) {
+    double resume = 0;
+    off_t off = (off_t) sf->offset;
+
+    len = (size_t)(sf->len < 0x7ffff000 ? sf->len : 0x7ffff000);
+    if ((len = ns_bandwidth_avail(nc, NS_BANDWIDTH_SEND, len, &resume)) == 0) {
+      nc->send_resume_time = resume;
+      return 1;
+    }
+    if ((n = sendfile(nc->sock, sf->fd, &off, len)) > 0) {
+      int num_sent = (int) n;
+      DBG(("%p %d bytes -> %d (sendfile)", nc, num_sent, nc->sock));
+      ns_bandwidth_charge(nc, NS_BANDWIDTH_SEND, n);
+      sf->offset += n;
+      if ((sf->len -= n) == 0) ns_send_file_free(nc);
+      ns_call(nc, NS_SEND, &num_sent);
+      return 1;
+    } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == EINTR) {
+      /* File got shorter, or the socket is full */
+      if (n == 0) nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return 1;
+    } else if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return 1;
+    }
+    /* This file or socket can't do it, read the file instead */
+    sf->no_sendfile = 1;
+    len = sf->len < (int64_t) sizeof(buf) ? (size_t) sf->len : sizeof(buf);
+  }
+#endif
+
+  if ((n = pread(sf->fd, buf, len, (off_t) sf->offset)) <= 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return 1;
+  }
+  mbuf_append(&nc->send_mbuf, buf, n);
+  sf->offset += n;
+  if ((sf->len -= n) == 0) ns_send_file_free(nc);
+  return 0;
+}
+#endif
+
+#ifdef NS_ENABLE_SSL
+/*
+ * Pick the TLS record size for the next write and return how much of `len`
+ * to write. Until NS_SSL_SMALL_RECORDS_LIMIT bytes are sent, records fit in
+ * a TCP segment, so the peer can decrypt the first bytes without waiting
+ * for a whole 16 KB record spread over several round trips of a slow
+ * starting connection. Bulk transfers then use full records. After the
+ * connection idles, the congestion window is small again, so is the record.
+ */
+static int ns_ssl_record_size(struct ns_connection *nc, size_t len) {
+#ifdef NS_SSL_OPENSSL_1_1
+  double now = ns_time();
+
+  if (now - nc->ssl_send_time >= NS_SSL_IDLE_RESET) nc->ssl_sent = 0;
+  nc->ssl_send_time = now;
+  if (nc->ssl_sent < NS_SSL_SMALL_RECORDS_LIMIT) {
+    /* Longer retries are fine, so cap the write at the limit */
+    SSL_set_max_send_fragment(nc->ssl, NS_SSL_SMALL_RECORD_SIZE);
+    if (len > NS_SSL_SMALL_RECORDS_LIMIT - nc->ssl_sent) {
+      len = NS_SSL_SMALL_RECORDS_LIMIT - nc->ssl_sent;
+    }
+  } else {
+    /* Lowering the max fragment lowered the split fragment too */
+    SSL_set_max_send_fragment(nc->ssl, NS_SSL_MAX_RECORD_SIZE);
+    SSL_set_split_send_fragment(nc->ssl, NS_SSL_MAX_RECORD_SIZE);
   }
+#else
+  (void) nc;
+#endif
+  return (int) len;
 }
+#endif
 
 static void ns_write_to_socket(struct ns_connection *conn) {
   struct mbuf *io = &conn->send_mbuf;
   int n = 0;
+  size_t len;
+  double resume = 0;
 
+#ifdef NS_ENABLE_ZEROCOPY
+  if (conn->zerocopy != NULL && ns_zerocopy_write(conn)) return;
+#endif
+#ifdef NS_ENABLE_SEND_FILE
+  if (io->len == 0 && conn->send_file != NULL && ns_send_file_some(conn)) {
+    return;
+  }
+#endif
+#ifdef NS_ENABLE_SPLICE
+  if (io->len == 0 && conn->send_file == NULL && conn->splice != NULL) {
+    ns_splice_out(conn);
+    return;
+  }
+#endif
   assert(io->len > 0);
 
+  if ((len = ns_bandwidth_avail(conn, NS_BANDWIDTH_SEND, io->len, &resume)) ==
+      0) {
+    /* Over the send rate, see ns_set_bandwidth() */
+    conn->send_resume_time = resume;
+    return;
+  }
+
 #ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
+  if (conn->ssl != NULL && (ns_ssl_ktls(conn) & NS_KTLS_SEND)) {
+    /* The kernel makes the records, partial writes are fine */
+    n = (int) NS_SEND_FUNC(conn->sock, io->buf, len, 0);
+  } else if (conn->ssl != NULL) {
     if (conn->flags & NSF_SSL_HANDSHAKE_DONE) {
-      n = SSL_write(conn->ssl, io->buf, io->len);
+      /*
+       * Retries must not shrink the buffer, send it all and let the debt
+       * pause the next write.
+       */
+      n = SSL_write(conn->ssl, io->buf, ns_ssl_record_size(conn, io->len));
       if (n <= 0) {
         int ssl_err = ns_ssl_err(conn, n);
         if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
@@ -830,6 +2800,7 @@ static void ns_write_to_socket(struct ns_connection *conn) {
       } else {
         /* Successful SSL operation, clear off SSL wait flags */
         conn->flags &= ~(NSF_WANT_READ | NSF_WANT_WRITE);
+        if (conn->ssl_sent < NS_SSL_SMALL_RECORDS_LIMIT) conn->ssl_sent += n;
       }
     } else {
       ns_ssl_begin(conn);
@@ -838,7 +2809,12 @@ static void ns_write_to_socket(struct ns_connection *conn) {
   } else
 #endif
   {
-    n = (int) NS_SEND_FUNC(conn->sock, io->buf, io->len, 0);
+    int flags = 0;
+#if defined(NS_ENABLE_SEND_FILE) && defined(MSG_MORE)
+    /* A file follows, let it share segments with e.g. a response header */
+    if (conn->send_file != NULL) flags |= MSG_MORE;
+#endif
+    n = (int) NS_SEND_FUNC(conn->sock, io->buf, len, flags);
   }
 
   DBG(("%p %d bytes -> %d", conn, n, conn->sock));
@@ -846,6 +2822,7 @@ static void ns_write_to_socket(struct ns_connection *conn) {
   if (ns_is_error(n)) {
     conn->flags |= NSF_CLOSE_IMMEDIATELY;
   } else if (n > 0) {
+    ns_bandwidth_charge(conn, NS_BANDWIDTH_SEND, n);
 #ifndef NS_DISABLE_FILESYSTEM
     /* LCOV_EXCL_START */
     if (conn->mgr->hexdump_file != NULL) {
@@ -862,16 +2839,62 @@ int ns_send(struct ns_connection *conn, const void *buf, int len) {
   return (int) ns_out(conn, buf, len);
 }
 
+#ifdef NS_ENABLE_UDP_GSO
+/*
+ * Receive a datagram, or several coalesced ones from the same peer. In the
+ * latter case, `*seg_size` is the size of all but the last one.
+ */
+static int ns_udp_recv_gro(struct ns_connection *ls, char *buf, size_t len,
+                           union socket_address *sa, int *seg_size) {
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  int n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_name = &sa->sa;
+  msg.msg_namelen = sizeof(*sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if ((n = (int) recvmsg(ls->sock, &msg, 0)) > 0) {
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+        memcpy(seg_size, CMSG_DATA(cm), sizeof(*seg_size));
+      }
+    }
+  }
+
+  return n;
+}
+#endif
+
 static void ns_handle_udp(struct ns_connection *ls) {
   struct ns_connection nc;
-  char buf[NS_UDP_RECEIVE_BUFFER_SIZE];
-  int n;
+  char stack_buf[NS_UDP_RECEIVE_BUFFER_SIZE], *buf = stack_buf;
+  int n, len, seg_size = 0, off = 0;
   socklen_t s_len = sizeof(nc.sa);
 
   memset(&nc, 0, sizeof(nc));
-  n = recvfrom(ls->sock, buf, sizeof(buf), 0, &nc.sa.sa, &s_len);
+#ifdef NS_ENABLE_UDP_GSO
+  if (ls->udp_offload != NULL && ls->udp_offload->gro) {
+    buf = ls->udp_offload->gro_buf;
+    n = ns_udp_recv_gro(ls, buf, NS_UDP_GRO_BUFFER_SIZE, &nc.sa, &seg_size);
+  } else
+#endif
+    n = recvfrom(ls->sock, buf, NS_UDP_RECEIVE_BUFFER_SIZE, 0, &nc.sa.sa,
+                 &s_len);
   if (n <= 0) {
     DBG(("%p recvfrom: %s", ls, strerror(errno)));
+  } else if (!ns_ip_acl_check(ls->ip_acl, &nc.sa)) {
+    DBG(("%p %d bytes denied by ACL", ls, n));
   } else {
     union socket_address sa = nc.sa;
     /* Copy all attributes, preserving sender address */
@@ -879,14 +2902,17 @@ static void ns_handle_udp(struct ns_connection *ls) {
 
     /* Then override some */
     nc.sa = sa;
-    nc.recv_mbuf.buf = buf;
-    nc.recv_mbuf.len = nc.recv_mbuf.size = n;
     nc.listener = ls;
     nc.flags = NSF_UDP;
 
-    /* Call NS_RECV handler */
-    DBG(("%p %d bytes received", ls, n));
-    ns_call(&nc, NS_RECV, &n);
+    /* Call NS_RECV handler for each datagram */
+    DBG(("%p %d bytes received, %d per datagram", ls, n, seg_size));
+    for (; n > 0; n -= len, off += len) {
+      len = seg_size > 0 && n > seg_size ? seg_size : n;
+      nc.recv_mbuf.buf = buf + off;
+      nc.recv_mbuf.len = nc.recv_mbuf.size = len;
+      ns_call(&nc, NS_RECV, &len);
+    }
 
     /*
      * See https://github.com/cesanta/fossa/issues/207
@@ -904,6 +2930,8 @@ static void ns_mgr_handle_connection(struct ns_connection *nc, int fd_flags,
                                      time_t now) {
   DBG(("%p fd=%d fd_flags=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock,
        fd_flags, nc->flags, (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
+  /* A worker thread is using the connection, see ns_ssl_begin() */
+  if (nc->flags & NSF_SSL_BUSY) return;
   if (fd_flags != 0) nc->last_io_time = now;
 
   if (nc->flags & NSF_CONNECTING) {
@@ -923,6 +2951,11 @@ static void ns_mgr_handle_connection(struct ns_connection *nc, int fd_flags,
     return;
   }
 
+#ifdef NS_ENABLE_ZEROCOPY
+  /* Completions signal an error condition, see ns_set_zerocopy() */
+  if (ns_zerocopy_pending(nc)) ns_zerocopy_reap(nc);
+#endif
+
   if (fd_flags & _NSF_FD_CAN_READ) {
     if (nc->flags & NSF_UDP) {
       ns_handle_udp(nc);
@@ -945,6 +2978,24 @@ static void ns_mgr_handle_connection(struct ns_connection *nc, int fd_flags,
        (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
 }
 
+/*
+ * Check whether IO is paused until `*resume_time`, see `recv_resume_time`.
+ * If so, shorten the poll timeout `milli` to resume in time.
+ */
+static int ns_io_paused(double *resume_time, double now, int *milli) {
+  int ms;
+
+  if (*resume_time == 0) return 0;
+  if (now >= *resume_time) {
+    *resume_time = 0;
+    return 0;
+  }
+  ms = (int) ((*resume_time - now) * 1000) + 1;
+  if (*milli < 0 || ms < *milli) *milli = ms;
+
+  return 1;
+}
+
 static void ns_mgr_handle_ctl_sock(struct ns_mgr *mgr) {
   struct ctl_msg ctl_msg;
   int len =
@@ -979,11 +3030,13 @@ static void ns_ev_mgr_epoll_set_flags(const struct ns_connection *nc,
                                       struct epoll_event *ev) {
   /* NOTE: EPOLLERR and EPOLLHUP are always enabled. */
   ev->events = 0;
-  if (nc->recv_mbuf.len < nc->recv_mbuf_limit) {
+  if (nc->flags & NSF_SSL_BUSY) return;
+  if (!ns_recv_full(nc) && nc->recv_resume_time == 0) {
     ev->events |= EPOLLIN;
   }
   if ((nc->flags & NSF_CONNECTING) ||
-      (nc->send_mbuf.len > 0 && !(nc->flags & NSF_DONT_SEND))) {
+      (ns_send_pending(nc) && !(nc->flags & NSF_DONT_SEND) &&
+       nc->send_resume_time == 0)) {
     ev->events |= EPOLLOUT;
   }
 }
@@ -1004,6 +3057,13 @@ static void ns_ev_mgr_epoll_ctl(struct ns_connection *nc, int op) {
     perror("epoll_ctl");
     abort();
   }
+  if (op != EPOLL_CTL_DEL) {
+    /* Remember the interest set, so that unchanged ones are skipped */
+    intptr_t epf = (intptr_t) nc->mgr_data & _NS_EPF_NO_POLL;
+    if (ev.events & EPOLLIN) epf |= _NS_EPF_EV_EPOLLIN;
+    if (ev.events & EPOLLOUT) epf |= _NS_EPF_EV_EPOLLOUT;
+    nc->mgr_data = (void *) epf;
+  }
 }
 
 static void ns_ev_mgr_init(struct ns_mgr *mgr) {
@@ -1045,6 +3105,28 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int timeout_ms) {
   struct ns_connection *nc, *next;
   int num_ev, fd_flags;
   time_t now;
+  double t = ns_time();
+
+  ns_close_inherited(mgr);
+  for (nc = mgr->active_connections; nc != NULL; nc = nc->next) {
+    /* Datagrams sent since the last poll */
+    ns_udp_flush(nc);
+    /* Resume paused connections that are due */
+    if ((nc->recv_resume_time != 0 &&
+         !ns_io_paused(&nc->recv_resume_time, t, &timeout_ms)) |
+        (nc->send_resume_time != 0 &&
+         !ns_io_paused(&nc->send_resume_time, t, &timeout_ms))) {
+      ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
+    }
+    /*
+     * Connections that ran out of read budget go on without waiting, unless
+     * they can't be read anyway: see the read below
+     */
+    if ((nc->flags & NSF_READ_PENDING) && !(nc->flags & NSF_SSL_BUSY) &&
+        nc->recv_resume_time == 0 && !ns_recv_full(nc)) {
+      timeout_ms = 0;
+    }
+  }
 
   num_ev = epoll_wait(epoll_fd, events, NS_EPOLL_MAX_EVENTS, timeout_ms);
   now = time(NULL);
@@ -1070,14 +3152,21 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int timeout_ms) {
   for (nc = mgr->active_connections; nc != NULL; nc = next) {
     next = nc->next;
     if (!(((intptr_t) nc->mgr_data) & _NS_EPF_NO_POLL)) {
-      ns_mgr_handle_connection(nc, 0, now);
+      fd_flags = (nc->flags & NSF_READ_PENDING) && nc->recv_resume_time == 0 &&
+                         !ns_recv_full(nc)
+                     ? _NSF_FD_CAN_READ
+                     : 0;
+      ns_mgr_handle_connection(nc, fd_flags, now);
     } else {
       intptr_t epf = (intptr_t) nc->mgr_data;
       epf ^= _NS_EPF_NO_POLL;
       nc->mgr_data = (void *) epf;
     }
-    if ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & NSF_SEND_AND_CLOSE))) {
+    ns_udp_flush(nc);
+    if (!(nc->flags & NSF_SSL_BUSY) &&
+        ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
+         (!ns_send_pending(nc) && !ns_zerocopy_pending(nc) &&
+          (nc->flags & NSF_SEND_AND_CLOSE)))) {
       ns_close_conn(nc);
     } else {
       ns_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
@@ -1121,8 +3210,10 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
   struct timeval tv;
   fd_set read_set, write_set, err_set;
   sock_t max_fd = INVALID_SOCKET;
-  int num_selected;
+  int num_selected, read_pending = 0;
+  double t = ns_time();
 
+  ns_close_inherited(mgr);
   FD_ZERO(&read_set);
   FD_ZERO(&write_set);
   FD_ZERO(&err_set);
@@ -1130,20 +3221,27 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
 
   for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
     tmp = nc->next;
+    /* Datagrams sent since the last poll */
+    ns_udp_flush(nc);
+    if (nc->flags & NSF_SSL_BUSY) continue;
 
-    if (!(nc->flags & NSF_WANT_WRITE) &&
-        nc->recv_mbuf.len < nc->recv_mbuf_limit) {
+    if (!(nc->flags & NSF_WANT_WRITE) && !ns_recv_full(nc) &&
+        !ns_io_paused(&nc->recv_resume_time, t, &milli)) {
       ns_add_to_set(nc->sock, &read_set, &max_fd);
+      if (nc->flags & NSF_READ_PENDING) read_pending = 1;
     }
 
     if (((nc->flags & NSF_CONNECTING) && !(nc->flags & NSF_WANT_READ)) ||
-        (nc->send_mbuf.len > 0 && !(nc->flags & NSF_CONNECTING) &&
-         !(nc->flags & NSF_DONT_SEND))) {
+        (ns_send_pending(nc) && !(nc->flags & NSF_CONNECTING) &&
+         !(nc->flags & NSF_DONT_SEND) &&
+         !ns_io_paused(&nc->send_resume_time, t, &milli))) {
       ns_add_to_set(nc->sock, &write_set, &max_fd);
       ns_add_to_set(nc->sock, &err_set, &max_fd);
     }
   }
 
+  /* Connections that ran out of read budget go on without waiting */
+  if (read_pending) milli = 0;
   tv.tv_sec = milli / 1000;
   tv.tv_usec = (milli % 1000) * 1000;
 
@@ -1163,6 +3261,10 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
                  (FD_ISSET(nc->sock, &write_set) ? _NSF_FD_CAN_WRITE : 0) |
                  (FD_ISSET(nc->sock, &err_set) ? _NSF_FD_ERROR : 0);
     }
+    if ((nc->flags & NSF_READ_PENDING) && nc->recv_resume_time == 0 &&
+        !ns_recv_full(nc)) {
+      fd_flags |= _NSF_FD_CAN_READ;
+    }
 #ifdef NS_CC3200
     // CC3200 does not report UDP sockets as writeable.
     if (nc->flags & NSF_UDP &&
@@ -1176,8 +3278,11 @@ time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
 
   for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
     tmp = nc->next;
-    if ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & NSF_SEND_AND_CLOSE))) {
+    ns_udp_flush(nc);
+    if (!(nc->flags & NSF_SSL_BUSY) &&
+        ((nc->flags & NSF_CLOSE_IMMEDIATELY) ||
+         (!ns_send_pending(nc) && !ns_zerocopy_pending(nc) &&
+          (nc->flags & NSF_SEND_AND_CLOSE)))) {
       ns_close_conn(nc);
     }
   }
@@ -1203,7 +3308,7 @@ NS_INTERNAL struct ns_connection *ns_finish_connect(struct ns_connection *nc,
   DBG(("%p %s://%s:%hu", nc, proto == SOCK_DGRAM ? "udp" : "tcp",
        inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
 
-  if ((sock = socket(AF_INET, proto, 0)) == INVALID_SOCKET) {
+  if ((sock = socket(sa->sa.sa_family, proto, 0)) == INVALID_SOCKET) {
     int failure = errno;
     NS_SET_PTRPTR(o.error_string, "cannot create socket");
     if (nc->flags & NSF_CONNECTING) {
@@ -1216,7 +3321,25 @@ NS_INTERNAL struct ns_connection *ns_finish_connect(struct ns_connection *nc,
 #ifndef NS_CC3200
   ns_set_non_blocking_mode(sock);
 #endif
-  rc = (proto == SOCK_DGRAM) ? 0 : connect(sock, &sa->sa, sizeof(sa->sin));
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(__linux__)
+  if (proto == SOCK_DGRAM && sa->sa.sa_family == AF_UNIX) {
+    /* Autobind to an abstract name, otherwise the peer can't reply */
+    union socket_address self;
+    memset(&self, 0, sizeof(self));
+    self.sa.sa_family = AF_UNIX;
+    (void) bind(sock, &self.sa, sizeof(self.un.sun_family));
+  }
+#endif
+  if (proto == SOCK_STREAM) {
+    ns_set_tcp_defaults(sock, sa);
+#ifdef TCP_FASTOPEN_CONNECT
+    /* connect() returns at once, the first write sends the SYN */
+    if ((nc->flags & NSF_TCP_FASTOPEN) && ns_is_inet(sa)) {
+      (void) ns_set_tcp_opt(sock, TCP_FASTOPEN_CONNECT, 1);
+    }
+#endif
+  }
+  rc = (proto == SOCK_DGRAM) ? 0 : connect(sock, &sa->sa, ns_sa_len(sa));
 
   if (rc != 0 && ns_is_error(rc)) {
     NS_SET_PTRPTR(o.error_string, "cannot connect to socket");
@@ -1233,6 +3356,9 @@ NS_INTERNAL struct ns_connection *ns_finish_connect(struct ns_connection *nc,
 
   /* No ns_destroy_conn() call after this! */
   ns_set_sock(nc, sock);
+#ifdef NS_ENABLE_UDP_GSO
+  if (proto == SOCK_DGRAM) ns_udp_offload_init(nc);
+#endif
 
 #ifdef NS_ENABLE_SSL
   /*
@@ -1363,7 +3489,8 @@ struct ns_connection *ns_bind_opt(struct ns_mgr *mgr, const char *address,
 
   if (ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0) {
     NS_SET_PTRPTR(opts.error_string, "cannot parse address");
-  } else if ((sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
+  } else if ((sock = ns_take_inherited(mgr, &sa, proto)) == INVALID_SOCKET &&
+             (sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
     DBG(("Failed to open listener: %d", errno));
     NS_SET_PTRPTR(opts.error_string, "failed to open listener");
   } else if ((nc = ns_add_sock_opt(mgr, sock, callback, add_sock_opts)) ==
@@ -1377,8 +3504,16 @@ struct ns_connection *ns_bind_opt(struct ns_mgr *mgr, const char *address,
 
     if (proto == SOCK_DGRAM) {
       nc->flags |= NSF_UDP;
+#ifdef NS_ENABLE_UDP_GSO
+      ns_udp_offload_init(nc);
+#endif
     } else {
       nc->flags |= NSF_LISTENING;
+#if defined(TCP_FASTOPEN) && !defined(_WIN32)
+      if ((nc->flags & NSF_TCP_FASTOPEN) && ns_is_inet(&sa)) {
+        (void) ns_set_tcp_opt(sock, TCP_FASTOPEN, NS_TCP_FASTOPEN_QUEUE);
+      }
+#endif
     }
 
     DBG(("%p sock %d/%d", nc, sock, proto));
@@ -1387,6 +3522,213 @@ struct ns_connection *ns_bind_opt(struct ns_mgr *mgr, const char *address,
   return nc;
 }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+/*
+ * Hot restart protocol. The new process connects to the control listener
+ * and receives a 1-byte message with the number of listening sockets,
+ * carrying the sockets themselves as SCM_RIGHTS. It replies with a 1-byte
+ * acknowledgement, and only then the old process closes its listeners.
+ */
+#define NS_HANDOFF_ACK 'A'
+
+static void ns_handoff_send(struct ns_connection *nc) {
+  struct ns_connection *c;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * NS_HANDOFF_MAX_SOCKETS)];
+  } ctl;
+  int fds[NS_HANDOFF_MAX_SOCKETS];
+  unsigned char n = 0;
+
+  for (c = nc->mgr->active_connections; c != NULL; c = c->next) {
+    /* Only these are closed on acknowledgement, the rest keep serving */
+    c->flags &= ~NSF_HANDED_OFF;
+    if ((c->flags & NSF_LISTENING) && n < NS_HANDOFF_MAX_SOCKETS) {
+      fds[n++] = c->sock;
+      c->flags |= NSF_HANDED_OFF;
+    }
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (char *) &n;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+  }
+
+  if (sendmsg(nc->sock, &msg, 0) != 1) {
+    DBG(("%p sendmsg: %s", nc, strerror(errno)));
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void ns_hot_restart_handler(struct ns_connection *nc, int ev,
+                                   void *ev_data) {
+  struct ns_connection *c;
+  struct ns_peer_cred cred;
+  int n = 0;
+
+  (void) ev_data;
+  if (ev == NS_ACCEPT) {
+    /* Abstract names have no file permissions: check who is asking */
+    if (ns_get_peer_cred(nc, &cred) != 0 || cred.uid != (int) geteuid()) {
+      DBG(("%p handoff refused", nc));
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      return;
+    }
+    ns_handoff_send(nc);
+  } else if (ev == NS_RECV && nc->recv_mbuf.buf[0] == NS_HANDOFF_ACK) {
+    /* The new process has the sockets: stop accepting */
+    for (c = nc->mgr->active_connections; c != NULL; c = c->next) {
+      if (c->flags & NSF_HANDED_OFF) {
+        c->flags |= NSF_CLOSE_IMMEDIATELY;
+        n++;
+      }
+    }
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    if (nc->handler != NULL) nc->handler(nc, NS_HANDOFF, &n);
+  } else if (ev == NS_RECV) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+struct ns_connection *ns_hot_restart_listen(struct ns_mgr *mgr,
+                                            const char *address,
+                                            ns_event_handler_t handler) {
+  struct ns_connection *nc;
+
+  if (strncmp(address, "unix://", 7) != 0) return NULL;
+  if ((nc = ns_bind(mgr, address, handler)) != NULL) {
+    nc->proto_handler = ns_hot_restart_handler;
+  }
+  return nc;
+}
+
+int ns_hot_restart_takeover(struct ns_mgr *mgr, const char *address) {
+  union socket_address sa;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * NS_HANDOFF_MAX_SOCKETS)];
+  } ctl;
+  struct timeval tv;
+  char host[NS_MAX_HOST_LEN], ack = NS_HANDOFF_ACK;
+  unsigned char count;
+  sock_t sock, *p;
+  int proto, i, n = -1, fd;
+
+  if (strncmp(address, "unix://", 7) != 0 ||
+      ns_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0 ||
+      (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+    return -1;
+  }
+  if (connect(sock, &sa.sa, ns_sa_len(&sa)) != 0) {
+    /* Nobody to take over from, it's a cold start */
+    closesocket(sock);
+    return 0;
+  }
+
+  tv.tv_sec = NS_HANDOFF_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (char *) &count;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  if (recvmsg(sock, &msg, 0) == 1) {
+    n = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      p = (sock_t *) NS_REALLOC(mgr->inherited,
+                                (mgr->num_inherited + n) * sizeof(*p));
+      for (i = 0; i < n; i++) {
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+        if (p == NULL) {
+          closesocket(fd);
+        } else {
+          ns_set_close_on_exec(fd);
+          p[mgr->num_inherited++] = fd;
+        }
+      }
+      if (p == NULL) {
+        n = -1;
+      } else {
+        mgr->inherited = p;
+      }
+    }
+    if (n != count || (msg.msg_flags & MSG_CTRUNC)) {
+      /* Keep whatever arrived, but let the old process keep serving */
+      n = -1;
+    } else if (send(sock, &ack, 1, 0) != 1) {
+      n = -1;
+    }
+  }
+  closesocket(sock);
+
+  DBG(("%p took over %d sockets from %s", mgr, n, address));
+  return n;
+}
+#endif
+
+int ns_get_peer_cred(struct ns_connection *nc, struct ns_peer_cred *cred) {
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(SO_PEERCRED)
+  /* Same layout as struct ucred, which glibc hides without _GNU_SOURCE */
+  struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+  } uc;
+  socklen_t len = sizeof(uc);
+
+  if (nc->sa.sa.sa_family != AF_UNIX ||
+      getsockopt(nc->sock, SOL_SOCKET, SO_PEERCRED, &uc, &len) != 0) {
+    return -1;
+  }
+  cred->pid = (int) uc.pid;
+  cred->uid = (int) uc.uid;
+  cred->gid = (int) uc.gid;
+  return 0;
+#elif defined(NS_ENABLE_UNIX_SOCKETS) &&                    \
+    (defined(__APPLE__) || defined(__FreeBSD__) || \
+     defined(__OpenBSD__) || defined(__NetBSD__))
+  uid_t uid;
+  gid_t gid;
+
+  if (nc->sa.sa.sa_family != AF_UNIX || getpeereid(nc->sock, &uid, &gid) != 0) {
+    return -1;
+  }
+  cred->pid = -1;
+  cred->uid = (int) uid;
+  cred->gid = (int) gid;
+  return 0;
+#else
+  (void) nc;
+  (void) cred;
+  return -1;
+#endif
+}
+
 struct ns_connection *ns_add_sock(struct ns_mgr *s, sock_t sock,
                                   ns_event_handler_t callback) {
   static struct ns_add_sock_opts opts;
@@ -1471,6 +3813,383 @@ int ns_check_ip_acl(const char *acl, uint32_t remote_ip) {
   return allowed == '+';
 }
 
+/*
+ * Compiled ACL: a binary trie per address family, indexed by address bits.
+ * A node at depth N stands for an N-bit prefix and holds the last rule for
+ * that prefix. A lookup walks the address bits once, and the latest rule met
+ * on the way wins, as in ns_check_ip_acl().
+ */
+struct ns_ip_acl_node {
+  int child[2]; /* Indices in ns_ip_acl::nodes, 0 if none */
+  int rule;     /* 1 + index of the rule in the ACL string, 0 if none */
+  int allow;
+};
+
+struct ns_ip_acl {
+  struct ns_ip_acl_node *nodes; /* nodes[0] is the IPv4 root, [1] IPv6 */
+  int num_nodes;
+  int size;
+  int num_rules; /* 0 allows everything */
+};
+
+static int ns_ip_acl_insert(struct ns_ip_acl *acl, int root,
+                            const unsigned char *addr, int prefix_len,
+                            int allow, int rule) {
+  struct ns_ip_acl_node *nodes;
+  int i, bit, n = root;
+
+  for (i = 0; i < prefix_len; i++) {
+    bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+    if (acl->nodes[n].child[bit] == 0) {
+      if (acl->num_nodes == acl->size) {
+        nodes = (struct ns_ip_acl_node *) NS_REALLOC(
+            acl->nodes, acl->size * 2 * sizeof(*nodes));
+        if (nodes == NULL) return -1;
+        acl->nodes = nodes;
+        acl->size *= 2;
+      }
+      memset(&acl->nodes[acl->num_nodes], 0, sizeof(*nodes));
+      acl->nodes[n].child[bit] = acl->num_nodes++;
+    }
+    n = acl->nodes[n].child[bit];
+  }
+  acl->nodes[n].rule = rule;
+  acl->nodes[n].allow = allow;
+
+  return 0;
+}
+
+/* Parse `x.x.x.x[/n]` or, with IPv6 support, `x:x::x[/n]` */
+static int ns_ip_acl_parse(const struct ns_str *spec, unsigned char *addr,
+                           int *prefix_len) {
+  uint32_t net, mask;
+  char buf[60], *slash;
+  int n;
+
+  if (spec->len >= sizeof(buf)) return -1;
+  memcpy(buf, spec->p, spec->len);
+  buf[spec->len] = '\0';
+
+  if ((n = parse_net(buf, &net, &mask)) == (int) spec->len) {
+    for (*prefix_len = 0; *prefix_len < 32 && (mask & 0x80000000U);
+         mask <<= 1) {
+      (*prefix_len)++;
+    }
+    net = htonl(net);
+    memcpy(addr, &net, sizeof(net));
+    return AF_INET;
+  }
+#ifdef NS_ENABLE_IPV6
+  *prefix_len = 128;
+  if ((slash = strchr(buf, '/')) != NULL) {
+    *slash++ = '\0';
+    if (sscanf(slash, "%d%n", prefix_len, &n) != 1 || slash[n] != '\0' ||
+        *prefix_len < 0 || *prefix_len > 128) {
+      return -1;
+    }
+  }
+  if (inet_pton(AF_INET6, buf, addr) == 1) {
+    return AF_INET6;
+  }
+#else
+  (void) slash;
+#endif
+
+  return -1;
+}
+
+struct ns_ip_acl *ns_ip_acl_compile(const char *spec) {
+  struct ns_ip_acl *acl;
+  unsigned char addr[16];
+  int family, prefix_len, rule = 0;
+  struct ns_str vec, net;
+
+  if ((acl = (struct ns_ip_acl *) NS_CALLOC(1, sizeof(*acl))) == NULL ||
+      (acl->nodes = (struct ns_ip_acl_node *) NS_CALLOC(
+           16, sizeof(*acl->nodes))) == NULL) {
+    NS_FREE(acl);
+    return NULL;
+  }
+  acl->size = 16;
+  acl->num_nodes = 2;
+
+  while (spec != NULL &&
+         (spec = ns_next_comma_list_entry(spec, &vec, NULL)) != NULL) {
+    net.p = vec.p + 1;
+    net.len = vec.len - 1;
+    if ((vec.p[0] != '+' && vec.p[0] != '-') ||
+        (family = ns_ip_acl_parse(&net, addr, &prefix_len)) < 0 ||
+        ns_ip_acl_insert(acl, family == AF_INET ? 0 : 1, addr, prefix_len,
+                         vec.p[0] == '+', ++rule) != 0) {
+      ns_ip_acl_free(acl);
+      return NULL;
+    }
+  }
+  /* /0 rules add no nodes, so count rules rather than nodes */
+  acl->num_rules = rule;
+
+  return acl;
+}
+
+void ns_ip_acl_free(struct ns_ip_acl *acl) {
+  if (acl != NULL) {
+    NS_FREE(acl->nodes);
+    NS_FREE(acl);
+  }
+}
+
+static int ns_ip_acl_lookup(const struct ns_ip_acl *acl, int n,
+                            const unsigned char *addr, int bits) {
+  int i, rule = 0, allow = 0;
+
+  for (i = 0;; i++) {
+    if (acl->nodes[n].rule > rule) {
+      rule = acl->nodes[n].rule;
+      allow = acl->nodes[n].allow;
+    }
+    if (i == bits ||
+        (n = acl->nodes[n].child[(addr[i / 8] >> (7 - i % 8)) & 1]) == 0) {
+      break;
+    }
+  }
+
+  /* An empty ACL allows everything, otherwise deny by default */
+  return rule > 0 ? allow : acl->num_rules == 0;
+}
+
+int ns_ip_acl_check(const struct ns_ip_acl *acl,
+                    const union socket_address *sa) {
+  const unsigned char *addr;
+
+  if (acl == NULL) return 1;
+  if (sa->sa.sa_family == AF_INET) {
+    return ns_ip_acl_lookup(acl, 0, (const unsigned char *) &sa->sin.sin_addr,
+                            32);
+  }
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) {
+    addr = (const unsigned char *) &sa->sin6.sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&sa->sin6.sin6_addr)) {
+      /* IPv4 client on a dual-stack socket */
+      return ns_ip_acl_lookup(acl, 0, addr + 12, 32);
+    }
+    return ns_ip_acl_lookup(acl, 1, addr, 128);
+  }
+#endif
+  (void) addr;
+
+  /* Not an IP peer: only an empty ACL lets it in */
+  return acl->num_rules == 0;
+}
+
+int ns_set_ip_acl(struct ns_connection *nc, const char *spec) {
+  struct ns_ip_acl *acl = NULL;
+
+  if (spec != NULL && *spec != '\0' &&
+      (acl = ns_ip_acl_compile(spec)) == NULL) {
+    return -1;
+  }
+  /* Swap in one step, a bad ACL leaves the old one in place */
+  ns_ip_acl_free(nc->ip_acl);
+  nc->ip_acl = acl;
+
+  return 0;
+}
+
+struct ns_rate_limit *ns_rate_limit_create(struct ns_rate_limit_opts opts) {
+  struct ns_rate_limit *rl;
+  int i;
+
+  if (opts.rate <= 0) return NULL;
+  if (opts.burst < 1) opts.burst = 1;
+  if (opts.max_clients <= 0) opts.max_clients = NS_RATE_LIMIT_DEFAULT_CLIENTS;
+  if (opts.action == 0) opts.action = NS_RATE_LIMIT_REJECT;
+
+  if ((rl = (struct ns_rate_limit *) NS_CALLOC(1, sizeof(*rl))) == NULL) {
+    return NULL;
+  }
+  rl->opts = opts;
+  rl->refs = 1;
+  rl->lru_head = rl->lru_tail = -1;
+  /* At least two chains per bucket keeps chains short */
+  for (rl->mask = 1; rl->mask < (uint32_t) opts.max_clients * 2;) {
+    rl->mask <<= 1;
+  }
+  rl->buckets = (struct ns_rate_limit_bucket *) NS_MALLOC(
+      opts.max_clients * sizeof(*rl->buckets));
+  rl->chains = (int *) NS_MALLOC(rl->mask * sizeof(*rl->chains));
+  if (rl->buckets == NULL || rl->chains == NULL) {
+    ns_rate_limit_free(rl);
+    return NULL;
+  }
+  for (i = 0; i < (int) rl->mask; i++) rl->chains[i] = -1;
+  rl->mask--;
+
+  return rl;
+}
+
+void ns_rate_limit_free(struct ns_rate_limit *rl) {
+  if (rl != NULL && --rl->refs == 0) {
+    NS_FREE(rl->buckets);
+    NS_FREE(rl->chains);
+    NS_FREE(rl);
+  }
+}
+
+static void ns_rate_limit_lru_unlink(struct ns_rate_limit *rl, int i) {
+  struct ns_rate_limit_bucket *b = &rl->buckets[i];
+
+  if (b->lru_prev >= 0) {
+    rl->buckets[b->lru_prev].lru_next = b->lru_next;
+  } else {
+    rl->lru_head = b->lru_next;
+  }
+  if (b->lru_next >= 0) {
+    rl->buckets[b->lru_next].lru_prev = b->lru_prev;
+  } else {
+    rl->lru_tail = b->lru_prev;
+  }
+}
+
+static void ns_rate_limit_lru_push(struct ns_rate_limit *rl, int i) {
+  struct ns_rate_limit_bucket *b = &rl->buckets[i];
+
+  b->lru_prev = -1;
+  b->lru_next = rl->lru_head;
+  if (rl->lru_head >= 0) rl->buckets[rl->lru_head].lru_prev = i;
+  rl->lru_head = i;
+  if (rl->lru_tail < 0) rl->lru_tail = i;
+}
+
+/* Find the bucket of a key, taking over the least recently used if new */
+static struct ns_rate_limit_bucket *ns_rate_limit_bucket(
+    struct ns_rate_limit *rl, const void *key, size_t key_len, double now) {
+  const unsigned char *p = (const unsigned char *) key;
+  size_t n =
+      key_len < NS_RATE_LIMIT_KEY_SIZE ? key_len : NS_RATE_LIMIT_KEY_SIZE;
+  uint32_t hash = 2166136261U; /* FNV-1a */
+  struct ns_rate_limit_bucket *b;
+  int i, *link;
+
+  for (i = 0; i < (int) key_len; i++) hash = (hash ^ p[i]) * 16777619U;
+
+  for (i = rl->chains[hash & rl->mask]; i >= 0; i = b->next) {
+    b = &rl->buckets[i];
+    if (b->hash == hash && b->key_len == key_len &&
+        memcmp(b->key, key, n) == 0) {
+      if (i != rl->lru_head) {
+        ns_rate_limit_lru_unlink(rl, i);
+        ns_rate_limit_lru_push(rl, i);
+      }
+      return b;
+    }
+  }
+
+  if (rl->stats.num_clients < rl->opts.max_clients) {
+    i = rl->stats.num_clients++;
+  } else {
+    i = rl->lru_tail;
+    b = &rl->buckets[i];
+    for (link = &rl->chains[b->hash & rl->mask]; *link != i;
+         link = &rl->buckets[*link].next) {
+    }
+    *link = b->next;
+    ns_rate_limit_lru_unlink(rl, i);
+    rl->stats.evicted++;
+  }
+
+  b = &rl->buckets[i];
+  b->tokens = rl->opts.burst;
+  b->last = now;
+  b->hash = hash;
+  b->key_len = key_len;
+  memcpy(b->key, key, n);
+  b->next = rl->chains[hash & rl->mask];
+  rl->chains[hash & rl->mask] = i;
+  ns_rate_limit_lru_push(rl, i);
+
+  return b;
+}
+
+double ns_rate_limit_take(struct ns_rate_limit *rl, const void *key,
+                          size_t key_len, double now) {
+  struct ns_rate_limit_bucket *b;
+
+  if (rl == NULL) return 0;
+  b = ns_rate_limit_bucket(rl, key, key_len, now);
+  if (now > b->last) {
+    b->tokens += (now - b->last) * rl->opts.rate;
+    if (b->tokens > rl->opts.burst) b->tokens = rl->opts.burst;
+    b->last = now;
+  }
+  if (b->tokens >= 1) {
+    b->tokens -= 1;
+    rl->stats.allowed++;
+    return 0;
+  }
+  rl->stats.limited++;
+
+  return (1 - b->tokens) / rl->opts.rate;
+}
+
+double ns_rate_limit_take_addr(struct ns_rate_limit *rl,
+                               const union socket_address *sa, double now) {
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) {
+    const unsigned char *a = sa->sin6.sin6_addr.s6_addr;
+    /* IPv4-mapped addresses share the bucket of the IPv4 address */
+    if (IN6_IS_ADDR_V4MAPPED(&sa->sin6.sin6_addr)) {
+      return ns_rate_limit_take(rl, a + 12, 4, now);
+    }
+    return ns_rate_limit_take(rl, a, 16, now);
+  }
+#endif
+  if (sa->sa.sa_family == AF_INET) {
+    return ns_rate_limit_take(rl, &sa->sin.sin_addr, 4, now);
+  }
+  return ns_rate_limit_take(rl, "", 0, now);
+}
+
+void ns_rate_limit_get_stats(const struct ns_rate_limit *rl,
+                             struct ns_rate_limit_stats *stats) {
+  *stats = rl->stats;
+}
+
+void ns_set_rate_limit(struct ns_connection *nc, int which,
+                       struct ns_rate_limit *rl) {
+  if (rl != NULL) rl->refs++;
+  ns_rate_limit_free(nc->rate_limit[which]);
+  nc->rate_limit[which] = rl;
+}
+
+int ns_rate_limit_message(struct ns_connection *nc, void *msg,
+                          double *retry_after) {
+  struct ns_rate_limit *rl = nc->rate_limit[NS_RATE_LIMIT_MESSAGES];
+  struct ns_str key;
+  double now;
+
+  *retry_after = 0;
+  if (rl == NULL) return 0;
+
+  now = ns_time();
+  if (rl->opts.get_key != NULL && rl->opts.get_key(nc, msg, &key)) {
+    *retry_after = ns_rate_limit_take(rl, key.p, key.len, now);
+  } else {
+    *retry_after = ns_rate_limit_take_addr(rl, &nc->sa, now);
+  }
+  if (*retry_after <= 0) return 0;
+
+  DBG(("%p rate limited for %g s", nc, *retry_after));
+  if (rl->opts.action == NS_RATE_LIMIT_CLOSE) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (rl->opts.action == NS_RATE_LIMIT_DELAY) {
+    nc->flags |= NSF_RATE_LIMITED;
+    nc->recv_resume_time = now + *retry_after;
+  }
+
+  return rl->opts.action;
+}
+
 /* Move data from one connection to another */
 void ns_forward(struct ns_connection *from, struct ns_connection *to) {
   ns_send(to, from->recv_mbuf.buf, from->recv_mbuf.len);
@@ -53,6 +53,29 @@ typedef void *SSL_CTX;
 extern "C" {
 #endif /* __cplusplus */
 
+#if !defined(NS_DISABLE_UNIX_SOCKETS) && !defined(_WIN32) && \
+    !defined(NS_CC3200) && !defined(NS_ESP8266) && !defined(PICOTCP)
+#define NS_ENABLE_UNIX_SOCKETS
+#include <sys/un.h>
+#endif
+
+#if !defined(NS_DISABLE_FILESYSTEM) && !defined(_WIN32) && \
+    !defined(NS_CC3200) && !defined(NS_ESP8266) && !defined(PICOTCP)
+#define NS_ENABLE_SEND_FILE
+#endif
+
+#if !defined(NS_DISABLE_SPLICE) && defined(__linux__)
+#define NS_ENABLE_SPLICE
+#endif
+
+#if !defined(NS_DISABLE_ZEROCOPY) && defined(__linux__)
+#define NS_ENABLE_ZEROCOPY
+#endif
+
+#if !defined(NS_DISABLE_UDP_GSO) && defined(__linux__)
+#define NS_ENABLE_UDP_GSO
+#endif
+
 union socket_address {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -61,6 +84,9 @@ union socket_address {
 #else
   struct sockaddr sin6;
 #endif
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  struct sockaddr_un un;
+#endif
 };
 
 /* Describes chunk of memory */
@@ -86,6 +112,7 @@ typedef void (*ns_event_handler_t)(struct ns_connection *, int ev, void *);
 #define NS_RECV 3    /* Data has benn received. int *num_bytes */
 #define NS_SEND 4    /* Data has been written to a socket. int *num_bytes */
 #define NS_CLOSE 5   /* Connection is closed. NULL */
+#define NS_HANDOFF 6 /* Listeners went to a new process. int *num_sockets */
 
 /*
  * Fossa event manager.
@@ -96,6 +123,11 @@ struct ns_mgr {
   sock_t ctl[2];            /* Socketpair for mg_wakeup() */
   void *user_data;          /* User data */
   void *mgr_data;           /* Implementation-specific event manager's data. */
+  sock_t *inherited;        /* Sockets from ns_hot_restart_takeover() */
+  int num_inherited;
+  struct ns_ssl_client_cache *ssl_clients; /* See ns_set_ssl() */
+  struct ns_workers *ssl_workers;  /* See ns_ssl_offload_handshakes() */
+  struct ns_workers *file_workers; /* See ns_offload_file_io() */
 };
 
 /*
@@ -109,6 +141,7 @@ struct ns_connection {
   sock_t sock;             /* Socket to the remote peer */
   union socket_address sa; /* Remote peer address */
   size_t recv_mbuf_limit;  /* Max size of recv buffer */
+  size_t recv_budget;      /* Max bytes read per poll, 0 for no limit */
   struct mbuf recv_mbuf;   /* Received data */
   struct mbuf send_mbuf;   /* Data scheduled for sending */
   SSL *ssl;
@@ -121,6 +154,17 @@ struct ns_connection {
   void *priv_1;                     /* Used by ns_enable_multithreading() */
   void *priv_2;                     /* Used by ns_enable_multithreading() */
   void *mgr_data; /* Implementation-specific event manager's data. */
+  struct ns_ip_acl *ip_acl; /* Listeners: see ns_set_ip_acl() */
+  struct ns_rate_limit *rate_limit[2]; /* See ns_set_rate_limit() */
+  double recv_resume_time; /* If not 0, don't read before this ns_time() */
+  double send_resume_time; /* If not 0, don't write before this ns_time() */
+  struct ns_bandwidth *bandwidth; /* See ns_set_bandwidth() */
+  struct ns_send_file *send_file; /* See ns_send_file() */
+  struct ns_splice *splice;       /* See ns_splice() */
+  struct ns_zerocopy *zerocopy;   /* See ns_set_zerocopy() */
+  struct ns_udp_offload *udp_offload; /* UDP GSO and GRO, see ns_send() */
+  size_t ssl_sent;       /* SSL bytes sent since idle, picks the record size */
+  double ssl_send_time;  /* ns_time() of the last SSL write */
 
   unsigned long flags;
 /* Flags set by Fossa */
@@ -132,6 +176,10 @@ struct ns_connection {
 #define NSF_WANT_READ (1 << 5)          /* SSL specific */
 #define NSF_WANT_WRITE (1 << 6)         /* SSL specific */
 #define NSF_IS_WEBSOCKET (1 << 7)       /* Websocket specific */
+#define NSF_RATE_LIMITED (1 << 8)       /* A message is delayed, see below */
+#define NSF_READ_PENDING (1 << 9)       /* Out of recv_budget, more to read */
+#define NSF_SSL_BUSY (1 << 15)          /* Handshake step in a worker thread */
+#define NSF_HANDED_OFF (1 << 17)        /* Sent by ns_hot_restart_listen() */
 
 /* Flags that are settable by user */
 #define NSF_SEND_AND_CLOSE (1 << 10)      /* Push remaining data and close  */
@@ -139,6 +187,7 @@ struct ns_connection {
 #define NSF_CLOSE_IMMEDIATELY (1 << 12)   /* Disconnect */
 #define NSF_WEBSOCKET_NO_DEFRAG (1 << 13) /* Websocket specific */
 #define NSF_DELETE_CHUNK (1 << 14)        /* HTTP specific */
+#define NSF_TCP_FASTOPEN (1 << 16)        /* ns_bind_opt(), ns_connect_opt() */
 
 #define NSF_USER_1 (1 << 20) /* Flags left for application */
 #define NSF_USER_2 (1 << 21)
@@ -263,8 +312,20 @@ struct ns_connection *ns_bind(struct ns_mgr *, const char *,
  * e.g. `udp://:8000`. To summarize, `address` paramer has following format:
  * `[PROTO://][IP_ADDRESS]:PORT`, where `PROTO` could be `tcp` or `udp`.
  *
+ * Unix domain sockets are addressed by path instead, e.g.
+ * `unix:///var/run/app.sock` for a stream socket or
+ * `unixgram:///var/run/app.sock` for a datagram socket. A socket file left
+ * behind by a process that's gone is removed first, but a live one is not.
+ * The file isn't removed when the listener is closed. On Linux, a name
+ * starting with `@` is in the abstract namespace, e.g. `unix://@app`, and
+ * needs no file at all.
+ *
  * See the `ns_bind_opts` structure for a description of the optional
- * parameters.
+ * parameters. With `NSF_TCP_FASTOPEN` in `flags`, a TCP listener accepts
+ * TCP Fast Open, where supported: the first data of a client that
+ * connected before arrives with its SYN packet. That data may be
+ * replayed, so it should be idempotent. On Linux, the server side must
+ * also be enabled with the `net.ipv4.tcp_fastopen` sysctl.
  *
  * Return a new listening connection, or `NULL` on error.
  * NOTE: Connection remains owned by the manager, do not free().
@@ -295,7 +356,8 @@ struct ns_connection *ns_connect(struct ns_mgr *, const char *,
  * IPv6 address (if Fossa is compiled with `-DNS_ENABLE_IPV6`), or a host name.
  * If `HOST` is a name, Fossa will resolve it asynchronously. Examples of
  * valid addresses: `google.com:80`, `udp://1.2.3.4:53`, `10.0.0.1:443`,
- * `[::1]:80`
+ * `[::1]:80`, `unix:///var/run/app.sock`. See `ns_bind_opt()` for the
+ * format of Unix domain socket addresses.
  *
  * See the `ns_connect_opts` structure for a description of the optional
  * parameters.
@@ -307,6 +369,13 @@ struct ns_connection *ns_connect(struct ns_mgr *, const char *,
  * NOTE: To enable IPv6 addresses, `-DNS_ENABLE_IPV6` should be specified
  * in the compilation flags.
  *
+ * NOTE: With `NSF_TCP_FASTOPEN` in `flags`, a TCP connection uses TCP Fast
+ * Open where supported (Linux 4.11+), and silently doesn't otherwise: when
+ * the server gave a cookie on a previous connection, the data buffered
+ * when the connection is first written goes in the SYN packet, saving a
+ * round trip. `NS_CONNECT` then reports success before the server
+ * answers, and a refused connection is only seen as `NS_CLOSE`.
+ *
  * NOTE: New connection will receive `NS_CONNECT` as it's first event
  * which will report connect success status.
  * If asynchronous resolution fail, or `connect()` syscall fail for whatever
@@ -340,6 +409,73 @@ struct ns_connection *ns_connect_opt(struct ns_mgr *, const char *,
                                      ns_event_handler_t,
                                      struct ns_connect_opts);
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+/*
+ * Hot restart: let a new process take over listening sockets of this one.
+ *
+ * Create a control listener on `address`, which must be a `unix://` address.
+ * When a new process calls `ns_hot_restart_takeover()` on the same address,
+ * it gets copies of up to `NS_HANDOFF_MAX_SOCKETS` listening connections of
+ * this manager, the control listener included. Once the new process confirms
+ * that it has them, this manager closes the listeners it handed over and
+ * `handler` receives `NS_HANDOFF` with their number. Connections accepted
+ * before that are served as usual: it's up to the application to exit when
+ * they're done.
+ *
+ * Clients don't notice the switch: the listening sockets stay open
+ * throughout, and both processes accept from them for a moment.
+ *
+ * Only processes with the same effective user ID get the sockets, checked
+ * with `ns_get_peer_cred()`; for others `ns_hot_restart_takeover()` fails.
+ * Platforms where that can't be checked refuse every handoff.
+ *
+ * Return the control listener, or `NULL` on error.
+ */
+struct ns_connection *ns_hot_restart_listen(struct ns_mgr *,
+                                            const char *address,
+                                            ns_event_handler_t handler);
+
+/*
+ * Take over listening sockets from the process that called
+ * `ns_hot_restart_listen()` on `address`. Blocks for up to
+ * `NS_HANDOFF_TIMEOUT` seconds.
+ *
+ * Call it before creating listeners: `ns_bind()` then reuses a taken over
+ * socket bound to the same address instead of creating a new one. Sockets
+ * that aren't reused by the first `ns_mgr_poll()` are closed.
+ *
+ * [source,c]
+ * ----
+ * ns_mgr_init(&mgr, NULL);
+ * ns_hot_restart_takeover(&mgr, "unix:///var/run/app.ctl");
+ * ns_bind(&mgr, "80", ev_handler);
+ * ns_hot_restart_listen(&mgr, "unix:///var/run/app.ctl", ctl_handler);
+ * ----
+ *
+ * Return the number of sockets taken over, 0 if there's no process to take
+ * them from, or -1 on error.
+ */
+int ns_hot_restart_takeover(struct ns_mgr *, const char *address);
+#endif
+
+/* Credentials of the process on the other end of a Unix domain socket */
+struct ns_peer_cred {
+  int pid; /* -1 where the platform doesn't tell */
+  int uid;
+  int gid;
+};
+
+/*
+ * Get credentials of the peer of a connected Unix domain stream socket,
+ * e.g. in the `NS_ACCEPT` handler of a `unix://` listener. The kernel
+ * records them when the peer connects, so they can be trusted for access
+ * control.
+ *
+ * Return 0 on success, or -1 if the connection isn't a Unix domain socket
+ * or the platform can't tell.
+ */
+int ns_get_peer_cred(struct ns_connection *, struct ns_peer_cred *);
+
 /*
  * Enable SSL for a given connection.
  * `cert` is a server certificate file name for a listening connection,
@@ -348,12 +484,113 @@ struct ns_connection *ns_connect_opt(struct ns_mgr *, const char *,
  * must contain a certificate, concatenated with a private key, optionally
  * concatenated with parameters.
  * `ca_cert` is a CA certificate, or NULL if peer verification is not
- * required.
+ * required. Outgoing connections share contexts and resume sessions, see
+ * `ns_ssl_get_client_stats()`.
  * Return: NULL on success, or error message on error.
  */
 const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
                        const char *ca_cert);
 
+struct ns_ssl_client_stats {
+  unsigned long handshakes; /* Client handshakes completed */
+  unsigned long resumed;    /* Of these, resumed stored sessions */
+  int num_contexts;         /* Cached contexts */
+  int num_sessions;         /* Stored sessions */
+};
+
+/*
+ * Get counters of the client SSL context cache, e.g. the session
+ * resumption rate is `resumed / handshakes`.
+ *
+ * With OpenSSL 1.1 or later, `ns_set_ssl()` on outgoing connections
+ * shares one context per `cert`, `ca_cert` pair in the manager, so
+ * certificate files are only read once. Sessions handed out by servers
+ * (IDs or tickets) are stored per server IP address and port, and offered
+ * by the next connection to the same server, skipping the key exchange if
+ * the server accepts. Contexts are freed by `ns_mgr_free()`.
+ */
+void ns_ssl_get_client_stats(struct ns_mgr *, struct ns_ssl_client_stats *);
+
+/*
+ * Server-side SSL settings. They apply to a listener after `ns_set_ssl()`
+ * and need OpenSSL 1.1 or later. They return NULL on success, or an error
+ * message.
+ */
+
+#define NS_SSL_TICKET_KEY_SIZE 80
+
+/*
+ * Set the keys protecting session tickets issued by a listener, so that
+ * managers and processes given the same keys resume each other's
+ * sessions. By default, each listener makes up its own keys.
+ *
+ * `keys` is one or more keys of `NS_SSL_TICKET_KEY_SIZE` random bytes
+ * (16 bytes name, 32 bytes HMAC key, 32 bytes AES key), e.g. made with
+ * `openssl rand 80`. The first key encrypts new tickets. Tickets made with
+ * the other ones are still accepted and replaced. To rotate, call again
+ * with a new key prepended and the oldest dropped. `len` 0 turns tickets
+ * off.
+ */
+const char *ns_ssl_set_ticket_keys(struct ns_connection *, const void *keys,
+                                   size_t len);
+
+/*
+ * Tune the in-memory session cache of a listener, used by clients resuming
+ * by session ID rather than by ticket. Keep up to `max_sessions` sessions
+ * (0 turns the cache off) for `timeout` seconds, which is also the
+ * lifetime of tickets. 0 keeps the default timeout of 300 seconds.
+ */
+const char *ns_ssl_set_session_cache(struct ns_connection *,
+                                     int max_sessions, int timeout);
+
+/*
+ * Serve the certificate file `cert` to clients asking for `server_name`
+ * with SNI, rather than the listener's one. A name starting with `*.`
+ * matches one more label, e.g. `*.example.com` matches `www.example.com`.
+ * Certificates are loaded when added, not per handshake.
+ */
+const char *ns_ssl_add_sni_cert(struct ns_connection *,
+                                const char *server_name, const char *cert);
+
+/*
+ * Staple an OCSP response (DER encoded) to the certificate added for
+ * `server_name`, or to the listener's certificate if NULL, when clients
+ * ask for it. The response is copied; call again to refresh it before it
+ * expires, e.g. with one fetched by `openssl ocsp -respout`. `len` 0 stops
+ * stapling. Responses aren't checked.
+ */
+const char *ns_ssl_set_ocsp_response(struct ns_connection *,
+                                     const char *server_name, const void *der,
+                                     size_t len);
+
+/*
+ * Run the handshakes of SSL connections accepted by the manager in
+ * `num_threads` worker threads, so that the public key operations of a
+ * burst of new clients don't stall established connections. The event
+ * loop only waits for the sockets to get ready, and `NS_ACCEPT` is sent
+ * when the handshake completes, as usual. Outgoing connections still
+ * handshake in the event loop.
+ *
+ * Needs `NS_ENABLE_THREADS` and OpenSSL 1.1 or later, not on Windows.
+ * Return 0 on success, -1 on failure or if already enabled.
+ */
+int ns_ssl_offload_handshakes(struct ns_mgr *, int num_threads);
+
+#define NS_KTLS_SEND 1 /* The kernel encrypts data sent */
+#define NS_KTLS_RECV 2 /* The kernel decrypts data received */
+
+/*
+ * Tell whether the kernel does the record encryption of an SSL connection
+ * after the handshake: a bitmask of `NS_KTLS_SEND` and `NS_KTLS_RECV`.
+ *
+ * Kernel TLS is tried if Fossa is built with `-DNS_ENABLE_KTLS` against
+ * OpenSSL 3.0 or later, and used if the kernel (Linux `tls` module) and the
+ * negotiated cipher support it. Otherwise OpenSSL does it as usual. With
+ * `NS_KTLS_SEND`, Fossa writes to the socket directly, and `ns_send_file()`
+ * can use `sendfile()`.
+ */
+int ns_ssl_ktls(struct ns_connection *);
+
 /*
  * Send data to the connection.
  *
@@ -362,9 +599,93 @@ const char *ns_set_ssl(struct ns_connection *nc, const char *cert,
  * to the output buffer. The exception is UDP connections. For UDP, data is
  * sent immediately, and returned value indicates an actual number of bytes
  * sent to the socket.
+ *
+ * On Linux, if the kernel supports UDP segmentation offload, small UDP
+ * datagrams to the same peer are queued instead, and the queue goes out in
+ * a single `UDP_SEGMENT` send when the poll iteration ends, or when the
+ * next `ns_mgr_poll()` starts for datagrams sent outside of event handlers.
+ * UDP sockets also accept coalesced datagrams with `UDP_GRO`, which are
+ * split back into an `NS_RECV` event per datagram.
  */
 int ns_send(struct ns_connection *, const void *buf, int len);
 
+#ifdef NS_ENABLE_SEND_FILE
+/*
+ * Send `len` bytes of file `fd`, starting at `offset`, after the data
+ * already in the output buffer. The connection takes ownership of `fd` and
+ * closes it when done.
+ *
+ * On Linux, the file goes from the page cache to the socket with
+ * `sendfile()`, without passing through the output buffer: for plain TCP
+ * connections, and for SSL connections with kernel TLS, see `ns_ssl_ktls()`.
+ * Otherwise, it's read in chunks as the output buffer drains. `NS_SEND`
+ * reports progress either way, and `send_file` is reset to `NULL` when the
+ * file is sent. Data must not be sent on the connection before that.
+ *
+ * Return 0 on success, or -1 if a file is already being sent, or on error.
+ * On error, `fd` isn't closed.
+ */
+int ns_send_file(struct ns_connection *, int fd, int64_t offset, int64_t len);
+#endif
+
+#ifdef NS_ENABLE_SPLICE
+/*
+ * Forward everything received on either of two plain stream connections, TCP
+ * or Unix domain sockets, to the other one, e.g. to make a TCP proxy.
+ *
+ * Each direction goes through a pipe with `splice()`, so the data never
+ * reaches user space. A connection isn't read while the pipe to its peer is
+ * full, and the other way around. Data that is already in the receive
+ * buffers is sent first. Afterwards, `NS_RECV` and `NS_SEND` only report
+ * byte counts, `recv_mbuf` stays empty. Data can still be sent with
+ * `ns_send()`, it goes before what's left in the pipe. When one connection
+ * closes, the other one sends what's left and closes too.
+ *
+ * Return 0 on success, or -1 if a connection is not a plain stream (e.g. SSL,
+ * UDP or listening), is already spliced, or on error.
+ */
+int ns_splice(struct ns_connection *, struct ns_connection *);
+#endif
+
+/*
+ * Enable or disable Nagle's algorithm for a TCP connection. Fossa enables
+ * `TCP_NODELAY` on accepted and outgoing TCP connections: data buffered
+ * during a poll iteration is written at once anyway, so Nagle only delays
+ * the small writes that follow, by up to the peer's delayed ACK timeout.
+ *
+ * Return 0 on success, -1 on error or if it's not a TCP connection.
+ */
+int ns_set_nodelay(struct ns_connection *, int on);
+
+/*
+ * Cork or uncork a TCP connection. While corked, the kernel only sends
+ * full segments, so that data written by several calls, e.g. several SSL
+ * records, or a response header and a file, leave together. Uncorking
+ * sends what is left. Linux sends it anyway after 200 ms.
+ *
+ * Return 0 on success, -1 on error or if not supported.
+ */
+int ns_set_cork(struct ns_connection *, int on);
+
+/*
+ * Send output buffers of at least `threshold` bytes without copying them to
+ * the kernel, with Linux `MSG_ZEROCOPY`. 0 turns it off. Set on a listener,
+ * it applies to accepted connections.
+ *
+ * Zero-copy only pays off for large sends, e.g. 16 KB or more, since
+ * pinning the pages and the completion notifications have a cost. When
+ * the output buffer is sent this way, the connection takes it over and
+ * keeps it until the kernel reports that the data is acknowledged, and a
+ * new buffer collects data sent in the meantime. Completions are read by
+ * the event loop, and `NSF_SEND_AND_CLOSE` waits for them. If the kernel
+ * reports it had to copy anyway, e.g. on loopback, the connection goes
+ * back to regular sends.
+ *
+ * Return 0 on success, or -1 if not supported, e.g. for SSL, UDP or Unix
+ * domain connections.
+ */
+int ns_set_zerocopy(struct ns_connection *, size_t threshold);
+
 /*
  * Send `printf`-style formatted data to the connection.
  *
@@ -416,6 +737,160 @@ int ns_resolve(const char *domain_name, char *ip_addr_buf, size_t buf_len);
  */
 int ns_check_ip_acl(const char *acl, uint32_t remote_ip);
 
+/*
+ * Compile an ACL for fast repeated checks with `ns_ip_acl_check()`.
+ *
+ * The syntax is that of `ns_check_ip_acl()`. With `NS_ENABLE_IPV6`, IPv6
+ * subnets such as `+2001:db8::/32` or `-::1` are accepted as well.
+ * The compiled form is a bitwise trie per address family: checks take one
+ * walk along the address bits, however long the ACL. As with
+ * `ns_check_ip_acl()`, the last matching entry wins.
+ *
+ * Return NULL if the ACL is malformed or out of memory.
+ */
+struct ns_ip_acl *ns_ip_acl_compile(const char *acl);
+
+/* Free a compiled ACL. */
+void ns_ip_acl_free(struct ns_ip_acl *);
+
+/*
+ * Check a peer address against a compiled ACL.
+ *
+ * IPv4 and IPv6 peers are checked against the rules of their family;
+ * IPv4-mapped IPv6 addresses are checked as IPv4. A NULL ACL allows
+ * everything. Return 1 if allowed, 0 if not.
+ */
+int ns_ip_acl_check(const struct ns_ip_acl *, const union socket_address *);
+
+/*
+ * Set the ACL of a listening connection.
+ *
+ * Connections accepted (or UDP datagrams received) from disallowed addresses
+ * are dropped right after `accept()`, before a connection is allocated and
+ * before any event handler runs.
+ *
+ * The ACL is compiled first and replaces the previous one only if valid,
+ * so it can be reloaded at any time between events. NULL or an empty
+ * string removes the ACL. Return -1 if the ACL is malformed.
+ */
+int ns_set_ip_acl(struct ns_connection *nc, const char *acl);
+
+/* What a rate limit applies to, see `ns_set_rate_limit()` */
+#define NS_RATE_LIMIT_CONNECTIONS 0 /* New connections, checked at accept */
+#define NS_RATE_LIMIT_MESSAGES 1    /* HTTP requests and MQTT publishes */
+
+/* What to do when a client exceeds its rate */
+#define NS_RATE_LIMIT_REJECT 1 /* Drop it; HTTP: reply 429 Too Many Requests */
+#define NS_RATE_LIMIT_CLOSE 2  /* Close the connection */
+#define NS_RATE_LIMIT_DELAY 3  /* Stop reading until the client is in budget */
+
+struct ns_rate_limit_opts {
+  double rate;     /* Tokens (connections, messages) per second per client */
+  double burst;    /* Bucket size, at least 1 */
+  int max_clients; /* Buckets kept, least recently used are evicted */
+  int action;      /* NS_RATE_LIMIT_*, default NS_RATE_LIMIT_REJECT */
+  /*
+   * Optional: key messages by something else than the client IP address,
+   * e.g. an API key. `msg` is a `struct http_message *` or a
+   * `struct ns_mqtt_message *`. Return 0 to use the IP address.
+   */
+  int (*get_key)(struct ns_connection *nc, void *msg, struct ns_str *key);
+};
+
+struct ns_rate_limit_stats {
+  unsigned long allowed; /* Tokens taken */
+  unsigned long limited; /* Requests over the rate */
+  unsigned long evicted; /* Buckets evicted to make room for new clients */
+  int num_clients;       /* Buckets in use */
+};
+
+/*
+ * Create a token bucket rate limiter.
+ *
+ * Each client gets a bucket of `burst` tokens, refilled at `rate` tokens
+ * per second. Buckets live in a fixed-size hash table; when it's full, the
+ * least recently seen client is forgotten, so `max_clients` should exceed
+ * the number of clients active at any one time.
+ *
+ * The limiter is reference counted: listeners and connections using it
+ * hold a reference, `ns_rate_limit_free()` drops the creator's one.
+ * Return NULL if options are invalid or out of memory.
+ */
+struct ns_rate_limit *ns_rate_limit_create(struct ns_rate_limit_opts opts);
+
+/* Release a limiter reference, see `ns_rate_limit_create()`. */
+void ns_rate_limit_free(struct ns_rate_limit *);
+
+/*
+ * Take a token from the bucket of `key` at time `now` (see `ns_time()`).
+ *
+ * Keys are arbitrary bytes; keys longer than 32 bytes are compared by
+ * prefix and hash. Return 0 if a token was taken, otherwise the number of
+ * seconds until one is available.
+ */
+double ns_rate_limit_take(struct ns_rate_limit *, const void *key,
+                          size_t key_len, double now);
+
+/* Same as `ns_rate_limit_take()`, keyed by IP address. */
+double ns_rate_limit_take_addr(struct ns_rate_limit *,
+                               const union socket_address *, double now);
+
+/* Get limiter counters, e.g. for a metrics endpoint. */
+void ns_rate_limit_get_stats(const struct ns_rate_limit *,
+                             struct ns_rate_limit_stats *);
+
+/*
+ * Attach a rate limiter to a connection, replacing the previous one.
+ *
+ * `which` is `NS_RATE_LIMIT_CONNECTIONS` (listeners only: checked right
+ * after `accept()`, before any event handler runs) or
+ * `NS_RATE_LIMIT_MESSAGES` (checked by the HTTP handler for each request
+ * and by the MQTT handler for each PUBLISH). Connections accepted by a
+ * listener inherit its message limiter. NULL removes the limiter.
+ *
+ * With `NS_RATE_LIMIT_DELAY` the connection stops reading, and a delayed
+ * message stays buffered and is processed once it's within the rate;
+ * `NSF_RATE_LIMITED` is set meanwhile.
+ */
+void ns_set_rate_limit(struct ns_connection *nc, int which,
+                       struct ns_rate_limit *);
+
+/*
+ * Charge a message received on `nc` to its message limiter, keyed by
+ * `get_key()` or the peer address. Protocol handlers call this.
+ *
+ * Return 0 if the message can be processed. Otherwise, return the action
+ * taken: `NS_RATE_LIMIT_CLOSE` and `NS_RATE_LIMIT_DELAY` are handled here,
+ * for `NS_RATE_LIMIT_REJECT` the caller drops the message. `retry_after`
+ * receives the number of seconds until the client is in budget again.
+ */
+int ns_rate_limit_message(struct ns_connection *nc, void *msg,
+                          double *retry_after);
+
+/* Directions of a bandwidth limit, see `ns_set_bandwidth()` */
+#define NS_BANDWIDTH_SEND 0
+#define NS_BANDWIDTH_RECV 1
+
+/*
+ * Limit the byte rate of a connection in one direction.
+ *
+ * `rate` is in bytes per second, 0 removes the limit. `burst` is the token
+ * bucket size in bytes: up to that much can be transferred at once after
+ * an idle period. 0 means a tenth of a second worth of `rate`.
+ *
+ * Once over the rate, the connection is taken out of the poll set for that
+ * direction until the bucket refills, so a shaped download doesn't spin
+ * the event loop. Limits can be changed at any time.
+ *
+ * On a listening connection, the limit applies to all the connections it
+ * accepts from then on, together: e.g. the total upload of an HTTP server.
+ * Each of them can have its own limit on top.
+ *
+ * Return 0 on success, -1 if `dir` or `rate` is invalid or out of memory.
+ */
+int ns_set_bandwidth(struct ns_connection *nc, int dir, double rate,
+                     double burst);
+
 /*
  * Enable multi-threaded handling for the given listening connection `nc`.
  * For each accepted connection, Mongoose will create a separate thread
@@ -425,6 +900,23 @@ int ns_check_ip_acl(const char *acl, uint32_t remote_ip);
  */
 void ns_enable_multithreading(struct ns_connection *nc);
 
+/*
+ * Read and write files served by `ns_serve_http()`, and uploaded with DAV
+ * `PUT`, in `num_threads` worker threads, so that a cold cache or a slow
+ * disk doesn't stall other connections of the manager.
+ *
+ * Downloads are read ahead in chunks, up to `NS_HTTP_READ_AHEAD` bytes of
+ * the output buffer; they don't use `ns_send_file()`, whose `sendfile()`
+ * calls would read the disk in the event loop. Uploads are written as they
+ * arrive; while a write is in progress, reading stops once
+ * `NS_HTTP_READ_AHEAD` bytes are buffered. Completions are handled by the
+ * event loop.
+ *
+ * Needs `NS_ENABLE_THREADS`, not on Windows.
+ * Return 0 on success, -1 on failure or if already enabled.
+ */
+int ns_offload_file_io(struct ns_mgr *, int num_threads);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -138,6 +138,25 @@ int ns_resolve_from_hosts_file(const char *name, union socket_address *usa) {
   return -1;
 }
 
+/*
+ * Check that a reply carries at least one well-formed answer, without
+ * allocating a full `struct ns_dns_message` for it.
+ */
+static int ns_resolve_has_answer(const char *buf, int len) {
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+
+  if (ns_dns_iter_init(&it, buf, len) == -1) {
+    return 0;
+  }
+  while (ns_dns_iter_next(&it, &rr) > 0) {
+    if (rr.kind == NS_DNS_ANSWER) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static void ns_resolve_async_eh(struct ns_connection *nc, int ev, void *data) {
   time_t now = time(NULL);
   struct ns_resolve_async_request *req;
@@ -163,8 +182,10 @@ static void ns_resolve_async_eh(struct ns_connection *nc, int ev, void *data) {
       }
       break;
     case NS_RECV:
-      msg = (struct ns_dns_message *) NS_MALLOC(sizeof(*msg));
-      if (ns_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
+      msg = NULL;
+      if (ns_resolve_has_answer(nc->recv_mbuf.buf, *(int *) data) &&
+          (msg = (struct ns_dns_message *) NS_MALLOC(sizeof(*msg))) != NULL &&
+          ns_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
           msg->num_answers > 0) {
         req->callback(msg, req->data);
       } else {
@@ -5,6 +5,10 @@
 
 #include "internal.h"
 
+#if !defined(_WIN32) && !defined(NS_CC3200) && !defined(NS_ESP8266)
+#include <sys/time.h> /* For gettimeofday() */
+#endif
+
 const char *ns_skip(const char *s, const char *end, const char *delims,
                     struct ns_str *v) {
   v->p = s;
@@ -146,6 +150,17 @@ void ns_sock_addr_to_str(const union socket_address *sa, char *buf, size_t len,
   int is_v6;
   if (buf == NULL || len <= 0) return;
   buf[0] = '\0';
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* No port: the path, or @name if abstract, stands for both */
+    const char *path = sa->un.sun_path;
+    if (flags & (NS_SOCK_STRINGIFY_IP | NS_SOCK_STRINGIFY_PORT)) {
+      snprintf(buf, len, "%s%s", path[0] == '\0' && path[1] != '\0' ? "@" : "",
+               path[0] == '\0' ? path + 1 : path);
+    }
+    return;
+  }
+#endif
 #if defined(NS_ENABLE_IPV6)
   is_v6 = sa->sa.sa_family == AF_INET6;
 #else
@@ -245,6 +260,61 @@ int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap) {
   return len;
 }
 
+/* Free space to have before formatting, so that most output fits at once */
+#define NS_MBUF_PRINTF_RESERVE 100
+
+int ns_mbuf_vprintf(struct mbuf *io, const char *fmt, va_list ap) {
+  char mem[NS_MBUF_PRINTF_RESERVE], *buf = mem;
+  va_list ap_copy;
+  size_t avail;
+  int len;
+
+  if (io->size - io->len < NS_MBUF_PRINTF_RESERVE) {
+    mbuf_resize(io, (io->len + NS_MBUF_PRINTF_RESERVE) * MBUF_SIZE_MULTIPLIER);
+  }
+  avail = io->size - io->len;
+
+  va_copy(ap_copy, ap);
+  len = vsnprintf(io->buf + io->len, avail, fmt, ap_copy);
+  va_end(ap_copy);
+
+  if (len >= (int) avail) {
+    /* Now that the length is known, make room and format again */
+    mbuf_resize(io, io->len + len + 1);
+    if (io->size - io->len <= (size_t) len) {
+      return -1; /* LCOV_EXCL_LINE */
+    }
+    va_copy(ap_copy, ap);
+    vsnprintf(io->buf + io->len, len + 1, fmt, ap_copy);
+    va_end(ap_copy);
+  } else if (len < 0) {
+    /* Non-compliant vsnprintf() doesn't tell the length, see ns_avprintf() */
+    /* LCOV_EXCL_START */
+    if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
+      mbuf_append(io, buf, len);
+    }
+    if (buf != mem && buf != NULL) {
+      NS_FREE(buf);
+    }
+    return len;
+    /* LCOV_EXCL_STOP */
+  }
+  io->len += len;
+
+  return len;
+}
+
+int ns_mbuf_printf(struct mbuf *io, const char *fmt, ...) {
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = ns_mbuf_vprintf(io, fmt, ap);
+  va_end(ap);
+
+  return len;
+}
+
 #ifndef NS_DISABLE_FILESYSTEM
 void ns_hexdump_connection(struct ns_connection *nc, const char *path,
                            int num_bytes, int ev) {
@@ -351,3 +421,20 @@ int ns_match_prefix(const char *pattern, int pattern_len, const char *str) {
   }
   return j;
 }
+
+double ns_time(void) {
+#if defined(_WIN32)
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  /* 100ns intervals since 1601-01-01 */
+  return ((double) ft.dwHighDateTime * 4294967296.0 + ft.dwLowDateTime) /
+             10000000.0 -
+         11644473600.0;
+#elif defined(NS_CC3200) || defined(NS_ESP8266)
+  return (double) time(NULL);
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+#endif
+}
@@ -130,6 +130,8 @@ void ns_set_close_on_exec(sock_t);
  *
  * If both port number and IP address are printed, they are separated by `:`.
  * If compiled with `-DNS_ENABLE_IPV6`, IPv6 addresses are supported.
+ * Unix domain sockets have no port: either flag prints the path, or `@name`
+ * for an abstract name, or nothing for an unnamed socket.
  */
 void ns_sock_to_str(sock_t sock, char *buf, size_t len, int flags);
 
@@ -177,6 +179,19 @@ void ns_hexdump_connection(struct ns_connection *nc, const char *path,
  */
 int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap);
 
+/*
+ * Append printf-formatted output to an IO buffer.
+ *
+ * The output is formatted straight into the free space of `io`, which grows
+ * as needed: no temporary buffer is used, and the format is processed a
+ * second time only when the buffer had to grow.
+ * Return the number of bytes appended, or -1 on error.
+ */
+int ns_mbuf_vprintf(struct mbuf *io, const char *fmt, va_list ap);
+
+/* Same as `ns_mbuf_vprintf()`, with a variable argument list. */
+int ns_mbuf_printf(struct mbuf *io, const char *fmt, ...);
+
 /*
  * Return true if target platform is big endian.
  */
@@ -204,6 +219,12 @@ const char *ns_next_comma_list_entry(const char *list, struct ns_str *val,
  */
 int ns_match_prefix(const char *pattern, int pattern_len, const char *str);
 
+/*
+ * Return current time in seconds since the epoch, with sub-second precision
+ * where the platform provides it.
+ */
+double ns_time(void);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -20,6 +20,8 @@
 #include "unit_test.h"
 #include "test_util.h"
 
+#include <netinet/tcp.h>
+
 #if __STDC_VERSION__ < 199901L && !defined(WIN32)
 #define __func__ ""
 #endif
@@ -243,6 +245,154 @@ static const char *test_ssl(void) {
   return test_mgr_with_ssl(1);
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static const char *test_ssl_client_cache(void) {
+  char addr[100] = "127.0.0.1:0", buf[100];
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct ns_ssl_client_stats st;
+  SSL_CTX *ctx = NULL;
+  int i;
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, addr, eh1)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, CA_PEM) == NULL);
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+
+  for (i = 0; i < 3; i++) {
+    ASSERT((nc = ns_connect(&mgr, addr, eh1)) != NULL);
+    ASSERT(ns_set_ssl(nc, C_PEM, CA_PEM) == NULL);
+    /* Certificates are loaded once */
+    if (ctx == NULL) ctx = nc->ssl_ctx;
+    ASSERT(nc->ssl_ctx == ctx);
+    buf[0] = '\0';
+    nc->user_data = buf;
+    poll_until(&mgr, 1000, c_str_ne, buf, (void *) "");
+    ASSERT_STREQ(buf, "ok!");
+  }
+
+  /* The first connection gets a session, the others resume it */
+  ns_ssl_get_client_stats(&mgr, &st);
+  ASSERT_EQ(st.num_contexts, 1);
+  ASSERT_EQ(st.num_sessions, 1);
+  ASSERT_EQ(st.handshakes, 3);
+  ASSERT_EQ(st.resumed, 2);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+
+#ifdef NS_ENABLE_THREADS
+static int ssl_offload_all_ok(void *param, void *unused) {
+  char(*bufs)[10] = (char(*)[10]) param;
+  int i;
+  (void) unused;
+  for (i = 0; i < 5; i++) {
+    if (strcmp(bufs[i], "ok!") != 0) return 0;
+  }
+  return 1;
+}
+
+static const char *test_ssl_offload(void) {
+  char addr[100] = "127.0.0.1:0", bufs[5][10];
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  int i;
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT_EQ(ns_ssl_offload_handshakes(&mgr, 0), -1);
+  ASSERT_EQ(ns_ssl_offload_handshakes(&mgr, 2), 0);
+  ASSERT_EQ(ns_ssl_offload_handshakes(&mgr, 2), -1);
+  ASSERT((nc = ns_bind(&mgr, addr, eh1)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, CA_PEM) == NULL);
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+
+  /* Accepted connections handshake concurrently in the workers */
+  for (i = 0; i < 5; i++) {
+    ASSERT((nc = ns_connect(&mgr, addr, eh1)) != NULL);
+    ASSERT(ns_set_ssl(nc, C_PEM, CA_PEM) == NULL);
+    bufs[i][0] = '\0';
+    nc->user_data = bufs[i];
+  }
+  poll_until(&mgr, 5000, ssl_offload_all_ok, bufs, NULL);
+  for (i = 0; i < 5; i++) ASSERT_STREQ(bufs[i], "ok!");
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
+#define RECORDS_DATA_SIZE (1024 * 1024 + 200000)
+
+struct ssl_records_res {
+  int num_small; /* Application data records before the first large one */
+  int max;       /* Largest record */
+  int received;
+};
+
+static void ssl_records_msg_cb(int write_p, int version, int content_type,
+                               const void *buf, size_t len, SSL *ssl,
+                               void *arg) {
+  struct ssl_records_res *res = (struct ssl_records_res *) arg;
+  const unsigned char *p = (const unsigned char *) buf;
+  int size;
+
+  (void) version;
+  (void) ssl;
+  /* Incoming record headers. TLS 1.3 hides the type of encrypted records */
+  if (write_p || content_type != SSL3_RT_HEADER || len != 5 ||
+      p[0] != SSL3_RT_APPLICATION_DATA) {
+    return;
+  }
+  size = (p[3] << 8) | p[4];
+  if (res->max < 1500 && size < 1500) res->num_small++;
+  if (size > res->max) res->max = size;
+}
+
+static void ssl_records_handler(struct ns_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == NS_ACCEPT) {
+    char *data = (char *) calloc(1, RECORDS_DATA_SIZE);
+    ns_send(nc, data, RECORDS_DATA_SIZE);
+    free(data);
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  } else if (ev == NS_RECV && nc->listener == NULL) {
+    ((struct ssl_records_res *) nc->user_data)->received +=
+        (int) nc->recv_mbuf.len;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static const char *test_ssl_record_size(void) {
+  char addr[100] = "127.0.0.1:0";
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct ssl_records_res res;
+
+  memset(&res, 0, sizeof(res));
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, addr, ssl_records_handler)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, NULL) == NULL);
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+
+  ASSERT((nc = ns_connect(&mgr, addr, ssl_records_handler)) != NULL);
+  ASSERT(ns_set_ssl(nc, NULL, NULL) == NULL);
+  nc->user_data = &res;
+  SSL_set_msg_callback(nc->ssl, ssl_records_msg_cb);
+  SSL_set_msg_callback_arg(nc->ssl, &res);
+  poll_until(&mgr, 5000, c_int_eq, &res.received,
+             (void *) (intptr_t) RECORDS_DATA_SIZE);
+  ASSERT_EQ(res.received, RECORDS_DATA_SIZE);
+
+  /* Records fit in a TCP segment for the first megabyte, then grow */
+  ASSERT(res.num_small > 1024 * 1024 / 1500);
+  ASSERT(res.max > 16384);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
 static void eh_hello_server(struct ns_connection *nc, int ev, void *ev_data) {
   (void) ev_data;
   if (ev == NS_ACCEPT) ns_printf(nc, "hello");
@@ -312,6 +462,134 @@ static const char *test_modern_crypto(void) {
   return NULL;
 }
 #endif /* _KRYPTON_H */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+struct ssl_server_res {
+  char locality[100]; /* Of the server certificate */
+  char ocsp[100];     /* Stapled response */
+  int reused;
+  SSL_SESSION *session;
+};
+
+static void ssl_server_clnt_handler(struct ns_connection *nc, int ev,
+                                    void *p) {
+  struct ssl_server_res *res = (struct ssl_server_res *) nc->user_data;
+  const unsigned char *ocsp;
+  long len;
+  X509 *cert;
+  (void) p;
+
+  if (ev == NS_RECV) {
+    if ((cert = SSL_get_peer_certificate(nc->ssl)) != NULL) {
+      X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_localityName,
+                                res->locality, sizeof(res->locality));
+      X509_free(cert);
+    }
+    len = SSL_get_tlsext_status_ocsp_resp(nc->ssl, &ocsp);
+    if (len > 0) {
+      snprintf(res->ocsp, sizeof(res->ocsp), "%.*s", (int) len, ocsp);
+    }
+    res->reused = SSL_session_reused(nc->ssl);
+    if (res->session == NULL) res->session = SSL_get1_session(nc->ssl);
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+/* Connect to `addr`, offering `session` if not NULL */
+static const char *ssl_server_connect(struct ns_mgr *mgr, const char *addr,
+                                      const char *server_name,
+                                      SSL_SESSION *session,
+                                      struct ssl_server_res *res) {
+  struct ns_connection *nc;
+
+  memset(res, 0, sizeof(*res));
+  ASSERT((nc = ns_connect(mgr, addr, ssl_server_clnt_handler)) != NULL);
+  ASSERT(ns_set_ssl(nc, NULL, NULL) == NULL);
+  SSL_set_tlsext_status_type(nc->ssl, TLSEXT_STATUSTYPE_ocsp);
+  if (server_name != NULL) SSL_set_tlsext_host_name(nc->ssl, server_name);
+  if (session != NULL) SSL_set_session(nc->ssl, session);
+  nc->user_data = res;
+  poll_until(mgr, 1000, c_str_ne, res->locality, (void *) "");
+  ASSERT(res->locality[0] != '\0');
+  return NULL;
+}
+
+static const char *test_ssl_server_opts(void) {
+  char addr1[100] = "127.0.0.1:0", addr2[100] = "127.0.0.1:0",
+       addr3[100] = "127.0.0.1:0", keys[2 * NS_SSL_TICKET_KEY_SIZE];
+  struct ssl_server_res res, res2;
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  const char *msg;
+  size_t i;
+
+  for (i = 0; i < sizeof(keys); i++) keys[i] = (char) (i * 13);
+  ns_mgr_init(&mgr, NULL);
+
+  ASSERT((nc = ns_bind(&mgr, addr1, eh_hello_server)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, NULL) == NULL);
+  ASSERT(ns_ssl_set_ticket_keys(nc, keys, sizeof(keys) - 1) != NULL);
+  ASSERT(ns_ssl_set_ticket_keys(nc, keys, sizeof(keys)) == NULL);
+  ASSERT(ns_ssl_set_session_cache(nc, 100, 60) == NULL);
+  ASSERT(ns_ssl_add_sni_cert(nc, "*.example.com", CA_PEM) == NULL);
+  ASSERT(ns_ssl_set_ocsp_response(nc, "foo.com", "x", 1) != NULL);
+  ASSERT(ns_ssl_set_ocsp_response(nc, NULL, "ocsp1", 5) == NULL);
+  ASSERT(ns_ssl_set_ocsp_response(nc, "*.example.com", "ocsp2", 5) == NULL);
+  ns_sock_to_str(nc->sock, addr1, sizeof(addr1), 3);
+
+  /* Another listener, which has rotated the keys: the first one is older */
+  ASSERT((nc = ns_bind(&mgr, addr2, eh_hello_server)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, NULL) == NULL);
+  memcpy(keys + NS_SSL_TICKET_KEY_SIZE, keys, NS_SSL_TICKET_KEY_SIZE);
+  memset(keys, 'k', NS_SSL_TICKET_KEY_SIZE);
+  ASSERT(ns_ssl_set_ticket_keys(nc, keys, sizeof(keys)) == NULL);
+  ns_sock_to_str(nc->sock, addr2, sizeof(addr2), 3);
+
+  /* And one with its own keys */
+  ASSERT((nc = ns_bind(&mgr, addr3, eh_hello_server)) != NULL);
+  ASSERT(ns_set_ssl(nc, S_PEM, NULL) == NULL);
+  ns_sock_to_str(nc->sock, addr3, sizeof(addr3), 3);
+
+  /* Certificate and OCSP response selected by SNI */
+  if ((msg = ssl_server_connect(&mgr, addr1, NULL, NULL, &res)) != NULL) {
+    return msg;
+  }
+  ASSERT_STREQ(res.locality, "Galway");
+  ASSERT_STREQ(res.ocsp, "ocsp1");
+  ASSERT_EQ(res.reused, 0);
+  if ((msg = ssl_server_connect(&mgr, addr1, "www.example.com", NULL,
+                                &res2)) != NULL) {
+    return msg;
+  }
+  ASSERT_STREQ(res2.locality, "Dublin");
+  ASSERT_STREQ(res2.ocsp, "ocsp2");
+  SSL_SESSION_free(res2.session);
+  if ((msg = ssl_server_connect(&mgr, addr1, "example.com", NULL, &res2)) !=
+      NULL) {
+    return msg;
+  }
+  ASSERT_STREQ(res2.locality, "Galway");
+  SSL_SESSION_free(res2.session);
+
+  /* Tickets are accepted by listeners sharing the key */
+  if ((msg = ssl_server_connect(&mgr, addr2, NULL, res.session, &res2)) !=
+      NULL) {
+    return msg;
+  }
+  ASSERT_EQ(res2.reused, 1);
+  SSL_SESSION_free(res2.session);
+  if ((msg = ssl_server_connect(&mgr, addr3, NULL, res.session, &res2)) !=
+      NULL) {
+    return msg;
+  }
+  ASSERT_EQ(res2.reused, 0);
+  SSL_SESSION_free(res2.session);
+  SSL_SESSION_free(res.session);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
 #endif /* NS_ENABLE_SSL */
 
 static const char *test_to64(void) {
@@ -335,6 +613,838 @@ static const char *test_check_ip_acl(void) {
   return NULL;
 }
 
+static int ip_acl_check4(struct ns_ip_acl *acl, uint32_t ip) {
+  union socket_address sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin.sin_family = AF_INET;
+  sa.sin.sin_addr.s_addr = htonl(ip);
+  return ns_ip_acl_check(acl, &sa);
+}
+
+#ifdef NS_ENABLE_IPV6
+static int ip_acl_check6(struct ns_ip_acl *acl, const char *ip) {
+  union socket_address sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin6.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, ip, &sa.sin6.sin6_addr);
+  return ns_ip_acl_check(acl, &sa);
+}
+#endif
+
+static void ip_acl_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  (void) ev_data;
+  if (ev == NS_ACCEPT) {
+    (*(int *) nc->user_data)++;
+  } else if (ev == NS_CLOSE && nc->listener == NULL &&
+             !(nc->flags & NSF_LISTENING)) {
+    *(int *) nc->user_data = -1;
+  }
+}
+
+static const char *test_ip_acl(void) {
+  static const char *acls[] = {"",
+                               "-0.0.0.0/0",
+                               "-0.0.0.0/0,+1.0.0.0/8",
+                               "-0.0.0.0/0,+1.2.3.4",
+                               "+1.0.0.0/8,-0.0.0.0/0",
+                               "-0.0.0.0/0,+10.0.0.0/8,-10.1.0.0/16,+10.1.2.3",
+                               "+1.2.3.4/32,-1.2.0.0/16,+1.2.3.0/24"};
+  struct ns_ip_acl *acl;
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  uint32_t ip, seed = 1;
+  int i, j, accepted = 0, closed = 0;
+
+  /* Same verdicts as ns_check_ip_acl() */
+  for (i = 0; i < (int) ARRAY_SIZE(acls); i++) {
+    ASSERT((acl = ns_ip_acl_compile(acls[i])) != NULL);
+    for (j = 0; j < 2000; j++) {
+      seed = seed * 1103515245 + 12345;
+      /* Keep hitting the subnets used above */
+      ip = j % 4 == 0 ? seed : (j % 4 == 1 ? 0x01020300 : 0x0a010000) |
+                                   (seed >> 24 & (j % 4 == 2 ? 0xff : 0x3ff));
+      ASSERT_EQ(ip_acl_check4(acl, ip), ns_check_ip_acl(acls[i], ip));
+    }
+    ns_ip_acl_free(acl);
+  }
+
+  ASSERT(ns_ip_acl_compile("invalid") == NULL);
+  ASSERT(ns_ip_acl_compile("+1.2.3.4/33") == NULL);
+  ASSERT(ns_ip_acl_compile("+1.2.3.4x") == NULL);
+  ASSERT(ns_ip_acl_compile("1.2.3.4") == NULL);
+  ASSERT_EQ(ns_ip_acl_check(NULL, NULL), 1);
+
+#ifdef NS_ENABLE_IPV6
+  ASSERT((acl = ns_ip_acl_compile(
+              "-0.0.0.0/0,+127.0.0.1,-::/0,+2001:db8::/32,-2001:db8::1")) !=
+         NULL);
+  ASSERT_EQ(ip_acl_check6(acl, "2001:db8::2"), 1);
+  ASSERT_EQ(ip_acl_check6(acl, "2001:db8::1"), 0);
+  ASSERT_EQ(ip_acl_check6(acl, "2001:db9::2"), 0);
+  ASSERT_EQ(ip_acl_check6(acl, "::ffff:127.0.0.1"), 1);
+  ASSERT_EQ(ip_acl_check6(acl, "::ffff:127.0.0.2"), 0);
+  ASSERT_EQ(ip_acl_check4(acl, 0x7f000001), 1);
+  ns_ip_acl_free(acl);
+  ASSERT((acl = ns_ip_acl_compile("+::1/129")) == NULL);
+  ASSERT((acl = ns_ip_acl_compile("-1.2.3.4")) != NULL);
+  /* IPv6 peers aren't matched by IPv4 rules, denied by default */
+  ASSERT_EQ(ip_acl_check6(acl, "::1"), 0);
+  ns_ip_acl_free(acl);
+  /* /0 rules add no trie nodes, the ACL is still not empty */
+  ASSERT((acl = ns_ip_acl_compile("-0.0.0.0/0")) != NULL);
+  ASSERT_EQ(ip_acl_check6(acl, "::1"), 0);
+  ns_ip_acl_free(acl);
+  ASSERT((acl = ns_ip_acl_compile("+::/0")) != NULL);
+  ASSERT_EQ(ip_acl_check6(acl, "::1"), 1);
+  ASSERT_EQ(ip_acl_check4(acl, 0x7f000001), 0);
+  ns_ip_acl_free(acl);
+#endif
+  {
+    /* Not an IP peer, e.g. a Unix domain socket */
+    union socket_address sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa.sa_family = AF_UNIX;
+    ASSERT((acl = ns_ip_acl_compile("-0.0.0.0/0")) != NULL);
+    ASSERT_EQ(ns_ip_acl_check(acl, &sa), 0);
+    ns_ip_acl_free(acl);
+    ASSERT((acl = ns_ip_acl_compile("")) != NULL);
+    ASSERT_EQ(ns_ip_acl_check(acl, &sa), 1);
+    ns_ip_acl_free(acl);
+  }
+
+  /* Denied at accept time, the listener handler never sees the client */
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7794", ip_acl_handler)) != NULL);
+  ls->user_data = &accepted;
+  ASSERT_EQ(ns_set_ip_acl(ls, "-0.0.0.0/0,+10.0.0.0/8"), 0);
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7794", ip_acl_handler)) != NULL);
+  nc->user_data = &closed;
+  poll_until(&mgr, 1000, c_int_eq, &closed, (void *) -1);
+  ASSERT_EQ(closed, -1);
+  ASSERT_EQ(accepted, 0);
+
+  /* A bad ACL doesn't replace the current one, a good one does */
+  ASSERT_EQ(ns_set_ip_acl(ls, "+bad"), -1);
+  ASSERT(ls->ip_acl != NULL);
+  ASSERT_EQ(ns_set_ip_acl(ls, "-0.0.0.0/0,+127.0.0.1"), 0);
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7794", ip_acl_handler)) != NULL);
+  nc->user_data = &closed;
+  poll_until(&mgr, 1000, c_int_eq, &accepted, (void *) 1);
+  ASSERT_EQ(accepted, 1);
+  ASSERT_EQ(ns_set_ip_acl(ls, NULL), 0);
+  ASSERT(ls->ip_acl == NULL);
+  ASSERT_EQ(ns_set_ip_acl(ls, "+10.0.0.0/8"), 0);
+  ns_mgr_free(&mgr);
+
+  return NULL;
+}
+
+static void rl_srv_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  (void) ev_data;
+  if (ev == NS_HTTP_REQUEST) {
+    ns_printf(nc, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+  }
+}
+
+static void rl_client_handler(struct ns_connection *nc, int ev,
+                              void *ev_data) {
+  if (ev == NS_HTTP_REPLY) {
+    *(int *) nc->user_data = ((struct http_message *) ev_data)->resp_code;
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static int rl_http_get(struct ns_mgr *mgr, const char *addr) {
+  struct ns_connection *nc = ns_connect(mgr, addr, rl_client_handler);
+  int code = 0;
+
+  ns_set_protocol_http_websocket(nc);
+  nc->user_data = &code;
+  ns_printf(nc, "%s", "GET / HTTP/1.0\r\n\r\n");
+  poll_until(mgr, 1000, c_int_ne, &code, (void *) 0);
+
+  return code;
+}
+
+static void rl_mqtt_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  (void) ev_data;
+  if (ev == NS_MQTT_PUBLISH) (*(int *) nc->user_data)++;
+}
+
+static const char *test_rate_limit(void) {
+  static const char publish[] = {(char) (NS_MQTT_CMD_PUBLISH << 4), 10, 0, 6,
+                                 '/', 't', 'o', 'p', 'i', 'c', 'h', 'i'};
+  char long_key[40];
+  struct ns_rate_limit_opts opts;
+  struct ns_rate_limit_stats stats;
+  struct ns_rate_limit *rl;
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  union socket_address sa;
+  int accepted = 0, closed = 0, published = 0, n = sizeof(publish);
+  double wait;
+
+  memset(&opts, 0, sizeof(opts));
+  ASSERT(ns_rate_limit_create(opts) == NULL);
+  opts.rate = 10;
+  opts.burst = 2;
+  opts.max_clients = 2;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+
+  /* Burst, then refill at the rate */
+  ASSERT(ns_rate_limit_take(rl, "a", 1, 100) == 0);
+  ASSERT(ns_rate_limit_take(rl, "a", 1, 100) == 0);
+  wait = ns_rate_limit_take(rl, "a", 1, 100);
+  ASSERT(wait > 0.099 && wait < 0.101);
+  ASSERT(ns_rate_limit_take(rl, "a", 1, 100.25) == 0);
+
+  /* Least recently seen clients are evicted */
+  ASSERT(ns_rate_limit_take(rl, "b", 1, 100.25) == 0);
+  ASSERT(ns_rate_limit_take(rl, "b", 1, 100.25) == 0);
+  ASSERT(ns_rate_limit_take(rl, "b", 1, 100.25) > 0);
+  ASSERT(ns_rate_limit_take(rl, "c", 1, 100.25) == 0);
+  ASSERT(ns_rate_limit_take(rl, "b", 1, 100.25) > 0);
+  ASSERT(ns_rate_limit_take(rl, "a", 1, 100.25) == 0);
+  ns_rate_limit_get_stats(rl, &stats);
+  ASSERT_EQ(stats.allowed, 7);
+  ASSERT_EQ(stats.limited, 3);
+  ASSERT_EQ(stats.evicted, 2);
+  ASSERT_EQ(stats.num_clients, 2);
+  ns_rate_limit_free(rl);
+
+  opts.burst = 1;
+  opts.max_clients = 0;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  memset(long_key, 'x', sizeof(long_key));
+  ASSERT(ns_rate_limit_take(rl, long_key, sizeof(long_key), 0) == 0);
+  long_key[sizeof(long_key) - 1] = 'y';
+  ASSERT(ns_rate_limit_take(rl, long_key, sizeof(long_key), 0) == 0);
+  ASSERT(ns_rate_limit_take(rl, long_key, sizeof(long_key), 0) > 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin.sin_family = AF_INET;
+  sa.sin.sin_addr.s_addr = htonl(0x7f000001);
+  ASSERT(ns_rate_limit_take_addr(rl, &sa, 0) == 0);
+#ifdef NS_ENABLE_IPV6
+  memset(&sa, 0, sizeof(sa));
+  sa.sin6.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "::ffff:127.0.0.1", &sa.sin6.sin6_addr);
+  ASSERT(ns_rate_limit_take_addr(rl, &sa, 0) > 0);
+  inet_pton(AF_INET6, "::1", &sa.sin6.sin6_addr);
+  ASSERT(ns_rate_limit_take_addr(rl, &sa, 0) == 0);
+#endif
+  ns_rate_limit_free(rl);
+
+  /* Connections over the rate are closed right after accept() */
+  opts.rate = 0.001;
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7795", ip_acl_handler)) != NULL);
+  ls->user_data = &accepted;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  ns_set_rate_limit(ls, NS_RATE_LIMIT_CONNECTIONS, rl);
+  ns_rate_limit_free(rl);
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7795", ip_acl_handler)) != NULL);
+  nc->user_data = &closed;
+  poll_until(&mgr, 1000, c_int_eq, &accepted, (void *) 1);
+  ASSERT_EQ(accepted, 1);
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7795", ip_acl_handler)) != NULL);
+  nc->user_data = &closed;
+  poll_until(&mgr, 1000, c_int_eq, &closed, (void *) -1);
+  ASSERT_EQ(closed, -1);
+  ASSERT_EQ(accepted, 1);
+  ns_rate_limit_get_stats(rl, &stats);
+  ASSERT_EQ(stats.limited, 1);
+
+  /* HTTP requests over the rate get 429 */
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7796", rl_srv_handler)) != NULL);
+  ns_set_protocol_http_websocket(ls);
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  ns_set_rate_limit(ls, NS_RATE_LIMIT_MESSAGES, rl);
+  ns_rate_limit_free(rl);
+  ASSERT_EQ(rl_http_get(&mgr, "127.0.0.1:7796"), 200);
+  ASSERT_EQ(rl_http_get(&mgr, "127.0.0.1:7796"), 429);
+
+  /* Or wait until they're within the rate */
+  opts.rate = 4;
+  opts.action = NS_RATE_LIMIT_DELAY;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  ns_set_rate_limit(ls, NS_RATE_LIMIT_MESSAGES, rl);
+  ns_rate_limit_free(rl);
+  ASSERT_EQ(rl_http_get(&mgr, "127.0.0.1:7796"), 200);
+  ASSERT_EQ(rl_http_get(&mgr, "127.0.0.1:7796"), 200);
+  /* The second one was held back, not rejected, then let through */
+  ns_rate_limit_get_stats(rl, &stats);
+  ASSERT(stats.limited >= 1);
+  ASSERT_EQ(stats.allowed, 2);
+  ns_mgr_free(&mgr);
+
+  /* MQTT: PUBLISH messages over the rate are dropped... */
+  nc = (struct ns_connection *) calloc(1, sizeof(*nc));
+  nc->handler = rl_mqtt_handler;
+  nc->user_data = &published;
+  ns_set_protocol_mqtt(nc);
+  opts.rate = 0.001;
+  opts.action = NS_RATE_LIMIT_REJECT;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  ns_set_rate_limit(nc, NS_RATE_LIMIT_MESSAGES, rl);
+  ns_rate_limit_free(rl);
+  mbuf_append(&nc->recv_mbuf, publish, n);
+  nc->proto_handler(nc, NS_RECV, &n);
+  mbuf_append(&nc->recv_mbuf, publish, n);
+  nc->proto_handler(nc, NS_RECV, &n);
+  ASSERT_EQ(published, 1);
+  ASSERT_EQ(nc->recv_mbuf.len, 0);
+
+  /* ...or kept until the connection is within the rate */
+  opts.action = NS_RATE_LIMIT_DELAY;
+  ASSERT((rl = ns_rate_limit_create(opts)) != NULL);
+  ns_set_rate_limit(nc, NS_RATE_LIMIT_MESSAGES, rl);
+  ns_rate_limit_free(rl);
+  mbuf_append(&nc->recv_mbuf, publish, n);
+  nc->proto_handler(nc, NS_RECV, &n);
+  mbuf_append(&nc->recv_mbuf, publish, n);
+  nc->proto_handler(nc, NS_RECV, &n);
+  ASSERT_EQ(published, 2);
+  ASSERT_EQ(nc->recv_mbuf.len, sizeof(publish));
+  ASSERT((nc->flags & NSF_RATE_LIMITED) != 0);
+  ASSERT(nc->recv_resume_time > 0);
+  ns_set_rate_limit(nc, NS_RATE_LIMIT_MESSAGES, NULL);
+  nc->recv_resume_time = 0;
+  nc->proto_handler(nc, NS_POLL, &n);
+  ASSERT_EQ(published, 3);
+  ASSERT_EQ(nc->recv_mbuf.len, 0);
+  ASSERT((nc->flags & NSF_RATE_LIMITED) == 0);
+  mbuf_free(&nc->recv_mbuf);
+  free(nc);
+
+  return NULL;
+}
+
+static void bw_server_handler(struct ns_connection *nc, int ev, void *p) {
+  char buf[1024];
+  int i;
+  (void) p;
+
+  if (ev == NS_ACCEPT) {
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < *(int *) nc->user_data; i += sizeof(buf)) {
+      ns_send(nc, buf, sizeof(buf));
+    }
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+static void bw_client_handler(struct ns_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == NS_RECV) {
+    *(int *) nc->user_data += (int) nc->recv_mbuf.len;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static const char *test_bandwidth(void) {
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  int size = 32 * 1024, received = 0;
+  double start;
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7797", bw_server_handler)) != NULL);
+  ls->user_data = &size;
+
+  /* Receive at 200 KB/s after an 8 KB burst: takes 0.12 s */
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7797", bw_client_handler)) != NULL);
+  nc->user_data = &received;
+  ASSERT_EQ(ns_set_bandwidth(nc, 2, 200000, 8192), -1);
+  ASSERT_EQ(ns_set_bandwidth(nc, -1, 200000, 8192), -1);
+  ASSERT_EQ(ns_set_bandwidth(nc, NS_BANDWIDTH_RECV, -1, 8192), -1);
+  ASSERT(nc->bandwidth == NULL);
+  ASSERT_EQ(ns_set_bandwidth(nc, NS_BANDWIDTH_RECV, 200000, 8192), 0);
+  start = ns_time();
+  poll_until(&mgr, 2000, c_int_eq, &received, (void *) (intptr_t) size);
+  ASSERT_EQ(received, size);
+  ASSERT(ns_time() - start > 0.1);
+
+  /* Two downloads share the limit of the listener */
+  ASSERT_EQ(ns_set_bandwidth(ls, NS_BANDWIDTH_SEND, 200000, 8192), 0);
+  size = 16 * 1024;
+  received = 0;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7797", bw_client_handler)) != NULL);
+  nc->user_data = &received;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7797", bw_client_handler)) != NULL);
+  nc->user_data = &received;
+  start = ns_time();
+  poll_until(&mgr, 2000, c_int_eq, &received, (void *) (intptr_t)(2 * size));
+  ASSERT_EQ(received, 2 * size);
+  ASSERT(ns_time() - start > 0.1);
+
+  /* Limits can be lifted at runtime */
+  ASSERT_EQ(ns_set_bandwidth(ls, NS_BANDWIDTH_SEND, 0, 0), 0);
+  size = 256 * 1024;
+  received = 0;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7797", bw_client_handler)) != NULL);
+  nc->user_data = &received;
+  poll_until(&mgr, 2000, c_int_eq, &received, (void *) (intptr_t) size);
+  ASSERT_EQ(received, size);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+
+static void recv_budget_handler(struct ns_connection *nc, int ev, void *p) {
+  if (ev == NS_RECV) {
+    *(int *) nc->user_data += *(int *) p;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+/* Applies backpressure: never consumes what it receives */
+static void recv_keep_handler(struct ns_connection *nc, int ev, void *p) {
+  if (ev == NS_RECV) *(int *) nc->user_data += *(int *) p;
+}
+
+static const char *test_recv_budget(void) {
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  char buf[1024];
+  int i, prev, size = 128 * 1024, received = 0, full_polls = 0;
+  double start;
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7798", recv_budget_handler)) != NULL);
+  ls->user_data = &received;
+  ls->recv_budget = 4096;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7798", NULL)) != NULL);
+  memset(buf, 'x', sizeof(buf));
+  for (i = 0; i < size; i += sizeof(buf)) {
+    ns_send(nc, buf, sizeof(buf));
+  }
+
+  /* A bulk sender gets no more than its budget per poll */
+  for (i = 0; i < 1000 && received < size; i++) {
+    prev = received;
+    ns_mgr_poll(&mgr, 100);
+    ASSERT(received - prev <= 4096);
+    if (received - prev == 4096) full_polls++;
+  }
+  ASSERT_EQ(received, size);
+  ASSERT(full_polls > 0);
+
+  /* Out of budget with a full buffer: nothing to read, the poll waits */
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7802", recv_keep_handler)) != NULL);
+  ls->user_data = &received;
+  ls->recv_budget = 1024;
+  ls->recv_mbuf_limit = 2048;
+  received = 0;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7802", NULL)) != NULL);
+  for (i = 0; i < 10; i++) ns_send(nc, buf, sizeof(buf));
+  poll_until(&mgr, 1000, c_int_eq, &received, (void *) 2048);
+  ASSERT_EQ(received, 2048);
+  start = ns_time();
+  for (i = 0; i < 3; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT(ns_time() - start > 0.1);
+  ASSERT_EQ(received, 2048);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+
+#ifdef NS_ENABLE_SEND_FILE
+static void send_file_srv_handler(struct ns_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == NS_ACCEPT) {
+    int fd = open((const char *) nc->user_data, O_RDONLY);
+    ns_printf(nc, "%s", "head:");
+    if (ns_send_file(nc, fd, 1000, 50000) != 0 ||
+        ns_send_file(nc, fd, 0, 1) != -1) {
+      close(fd);
+    }
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+struct send_file_res {
+  struct mbuf got;
+  int closed;
+};
+
+static void send_file_clnt_handler(struct ns_connection *nc, int ev, void *p) {
+  struct send_file_res *res = (struct send_file_res *) nc->user_data;
+  (void) p;
+  if (ev == NS_RECV) {
+    mbuf_append(&res->got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == NS_CLOSE) {
+    res->closed = 1;
+  }
+}
+
+static const char *test_send_file(void) {
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  const char *path = "send_file.tmp";
+  char data[60000];
+  struct send_file_res res;
+  FILE *fp;
+  int i;
+
+  for (i = 0; i < (int) sizeof(data); i++) data[i] = (char) (i * 7);
+  ASSERT((fp = fopen(path, "wb")) != NULL);
+  ASSERT_EQ(fwrite(data, 1, sizeof(data), fp), sizeof(data));
+  fclose(fp);
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, "127.0.0.1:7801", send_file_srv_handler)) !=
+         NULL);
+  nc->user_data = (void *) path;
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7801", send_file_clnt_handler)) !=
+         NULL);
+  mbuf_init(&res.got, 0);
+  res.closed = 0;
+  nc->user_data = &res;
+  poll_until(&mgr, 5000, c_int_eq, &res.closed, (void *) 1);
+  ASSERT_EQ(res.closed, 1);
+  /* File data follows what was buffered before it */
+  ASSERT_EQ(res.got.len, 5 + 50000);
+  ASSERT(memcmp(res.got.buf, "head:", 5) == 0);
+  ASSERT(memcmp(res.got.buf + 5, data + 1000, 50000) == 0);
+
+  mbuf_free(&res.got);
+  ns_mgr_free(&mgr);
+  remove(path);
+  return NULL;
+}
+#endif
+
+struct tcp_opts_res {
+  struct ns_connection *accepted;
+  int num_accepted;
+};
+
+static void tcp_opts_handler(struct ns_connection *nc, int ev, void *p) {
+  struct tcp_opts_res *res = (struct tcp_opts_res *) nc->user_data;
+  (void) p;
+  if (ev == NS_ACCEPT) {
+    res->accepted = nc;
+    res->num_accepted++;
+  }
+}
+
+static int get_nodelay(struct ns_connection *nc) {
+  int on = -1;
+  socklen_t len = sizeof(on);
+  getsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, &len);
+  return on != 0;
+}
+
+static const char *test_tcp_opts(void) {
+  char addr[100] = "127.0.0.1:0";
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc, *accepted;
+  struct tcp_opts_res res;
+
+  memset(&res, 0, sizeof(res));
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, addr, tcp_opts_handler)) != NULL);
+  ls->user_data = &res;
+  ns_sock_to_str(ls->sock, addr, sizeof(addr), 3);
+  ASSERT((nc = ns_connect(&mgr, addr, tcp_opts_handler)) != NULL);
+  nc->user_data = &res;
+  poll_until(&mgr, 1000, c_int_eq, &res.num_accepted, (void *) 1);
+  ASSERT_EQ(res.num_accepted, 1);
+  accepted = res.accepted;
+
+  /* Nagle is off by default on both ends */
+  ASSERT_EQ(get_nodelay(nc), 1);
+  ASSERT_EQ(get_nodelay(accepted), 1);
+  ASSERT_EQ(ns_set_nodelay(accepted, 0), 0);
+  ASSERT_EQ(get_nodelay(accepted), 0);
+
+  ASSERT_EQ(ns_set_cork(nc, 1), 0);
+  ASSERT_EQ(ns_set_cork(nc, 0), 0);
+  ASSERT_EQ(ns_set_cork(ls, 1), -1);
+  ASSERT_EQ(ns_set_nodelay(ls, 1), -1);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+
+#ifdef TCP_FASTOPEN_CONNECT
+static const char *test_tcp_fastopen(void) {
+  char addr[100] = "127.0.0.1:0", buf[100];
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct ns_bind_opts bopts;
+  struct ns_connect_opts copts;
+  socklen_t len;
+  int i, val;
+
+  memset(&bopts, 0, sizeof(bopts));
+  memset(&copts, 0, sizeof(copts));
+  bopts.flags = copts.flags = NSF_TCP_FASTOPEN;
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind_opt(&mgr, addr, eh1, bopts)) != NULL);
+  len = sizeof(val);
+  ASSERT_EQ(getsockopt(nc->sock, IPPROTO_TCP, TCP_FASTOPEN, &val, &len), 0);
+  ASSERT(val > 0);
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+
+  /* The second connection can use the cookie got by the first one */
+  for (i = 0; i < 2; i++) {
+    ASSERT((nc = ns_connect_opt(&mgr, addr, eh1, copts)) != NULL);
+    len = sizeof(val);
+    ASSERT_EQ(getsockopt(nc->sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val,
+                         &len),
+              0);
+    ASSERT_EQ(val, 1);
+    buf[0] = '\0';
+    nc->user_data = buf;
+    poll_until(&mgr, 1000, c_str_ne, buf, (void *) "");
+    ASSERT_STREQ(buf, "ok!");
+  }
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
+#ifdef NS_ENABLE_SPLICE
+#define SPLICE_DATA_SIZE 3000000
+
+struct splice_res {
+  char upstream[100];
+  int spliced;     /* Bytes received by the proxy */
+  int buffered;    /* Bytes the proxy got in recv_mbuf */
+  int echoed;      /* Bytes received by the client */
+  int num_closed;  /* Proxied connections closed */
+  struct mbuf got; /* What the client got back */
+};
+
+static void splice_echo_handler(struct ns_connection *nc, int ev, void *p) {
+  struct mbuf *io = &nc->recv_mbuf;
+  (void) p;
+  if (ev == NS_RECV) {
+    ns_send(nc, io->buf, io->len);
+    mbuf_remove(io, io->len);
+  }
+}
+
+static void splice_proxy_handler(struct ns_connection *nc, int ev, void *p) {
+  struct splice_res *res = (struct splice_res *) nc->user_data;
+  struct ns_connection *up;
+
+  if (ev == NS_ACCEPT) {
+    up = ns_connect(nc->mgr, res->upstream, splice_proxy_handler);
+    up->user_data = res;
+    /* The peer is still connecting, which is fine */
+    if (ns_splice(nc, up) != 0 || ns_splice(nc, up) != -1) {
+      nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    }
+  } else if (ev == NS_RECV) {
+    res->spliced += *(int *) p;
+    res->buffered += (int) nc->recv_mbuf.len;
+  } else if (ev == NS_CLOSE) {
+    res->num_closed++;
+  }
+}
+
+static void splice_client_handler(struct ns_connection *nc, int ev, void *p) {
+  struct splice_res *res = (struct splice_res *) nc->user_data;
+  struct mbuf *io = &nc->recv_mbuf;
+  (void) p;
+  if (ev == NS_RECV) {
+    mbuf_append(&res->got, io->buf, io->len);
+    mbuf_remove(io, io->len);
+    res->echoed = (int) res->got.len;
+  }
+}
+
+static const char *test_splice(void) {
+  char addr[100] = "127.0.0.1:0";
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  struct splice_res res;
+  char *data;
+  int i;
+
+  memset(&res, 0, sizeof(res));
+  strcpy(res.upstream, addr);
+  mbuf_init(&res.got, 0);
+  ASSERT((data = (char *) malloc(SPLICE_DATA_SIZE)) != NULL);
+  for (i = 0; i < SPLICE_DATA_SIZE; i++) data[i] = (char) (i * 7 + i / 251);
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((ls = ns_bind(&mgr, res.upstream, splice_echo_handler)) != NULL);
+  ns_sock_to_str(ls->sock, res.upstream, sizeof(res.upstream), 3);
+  ASSERT((ls = ns_bind(&mgr, addr, splice_proxy_handler)) != NULL);
+  ls->user_data = &res;
+  ns_sock_to_str(ls->sock, addr, sizeof(addr), 3);
+  ASSERT_EQ(ns_splice(ls, ls), -1);
+
+  /* The client sends it all at once, pipes fill up both ways */
+  ASSERT((nc = ns_connect(&mgr, addr, splice_client_handler)) != NULL);
+  nc->user_data = &res;
+  ns_send(nc, data, SPLICE_DATA_SIZE);
+  poll_until(&mgr, 10000, c_int_eq, &res.echoed,
+             (void *) (intptr_t) SPLICE_DATA_SIZE);
+  ASSERT_EQ(res.echoed, SPLICE_DATA_SIZE);
+  ASSERT(memcmp(res.got.buf, data, SPLICE_DATA_SIZE) == 0);
+  ASSERT_EQ(res.spliced, 2 * SPLICE_DATA_SIZE);
+  ASSERT_EQ(res.buffered, 0);
+
+  /* Closing the client closes both proxied connections */
+  ASSERT_EQ(res.num_closed, 0);
+  nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  poll_until(&mgr, 1000, c_int_eq, &res.num_closed, (void *) 2);
+  ASSERT_EQ(res.num_closed, 2);
+
+  mbuf_free(&res.got);
+  free(data);
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
+#ifdef NS_ENABLE_ZEROCOPY
+#define ZEROCOPY_DATA_SIZE 1000000
+
+struct zerocopy_res {
+  char *data;
+  int num_sends;  /* NS_SEND events on the server side */
+  int taken_over; /* The output buffer was taken by the first send */
+  int closed;
+  struct mbuf got;
+};
+
+static void zerocopy_srv_handler(struct ns_connection *nc, int ev, void *p) {
+  struct zerocopy_res *res = (struct zerocopy_res *) nc->user_data;
+  (void) p;
+  if (ev == NS_ACCEPT) {
+    ns_send(nc, res->data, ZEROCOPY_DATA_SIZE);
+  } else if (ev == NS_SEND && res->num_sends++ == 0) {
+    /* Goes to a new buffer, after what's in flight */
+    res->taken_over = nc->send_mbuf.len == 0;
+    ns_send(nc, "tail", 4);
+    nc->flags |= NSF_SEND_AND_CLOSE;
+  }
+}
+
+static void zerocopy_clnt_handler(struct ns_connection *nc, int ev, void *p) {
+  struct zerocopy_res *res = (struct zerocopy_res *) nc->user_data;
+  (void) p;
+  if (ev == NS_RECV) {
+    mbuf_append(&res->got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == NS_CLOSE) {
+    res->closed = 1;
+  }
+}
+
+static const char *test_zerocopy(void) {
+  char addr[100] = "127.0.0.1:0";
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct zerocopy_res res;
+  int i;
+
+  memset(&res, 0, sizeof(res));
+  mbuf_init(&res.got, 0);
+  ASSERT((res.data = (char *) malloc(ZEROCOPY_DATA_SIZE)) != NULL);
+  for (i = 0; i < ZEROCOPY_DATA_SIZE; i++) res.data[i] = (char) (i * 11);
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, "udp://127.0.0.1:0", eh1)) != NULL);
+  ASSERT_EQ(ns_set_zerocopy(nc, 16384), -1);
+  ASSERT((nc = ns_bind(&mgr, addr, zerocopy_srv_handler)) != NULL);
+  ASSERT_EQ(ns_set_zerocopy(nc, 16384), 0);
+  nc->user_data = &res;
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+  ASSERT((nc = ns_connect(&mgr, addr, zerocopy_clnt_handler)) != NULL);
+  nc->user_data = &res;
+
+  /* Closing waits for the completions */
+  poll_until(&mgr, 5000, c_int_eq, &res.closed, (void *) 1);
+  ASSERT_EQ(res.closed, 1);
+  ASSERT_EQ(res.taken_over, 1);
+  ASSERT_EQ(res.got.len, ZEROCOPY_DATA_SIZE + 4);
+  ASSERT(memcmp(res.got.buf, res.data, ZEROCOPY_DATA_SIZE) == 0);
+  ASSERT(memcmp(res.got.buf + ZEROCOPY_DATA_SIZE, "tail", 4) == 0);
+
+  mbuf_free(&res.got);
+  free(res.data);
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
+#ifdef NS_ENABLE_UDP_GSO
+#define UDP_GSO_NUM 50
+
+struct udp_gso_res {
+  int num_received; /* By the server */
+  int num_echoed;   /* Received back by the client */
+  int num_errors;   /* Datagrams that don't look as sent */
+};
+
+static int udp_gso_size(int i) {
+  return i == UDP_GSO_NUM - 2 ? 30 : 100; /* A short one ends a batch */
+}
+
+static void udp_gso_check(struct udp_gso_res *res, struct mbuf *io, int n,
+                          int i) {
+  if (n != (int) io->len || n != udp_gso_size(i) ||
+      (unsigned char) io->buf[0] != i || io->buf[n - 1] != io->buf[0]) {
+    res->num_errors++;
+  }
+}
+
+static void udp_gso_srv_handler(struct ns_connection *nc, int ev, void *p) {
+  struct udp_gso_res *res = (struct udp_gso_res *) nc->user_data;
+  if (ev == NS_RECV) {
+    udp_gso_check(res, &nc->recv_mbuf, *(int *) p, res->num_received++);
+    ns_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+  }
+}
+
+static void udp_gso_clnt_handler(struct ns_connection *nc, int ev, void *p) {
+  struct udp_gso_res *res = (struct udp_gso_res *) nc->user_data;
+  if (ev == NS_RECV) {
+    udp_gso_check(res, &nc->recv_mbuf, *(int *) p, res->num_echoed++);
+  }
+}
+
+static const char *test_udp_gso(void) {
+  char addr[100] = "udp://127.0.0.1:0", buf[100];
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct udp_gso_res res;
+  int i;
+
+  memset(&res, 0, sizeof(res));
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, addr, udp_gso_srv_handler)) != NULL);
+  nc->user_data = &res;
+  ns_sock_to_str(nc->sock, addr + 6, sizeof(addr) - 6, 3);
+  ASSERT((nc = ns_connect(&mgr, addr, udp_gso_clnt_handler)) != NULL);
+  nc->user_data = &res;
+
+  for (i = 0; i < UDP_GSO_NUM; i++) {
+    memset(buf, i, sizeof(buf));
+    ASSERT_EQ(ns_send(nc, buf, udp_gso_size(i)), udp_gso_size(i));
+  }
+  for (i = 0; i < 100 && res.num_echoed < UDP_GSO_NUM; i++) {
+    ns_mgr_poll(&mgr, 100);
+  }
+  ASSERT_EQ(res.num_received, UDP_GSO_NUM);
+  ASSERT_EQ(res.num_echoed, UDP_GSO_NUM);
+  ASSERT_EQ(res.num_errors, 0);
+  /* Batches both ways, rather than a datagram per poll */
+  if (nc->udp_offload != NULL) ASSERT(i <= 5);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+#endif
+
 /* TODO(mkm) port these test cases to the new async parse_address */
 static const char *test_parse_address(void) {
   static const char *valid[] = {
@@ -485,6 +1595,30 @@ static const char *test_alloc_vprintf(void) {
   return NULL;
 }
 
+static const char *test_mbuf_printf(void) {
+  struct mbuf io;
+  char big[1000];
+
+  mbuf_init(&io, 0);
+  ASSERT_EQ(ns_mbuf_printf(&io, "%d %s", 123, "abc"), 7);
+  ASSERT_EQ(io.len, 7);
+  ASSERT(memcmp(io.buf, "123 abc", 7) == 0);
+
+  /* Doesn't fit in the reserved space */
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  ASSERT_EQ(ns_mbuf_printf(&io, "[%s]", big), (int) sizeof(big) + 1);
+  ASSERT_EQ(io.len, 7 + sizeof(big) + 1);
+  ASSERT(memcmp(io.buf + 7, "[xxx", 4) == 0);
+  ASSERT(memcmp(io.buf + io.len - 2, "x]", 2) == 0);
+
+  ASSERT_EQ(ns_mbuf_printf(&io, "%s", ""), 0);
+  ASSERT_EQ(io.len, 7 + sizeof(big) + 1);
+
+  mbuf_free(&io);
+  return NULL;
+}
+
 static const char *test_socketpair(void) {
   sock_t sp[2];
   static const char foo[] = "hi there";
@@ -798,6 +1932,172 @@ static const char *test_udp(void) {
   return NULL;
 }
 
+#ifdef NS_ENABLE_UNIX_SOCKETS
+static void unix_srv_handler(struct ns_connection *nc, int ev, void *p) {
+  struct ns_peer_cred *cred = (struct ns_peer_cred *) nc->user_data;
+  (void) p;
+
+  if (ev == NS_ACCEPT) {
+    ns_get_peer_cred(nc, cred);
+  } else if (ev == NS_RECV) {
+    ns_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static void unix_clnt_handler(struct ns_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == NS_RECV) {
+    memcpy(nc->user_data, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static const char *test_unix_sockets(void) {
+  struct ns_mgr mgr;
+  struct ns_connection *ls, *nc;
+  struct ns_peer_cred cred = {0, -1, -1};
+  struct udp_res res;
+  union socket_address sa;
+  char path[100], addr[120], buf[120], host[50];
+  int proto;
+  sock_t sock;
+
+  ASSERT(ns_parse_address("unixgram://@x", &sa, &proto, host, 50) > 0);
+  ASSERT_EQ(proto, SOCK_DGRAM);
+  ASSERT_EQ(sa.sa.sa_family, AF_UNIX);
+  ASSERT(memcmp(sa.un.sun_path, "\0x", 3) == 0);
+  ASSERT_EQ(ns_parse_address("unix://", &sa, &proto, host, 50), -1);
+  ASSERT_EQ(ns_parse_address("unix://@", &sa, &proto, host, 50), -1);
+
+  /* A socket file left behind doesn't get in the way */
+  snprintf(path, sizeof(path), "/tmp/fossa_ut_%d.sock", (int) getpid());
+  snprintf(addr, sizeof(addr), "unix://%s", path);
+  ASSERT(ns_parse_address(addr, &sa, &proto, host, 50) > 0);
+  ASSERT_EQ(proto, SOCK_STREAM);
+  ASSERT((sock = socket(AF_UNIX, SOCK_STREAM, 0)) != INVALID_SOCKET);
+  ASSERT_EQ(bind(sock, &sa.sa, sizeof(sa.un)), 0);
+  closesocket(sock);
+
+  memset(&res, 0, sizeof(res));
+  ns_mgr_init(&mgr, &res);
+  ASSERT((ls = ns_bind(&mgr, addr, unix_srv_handler)) != NULL);
+  ls->user_data = &cred;
+  ns_sock_addr_to_str(&ls->sa, buf, sizeof(buf), NS_SOCK_STRINGIFY_IP);
+  ASSERT_STREQ(buf, path);
+  /* But a live one does */
+  ASSERT(ns_bind(&mgr, addr, unix_srv_handler) == NULL);
+
+  ASSERT((nc = ns_connect(&mgr, addr, unix_clnt_handler)) != NULL);
+  nc->user_data = res.buf_clnt;
+  ns_printf(nc, "%s", "hi!");
+  poll_until(&mgr, 1000, c_str_ne, res.buf_clnt, (void *) "");
+  ASSERT_STREQ(res.buf_clnt, "hi!");
+  ASSERT_EQ(cred.uid, (int) getuid());
+  ASSERT_EQ(cred.gid, (int) getgid());
+#ifdef __linux__
+  ASSERT_EQ(cred.pid, (int) getpid());
+
+  /* Datagrams, abstract namespace */
+  memset(&res, 0, sizeof(res));
+  snprintf(addr, sizeof(addr), "unixgram://@fossa_ut_%d", (int) getpid());
+  ASSERT(ns_bind(&mgr, addr, eh3_srv) != NULL);
+  ASSERT((nc = ns_connect(&mgr, addr, eh3_clnt)) != NULL);
+  ns_printf(nc, "%s", "boo!");
+  poll_until(&mgr, 1000, c_str_ne, res.buf_clnt, (void *) "");
+  ASSERT_STREQ(res.buf_srv, "boo!");
+  ASSERT_STREQ(res.buf_clnt, "boo!");
+#endif
+
+  ns_mgr_free(&mgr);
+  unlink(path);
+  return NULL;
+}
+#endif
+
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(NS_ENABLE_THREADS)
+struct hot_restart_data {
+  struct ns_mgr mgr;
+  const char *ctl;
+  int taken; /* Result of ns_hot_restart_takeover() */
+};
+
+static void *hot_restart_thread(void *param) {
+  struct hot_restart_data *d = (struct hot_restart_data *) param;
+  d->taken = ns_hot_restart_takeover(&d->mgr, d->ctl);
+  return NULL;
+}
+
+static void hot_restart_handler(struct ns_connection *nc, int ev, void *p) {
+  if (ev == NS_HANDOFF) {
+    *(int *) nc->mgr->user_data = *(int *) p;
+  }
+}
+
+static const char *test_hot_restart(void) {
+  struct ns_mgr mgr;
+  struct hot_restart_data d;
+  struct ns_connection *ls, *nc, *ctl;
+  char ctl_addr[100], buf[20] = "";
+  sock_t inherited[2];
+  int handed_off = -1;
+
+  snprintf(ctl_addr, sizeof(ctl_addr), "unix:///tmp/fossa_ut_%d.ctl",
+           (int) getpid());
+  ns_mgr_init(&mgr, &handed_off);
+  ASSERT(ns_hot_restart_takeover(&mgr, ctl_addr) == 0);
+  ASSERT((ls = ns_bind(&mgr, "127.0.0.1:7799", unix_srv_handler)) != NULL);
+  ASSERT(ns_hot_restart_listen(&mgr, ctl_addr, hot_restart_handler) != NULL);
+  ASSERT(ns_hot_restart_listen(&mgr, "127.0.0.1:7800", NULL) == NULL);
+
+  /* Connected before the handoff, served by the old manager till the end */
+  ASSERT((nc = ns_connect(&mgr, "127.0.0.1:7799", unix_clnt_handler)) != NULL);
+  nc->user_data = buf;
+  ns_printf(nc, "%s", "hi!");
+  poll_until(&mgr, 1000, c_str_ne, buf, (void *) "");
+  ASSERT_STREQ(buf, "hi!");
+  memset(buf, 0, sizeof(buf));
+
+  ns_mgr_init(&d.mgr, NULL);
+  d.ctl = ctl_addr;
+  d.taken = -2;
+  ns_start_thread(hot_restart_thread, &d);
+  poll_until(&mgr, 1000, c_int_ne, &handed_off, (void *) -1);
+  ASSERT_EQ(handed_off, 2);
+  ASSERT_EQ(d.taken, 2);
+  ASSERT_EQ(d.mgr.num_inherited, 2);
+  memcpy(inherited, d.mgr.inherited, sizeof(inherited));
+
+  /* Listeners are gone from the old manager, the client isn't */
+  for (ls = ns_next(&mgr, NULL); ls != NULL; ls = ns_next(&mgr, ls)) {
+    ASSERT(!(ls->flags & NSF_LISTENING));
+  }
+  ns_printf(nc, "%s", "old");
+  poll_until(&mgr, 1000, c_str_ne, buf, (void *) "");
+  ASSERT_STREQ(buf, "old");
+
+  /* The new manager reuses the very same sockets */
+  ASSERT((ls = ns_bind(&d.mgr, "127.0.0.1:7799", unix_srv_handler)) != NULL);
+  ASSERT(ls->sock == inherited[0] || ls->sock == inherited[1]);
+  ASSERT((ctl = ns_hot_restart_listen(&d.mgr, ctl_addr, NULL)) != NULL);
+  ASSERT(ctl->sock == inherited[0] || ctl->sock == inherited[1]);
+  ASSERT_EQ(d.mgr.num_inherited, 0);
+
+  memset(buf, 0, sizeof(buf));
+  ASSERT((nc = ns_connect(&d.mgr, "127.0.0.1:7799", unix_clnt_handler)) !=
+         NULL);
+  nc->user_data = buf;
+  ns_printf(nc, "%s", "new");
+  poll_until(&d.mgr, 1000, c_str_ne, buf, (void *) "");
+  ASSERT_STREQ(buf, "new");
+
+  ns_mgr_free(&d.mgr);
+  ns_mgr_free(&mgr);
+  unlink(ctl_addr + 7);
+  return NULL;
+}
+#endif
+
 static const char *test_parse_http_message(void) {
   static const char *a = "GET / HTTP/1.0\n\n";
   static const char *b = "GET /blah HTTP/1.0\r\nFoo:  bar  \r\n\r\n";
@@ -1298,18 +2598,102 @@ static const char *test_http_range(void) {
   ASSERT(strstr(buf, "Content-Range: bytes 300-311/312\r\n") != 0);
   ASSERT_STREQ(buf + strlen(buf) - 14, "\r\nis disease.\n");
 
-  /* Fetch past EOF, must trigger 416 response */
-  fetch_http(buf, "%s", "GET /data/range.txt HTTP/1.0\nRange: bytes=1000-\n\n");
-  ASSERT_STREQ_NZ(buf, "HTTP/1.1 416");
-  ASSERT(strstr(buf, "Content-Length: 0\r\n") != 0);
-  ASSERT(strstr(buf, "Content-Range: bytes */312\r\n") != 0);
+  /* Fetch past EOF, must trigger 416 response */
+  fetch_http(buf, "%s", "GET /data/range.txt HTTP/1.0\nRange: bytes=1000-\n\n");
+  ASSERT_STREQ_NZ(buf, "HTTP/1.1 416");
+  ASSERT(strstr(buf, "Content-Length: 0\r\n") != 0);
+  ASSERT(strstr(buf, "Content-Range: bytes */312\r\n") != 0);
+
+  /* Request range past EOF, must trigger 416 response */
+  fetch_http(buf, "%s", "GET /data/range.txt HTTP/1.0\nRange: bytes=0-312\n\n");
+  ASSERT_STREQ_NZ(buf, "HTTP/1.1 416");
+
+  return NULL;
+}
+
+#ifdef NS_ENABLE_THREADS
+#define FILE_IO_SIZE (1024 * 1024 + 12345)
+
+/* res[0]: replies, res[1]: status of the first one, res[2]: data is ok */
+static void file_io_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct http_message *hm = (struct http_message *) ev_data;
+  int *res = (int *) nc->user_data;
+  size_t i, start;
+
+  if (ev != NS_HTTP_REPLY) return;
+  start = hm->resp_code == 206 ? 1000 : 0;
+  if (res[0]++ == 0) res[1] = hm->resp_code;
+  if (hm->body.len == 0) return;
+  res[2] = 1;
+  for (i = 0; i < hm->body.len; i++) {
+    if (hm->body.p[i] != (char) ((start + i) % 251)) res[2] = 0;
+  }
+  nc->flags |= NSF_CLOSE_IMMEDIATELY;
+}
+
+static size_t s_file_io_max_recv;
+
+/* Reading stops while an upload is being written */
+static void file_io_server(struct ns_connection *nc, int ev, void *ev_data) {
+  if (ev == NS_RECV && nc->proto_data != NULL &&
+      nc->recv_mbuf.len > s_file_io_max_recv) {
+    s_file_io_max_recv = nc->recv_mbuf.len;
+  }
+  cb1(nc, ev, ev_data);
+}
+
+static const char *test_http_file_io(void) {
+  char addr[100] = "127.0.0.1:0", *data;
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  int i, res[3] = {0, 0, 0};
+  ns_stat_t st;
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT_EQ(ns_offload_file_io(&mgr, 0), -1);
+  ASSERT_EQ(ns_offload_file_io(&mgr, 2), 0);
+  ASSERT_EQ(ns_offload_file_io(&mgr, 2), -1);
+  ASSERT((nc = ns_bind(&mgr, addr, file_io_server)) != NULL);
+  ns_set_protocol_http_websocket(nc);
+  ns_sock_to_str(nc->sock, addr, sizeof(addr), 3);
+  remove("./data/dav/io.bin");
+  s_file_io_max_recv = 0;
 
-  /* Request range past EOF, must trigger 416 response */
-  fetch_http(buf, "%s", "GET /data/range.txt HTTP/1.0\nRange: bytes=0-312\n\n");
-  ASSERT_STREQ_NZ(buf, "HTTP/1.1 416");
+  /* Upload, followed by a download that waits for the writes to finish */
+  ASSERT((data = (char *) malloc(FILE_IO_SIZE)) != NULL);
+  for (i = 0; i < FILE_IO_SIZE; i++) data[i] = (char) (i % 251);
+  ASSERT((nc = ns_connect(&mgr, addr, file_io_handler)) != NULL);
+  ns_set_protocol_http_websocket(nc);
+  nc->user_data = res;
+  ns_printf(nc, "PUT /io.bin HTTP/1.1\r\nContent-Length: %d\r\n\r\n",
+            FILE_IO_SIZE);
+  ns_send(nc, data, FILE_IO_SIZE);
+  ns_printf(nc, "%s", "GET /data/dav/io.bin HTTP/1.1\r\n\r\n");
+  free(data);
+  poll_until(&mgr, 10000, c_int_eq, &res[0], (void *) 2);
+  ASSERT_EQ(res[0], 2);
+  ASSERT_EQ(res[1], 201);
+  ASSERT_EQ(res[2], 1);
+  ASSERT(ns_stat("./data/dav/io.bin", &st) == 0);
+  ASSERT_EQ(st.st_size, FILE_IO_SIZE);
+  ASSERT(s_file_io_max_recv < NS_HTTP_READ_AHEAD + 1024);
+
+  /* Range */
+  memset(res, 0, sizeof(res));
+  ASSERT((nc = ns_connect(&mgr, addr, file_io_handler)) != NULL);
+  ns_set_protocol_http_websocket(nc);
+  nc->user_data = res;
+  ns_printf(nc, "%s",
+            "GET /data/dav/io.bin HTTP/1.1\r\nRange: bytes=1000-99999\r\n\r\n");
+  poll_until(&mgr, 10000, c_int_eq, &res[0], (void *) 1);
+  ASSERT_EQ(res[1], 206);
+  ASSERT_EQ(res[2], 1);
 
+  ns_mgr_free(&mgr);
+  remove("./data/dav/io.bin");
   return NULL;
 }
+#endif
 
 static void cb3(struct ns_connection *nc, int ev, void *ev_data) {
   struct websocket_message *wm = (struct websocket_message *) ev_data;
@@ -1680,7 +3064,7 @@ static void mqtt_eh(struct ns_connection *nc, int ev, void *ev_data) {
 
 static const char *test_mqtt_parse_mqtt(void) {
   struct ns_connection *nc = (struct ns_connection *) calloc(1, sizeof(*nc));
-  char msg[] = {(char) (NS_MQTT_CMD_SUBACK << 4), 2};
+  char msg[] = {(char) (NS_MQTT_CMD_SUBACK << 4), 2, 0, 1};
   char *long_msg;
   int check = 0;
   int num_bytes = sizeof(msg);
@@ -1705,7 +3089,7 @@ static const char *test_mqtt_parse_mqtt(void) {
   memcpy(&long_msg[3], "\0\006/topic", 8);
   memset(&long_msg[11], 'A', mqtt_long_payload_len);
 
-  num_bytes = 2 + rest_len;
+  num_bytes = 3 + rest_len;
   mbuf_append(&nc->recv_mbuf, long_msg, num_bytes);
   nc->proto_handler(nc, NS_RECV, &num_bytes);
 
@@ -1723,7 +3107,7 @@ static const char *test_mqtt_parse_mqtt(void) {
   memcpy(&long_msg[4], "\0\006/topic", 8);
   memset(&long_msg[12], 'A', mqtt_very_long_payload_len);
 
-  num_bytes = 2 + rest_len;
+  num_bytes = 4 + rest_len;
   mbuf_append(&nc->recv_mbuf, long_msg, num_bytes);
   nc->proto_handler(nc, NS_RECV, &num_bytes);
 
@@ -1812,6 +3196,246 @@ static const char *test_mqtt_broker(void) {
 }
 #endif /* NS_ENABLE_MQTT_BROKER */
 
+static const char *test_json_writer(void) {
+  struct ns_json_writer w;
+  struct mbuf io;
+  char big[5000];
+  int i;
+
+  mbuf_init(&io, 0);
+  ns_json_init(&w, &io);
+  ns_json_begin_object(&w);
+  ns_json_key(&w, "a\"b");
+  ns_json_string(&w, "x\\y\n\x01\"z", 7);
+  ns_json_key(&w, "ints");
+  ns_json_begin_array(&w);
+  ns_json_int(&w, 0);
+  ns_json_int(&w, -7);
+  ns_json_int(&w, 1234567);
+  ns_json_int(&w, INT64_MAX);
+  ns_json_int(&w, INT64_MIN);
+  ns_json_end_array(&w);
+  ns_json_key(&w, "doubles");
+  ns_json_begin_array(&w);
+  ns_json_double(&w, 3);
+  ns_json_double(&w, -0.5);
+  ns_json_double(&w, 0.1);
+  ns_json_double(&w, 1e300);
+  ns_json_double(&w, 1.0 / 3);
+  ns_json_double(&w, strtod("nan", NULL));
+  ns_json_end_array(&w);
+  ns_json_key(&w, "empty");
+  ns_json_begin_object(&w);
+  ns_json_end_object(&w);
+  ns_json_key(&w, "misc");
+  ns_json_begin_array(&w);
+  ns_json_bool(&w, 1);
+  ns_json_bool(&w, 0);
+  ns_json_null(&w);
+  ns_json_raw(&w, "[1,2]", 5);
+  ns_json_begin_array(&w);
+  ns_json_end_array(&w);
+  ns_json_end_array(&w);
+  ns_json_end_object(&w);
+  ASSERT_EQ(w.error, 0);
+  ASSERT_EQ(w.depth, 0);
+  mbuf_append(&io, "", 1);
+  ASSERT_STREQ(io.buf,
+               "{\"a\\\"b\":\"x\\\\y\\n\\u0001\\\"z\","
+               "\"ints\":[0,-7,1234567,9223372036854775807,"
+               "-9223372036854775808],"
+               "\"doubles\":[3,-0.5,0.1,1e+300,0.33333333333333331,null],"
+               "\"empty\":{},\"misc\":[true,false,null,[1,2],[]]}");
+
+  /* Long strings aren't truncated */
+  io.len = 0;
+  memset(big, 'x', sizeof(big));
+  big[100] = '\t';
+  ns_json_string(&w, big, sizeof(big));
+  ASSERT_EQ(io.len, sizeof(big) + 1 + 2);
+  ASSERT(memcmp(io.buf + 100, "x\\tx", 4) == 0);
+
+  /* Nesting limits */
+  io.len = 0;
+  ns_json_init(&w, &io);
+  ns_json_end_array(&w);
+  ASSERT_EQ(w.error, 1);
+  ns_json_init(&w, &io);
+  for (i = 0; i <= NS_JSON_MAX_DEPTH; i++) {
+    ns_json_begin_array(&w);
+  }
+  ASSERT_EQ(w.error, 1);
+  ASSERT_EQ(w.depth, NS_JSON_MAX_DEPTH);
+
+  mbuf_free(&io);
+  return NULL;
+}
+
+static int json_find_matches(const char *buf, size_t len, const char *path) {
+  struct json_token *toks = parse_json2(buf, len), *t;
+  struct ns_str v;
+  int type = ns_json_find(buf, len, path, &v), ok;
+
+  t = find_json_token(toks, path);
+  ok = t == NULL ? type == JSON_TYPE_EOF
+                 : (int) t->type == type && t->ptr == v.p &&
+                       t->len == (int) v.len;
+  free(toks);
+  return ok;
+}
+
+static const char *test_json_find(void) {
+  struct ns_json_writer w;
+  struct mbuf io;
+  struct ns_str v;
+  char path[50], name[50];
+  const char *s = " { \"a\" : [ 1 , { \"b\\\"\" : \"x]}\\\\\" } , [ ] ] ,"
+                  "\"c\":{},\"d\":true}";
+  int i;
+
+  /* Multi-KB document, with escapes in long strings */
+  mbuf_init(&io, 0);
+  ns_json_init(&w, &io);
+  ns_json_begin_object(&w);
+  ns_json_key(&w, "items");
+  ns_json_begin_array(&w);
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "item \"%d\" with a long {name}", i);
+    ns_json_begin_object(&w);
+    ns_json_key(&w, "id");
+    ns_json_int(&w, i);
+    ns_json_key(&w, "name");
+    ns_json_string(&w, name, strlen(name));
+    ns_json_key(&w, "tags");
+    ns_json_begin_array(&w);
+    ns_json_string(&w, "a\\[b", 4);
+    ns_json_double(&w, i / 4.0);
+    ns_json_null(&w);
+    ns_json_end_array(&w);
+    ns_json_end_object(&w);
+  }
+  ns_json_end_array(&w);
+  ns_json_key(&w, "total");
+  ns_json_int(&w, 100);
+  ns_json_end_object(&w);
+  ASSERT(io.len > 5000);
+
+  for (i = 0; i < 100; i += 33) {
+    snprintf(path, sizeof(path), "items[%d].name", i);
+    ASSERT(json_find_matches(io.buf, io.len, path));
+    snprintf(path, sizeof(path), "items[%d].tags[1]", i);
+    ASSERT(json_find_matches(io.buf, io.len, path));
+    snprintf(path, sizeof(path), "items[%d].tags", i);
+    ASSERT(json_find_matches(io.buf, io.len, path));
+    snprintf(path, sizeof(path), "items[%d]", i);
+    ASSERT(json_find_matches(io.buf, io.len, path));
+  }
+  ASSERT(json_find_matches(io.buf, io.len, "total"));
+  ASSERT(json_find_matches(io.buf, io.len, "items[99].tags[2]"));
+  ASSERT(json_find_matches(io.buf, io.len, "items[100]"));
+  ASSERT(json_find_matches(io.buf, io.len, "items[1].nope"));
+  ASSERT(json_find_matches(io.buf, io.len, "nope"));
+  ASSERT_EQ(ns_json_find(io.buf, io.len, "", &v), JSON_TYPE_OBJECT);
+  ASSERT_EQ(v.len, io.len);
+
+  /* Whitespace, escaped quotes and brackets in strings */
+  ASSERT_EQ(ns_json_find(s, strlen(s), "a[1].b\\\"", &v), JSON_TYPE_STRING);
+  ASSERT_EQ(v.len, 5);
+  ASSERT(memcmp(v.p, "x]}\\\\", 5) == 0);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "a[2]", &v), JSON_TYPE_ARRAY);
+  ASSERT_EQ(v.len, 3);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "a[0]", &v), JSON_TYPE_NUMBER);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "d", &v), JSON_TYPE_TRUE);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "c", &v), JSON_TYPE_OBJECT);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "c.x", &v), JSON_TYPE_EOF);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "a[2][0]", &v), JSON_TYPE_EOF);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "a.b", &v), JSON_TYPE_EOF);
+  ASSERT_EQ(ns_json_find(s, strlen(s), "d[0]", &v), JSON_TYPE_EOF);
+
+  /* Truncated documents */
+  for (i = 0; i < (int) strlen(s) - 1; i++) {
+    ASSERT_EQ(ns_json_find(s, i, "d", &v), JSON_TYPE_EOF);
+  }
+  ASSERT_EQ(ns_json_find(io.buf, io.len - 5, "total", &v), JSON_TYPE_EOF);
+
+  mbuf_free(&io);
+  return NULL;
+}
+
+static void json_send_server(struct ns_connection *nc, int ev, void *ev_data) {
+  struct websocket_message *wm = (struct websocket_message *) ev_data;
+  struct ns_json_writer w;
+  size_t off = nc->send_mbuf.len;
+
+  ns_json_init(&w, &nc->send_mbuf);
+  if (ev == NS_HTTP_REQUEST) {
+    ns_json_begin_object(&w);
+    ns_json_key(&w, "ok");
+    ns_json_bool(&w, 1);
+    ns_json_end_object(&w);
+    ns_send_http_response_at(nc, off, 201,
+                             "Content-Type: application/json\r\n");
+  } else if (ev == NS_WEBSOCKET_FRAME) {
+    /* Echo the frame back as a JSON string */
+    ns_json_string(&w, (const char *) wm->data, wm->size);
+    ns_send_websocket_frame_at(nc, WEBSOCKET_OP_TEXT, off);
+  }
+}
+
+static void json_send_client(struct ns_connection *nc, int ev, void *ev_data) {
+  struct http_message *hm = (struct http_message *) ev_data;
+  struct websocket_message *wm = (struct websocket_message *) ev_data;
+  struct ns_json_writer w;
+  char *buf = (char *) nc->user_data;
+  size_t off;
+
+  if (ev == NS_HTTP_REPLY) {
+    snprintf(buf, 100, "%d %.*s %.*s", hm->resp_code, (int) hm->body.len,
+             hm->body.p, (int) ns_get_http_header(hm, "Content-Type")->len,
+             ns_get_http_header(hm, "Content-Type")->p);
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (ev == NS_WEBSOCKET_HANDSHAKE_DONE) {
+    /* Masked client frame, written in place */
+    off = nc->send_mbuf.len;
+    ns_json_init(&w, &nc->send_mbuf);
+    ns_json_begin_array(&w);
+    ns_json_int(&w, 42);
+    ns_json_end_array(&w);
+    ns_send_websocket_frame_at(nc, WEBSOCKET_OP_TEXT, off);
+  } else if (ev == NS_WEBSOCKET_FRAME) {
+    snprintf(buf, 100, "%.*s", (int) wm->size, wm->data);
+  }
+}
+
+static const char *test_json_send(void) {
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  const char *local_addr = "127.0.0.1:7793";
+  char buf1[100] = "", buf2[100] = "";
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, local_addr, json_send_server)) != NULL);
+  ns_set_protocol_http_websocket(nc);
+
+  ASSERT((nc = ns_connect_http(&mgr, json_send_client,
+                               "http://127.0.0.1:7793/", NULL, NULL)) != NULL);
+  nc->user_data = buf1;
+
+  ASSERT((nc = ns_connect(&mgr, local_addr, json_send_client)) != NULL);
+  ns_set_protocol_http_websocket(nc);
+  nc->user_data = buf2;
+  ns_send_websocket_handshake(nc, "/ws", NULL);
+
+  poll_until(&mgr, 1000, c_str_ne, buf2, (void *) "");
+  poll_until(&mgr, 1000, c_str_ne, buf1, (void *) "");
+  ns_mgr_free(&mgr);
+
+  ASSERT_STREQ(buf1, "201 {\"ok\":true} application/json");
+  ASSERT_STREQ(buf2, "\"[42]\"");
+
+  return NULL;
+}
+
 static int rpc_sum(char *buf, int len, struct ns_rpc_request *req) {
   double sum = 0;
   int i;
@@ -1906,6 +3530,331 @@ static const char *test_rpc(void) {
   return NULL;
 }
 
+static int rpc_sum_mbuf(struct mbuf *out, struct ns_rpc_request *req,
+                        void *user_data) {
+  double sum = 0;
+  int i;
+
+  (void) user_data;
+  if (req->params == NULL || req->params[0].type != JSON_TYPE_ARRAY) {
+    return ns_rpc_append_std_error(out, req, JSON_RPC_INVALID_PARAMS_ERROR);
+  }
+  for (i = 0; i < req->params[0].num_desc; i++) {
+    sum += strtod(req->params[i + 1].ptr, NULL);
+  }
+  return ns_rpc_append_reply(out, req, "f", sum);
+}
+
+static int rpc_echo_mbuf(struct mbuf *out, struct ns_rpc_request *req,
+                         void *user_data) {
+  (*(int *) user_data)++;
+  return ns_rpc_append_reply(out, req, "v", req->params->ptr,
+                             (size_t) req->params->len);
+}
+
+static int rpc_list_mbuf(struct mbuf *out, struct ns_rpc_request *req,
+                         void *user_data) {
+  struct ns_json_writer w;
+  (void) user_data;
+  ns_json_init(&w, out);
+  ns_rpc_begin_reply(&w, req);
+  ns_json_begin_array(&w);
+  ns_json_string(&w, "a", 1);
+  ns_json_int(&w, 2);
+  ns_json_end_array(&w);
+  ns_json_end_object(&w);
+  return w.error ? -1 : 0;
+}
+
+static int rpc_dispatch_str(struct ns_rpc_methods *methods, const char *s,
+                            struct mbuf *out) {
+  return ns_rpc_dispatch_mbuf(methods, s, strlen(s), out);
+}
+
+static const char *test_rpc_dispatch_mbuf(void) {
+  struct ns_rpc_methods methods;
+  struct mbuf out;
+  char name[20], big[3000];
+  int i, calls = 0;
+  const char *batch =
+      "[{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"sum\",\"params\":[1,2]},"
+      "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[3]},"
+      "{\"jsonrpc\":\"2.0\",\"id\":\"a\\\"b\",\"method\":\"nope\"}, 5]";
+
+  ns_rpc_methods_init(&methods);
+  mbuf_init(&out, 0);
+
+  /* No methods yet */
+  ASSERT(rpc_dispatch_str(&methods, "{\"id\":1,\"method\":\"sum\"}", &out) >
+         0);
+  ASSERT(strstr(out.buf, "-32601") != NULL);
+  out.len = 0;
+
+  /* Grow the table past its initial size */
+  for (i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "m%d", i);
+    ASSERT_EQ(ns_rpc_add_method(&methods, strdup(name), rpc_sum_mbuf, NULL),
+              0);
+  }
+  ASSERT_EQ(ns_rpc_add_method(&methods, "sum", rpc_sum_mbuf, NULL), 0);
+  ASSERT_EQ(ns_rpc_add_method(&methods, "echo", rpc_echo_mbuf, &calls), 0);
+  ASSERT_EQ(ns_rpc_add_method(&methods, "echo", rpc_echo_mbuf, &calls), 0);
+  ASSERT_EQ(methods.num_methods, 42);
+  ASSERT_EQ(methods.size, 128);
+
+  /* Single request */
+  ASSERT_EQ(rpc_dispatch_str(&methods,
+                             "{\"id\":7,\"method\":\"m39\",\"params\":[20,22]}",
+                             &out),
+            (int) out.len);
+  mbuf_append(&out, "", 1);
+  ASSERT_STREQ(out.buf, "{\"jsonrpc\":\"2.0\",\"id\":7,\"result\":42}");
+  out.len = 0;
+
+  /* Reply written with a JSON writer */
+  ASSERT_EQ(ns_rpc_add_method(&methods, "list", rpc_list_mbuf, NULL), 0);
+  ASSERT(rpc_dispatch_str(&methods, "{\"id\":\"x\",\"method\":\"list\"}",
+                          &out) > 0);
+  mbuf_append(&out, "", 1);
+  ASSERT_STREQ(out.buf,
+               "{\"jsonrpc\":\"2.0\",\"id\":\"x\",\"result\":[\"a\",2]}");
+  out.len = 0;
+
+  /* Batch: notification gets no reply, string IDs are kept as is */
+  ASSERT(rpc_dispatch_str(&methods, batch, &out) > 0);
+  mbuf_append(&out, "", 1);
+  ASSERT_STREQ(out.buf,
+               "[{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3},"
+               "{\"jsonrpc\":\"2.0\",\"id\":\"a\\\"b\",\"error\":{\"code\":"
+               "-32601,\"message\":\"method not found\",\"data\":null}},"
+               "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32600,"
+               "\"message\":\"invalid request\",\"data\":null}}]");
+  ASSERT_EQ(calls, 1);
+  out.len = 0;
+
+  /* Batch of notifications */
+  ASSERT_EQ(rpc_dispatch_str(&methods,
+                             "[{\"method\":\"echo\",\"params\":1}, "
+                             "{\"method\":\"nope\"} ]",
+                             &out),
+            0);
+  ASSERT_EQ(out.len, 0);
+  ASSERT_EQ(calls, 2);
+
+  /* Errors */
+  ASSERT(rpc_dispatch_str(&methods, " [ ]", &out) > 0);
+  ASSERT(strstr(out.buf, "-32600") != NULL);
+  out.len = 0;
+  ASSERT(rpc_dispatch_str(&methods, "{\"id\":1", &out) > 0);
+  ASSERT(strstr(out.buf, "-32700") != NULL);
+  out.len = 0;
+  ASSERT(rpc_dispatch_str(&methods, " \n{bad", &out) > 0);
+  ASSERT(strstr(out.buf, "-32700") != NULL);
+  out.len = 0;
+  ASSERT(ns_rpc_dispatch_mbuf(&methods, "", 0, &out) > 0);
+  ASSERT(strstr(out.buf, "-32700") != NULL);
+  out.len = 0;
+  ASSERT(rpc_dispatch_str(&methods, " ", &out) > 0);
+  ASSERT(strstr(out.buf, "-32700") != NULL);
+  out.len = 0;
+  ASSERT(rpc_dispatch_str(&methods, "[{\"id\":1,\"method\":\"sum\"}", &out) > 0);
+  ASSERT(strstr(out.buf, "-32700") != NULL);
+  ASSERT(out.buf[0] == '{');
+  out.len = 0;
+
+  /* Large results are not truncated */
+  memset(big, 'x', sizeof(big));
+  memcpy(big, "{\"id\":1,\"method\":\"echo\",\"params\":\"", 34);
+  memcpy(big + sizeof(big) - 2, "\"}", 2);
+  ASSERT_EQ(ns_rpc_dispatch_mbuf(&methods, big, sizeof(big), &out),
+            (int) sizeof(big) - 34 - 2 + 2 +
+                (int) strlen("{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":}"));
+
+  for (i = 0; i < methods.size; i++) {
+    if (methods.table[i].name != NULL && methods.table[i].name[0] == 'm') {
+      free((void *) methods.table[i].name);
+    }
+  }
+  ns_rpc_methods_free(&methods);
+  ASSERT(methods.table == NULL);
+  mbuf_free(&out);
+  return NULL;
+}
+
+struct rpc_chan_data {
+  struct ns_rpc_methods methods;
+  struct ns_rpc_channel client;
+  struct ns_rpc_deferred *deferred[3];
+  int num_deferred;
+  int flags;
+  int num_sums, total, later, failed;
+};
+
+static int rpc_chan_sum(struct mbuf *out, struct ns_rpc_request *req,
+                        void *user_data) {
+  long a = strtol(req->params[1].ptr, NULL, 10);
+  long b = strtol(req->params[2].ptr, NULL, 10);
+  (void) user_data;
+  return ns_rpc_append_reply(out, req, "i", a + b);
+}
+
+static int rpc_chan_defer(struct mbuf *out, struct ns_rpc_request *req,
+                          void *user_data) {
+  struct rpc_chan_data *d = (struct rpc_chan_data *) user_data;
+  (void) out;
+  d->deferred[d->num_deferred++] = ns_rpc_defer(req);
+  return 0;
+}
+
+static void rpc_chan_sum_cb(struct ns_rpc_channel *ch, void *cb_data,
+                            struct ns_rpc_reply *reply,
+                            struct ns_rpc_error *error) {
+  struct rpc_chan_data *d = (struct rpc_chan_data *) ch->user_data;
+  (void) cb_data;
+  if (reply != NULL && error == NULL) {
+    d->num_sums++;
+    d->total += strtol(reply->result->ptr, NULL, 10);
+  }
+}
+
+static void rpc_chan_later_cb(struct ns_rpc_channel *ch, void *cb_data,
+                              struct ns_rpc_reply *reply,
+                              struct ns_rpc_error *error) {
+  struct rpc_chan_data *d = (struct rpc_chan_data *) ch->user_data;
+  (void) cb_data;
+  /* Must come after the replies to the calls made after it */
+  if (reply != NULL && d->num_sums == 20 && reply->result->len == 4 &&
+      memcmp(reply->result->ptr, "done", 4) == 0) {
+    d->later = 1;
+  } else if (error != NULL && error->error_code != NULL &&
+             strncmp(error->error_code->ptr, "-32601", 6) == 0) {
+    d->later = 2;
+  }
+}
+
+static void rpc_chan_fail_cb(struct ns_rpc_channel *ch, void *cb_data,
+                             struct ns_rpc_reply *reply,
+                             struct ns_rpc_error *error) {
+  (void) ch;
+  if (reply == NULL && error == NULL) {
+    (*(int *) cb_data)++;
+  }
+}
+
+static void rpc_chan_server(struct ns_connection *nc, int ev, void *ev_data) {
+  struct rpc_chan_data *d;
+  struct ns_rpc_channel *ch;
+
+  if (nc->listener == NULL) return;
+  if (ev == NS_ACCEPT) {
+    d = (struct rpc_chan_data *) nc->user_data;
+    ch = (struct ns_rpc_channel *) calloc(1, sizeof(*ch));
+    ns_rpc_channel_init(ch, nc, &d->methods, d->flags);
+    nc->user_data = ch;
+  }
+  ch = (struct ns_rpc_channel *) nc->user_data;
+  ns_rpc_channel_handler(ch, ev, ev_data);
+  if (ev == NS_CLOSE) free(ch);
+}
+
+static void rpc_chan_client(struct ns_connection *nc, int ev, void *ev_data) {
+  struct ns_rpc_channel *ch = (struct ns_rpc_channel *) nc->user_data;
+  int i;
+
+  if ((ev == NS_CONNECT && (ch->flags & NS_RPC_CHANNEL_TCP)) ||
+      ev == NS_WEBSOCKET_HANDSHAKE_DONE) {
+    /* Deferred call first, all calls pipelined without waiting */
+    ns_rpc_call(ch, "later", rpc_chan_later_cb, NULL, "[]");
+    for (i = 0; i < 20; i++) {
+      ns_rpc_call(ch, "sum", rpc_chan_sum_cb, NULL, "[i,i]", (long) i,
+                  (long) i);
+    }
+  }
+  ns_rpc_channel_handler(ch, ev, ev_data);
+}
+
+static int rpc_chan_done(void *a, void *b) {
+  struct rpc_chan_data *d = (struct rpc_chan_data *) a;
+  (void) b;
+  return d->num_sums == 20 && d->num_deferred == 1;
+}
+
+static const char *run_rpc_channel(int flags) {
+  struct ns_mgr mgr;
+  struct ns_connection *nc;
+  struct rpc_chan_data d;
+  const char *addr = "127.0.0.1:7792";
+  int timeouts = 0, closed = 0;
+
+  memset(&d, 0, sizeof(d));
+  d.flags = flags;
+  ns_rpc_methods_init(&d.methods);
+  ns_rpc_add_method(&d.methods, "sum", rpc_chan_sum, &d);
+  ns_rpc_add_method(&d.methods, "later", rpc_chan_defer, &d);
+  ns_rpc_add_method(&d.methods, "never", rpc_chan_defer, &d);
+
+  ns_mgr_init(&mgr, NULL);
+  ASSERT((nc = ns_bind(&mgr, addr, rpc_chan_server)) != NULL);
+  nc->user_data = &d;
+  if (!(flags & NS_RPC_CHANNEL_TCP)) ns_set_protocol_http_websocket(nc);
+
+  ASSERT((nc = ns_connect(&mgr, addr, rpc_chan_client)) != NULL);
+  ns_rpc_channel_init(&d.client, nc, NULL, flags);
+  d.client.user_data = &d;
+  nc->user_data = &d.client;
+  if (!(flags & NS_RPC_CHANNEL_TCP)) {
+    ns_set_protocol_http_websocket(nc);
+    ns_send_websocket_handshake(nc, "/rpc", NULL);
+  }
+
+  poll_until(&mgr, 1000, rpc_chan_done, &d, NULL);
+  ASSERT_EQ(d.num_sums, 20);
+  ASSERT_EQ(d.total, 380);
+  ASSERT_EQ(d.num_deferred, 1);
+  ASSERT_EQ(d.client.num_pending, 1);
+
+  /* Deferred reply overtaken by the replies to later calls */
+  ASSERT(d.deferred[0] != NULL);
+  ASSERT_EQ(ns_rpc_deferred_reply(d.deferred[0], "s", "done"), 0);
+  poll_until(&mgr, 1000, c_int_eq, &d.later, (void *) 1);
+  ASSERT_EQ(d.later, 1);
+  ASSERT_EQ(d.client.num_pending, 0);
+
+  /* Unknown method, and a call that never gets a reply */
+  d.client.timeout = 10;
+  ASSERT(ns_rpc_call(&d.client, "never", rpc_chan_fail_cb, &closed, "[]") >
+         0);
+  /* A lowered timeout isn't held up by calls made before */
+  d.client.timeout = 1;
+  ASSERT(ns_rpc_call(&d.client, "nope", rpc_chan_later_cb, NULL, "[]") > 0);
+  ASSERT(ns_rpc_call(&d.client, "never", rpc_chan_fail_cb, &timeouts, "[]") >
+         0);
+  poll_until(&mgr, 3500, c_int_eq, &timeouts, (void *) 1);
+  ASSERT_EQ(timeouts, 1);
+  ASSERT_EQ(closed, 0);
+  ASSERT_EQ(d.later, 2);
+  ASSERT_EQ(d.num_deferred, 3);
+
+  /* Outstanding calls fail when the connection closes */
+  ns_mgr_free(&mgr);
+  ASSERT_EQ(closed, 1);
+  ASSERT(d.client.nc == NULL);
+
+  /* Handles outlive the channel */
+  ASSERT_EQ(ns_rpc_deferred_error(d.deferred[1], JSON_RPC_SERVER_ERROR, NULL),
+            -1);
+  ASSERT_EQ(ns_rpc_deferred_reply(d.deferred[2], "N"), -1);
+
+  ns_rpc_methods_free(&d.methods);
+  return NULL;
+}
+
+static const char *test_rpc_channel(void) {
+  const char *msg;
+  if ((msg = run_rpc_channel(NS_RPC_CHANNEL_TCP)) != NULL) return msg;
+  return run_rpc_channel(0);
+}
+
 static void cb5(struct ns_connection *nc, int ev, void *ev_data) {
   switch (ev) {
     case NS_CONNECT:
@@ -2117,6 +4066,7 @@ static const char *test_hexdump_file(void) {
 
 static const char *test_http_chunk(void) {
   struct ns_connection nc;
+  char big[300];
 
   memset(&nc, 0, sizeof(nc));
 
@@ -2125,6 +4075,16 @@ static const char *test_http_chunk(void) {
   ASSERT_EQ(memcmp(nc.send_mbuf.buf, "7\r\n123 :-)\r\n", 12), 0);
   mbuf_free(&nc.send_mbuf);
 
+  /* Chunk formatted in place after pending data */
+  mbuf_append(&nc.send_mbuf, "ab", 2);
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  ns_printf_http_chunk(&nc, "%s", big);
+  ASSERT_EQ(nc.send_mbuf.len, 2 + 5 + 299 + 2);
+  ASSERT_EQ(memcmp(nc.send_mbuf.buf, "ab12B\r\nxxx", 10), 0);
+  ASSERT_EQ(memcmp(nc.send_mbuf.buf + nc.send_mbuf.len - 3, "x\r\n", 3), 0);
+  mbuf_free(&nc.send_mbuf);
+
   ns_send_http_chunk(&nc, "", 0);
   ASSERT_EQ(nc.send_mbuf.len, 5);
   ASSERT_EQ(memcmp(nc.send_mbuf.buf, "0\r\n\r\n", 3), 0);
@@ -2466,6 +4426,129 @@ static const char *test_dns_decode_truncated(void) {
   return NULL;
 }
 
+static const char *test_dns_iter(void) {
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+  struct in_addr ina;
+  char cname[256];
+  int num_questions = 0, num_answers = 0;
+
+  /* Same `go.cesanta.com` response as in test_dns_decode */
+  const unsigned char pkt[] = {
+      0xa1, 0x00, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+      0x02, 0x67, 0x6f, 0x07, 0x63, 0x65, 0x73, 0x61, 0x6e, 0x74, 0x61, 0x03,
+      0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x05,
+      0x00, 0x01, 0x00, 0x00, 0x09, 0x52, 0x00, 0x13, 0x03, 0x67, 0x68, 0x73,
+      0x0c, 0x67, 0x6f, 0x6f, 0x67, 0x6c, 0x65, 0x68, 0x6f, 0x73, 0x74, 0x65,
+      0x64, 0xc0, 0x17, 0xc0, 0x2c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01,
+      0x2b, 0x00, 0x04, 0x4a, 0x7d, 0x88, 0x79};
+
+  ASSERT_EQ(ns_dns_iter_init(&it, (const char *) pkt, 11), -1);
+  ASSERT_EQ(ns_dns_iter_init(&it, (const char *) pkt, sizeof(pkt)), 0);
+  ASSERT_EQ(it.num_questions, 1);
+  ASSERT_EQ(it.num_answers, 2);
+  ASSERT_EQ(it.flags, 0x8180);
+
+  while (ns_dns_iter_next(&it, &rr) > 0) {
+    if (rr.kind == NS_DNS_QUESTION) {
+      num_questions++;
+      ASSERT_EQ(rr.rtype, NS_DNS_A_RECORD);
+      ASSERT_EQ(ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta.com"), 0);
+      ASSERT_EQ(ns_dns_name_cmp(&it.pkt, &rr.name, "GO.Cesanta.COM."), 0);
+      ASSERT(ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta.co") != 0);
+      ASSERT(ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta.comm") != 0);
+      ASSERT(ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta") != 0);
+      ASSERT(ns_dns_name_cmp(&it.pkt, &rr.name, "") != 0);
+    } else if (rr.rtype == NS_DNS_CNAME_RECORD) {
+      num_answers++;
+      /* Compressed name: a single pointer to the question */
+      ASSERT_EQ(rr.name.len, 2);
+      ASSERT_EQ(ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta.com"), 0);
+      ASSERT_EQ(ns_dns_name_cmp(&it.pkt, &rr.rdata, "ghs.googlehosted.com"),
+                0);
+      ASSERT_EQ(ns_dns_iter_record_data(&it, &rr, cname, sizeof(cname)), 0);
+      ASSERT_STREQ(cname, "ghs.googlehosted.com");
+    } else {
+      num_answers++;
+      ASSERT_EQ(rr.rtype, NS_DNS_A_RECORD);
+      ASSERT_EQ(rr.ttl, 299);
+      ASSERT_EQ(ns_dns_name_cmp(&it.pkt, &rr.name, "ghs.googlehosted.com"), 0);
+      ASSERT_EQ(ns_dns_iter_record_data(&it, &rr, &ina, sizeof(ina)), 0);
+      ASSERT_EQ(ina.s_addr, inet_addr("74.125.136.121"));
+    }
+  }
+  ASSERT_EQ(num_questions, 1);
+  ASSERT_EQ(num_answers, 2);
+  ASSERT_EQ(ns_dns_iter_next(&it, &rr), 0);
+
+  return NULL;
+}
+
+static const char *test_dns_iter_fuzz(void) {
+  const unsigned char src[] = {
+      0xa1, 0x00, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+      0x02, 0x67, 0x6f, 0x07, 0x63, 0x65, 0x73, 0x61, 0x6e, 0x74, 0x61, 0x03,
+      0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x05,
+      0x00, 0x01, 0x00, 0x00, 0x09, 0x52, 0x00, 0x13, 0x03, 0x67, 0x68, 0x73,
+      0x0c, 0x67, 0x6f, 0x6f, 0x67, 0x6c, 0x65, 0x68, 0x6f, 0x73, 0x74, 0x65,
+      0x64, 0xc0, 0x17, 0xc0, 0x2c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01,
+      0x2b, 0x00, 0x04, 0x4a, 0x7d, 0x88, 0x79};
+  /* A name pointing to itself */
+  const unsigned char loop[] = {0x00, 0x01, 0x81, 0x80, 0x00, 0x01, 0x00, 0x00,
+                                0x00, 0x00, 0x00, 0x00, 0xc0, 0x0c, 0x00, 0x01,
+                                0x00, 0x01};
+  struct ns_dns_iterator it;
+  struct ns_dns_resource_record rr;
+  struct ns_dns_message msg;
+  unsigned char pkt[sizeof(src)];
+  char name[256];
+  unsigned int seed = 1;
+  int i, j, len, res, num_records;
+
+  ASSERT_EQ(ns_dns_iter_init(&it, (const char *) loop, sizeof(loop)), 0);
+  ASSERT_EQ(ns_dns_iter_next(&it, &rr), 1);
+  ASSERT(ns_dns_name_cmp(&it.pkt, &rr.name, "www.cesanta.com") < 0);
+  ASSERT_EQ(ns_dns_iter_record_data(&it, &rr, name, sizeof(name)), -1);
+
+  for (i = 0; i < 20000; i++) {
+    memcpy(pkt, src, sizeof(pkt));
+    len = sizeof(pkt);
+    if (i < (int) sizeof(pkt)) {
+      /* Every possible truncation point first */
+      len = i;
+    } else {
+      /* Then a few random byte flips at a time */
+      for (j = 0; j < 1 + i % 4; j++) {
+        seed = seed * 1103515245 + 12345;
+        pkt[(seed >> 8) % sizeof(pkt)] = (unsigned char) (seed >> 16);
+      }
+    }
+
+    if (ns_dns_iter_init(&it, (const char *) pkt, len) != 0) {
+      ASSERT(len < 12);
+      continue;
+    }
+    num_records = 0;
+    while ((res = ns_dns_iter_next(&it, &rr)) > 0) {
+      num_records++;
+      ASSERT(rr.name.p >= (const char *) pkt);
+      ASSERT(rr.name.p + rr.name.len <= (const char *) pkt + len);
+      if (rr.kind == NS_DNS_ANSWER) {
+        ASSERT(rr.rdata.p + rr.rdata.len <= (const char *) pkt + len);
+      }
+      ns_dns_name_cmp(&it.pkt, &rr.name, "go.cesanta.com");
+      ns_dns_name_cmp(&it.pkt, &rr.rdata, "ghs.googlehosted.com");
+      ns_dns_iter_record_data(&it, &rr, name, sizeof(name));
+    }
+    ASSERT(num_records <= it.num_questions + it.num_answers);
+
+    ASSERT_EQ(ns_parse_dns((const char *) pkt, len, &msg), 0);
+    ASSERT(msg.num_questions + msg.num_answers <= num_records);
+  }
+
+  return NULL;
+}
+
 static const char *check_www_cesanta_com_reply(const char *pkt, size_t len) {
   char name[256];
 
@@ -2553,6 +4636,74 @@ static const char *test_dns_reply_encode(void) {
   return NULL;
 }
 
+#ifdef NS_ENABLE_DNS_SERVER
+static const char *test_dns_reply_compress(void) {
+  const char *err;
+  struct ns_dns_message msg;
+  struct ns_dns_reply reply;
+  struct ns_dns_resource_record *rr;
+  struct ns_connection nc;
+  struct mbuf pkt;
+  in_addr_t addr = inet_addr("54.194.65.250");
+  const char *p;
+  int i;
+
+  mbuf_init(&pkt, 0);
+  memset(&nc, 0, sizeof(nc));
+
+  ns_send_dns_query(&nc, "www.cesanta.com", NS_DNS_A_RECORD);
+  ns_parse_dns(nc.send_mbuf.buf + 2, nc.send_mbuf.len - 2, &msg);
+  rr = &msg.questions[0];
+
+  reply = ns_dns_create_reply(&pkt, &msg);
+  ASSERT_EQ(ns_dns_reply_record(&reply, rr, NULL, NS_DNS_CNAME_RECORD, 3600,
+                                "cesanta.com", 11),
+            0);
+  ASSERT_EQ(ns_dns_reply_record(&reply, rr, "cesanta.com", NS_DNS_A_RECORD,
+                                3600, &addr, 4),
+            0);
+  ns_dns_update_header(&pkt, 0, &msg);
+
+  /* Header: 12, question: 17 + 4, CNAME: 2 + 10 + 2, A: 2 + 10 + 4 */
+  ASSERT_EQ(pkt.len, 33 + 14 + 16);
+  p = pkt.buf + 33;
+  /* Answer name points to the question */
+  ASSERT_EQ((unsigned char) p[0], 0xc0);
+  ASSERT_EQ(p[1], 12);
+  /* CNAME data points to the "cesanta.com" suffix of the question */
+  ASSERT_EQ(p[10], 0);
+  ASSERT_EQ(p[11], 2);
+  ASSERT_EQ((unsigned char) p[12], 0xc0);
+  ASSERT_EQ(p[13], 16);
+  /* A record name points to the same suffix */
+  ASSERT_EQ((unsigned char) p[14], 0xc0);
+  ASSERT_EQ(p[15], 16);
+
+  if ((err = check_www_cesanta_com_reply(pkt.buf, pkt.len)) != NULL) {
+    return err;
+  }
+  mbuf_free(&pkt);
+
+  /* New names are remembered too, and matched case-insensitively */
+  reply = ns_dns_create_reply(&pkt, &msg);
+  for (i = 0; i < 3; i++) {
+    ASSERT_EQ(ns_dns_reply_record(&reply, rr, i == 1 ? "x.Example.org."
+                                                     : "x.example.org",
+                                  NS_DNS_A_RECORD, 3600, &addr, 4),
+              0);
+  }
+  ASSERT_EQ(pkt.len, 33 + (15 + 10 + 4) + 2 * (2 + 10 + 4));
+  ASSERT_EQ(ns_dns_reply_record(&reply, rr, "bad..name", NS_DNS_A_RECORD,
+                                3600, &addr, 4),
+            -1);
+  ASSERT_EQ(msg.num_answers, 3);
+  mbuf_free(&pkt);
+
+  mbuf_free(&nc.send_mbuf);
+  return NULL;
+}
+#endif
+
 #ifdef NS_ENABLE_DNS_SERVER
 static void dns_server_eh(struct ns_connection *nc, int ev, void *ev_data) {
   struct ns_dns_message *msg;
@@ -2670,6 +4821,145 @@ static const char *test_dns_server(void) {
   mbuf_free(&nc.send_mbuf);
   return NULL;
 }
+
+struct mdns_test_data {
+  int ready, conflicts, records, recv;
+};
+
+static void mdns_test_handler(struct ns_connection *nc, int ev, void *ev_data) {
+  struct ns_mdns *mdns = (struct ns_mdns *) nc->user_data;
+  struct mdns_test_data *d;
+
+  (void) ev_data;
+  if (mdns == NULL) return;
+  d = (struct mdns_test_data *) mdns->user_data;
+  switch (ev) {
+    case NS_RECV:
+      d->recv++;
+      break;
+    case NS_MDNS_READY:
+      d->ready++;
+      break;
+    case NS_MDNS_CONFLICT:
+      d->conflicts++;
+      mdns->host = "c.local";
+      break;
+    case NS_MDNS_RECORD:
+      d->records++;
+      break;
+  }
+}
+
+static void poll_mdns(struct ns_mgr *mgr, int *flag, int secs) {
+  time_t deadline = time(NULL) + secs;
+  while (!*flag && time(NULL) < deadline) {
+    ns_mgr_poll(mgr, 100);
+  }
+}
+
+static const char *test_mdns(void) {
+  const char *addr = "udp://127.0.0.1:15353";
+  struct ns_mgr mgr;
+  struct ns_mdns a, b, c;
+  struct mdns_test_data da, db, dc;
+  struct ns_mdns_service svc;
+  struct ns_mdns_record *r;
+  int i;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  memset(&c, 0, sizeof(c));
+  memset(&da, 0, sizeof(da));
+  memset(&db, 0, sizeof(db));
+  memset(&dc, 0, sizeof(dc));
+  svc.instance = "Kitchen";
+  svc.type = "_http._tcp.local";
+  svc.port = 8000;
+  svc.txt = "\x06path=/";
+  svc.txt_len = 7;
+
+  ns_mgr_init(&mgr, NULL);
+  a.host = "a.local";
+  a.addr.s_addr = inet_addr("127.0.0.2");
+  a.services = &svc;
+  a.num_services = 1;
+  a.user_data = &da;
+  ASSERT(ns_mdns_bind(&mgr, addr, mdns_test_handler, &a) != NULL);
+  /* Without a host name, b only queries */
+  b.user_data = &db;
+  ASSERT(ns_mdns_bind(&mgr, addr, mdns_test_handler, &b) != NULL);
+  ASSERT(ns_mdns_bind(&mgr, "tcp://:15353", mdns_test_handler, &c) == NULL);
+
+  /* Probing and announcing */
+  poll_mdns(&mgr, &da.ready, 10);
+  for (i = 0; i < 5; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT_EQ(da.ready, 1);
+  ASSERT_EQ(da.conflicts, 0);
+  ASSERT_EQ(db.ready, 0);
+
+  /* b has cached the announcements */
+  ASSERT((r = ns_mdns_next_record(&b, "_http._tcp.local", NS_DNS_PTR_RECORD,
+                                  NULL)) != NULL);
+  ASSERT_STREQ(r->rdata, "Kitchen._http._tcp.local");
+  ASSERT(ns_mdns_next_record(&b, "_services._dns-sd._udp.local",
+                             NS_DNS_PTR_RECORD, NULL) != NULL);
+  ASSERT((r = ns_mdns_next_record(&b, "kitchen._http._tcp.local",
+                                  NS_DNS_SRV_RECORD, NULL)) != NULL);
+  ASSERT_EQ((((unsigned char) r->rdata[4] << 8) | (unsigned char) r->rdata[5]),
+            8000);
+  ASSERT_STREQ(r->rdata + 6, "a.local");
+  ASSERT((r = ns_mdns_next_record(&b, "Kitchen._http._tcp.local",
+                                  NS_DNS_TXT_RECORD, NULL)) != NULL);
+  ASSERT_EQ(r->rdata_len, 7);
+  ASSERT((r = ns_mdns_next_record(&b, "a.local", NS_DNS_A_RECORD, NULL)) !=
+         NULL);
+  ASSERT(memcmp(r->rdata, &a.addr, 4) == 0);
+  ASSERT_EQ(r->ttl, NS_MDNS_DEFAULT_TTL);
+  ASSERT(ns_mdns_next_record(&b, "a.local", NS_DNS_A_RECORD, r) == NULL);
+  ASSERT_EQ(db.records, 5);
+  /* a doesn't cache its own records */
+  ASSERT(ns_mdns_next_record(&a, NULL, NS_DNS_ANY_RECORD, NULL) == NULL);
+
+  /* Known answers are suppressed: b only gets its own query */
+  db.recv = 0;
+  ASSERT_EQ(ns_mdns_query(&b, "_http._tcp.local", NS_DNS_PTR_RECORD), 0);
+  for (i = 0; i < 5; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT_EQ(db.recv, 1);
+
+  /* Unknown ones are answered, along with SRV, TXT and A records */
+  memset(b.cache, 0, sizeof(b.cache));
+  db.recv = db.records = 0;
+  ASSERT_EQ(ns_mdns_query(&b, "_http._tcp.local", NS_DNS_PTR_RECORD), 0);
+  for (i = 0; i < 5; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT_EQ(db.recv, 2);
+  ASSERT_EQ(db.records, 4);
+
+  /* c wants a's name, gets told off and picks another one */
+  c.host = "a.local";
+  c.addr.s_addr = inet_addr("127.0.0.3");
+  c.user_data = &dc;
+  ASSERT(ns_mdns_bind(&mgr, addr, mdns_test_handler, &c) != NULL);
+  poll_mdns(&mgr, &dc.ready, 15);
+  for (i = 0; i < 5; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT_EQ(dc.ready, 1);
+  ASSERT_EQ(dc.conflicts, 1);
+  ASSERT_STREQ(c.host, "c.local");
+  ASSERT_EQ(da.conflicts, 0);
+  ASSERT((r = ns_mdns_next_record(&b, "c.local", NS_DNS_A_RECORD, NULL)) !=
+         NULL);
+  ASSERT(memcmp(r->rdata, &c.addr, 4) == 0);
+
+  /* c says goodbye when closed */
+  c.nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  for (i = 0; i < 5; i++) ns_mgr_poll(&mgr, 50);
+  ASSERT(c.nc == NULL);
+  ASSERT(ns_mdns_next_record(&b, "c.local", NS_DNS_A_RECORD, NULL) == NULL);
+  ASSERT(ns_mdns_next_record(&b, "a.local", NS_DNS_A_RECORD, NULL) != NULL);
+
+  ns_mgr_free(&mgr);
+  return NULL;
+}
+
 #endif /* NS_ENABLE_DNS_SERVER */
 
 static void dns_resolve_cb(struct ns_dns_message *msg, void *data) {
@@ -3172,10 +5462,31 @@ static const char *run_tests(const char *filter, double *total_elapsed) {
   RUN_TEST(test_mbuf);
   RUN_TEST(test_parse_address);
   RUN_TEST(test_check_ip_acl);
+  RUN_TEST(test_ip_acl);
+  RUN_TEST(test_rate_limit);
+  RUN_TEST(test_bandwidth);
+  RUN_TEST(test_recv_budget);
+#ifdef NS_ENABLE_SEND_FILE
+  RUN_TEST(test_send_file);
+#endif
+  RUN_TEST(test_tcp_opts);
+#ifdef TCP_FASTOPEN_CONNECT
+  RUN_TEST(test_tcp_fastopen);
+#endif
+#ifdef NS_ENABLE_SPLICE
+  RUN_TEST(test_splice);
+#endif
+#ifdef NS_ENABLE_ZEROCOPY
+  RUN_TEST(test_zerocopy);
+#endif
+#ifdef NS_ENABLE_UDP_GSO
+  RUN_TEST(test_udp_gso);
+#endif
   RUN_TEST(test_connect_opts);
   RUN_TEST(test_connect_opts_error_string);
   RUN_TEST(test_to64);
   RUN_TEST(test_alloc_vprintf);
+  RUN_TEST(test_mbuf_printf);
   RUN_TEST(test_socketpair);
 #ifndef __APPLE__
   RUN_TEST(test_simple);
@@ -3195,10 +5506,18 @@ static const char *run_tests(const char *filter, double *total_elapsed) {
   RUN_TEST(test_http_rewrites);
   RUN_TEST(test_http_dav);
   RUN_TEST(test_http_range);
+#ifdef NS_ENABLE_THREADS
+  RUN_TEST(test_http_file_io);
+#endif
   RUN_TEST(test_http_multipart);
   RUN_TEST(test_websocket);
   RUN_TEST(test_websocket_big);
+  RUN_TEST(test_json_writer);
+  RUN_TEST(test_json_find);
+  RUN_TEST(test_json_send);
   RUN_TEST(test_rpc);
+  RUN_TEST(test_rpc_dispatch_mbuf);
+  RUN_TEST(test_rpc_channel);
   RUN_TEST(test_http_chunk);
   RUN_TEST(test_http_chunk2);
   RUN_TEST(test_mqtt_handshake);
@@ -3217,9 +5536,15 @@ static const char *run_tests(const char *filter, double *total_elapsed) {
   RUN_TEST(test_dns_uncompress);
   RUN_TEST(test_dns_decode);
   RUN_TEST(test_dns_decode_truncated);
+  RUN_TEST(test_dns_iter);
+  RUN_TEST(test_dns_iter_fuzz);
   RUN_TEST(test_dns_reply_encode);
+#ifdef NS_ENABLE_DNS_SERVER
+  RUN_TEST(test_dns_reply_compress);
+#endif
 #ifdef NS_ENABLE_DNS_SERVER
   RUN_TEST(test_dns_server);
+  RUN_TEST(test_mdns);
 #endif
   RUN_TEST(test_dns_resolve);
   RUN_TEST(test_dns_resolve_timeout);
@@ -3236,11 +5561,27 @@ static const char *run_tests(const char *filter, double *total_elapsed) {
   RUN_TEST(test_hexdump_file);
 #ifdef NS_ENABLE_SSL
   RUN_TEST(test_ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  RUN_TEST(test_ssl_client_cache);
+#ifdef NS_ENABLE_THREADS
+  RUN_TEST(test_ssl_offload);
+#endif
+  RUN_TEST(test_ssl_record_size);
+#endif
 #ifndef _KRYPTON_H
   RUN_TEST(test_modern_crypto);
 #endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  RUN_TEST(test_ssl_server_opts);
+#endif
 #endif
   RUN_TEST(test_udp);
+#ifdef NS_ENABLE_UNIX_SOCKETS
+  RUN_TEST(test_unix_sockets);
+#endif
+#if defined(NS_ENABLE_UNIX_SOCKETS) && defined(NS_ENABLE_THREADS)
+  RUN_TEST(test_hot_restart);
+#endif
 #ifdef NS_ENABLE_COAP
   RUN_TEST(test_coap);
 #endif